@@ -0,0 +1,250 @@
+// HashMap get/put throughput benchmark
+//
+// Preloads --keys entries, then runs threads that each pick random keys and
+// either look them up or overwrite them (--writes percent) for a fixed
+// duration, once per thread count. Every run is repeated against a copy of
+// the previous single-lock, fixed 1024-bucket table for comparison.
+//
+// Usage: hashmap_bench [--threads 1,2,4,8] [--keys N] [--seconds S]
+//                      [--writes PCT]
+
+#include "../include/hashmap.h"
+#include <sys/time.h>
+
+#define BENCH_MAX_THREADS 256
+#define BASELINE_BUCKETS 1024
+
+static int bench_keys = 200000;
+static int bench_seconds = 2;
+static int bench_writes = 10;
+
+static volatile int bench_stop = 0;
+static char (*key_names)[32];
+
+// The table this replaced: one rwlock, fixed buckets, keys in fixed arrays
+typedef struct BaselineNode {
+    char key[MAX_FILENAME];
+    void* value;
+    struct BaselineNode* next;
+} BaselineNode;
+
+typedef struct {
+    BaselineNode* buckets[BASELINE_BUCKETS];
+    pthread_rwlock_t lock;
+} BaselineMap;
+
+static unsigned int baseline_hash(const char* key) {
+    unsigned int h = 5381;
+    int c;
+    while ((c = *key++)) {
+        h = ((h << 5) + h) + c;
+    }
+    return h % BASELINE_BUCKETS;
+}
+
+static void baseline_put(BaselineMap* map, const char* key, void* value) {
+    unsigned int index = baseline_hash(key);
+    pthread_rwlock_wrlock(&map->lock);
+    for (BaselineNode* node = map->buckets[index]; node; node = node->next) {
+        if (strcmp(node->key, key) == 0) {
+            free(node->value);
+            node->value = value;
+            pthread_rwlock_unlock(&map->lock);
+            return;
+        }
+    }
+    BaselineNode* node = (BaselineNode*)malloc(sizeof(BaselineNode));
+    strncpy(node->key, key, MAX_FILENAME - 1);
+    node->key[MAX_FILENAME - 1] = '\0';
+    node->value = value;
+    node->next = map->buckets[index];
+    map->buckets[index] = node;
+    pthread_rwlock_unlock(&map->lock);
+}
+
+static void* baseline_get(BaselineMap* map, const char* key) {
+    unsigned int index = baseline_hash(key);
+    pthread_rwlock_rdlock(&map->lock);
+    for (BaselineNode* node = map->buckets[index]; node; node = node->next) {
+        if (strcmp(node->key, key) == 0) {
+            void* value = node->value;
+            pthread_rwlock_unlock(&map->lock);
+            return value;
+        }
+    }
+    pthread_rwlock_unlock(&map->lock);
+    return NULL;
+}
+
+static void baseline_destroy(BaselineMap* map) {
+    for (int i = 0; i < BASELINE_BUCKETS; i++) {
+        BaselineNode* node = map->buckets[i];
+        while (node) {
+            BaselineNode* next = node->next;
+            free(node->value);
+            free(node);
+            node = next;
+        }
+    }
+    pthread_rwlock_destroy(&map->lock);
+    free(map);
+}
+
+typedef struct {
+    int index;
+    int baseline;
+    void* map;
+    long ops;
+    long misses;
+} bench_worker_t;
+
+static void* bench_worker(void* arg) {
+    bench_worker_t* worker = (bench_worker_t*)arg;
+    unsigned int state = 2463534242u + worker->index * 7919u;
+
+    while (!bench_stop) {
+        // xorshift32
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        const char* key = key_names[state % bench_keys];
+        int write = (int)((state >> 8) % 100) < bench_writes;
+
+        if (write) {
+            int* value = (int*)malloc(sizeof(int));
+            *value = worker->index;
+            if (worker->baseline) {
+                baseline_put((BaselineMap*)worker->map, key, value);
+            } else {
+                hashmap_put((HashMap*)worker->map, key, value);
+            }
+        } else {
+            void* value = worker->baseline ? baseline_get((BaselineMap*)worker->map, key)
+                                           : hashmap_get((HashMap*)worker->map, key);
+            if (!value) {
+                worker->misses++;
+            }
+        }
+        worker->ops++;
+    }
+    return NULL;
+}
+
+static double now_seconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double bench_run(int baseline, void* map, int threads) {
+    bench_worker_t workers[BENCH_MAX_THREADS];
+    pthread_t tids[BENCH_MAX_THREADS];
+
+    bench_stop = 0;
+    double start = now_seconds();
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].baseline = baseline;
+        workers[i].map = map;
+        workers[i].ops = 0;
+        workers[i].misses = 0;
+        pthread_create(&tids[i], NULL, bench_worker, &workers[i]);
+    }
+
+    sleep(bench_seconds);
+    bench_stop = 1;
+
+    long ops = 0, misses = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        ops += workers[i].ops;
+        misses += workers[i].misses;
+    }
+
+    if (misses > 0) {
+        fprintf(stderr, "warning: %ld lookups missed\n", misses);
+    }
+    return ops / (now_seconds() - start);
+}
+
+static void* preload(int baseline) {
+    void* map;
+    if (baseline) {
+        BaselineMap* base = (BaselineMap*)calloc(1, sizeof(BaselineMap));
+        pthread_rwlock_init(&base->lock, NULL);
+        map = base;
+    } else {
+        map = hashmap_create();
+    }
+
+    for (int i = 0; i < bench_keys; i++) {
+        int* value = (int*)malloc(sizeof(int));
+        *value = i;
+        if (baseline) {
+            baseline_put((BaselineMap*)map, key_names[i], value);
+        } else {
+            hashmap_put((HashMap*)map, key_names[i], value);
+        }
+    }
+    return map;
+}
+
+int main(int argc, char* argv[]) {
+    int thread_counts[32] = {1, 2, 4, 8, 16};
+    int num_counts = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            bench_keys = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            bench_seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--writes") == 0 && i + 1 < argc) {
+            bench_writes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_counts = 0;
+            char* list = argv[++i];
+            for (char* tok = strtok(list, ","); tok && num_counts < 32; tok = strtok(NULL, ",")) {
+                int n = atoi(tok);
+                if (n > 0 && n <= BENCH_MAX_THREADS) {
+                    thread_counts[num_counts++] = n;
+                }
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--threads 1,2,4] [--keys N] [--seconds S] "
+                    "[--writes PCT]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench_keys <= 0) {
+        fprintf(stderr, "--keys must be positive\n");
+        return 1;
+    }
+
+    key_names = malloc(sizeof(*key_names) * bench_keys);
+    for (int i = 0; i < bench_keys; i++) {
+        snprintf(key_names[i], sizeof(key_names[i]), "dir_%d/file_%d.txt", i % 97, i);
+    }
+
+    printf("HashMap throughput (%d keys, %d%% writes, %ds per run)\n",
+           bench_keys, bench_writes, bench_seconds);
+
+    HashMap* map = (HashMap*)preload(0);
+    BaselineMap* base = (BaselineMap*)preload(1);
+
+    for (int i = 0; i < num_counts; i++) {
+        double segmented = bench_run(0, map, thread_counts[i]);
+        double single = bench_run(1, base, thread_counts[i]);
+        printf("threads=%-4d segmented ops/sec=%-12.0f single-lock ops/sec=%-12.0f speedup=%.2fx\n",
+               thread_counts[i], segmented, single, segmented / single);
+        fflush(stdout);
+    }
+
+    hashmap_destroy(map);
+    baseline_destroy(base);
+    free(key_names);
+
+    return 0;
+}
@@ -0,0 +1,854 @@
+// Load generator for the whole system
+//
+// Opens --connections virtual clients, each with its own Name Server and
+// Storage Server connections, spread over --threads threads and signed in
+// as one of --users users (leases of different users conflict). Each thread
+// polls its clients; a client with nothing in flight starts its next
+// operation, drawn from --mix, as soon as the last one finishes (closed
+// loop). Operations take the same wire path the client does, without its
+// location cache:
+//   create  NM CREATE, then SS CREATE of a new file
+//   read    NM locate, then SS READ_CHUNKED of a whole working-set file
+//   write   NM LOCK_ACQUIRE of one sentence of a file its user owns, SS
+//           WRITE_COMMIT inserting a word, NM LOCK_RELEASE
+//   lock    NM LOCK_ACQUIRE and LOCK_RELEASE of one sentence
+// The working set (--files files of --file-size bytes, owned in turn by
+// each user and readable by all) is uploaded first.
+// After --warmup seconds, operations are counted and timed for --seconds;
+// a write or lock refused because the sentence is locked is counted as a
+// conflict, not an error. Latency runs from an operation's first request
+// to its last reply and goes into the metrics.h histograms (within 6.25%).
+//
+// Prints a summary, and with --json writes the results as JSON to a file
+// ("-": stdout, the summary then goes to stderr) for comparison between
+// releases. Created and working-set files are deleted at the end unless
+// --keep is given.
+//
+// Usage: load_bench [--host H] [--port P] [--connections N] [--threads T]
+//                   [--users U] [--seconds S] [--warmup S]
+//                   [--mix read=70,write=20,...] [--files N]
+//                   [--file-size BYTES] [--json PATH] [--keep]
+
+#include "../include/common.h"
+#include "../include/lease.h"
+#include "../include/metrics.h"
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#define LOAD_USER "loadbench"
+#define LOAD_MAX_THREADS 256
+#define LOAD_MAX_CONNECTIONS 16384
+
+#define LOAD_CREATE 0
+#define LOAD_READ 1
+#define LOAD_WRITE 2
+#define LOAD_LOCK 3
+#define LOAD_OPS 4
+
+static const char* load_op_names[LOAD_OPS] = {"create", "read", "write", "lock"};
+
+// Each operation's latencies are kept in the series of its main command
+static const int load_op_series[LOAD_OPS] = {CMD_CREATE, CMD_READ_CHUNKED, CMD_WRITE_COMMIT,
+                                             CMD_LOCK_ACQUIRE};
+
+static const char* load_host = "127.0.0.1";
+static int load_port = NM_PORT;
+static int load_connections = 1000;
+static int load_threads = 8;
+static int load_users = 16;
+static int load_seconds = 10;
+static int load_warmup = 2;
+static int load_files = 64;
+static long load_file_size = 4096;
+static int load_mix[LOAD_OPS] = {5, 70, 20, 5};
+static const char* load_json = NULL;
+static int load_keep = 0;
+
+static int load_sentences = 1;  // Sentences in each working-set file
+static char (*load_file_ss)[80] = NULL;  // Working-set file locations ("ip|port")
+static int* load_user_fds = NULL;        // Setup connection of each user to the NM
+
+static volatile int load_stop = 0;
+static volatile long long load_measure_from_us = 0;
+static volatile long long load_measure_until_us = 0;
+
+// Operation phases: the reply each client is waiting for
+#define PHASE_IDLE 0
+#define PHASE_NM 1        // CREATE, locate or LOCK_ACQUIRE reply
+#define PHASE_SS 2        // SS reply (for a read, the header)
+#define PHASE_STREAM 3    // Read chunks, until MSG_END
+#define PHASE_RELEASE 4   // LOCK_RELEASE reply
+
+typedef struct {
+    int nm_fd;
+    int ss_fd;
+    char ss_key[80];   // "ip|port" of ss_fd
+    int wait_fd;       // Where the next reply arrives
+    int op;
+    int phase;
+    int error;         // First failure of the operation in flight
+    int sentence;
+    int user;
+    char username[MAX_USERNAME];
+    char filename[MAX_FILENAME];
+    char lease[128];
+    long long start_us;
+    long created;      // Files made by its CREATEs
+} LoadClient;
+
+typedef struct {
+    int index;
+    int first;         // Clients [first, first + count)
+    int count;
+    unsigned long long rng;
+    long ops[LOAD_OPS];
+    long errors[LOAD_OPS];
+    long conflicts[LOAD_OPS];
+    long failed_connections;
+} LoadWorker;
+
+static LoadClient* load_clients = NULL;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long next_random(unsigned long long* state) {
+    unsigned long long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static int load_connect(const char* host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int load_connect_address(const char* address) {
+    char ip[64];
+    int port;
+    if (sscanf(address, "%63[^|]|%d", ip, &port) != 2) {
+        return -1;
+    }
+    return load_connect(ip, port);
+}
+
+static void user_name(int index, char* out, size_t len) {
+    snprintf(out, len, "%s%d", LOAD_USER, index);
+}
+
+// Name Server connection with user registered on it
+static int load_connect_nm(const char* user) {
+    int fd = load_connect(load_host, load_port);
+    if (fd < 0) {
+        return -1;
+    }
+
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.msg_type = MSG_REGISTER_USER;
+    strncpy(msg.username, user, MAX_USERNAME - 1);
+    snprintf(msg.data, BUFFER_SIZE, "127.0.0.1|0");
+
+    Message response;
+    if (send_message(fd, &msg) < 0 || receive_message(fd, &response) < 0 ||
+        response.error_code != SUCCESS) {
+        close(fd);
+        return -1;
+    }
+    message_free_body(&response);
+    return fd;
+}
+
+// The Storage Server connection for address ("ip|port..."), reconnecting
+// if the client's current one goes elsewhere
+static int load_ss_socket(LoadClient* client, const char* address) {
+    char ip[64];
+    int port;
+    if (sscanf(address, "%63[^|]|%d", ip, &port) != 2) {
+        return -1;
+    }
+
+    char key[80];
+    snprintf(key, sizeof(key), "%s|%d", ip, port);
+    if (client->ss_fd >= 0 && strcmp(client->ss_key, key) == 0) {
+        return client->ss_fd;
+    }
+    if (client->ss_fd >= 0) {
+        close(client->ss_fd);
+    }
+    client->ss_fd = load_connect(ip, port);
+    snprintf(client->ss_key, sizeof(client->ss_key), "%s", key);
+    return client->ss_fd;
+}
+
+static int load_send(LoadClient* client, int fd, int msg_type, int command, const char* data) {
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.msg_type = msg_type;
+    msg.command = command;
+    strncpy(msg.username, client->username, MAX_USERNAME - 1);
+    strncpy(msg.filename, client->filename, MAX_FILENAME - 1);
+    if (data) {
+        snprintf(msg.data, BUFFER_SIZE, "%s", data);
+    }
+
+    if (fd < 0 || send_message(fd, &msg) < 0) {
+        return -1;
+    }
+    client->wait_fd = fd;
+    return 0;
+}
+
+// One blocking request/reply, for setup and cleanup
+static int load_request(int fd, const char* user, int msg_type, int command, const char* filename,
+                        const char* data, Message* response) {
+    LoadClient client;
+    memset(&client, 0, sizeof(client));
+    memset(response, 0, sizeof(Message));
+    snprintf(client.username, sizeof(client.username), "%s", user);
+    snprintf(client.filename, sizeof(client.filename), "%s", filename);
+    if (load_send(&client, fd, msg_type, command, data) < 0 || receive_message(fd, response) < 0) {
+        return -1;
+    }
+    return response->error_code;
+}
+
+static void working_set_name(int index, char* out, size_t len) {
+    snprintf(out, len, "load_%d_%d.txt", (int)getpid(), index);
+}
+
+static void created_name(long client, long n, char* out, size_t len) {
+    snprintf(out, len, "load_%d_c%ld_%ld.txt", (int)getpid(), client, n);
+}
+
+static int pick_op(LoadWorker* worker) {
+    int total = 0;
+    for (int i = 0; i < LOAD_OPS; i++) {
+        total += load_mix[i];
+    }
+    int r = (int)(next_random(&worker->rng) % total);
+    for (int i = 0; i < LOAD_OPS; i++) {
+        if (r < load_mix[i]) {
+            return i;
+        }
+        r -= load_mix[i];
+    }
+    return LOAD_READ;
+}
+
+static void load_finish(LoadWorker* worker, LoadClient* client) {
+    long long end = now_us();
+    if (client->start_us >= load_measure_from_us && end <= load_measure_until_us) {
+        if (client->error == SUCCESS) {
+            worker->ops[client->op]++;
+            metrics_record(load_op_series[client->op], end - client->start_us, 0);
+        } else if (client->error == ERR_FILE_LOCKED) {
+            worker->conflicts[client->op]++;
+        } else {
+            worker->errors[client->op]++;
+        }
+    }
+    client->phase = PHASE_IDLE;
+}
+
+// A client whose connection failed is taken out of the run
+static void load_drop(LoadWorker* worker, LoadClient* client) {
+    client->error = ERR_STORAGE_SERVER_DOWN;
+    load_finish(worker, client);
+    if (client->nm_fd >= 0) {
+        close(client->nm_fd);
+    }
+    if (client->ss_fd >= 0) {
+        close(client->ss_fd);
+    }
+    client->nm_fd = client->ss_fd = client->wait_fd = -1;
+    worker->failed_connections++;
+}
+
+static int load_start(LoadWorker* worker, LoadClient* client) {
+    client->op = pick_op(worker);
+    client->error = SUCCESS;
+    client->lease[0] = '\0';
+    client->start_us = now_us();
+    client->phase = PHASE_NM;
+
+    if (client->op == LOAD_CREATE) {
+        created_name(client - load_clients, client->created++, client->filename,
+                     sizeof(client->filename));
+        return load_send(client, client->nm_fd, MSG_COMMAND, CMD_CREATE, NULL);
+    }
+
+    // Working-set file index is owned by user index % load_users
+    int file = (int)(next_random(&worker->rng) % load_files);
+    if (client->op == LOAD_WRITE) {
+        int owned = (load_files - client->user + load_users - 1) / load_users;
+        file = client->user + load_users * (int)(next_random(&worker->rng) % owned);
+    }
+    working_set_name(file, client->filename, sizeof(client->filename));
+    if (client->op == LOAD_READ) {
+        return load_send(client, client->nm_fd, MSG_COMMAND, CMD_READ_CHUNKED, NULL);
+    }
+
+    client->sentence = (int)(next_random(&worker->rng) % load_sentences);
+    char range[32];
+    snprintf(range, sizeof(range), "%d-%d", client->sentence, client->sentence);
+    return load_send(client, client->nm_fd, MSG_COMMAND, CMD_LOCK_ACQUIRE, range);
+}
+
+static int load_release(LoadClient* client) {
+    char data[128];
+    if (client->lease[0]) {
+        snprintf(data, sizeof(data), "%s", client->lease);
+    } else {
+        snprintf(data, sizeof(data), "%d", client->sentence);
+    }
+    client->phase = PHASE_RELEASE;
+    return load_send(client, client->nm_fd, MSG_COMMAND, CMD_LOCK_RELEASE, data);
+}
+
+// Next step of the client's operation after reply; -1 if a request could
+// not be sent
+static int load_advance(LoadWorker* worker, LoadClient* client, Message* reply) {
+    switch (client->phase) {
+        case PHASE_NM:
+            if (reply->error_code != SUCCESS) {
+                client->error = reply->error_code;
+                load_finish(worker, client);
+                return 0;
+            }
+            client->phase = PHASE_SS;
+            if (client->op == LOAD_CREATE) {
+                return load_send(client, load_ss_socket(client, reply->data), MSG_SS_COMMAND,
+                                 CMD_CREATE, NULL);
+            }
+            if (client->op == LOAD_READ) {
+                return load_send(client, load_ss_socket(client, reply->data), MSG_SS_COMMAND,
+                                 CMD_READ_CHUNKED, NULL);
+            }
+
+            const char* lease = strstr(reply->data, LEASE_PREFIX);
+            snprintf(client->lease, sizeof(client->lease), "%s", lease ? lease : "");
+            if (client->op == LOAD_LOCK) {
+                return load_release(client);
+            }
+
+            char data[BUFFER_SIZE];
+            snprintf(data, sizeof(data), "%s\n%d|0|load|", client->lease, client->sentence);
+            return load_send(client, load_ss_socket(client, reply->data), MSG_SS_COMMAND,
+                             CMD_WRITE_COMMIT, data);
+
+        case PHASE_SS:
+            client->error = reply->error_code;
+            if (client->op == LOAD_WRITE) {
+                return load_release(client);
+            }
+            if (client->op == LOAD_READ && reply->error_code == SUCCESS) {
+                client->phase = PHASE_STREAM;
+                return 0;
+            }
+            load_finish(worker, client);
+            return 0;
+
+        case PHASE_STREAM:
+            if (reply->msg_type == MSG_CHUNK) {
+                return 0;
+            }
+            client->error = reply->error_code;
+            load_finish(worker, client);
+            return 0;
+
+        case PHASE_RELEASE:
+            load_finish(worker, client);  // The commit's outcome, if any
+            return 0;
+    }
+    return 0;
+}
+
+static void* load_worker(void* arg) {
+    LoadWorker* worker = (LoadWorker*)arg;
+    struct pollfd* fds = (struct pollfd*)malloc(worker->count * sizeof(struct pollfd));
+    int* owners = (int*)malloc(worker->count * sizeof(int));
+
+    while (!load_stop) {
+        int waiting = 0;
+        for (int i = 0; i < worker->count; i++) {
+            LoadClient* client = &load_clients[worker->first + i];
+            if (client->nm_fd < 0) {
+                continue;
+            }
+            if (client->phase == PHASE_IDLE && load_start(worker, client) < 0) {
+                load_drop(worker, client);
+                continue;
+            }
+            fds[waiting].fd = client->wait_fd;
+            fds[waiting].events = POLLIN;
+            owners[waiting++] = i;
+        }
+        if (waiting == 0) {
+            break;  // Every connection failed
+        }
+
+        if (poll(fds, waiting, 100) <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < waiting; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            LoadClient* client = &load_clients[worker->first + owners[i]];
+            Message reply;
+            if (receive_message(fds[i].fd, &reply) < 0) {
+                load_drop(worker, client);
+                continue;
+            }
+            if (load_advance(worker, client, &reply) < 0) {
+                load_drop(worker, client);
+            }
+            message_free_body(&reply);
+        }
+    }
+
+    free(fds);
+    free(owners);
+    return NULL;
+}
+
+// Working-set file text: numbered sentences up to load_file_size bytes
+static char* working_set_text(size_t* len) {
+    char* text = (char*)malloc(load_file_size + 64);
+    size_t pos = 0;
+    load_sentences = 0;
+    while (pos < (size_t)load_file_size || load_sentences == 0) {
+        pos += snprintf(text + pos, 64, "Load bench sentence %d of the working set. ",
+                        load_sentences++);
+    }
+    *len = pos;
+    return text;
+}
+
+// Creates working-set file index with text as its owner, and lets every
+// other user read it
+static int upload(int index, const char* text, size_t len) {
+    int nm_fd = load_user_fds[index % load_users];
+    char owner[MAX_USERNAME];
+    user_name(index % load_users, owner, sizeof(owner));
+    char filename[MAX_FILENAME];
+    working_set_name(index, filename, sizeof(filename));
+
+    Message response;
+    if (load_request(nm_fd, owner, MSG_COMMAND, CMD_CREATE, filename, NULL, &response) != SUCCESS) {
+        return -1;
+    }
+    // A cut location would point the load clients at the wrong server
+    if (snprintf(load_file_ss[index], sizeof(load_file_ss[index]), "%s", response.data) >=
+        (int)sizeof(load_file_ss[index])) {
+        message_free_body(&response);
+        return -1;
+    }
+    int ss_fd = load_connect_address(response.data);
+    message_free_body(&response);
+    if (ss_fd < 0) {
+        return -1;
+    }
+
+    int rc = load_request(ss_fd, owner, MSG_SS_COMMAND, CMD_CREATE, filename, NULL, &response);
+    message_free_body(&response);
+    if (rc != SUCCESS ||
+        load_request(ss_fd, owner, MSG_SS_COMMAND, CMD_WRITE_BULK, filename, NULL, &response) != SUCCESS) {
+        message_free_body(&response);
+        close(ss_fd);
+        return -1;
+    }
+    message_free_body(&response);
+
+    Message chunk;
+    memset(&chunk, 0, sizeof(Message));
+    chunk.msg_type = MSG_CHUNK;
+    chunk.command = CMD_WRITE_BULK;
+    size_t chunk_size = message_max_payload(&chunk);
+    for (size_t pos = 0; pos < len; pos += chunk_size) {
+        chunk.body = (char*)text + pos;
+        chunk.body_len = len - pos < chunk_size ? len - pos : chunk_size;
+        if (send_message(ss_fd, &chunk) < 0) {
+            close(ss_fd);
+            return -1;
+        }
+    }
+    chunk.msg_type = MSG_END;
+    chunk.body = NULL;
+    chunk.body_len = 0;
+    send_message(ss_fd, &chunk);
+
+    rc = receive_message(ss_fd, &response) < 0 ? -1 : response.error_code;
+    message_free_body(&response);
+
+    for (int u = 0; u < load_users && rc == SUCCESS; u++) {
+        char user[MAX_USERNAME];
+        user_name(u, user, sizeof(user));
+        if (u == index % load_users) {
+            continue;
+        }
+        rc = load_request(ss_fd, owner, MSG_SS_COMMAND, CMD_ADDACCESS, filename, user, &response);
+        message_free_body(&response);
+    }
+    close(ss_fd);
+    return rc == SUCCESS ? 0 : -1;
+}
+
+// Deletes the working set and every file the run created, each as the user
+// owning it
+static void cleanup() {
+    Message response;
+    char filename[MAX_FILENAME];
+    char owner[MAX_USERNAME];
+    for (int i = 0; i < load_files; i++) {
+        working_set_name(i, filename, sizeof(filename));
+        user_name(i % load_users, owner, sizeof(owner));
+        load_request(load_user_fds[i % load_users], owner, MSG_COMMAND, CMD_DELETE, filename, NULL,
+                     &response);
+        message_free_body(&response);
+    }
+    for (int i = 0; i < load_connections; i++) {
+        for (long n = 0; n < load_clients[i].created; n++) {
+            created_name(i, n, filename, sizeof(filename));
+            load_request(load_user_fds[load_clients[i].user], load_clients[i].username, MSG_COMMAND,
+                         CMD_DELETE, filename, NULL, &response);
+            message_free_body(&response);
+        }
+    }
+}
+
+typedef struct {
+    long ops;
+    long errors;
+    long conflicts;
+    MetricsSeries latency;
+} LoadResult;
+
+static void print_latency(FILE* out, const MetricsSeries* latency) {
+    fprintf(out, "{\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu, "
+            "\"mean\": %.1f}",
+            metrics_quantile(latency, 0.5), metrics_quantile(latency, 0.9),
+            metrics_quantile(latency, 0.99), metrics_quantile(latency, 0.999), latency->max_us,
+            latency->count ? (double)latency->sum_us / latency->count : 0.0);
+}
+
+static void print_result_json(FILE* out, const LoadResult* result) {
+    fprintf(out, "\"ops\": %ld, \"ops_per_sec\": %.1f, \"errors\": %ld, \"conflicts\": %ld, "
+            "\"latency_us\": ",
+            result->ops, (double)result->ops / load_seconds, result->errors, result->conflicts);
+    print_latency(out, &result->latency);
+}
+
+static void print_json(FILE* out, const LoadResult* results, const LoadResult* total,
+                       int connected, long failed_connections) {
+    char timestamp[32];
+    time_t now = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(out, "{\n  \"benchmark\": \"load_bench\",\n  \"timestamp\": \"%s\",\n", timestamp);
+    fprintf(out, "  \"config\": {\"host\": \"%s\", \"port\": %d, \"connections\": %d, "
+            "\"threads\": %d, \"users\": %d, \"seconds\": %d, \"warmup\": %d, \"files\": %d, "
+            "\"file_size\": %ld, \"mix\": {",
+            load_host, load_port, load_connections, load_threads, load_users, load_seconds, load_warmup,
+            load_files, load_file_size);
+    for (int i = 0; i < LOAD_OPS; i++) {
+        fprintf(out, "%s\"%s\": %d", i ? ", " : "", load_op_names[i], load_mix[i]);
+    }
+    fprintf(out, "}},\n  \"connected\": %d,\n  \"failed_connections\": %ld,\n", connected,
+            failed_connections);
+    fprintf(out, "  \"total\": {");
+    print_result_json(out, total);
+    fprintf(out, "},\n  \"operations\": {\n");
+    int first = 1;
+    for (int i = 0; i < LOAD_OPS; i++) {
+        if (load_mix[i] == 0) {
+            continue;
+        }
+        fprintf(out, "%s    \"%s\": {", first ? "" : ",\n", load_op_names[i]);
+        print_result_json(out, &results[i]);
+        fprintf(out, "}");
+        first = 0;
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+static void print_summary(FILE* out, const char* name, const LoadResult* result) {
+    const MetricsSeries* latency = &result->latency;
+    fprintf(out, "%-7s ops=%-9ld ops/sec=%-9.0f", name, result->ops,
+            (double)result->ops / load_seconds);
+    if (latency->count > 0) {
+        fprintf(out, " p50=%.2fms p99=%.2fms p999=%.2fms max=%.2fms",
+                metrics_quantile(latency, 0.5) / 1000.0, metrics_quantile(latency, 0.99) / 1000.0,
+                metrics_quantile(latency, 0.999) / 1000.0, latency->max_us / 1000.0);
+    }
+    fprintf(out, " errors=%ld conflicts=%ld\n", result->errors, result->conflicts);
+}
+
+static void report(LoadWorker* workers, int threads, int connected) {
+    LoadResult results[LOAD_OPS];
+    LoadResult total;
+    memset(results, 0, sizeof(results));
+    memset(&total, 0, sizeof(total));
+    long failed_connections = 0;
+
+    for (int t = 0; t < threads; t++) {
+        failed_connections += workers[t].failed_connections;
+        for (int i = 0; i < LOAD_OPS; i++) {
+            results[i].ops += workers[t].ops[i];
+            results[i].errors += workers[t].errors[i];
+            results[i].conflicts += workers[t].conflicts[i];
+        }
+    }
+
+    for (int i = 0; i < LOAD_OPS; i++) {
+        MetricsSeries* latency = &results[i].latency;
+        metrics_snapshot(load_op_series[i], latency);
+        total.ops += results[i].ops;
+        total.errors += results[i].errors;
+        total.conflicts += results[i].conflicts;
+        total.latency.count += latency->count;
+        total.latency.sum_us += latency->sum_us;
+        if (latency->max_us > total.latency.max_us) {
+            total.latency.max_us = latency->max_us;
+        }
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            total.latency.buckets[b] += latency->buckets[b];
+        }
+    }
+
+    FILE* summary = load_json && strcmp(load_json, "-") == 0 ? stderr : stdout;
+    fprintf(summary, "%d connections on %d threads, %ds measured after %ds warmup\n", connected,
+            threads, load_seconds, load_warmup);
+    for (int i = 0; i < LOAD_OPS; i++) {
+        if (load_mix[i] > 0) {
+            print_summary(summary, load_op_names[i], &results[i]);
+        }
+    }
+    print_summary(summary, "total", &total);
+    if (failed_connections > 0) {
+        fprintf(summary, "Connections lost: %ld\n", failed_connections);
+    }
+
+    if (!load_json) {
+        return;
+    }
+    FILE* out = strcmp(load_json, "-") == 0 ? stdout : fopen(load_json, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot write %s: %s\n", load_json, strerror(errno));
+        return;
+    }
+    print_json(out, results, &total, connected, failed_connections);
+    if (out != stdout) {
+        fclose(out);
+        fprintf(summary, "Results written to %s\n", load_json);
+    }
+}
+
+// "read=70,write=20,..."; operations left out get no share
+static int parse_mix(char* text) {
+    int mix[LOAD_OPS] = {0};
+    int total = 0;
+    for (char* tok = strtok(text, ","); tok; tok = strtok(NULL, ",")) {
+        char* eq = strchr(tok, '=');
+        int op = -1;
+        for (int i = 0; eq && i < LOAD_OPS; i++) {
+            if ((size_t)(eq - tok) == strlen(load_op_names[i]) &&
+                strncmp(tok, load_op_names[i], eq - tok) == 0) {
+                op = i;
+            }
+        }
+        if (op < 0 || atoi(eq + 1) < 0) {
+            return -1;
+        }
+        mix[op] = atoi(eq + 1);
+        total += mix[op];
+    }
+    if (total == 0) {
+        return -1;
+    }
+    memcpy(load_mix, mix, sizeof(mix));
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [--host H] [--port P] [--connections N] [--threads T]\n"
+            "          [--users U] [--seconds S] [--warmup S] [--mix read=70,write=20,create=5,lock=5]\n"
+            "          [--files N] [--file-size BYTES] [--json PATH] [--keep]\n",
+            prog);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--host") == 0 && has_value) {
+            load_host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && has_value) {
+            load_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connections") == 0 && has_value) {
+            load_connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            load_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--users") == 0 && has_value) {
+            load_users = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && has_value) {
+            load_seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && has_value) {
+            load_warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--files") == 0 && has_value) {
+            load_files = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--file-size") == 0 && has_value) {
+            load_file_size = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--mix") == 0 && has_value) {
+            if (parse_mix(argv[++i]) < 0) {
+                fprintf(stderr, "Invalid --mix; operations are create, read, write and lock\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--json") == 0 && has_value) {
+            load_json = argv[++i];
+        } else if (strcmp(argv[i], "--keep") == 0) {
+            load_keep = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (load_connections < 1 || load_connections > LOAD_MAX_CONNECTIONS || load_threads < 1 ||
+        load_threads > LOAD_MAX_THREADS || load_users < 1 || load_seconds < 1 || load_warmup < 0 ||
+        load_files < 1 || load_file_size < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (load_threads > load_connections) {
+        load_threads = load_connections;
+    }
+    if (load_users > load_files) {
+        load_users = load_files;  // Each user owns at least one file to write
+    }
+
+    // Two sockets per connection, plus setup and stdio
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < (rlim_t)load_connections * 2 + 16) {
+        fprintf(stderr, "Open file limit %lu is too low for %d connections\n",
+                (unsigned long)limit.rlim_cur, load_connections);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    load_user_fds = (int*)malloc(load_users * sizeof(int));
+    for (int u = 0; u < load_users; u++) {
+        char user[MAX_USERNAME];
+        user_name(u, user, sizeof(user));
+        load_user_fds[u] = load_connect_nm(user);
+        if (load_user_fds[u] < 0) {
+            fprintf(stderr, "Cannot connect to Name Server at %s:%d\n", load_host, load_port);
+            return 1;
+        }
+    }
+
+    size_t text_len;
+    char* text = working_set_text(&text_len);
+    load_file_ss = calloc(load_files, sizeof(load_file_ss[0]));
+    for (int i = 0; i < load_files; i++) {
+        if (upload(i, text, text_len) < 0) {
+            fprintf(stderr, "Cannot create working-set file %d\n", i);
+            free(text);
+            return 1;
+        }
+    }
+    free(text);
+
+    load_clients = (LoadClient*)calloc(load_connections, sizeof(LoadClient));
+    int connected = 0;
+    for (int i = 0; i < load_connections; i++) {
+        // Connected up front, so that the run does not time connection setup
+        LoadClient* client = &load_clients[i];
+        client->user = i % load_users;
+        user_name(client->user, client->username, sizeof(client->username));
+        client->ss_fd = -1;
+        client->nm_fd = load_connect_nm(client->username);
+        if (client->nm_fd >= 0 && load_ss_socket(client, load_file_ss[i % load_files]) < 0) {
+            close(client->nm_fd);
+            client->nm_fd = -1;
+        }
+        connected += client->nm_fd >= 0;
+    }
+    if (connected < load_connections) {
+        fprintf(stderr, "Only %d of %d connections to the Name Server succeeded\n", connected,
+                load_connections);
+    }
+
+    LoadWorker workers[LOAD_MAX_THREADS];
+    pthread_t tids[LOAD_MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+
+    long long start = now_us();
+    load_measure_from_us = start + load_warmup * 1000000LL;
+    load_measure_until_us = load_measure_from_us + load_seconds * 1000000LL;
+    for (int t = 0; t < load_threads; t++) {
+        workers[t].index = t;
+        workers[t].first = (int)((long)load_connections * t / load_threads);
+        workers[t].count = (int)((long)load_connections * (t + 1) / load_threads) - workers[t].first;
+        workers[t].rng = (unsigned long long)start * 2654435761ULL + t + 1;
+        pthread_create(&tids[t], NULL, load_worker, &workers[t]);
+    }
+
+    sleep(load_warmup + load_seconds);
+    load_stop = 1;
+    for (int t = 0; t < load_threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+
+    report(workers, load_threads, connected);
+
+    for (int i = 0; i < load_connections; i++) {
+        if (load_clients[i].nm_fd >= 0) {
+            close(load_clients[i].nm_fd);
+        }
+        if (load_clients[i].ss_fd >= 0) {
+            close(load_clients[i].ss_fd);
+        }
+    }
+    if (!load_keep) {
+        cleanup();
+    }
+    for (int u = 0; u < load_users; u++) {
+        close(load_user_fds[u]);
+    }
+    free(load_user_fds);
+    free(load_clients);
+    free(load_file_ss);
+    return 0;
+}
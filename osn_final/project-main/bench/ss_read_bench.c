@@ -0,0 +1,324 @@
+// Storage Server read-scaling benchmark
+//
+// Opens one connection per thread to a running Storage Server and issues
+// CMD_READ requests back to back for a fixed duration, once per thread count.
+// With --shared every thread reads the same file (reader/reader concurrency);
+// otherwise each thread reads its own file. A writer thread can be added with
+// --writer to measure how reads of other files behave while commits fsync.
+// --size N uploads N-byte files instead, to exercise the sendfile path; the
+// server's zero-copy/buffered byte counters are printed at the end.
+//
+// Usage: ss_read_bench [--host H] [--port P] [--threads 1,2,4,8]
+//                      [--seconds S] [--shared] [--writer] [--size BYTES]
+
+#include "../include/common.h"
+#include "../include/lease.h"
+#include <sys/time.h>
+
+#define BENCH_USER "bench"
+#define BENCH_MAX_THREADS 256
+
+static const char* bench_host = "127.0.0.1";
+static int bench_port = 7000;
+static int bench_seconds = 3;
+static int bench_shared = 0;
+static int bench_writer = 0;
+static long bench_size = 0;
+
+static volatile int bench_stop = 0;
+
+typedef struct {
+    int index;
+    long ops;
+    long errors;
+} bench_worker_t;
+
+static int bench_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bench_port);
+    inet_pton(AF_INET, bench_host, &addr.sin_addr);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int bench_request(int fd, int command, const char* filename, const char* data,
+                         Message* response) {
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.msg_type = MSG_COMMAND;
+    msg.command = command;
+    strncpy(msg.username, BENCH_USER, MAX_USERNAME - 1);
+    strncpy(msg.filename, filename, MAX_FILENAME - 1);
+    if (data) {
+        strncpy(msg.data, data, BUFFER_SIZE - 1);
+    }
+
+    if (send_message(fd, &msg) < 0 || receive_message(fd, response) < 0) {
+        return -1;
+    }
+    return response->error_code;
+}
+
+static void bench_filename(int index, char* out, size_t len) {
+    snprintf(out, len, "bench_%d.txt", bench_shared ? 0 : index);
+}
+
+// A write lease for sentence 0 of filename followed by edits, as
+// CMD_WRITE_COMMIT data; the server must share LEASE_KEY with the bench
+static void bench_commit_data(const char* filename, const char* edits, char* out, size_t len) {
+    WriteLease lease = {1, 0, 0, lease_now_ms() + 3600 * 1000LL, 0};
+    lease_sign(&lease, filename, BENCH_USER);
+    int used = lease_format(&lease, out, len);
+    snprintf(out + used, len - used, "\n%s", edits);
+}
+
+// Replace filename with size bytes of sentences via CMD_WRITE_BULK
+static int bench_upload(int fd, const char* filename, long size) {
+    Message response;
+    if (bench_request(fd, CMD_WRITE_BULK, filename, NULL, &response) != SUCCESS) {
+        message_free_body(&response);
+        return -1;
+    }
+    message_free_body(&response);
+
+    static const char pattern[] = "Benchmark content for zero copy reads. ";
+    char* buffer = (char*)malloc(FILE_CHUNK_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    for (size_t i = 0; i < FILE_CHUNK_SIZE; i++) {
+        buffer[i] = pattern[i % (sizeof(pattern) - 1)];
+    }
+
+    Message chunk;
+    memset(&chunk, 0, sizeof(Message));
+    chunk.msg_type = MSG_CHUNK;
+    chunk.body = buffer;
+
+    int rc = 0;
+    for (long left = size; left > 0 && rc == 0; left -= chunk.body_len) {
+        chunk.body_len = left < FILE_CHUNK_SIZE ? (size_t)left : FILE_CHUNK_SIZE;
+        rc = send_message(fd, &chunk);
+    }
+    free(buffer);
+
+    chunk.msg_type = MSG_END;
+    chunk.body = NULL;
+    chunk.body_len = 0;
+    if (rc < 0 || send_message(fd, &chunk) < 0 || receive_message(fd, &response) < 0) {
+        return -1;
+    }
+    rc = response.error_code;
+    message_free_body(&response);
+    return rc == SUCCESS ? 0 : -1;
+}
+
+// Create a file with a few sentences of content (idempotent)
+static int bench_prepare_file(int fd, const char* filename) {
+    Message response;
+    int rc = bench_request(fd, CMD_CREATE, filename, NULL, &response);
+    message_free_body(&response);
+    if (rc != SUCCESS && rc != ERR_FILE_EXISTS) {
+        return -1;
+    }
+
+    if (bench_size > 0) {
+        return bench_upload(fd, filename, bench_size);
+    }
+
+    char data[256];
+    bench_commit_data(filename, "0|0|Benchmark|1|content|2|for|3|parallel|4|reads.|", data,
+                      sizeof(data));
+    rc = bench_request(fd, CMD_WRITE_COMMIT, filename, data, &response);
+    message_free_body(&response);
+    return rc == SUCCESS ? 0 : -1;
+}
+
+static void* bench_reader(void* arg) {
+    bench_worker_t* worker = (bench_worker_t*)arg;
+    char filename[MAX_FILENAME];
+    bench_filename(worker->index, filename, sizeof(filename));
+
+    int fd = bench_connect();
+    if (fd < 0) {
+        worker->errors++;
+        return NULL;
+    }
+
+    while (!bench_stop) {
+        Message response;
+        if (bench_request(fd, CMD_READ, filename, NULL, &response) == SUCCESS) {
+            worker->ops++;
+        } else {
+            worker->errors++;
+        }
+        message_free_body(&response);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Keeps committing to a file no reader touches
+static void* bench_committer(void* arg) {
+    long* commits = (long*)arg;
+    int fd = bench_connect();
+    if (fd < 0) {
+        return NULL;
+    }
+
+    char data[256];
+    bench_commit_data("bench_writer.txt", "0|0|Again.|", data, sizeof(data));
+    while (!bench_stop) {
+        Message response;
+        if (bench_request(fd, CMD_WRITE_COMMIT, "bench_writer.txt", data, &response) == SUCCESS) {
+            (*commits)++;
+        }
+        message_free_body(&response);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static double now_seconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void bench_run(int threads) {
+    bench_worker_t workers[BENCH_MAX_THREADS];
+    pthread_t tids[BENCH_MAX_THREADS];
+    pthread_t writer_tid;
+    long commits = 0;
+
+    bench_stop = 0;
+    double start = now_seconds();
+
+    if (bench_writer) {
+        pthread_create(&writer_tid, NULL, bench_committer, &commits);
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].ops = 0;
+        workers[i].errors = 0;
+        pthread_create(&tids[i], NULL, bench_reader, &workers[i]);
+    }
+
+    sleep(bench_seconds);
+    bench_stop = 1;
+
+    long ops = 0, errors = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        ops += workers[i].ops;
+        errors += workers[i].errors;
+    }
+    if (bench_writer) {
+        pthread_join(writer_tid, NULL);
+    }
+
+    double elapsed = now_seconds() - start;
+    printf("threads=%-4d reads=%-9ld reads/sec=%-10.0f errors=%ld", threads, ops, ops / elapsed, errors);
+    if (bench_writer) {
+        printf(" commits/sec=%.0f", commits / elapsed);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    int thread_counts[32] = {1, 2, 4, 8, 16};
+    int num_counts = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            bench_host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            bench_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            bench_seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_counts = 0;
+            char* list = argv[++i];
+            for (char* tok = strtok(list, ","); tok && num_counts < 32; tok = strtok(NULL, ",")) {
+                int n = atoi(tok);
+                if (n > 0 && n <= BENCH_MAX_THREADS) {
+                    thread_counts[num_counts++] = n;
+                }
+            }
+        } else if (strcmp(argv[i], "--shared") == 0) {
+            bench_shared = 1;
+        } else if (strcmp(argv[i], "--writer") == 0) {
+            bench_writer = 1;
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            bench_size = atol(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--host H] [--port P] [--threads 1,2,4] "
+                    "[--seconds S] [--shared] [--writer] [--size BYTES]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int max_threads = 0;
+    for (int i = 0; i < num_counts; i++) {
+        if (thread_counts[i] > max_threads) {
+            max_threads = thread_counts[i];
+        }
+    }
+
+    int fd = bench_connect();
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to Storage Server at %s:%d\n", bench_host, bench_port);
+        return 1;
+    }
+    if (lease_init("BENCH") < 0) {
+        fprintf(stderr, "LEASE_KEY must be set to the server's key\n");
+        close(fd);
+        return 1;
+    }
+
+    int files = bench_shared ? 1 : max_threads;
+    for (int i = 0; i < files; i++) {
+        char filename[MAX_FILENAME];
+        bench_filename(i, filename, sizeof(filename));
+        if (bench_prepare_file(fd, filename) < 0) {
+            fprintf(stderr, "Failed to prepare %s\n", filename);
+            close(fd);
+            return 1;
+        }
+    }
+    if (bench_writer && bench_prepare_file(fd, "bench_writer.txt") < 0) {
+        fprintf(stderr, "Failed to prepare bench_writer.txt\n");
+        close(fd);
+        return 1;
+    }
+
+    printf("Storage Server read scaling (%s files, %ds per run%s)\n",
+           bench_shared ? "shared" : "per-thread", bench_seconds,
+           bench_writer ? ", concurrent writer" : "");
+    for (int i = 0; i < num_counts; i++) {
+        bench_run(thread_counts[i]);
+    }
+
+    Message response;
+    if (bench_request(fd, CMD_STATS, "", NULL, &response) == SUCCESS) {
+        printf("Server transfer counters:\n%s", response.data);
+    }
+    message_free_body(&response);
+    close(fd);
+
+    return 0;
+}
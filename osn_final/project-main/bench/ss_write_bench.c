@@ -0,0 +1,229 @@
+// Storage Server commit benchmark
+//
+// Opens one connection per thread to a running Storage Server and issues
+// CMD_WRITE_COMMIT requests back to back for a fixed duration, once per
+// thread count. Each thread appends a sentence per commit to its own new
+// file, so commits only contend on the disk. Prints commits/sec and the
+// commit latency percentiles, then the server's durability counters.
+//
+// Run it once per SS_DURABILITY mode the server is started with (strict,
+// group, relaxed) to compare them. The bench signs its own write leases,
+// so it needs the server's LEASE_KEY in its environment.
+//
+// Usage: ss_write_bench [--host H] [--port P] [--threads 1,4,16] [--seconds S]
+
+#include "../include/common.h"
+#include "../include/lease.h"
+#include <sys/time.h>
+
+#define BENCH_USER "bench"
+#define BENCH_MAX_THREADS 256
+#define BENCH_MAX_SAMPLES 200000  // Latencies kept per thread
+
+static const char* bench_host = "127.0.0.1";
+static int bench_port = 7000;
+static int bench_seconds = 3;
+
+static volatile int bench_stop = 0;
+
+typedef struct {
+    int index;
+    int threads;
+    long ops;
+    long errors;
+    double* latencies;  // Seconds, one per successful commit
+} bench_worker_t;
+
+static double now_seconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int bench_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bench_port);
+    inet_pton(AF_INET, bench_host, &addr.sin_addr);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int bench_request(int fd, int command, const char* filename, const char* data,
+                         Message* response) {
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.msg_type = MSG_COMMAND;
+    msg.command = command;
+    strncpy(msg.username, BENCH_USER, MAX_USERNAME - 1);
+    strncpy(msg.filename, filename, MAX_FILENAME - 1);
+    if (data) {
+        strncpy(msg.data, data, BUFFER_SIZE - 1);
+    }
+
+    if (send_message(fd, &msg) < 0 || receive_message(fd, response) < 0) {
+        return -1;
+    }
+    return response->error_code;
+}
+
+static void* bench_committer(void* arg) {
+    bench_worker_t* worker = (bench_worker_t*)arg;
+    char filename[MAX_FILENAME];
+    snprintf(filename, sizeof(filename), "wbench_%d_%d_%d.txt", (int)getpid(), worker->threads,
+             worker->index);
+
+    int fd = bench_connect();
+    Message response;
+    if (fd < 0 || bench_request(fd, CMD_CREATE, filename, NULL, &response) != SUCCESS) {
+        worker->errors++;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    message_free_body(&response);
+
+    // One lease for the whole run, covering every sentence appended
+    WriteLease lease = {(unsigned long long)worker->index + 1, 0, 1 << 30,
+                        lease_now_ms() + 3600 * 1000LL, 0};
+    lease_sign(&lease, filename, BENCH_USER);
+    char lease_text[128];
+    lease_format(&lease, lease_text, sizeof(lease_text));
+
+    int sentence = 0;
+    while (!bench_stop) {
+        char data[256];
+        snprintf(data, sizeof(data), "%s\n%d|0|Commit.|", lease_text, sentence);
+
+        double start = now_seconds();
+        if (bench_request(fd, CMD_WRITE_COMMIT, filename, data, &response) == SUCCESS) {
+            if (worker->ops < BENCH_MAX_SAMPLES) {
+                worker->latencies[worker->ops] = now_seconds() - start;
+            }
+            worker->ops++;
+            sentence++;
+        } else {
+            worker->errors++;
+        }
+        message_free_body(&response);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(int threads) {
+    bench_worker_t workers[BENCH_MAX_THREADS];
+    pthread_t tids[BENCH_MAX_THREADS];
+
+    bench_stop = 0;
+    double start = now_seconds();
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].threads = threads;
+        workers[i].ops = 0;
+        workers[i].errors = 0;
+        workers[i].latencies = (double*)malloc(BENCH_MAX_SAMPLES * sizeof(double));
+        pthread_create(&tids[i], NULL, bench_committer, &workers[i]);
+    }
+
+    sleep(bench_seconds);
+    bench_stop = 1;
+
+    long ops = 0, errors = 0, samples = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        ops += workers[i].ops;
+        errors += workers[i].errors;
+    }
+    double elapsed = now_seconds() - start;
+
+    double* all = (double*)malloc((ops > 0 ? ops : 1) * sizeof(double));
+    for (int i = 0; i < threads; i++) {
+        long kept = workers[i].ops < BENCH_MAX_SAMPLES ? workers[i].ops : BENCH_MAX_SAMPLES;
+        memcpy(all + samples, workers[i].latencies, kept * sizeof(double));
+        samples += kept;
+        free(workers[i].latencies);
+    }
+    qsort(all, samples, sizeof(double), compare_doubles);
+
+    printf("threads=%-4d commits=%-8ld commits/sec=%-8.0f", threads, ops, ops / elapsed);
+    if (samples > 0) {
+        printf(" p50=%.2fms p99=%.2fms max=%.2fms", all[samples / 2] * 1000,
+               all[samples * 99 / 100] * 1000, all[samples - 1] * 1000);
+    }
+    printf(" errors=%ld\n", errors);
+    fflush(stdout);
+    free(all);
+}
+
+int main(int argc, char* argv[]) {
+    int thread_counts[32] = {1, 4, 16};
+    int num_counts = 3;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            bench_host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            bench_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            bench_seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_counts = 0;
+            char* list = argv[++i];
+            for (char* tok = strtok(list, ","); tok && num_counts < 32; tok = strtok(NULL, ",")) {
+                int n = atoi(tok);
+                if (n > 0 && n <= BENCH_MAX_THREADS) {
+                    thread_counts[num_counts++] = n;
+                }
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--host H] [--port P] [--threads 1,4,16] [--seconds S]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    int fd = bench_connect();
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to Storage Server at %s:%d\n", bench_host, bench_port);
+        return 1;
+    }
+    if (lease_init("BENCH") < 0) {
+        fprintf(stderr, "LEASE_KEY must be set to the server's key\n");
+        close(fd);
+        return 1;
+    }
+
+    printf("Storage Server commit latency (%ds per run)\n", bench_seconds);
+    for (int i = 0; i < num_counts; i++) {
+        bench_run(thread_counts[i]);
+    }
+
+    Message response;
+    if (bench_request(fd, CMD_STATS, "", NULL, &response) == SUCCESS) {
+        char* line = strstr(response.data, "durability_mode:");
+        printf("Server durability counters:\n%s", line ? line : "(not reported)\n");
+    }
+    message_free_body(&response);
+    close(fd);
+
+    return 0;
+}
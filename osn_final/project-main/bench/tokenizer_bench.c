@@ -0,0 +1,150 @@
+// Tokenizer throughput benchmark
+//
+// Generates text of each size (words of 1-10 letters, sentences of 3-20
+// words, occasional newlines) and times, for every kernel this CPU
+// supports, the sentence index (sentence_index_from_text) and the word
+// spans (tokenize_words). Results from each kernel are checked against the
+// scalar one.
+//
+// Usage: tokenizer_bench [--sizes 1024,65536,1048576,10485760] [--min-ms MS]
+
+#include "../include/common.h"
+#include "../include/sentence_index.h"
+#include "../include/sentence_parser.h"
+#include <sys/time.h>
+
+static int bench_min_ms = 200;
+
+static double now_seconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static char* make_text(size_t size) {
+    char* text = (char*)malloc(size + 1);
+    if (!text) {
+        return NULL;
+    }
+
+    unsigned seed = 12345;
+    size_t pos = 0;
+    int words_left = 0;
+    while (pos < size) {
+        seed = seed * 1103515245 + 12345;
+        if (words_left == 0) {
+            words_left = 3 + (seed >> 16) % 18;
+        }
+
+        int len = 1 + (seed >> 8) % 10;
+        for (int i = 0; i < len && pos < size; i++) {
+            text[pos++] = 'a' + (seed >> (i % 16)) % 26;
+        }
+        if (--words_left == 0 && pos < size) {
+            text[pos++] = ".!?"[(seed >> 4) % 3];
+        }
+        if (pos < size) {
+            text[pos++] = (seed >> 20) % 16 == 0 ? '\n' : ' ';
+        }
+    }
+    text[size] = '\0';
+    return text;
+}
+
+// Repeat one scan for at least bench_min_ms; returns MB/s
+static double measure(const char* text, size_t len, TextSpan* spans, int max_spans, int words) {
+    double start = now_seconds();
+    double elapsed = 0;
+    long runs = 0;
+    do {
+        if (words) {
+            tokenize_words(text, len, spans, max_spans);
+        } else {
+            free(sentence_index_from_text(text, len));
+        }
+        runs++;
+        elapsed = now_seconds() - start;
+    } while (elapsed * 1000 < bench_min_ms);
+    return (double)len * runs / elapsed / (1024 * 1024);
+}
+
+static int same_index(const SentenceIndex* a, const SentenceIndex* b) {
+    if (!a || !b || a->count != b->count || a->total_words != b->total_words ||
+        a->open_tail != b->open_tail) {
+        return 0;
+    }
+    for (int i = 0; i < a->count; i++) {
+        if (a->spans[i].offset != b->spans[i].offset || a->spans[i].length != b->spans[i].length ||
+            a->spans[i].words != b->spans[i].words) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    size_t sizes[16] = {1024, 16 * 1024, 256 * 1024, 1024 * 1024, 10 * 1024 * 1024};
+    int num_sizes = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            num_sizes = 0;
+            for (char* tok = strtok(argv[++i], ","); tok && num_sizes < 16; tok = strtok(NULL, ",")) {
+                if (atol(tok) > 0) {
+                    sizes[num_sizes++] = atol(tok);
+                }
+            }
+        } else if (strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc) {
+            bench_min_ms = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--sizes 1024,65536,...] [--min-ms MS]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static const char* kernels[] = {"scalar", "sse2", "avx2", "neon"};
+    int failed = 0;
+
+    printf("%-10s %-8s %14s %14s\n", "size", "kernel", "sentences MB/s", "words MB/s");
+    for (int s = 0; s < num_sizes; s++) {
+        char* text = make_text(sizes[s]);
+        int max_spans = (int)(sizes[s] / 2 + 1);
+        TextSpan* spans = (TextSpan*)malloc(max_spans * sizeof(TextSpan));
+        TextSpan* expected_spans = (TextSpan*)malloc(max_spans * sizeof(TextSpan));
+        if (!text || !spans || !expected_spans) {
+            fprintf(stderr, "Out of memory for %zu bytes\n", sizes[s]);
+            return 1;
+        }
+
+        tokenizer_use_kernel("scalar");
+        SentenceIndex* expected = sentence_index_from_text(text, sizes[s]);
+        int expected_words = tokenize_words(text, sizes[s], expected_spans, max_spans);
+
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (tokenizer_use_kernel(kernels[k]) < 0) {
+                continue;
+            }
+
+            SentenceIndex* idx = sentence_index_from_text(text, sizes[s]);
+            int words = tokenize_words(text, sizes[s], spans, max_spans);
+            if (!same_index(idx, expected) || words != expected_words ||
+                memcmp(spans, expected_spans, words * sizeof(TextSpan)) != 0) {
+                printf("MISMATCH: kernel %s differs from scalar at %zu bytes\n", kernels[k], sizes[s]);
+                failed = 1;
+            }
+            free(idx);
+
+            double sentence_rate = measure(text, sizes[s], spans, max_spans, 0);
+            double word_rate = measure(text, sizes[s], spans, max_spans, 1);
+            printf("%-10zu %-8s %14.0f %14.0f\n", sizes[s], kernels[k], sentence_rate, word_rate);
+            fflush(stdout);
+        }
+
+        free(expected);
+        free(expected_spans);
+        free(spans);
+        free(text);
+    }
+
+    return failed;
+}
@@ -0,0 +1,69 @@
+#ifndef COLD_STORE_H
+#define COLD_STORE_H
+
+#include "common.h"
+
+// Compressed tier for files nobody uses (Storage Server side).
+//
+// Freezing a file compresses its content and its history log, in
+// independent 64 KB LZ4 blocks (lz4.h), into data/cold/files/<file> and
+// data/cold/history/<file>.log, then removes the raw copies. Metadata and
+// checkpoints stay where they are: checkpoints are pointers into the log
+// (see history.h). Thawing puts the raw copies back. A frozen file is
+// thawed before any request works on it, so the rest of the server only
+// ever sees data/files; the freezer refreezes it once it has been left
+// alone again. Checking a hot file costs one lookup in the frozen set.
+//
+// Files below SS_COLD_MIN_BYTES (default 4096) are left raw, as are files
+// that would not shrink by an eighth; the latter are tried again once
+// modified. A thawed file is not refrozen within SS_COLD_AFTER_SEC of the
+// thaw, so a request that just thawed a file finds it still there.
+//
+// Frozen copies are always synced before the raw ones go, whatever
+// SS_DURABILITY says, since the file they replace may be old. A file
+// found in both tiers at start up keeps the raw copy.
+//
+// The caller holds the file's write lock for cold_freeze and cold_thaw
+// and at least its read lock for cold_read and cold_stat.
+
+typedef struct {
+    int files;                        // Frozen now
+    unsigned long long raw_bytes;     // Their size uncompressed
+    unsigned long long stored_bytes;  // And on disk
+    unsigned long long freezes;
+    unsigned long long thaws;
+    unsigned long long incompressible;  // Freezes given up for too little saving
+    unsigned long long failures;
+    unsigned long long thaw_us_total;
+} ColdStats;
+
+// Reads SS_COLD_AFTER_SEC and SS_COLD_MIN_BYTES, finishes freezes and
+// thaws interrupted by a crash and loads the frozen set
+void cold_init();
+
+// Seconds without use after which a file is frozen; 0 when disabled
+int cold_after_seconds();
+// Smallest file worth freezing
+long cold_min_bytes();
+
+int cold_contains(const char* filename);
+
+// 1 if frozen, 0 if left raw (too small, incompressible, thawed
+// recently, or not there), -1 on error
+int cold_freeze(const char* filename);
+
+// 0 once data/files/<filename> holds the content (also when it was not
+// frozen), -1 on error
+int cold_thaw(const char* filename);
+
+// Content of a frozen file without thawing it, NUL-terminated; NULL if
+// not frozen or unreadable
+char* cold_read(const char* filename, size_t* len);
+
+// Size and sentence count of a frozen file's content without thawing it,
+// for INFO and FILEINFO; -1 if not frozen or unreadable
+int cold_stat(const char* filename, uint64_t* size, int* sentences);
+
+void cold_get_stats(ColdStats* stats);
+
+#endif // COLD_STORE_H
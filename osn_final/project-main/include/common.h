@@ -14,10 +14,13 @@
 #include <errno.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <stdint.h>
 
 // Configuration
 #define NM_PORT 5000
-#define MAX_CLIENTS 100
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 100  // Default listen backlog (NM_LISTEN_BACKLOG overrides)
+#endif
 #define BUFFER_SIZE 8192
 #define MAX_FILENAME 256
 #define MAX_USERNAME 64
@@ -43,6 +46,8 @@
 #define ERR_NO_STORAGE_SERVERS 11
 #define ERR_INVALID_PARAMETERS 12
 #define ERR_EXEC_FAILED 13
+#define ERR_WRONG_SHARD 14   // data: "host|port" of the owning Name Server shard
+#define ERR_STALE_LOCATION 15  // data: "ip|port" of the file's new Storage Server, or empty
 
 // Message types
 #define MSG_REGISTER_SS 1
@@ -50,6 +55,10 @@
 #define MSG_COMMAND 3
 #define MSG_RESPONSE 4
 #define MSG_SS_COMMAND 5
+#define MSG_HEARTBEAT 6
+#define MSG_ACK 7
+#define MSG_CHUNK 8    // One piece of a chunked transfer
+#define MSG_END 9      // End of a chunked transfer; error_code carries the outcome
 
 // Command types
 #define CMD_VIEW 1
@@ -87,6 +96,26 @@
 #define CMD_APPROVEREQUEST 27
 #define CMD_DENYREQUEST 28
 
+// Chunked transfers (files larger than BUFFER_SIZE)
+#define CMD_READ_CHUNKED 29
+#define CMD_WRITE_BULK 30
+#define FILE_CHUNK_SIZE (64 * 1024)
+
+// Storage Server transfer counters
+#define CMD_STATS 31
+
+// Name Server shard map ("host:port,...")
+#define CMD_SHARD_MAP 32
+
+// Storage Server to replica: a file's current state (or its deletion)
+#define CMD_REPLICATE 33
+
+// Name Server to Storage Server: move a file to another SS (rebalancing)
+#define CMD_MIGRATE 34
+
+// Counters and latency histograms as Prometheus text, in the reply body
+#define CMD_METRICS 35
+
 // Permissions
 #define PERM_NONE 0
 #define PERM_READ 1
@@ -103,6 +132,7 @@ typedef struct {
     char last_accessed_by[MAX_USERNAME];
     int word_count;
     int char_count;
+    unsigned long long version;  // Storage Server side: bumped on every change
 } FileInfo;
 
 typedef struct {
@@ -110,14 +140,6 @@ typedef struct {
     int permission; // PERM_READ or PERM_WRITE
 } ACLEntry;
 
-typedef struct {
-    char filename[MAX_FILENAME];
-    int sentence_index;
-    char locked_by[MAX_USERNAME];
-    time_t lock_time;
-    pthread_mutex_t mutex;
-} SentenceLock;
-
 typedef struct {
     char username[MAX_USERNAME];
     char ip[64];
@@ -135,6 +157,21 @@ typedef struct {
     char files[1000][MAX_FILENAME];
     int file_count;
     char replica_ss_id[64];  // ID of replica SS (for fault tolerance)
+    unsigned int epoch;      // Changes on every registration
+    pthread_mutex_t sync_lock;  // Guards in_sync and in_sync_at
+    char in_sync[256];       // ",id,id," of replicas with nothing pending
+    time_t in_sync_at;       // When in_sync was reported
+    
+    // Load report from the last heartbeat (load_at 0: none yet)
+    unsigned long long bytes_stored;
+    unsigned long long free_bytes;
+    double request_rate;         // Requests per second
+    unsigned long long p99_us;   // p99 request latency, microseconds
+    time_t load_at;
+    
+    unsigned int heartbeat_ms;   // Interval announced in its heartbeats
+    unsigned int heartbeat_seq;  // Last heartbeat received
+    unsigned int location_gen;   // From its registration; 0: does not check cached locations
 } StorageServerInfo;
 
 // Bonus: Access request structure
@@ -163,13 +200,102 @@ typedef struct {
     char filename[MAX_FILENAME];
     char data[BUFFER_SIZE];
     int data_len;
+    
+    // Wire bookkeeping (not part of the legacy fixed-size layout)
+    uint32_t request_id;  // Echoed back in the response frame
+    uint16_t location_gen;  // Storage Server generation a cached location was issued with; 0: none
+    int legacy;           // 1 if received as (and must be answered with) a legacy struct
+    char* body;           // Optional big body (FRAME_FLAG_BIG_BODY), heap allocated
+    size_t body_len;
 } Message;
 
+// Framed wire protocol
+//
+// Every message is sent as a fixed FrameHeader (network byte order) followed
+// by username_len + filename_len + data_len payload bytes. Only the bytes
+// actually used are sent, instead of the full sizeof(Message).
+//
+// With FRAME_FLAG_BIG_BODY the data section is taken from / delivered into
+// Message.body instead of Message.data, so it may exceed BUFFER_SIZE.
+//
+// Receivers also accept the old fixed-size struct (LegacyMessage): its first
+// field is msg_type, which can never collide with FRAME_MAGIC. A legacy
+// request is answered in the legacy format.
+//
+// location_gen is set by a client that went straight to a Storage Server
+// from its location cache (see ERR_STALE_LOCATION); older peers send 0.
+#define FRAME_MAGIC 0x4E465346u  // "NFSF"
+#define FRAME_VERSION 1
+#define FRAME_FLAG_BIG_BODY 0x01
+#define FRAME_MAX_BODY (64 * 1024 * 1024)
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t location_gen;
+    uint32_t request_id;
+    int32_t msg_type;
+    int32_t command;
+    int32_t error_code;
+    uint16_t username_len;
+    uint16_t filename_len;
+    uint32_t data_len;
+} FrameHeader;
+
+// Storage Server heartbeat: the data section of MSG_HEARTBEAT, fixed size,
+// integers in network byte order (heartbeat_encode / heartbeat_decode). It
+// carries the SS's load and replication state, so liveness costs one small
+// frame per interval and needs no separate reporting.
+#define HEARTBEAT_MAGIC 0x48425431u  // "HBT1"
+#define HEARTBEAT_MAX_REPLICAS 4
+
+typedef struct __attribute__((packed)) {
+    char ss_id[64];
+    int32_t backlog;            // Changes not yet shipped; -1: needs a resync
+} HeartbeatReplica;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t pid;
+    uint32_t interval_ms;       // How often the sender heartbeats
+    char ss_id[64];
+    uint64_t bytes_stored;
+    uint64_t free_bytes;
+    uint32_t request_rate_milli;  // Requests per second x 1000
+    uint32_t p99_us;            // p99 request latency
+    uint32_t replica_count;
+    HeartbeatReplica replicas[HEARTBEAT_MAX_REPLICAS];
+} Heartbeat;
+
+// Pre-framing wire layout, kept for peers that have not been upgraded
+typedef struct {
+    int msg_type;
+    int command;
+    int error_code;
+    char username[MAX_USERNAME];
+    char filename[MAX_FILENAME];
+    char data[BUFFER_SIZE];
+    int data_len;
+} LegacyMessage;
+
 // Function prototypes
 void log_message(const char* component, const char* level, const char* format, ...);
 char* get_error_message(int error_code);
-void send_message(int socket_fd, Message* msg);
+int send_message(int socket_fd, Message* msg);
+int send_message_flags(int socket_fd, Message* msg, int flags);
 int receive_message(int socket_fd, Message* msg);
+int send_message_file(int socket_fd, Message* msg, int file_fd, off_t offset, size_t len);
+void message_free_body(Message* msg);
+const char* message_payload(const Message* msg);
+size_t message_payload_len(const Message* msg);
+size_t message_max_payload(const Message* msg);
+ssize_t frame_peek_length(const char* buf, size_t len);
+ssize_t frame_decode(const char* buf, size_t len, Message* msg);
+void heartbeat_encode(const Heartbeat* hb, Message* msg);
+int heartbeat_decode(const Message* msg, Heartbeat* hb);
 char* get_timestamp();
+int config_get_int(const char* name, int default_value);
 
 #endif // COMMON_H
@@ -0,0 +1,39 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include "common.h"
+#include <stdbool.h>
+
+// Keep-alive outgoing connections, keyed by "ip:port".
+// - conn_pool_get() hands out an idle connection to that address, or opens
+//   a new one. Each connection has one user at a time.
+// - After a complete request/response exchange the user returns it with
+//   conn_pool_release(). A connection that may still have a reply in
+//   flight (error, interrupted transfer) must go to conn_pool_discard().
+// - conn_pool_cleanup_idle() closes connections idle for too long; an idle
+//   connection the peer has closed is noticed and replaced by the next get.
+typedef struct {
+    int fd;
+    char key[80];      // "ip:port"
+    time_t last_used;
+    bool in_use;
+} connection_t;
+
+typedef struct {
+    connection_t* slots;
+    int size;
+    pthread_mutex_t mutex;
+} ConnPool;
+
+ConnPool* conn_pool_create(int size);
+void conn_pool_destroy(ConnPool* pool);
+
+// Returns a connected socket, or -1
+int conn_pool_get(ConnPool* pool, const char* ip, int port);
+void conn_pool_release(ConnPool* pool, int fd);
+void conn_pool_discard(ConnPool* pool, int fd);
+
+// Closes connections unused for more than timeout_sec; returns how many
+int conn_pool_cleanup_idle(ConnPool* pool, int timeout_sec);
+
+#endif // CONN_POOL_H
@@ -0,0 +1,41 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+#include "common.h"
+
+// When a Storage Server write counts as done (SS_DURABILITY):
+// - strict (default): each file is fsynced, renamed into place and its
+//   directory fsynced before the write is acknowledged.
+// - group: concurrent writers are committed together. The first to arrive
+//   flushes everything queued by the time it starts: it starts writeback
+//   of every file before waiting on any, renames them all and fsyncs each
+//   directory once. Writers arriving meanwhile form the next group. With
+//   SS_GROUP_COMMIT_US (default 0) it first waits that long for more to
+//   join. A write is still acknowledged only once it is on disk.
+// - relaxed: writeback is started but not waited for and directories are
+//   not synced; a crash can lose the most recent writes.
+
+#define DURABILITY_STRICT 0
+#define DURABILITY_GROUP 1
+#define DURABILITY_RELAXED 2
+
+typedef struct {
+    unsigned long long groups;   // Flushes done (strict: one per request)
+    unsigned long long requests; // Syncs and commits requested
+    unsigned long long dir_syncs;
+} DurabilityStats;
+
+void durability_init();
+int durability_mode();
+const char* durability_mode_name();
+
+// Make the data written to fd durable (history log appends)
+int durability_sync(int fd);
+
+// Finish a temporary file: sync it, close fd, rename tmp_path over path
+// and sync the directory. The temporary file is removed on failure.
+int durability_commit(int fd, const char* tmp_path, const char* path);
+
+void durability_get_stats(DurabilityStats* stats);
+
+#endif // DURABILITY_H
@@ -0,0 +1,69 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "common.h"
+#include <sys/types.h>
+
+// EXEC jobs run on the Storage Server that holds the file, on a fixed pool
+// of SS_EXEC_WORKERS (default 4) worker threads started with the server,
+// each with its own scratch directory under data/exec, emptied before every
+// job. At most SS_EXEC_QUEUE jobs (default 16) wait for a worker; more are
+// refused. Each job runs in its scratch directory as a new process group
+// with only PATH, HOME and LANG set, no new privileges, none of the
+// server's descriptors, stdin from /dev/null and at most:
+// - SS_EXEC_CPU_SEC (default 5) seconds of CPU time,
+// - SS_EXEC_MEMORY_MB (default 256) of address space (and per file),
+// - SS_EXEC_TIMEOUT_MS (default 10000) of wall-clock time,
+// - SS_EXEC_OUTPUT_MAX (default 1 MB) of combined stdout and stderr.
+// Going over a limit kills the whole process group.
+
+#define EXEC_EXITED 0        // exit_code holds the exit status
+#define EXEC_SIGNALED 1      // exit_code holds the signal (SIGXCPU: CPU limit)
+#define EXEC_TIMED_OUT 2
+#define EXEC_OUTPUT_LIMIT 3
+#define EXEC_ABORTED 4       // The output callback gave up (client went away)
+#define EXEC_SPAWN_FAILED 5
+
+// Output as it is produced; return -1 to stop the job
+typedef int (*ExecOutputFn)(void* ctx, const char* data, size_t len);
+
+typedef struct {
+    int status;
+    int exit_code;
+    long long wait_ms;   // Time spent queued
+    long long run_ms;
+    size_t output_bytes;
+} ExecResult;
+
+typedef struct {
+    int workers;
+    int queue_limit;
+    int queued;          // Waiting now
+    int running;
+    unsigned long long submitted;
+    unsigned long long rejected;
+    unsigned long long completed;  // Exited with status 0
+    unsigned long long failed;     // Any other outcome
+    unsigned long long timed_out;
+    unsigned long long wait_ms_total;
+    unsigned long long wait_ms_max;
+    unsigned long long run_ms_total;
+} ExecutorStats;
+
+void executor_init();
+
+// Claim a queue slot for a job about to be run. Returns its place in the
+// queue (0: a worker is free), or -1 if the queue is full.
+// A slot not passed to executor_run is handed back with executor_release.
+int executor_reserve();
+void executor_release();
+
+// Run script (len bytes) in the slot claimed by executor_reserve, passing
+// its output to out as it arrives. Blocks until the job is over.
+void executor_run(const char* script, size_t len, ExecOutputFn out, void* ctx,
+                  ExecResult* result);
+
+const char* executor_status_name(int status);
+void executor_get_stats(ExecutorStats* stats);
+
+#endif // EXECUTOR_H
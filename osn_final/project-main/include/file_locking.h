@@ -4,6 +4,17 @@
 #include <pthread.h>
 #include <glib.h>
 #include <stdbool.h>
+#include "common.h"
+
+// Waits for one file's lock. Every acquisition is also recorded in the
+// METRIC_LOCK_READ / METRIC_LOCK_WRITE metrics series.
+typedef struct {
+    char filename[MAX_FILENAME];
+    unsigned long long contended_reads;
+    unsigned long long contended_writes;
+    unsigned long long wait_us_total;
+    unsigned long long wait_us_max;
+} FileLockContention;
 
 // Structure to hold file lock information
 typedef struct {
@@ -37,4 +48,9 @@ void file_lock_dump();
 // Check if a file is currently locked
 bool file_is_locked(const char* filename);
 
+// Up to max files with the most total lock wait, most first; returns the
+// count. Files are tracked from their first contended acquisition, up to
+// LOCK_CONTENTION_FILES of them.
+int file_lock_top_contended(FileLockContention* out, int max);
+
 #endif // FILE_LOCKING_H
@@ -3,34 +3,58 @@
 
 #include "common.h"
 
-#define HASHMAP_SIZE 1024
+#include <stdatomic.h>
+
+#define HASHMAP_SEGMENT_BITS 6
+#define HASHMAP_SEGMENTS (1 << HASHMAP_SEGMENT_BITS)
 
 typedef struct HashNode {
-    char key[MAX_FILENAME];
-    void* value;
     struct HashNode* next;
+    void* value;
+    unsigned int hash;
+    char key[];  // NUL-terminated, allocated at the key's length
 } HashNode;
 
+// One independently locked, independently resized part of a map
 typedef struct {
-    HashNode* buckets[HASHMAP_SIZE];
     pthread_rwlock_t lock;
-    int size;
+    HashNode** buckets;
+    unsigned int mask;      // Bucket count - 1 (a power of two)
+    HashNode** old;         // Previous array while a resize drains it
+    unsigned int old_mask;
+    unsigned int migrated;  // Old buckets [0, migrated) already moved
+    int count;
+} HashSegment;
+
+typedef struct {
+    HashSegment segments[HASHMAP_SEGMENTS];
+    atomic_int size;
+    void (*free_value)(void*);  // Releases replaced and removed values
 } HashMap;
 
 // HashMap functions
-HashMap* hashmap_create();
+HashMap* hashmap_create();  // Values are released with free
+HashMap* hashmap_create_with(void (*free_value)(void*));
 void hashmap_destroy(HashMap* map);
 unsigned int hash(const char* key);
 void hashmap_put(HashMap* map, const char* key, void* value);
+// Grow the map up front for entries in total, so a bulk load does not
+// resize segments as it goes
+void hashmap_reserve(HashMap* map, int entries);
 void* hashmap_get(HashMap* map, const char* key);
 void hashmap_remove(HashMap* map, const char* key);
+void* hashmap_detach(HashMap* map, const char* key);  // Remove without freeing; returns the value
 int hashmap_contains(HashMap* map, const char* key);
 void hashmap_get_keys(HashMap* map, char keys[][MAX_FILENAME], int* count);
+// Call fn on every entry under each segment's read lock; fn must not modify
+// the map
+void hashmap_foreach(HashMap* map, void (*fn)(const char* key, void* value, void* ctx), void* ctx);
 
 // LRU Cache
 typedef struct LRUNode {
     char key[MAX_FILENAME];
     void* value;
+    size_t bytes;
     struct LRUNode* prev;
     struct LRUNode* next;
 } LRUNode;
@@ -39,16 +63,38 @@ typedef struct {
     LRUNode* head;
     LRUNode* tail;
     HashMap* map;
-    int capacity;
+    int capacity;        // Entry limit; <= 0 for none
     int size;
+    size_t bytes;        // Sum of the sizes given to lru_put_sized
+    size_t max_bytes;    // Byte budget; 0 for none
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    void (*free_value)(void*);  // Releases values that leave the cache
     pthread_mutex_t lock;
 } LRUCache;
 
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    int entries;
+    size_t bytes;
+} LRUStats;
+
 // LRU Cache functions
 LRUCache* lru_create(int capacity);
+LRUCache* lru_create_sized(int capacity, size_t max_bytes, void (*free_value)(void*));
 void lru_destroy(LRUCache* cache);
 void* lru_get(LRUCache* cache, const char* key);
+// Like lru_get, but retain(value) runs before the lock is dropped so the
+// value cannot be released by a concurrent eviction
+void* lru_get_retain(LRUCache* cache, const char* key, void (*retain)(void*));
 void lru_put(LRUCache* cache, const char* key, void* value);
+// Insert a value accounting bytes against the budget, evicting from the
+// tail as needed. A value larger than the whole budget is released at once.
+void lru_put_sized(LRUCache* cache, const char* key, void* value, size_t bytes);
 void lru_remove(LRUCache* cache, const char* key);
+void lru_get_stats(LRUCache* cache, LRUStats* stats);
 
 #endif // HASHMAP_H
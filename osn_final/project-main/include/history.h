@@ -0,0 +1,113 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "common.h"
+
+// Version log of a file (Storage Server side), data/history/<file>.log.
+//
+// Each record turns one version of the file into the next as a list of
+// steps applied in order: at offset, old bytes become new bytes. A write
+// commit records only the sentences it rewrote. Keeping the old bytes makes
+// every record reversible, so:
+// - UNDO reverts the newest change not undone yet, as a new record; repeated
+//   UNDOs walk back through the history.
+// - A checkpoint is a named pointer (data/checkpoints/<file>_<tag>.ckpt
+//   holding "<time> @<seq>") to a version; viewing or reverting to it
+//   replays the records after it backwards from the current content.
+//   Checkpoint files written before the log hold the full content instead,
+//   and are still read.
+//
+// Records carry a checksum and the file size they produce, so a torn tail
+// or a log that no longer matches the file is dropped instead of replayed.
+// The log keeps SS_HISTORY_DEPTH (default 100) undoable changes; a
+// background pass cuts older records once there are twice as many,
+// writing the content of any checkpoint that pointed before the cut into
+// its checkpoint file. Changes that replace the whole file from elsewhere
+// (upload of a large file, replication, migration, delete) call
+// history_reset() first.
+//
+// The caller holds the file's write lock for every function that takes a
+// filename, except history_read() and history_checkpoint_find(), which only
+// need the read lock.
+
+#define HISTORY_EDIT 1    // A write
+#define HISTORY_UNDO 2    // Reverts record target
+#define HISTORY_REVERT 3  // Back to the version of a checkpoint
+
+typedef struct {
+    size_t offset;
+    size_t old_len;
+    size_t new_len;
+    const char* old_bytes;
+    const char* new_bytes;
+} HistoryStep;
+
+typedef struct {
+    uint64_t seq;         // Version this record produces
+    uint64_t target;      // UNDO: the record reverted
+    uint64_t size_after;  // File size once applied
+    int kind;
+    int count;
+    HistoryStep* steps;
+    char* raw;            // The record as stored
+    size_t raw_len;
+} HistoryRecord;
+
+typedef struct {
+    int count;
+    HistoryRecord* records;  // Oldest first
+} History;
+
+// Reads SS_HISTORY_DEPTH and starts the compaction thread
+void history_init();
+
+// The version the file is at: seq of its newest record, 0 without history
+uint64_t history_version(const char* filename);
+
+// Append a record producing version history_version() + 1. *mark lets
+// history_cancel() take it back if the file write then fails.
+int history_append(const char* filename, int kind, uint64_t target,
+                   const HistoryStep* steps, int count, uint64_t size_after, off_t* mark);
+void history_cancel(const char* filename, off_t mark);
+
+// The log of a file whose content is current_size bytes; empty (not NULL)
+// when there is none or it does not match. NULL if out of memory. Cuts a
+// torn tail off the log, and drops a log that does not match (writing the
+// content of its checkpoints), so this needs the write lock.
+History* history_load(const char* filename, size_t current_size);
+
+// history_load() for callers holding only the read lock: changes nothing
+// on disk. If the log needs one of those repairs, returns NULL with
+// *repair set; history_load() under the write lock then does it.
+History* history_read(const char* filename, size_t current_size, int* repair);
+void history_free(History* history);
+
+// Index of the record UNDO would revert, or -1
+int history_undo_target(const History* history);
+
+// Steps that revert records first..last (indices), newest first; free()
+// the array, the bytes belong to history
+HistoryStep* history_inverse(const History* history, int first, int last, int* count);
+
+// Apply steps to content (len bytes, grown with realloc as needed)
+int history_apply(char** content, size_t* len, const HistoryStep* steps, int count);
+
+// Content of version seq, rebuilt from content (the current version)
+char* history_rebuild(const History* history, const char* content, size_t len,
+                      uint64_t seq, size_t* out_len);
+
+// Write the content of the checkpoints pointing into the log into their
+// files and delete the log. Call before replacing or removing the file.
+void history_reset(const char* filename);
+
+// After the file was renamed from `from` to `to`: the log follows it, and
+// checkpoints of the old name get their content
+void history_rename(const char* from, const char* to);
+
+// Checkpoints
+int history_checkpoint(const char* filename, const char* tag);
+// 1 and *seq for a pointer checkpoint, 0 for one holding its content (at
+// *offset in the file), -1 if there is no such checkpoint
+int history_checkpoint_find(const char* filename, const char* tag, uint64_t* seq, long* offset);
+
+#endif // HISTORY_H
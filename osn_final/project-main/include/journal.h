@@ -0,0 +1,62 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "common.h"
+
+// Append-only write-ahead journal of text records (one per line, no '\n'
+// inside a record). Each line carries a checksum so a torn tail left by a
+// crash is detected and cut off on open.
+//
+// Appends are group committed: journal_append() only buffers the record
+// and returns its sequence number; journal_wait() makes it durable. The
+// first waiter writes and fsyncs everything buffered so far on behalf of
+// all waiters, so concurrent mutations share one fsync.
+
+typedef struct {
+    int fd;
+    char path[MAX_PATH];
+    int durable;       // fdatasync each group (0: write only)
+    int failed;        // A write failed; further waits report it
+    int records;       // Records in the current file
+
+    char* pending;     // Buffered, not yet written records
+    size_t pending_len;
+    size_t pending_cap;
+    char* spare;       // Buffer handed back by the last flush
+    size_t spare_cap;
+
+    unsigned long long appended_seq;
+    unsigned long long durable_seq;
+    int flushing;      // A waiter is writing outside the lock
+
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+} Journal;
+
+// Replay every intact record of the journal at path through apply, cut off
+// a torn tail, and open it for appending. A missing file starts empty.
+Journal* journal_open(const char* path, int durable,
+                      void (*apply)(const char* record, void* ctx), void* ctx);
+void journal_close(Journal* journal);
+
+// Replay a journal read-only; returns the number of records applied
+int journal_replay(const char* path, void (*apply)(const char* record, void* ctx), void* ctx);
+
+// Buffer a record; returns its sequence number for journal_wait(). Callers
+// that need records in a particular order serialize their appends.
+unsigned long long journal_append(Journal* journal, const char* record);
+
+// Block until record seq is on disk. Returns 0, or -1 if a write failed.
+int journal_wait(Journal* journal, unsigned long long seq);
+
+// Write out what is buffered, move the current file to old_path and
+// continue in a fresh one. Meant for compaction: the caller takes its
+// snapshot and rotates under the same lock that orders its appends, so the
+// snapshot covers every record in old_path (including any that could not
+// be written). Returns 0, or -1 if the journal stays in the current file.
+int journal_rotate(Journal* journal, const char* old_path);
+
+// Records appended to the current file (including replayed ones)
+int journal_records(Journal* journal);
+
+#endif // JOURNAL_H
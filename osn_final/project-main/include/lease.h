@@ -0,0 +1,63 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include "common.h"
+
+// Write leases on sentence ranges.
+// The Name Server grants a user a lease on sentences first..last of a file
+// (LOCK_ACQUIRE) and signs it with a key it shares with the Storage Servers
+// (LEASE_KEY). The client hands the lease to the SS with its WRITE_COMMIT,
+// and the SS checks the signature, expiry and range itself, so a commit
+// needs no call back to the Name Server. A lease that is never released
+// (crashed client) stops counting at its expiry.
+//
+// Expiry is wall-clock milliseconds, so the NM and SS clocks must roughly
+// agree; an SS running ahead only ends leases early.
+//
+// Text form, as carried in messages: "lease|id|first|last|expires_ms|mac"
+
+#define LEASE_PREFIX "lease|"
+#define LEASE_MAX_SENTENCES 32  // Sentences one WRITE_COMMIT may edit
+
+typedef struct {
+    unsigned long long id;
+    int first;
+    int last;
+    long long expires_ms;
+    uint64_t mac;
+} WriteLease;
+
+// Load the signing key from LEASE_KEY; -1 (logged as component) if it is
+// not set. There is no default key: servers refuse to start without one.
+int lease_init(const char* component);
+
+long long lease_now_ms();
+
+// Sign / check a lease for filename and username
+void lease_sign(WriteLease* lease, const char* filename, const char* username);
+int lease_valid(const WriteLease* lease, const char* filename, const char* username);
+
+int lease_format(const WriteLease* lease, char* out, size_t len);
+// Parses text starting with LEASE_PREFIX; returns the length used, or -1
+int lease_parse(const char* text, WriteLease* lease);
+
+// Peer requests (CMD_REPLICATE between Storage Servers, CMD_MIGRATE from
+// the Name Server) arrive on the public client port, so they are signed
+// under the same LEASE_KEY: the payload starts with the fixed-length line
+// "peer|<expires_ms, 13 digits>|<mac, 16 hex>\n", a MAC over the command,
+// filename, expiry and the rest of the payload. Requests without a valid
+// one are refused.
+#define PEER_PREFIX "peer|"
+#define PEER_AUTH_LEN 36
+#define PEER_AUTH_MS 30000  // How long a signed request stays valid
+
+// Write the PEER_AUTH_LEN-byte line for payload (what follows it) into out
+void peer_sign(int command, const char* filename, const char* payload, size_t len, char* out);
+// 1 if payload (len bytes, starting with the line) carries a valid, unexpired
+// signature for command and filename
+int peer_valid(int command, const char* filename, const char* payload, size_t len);
+
+// SipHash-2-4 of data under a 16-byte key
+uint64_t siphash24(const uint8_t key[16], const void* data, size_t len);
+
+#endif // LEASE_H
@@ -0,0 +1,40 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include "common.h"
+
+// Asynchronous logger behind log_message().
+// - Each thread formats its lines into its own lock-free ring buffer; a
+//   single background thread drains the rings, echoes lines to stdout and
+//   appends them to logs/<component>.log, keeping the files open.
+// - Lines below the configured level are dropped before any formatting.
+// - A full ring drops the line rather than blocking the caller; the number
+//   of dropped lines is logged by the LOGGER component once there is room.
+//
+// Tunables (environment, read on first use):
+//   LOG_LEVEL       DEBUG, INFO (default), WARNING or ERROR
+//   LOG_RING_SLOTS  lines buffered per thread (default 128)
+//   LOG_FLUSH_MS    flusher interval (default 20)
+//   LOG_SYNC=1      write every line synchronously (debugging crashes)
+
+typedef enum {
+    LOG_DEBUG = 0,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR
+} LogLevel;
+
+// Change the minimum level at runtime; returns -1 for an unknown name
+int log_set_level(const char* level);
+
+// 1 if a line at this level would be kept (cheap; lets callers skip
+// building expensive arguments)
+int log_enabled(const char* level);
+
+// Write out everything buffered so far (blocks until done)
+void log_flush();
+
+// Lines dropped because a ring was full, since startup
+unsigned long log_dropped_count();
+
+#endif // LOGGER_H
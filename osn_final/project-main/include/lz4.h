@@ -0,0 +1,23 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "common.h"
+
+// LZ4 block format (the raw blocks inside .lz4 frames, without the frame):
+// each sequence is a token, literal bytes and a back-reference of at
+// least 4 bytes up to 64 KB behind. Blocks are independent, so a block of
+// at most 64 KB can be decoded on its own. Fast on both sides rather than
+// small; natural-language text typically shrinks to a third or half.
+
+// Largest compressed size of len input bytes
+size_t lz4_compress_bound(size_t len);
+
+// Compress len bytes of src into dst (cap bytes); the compressed length,
+// or 0 if it does not fit
+size_t lz4_compress(const char* src, size_t len, char* dst, size_t cap);
+
+// Decompress a whole block of len bytes into dst (cap bytes); the
+// decompressed length, or -1 if the block is malformed or does not fit
+long lz4_decompress(const char* src, size_t len, char* dst, size_t cap);
+
+#endif // LZ4_H
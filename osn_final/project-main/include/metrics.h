@@ -0,0 +1,65 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+
+// Request counters and latency histograms.
+// Each thread records into its own shard without locks; a report adds up
+// the shards of live threads and what exited threads left behind.
+// Latencies are in microseconds in HDR-style buckets: exact below 16 us,
+// then 16 buckets per power of two, so quantiles are within 1/16 (6.25%)
+// of the true value. Reports are Prometheus text (exposition format 0.0.4),
+// served by CMD_METRICS and, with metrics_http_start, over HTTP.
+
+// Series: one per command code, then these
+#define METRICS_COMMANDS 64
+#define METRIC_HEARTBEAT (METRICS_COMMANDS + 0)
+#define METRIC_REGISTER (METRICS_COMMANDS + 1)
+#define METRIC_LOCK_READ (METRICS_COMMANDS + 2)   // File lock waits
+#define METRIC_LOCK_WRITE (METRICS_COMMANDS + 3)
+#define METRICS_SERIES (METRICS_COMMANDS + 4)
+
+#define METRICS_SUB_BUCKETS 16
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS * 34)  // Up to 2^37 us (~38 hours)
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long errors;   // Lock series: acquisitions that had to wait
+    unsigned long long sum_us;
+    unsigned long long max_us;
+    unsigned long long buckets[METRICS_BUCKETS];
+} MetricsSeries;
+
+// Growing text buffer for reports
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} MetricsText;
+
+void metrics_record(int series, long long usec, int error);
+
+// Series totals over all threads; 0 if nothing was recorded
+int metrics_snapshot(int series, MetricsSeries* out);
+
+// Value at quantile q (0..1) of a snapshot, in microseconds
+unsigned long long metrics_quantile(const MetricsSeries* series, double q);
+
+void metrics_text_printf(MetricsText* text, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void metrics_text_free(MetricsText* text);
+
+// Copy value into out escaped for use inside a quoted label value
+void metrics_escape_label(const char* value, char* out, size_t len);
+
+// Append the request and lock series, named <prefix>_...
+void metrics_render(MetricsText* text, const char* prefix);
+
+// Serve render's report at http://<any>:port/metrics from a background
+// thread; -1 if the port cannot be bound
+typedef void (*metrics_render_fn)(MetricsText* text);
+int metrics_http_start(int port, metrics_render_fn render);
+
+const char* metrics_command_name(int command);
+
+#endif // METRICS_H
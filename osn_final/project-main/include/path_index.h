@@ -0,0 +1,66 @@
+#ifndef PATH_INDEX_H
+#define PATH_INDEX_H
+
+#include "common.h"
+#include "hashmap.h"
+
+// Hierarchical index of registry names for the Name Server.
+// - A tree with one node per path component; each node keeps its children
+//   sorted, so listing a folder or resuming after a cursor costs a binary
+//   search plus the entries returned.
+// - A per-owner sorted name set answers "files owned by X" without a scan.
+// - Folders exist implicitly while they contain files. A name ending in
+//   '/' (a folder marker, e.g. from CREATEFOLDER) keeps an empty folder.
+// Listings visit names in index order: component by component, bytewise
+// within a component. Callbacks return nonzero to stop (page full).
+
+typedef struct PathNode {
+    char* name;                  // Component; "" for the root
+    int is_file;
+    int is_folder;               // Has a folder marker
+    struct PathNode* parent;
+    struct PathNode** children;  // Sorted by name
+    int child_count;
+    int child_capacity;
+} PathNode;
+
+typedef struct {
+    char** names;  // Sorted
+    int count;
+    int capacity;
+} NameSet;
+
+typedef struct {
+    PathNode root;
+    HashMap* owners;  // owner -> NameSet*
+    pthread_rwlock_t lock;
+} PathIndex;
+
+// fn(name, is_folder, ctx): name is the child component (folder listing)
+// or the full registry name (walks and owner listings)
+typedef int (*path_index_fn)(const char* name, int is_folder, void* ctx);
+
+PathIndex* path_index_create();
+void path_index_destroy(PathIndex* index);
+
+void path_index_add(PathIndex* index, const char* name, const char* owner);
+void path_index_remove(PathIndex* index, const char* name, const char* owner);
+
+// 1 if folder (no trailing '/') exists, explicitly or because it has files
+int path_index_is_folder(PathIndex* index, const char* folder);
+
+// Children of folder ("" for the top level) after the child named after.
+// Returns -1 if the folder does not exist.
+int path_index_list(PathIndex* index, const char* folder, const char* after,
+                    path_index_fn fn, void* ctx);
+
+// Every file whose name starts with prefix, after the name after
+void path_index_walk(PathIndex* index, const char* prefix, const char* after,
+                     path_index_fn fn, void* ctx);
+
+// Files owned by owner whose name starts with prefix (bytewise order),
+// after the name after
+void path_index_owned(PathIndex* index, const char* owner, const char* prefix,
+                      const char* after, path_index_fn fn, void* ctx);
+
+#endif // PATH_INDEX_H
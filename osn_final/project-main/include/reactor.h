@@ -0,0 +1,21 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "common.h"
+
+// Edge-triggered epoll event loop: one thread owns every client socket and
+// buffers incoming bytes; complete requests are handed to a fixed pool of
+// worker threads. Requests on one connection are handled strictly in order.
+
+// Fills in response for msg; the reactor sends it afterwards
+typedef void (*reactor_handler_fn)(Message* msg, Message* response);
+
+// Run the event loop on an already listening socket until reactor_stop().
+// Returns 0 on clean shutdown, -1 if the loop could not be started.
+int reactor_run(int listen_fd, reactor_handler_fn handler, int num_workers);
+void reactor_stop();
+
+// Worker count used when none is configured (online cores)
+int reactor_default_workers();
+
+#endif // REACTOR_H
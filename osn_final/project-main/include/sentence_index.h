@@ -0,0 +1,61 @@
+#ifndef SENTENCE_INDEX_H
+#define SENTENCE_INDEX_H
+
+#include "common.h"
+
+// Byte-offset index of the sentences in a file. Spans follow the same rules
+// as parse_sentences(): a sentence ends after '.', '!' or '?' (or when it
+// reaches MAX_SENTENCE_LENGTH - 1 bytes) and is trimmed of surrounding
+// whitespace. An index is one malloc'd block and is released with free().
+
+typedef struct {
+    size_t offset;  // First byte of the trimmed sentence
+    size_t length;
+    int words;
+} SentenceSpan;
+
+typedef struct {
+    // Identity of the file contents this index describes
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    int total_words;
+    int open_tail;  // Last span is an unterminated sentence reaching EOF
+    int count;
+    int capacity;
+    SentenceSpan spans[];
+} SentenceIndex;
+
+// Result of splicing a rewritten sentence into a file
+typedef struct {
+    size_t offset;      // Where the old sentence bytes start in the file
+    size_t old_length;  // Old bytes replaced (0 when appending)
+    int separator;      // 1 if a ' ' goes before the new bytes (appending)
+} SentenceSplice;
+
+// Index an in-memory text (no file identity)
+SentenceIndex* sentence_index_from_text(const char* text, size_t len);
+
+// Index of the file at path, from the cache when its size/mtime/inode still
+// match. Returns a private copy (free() it) or NULL if the file is missing.
+// The caller holds the file's lock.
+SentenceIndex* sentence_index_load(const char* filename, const char* path);
+
+// Index after replacing sentence `sentence` (== count to append) of the
+// file open as fd with text[0..len). Only the edited region is re-tokenized,
+// up to the first boundary where it lines up again with the old index.
+SentenceIndex* sentence_index_splice(const SentenceIndex* idx, int fd, int sentence,
+                                     const char* text, size_t len, SentenceSplice* splice);
+
+// Where replacing sentence `sentence` (== count to append) with len bytes
+// goes in the file, without re-tokenizing (for several splices at once)
+void sentence_index_splice_point(const SentenceIndex* idx, int sentence, size_t len,
+                                 SentenceSplice* splice);
+
+// Install idx (ownership passes to the cache) for a file whose new contents
+// have identity st; invalidate drops any cached index
+void sentence_index_store(const char* filename, SentenceIndex* idx, const struct stat* st);
+void sentence_index_invalidate(const char* filename);
+
+#endif // SENTENCE_INDEX_H
@@ -2,8 +2,15 @@
 #define SENTENCE_PARSER_H
 
 #include "common.h"
+#include "tokenizer.h"
 
-// Sentence parsing functions
+// Word spans (whitespace-separated) of text[0..len) into spans, at most
+// max_spans; returns the count. Nothing is copied. Sentence spans come
+// from sentence_index_from_text().
+int tokenize_words(const char* text, size_t len, TextSpan* spans, int max_spans);
+
+// Sentence parsing into copies, for callers that need NUL-terminated
+// strings. Words longer than MAX_WORD_LENGTH - 1 bytes are truncated.
 int parse_sentences(const char* text, char sentences[][MAX_SENTENCE_LENGTH], int max_sentences);
 int parse_words(const char* sentence, char words[][MAX_WORD_LENGTH], int max_words);
 void rebuild_text(char sentences[][MAX_SENTENCE_LENGTH], int num_sentences, char* output, int max_len);
@@ -0,0 +1,47 @@
+#ifndef SHARD_MAP_H
+#define SHARD_MAP_H
+
+#include "common.h"
+
+// Partitioning of the file namespace across Name Server shards.
+// Each shard owns the arcs of a hash ring ending at its virtual nodes; a
+// filename belongs to the first virtual node at or after its hash. Points
+// are derived from the shard's address, so adding a shard only takes over
+// the keys that fall on its new arcs (about 1/N of them).
+//
+// The map is written "host:port,host:port,..." (NM_SHARDS); without it
+// there is one shard at 127.0.0.1:NM_PORT, the single Name Server setup.
+
+#define SHARD_MAX 32
+#define SHARD_VNODES 128   // Virtual nodes per shard
+
+typedef struct {
+    char host[64];
+    int port;
+} ShardAddr;
+
+typedef struct {
+    uint64_t point;
+    int shard;
+} ShardPoint;
+
+typedef struct {
+    int count;
+    ShardAddr shards[SHARD_MAX];
+    ShardPoint* ring;      // Sorted by point
+    int ring_size;
+} ShardMap;
+
+// NULL if spec is empty or malformed
+ShardMap* shard_map_parse(const char* spec);
+// NM_SHARDS, or the single local Name Server
+ShardMap* shard_map_from_env();
+void shard_map_free(ShardMap* map);
+
+// Shard owning key (a registry name)
+int shard_map_lookup(const ShardMap* map, const char* key);
+// Index of host:port in the map, or -1
+int shard_map_find(const ShardMap* map, const char* host, int port);
+void shard_map_format(const ShardMap* map, char* out, size_t len);
+
+#endif // SHARD_MAP_H
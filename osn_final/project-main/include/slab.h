@@ -0,0 +1,80 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "common.h"
+#include "metrics.h"
+
+// Fixed-size object pools and per-thread request arenas.
+//
+// A SlabPool hands out objects of one size carved from slabs of at least
+// SLAB_SIZE bytes. Each thread keeps up to SLAB_CACHE_OBJECTS free objects
+// per pool and takes the pool's lock only to refill or spill half of them,
+// so allocation on hot paths does not contend. Slabs are never given back:
+// a pool's footprint is its high-water mark. SLAB_DISABLE=1 makes every
+// pool use malloc and free directly, for memory checkers.
+//
+// An Arena is a bump allocator for scratch memory that lives no longer
+// than one request. Each thread has its own (request_arena()); a request
+// loop calls arena_reset() after every request, which frees everything
+// allocated since at once and keeps the first block for the next request.
+// Allocations larger than a block (ARENA_BLOCK_KB, default 64) get a
+// block of their own.
+
+#define SLAB_MAX_POOLS 16
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_CACHE_OBJECTS 32
+
+typedef struct SlabPool SlabPool;
+
+typedef struct {
+    const char* name;
+    size_t object_size;
+    unsigned long long allocs;
+    unsigned long long frees;
+    long long in_use;
+    size_t cached;           // Free objects held in thread caches
+    size_t slabs;
+    size_t reserved_bytes;
+} SlabStats;
+
+// Pools live for the whole process; NULL once SLAB_MAX_POOLS exist
+SlabPool* slab_pool_create(const char* name, size_t object_size);
+void* slab_alloc(SlabPool* pool);
+void* slab_zalloc(SlabPool* pool);   // Zeroed
+void slab_free(SlabPool* pool, void* object);
+int slab_get_stats(SlabStats* out, int max);  // One entry per pool
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Written only by the owning thread; the counters are read by reports
+typedef struct {
+    ArenaBlock* blocks;   // Newest first; the last one is kept by arena_reset
+    size_t used;          // Bytes handed out since the last reset
+    unsigned long long allocs;
+    unsigned long long resets;
+    unsigned long long extra_blocks;
+    size_t reserved_bytes;
+    size_t peak_bytes;
+} Arena;
+
+typedef struct {
+    int arenas;                       // Threads that have one
+    unsigned long long allocs;
+    unsigned long long resets;
+    unsigned long long extra_blocks;  // Allocated beyond a thread's first block
+    size_t reserved_bytes;
+    size_t peak_request_bytes;        // Most used between two resets
+} ArenaStats;
+
+// The calling thread's arena, created on first use and freed when the
+// thread exits
+Arena* request_arena();
+// 16-byte aligned; NULL if out of memory
+void* arena_alloc(Arena* arena, size_t len);
+void arena_reset(Arena* arena);
+void arena_get_stats(ArenaStats* stats);
+
+// Append pool and arena counters, named <prefix>_slab_... and <prefix>_arena_...
+void slab_render(MetricsText* text, const char* prefix);
+
+#endif // SLAB_H
@@ -0,0 +1,34 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include "common.h"
+
+// Byte classification behind the sentence and word tokenizers. Text is
+// looked at 64 bytes at a time and turned into bitmasks (bit i describes
+// byte i), which the tokenizers walk with ctz/popcount instead of testing
+// each byte. The classifier has a scalar kernel and vector ones: SSE2
+// (every x86-64), AVX2 (used when the CPU has it, checked at run time) and
+// NEON (every AArch64). The best one available is picked on first use;
+// TOKENIZER_KERNEL=scalar|sse2|avx2|neon forces one. Whitespace is the C
+// locale isspace() set; sentence delimiters are '.', '!' and '?'.
+
+// A run of bytes in a caller's buffer
+typedef struct {
+    size_t offset;
+    size_t length;
+} TextSpan;
+
+// Masks of p[0..len), len <= 64. Bits at and past len count as
+// whitespace and never as delimiters.
+void tok_classify(const char* p, size_t len, uint64_t* space, uint64_t* delim);
+
+// Bits 0..n-1 (n <= 64)
+static inline uint64_t tok_bits_below(size_t n) {
+    return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+// The kernel in use, and a way to pick one (-1 if this CPU or build lacks it)
+const char* tokenizer_kernel();
+int tokenizer_use_kernel(const char* name);
+
+#endif // TOKENIZER_H
@@ -1,17 +1,55 @@
 #include "../include/common.h"
+#include "../include/shard_map.h"
+#include "../include/conn_pool.h"
+#include "../include/hashmap.h"
+#include "../include/lease.h"
 #include <signal.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <poll.h>
 
-int nm_socket = -1;
+int nm_socket = -1;      // Name Server the current request goes to
 char username[MAX_USERNAME];
 int running = 1;
 
+// Name Server shards: requests about a file go to the shard owning its
+// name; listings ask every shard. shard_sockets are connected on first use.
+ShardMap* shard_map = NULL;
+int shard_sockets[SHARD_MAX];
+int bootstrap_shard = 0;
+
+// Storage Server connections kept open between commands
+ConnPool* ss_pool = NULL;
+
+// Where files were found, so that requests can go straight to their Storage
+// Server. An entry is trusted for the lease the Name Server gave with it and
+// carries the SS's location generation, which the SS checks: when the SS
+// answers ERR_STALE_LOCATION the entry is dropped and the request goes out
+// again. CLIENT_LOCATION_CACHE (default 1024) entries; 0 turns it off.
+typedef struct {
+    char ip[64];
+    int port;
+    uint16_t gen;
+    long long expires_ms;
+} CachedLocation;
+
+LRUCache* location_cache = NULL;
+
 void cleanup_client() {
     running = 0;
-    if (nm_socket >= 0) {
-        close(nm_socket);
+    for (int i = 0; shard_map && i < shard_map->count; i++) {
+        if (shard_sockets[i] >= 0) {
+            close(shard_sockets[i]);
+            shard_sockets[i] = -1;
+        }
     }
+    shard_map_free(shard_map);
+    shard_map = NULL;
+    nm_socket = -1;
+    conn_pool_destroy(ss_pool);
+    ss_pool = NULL;
+    lru_destroy(location_cache);
+    location_cache = NULL;
 }
 
 void signal_handler_client(int signum) {
@@ -21,46 +59,31 @@ void signal_handler_client(int signum) {
     exit(0);
 }
 
-int connect_to_nm() {
-    int retry_count = 0;
-    int max_retries = 3;
+// Connect to one Name Server and register the user there; -1 on failure
+static int open_nm_connection(const char* host, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
     
-    while (retry_count < max_retries) {
-        nm_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (nm_socket < 0) {
-            printf("ERROR: Failed to create socket\n");
-            return -1;
-        }
-        
-        // Set socket timeout
-        struct timeval timeout;
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
-        setsockopt(nm_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-        setsockopt(nm_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // Set socket timeout
+    struct timeval timeout;
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
     
     struct sockaddr_in nm_addr;
     memset(&nm_addr, 0, sizeof(nm_addr));
     nm_addr.sin_family = AF_INET;
-    nm_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    nm_addr.sin_port = htons(NM_PORT);
+    nm_addr.sin_addr.s_addr = inet_addr(host);
+    nm_addr.sin_port = htons(port);
     
-    if (connect(nm_socket, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
-        if (retry_count < max_retries - 1) {
-            printf("Connection failed, retrying (%d/%d)...\n", retry_count + 1, max_retries);
-            close(nm_socket);
-            retry_count++;
-            sleep(2);
-            continue;
-        }
-        printf("ERROR: Failed to connect to Name Server after %d attempts: %s\n", 
-               max_retries, strerror(errno));
-        close(nm_socket);
+    if (connect(sock, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
+        close(sock);
         return -1;
     }
     
-    printf("Connected to Name Server\n\n");
-    
     // Register user
     Message msg;
     memset(&msg, 0, sizeof(Message));
@@ -68,62 +91,215 @@ int connect_to_nm() {
     strncpy(msg.username, username, MAX_USERNAME - 1);
     snprintf(msg.data, BUFFER_SIZE, "127.0.0.1|0");
     
-    send_message(nm_socket, &msg);
+    send_message(sock, &msg);
     
     Message response;
-    if (receive_message(nm_socket, &response) >= 0 && response.error_code == SUCCESS) {
-        printf("Registered as: %s\n\n", username);
-        return 0;
-    } else {
-        printf("ERROR: Failed to register with Name Server\n");
-        close(nm_socket);
+    if (receive_message(sock, &response) < 0 || response.error_code != SUCCESS) {
+        close(sock);
         return -1;
     }
-    }
-    
-    return -1;  // Should never reach here
+    return sock;
 }
 
-void cmd_view(char* args) {
+// Ask the bootstrap Name Server for the shard map; an older server without
+// one is the only shard
+static void load_shard_map() {
+    for (int i = 0; i < SHARD_MAX; i++) {
+        shard_sockets[i] = -1;
+    }
+    
     Message msg;
     memset(&msg, 0, sizeof(Message));
     msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_VIEW;
+    msg.command = CMD_SHARD_MAP;
     strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.data, args, BUFFER_SIZE - 1);
     
     send_message(nm_socket, &msg);
     
     Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n");
-        return;
+    if (receive_message(nm_socket, &response) >= 0 && response.error_code == SUCCESS) {
+        shard_map = shard_map_parse(response.data);
     }
     
-    if (response.error_code != SUCCESS) {
-        printf("ERROR: %s\n", get_error_message(response.error_code));
-        return;
+    bootstrap_shard = shard_map ? shard_map_find(shard_map, "127.0.0.1", NM_PORT) : -1;
+    if (bootstrap_shard < 0) {
+        shard_map_free(shard_map);
+        char single[64];
+        snprintf(single, sizeof(single), "127.0.0.1:%d", NM_PORT);
+        shard_map = shard_map_parse(single);
+        bootstrap_shard = 0;
     }
+    shard_sockets[bootstrap_shard] = nm_socket;
     
-    if (strlen(response.data) == 0) {
-        printf("No files found.\n");
-        return;
+    if (shard_map->count > 1) {
+        printf("Name Server shards: %d\n\n", shard_map->count);
+    }
+}
+
+// Point nm_socket at a shard, connecting to it on first use
+static int use_shard(int shard) {
+    if (shard_sockets[shard] < 0) {
+        shard_sockets[shard] = open_nm_connection(shard_map->shards[shard].host,
+                                                  shard_map->shards[shard].port);
+        if (shard_sockets[shard] < 0) {
+            printf("ERROR: Name Server shard %s:%d unavailable\n\n",
+                   shard_map->shards[shard].host, shard_map->shards[shard].port);
+            return -1;
+        }
     }
+    nm_socket = shard_sockets[shard];
+    return 0;
+}
+
+int connect_to_nm() {
+    int max_retries = 3;
     
-    printf("Files:\n");
-    char* token = strtok(response.data, "|");
-    while (token != NULL) {
-        if (strlen(token) > 0) {
-            printf("--> %s\n", token);
-            
-            // Skip owner, word_count, char_count if present
-            token = strtok(NULL, "|");  // owner
-            token = strtok(NULL, "|");  // word_count
-            token = strtok(NULL, "|");  // char_count
+    for (int retry_count = 0; retry_count < max_retries; retry_count++) {
+        nm_socket = open_nm_connection("127.0.0.1", NM_PORT);
+        if (nm_socket >= 0) {
+            printf("Connected to Name Server\n\n");
+            printf("Registered as: %s\n\n", username);
+            load_shard_map();
+            return 0;
         }
-        token = strtok(NULL, "|");
+        
+        if (retry_count < max_retries - 1) {
+            printf("Connection failed, retrying (%d/%d)...\n", retry_count + 1, max_retries);
+            sleep(2);
+        }
+    }
+    
+    printf("ERROR: Failed to connect to Name Server after %d attempts: %s\n",
+           max_retries, strerror(errno));
+    return -1;
+}
+
+// Growable list of output lines, so listings from several shards can be
+// printed in one sorted sequence
+typedef struct {
+    char** lines;
+    int count;
+    int capacity;
+} LineList;
+
+static void line_list_add(LineList* list, const char* line) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        char** grown = (char**)realloc(list->lines, capacity * sizeof(char*));
+        if (!grown) return;
+        list->lines = grown;
+        list->capacity = capacity;
+    }
+    list->lines[list->count++] = strdup(line);
+}
+
+static int compare_lines(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void line_list_print(LineList* list, const char* prefix, int unique) {
+    qsort(list->lines, list->count, sizeof(char*), compare_lines);
+    for (int i = 0; i < list->count; i++) {
+        if (!unique || i == 0 || strcmp(list->lines[i], list->lines[i - 1]) != 0) {
+            printf("%s%s\n", prefix, list->lines[i]);
+        }
+    }
+}
+
+static void line_list_free(LineList* list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->lines[i]);
+    }
+    free(list->lines);
+    list->lines = NULL;
+    list->count = 0;
+}
+
+// Lists files page by page: each Name Server shard returns as many entries
+// as fit in one reply plus a cursor to continue from. -a lists every file
+// rather than only your own, -l shows owner and counts; prefix narrows the
+// list.
+void cmd_view(const char* flags, const char* prefix) {
+    int details = strchr(flags, 'l') != NULL;
+    LineList files = {NULL, 0, 0};
+    
+    for (int shard = 0; shard < shard_map->count; shard++) {
+        if (use_shard(shard) < 0) {
+            continue;
+        }
+        
+        char cursor[MAX_FILENAME] = "";
+        do {
+            Message msg;
+            memset(&msg, 0, sizeof(Message));
+            msg.msg_type = MSG_COMMAND;
+            msg.command = CMD_VIEW;
+            strncpy(msg.username, username, MAX_USERNAME - 1);
+            snprintf(msg.data, BUFFER_SIZE, "%s|%s|%s", flags, prefix, cursor);
+            
+            send_message(nm_socket, &msg);
+            
+            Message response;
+            if (receive_message(nm_socket, &response) < 0) {
+                printf("ERROR: Communication failed\n");
+                line_list_free(&files);
+                return;
+            }
+            
+            if (response.error_code != SUCCESS) {
+                printf("ERROR: %s\n", get_error_message(response.error_code));
+                line_list_free(&files);
+                return;
+            }
+            
+            // name|owner|words|chars| per file
+            char* save = NULL;
+            char* name = strtok_r(response.data, "|", &save);
+            while (name != NULL) {
+                char* owner = strtok_r(NULL, "|", &save);
+                char* words = strtok_r(NULL, "|", &save);
+                char* chars = strtok_r(NULL, "|", &save);
+                
+                char line[MAX_FILENAME + MAX_USERNAME + 64];
+                if (details && owner && words && chars) {
+                    snprintf(line, sizeof(line), "%s (owner: %s, words: %s, chars: %s)",
+                             name, owner, words, chars);
+                } else {
+                    snprintf(line, sizeof(line), "%s", name);
+                }
+                line_list_add(&files, line);
+                name = strtok_r(NULL, "|", &save);
+            }
+            
+            strncpy(cursor, response.filename, MAX_FILENAME - 1);
+            cursor[MAX_FILENAME - 1] = '\0';
+        } while (cursor[0] != '\0');
+    }
+    
+    if (files.count == 0) {
+        printf("No files found.\n");
+        return;
     }
+    printf("Files:\n");
+    line_list_print(&files, "--> ", 0);
     printf("\n");
+    line_list_free(&files);
+}
+
+// Connection to a Storage Server, reused from earlier commands when possible
+static int connect_to_ss(const char* ip, int port) {
+    conn_pool_cleanup_idle(ss_pool, config_get_int("CLIENT_SS_IDLE_SEC", 60));
+    return conn_pool_get(ss_pool, ip, port);
+}
+
+// Hand a Storage Server connection back once its exchange is over; one that
+// ended early may still have a reply in flight and is closed instead
+static void done_with_ss(int fd, int complete) {
+    if (complete) {
+        conn_pool_release(ss_pool, fd);
+    } else {
+        conn_pool_discard(ss_pool, fd);
+    }
 }
 
 void cmd_create(char* filename) {
@@ -153,24 +329,12 @@ void cmd_create(char* filename) {
     sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
     
     // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int ss_socket = connect_to_ss(ss_ip, ss_port);
     if (ss_socket < 0) {
         printf("ERROR: Failed to connect to storage server\n");
         return;
     }
     
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n");
-        close(ss_socket);
-        return;
-    }
-    
     // Send CREATE to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
@@ -182,7 +346,8 @@ void cmd_create(char* filename) {
     send_message(ss_socket, &ss_msg);
     
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
+    int received = receive_message(ss_socket, &ss_response) >= 0;
+    if (received) {
         if (ss_response.error_code == SUCCESS) {
             printf("File '%s' created successfully!\n\n", filename);
         } else {
@@ -190,14 +355,78 @@ void cmd_create(char* filename) {
         }
     }
     
-    close(ss_socket);
+    done_with_ss(ss_socket, received);
+}
+
+// Connect to the Storage Server a Name Server reply names ("ip|port...");
+// returns the socket or -1 after printing the error
+static int connect_to_ss_address(const char* address) {
+    char ss_ip[64];
+    int ss_port;
+    if (sscanf(address, "%63[^|]|%d", ss_ip, &ss_port) != 2) {
+        printf("ERROR: Invalid storage server address\n\n");
+        return -1;
+    }
+    
+    int ss_socket = connect_to_ss(ss_ip, ss_port);
+    if (ss_socket < 0) {
+        printf("ERROR: Failed to connect to storage server\n");
+        return -1;
+    }
+    
+    return ss_socket;
+}
+
+static long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Cache a Name Server location reply ("ip|port|location_gen|lease_ms")
+static void location_remember(const char* filename, const char* reply) {
+    CachedLocation loc;
+    unsigned int gen;
+    int lease_ms;
+    if (!location_cache ||
+        sscanf(reply, "%63[^|]|%d|%u|%d", loc.ip, &loc.port, &gen, &lease_ms) != 4 ||
+        gen == 0 || lease_ms <= 0) {
+        return;  // Not leased (a replica, or an older Name Server)
+    }
+    
+    CachedLocation* entry = (CachedLocation*)malloc(sizeof(CachedLocation));
+    *entry = loc;
+    entry->gen = (uint16_t)gen;
+    entry->expires_ms = monotonic_ms() + lease_ms;
+    lru_put(location_cache, filename, entry);
+}
+
+static void location_forget(const char* filename) {
+    if (location_cache) {
+        lru_remove(location_cache, filename);
+    }
+}
+
+static CachedLocation* location_lookup(const char* filename) {
+    if (!location_cache) {
+        return NULL;
+    }
+    
+    CachedLocation* entry = (CachedLocation*)lru_get(location_cache, filename);
+    if (entry && entry->expires_ms <= monotonic_ms()) {
+        lru_remove(location_cache, filename);
+        entry = NULL;
+    }
+    return entry;
 }
 
-void cmd_read(char* filename) {
+// Ask the Name Server where filename lives; the reply goes into address
+// (and into the location cache). Returns -1 after printing the error.
+static int locate_file(int command, const char* filename, char* address, size_t len) {
     Message msg;
     memset(&msg, 0, sizeof(Message));
     msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;
+    msg.command = command;
     strncpy(msg.username, username, MAX_USERNAME - 1);
     strncpy(msg.filename, filename, MAX_FILENAME - 1);
     
@@ -206,181 +435,486 @@ void cmd_read(char* filename) {
     Message response;
     if (receive_message(nm_socket, &response) < 0) {
         printf("ERROR: Communication failed\n");
-        return;
+        return -1;
     }
     
     if (response.error_code != SUCCESS) {
         printf("ERROR: %s\n\n", get_error_message(response.error_code));
-        return;
+        return -1;
     }
     
-    // Get SS info
-    char ss_ip[64];
-    int ss_port;
-    sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
+    snprintf(address, len, "%s", response.data);
+    location_remember(filename, response.data);
+    return 0;
+}
+
+// Ask the Name Server where filename lives and connect to that Storage
+// Server; returns the socket or -1 after printing the error
+static int connect_to_file_ss(int command, const char* filename) {
+    char address[BUFFER_SIZE];
+    if (locate_file(command, filename, address, sizeof(address)) < 0) {
+        return -1;
+    }
+    return connect_to_ss_address(address);
+}
+
+// Send ss_msg about filename to the Storage Server holding it and receive
+// the first reply into *reply. The SS comes from the location cache while
+// its lease lasts, else from the Name Server (asked with locate_command).
+// A cached location the SS turns away is dropped and the request is sent
+// once more: to the SS named in its redirect hint, or to where the NM says.
+// Returns the socket, or -1 after printing the error.
+static int ss_exchange(int locate_command, const char* filename, Message* ss_msg, Message* reply) {
+    char address[BUFFER_SIZE] = "";
+    
+    CachedLocation* cached = location_lookup(filename);
+    if (cached) {
+        int ss_socket = connect_to_ss(cached->ip, cached->port);
+        ss_msg->location_gen = cached->gen;
+        int sent = ss_socket >= 0 && send_message(ss_socket, ss_msg) == 0;
+        ss_msg->location_gen = 0;
+        
+        if (sent) {
+            if (receive_message(ss_socket, reply) < 0) {
+                printf("ERROR: Communication failed\n\n");
+                done_with_ss(ss_socket, 0);
+                location_forget(filename);
+                return -1;
+            }
+            if (reply->error_code != ERR_STALE_LOCATION) {
+                return ss_socket;
+            }
+            snprintf(address, sizeof(address), "%s", reply->data);
+            message_free_body(reply);
+            done_with_ss(ss_socket, 1);
+        } else if (ss_socket >= 0) {
+            done_with_ss(ss_socket, 0);
+        }
+        location_forget(filename);  // Unreachable or stale: ask again
+    }
     
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n");
-        close(ss_socket);
-        return;
+    if (address[0] == '\0' && locate_file(locate_command, filename, address, sizeof(address)) < 0) {
+        return -1;
+    }
+    
+    int ss_socket = connect_to_ss_address(address);
+    if (ss_socket < 0) {
+        return -1;
     }
     
+    send_message(ss_socket, ss_msg);
+    if (receive_message(ss_socket, reply) < 0) {
+        printf("ERROR: Communication failed\n\n");
+        done_with_ss(ss_socket, 0);
+        return -1;
+    }
+    return ss_socket;
+}
+
+// Reads are streamed: each chunk is written out as it arrives, so memory
+// use does not grow with the file. length 0 reads to the end of the file.
+void cmd_read(char* filename, long long offset, long long length) {
     // Send READ to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
-    ss_msg.command = CMD_READ;
+    ss_msg.command = CMD_READ_CHUNKED;
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(ss_socket, &ss_msg);
-    
-    Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("%s\n\n", ss_response.data);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
+    if (offset > 0 || length > 0) {
+        snprintf(ss_msg.data, BUFFER_SIZE, "%lld|%lld", offset, length);
     }
     
-    close(ss_socket);
-}
-
-void cmd_write(char* filename, int sentence_index) {
-    // Step 1: Acquire lock from Name Server
-    printf("Acquiring lock for %s sentence %d...\n", filename, sentence_index);
-    
-    Message lock_msg;
-    memset(&lock_msg, 0, sizeof(Message));
-    lock_msg.msg_type = MSG_COMMAND;
-    lock_msg.command = CMD_LOCK_ACQUIRE;
-    strncpy(lock_msg.username, username, MAX_USERNAME - 1);
-    strncpy(lock_msg.filename, filename, MAX_FILENAME - 1);
-    snprintf(lock_msg.data, BUFFER_SIZE, "%d", sentence_index);
-    
-    send_message(nm_socket, &lock_msg);
-    
-    Message lock_response;
-    if (receive_message(nm_socket, &lock_response) < 0) {
-        printf("ERROR: Failed to acquire lock\n\n");
+    Message ss_response;
+    int ss_socket = ss_exchange(CMD_READ_CHUNKED, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
         return;
     }
-    
-    if (lock_response.error_code != SUCCESS) {
-        printf("ERROR: %s\n\n", get_error_message(lock_response.error_code));
+    if (ss_response.error_code != SUCCESS) {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+        message_free_body(&ss_response);
+        done_with_ss(ss_socket, 1);
         return;
     }
+    message_free_body(&ss_response);
     
-    printf("Lock acquired!\n");
-    
-    // Get SS info from lock response
-    char ss_ip[64];
-    int ss_port;
-    sscanf(lock_response.data, "%[^|]|%d", ss_ip, &ss_port);
-    
-    // Step 2: Enter edit mode
-    printf("Write mode: %s sentence %d\n", filename, sentence_index);
-    printf("Enter edits as: <word_index> <content>\n");
-    printf("Type ETIRW when done\n\n");
-    
-    char write_data[BUFFER_SIZE];
-    int pos = 0;
-    pos += snprintf(write_data, BUFFER_SIZE, "%d|", sentence_index);
-    
-    char line[512];
-    while (fgets(line, sizeof(line), stdin)) {
-        // Remove newline
-        line[strcspn(line, "\n")] = 0;
-        
-        if (strcmp(line, "ETIRW") == 0) {
+    int complete = 0;
+    while (1) {
+        Message chunk;
+        if (receive_message(ss_socket, &chunk) < 0) {
+            printf("\nERROR: Transfer interrupted\n\n");
             break;
         }
         
-        // Parse word_index and word
-        int word_index;
-        char word[MAX_WORD_LENGTH];
-        if (sscanf(line, "%d %s", &word_index, word) == 2) {
-            pos += snprintf(write_data + pos, BUFFER_SIZE - pos, "%d|%s|", word_index, word);
-            printf("Added edit: word %d = \"%s\"\n", word_index, word);
+        if (chunk.msg_type == MSG_CHUNK) {
+            fwrite(message_payload(&chunk), 1, message_payload_len(&chunk), stdout);
+            message_free_body(&chunk);
+            continue;
+        }
+        
+        if (chunk.msg_type == MSG_END && chunk.error_code == SUCCESS) {
+            printf("\n\n");
         } else {
-            printf("Invalid format. Use: <word_index> <content>\n");
+            printf("\nERROR: %s\n\n", get_error_message(chunk.error_code));
         }
+        complete = chunk.msg_type == MSG_END;
+        message_free_body(&chunk);
+        break;
     }
     
-    printf("Committing write...\n");
+    done_with_ss(ss_socket, complete);
+}
+
+// Replace a file's contents with a local file, streamed in chunks
+void cmd_upload(char* filename, char* local_path) {
+    FILE* fp = fopen(local_path, "rb");
+    if (!fp) {
+        printf("ERROR: Cannot open %s: %s\n\n", local_path, strerror(errno));
+        return;
+    }
     
-    // Step 3: Connect to SS and commit write
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n\n");
-        close(ss_socket);
-        
-        // Release lock on failure
-        Message release_msg;
-        memset(&release_msg, 0, sizeof(Message));
-        release_msg.msg_type = MSG_COMMAND;
-        release_msg.command = CMD_LOCK_RELEASE;
-        strncpy(release_msg.username, username, MAX_USERNAME - 1);
-        strncpy(release_msg.filename, filename, MAX_FILENAME - 1);
-        snprintf(release_msg.data, BUFFER_SIZE, "%d", sentence_index);
-        send_message(nm_socket, &release_msg);
-        receive_message(nm_socket, &lock_response);
-        
+    int ss_socket = connect_to_file_ss(CMD_WRITE_BULK, filename);
+    if (ss_socket < 0) {
+        fclose(fp);
         return;
     }
     
-    // Send WRITE_COMMIT to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
-    ss_msg.command = CMD_WRITE_COMMIT;
+    ss_msg.command = CMD_WRITE_BULK;
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
-    strncpy(ss_msg.data, write_data, BUFFER_SIZE - 1);
-    
-    send_message(ss_socket, &ss_msg);
     
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Write successful!\n");
-        } else {
-            printf("ERROR: %s\n", get_error_message(ss_response.error_code));
+    send_message(ss_socket, &ss_msg);
+    int received = receive_message(ss_socket, &ss_response) >= 0;
+    if (!received || ss_response.error_code != SUCCESS) {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+        message_free_body(&ss_response);
+        done_with_ss(ss_socket, received);
+        fclose(fp);
+        return;
+    }
+    message_free_body(&ss_response);
+    
+    size_t chunk_size = FILE_CHUNK_SIZE;
+    if (chunk_size > message_max_payload(&ss_msg)) {
+        chunk_size = message_max_payload(&ss_msg);
+    }
+    char* buffer = (char*)malloc(chunk_size);
+    
+    Message chunk;
+    memset(&chunk, 0, sizeof(Message));
+    chunk.msg_type = MSG_CHUNK;
+    chunk.command = CMD_WRITE_BULK;
+    
+    int failed = buffer == NULL;
+    size_t n;
+    while (!failed && (n = fread(buffer, 1, chunk_size, fp)) > 0) {
+        chunk.body = buffer;
+        chunk.body_len = n;
+        if (send_message(ss_socket, &chunk) < 0) {
+            printf("ERROR: Transfer interrupted\n\n");
+            free(buffer);
+            done_with_ss(ss_socket, 0);
+            fclose(fp);
+            return;
         }
     }
+    if (ferror(fp)) {
+        failed = 1;
+    }
     
-    close(ss_socket);
+    // End of stream; a failed local read aborts the upload on the server
+    chunk.msg_type = MSG_END;
+    chunk.error_code = failed ? ERR_INTERNAL : SUCCESS;
+    chunk.body = NULL;
+    chunk.body_len = 0;
+    send_message(ss_socket, &chunk);
     
-    // Step 4: Release lock
-    printf("Releasing lock...\n");
+    received = receive_message(ss_socket, &ss_response) >= 0;
+    if (!received) {
+        printf("ERROR: Communication failed\n\n");
+    } else if (ss_response.error_code == SUCCESS) {
+        printf("Uploaded %s to %s: %s\n\n", local_path, filename, ss_response.data);
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+    }
+    message_free_body(&ss_response);
+    
+    free(buffer);
+    done_with_ss(ss_socket, received);
+    fclose(fp);
+}
+
+// Edits of one WRITE session. "WRITE <file> <sentence>" takes edit lines
+// "<word_index> <content>"; "WRITE <file> <first>-<last>" edits several
+// sentences, with lines "<sentence> <word_index> <content>". Either way the
+// sentences are leased from the Name Server in one LOCK_ACQUIRE and written
+// in one WRITE_COMMIT, which the SS applies all or nothing.
+#define WRITE_MAX_EDITS 128
+
+typedef struct {
+    int first;
+    int last;
+    int count;
+    struct {
+        int sentence;
+        int word_index;
+        char word[MAX_WORD_LENGTH];
+    } edits[WRITE_MAX_EDITS];
+} WriteEdits;
+
+// "n" or "first-last"; 0 on success
+static int write_parse_range(const char* text, WriteEdits* w) {
+    int fields = sscanf(text, "%d-%d", &w->first, &w->last);
+    if (fields == 1) {
+        w->last = w->first;
+    }
+    w->count = 0;
+    return fields >= 1 && w->first >= 0 && w->last >= w->first &&
+           w->last - w->first < LEASE_MAX_SENTENCES ? 0 : -1;
+}
+
+// Adds one edit line; returns an explanation if it cannot be used
+static const char* write_add_edit(WriteEdits* w, const char* line) {
+    if (w->count == WRITE_MAX_EDITS) {
+        return "Too many edits in one write";
+    }
+    
+    int sentence = w->first;
+    int word_index;
+    char word[MAX_WORD_LENGTH];
+    int ok = w->first == w->last
+                 ? sscanf(line, "%d %127s", &word_index, word) == 2
+                 : sscanf(line, "%d %d %127s", &sentence, &word_index, word) == 3;
+    if (!ok) {
+        return w->first == w->last ? "Invalid format. Use: <word_index> <content>"
+                                   : "Invalid format. Use: <sentence> <word_index> <content>";
+    }
+    if (sentence < w->first || sentence > w->last) {
+        return "Sentence is outside the locked range";
+    }
+    
+    w->edits[w->count].sentence = sentence;
+    w->edits[w->count].word_index = word_index;
+    snprintf(w->edits[w->count].word, MAX_WORD_LENGTH, "%s", word);
+    w->count++;
+    return NULL;
+}
+
+// WRITE_COMMIT data after the lease: one "sentence|word_index|word|..."
+// line per sentence edited, its edits in the order given
+static int write_format_edits(const WriteEdits* w, char* out, size_t len) {
+    size_t pos = 0;
+    for (int s = w->first; s <= w->last; s++) {
+        int started = 0;
+        for (int i = 0; i < w->count && pos < len; i++) {
+            if (w->edits[i].sentence != s) {
+                continue;
+            }
+            if (!started) {
+                pos += snprintf(out + pos, len - pos, "\n%d|", s);
+                started = 1;
+            }
+            if (pos < len) {
+                pos += snprintf(out + pos, len - pos, "%d|%s|", w->edits[i].word_index, w->edits[i].word);
+            }
+        }
+    }
+    return pos < len ? 0 : -1;
+}
+
+// LOCK_RELEASE data: the lease itself, or the first sentence if the Name
+// Server did not issue one
+static void write_release(const char* filename, const char* lease, int first) {
     Message release_msg;
     memset(&release_msg, 0, sizeof(Message));
     release_msg.msg_type = MSG_COMMAND;
     release_msg.command = CMD_LOCK_RELEASE;
     strncpy(release_msg.username, username, MAX_USERNAME - 1);
     strncpy(release_msg.filename, filename, MAX_FILENAME - 1);
-    snprintf(release_msg.data, BUFFER_SIZE, "%d", sentence_index);
+    if (lease[0]) {
+        snprintf(release_msg.data, BUFFER_SIZE, "%s", lease);
+    } else {
+        snprintf(release_msg.data, BUFFER_SIZE, "%d", first);
+    }
     
     send_message(nm_socket, &release_msg);
     
-    if (receive_message(nm_socket, &lock_response) >= 0) {
-        if (lock_response.error_code == SUCCESS) {
-            printf("Lock released!\n\n");
-        }
-    }
+    Message response;
+    if (receive_message(nm_socket, &response) >= 0 && response.error_code == SUCCESS) {
+        printf("Lock released!\n\n");
+    }
+}
+
+// Commits this close to the lease's expiry renew it first
+#define WRITE_RENEW_MARGIN_MS 5000
+
+// LOCK_ACQUIRE for w's sentences: fills in the SS and the lease (empty if
+// the Name Server issued none). The error code, or -1 without a reply.
+// Asking again while holding the lease renews it.
+static int write_lock(const char* filename, const WriteEdits* w, char* ss_ip, size_t ip_len,
+                      int* ss_port, char* lease, size_t lease_len) {
+    Message lock_msg;
+    memset(&lock_msg, 0, sizeof(Message));
+    lock_msg.msg_type = MSG_COMMAND;
+    lock_msg.command = CMD_LOCK_ACQUIRE;
+    strncpy(lock_msg.username, username, MAX_USERNAME - 1);
+    strncpy(lock_msg.filename, filename, MAX_FILENAME - 1);
+    snprintf(lock_msg.data, BUFFER_SIZE, "%d-%d", w->first, w->last);
+    
+    send_message(nm_socket, &lock_msg);
+    
+    Message lock_response;
+    if (receive_message(nm_socket, &lock_response) < 0) {
+        return -1;
+    }
+    if (lock_response.error_code != SUCCESS) {
+        return lock_response.error_code;
+    }
+    
+    // Get SS info and the lease from lock response
+    char ip[64];
+    if (sscanf(lock_response.data, "%63[^|]|%d", ip, ss_port) == 2) {
+        snprintf(ss_ip, ip_len, "%s", ip);
+    }
+    const char* lease_text = strstr(lock_response.data, LEASE_PREFIX);
+    snprintf(lease, lease_len, "%s", lease_text ? lease_text : "");
+    return SUCCESS;
+}
+
+// Renews the lease if it ends within WRITE_RENEW_MARGIN_MS, so a long edit
+// session still commits. 0 if the lease is good to use.
+static int write_renew(const char* filename, const WriteEdits* w, char* ss_ip, size_t ip_len,
+                       int* ss_port, char* lease, size_t lease_len) {
+    WriteLease current;
+    if (!lease[0] || lease_parse(lease, &current) < 0 ||
+        current.expires_ms - lease_now_ms() > WRITE_RENEW_MARGIN_MS) {
+        return 0;  // Nothing to renew, or still good
+    }
+    
+    int rc = write_lock(filename, w, ss_ip, ip_len, ss_port, lease, lease_len);
+    if (rc != SUCCESS) {
+        // Expired and, most likely, taken by someone else in the meantime
+        printf("ERROR: Write lease expired and could not be renewed (%s); edits were not saved\n\n",
+               rc < 0 ? "no reply from name server" : get_error_message(rc));
+        return -1;
+    }
+    printf("Lock renewed!\n");
+    return 0;
+}
+
+void cmd_write(char* filename, const char* range) {
+    static WriteEdits w;
+    if (write_parse_range(range, &w) < 0) {
+        printf("ERROR: Invalid sentence range (at most %d sentences)\n\n", LEASE_MAX_SENTENCES);
+        return;
+    }
+    
+    // Step 1: Acquire lock from Name Server
+    if (w.first == w.last) {
+        printf("Acquiring lock for %s sentence %d...\n", filename, w.first);
+    } else {
+        printf("Acquiring lock for %s sentences %d-%d...\n", filename, w.first, w.last);
+    }
+    
+    char ss_ip[64] = "";
+    int ss_port = 0;
+    char lease[128] = "";
+    int rc = write_lock(filename, &w, ss_ip, sizeof(ss_ip), &ss_port, lease, sizeof(lease));
+    if (rc < 0) {
+        printf("ERROR: Failed to acquire lock\n\n");
+        return;
+    }
+    if (rc != SUCCESS) {
+        printf("ERROR: %s\n\n", get_error_message(rc));
+        return;
+    }
+    
+    printf("Lock acquired!\n");
+    
+    // Step 2: Enter edit mode
+    if (w.first == w.last) {
+        printf("Write mode: %s sentence %d\n", filename, w.first);
+        printf("Enter edits as: <word_index> <content>\n");
+    } else {
+        printf("Write mode: %s sentences %d-%d\n", filename, w.first, w.last);
+        printf("Enter edits as: <sentence> <word_index> <content>\n");
+    }
+    printf("Type ETIRW when done\n\n");
+    
+    char line[512];
+    while (fgets(line, sizeof(line), stdin)) {
+        // Remove newline
+        line[strcspn(line, "\n")] = 0;
+        
+        if (strcmp(line, "ETIRW") == 0) {
+            break;
+        }
+        
+        const char* problem = write_add_edit(&w, line);
+        if (problem) {
+            printf("%s\n", problem);
+        } else if (w.first == w.last) {
+            printf("Added edit: word %d = \"%s\"\n", w.edits[w.count - 1].word_index,
+                   w.edits[w.count - 1].word);
+        } else {
+            printf("Added edit: sentence %d word %d = \"%s\"\n", w.edits[w.count - 1].sentence,
+                   w.edits[w.count - 1].word_index, w.edits[w.count - 1].word);
+        }
+    }
+    
+    if (write_renew(filename, &w, ss_ip, sizeof(ss_ip), &ss_port, lease, sizeof(lease)) < 0) {
+        return;
+    }
+    
+    // Send WRITE_COMMIT to SS: the lease, then the edits
+    Message ss_msg;
+    memset(&ss_msg, 0, sizeof(Message));
+    ss_msg.command = CMD_WRITE_COMMIT;
+    strncpy(ss_msg.username, username, MAX_USERNAME - 1);
+    strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
+    int pos = snprintf(ss_msg.data, BUFFER_SIZE, "%s", lease);
+    if (w.count == 0) {
+        // Nothing to change; the SS still checks the lease and the sentence
+        pos += snprintf(ss_msg.data + pos, BUFFER_SIZE - pos, "\n%d|", w.first);
+    } else if (write_format_edits(&w, ss_msg.data + pos, BUFFER_SIZE - pos) < 0) {
+        printf("ERROR: Edits too large for one write\n");
+        write_release(filename, lease, w.first);
+        return;
+    }
+    
+    printf("Committing write...\n");
+    
+    // Step 3: Connect to SS and commit write
+    int ss_socket = connect_to_ss(ss_ip, ss_port);
+    if (ss_socket < 0) {
+        printf("ERROR: Failed to connect to storage server\n\n");
+        
+        // Release lock on failure
+        write_release(filename, lease, w.first);
+        return;
+    }
+    
+    send_message(ss_socket, &ss_msg);
+    
+    Message ss_response;
+    int received = receive_message(ss_socket, &ss_response) >= 0;
+    if (received) {
+        if (ss_response.error_code == SUCCESS) {
+            printf("Write successful!\n");
+        } else if (ss_response.error_code == ERR_FILE_LOCKED && lease[0]) {
+            printf("ERROR: Write lease expired or invalid; edits were not saved\n");
+        } else {
+            printf("ERROR: %s\n", get_error_message(ss_response.error_code));
+        }
+    }
+    
+    done_with_ss(ss_socket, received);
+    
+    // Step 4: Release lock
+    printf("Releasing lock...\n");
+    write_release(filename, lease, w.first);
 }
 
 void cmd_delete(char* filename) {
@@ -399,6 +933,7 @@ void cmd_delete(char* filename) {
         return;
     }
     
+    location_forget(filename);
     if (response.error_code == SUCCESS) {
         printf("File '%s' deleted successfully!\n\n", filename);
     } else {
@@ -438,39 +973,6 @@ void cmd_list() {
 }
 
 void cmd_info(char* filename) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info first
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0 || response.error_code != SUCCESS) {
-        printf("ERROR: Failed to get storage server info\n\n");
-        return;
-    }
-    
-    char ss_ip[64];
-    int ss_port;
-    sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n\n");
-        close(ss_socket);
-        return;
-    }
-    
     // Send INFO to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
@@ -478,54 +980,22 @@ void cmd_info(char* filename) {
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("\n%s\n\n", ss_response.data);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
-    }
-    
-    close(ss_socket);
-}
-
-void cmd_fileinfo(char* filename) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info first
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0 || response.error_code != SUCCESS) {
-        printf("ERROR: Failed to get storage server info\n\n");
+    int ss_socket = ss_exchange(CMD_READ_CHUNKED, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
         return;
     }
     
-    char ss_ip[64];
-    int ss_port;
-    sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n\n");
-        close(ss_socket);
-        return;
+    if (ss_response.error_code == SUCCESS) {
+        printf("\n%s\n\n", ss_response.data);
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
     }
     
+    done_with_ss(ss_socket, 1);
+}
+
+void cmd_fileinfo(char* filename) {
     // Send FILEINFO to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
@@ -533,54 +1003,22 @@ void cmd_fileinfo(char* filename) {
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("\n%s\n", ss_response.data);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
-    }
-    
-    close(ss_socket);
-}
-
-void cmd_copy(char* source, char* destination) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info for source file
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, source, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0 || response.error_code != SUCCESS) {
-        printf("ERROR: Failed to get storage server info\n\n");
+    int ss_socket = ss_exchange(CMD_READ_CHUNKED, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
         return;
     }
     
-    char ss_ip[64];
-    int ss_port;
-    sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n\n");
-        close(ss_socket);
-        return;
+    if (ss_response.error_code == SUCCESS) {
+        printf("\n%s\n", ss_response.data);
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
     }
     
+    done_with_ss(ss_socket, 1);
+}
+
+void cmd_copy(char* source, char* destination) {
     // Send COPY to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
@@ -588,125 +1026,98 @@ void cmd_copy(char* source, char* destination) {
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     snprintf(ss_msg.data, BUFFER_SIZE, "%s|%s", source, destination);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("SUCCESS: %s\n\n", ss_response.data);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
-    }
-    
-    close(ss_socket);
-}
-
-void cmd_stream(char* filename) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0 || response.error_code != SUCCESS) {
-        printf("ERROR: Failed to get storage server info\n\n");
+    int ss_socket = ss_exchange(CMD_READ, source, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
         return;
     }
     
-    char ss_ip[64];
-    int ss_port;
-    sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
+    if (ss_response.error_code == SUCCESS) {
+        printf("SUCCESS: %s\n\n", ss_response.data);
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+    }
     
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n\n");
-        close(ss_socket);
-        return;
+    done_with_ss(ss_socket, 1);
+}
+
+// Print a file's words as the Storage Server streams them. pace_ms < 0
+// leaves the pacing to the server (SS_STREAM_WORD_MS); 0 streams in bulk.
+// Credit for CLIENT_STREAM_WINDOW chunks is returned half a window at a time
+// as they are consumed.
+void cmd_stream(char* filename, int pace_ms) {
+    int window = config_get_int("CLIENT_STREAM_WINDOW", 16);
+    if (window < 2) {
+        window = 2;
     }
+    int grant = window / 2;
     
-    // Send STREAM to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
     ss_msg.command = CMD_STREAM;
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(ss_socket, &ss_msg);
+    if (pace_ms >= 0) {
+        snprintf(ss_msg.data, BUFFER_SIZE, "%d|%d", window, pace_ms);
+    } else {
+        snprintf(ss_msg.data, BUFFER_SIZE, "%d", window);
+    }
     
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("\nStreaming: %s\n", filename);
-            // Parse words separated by |WORD|
-            char* data = ss_response.data;
-            char* word_start = strstr(data, "|WORD|");
-            while (word_start) {
-                word_start += 6;  // Skip |WORD|
-                char* word_end = strstr(word_start, "|WORD|");
-                if (word_end) {
-                    *word_end = '\0';
-                }
-                printf("%s ", word_start);
-                fflush(stdout);
-                usleep(100000);  // 0.1 second delay
-                if (!word_end) break;
-                word_start = word_end + 1;
+    int ss_socket = ss_exchange(CMD_READ_CHUNKED, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
+        return;
+    }
+    if (ss_response.error_code != SUCCESS) {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+        message_free_body(&ss_response);
+        done_with_ss(ss_socket, 1);
+        return;
+    }
+    message_free_body(&ss_response);
+    
+    Message ack;
+    memset(&ack, 0, sizeof(Message));
+    ack.msg_type = MSG_ACK;
+    ack.command = CMD_STREAM;
+    snprintf(ack.data, BUFFER_SIZE, "%d", grant);
+    
+    printf("\nStreaming: %s\n", filename);
+    int complete = 0;
+    long chunks = 0;
+    while (1) {
+        Message chunk;
+        if (receive_message(ss_socket, &chunk) < 0) {
+            printf("\nERROR: Stream interrupted\n\n");
+            break;
+        }
+        
+        if (chunk.msg_type == MSG_CHUNK) {
+            fwrite(message_payload(&chunk), 1, message_payload_len(&chunk), stdout);
+            fputc(' ', stdout);
+            fflush(stdout);
+            message_free_body(&chunk);
+            if (++chunks % grant == 0 && send_message(ss_socket, &ack) < 0) {
+                printf("\nERROR: Stream interrupted\n\n");
+                break;
             }
+            continue;
+        }
+        
+        if (chunk.msg_type == MSG_END && chunk.error_code == SUCCESS) {
             printf("\n\n");
         } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+            printf("\nERROR: %s\n\n", get_error_message(chunk.error_code));
         }
+        complete = chunk.msg_type == MSG_END;
+        message_free_body(&chunk);
+        break;
     }
     
-    close(ss_socket);
+    done_with_ss(ss_socket, complete);
 }
 
 void cmd_addaccess(char* filename, char* target_user) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0 || response.error_code != SUCCESS) {
-        printf("ERROR: Failed to get storage server info\n\n");
-        return;
-    }
-    
-    char ss_ip[64];
-    int ss_port;
-    sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n\n");
-        close(ss_socket);
-        return;
-    }
-    
     // Send ADDACCESS to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
@@ -715,54 +1126,22 @@ void cmd_addaccess(char* filename, char* target_user) {
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
     strncpy(ss_msg.data, target_user, BUFFER_SIZE - 1);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Access granted to %s\n\n", target_user);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
-    }
-    
-    close(ss_socket);
-}
-
-void cmd_remaccess(char* filename, char* target_user) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0 || response.error_code != SUCCESS) {
-        printf("ERROR: Failed to get storage server info\n\n");
+    int ss_socket = ss_exchange(CMD_READ, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
         return;
     }
     
-    char ss_ip[64];
-    int ss_port;
-    sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n\n");
-        close(ss_socket);
-        return;
+    if (ss_response.error_code == SUCCESS) {
+        printf("Access granted to %s\n\n", target_user);
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
     }
     
+    done_with_ss(ss_socket, 1);
+}
+
+void cmd_remaccess(char* filename, char* target_user) {
     // Send REMACCESS to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
@@ -771,77 +1150,89 @@ void cmd_remaccess(char* filename, char* target_user) {
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
     strncpy(ss_msg.data, target_user, BUFFER_SIZE - 1);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Access revoked from %s\n\n", target_user);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
-    }
-    
-    close(ss_socket);
-}
-
-void cmd_exec(char* filename) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_EXEC;
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n\n");
+    int ss_socket = ss_exchange(CMD_READ, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
         return;
     }
     
-    if (response.error_code == SUCCESS) {
-        printf("\nExecution output:\n%s\n", response.data);
+    if (ss_response.error_code == SUCCESS) {
+        printf("Access revoked from %s\n\n", target_user);
     } else {
-        printf("ERROR: %s\n\n", get_error_message(response.error_code));
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
     }
+    
+    done_with_ss(ss_socket, 1);
 }
 
-void cmd_undo(char* filename) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
+// Run a file on the Storage Server holding it, printing its output as it
+// is produced
+void cmd_exec(char* filename) {
+    Message ss_msg;
+    memset(&ss_msg, 0, sizeof(Message));
+    ss_msg.command = CMD_EXEC;
+    strncpy(ss_msg.username, username, MAX_USERNAME - 1);
+    strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
     
-    Message response;
-    if (receive_message(nm_socket, &response) < 0 || response.error_code != SUCCESS) {
-        printf("ERROR: Failed to get storage server info\n\n");
+    Message ss_response;
+    int ss_socket = ss_exchange(CMD_EXEC, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
         return;
     }
-    
-    char ss_ip[64];
-    int ss_port;
-    sscanf(response.data, "%[^|]|%d", ss_ip, &ss_port);
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Failed to connect to storage server\n\n");
-        close(ss_socket);
+    if (ss_response.error_code != SUCCESS) {
+        printf("ERROR: %s: %s\n\n", get_error_message(ss_response.error_code), ss_response.data);
+        message_free_body(&ss_response);
+        done_with_ss(ss_socket, 1);
         return;
     }
+    if (atoi(ss_response.data) > 0) {
+        printf("(waiting for a free worker, position %d in queue)\n", atoi(ss_response.data));
+    }
+    message_free_body(&ss_response);
+    
+    printf("\nExecution output:\n");
+    int complete = 0;
+    while (1) {
+        Message chunk;
+        if (receive_message(ss_socket, &chunk) < 0) {
+            printf("\nERROR: Execution output interrupted\n\n");
+            break;
+        }
+        
+        if (chunk.msg_type == MSG_CHUNK) {
+            fwrite(message_payload(&chunk), 1, message_payload_len(&chunk), stdout);
+            fflush(stdout);
+            message_free_body(&chunk);
+            continue;
+        }
+        
+        // "status|exit_code|wait_ms|run_ms"
+        char status[32] = "";
+        int exit_code = 0;
+        sscanf(chunk.data, "%31[^|]|%d", status, &exit_code);
+        if (chunk.msg_type == MSG_END && chunk.error_code == SUCCESS) {
+            printf("\n");
+        } else if (strcmp(status, "exited") == 0) {
+            printf("\nERROR: Execution failed (exit code %d)\n\n", exit_code);
+        } else if (strcmp(status, "signaled") == 0) {
+            printf("\nERROR: Execution failed (%s)\n\n",
+                   exit_code == SIGXCPU ? "CPU time limit" : strsignal(exit_code));
+        } else if (strcmp(status, "timed_out") == 0) {
+            printf("\nERROR: Execution failed (time limit)\n\n");
+        } else if (strcmp(status, "output_limit") == 0) {
+            printf("\nERROR: Execution stopped (output limit)\n\n");
+        } else {
+            printf("\nERROR: %s\n\n", get_error_message(chunk.error_code));
+        }
+        complete = chunk.msg_type == MSG_END;
+        message_free_body(&chunk);
+        break;
+    }
     
+    done_with_ss(ss_socket, complete);
+}
+
+void cmd_undo(char* filename) {
     // Send UNDO to SS
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
@@ -849,56 +1240,26 @@ void cmd_undo(char* filename) {
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Undo successful!\n\n");
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
+    int ss_socket = ss_exchange(CMD_READ, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
+        return;
     }
     
-    close(ss_socket);
+    if (ss_response.error_code == SUCCESS) {
+        printf("Undo successful!\n\n");
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+    }
+    
+    done_with_ss(ss_socket, 1);
 }
 
 // BONUS: Create folder
 void cmd_createfolder(char* foldername) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, foldername, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n");
-        return;
-    }
-    
-    // Parse SS info
-    char ss_ip[64];
-    int ss_port;
-    if (sscanf(response.data, "%[^:]:%d", ss_ip, &ss_port) != 2) {
-        printf("ERROR: Invalid server response\n");
-        return;
-    }
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Cannot connect to storage server\n");
-        close(ss_socket);
+    // The Name Server records the folder and picks the SS that holds it
+    int ss_socket = connect_to_file_ss(CMD_CREATEFOLDER, foldername);
+    if (ss_socket < 0) {
         return;
     }
     
@@ -912,176 +1273,166 @@ void cmd_createfolder(char* foldername) {
     send_message(ss_socket, &ss_msg);
     
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Folder created successfully!\n\n");
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
+    int received = receive_message(ss_socket, &ss_response) >= 0;
+    int ok = received && ss_response.error_code == SUCCESS;
+    done_with_ss(ss_socket, received);
+    
+    if (ok) {
+        printf("Folder created successfully!\n\n");
+        return;
     }
+    printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
     
-    close(ss_socket);
-}
-
-// BONUS: Move file to folder
-void cmd_move(char* filename, char* foldername) {
+    // Drop the Name Server's record of the folder again
     Message msg;
     memset(&msg, 0, sizeof(Message));
     msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info
+    msg.command = CMD_DELETE;
     strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
+    snprintf(msg.filename, MAX_FILENAME, "%s/", foldername);
     
     send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n");
-        return;
-    }
-    
-    // Parse SS info
-    char ss_ip[64];
-    int ss_port;
-    if (sscanf(response.data, "%[^:]:%d", ss_ip, &ss_port) != 2) {
-        printf("ERROR: Invalid server response\n");
-        return;
-    }
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Cannot connect to storage server\n");
-        close(ss_socket);
-        return;
-    }
-    
-    Message ss_msg;
-    memset(&ss_msg, 0, sizeof(Message));
-    ss_msg.msg_type = MSG_COMMAND;
-    ss_msg.command = CMD_MOVE;
-    strncpy(ss_msg.username, username, MAX_USERNAME - 1);
-    snprintf(ss_msg.data, BUFFER_SIZE, "%s|%s", filename, foldername);
-    
-    send_message(ss_socket, &ss_msg);
-    
-    Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("File moved successfully!\n\n");
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
-    }
-    
-    close(ss_socket);
+    receive_message(nm_socket, &ss_msg);
 }
 
-// BONUS: View folder contents
-void cmd_viewfolder(char* foldername) {
+// Renames filename to destination (or moves it into destination if that is
+// a folder) in the Name Server; reply data is "ip|port|new name"
+static int nm_move(const char* filename, const char* destination, Message* response) {
     Message msg;
     memset(&msg, 0, sizeof(Message));
     msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info
+    msg.command = CMD_MOVE;
     strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, foldername, MAX_FILENAME - 1);
+    strncpy(msg.filename, filename, MAX_FILENAME - 1);
+    strncpy(msg.data, destination, BUFFER_SIZE - 1);
     
     send_message(nm_socket, &msg);
     
-    Message response;
-    if (receive_message(nm_socket, &response) < 0) {
+    if (receive_message(nm_socket, response) < 0) {
         printf("ERROR: Communication failed\n");
-        return;
+        return -1;
     }
-    
-    // Parse SS info
-    char ss_ip[64];
-    int ss_port;
-    if (sscanf(response.data, "%[^:]:%d", ss_ip, &ss_port) != 2) {
-        printf("ERROR: Invalid server response\n");
+    if (response->error_code != SUCCESS) {
+        printf("ERROR: %s\n\n", get_error_message(response->error_code));
+        return -1;
+    }
+    return 0;
+}
+
+// BONUS: Move file to folder (or rename it)
+void cmd_move(char* filename, char* destination) {
+    Message response;
+    location_forget(filename);
+    if (nm_move(filename, destination, &response) < 0) {
         return;
     }
     
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Cannot connect to storage server\n");
-        close(ss_socket);
+    char new_name[MAX_FILENAME];
+    const char* bar = strchr(response.data, '|');
+    bar = bar ? strchr(bar + 1, '|') : NULL;
+    if (!bar) {
+        printf("ERROR: Invalid server response\n");
         return;
     }
+    snprintf(new_name, sizeof(new_name), "%s", bar + 1);
     
-    Message ss_msg;
-    memset(&ss_msg, 0, sizeof(Message));
-    ss_msg.msg_type = MSG_COMMAND;
-    ss_msg.command = CMD_VIEWFOLDER;
-    strncpy(ss_msg.username, username, MAX_USERNAME - 1);
-    strncpy(ss_msg.filename, foldername, MAX_FILENAME - 1);
-    
-    send_message(ss_socket, &ss_msg);
+    int ss_socket = connect_to_ss_address(response.data);
     
+    int ok = 0;
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Contents of %s:\n%s\n\n", foldername, ss_response.data);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
+    memset(&ss_response, 0, sizeof(Message));
+    if (ss_socket >= 0) {
+        Message ss_msg;
+        memset(&ss_msg, 0, sizeof(Message));
+        ss_msg.msg_type = MSG_COMMAND;
+        ss_msg.command = CMD_MOVE;
+        strncpy(ss_msg.username, username, MAX_USERNAME - 1);
+        snprintf(ss_msg.data, BUFFER_SIZE, "%s|%s", filename, new_name);
+        
+        send_message(ss_socket, &ss_msg);
+        int received = receive_message(ss_socket, &ss_response) >= 0;
+        ok = received && ss_response.error_code == SUCCESS;
+        done_with_ss(ss_socket, received);
     }
     
-    close(ss_socket);
-}
-
-// BONUS: Create checkpoint
-void cmd_checkpoint(char* filename, char* tag) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n");
+    if (ok) {
+        printf("File moved to %s successfully!\n\n", new_name);
         return;
     }
+    if (ss_socket >= 0) {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+    }
     
-    // Parse SS info
-    char ss_ip[64];
-    int ss_port;
-    if (sscanf(response.data, "%[^:]:%d", ss_ip, &ss_port) != 2) {
-        printf("ERROR: Invalid server response\n");
-        return;
+    // The SS still has the file under its old name
+    nm_move(new_name, filename, &response);
+}
+
+// BONUS: View folder contents, page by page from every Name Server shard
+// (a folder's files are spread over them by name)
+void cmd_viewfolder(char* foldername) {
+    LineList entries = {NULL, 0, 0};
+    int found = 0;
+    
+    for (int shard = 0; shard < shard_map->count; shard++) {
+        if (use_shard(shard) < 0) {
+            continue;
+        }
+        
+        char cursor[MAX_FILENAME] = "";
+        do {
+            Message msg;
+            memset(&msg, 0, sizeof(Message));
+            msg.msg_type = MSG_COMMAND;
+            msg.command = CMD_VIEWFOLDER;
+            strncpy(msg.username, username, MAX_USERNAME - 1);
+            strncpy(msg.filename, foldername, MAX_FILENAME - 1);
+            strncpy(msg.data, cursor, BUFFER_SIZE - 1);
+            
+            send_message(nm_socket, &msg);
+            
+            Message response;
+            if (receive_message(nm_socket, &response) < 0) {
+                printf("ERROR: Communication failed\n");
+                line_list_free(&entries);
+                return;
+            }
+            
+            // Shards that hold nothing under the folder report it missing
+            if (response.error_code == ERR_FILE_NOT_FOUND) {
+                break;
+            }
+            if (response.error_code != SUCCESS) {
+                printf("ERROR: %s\n\n", get_error_message(response.error_code));
+                line_list_free(&entries);
+                return;
+            }
+            found = 1;
+            
+            char* save = NULL;
+            for (char* entry = strtok_r(response.data, "\n", &save); entry;
+                 entry = strtok_r(NULL, "\n", &save)) {
+                line_list_add(&entries, entry);
+            }
+            
+            strncpy(cursor, response.filename, MAX_FILENAME - 1);
+            cursor[MAX_FILENAME - 1] = '\0';
+        } while (cursor[0] != '\0');
     }
     
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Cannot connect to storage server\n");
-        close(ss_socket);
+    if (!found) {
+        printf("ERROR: %s\n\n", get_error_message(ERR_FILE_NOT_FOUND));
         return;
     }
     
+    // The same subfolder can show up on several shards
+    printf("Contents of %s:\n", foldername);
+    line_list_print(&entries, "", 1);
+    printf("\n");
+    line_list_free(&entries);
+}
+
+// BONUS: Create checkpoint
+void cmd_checkpoint(char* filename, char* tag) {
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
     ss_msg.msg_type = MSG_COMMAND;
@@ -1089,59 +1440,23 @@ void cmd_checkpoint(char* filename, char* tag) {
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     snprintf(ss_msg.data, BUFFER_SIZE, "%s|%s", filename, tag);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Checkpoint created: %s\n\n", tag);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
+    int ss_socket = ss_exchange(CMD_READ, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
+        return;
+    }
+    
+    if (ss_response.error_code == SUCCESS) {
+        printf("Checkpoint created: %s\n\n", tag);
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
     }
     
-    close(ss_socket);
+    done_with_ss(ss_socket, 1);
 }
 
 // BONUS: View checkpoint
 void cmd_viewcheckpoint(char* filename, char* tag) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n");
-        return;
-    }
-    
-    // Parse SS info
-    char ss_ip[64];
-    int ss_port;
-    if (sscanf(response.data, "%[^:]:%d", ss_ip, &ss_port) != 2) {
-        printf("ERROR: Invalid server response\n");
-        return;
-    }
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Cannot connect to storage server\n");
-        close(ss_socket);
-        return;
-    }
-    
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
     ss_msg.msg_type = MSG_COMMAND;
@@ -1149,59 +1464,27 @@ void cmd_viewcheckpoint(char* filename, char* tag) {
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     snprintf(ss_msg.data, BUFFER_SIZE, "%s|%s", filename, tag);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Checkpoint content:\n%s\n\n", ss_response.data);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
+    int ss_socket = ss_exchange(CMD_READ, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
+        return;
     }
     
-    close(ss_socket);
+    if (ss_response.error_code == SUCCESS) {
+        // The content comes in the body, like a read's
+        printf("Checkpoint content:\n");
+        fwrite(message_payload(&ss_response), 1, message_payload_len(&ss_response), stdout);
+        printf("\n\n");
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+    }
+    message_free_body(&ss_response);
+    
+    done_with_ss(ss_socket, 1);
 }
 
 // BONUS: Revert to checkpoint
 void cmd_revert(char* filename, char* tag) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n");
-        return;
-    }
-    
-    // Parse SS info
-    char ss_ip[64];
-    int ss_port;
-    if (sscanf(response.data, "%[^:]:%d", ss_ip, &ss_port) != 2) {
-        printf("ERROR: Invalid server response\n");
-        return;
-    }
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Cannot connect to storage server\n");
-        close(ss_socket);
-        return;
-    }
-    
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
     ss_msg.msg_type = MSG_COMMAND;
@@ -1209,59 +1492,23 @@ void cmd_revert(char* filename, char* tag) {
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     snprintf(ss_msg.data, BUFFER_SIZE, "%s|%s", filename, tag);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("File reverted to checkpoint: %s\n\n", tag);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
+    int ss_socket = ss_exchange(CMD_READ, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
+        return;
+    }
+    
+    if (ss_response.error_code == SUCCESS) {
+        printf("File reverted to checkpoint: %s\n\n", tag);
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
     }
     
-    close(ss_socket);
+    done_with_ss(ss_socket, 1);
 }
 
 // BONUS: List checkpoints
 void cmd_listcheckpoints(char* filename) {
-    Message msg;
-    memset(&msg, 0, sizeof(Message));
-    msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_READ;  // Get SS info
-    strncpy(msg.username, username, MAX_USERNAME - 1);
-    strncpy(msg.filename, filename, MAX_FILENAME - 1);
-    
-    send_message(nm_socket, &msg);
-    
-    Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n");
-        return;
-    }
-    
-    // Parse SS info
-    char ss_ip[64];
-    int ss_port;
-    if (sscanf(response.data, "%[^:]:%d", ss_ip, &ss_port) != 2) {
-        printf("ERROR: Invalid server response\n");
-        return;
-    }
-    
-    // Connect to SS
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss_ip);
-    ss_addr.sin_port = htons(ss_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("ERROR: Cannot connect to storage server\n");
-        close(ss_socket);
-        return;
-    }
-    
     Message ss_msg;
     memset(&ss_msg, 0, sizeof(Message));
     ss_msg.msg_type = MSG_COMMAND;
@@ -1269,18 +1516,19 @@ void cmd_listcheckpoints(char* filename) {
     strncpy(ss_msg.username, username, MAX_USERNAME - 1);
     strncpy(ss_msg.filename, filename, MAX_FILENAME - 1);
     
-    send_message(ss_socket, &ss_msg);
-    
     Message ss_response;
-    if (receive_message(ss_socket, &ss_response) >= 0) {
-        if (ss_response.error_code == SUCCESS) {
-            printf("Checkpoints for %s:\n%s\n\n", filename, ss_response.data);
-        } else {
-            printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
-        }
+    int ss_socket = ss_exchange(CMD_READ, filename, &ss_msg, &ss_response);
+    if (ss_socket < 0) {
+        return;
     }
     
-    close(ss_socket);
+    if (ss_response.error_code == SUCCESS) {
+        printf("Checkpoints for %s:\n%s\n\n", filename, ss_response.data);
+    } else {
+        printf("ERROR: %s\n\n", get_error_message(ss_response.error_code));
+    }
+    
+    done_with_ss(ss_socket, 1);
 }
 
 // BONUS: Request access
@@ -1307,27 +1555,84 @@ void cmd_requestaccess(char* filename) {
     }
 }
 
-// BONUS: View pending requests
-void cmd_viewrequests() {
+// Print the Prometheus report of the Name Server, or of the Storage Server
+// holding filename
+void cmd_metrics(const char* filename) {
     Message msg;
     memset(&msg, 0, sizeof(Message));
     msg.msg_type = MSG_COMMAND;
-    msg.command = CMD_VIEWREQUESTS;
+    msg.command = CMD_METRICS;
     strncpy(msg.username, username, MAX_USERNAME - 1);
     
-    send_message(nm_socket, &msg);
-    
     Message response;
-    if (receive_message(nm_socket, &response) < 0) {
-        printf("ERROR: Communication failed\n");
-        return;
+    int ss_socket = -1;
+    if (filename) {
+        strncpy(msg.filename, filename, MAX_FILENAME - 1);
+        ss_socket = ss_exchange(CMD_READ, filename, &msg, &response);
+        if (ss_socket < 0) {
+            return;
+        }
+    } else {
+        send_message(nm_socket, &msg);
+        if (receive_message(nm_socket, &response) < 0) {
+            printf("ERROR: Communication failed\n\n");
+            return;
+        }
     }
     
     if (response.error_code == SUCCESS) {
-        printf("Pending Access Requests:\n%s\n\n", response.data);
+        fwrite(message_payload(&response), 1, message_payload_len(&response), stdout);
+        printf("\n");
     } else {
         printf("ERROR: %s\n\n", get_error_message(response.error_code));
     }
+    message_free_body(&response);
+    if (ss_socket >= 0) {
+        done_with_ss(ss_socket, 1);
+    }
+}
+
+// BONUS: View pending requests
+void cmd_viewrequests() {
+    // Requests are kept by the shard owning the file, so ask every shard
+    int found = 0;
+    
+    for (int shard = 0; shard < shard_map->count; shard++) {
+        if (use_shard(shard) < 0) {
+            continue;
+        }
+        
+        Message msg;
+        memset(&msg, 0, sizeof(Message));
+        msg.msg_type = MSG_COMMAND;
+        msg.command = CMD_VIEWREQUESTS;
+        strncpy(msg.username, username, MAX_USERNAME - 1);
+        
+        send_message(nm_socket, &msg);
+        
+        Message response;
+        if (receive_message(nm_socket, &response) < 0) {
+            printf("ERROR: Communication failed\n");
+            return;
+        }
+        
+        if (response.error_code != SUCCESS) {
+            printf("ERROR: %s\n\n", get_error_message(response.error_code));
+            return;
+        }
+        
+        if (strcmp(response.data, "No pending access requests") != 0) {
+            if (found++ == 0) {
+                printf("Pending Access Requests:\n");
+            }
+            printf("%s\n", response.data);
+        }
+    }
+    
+    if (found == 0) {
+        printf("Pending Access Requests:\nNo pending access requests\n");
+    }
+    printf("\n");
 }
 
 // BONUS: Approve request
@@ -1380,23 +1685,26 @@ void cmd_denyrequest(char* filename, char* requester) {
 
 void show_help() {
     printf("\nAvailable Commands:\n");
-    printf("  VIEW                          List files\n");
-    printf("  READ <filename>               Read file contents\n");
+    printf("  VIEW [-a] [-l] [prefix]       List your files (-a: all files, -l: details)\n");
+    printf("  READ <filename> [off] [len]   Read file contents (optionally a byte range)\n");
     printf("  CREATE <filename>             Create a new file\n");
     printf("  WRITE <filename> <sent#>      Write to file (enter edit mode)\n");
+    printf("  WRITE <filename> <a>-<b>      Edit sentences a..b in one write\n");
+    printf("  UPLOAD <filename> <localpath> Replace file contents with a local file\n");
     printf("  DELETE <filename>             Delete a file\n");
     printf("  INFO <filename>               Show file metadata\n");
     printf("  FILEINFO <filename>           Show detailed file information\n");
     printf("  COPY <source> <destination>   Copy file to new name\n");
-    printf("  STREAM <filename>             Stream file word-by-word\n");
+    printf("  STREAM <filename> [pace_ms]   Stream file word-by-word (pace 0: all at once)\n");
     printf("  UNDO <filename>               Undo last write\n");
     printf("  ADDACCESS <filename> <user>   Grant user access\n");
     printf("  REMACCESS <filename> <user>   Revoke user access\n");
     printf("  EXEC <filename>               Execute file on server\n");
     printf("  LIST                          List all users\n");
+    printf("  METRICS [filename]            Server counters and latencies (NM, or the file's SS)\n");
     printf("\nBonus Commands:\n");
     printf("  CREATEFOLDER <name>           Create a folder\n");
-    printf("  MOVE <file> <folder>          Move file to folder\n");
+    printf("  MOVE <file> <folder|name>     Move file to folder, or rename it\n");
     printf("  VIEWFOLDER <name>             View folder contents\n");
     printf("  CHECKPOINT <file> <tag>       Save checkpoint\n");
     printf("  VIEWCHECKPOINT <file> <tag>   View checkpoint\n");
@@ -1410,6 +1718,221 @@ void show_help() {
     printf("  EXIT                          Exit client\n\n");
 }
 
+// Point nm_socket at the shard for this command: the one owning the file
+// it names, or the bootstrap shard. Listings pick their shards themselves.
+static int route_command(const char* command, const char* name) {
+    static const char* by_name[] = {
+        "CREATE", "READ", "WRITE", "UPLOAD", "DELETE", "INFO", "FILEINFO", "COPY",
+        "STREAM", "UNDO", "ADDACCESS", "REMACCESS", "EXEC", "MOVE", "CHECKPOINT",
+        "VIEWCHECKPOINT", "REVERT", "LISTCHECKPOINTS", "REQUESTACCESS",
+        "APPROVEREQUEST", "DENYREQUEST", "METRICS", NULL
+    };
+    
+    if (name) {
+        for (int i = 0; by_name[i]; i++) {
+            if (strcmp(command, by_name[i]) == 0) {
+                return use_shard(shard_map_lookup(shard_map, name));
+            }
+        }
+        
+        if (strcmp(command, "CREATEFOLDER") == 0) {
+            // Folders are registered as a "<name>/" marker
+            char marker[MAX_FILENAME + 1];
+            size_t len = strlen(name);
+            while (len > 0 && name[len - 1] == '/') {
+                len--;
+            }
+            snprintf(marker, sizeof(marker), "%.*s/", (int)len, name);
+            return use_shard(shard_map_lookup(shard_map, marker));
+        }
+    }
+    
+    return use_shard(bootstrap_shard);
+}
+
+// Run one command line as typed at the prompt; returns 1 for EXIT
+static int run_command(const char* line) {
+    // Parse command
+    char command[64];
+    char arg1[MAX_FILENAME];
+    char arg2[64];
+    char arg3[64];
+    int args = sscanf(line, "%63s %255s %63s %63s", command, arg1, arg2, arg3);
+    
+    if (args < 1) {
+        return 0;
+    }
+    
+    // Convert to uppercase
+    for (int i = 0; command[i]; i++) {
+        command[i] = toupper(command[i]);
+    }
+    
+    if (route_command(command, args > 1 ? arg1 : NULL) < 0) {
+        return 0;
+    }
+    
+    if (strcmp(command, "EXIT") == 0 || strcmp(command, "QUIT") == 0) {
+        return 1;
+    } else if (strcmp(command, "HELP") == 0) {
+        show_help();
+    } else if (strcmp(command, "VIEW") == 0) {
+        if (args > 1 && arg1[0] == '-') {
+            cmd_view(arg1, args > 2 ? arg2 : "");
+        } else {
+            cmd_view("", args > 1 ? arg1 : "");
+        }
+    } else if (strcmp(command, "CREATE") == 0) {
+        if (args < 2) {
+            printf("Usage: CREATE <filename>\n\n");
+        } else {
+            cmd_create(arg1);
+        }
+    } else if (strcmp(command, "READ") == 0) {
+        if (args < 2) {
+            printf("Usage: READ <filename> [offset] [length]\n\n");
+        } else {
+            cmd_read(arg1, args > 2 ? atoll(arg2) : 0, args > 3 ? atoll(arg3) : 0);
+        }
+    } else if (strcmp(command, "UPLOAD") == 0) {
+        char local_path[512];
+        if (args < 3 || sscanf(line, "%*s %*s %511s", local_path) != 1) {
+            printf("Usage: UPLOAD <filename> <localpath>\n\n");
+        } else {
+            cmd_upload(arg1, local_path);
+        }
+    } else if (strcmp(command, "WRITE") == 0) {
+        if (args < 3) {
+            printf("Usage: WRITE <filename> <sentence_index>[-<last_sentence>]\n\n");
+        } else {
+            cmd_write(arg1, arg2);
+        }
+    } else if (strcmp(command, "DELETE") == 0) {
+        if (args < 2) {
+            printf("Usage: DELETE <filename>\n\n");
+        } else {
+            cmd_delete(arg1);
+        }
+    } else if (strcmp(command, "INFO") == 0) {
+        if (args < 2) {
+            printf("Usage: INFO <filename>\n\n");
+        } else {
+            cmd_info(arg1);
+        }
+    } else if (strcmp(command, "FILEINFO") == 0) {
+        if (args < 2) {
+            printf("Usage: FILEINFO <filename>\n\n");
+        } else {
+            cmd_fileinfo(arg1);
+        }
+    } else if (strcmp(command, "COPY") == 0) {
+        if (args < 3) {
+            printf("Usage: COPY <source> <destination>\n\n");
+        } else {
+            cmd_copy(arg1, arg2);
+        }
+    } else if (strcmp(command, "STREAM") == 0) {
+        if (args < 2) {
+            printf("Usage: STREAM <filename> [pace_ms]\n\n");
+        } else {
+            cmd_stream(arg1, args > 2 ? atoi(arg2) : -1);
+        }
+    } else if (strcmp(command, "UNDO") == 0) {
+        if (args < 2) {
+            printf("Usage: UNDO <filename>\n\n");
+        } else {
+            cmd_undo(arg1);
+        }
+    } else if (strcmp(command, "ADDACCESS") == 0) {
+        if (args < 3) {
+            printf("Usage: ADDACCESS <filename> <username>\n\n");
+        } else {
+            cmd_addaccess(arg1, arg2);
+        }
+    } else if (strcmp(command, "REMACCESS") == 0) {
+        if (args < 3) {
+            printf("Usage: REMACCESS <filename> <username>\n\n");
+        } else {
+            cmd_remaccess(arg1, arg2);
+        }
+    } else if (strcmp(command, "EXEC") == 0) {
+        if (args < 2) {
+            printf("Usage: EXEC <filename>\n\n");
+        } else {
+            cmd_exec(arg1);
+        }
+    } else if (strcmp(command, "LIST") == 0) {
+        cmd_list();
+    } else if (strcmp(command, "CREATEFOLDER") == 0) {
+        if (args < 2) {
+            printf("Usage: CREATEFOLDER <foldername>\n\n");
+        } else {
+            cmd_createfolder(arg1);
+        }
+    } else if (strcmp(command, "MOVE") == 0) {
+        if (args < 3) {
+            printf("Usage: MOVE <filename> <folder or new name>\n\n");
+        } else {
+            cmd_move(arg1, arg2);
+        }
+    } else if (strcmp(command, "VIEWFOLDER") == 0) {
+        if (args < 2) {
+            printf("Usage: VIEWFOLDER <foldername>\n\n");
+        } else {
+            cmd_viewfolder(arg1);
+        }
+    } else if (strcmp(command, "CHECKPOINT") == 0) {
+        if (args < 3) {
+            printf("Usage: CHECKPOINT <filename> <tag>\n\n");
+        } else {
+            cmd_checkpoint(arg1, arg2);
+        }
+    } else if (strcmp(command, "VIEWCHECKPOINT") == 0) {
+        if (args < 3) {
+            printf("Usage: VIEWCHECKPOINT <filename> <tag>\n\n");
+        } else {
+            cmd_viewcheckpoint(arg1, arg2);
+        }
+    } else if (strcmp(command, "REVERT") == 0) {
+        if (args < 3) {
+            printf("Usage: REVERT <filename> <tag>\n\n");
+        } else {
+            cmd_revert(arg1, arg2);
+        }
+    } else if (strcmp(command, "LISTCHECKPOINTS") == 0) {
+        if (args < 2) {
+            printf("Usage: LISTCHECKPOINTS <filename>\n\n");
+        } else {
+            cmd_listcheckpoints(arg1);
+        }
+    } else if (strcmp(command, "REQUESTACCESS") == 0) {
+        if (args < 2) {
+            printf("Usage: REQUESTACCESS <filename>\n\n");
+        } else {
+            cmd_requestaccess(arg1);
+        }
+    } else if (strcmp(command, "VIEWREQUESTS") == 0) {
+        cmd_viewrequests();
+    } else if (strcmp(command, "METRICS") == 0) {
+        cmd_metrics(args > 1 ? arg1 : NULL);
+    } else if (strcmp(command, "APPROVEREQUEST") == 0) {
+        if (args < 3) {
+            printf("Usage: APPROVEREQUEST <filename> <username>\n\n");
+        } else {
+            cmd_approverequest(arg1, arg2);
+        }
+    } else if (strcmp(command, "DENYREQUEST") == 0) {
+        if (args < 3) {
+            printf("Usage: DENYREQUEST <filename> <username>\n\n");
+        } else {
+            cmd_denyrequest(arg1, arg2);
+        }
+    } else {
+        printf("Unknown command: %s. Type HELP for available commands.\n\n", command);
+    }
+    return 0;
+}
+
 void command_loop() {
     char line[512];
     
@@ -1430,180 +1953,564 @@ void command_loop() {
             continue;
         }
         
-        // Parse command
-        char command[64];
-        char arg1[MAX_FILENAME];
-        char arg2[64];
-        int args = sscanf(line, "%s %s %s", command, arg1, arg2);
-        
-        if (args < 1) {
-            continue;
+        if (run_command(line)) {
+            break;
         }
-        
-        // Convert to uppercase
-        for (int i = 0; command[i]; i++) {
-            command[i] = toupper(command[i]);
+    }
+}
+
+// Batch mode: client --batch [file] (stdin by default) for scripted jobs.
+// The input is what would be typed at the prompt: the username, then one
+// command per line, WRITE followed by its edits and ETIRW.
+//
+// CREATE, DELETE, READ, INFO and WRITE are pipelined: up to
+// CLIENT_PIPELINE_DEPTH (default 32) of them are in flight at once over one
+// connection per server, and replies are matched to commands by request ID,
+// so commands may finish out of order. Commands on the same file still run
+// in input order. Any other command waits for everything before it and runs
+// as it would interactively. Every command's result starts with its input
+// line number: "<line>: <outcome>" for pipelined ones, a "<line>: <command>:"
+// line followed by the usual output for the others.
+enum { BATCH_CREATE, BATCH_DELETE, BATCH_READ, BATCH_INFO, BATCH_WRITE };
+enum { PHASE_NM, PHASE_SS, PHASE_STREAM, PHASE_RELEASE };
+
+typedef struct BatchJob {
+    int line;
+    int kind;
+    char filename[MAX_FILENAME];
+    char args[BUFFER_SIZE];    // READ: "offset|length"; WRITE: the edits (see write_format_edits)
+    char range[64];            // WRITE: sentences to lease
+    char lease[128];           // WRITE: the lease granted
+    
+    int phase;
+    int fd;                    // Connection the outstanding request went out on
+    int nm_fd;                 // WRITE: where the lock is released
+    uint32_t request_id;
+    int retried;               // Already sent again after a stale location
+    int error;                 // Outcome; for WRITE, of the commit
+    char* output;              // READ: content so far
+    size_t output_len;
+    size_t output_cap;
+    struct BatchJob* next;
+} BatchJob;
+
+typedef struct {
+    char key[80];              // "ip:port"
+    int fd;
+} BatchConn;
+
+typedef struct {
+    BatchJob* queued;          // Parsed, not started, in input order
+    BatchJob* active;
+    int queued_count;
+    int active_count;
+    HashMap* files;            // Names with a job in flight
+    BatchConn ss[16];
+    int ss_count;
+    uint32_t next_id;
+    int done;
+    int failed;
+} Batch;
+
+// Connection to a Storage Server, kept for the whole batch so that its
+// requests can be pipelined
+static int batch_ss_socket(Batch* batch, const char* address) {
+    char ip[64];
+    int port;
+    if (sscanf(address, "%63[^|]|%d", ip, &port) != 2) {
+        return -1;
+    }
+    
+    char key[80];
+    snprintf(key, sizeof(key), "%s:%d", ip, port);
+    for (int i = 0; i < batch->ss_count; i++) {
+        if (strcmp(batch->ss[i].key, key) == 0) {
+            return batch->ss[i].fd;
         }
-        
-        if (strcmp(command, "EXIT") == 0 || strcmp(command, "QUIT") == 0) {
+    }
+    if (batch->ss_count == (int)(sizeof(batch->ss) / sizeof(batch->ss[0]))) {
+        return -1;
+    }
+    
+    int fd = connect_to_ss(ip, port);
+    if (fd >= 0) {
+        snprintf(batch->ss[batch->ss_count].key, sizeof(batch->ss[0].key), "%s", key);
+        batch->ss[batch->ss_count++].fd = fd;
+    }
+    return fd;
+}
+
+// The Name Server shard owning filename
+static int batch_nm_socket(const char* filename) {
+    return use_shard(shard_map_lookup(shard_map, filename)) < 0 ? -1 : nm_socket;
+}
+
+static int batch_send(Batch* batch, BatchJob* job, int fd, Message* msg) {
+    if (fd < 0) {
+        return -1;
+    }
+    if (++batch->next_id == 0) {
+        batch->next_id = 1;  // 0 is what servers that do not echo IDs send
+    }
+    msg->request_id = batch->next_id;
+    job->request_id = msg->request_id;
+    job->fd = fd;
+    strncpy(msg->username, username, MAX_USERNAME - 1);
+    strncpy(msg->filename, job->filename, MAX_FILENAME - 1);
+    return send_message(fd, msg);
+}
+
+static int batch_send_nm(Batch* batch, BatchJob* job, int command, const char* data) {
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.msg_type = MSG_COMMAND;
+    msg.command = command;
+    snprintf(msg.data, BUFFER_SIZE, "%s", data);
+    job->phase = PHASE_NM;
+    return batch_send(batch, job, batch_nm_socket(job->filename), &msg);
+}
+
+static int batch_send_ss(Batch* batch, BatchJob* job, const char* address, uint16_t gen) {
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.msg_type = MSG_SS_COMMAND;
+    msg.location_gen = gen;
+    switch (job->kind) {
+        case BATCH_CREATE:
+            msg.command = CMD_CREATE;
             break;
-        } else if (strcmp(command, "HELP") == 0) {
-            show_help();
-        } else if (strcmp(command, "VIEW") == 0) {
-            cmd_view(args > 1 ? arg1 : "");
-        } else if (strcmp(command, "CREATE") == 0) {
-            if (args < 2) {
-                printf("Usage: CREATE <filename>\n\n");
-            } else {
-                cmd_create(arg1);
-            }
-        } else if (strcmp(command, "READ") == 0) {
-            if (args < 2) {
-                printf("Usage: READ <filename>\n\n");
-            } else {
-                cmd_read(arg1);
-            }
-        } else if (strcmp(command, "WRITE") == 0) {
-            if (args < 3) {
-                printf("Usage: WRITE <filename> <sentence_index>\n\n");
-            } else {
-                int sent_idx = atoi(arg2);
-                cmd_write(arg1, sent_idx);
-            }
-        } else if (strcmp(command, "DELETE") == 0) {
-            if (args < 2) {
-                printf("Usage: DELETE <filename>\n\n");
-            } else {
-                cmd_delete(arg1);
-            }
-        } else if (strcmp(command, "INFO") == 0) {
-            if (args < 2) {
-                printf("Usage: INFO <filename>\n\n");
-            } else {
-                cmd_info(arg1);
-            }
-        } else if (strcmp(command, "FILEINFO") == 0) {
-            if (args < 2) {
-                printf("Usage: FILEINFO <filename>\n\n");
-            } else {
-                cmd_fileinfo(arg1);
-            }
-        } else if (strcmp(command, "COPY") == 0) {
-            if (args < 3) {
-                printf("Usage: COPY <source> <destination>\n\n");
-            } else {
-                cmd_copy(arg1, arg2);
+        case BATCH_READ:
+            msg.command = CMD_READ_CHUNKED;
+            snprintf(msg.data, BUFFER_SIZE, "%s", job->args);
+            break;
+        case BATCH_INFO:
+            msg.command = CMD_INFO;
+            break;
+        default:
+            msg.command = CMD_WRITE_COMMIT;
+            // batch_parse left room for the lease in front of the edits
+            size_t lease_len = strlen(job->lease);
+            memcpy(msg.data, job->lease, lease_len);
+            snprintf(msg.data + lease_len, BUFFER_SIZE - lease_len, "%s", job->args);
+    }
+    job->phase = PHASE_SS;
+    return batch_send(batch, job, batch_ss_socket(batch, address), &msg);
+}
+
+// Reads and INFO go straight to the cached location when there is one
+static int batch_locate(Batch* batch, BatchJob* job) {
+    if (job->kind == BATCH_READ || job->kind == BATCH_INFO) {
+        CachedLocation* cached = location_lookup(job->filename);
+        if (cached) {
+            char address[80];
+            snprintf(address, sizeof(address), "%s|%d", cached->ip, cached->port);
+            if (batch_send_ss(batch, job, address, cached->gen) == 0) {
+                return 0;
             }
-        } else if (strcmp(command, "STREAM") == 0) {
-            if (args < 2) {
-                printf("Usage: STREAM <filename>\n\n");
-            } else {
-                cmd_stream(arg1);
+            location_forget(job->filename);
+        }
+    }
+    
+    switch (job->kind) {
+        case BATCH_CREATE:
+            return batch_send_nm(batch, job, CMD_CREATE, "");
+        case BATCH_DELETE:
+            return batch_send_nm(batch, job, CMD_DELETE, "");
+        case BATCH_WRITE: {
+            int rc = batch_send_nm(batch, job, CMD_LOCK_ACQUIRE, job->range);
+            job->nm_fd = job->fd;
+            return rc;
+        }
+        default:
+            return batch_send_nm(batch, job, CMD_READ_CHUNKED, "");
+    }
+}
+
+static const char* batch_command_name(int kind) {
+    static const char* names[] = {"CREATE", "DELETE", "READ", "INFO", "WRITE"};
+    return names[kind];
+}
+
+static void batch_finish(Batch* batch, BatchJob* job, const char* text) {
+    printf("%d: %s %s: ", job->line, batch_command_name(job->kind), job->filename);
+    if (job->error != SUCCESS) {
+        printf("ERROR: %s\n", get_error_message(job->error));
+        batch->failed++;
+    } else if (job->kind == BATCH_READ) {
+        printf("\n%.*s\n", (int)job->output_len, job->output ? job->output : "");
+    } else if (text && text[0]) {
+        printf("\n%s\n", text);
+    } else {
+        printf("OK\n");
+    }
+    batch->done++;
+    job->phase = -1;
+}
+
+// Next step of job after reply (which arrived on job->fd)
+static void batch_advance(Batch* batch, BatchJob* job, Message* reply) {
+    int rc = 0;
+    
+    switch (job->phase) {
+        case PHASE_NM:
+            job->error = reply->error_code;
+            if (job->error != SUCCESS || job->kind == BATCH_DELETE) {
+                if (job->kind == BATCH_DELETE) {
+                    location_forget(job->filename);
+                }
+                batch_finish(batch, job, NULL);
+                return;
             }
-        } else if (strcmp(command, "UNDO") == 0) {
-            if (args < 2) {
-                printf("Usage: UNDO <filename>\n\n");
-            } else {
-                cmd_undo(arg1);
+            if (job->kind == BATCH_READ || job->kind == BATCH_INFO) {
+                location_remember(job->filename, reply->data);
             }
-        } else if (strcmp(command, "ADDACCESS") == 0) {
-            if (args < 3) {
-                printf("Usage: ADDACCESS <filename> <username>\n\n");
-            } else {
-                cmd_addaccess(arg1, arg2);
+            if (job->kind == BATCH_WRITE) {
+                const char* lease = strstr(reply->data, LEASE_PREFIX);
+                snprintf(job->lease, sizeof(job->lease), "%s", lease ? lease : "");
             }
-        } else if (strcmp(command, "REMACCESS") == 0) {
-            if (args < 3) {
-                printf("Usage: REMACCESS <filename> <username>\n\n");
-            } else {
-                cmd_remaccess(arg1, arg2);
+            rc = batch_send_ss(batch, job, reply->data, 0);
+            break;
+        
+        case PHASE_SS:
+            if (reply->error_code == ERR_STALE_LOCATION && !job->retried) {
+                job->retried = 1;
+                location_forget(job->filename);
+                rc = reply->data[0] ? batch_send_ss(batch, job, reply->data, 0)
+                                    : batch_locate(batch, job);
+                break;
             }
-        } else if (strcmp(command, "EXEC") == 0) {
-            if (args < 2) {
-                printf("Usage: EXEC <filename>\n\n");
-            } else {
-                cmd_exec(arg1);
+            job->error = reply->error_code;
+            if (job->kind == BATCH_WRITE) {
+                Message msg;
+                memset(&msg, 0, sizeof(Message));
+                msg.msg_type = MSG_COMMAND;
+                msg.command = CMD_LOCK_RELEASE;
+                if (job->lease[0]) {
+                    snprintf(msg.data, BUFFER_SIZE, "%s", job->lease);
+                } else {
+                    snprintf(msg.data, BUFFER_SIZE, "%d", atoi(job->range));
+                }
+                job->phase = PHASE_RELEASE;
+                rc = batch_send(batch, job, job->nm_fd, &msg);
+                break;
             }
-        } else if (strcmp(command, "LIST") == 0) {
-            cmd_list();
-        } else if (strcmp(command, "CREATEFOLDER") == 0) {
-            if (args < 2) {
-                printf("Usage: CREATEFOLDER <foldername>\n\n");
-            } else {
-                cmd_createfolder(arg1);
+            if (job->kind == BATCH_READ && job->error == SUCCESS) {
+                job->phase = PHASE_STREAM;
+                return;
             }
-        } else if (strcmp(command, "MOVE") == 0) {
-            if (args < 3) {
-                printf("Usage: MOVE <filename> <foldername>\n\n");
-            } else {
-                cmd_move(arg1, arg2);
+            batch_finish(batch, job, job->kind == BATCH_INFO ? reply->data : NULL);
+            return;
+        
+        case PHASE_STREAM:
+            if (reply->msg_type == MSG_CHUNK) {
+                const char* data = message_payload(reply);
+                size_t len = message_payload_len(reply);
+                if (job->output_len + len > job->output_cap) {
+                    size_t cap = job->output_cap ? job->output_cap : 4096;
+                    while (cap < job->output_len + len) {
+                        cap *= 2;
+                    }
+                    job->output = (char*)realloc(job->output, cap);
+                    job->output_cap = cap;
+                }
+                memcpy(job->output + job->output_len, data, len);
+                job->output_len += len;
+                return;
             }
-        } else if (strcmp(command, "VIEWFOLDER") == 0) {
-            if (args < 2) {
-                printf("Usage: VIEWFOLDER <foldername>\n\n");
-            } else {
-                cmd_viewfolder(arg1);
+            job->error = reply->error_code;
+            batch_finish(batch, job, NULL);
+            return;
+        
+        case PHASE_RELEASE:
+            batch_finish(batch, job, NULL);  // The commit's outcome
+            return;
+    }
+    
+    if (rc < 0) {
+        job->error = job->error != SUCCESS ? job->error : ERR_STORAGE_SERVER_DOWN;
+        batch_finish(batch, job, NULL);
+    }
+}
+
+// Parse one input line into a job; NULL if it is not a pipelined command.
+// WRITE reads its edits from in.
+static BatchJob* batch_parse(const char* line, int* line_no, FILE* in) {
+    char command[64], arg1[MAX_FILENAME], arg2[64], arg3[64];
+    int args = sscanf(line, "%63s %255s %63s %63s", command, arg1, arg2, arg3);
+    if (args < 2) {
+        return NULL;
+    }
+    for (int i = 0; command[i]; i++) {
+        command[i] = toupper(command[i]);
+    }
+    
+    static const char* kinds[] = {"CREATE", "DELETE", "READ", "INFO", "WRITE"};
+    int kind = -1;
+    for (int i = 0; i < 5; i++) {
+        if (strcmp(command, kinds[i]) == 0) {
+            kind = i;
+        }
+    }
+    if (kind < 0 || (kind == BATCH_WRITE && args < 3)) {
+        return NULL;
+    }
+    
+    BatchJob* job = (BatchJob*)calloc(1, sizeof(BatchJob));
+    job->line = *line_no;
+    job->kind = kind;
+    job->fd = -1;
+    job->nm_fd = -1;
+    snprintf(job->filename, sizeof(job->filename), "%s", arg1);
+    
+    if (kind == BATCH_READ && args > 2) {
+        snprintf(job->args, sizeof(job->args), "%lld|%lld", atoll(arg2), args > 3 ? atoll(arg3) : 0);
+    } else if (kind == BATCH_WRITE) {
+        // Same edit lines as interactive WRITE, up to ETIRW. A bad range
+        // is left for the Name Server to refuse.
+        static WriteEdits w;
+        snprintf(job->range, sizeof(job->range), "%s", arg2);
+        int ranged = write_parse_range(arg2, &w) == 0;
+        char edit[512];
+        while (fgets(edit, sizeof(edit), in)) {
+            (*line_no)++;
+            edit[strcspn(edit, "\n")] = 0;
+            if (strcmp(edit, "ETIRW") == 0) {
+                break;
             }
-        } else if (strcmp(command, "CHECKPOINT") == 0) {
-            if (args < 3) {
-                printf("Usage: CHECKPOINT <filename> <tag>\n\n");
-            } else {
-                cmd_checkpoint(arg1, arg2);
+            if (ranged) {
+                write_add_edit(&w, edit);
             }
-        } else if (strcmp(command, "VIEWCHECKPOINT") == 0) {
-            if (args < 3) {
-                printf("Usage: VIEWCHECKPOINT <filename> <tag>\n\n");
-            } else {
-                cmd_viewcheckpoint(arg1, arg2);
+        }
+        if (ranged && w.count == 0) {
+            snprintf(job->args, BUFFER_SIZE, "\n%d|", w.first);
+        } else if (ranged && write_format_edits(&w, job->args,
+                                                sizeof(job->args) - sizeof(job->lease)) < 0) {
+            job->error = ERR_INVALID_PARAMETERS;  // Edits too large for one write
+        }
+    }
+    return job;
+}
+
+// Start queued jobs, in order, while the window has room and their file is
+// not busy
+static void batch_start(Batch* batch, int depth) {
+    BatchJob** link = &batch->queued;
+    while (*link && batch->active_count < depth) {
+        BatchJob* job = *link;
+        if (hashmap_contains(batch->files, job->filename)) {
+            link = &job->next;
+            continue;
+        }
+        
+        *link = job->next;
+        batch->queued_count--;
+        if (job->error != SUCCESS || batch_locate(batch, job) < 0) {
+            job->error = job->error != SUCCESS ? job->error : ERR_STORAGE_SERVER_DOWN;
+            batch_finish(batch, job, NULL);
+            free(job);
+            continue;
+        }
+        
+        hashmap_put(batch->files, job->filename, strdup(""));
+        job->next = batch->active;
+        batch->active = job;
+        batch->active_count++;
+    }
+}
+
+// Drop finished jobs from the active list
+static void batch_reap(Batch* batch) {
+    BatchJob** link = &batch->active;
+    while (*link) {
+        BatchJob* job = *link;
+        if (job->phase >= 0) {
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+        batch->active_count--;
+        hashmap_remove(batch->files, job->filename);
+        free(job->output);
+        free(job);
+    }
+}
+
+// A connection failed: every job waiting on it fails with it
+static void batch_drop_connection(Batch* batch, int fd) {
+    for (BatchJob* job = batch->active; job; job = job->next) {
+        if (job->phase >= 0 && job->fd == fd) {
+            job->error = ERR_STORAGE_SERVER_DOWN;
+            batch_finish(batch, job, NULL);
+        }
+    }
+    for (int i = 0; i < batch->ss_count; i++) {
+        if (batch->ss[i].fd == fd) {
+            done_with_ss(fd, 0);
+            batch->ss[i] = batch->ss[--batch->ss_count];
+            return;
+        }
+    }
+    for (int i = 0; i < shard_map->count; i++) {
+        if (shard_sockets[i] == fd) {
+            close(fd);
+            shard_sockets[i] = -1;
+        }
+    }
+}
+
+// Wait for replies and hand each to its job
+static void batch_poll(Batch* batch) {
+    struct pollfd fds[64];
+    int count = 0;
+    for (BatchJob* job = batch->active; job && count < 64; job = job->next) {
+        int seen = 0;
+        for (int i = 0; i < count && !seen; i++) {
+            seen = fds[i].fd == job->fd;
+        }
+        if (!seen) {
+            fds[count].fd = job->fd;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            count++;
+        }
+    }
+    
+    if (poll(fds, count, 5000) <= 0) {
+        return;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (!fds[i].revents) {
+            continue;
+        }
+        
+        Message reply;
+        if (receive_message(fds[i].fd, &reply) < 0) {
+            batch_drop_connection(batch, fds[i].fd);
+            continue;
+        }
+        
+        BatchJob* job = batch->active;
+        while (job && (job->phase < 0 || job->fd != fds[i].fd || job->request_id != reply.request_id)) {
+            job = job->next;
+        }
+        if (job) {
+            batch_advance(batch, job, &reply);
+        }
+        message_free_body(&reply);
+    }
+}
+
+void batch_loop(FILE* in) {
+    int depth = config_get_int("CLIENT_PIPELINE_DEPTH", 32);
+    if (depth <= 0) {
+        depth = 1;
+    }
+    
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.files = hashmap_create();
+    
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    
+    char line[512];
+    char* barrier = NULL;  // Non-pipelined command waiting for the rest to finish
+    int barrier_line = 0;
+    int line_no = 1;       // The username was line 1
+    int eof = 0;
+    
+    while (running) {
+        // Read ahead to keep the window full, up to the next barrier
+        while (!eof && !barrier && batch.queued_count < depth) {
+            if (!fgets(line, sizeof(line), in)) {
+                eof = 1;
+                break;
             }
-        } else if (strcmp(command, "REVERT") == 0) {
-            if (args < 3) {
-                printf("Usage: REVERT <filename> <tag>\n\n");
-            } else {
-                cmd_revert(arg1, arg2);
+            line_no++;
+            line[strcspn(line, "\n")] = 0;
+            if (strlen(line) == 0) {
+                continue;
             }
-        } else if (strcmp(command, "LISTCHECKPOINTS") == 0) {
-            if (args < 2) {
-                printf("Usage: LISTCHECKPOINTS <filename>\n\n");
-            } else {
-                cmd_listcheckpoints(arg1);
+            
+            BatchJob* job = batch_parse(line, &line_no, in);
+            if (!job) {
+                barrier = strdup(line);
+                barrier_line = line_no;
+                break;
             }
-        } else if (strcmp(command, "REQUESTACCESS") == 0) {
-            if (args < 2) {
-                printf("Usage: REQUESTACCESS <filename>\n\n");
-            } else {
-                cmd_requestaccess(arg1);
+            BatchJob** tail = &batch.queued;
+            while (*tail) {
+                tail = &(*tail)->next;
             }
-        } else if (strcmp(command, "VIEWREQUESTS") == 0) {
-            cmd_viewrequests();
-        } else if (strcmp(command, "APPROVEREQUEST") == 0) {
-            if (args < 3) {
-                printf("Usage: APPROVEREQUEST <filename> <username>\n\n");
-            } else {
-                cmd_approverequest(arg1, arg2);
+            *tail = job;
+            batch.queued_count++;
+        }
+        
+        batch_start(&batch, depth);
+        
+        if (batch.active_count == 0 && batch.queued_count == 0) {
+            if (barrier) {
+                printf("%d: %s:\n", barrier_line, barrier);
+                int quit = run_command(barrier);
+                free(barrier);
+                barrier = NULL;
+                fflush(stdout);
+                if (quit) {
+                    break;
+                }
+                continue;
             }
-        } else if (strcmp(command, "DENYREQUEST") == 0) {
-            if (args < 3) {
-                printf("Usage: DENYREQUEST <filename> <username>\n\n");
-            } else {
-                cmd_denyrequest(arg1, arg2);
+            if (eof) {
+                break;
             }
-        } else {
-            printf("Unknown command: %s. Type HELP for available commands.\n\n", command);
+            continue;
         }
+        
+        batch_poll(&batch);
+        batch_reap(&batch);
+        fflush(stdout);
     }
+    
+    free(barrier);
+    hashmap_destroy(batch.files);
+    for (int i = 0; i < batch.ss_count; i++) {
+        done_with_ss(batch.ss[i].fd, 1);
+    }
+    
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double elapsed_ms = (finished.tv_sec - started.tv_sec) * 1000.0 +
+                        (finished.tv_nsec - started.tv_nsec) / 1e6;
+    printf("Batch: %d commands pipelined, %d failed, %.1f ms\n", batch.done, batch.failed, elapsed_ms);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     signal(SIGINT, signal_handler_client);
     signal(SIGTERM, signal_handler_client);
     
-    printf("=== Distributed File System Client ===\n\n");
+    // client --batch [file]: run a script, pipelined (see batch_loop)
+    FILE* batch_in = NULL;
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        batch_in = argc > 2 && strcmp(argv[2], "-") != 0 ? fopen(argv[2], "r") : stdin;
+        if (!batch_in) {
+            fprintf(stderr, "Cannot open %s: %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+    } else if (argc > 1) {
+        fprintf(stderr, "Usage: %s [--batch [file]]\n", argv[0]);
+        return 1;
+    }
+    FILE* in = batch_in ? batch_in : stdin;
     
-    // Get username
-    printf("Enter your username: ");
-    fflush(stdout);
-    if (!fgets(username, MAX_USERNAME, stdin)) {
+    if (!batch_in) {
+        printf("=== Distributed File System Client ===\n\n");
+        
+        // Get username
+        printf("Enter your username: ");
+        fflush(stdout);
+    }
+    if (!fgets(username, MAX_USERNAME, in)) {
         return 1;
     }
     username[strcspn(username, "\n")] = 0;
@@ -1613,13 +2520,30 @@ int main() {
         return 1;
     }
     
-    printf("Welcome, %s!\n\n", username);
+    if (!batch_in) {
+        printf("Welcome, %s!\n\n", username);
+    }
+    
+    ss_pool = conn_pool_create(config_get_int("CLIENT_SS_POOL", 16));
+    int cache_size = config_get_int("CLIENT_LOCATION_CACHE", 1024);
+    if (cache_size > 0) {
+        location_cache = lru_create(cache_size);
+    }
     
     // Connect to Name Server
     if (connect_to_nm() < 0) {
         return 1;
     }
     
+    if (batch_in) {
+        batch_loop(batch_in);
+        if (batch_in != stdin) {
+            fclose(batch_in);
+        }
+        cleanup_client();
+        return 0;
+    }
+    
     // Start command loop
     command_loop();
     
@@ -0,0 +1,607 @@
+#include "../include/cold_store.h"
+#include "../include/hashmap.h"
+#include "../include/logger.h"
+#include "../include/lz4.h"
+#include "../include/sentence_index.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/time.h>
+
+#define COLD_MAGIC 0x444c4f43u      // "COLD"
+#define COLD_VERSION 2             // 1: no sentence count, still read
+#define COLD_BLOCK (64 * 1024)
+#define COLD_BLOCK_RAW 0x80000000u  // Block length flag: stored uncompressed
+
+// Start of a frozen file, followed by blocks of COLD_BLOCK raw bytes (the
+// last one shorter), each a uint32_t length and the block
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t raw_size;
+    uint32_t block_size;
+    uint32_t sentences;  // Of the content, for INFO without a thaw (not in logs)
+} ColdHeader;
+
+typedef struct {
+    uint64_t raw_size;     // Content and log together
+    uint64_t stored_size;
+} ColdEntry;
+
+static HashMap* frozen = NULL;          // ColdEntry of each frozen file
+static HashMap* thawed = NULL;          // time_t of each file's last thaw
+static HashMap* incompressible = NULL;  // mtime of content that did not shrink
+static int frozen_count = 0;
+static int cold_after = 604800;
+static long min_bytes = 4096;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ColdStats stats;
+
+static void cold_path(const char* filename, char* path, size_t len) {
+    snprintf(path, len, "data/cold/files/%s", filename);
+}
+
+static void cold_log_path(const char* filename, char* path, size_t len) {
+    snprintf(path, len, "data/cold/history/%s.log", filename);
+}
+
+static void hot_path(const char* filename, char* path, size_t len) {
+    snprintf(path, len, "data/files/%s", filename);
+}
+
+static void hot_log_path(const char* filename, char* path, size_t len) {
+    snprintf(path, len, "data/history/%s.log", filename);
+}
+
+static void count(unsigned long long* counter, unsigned long long n) {
+    pthread_mutex_lock(&stats_lock);
+    *counter += n;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static int write_all(int fd, const void* buf, size_t len) {
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Up to len bytes; fewer only at end of file
+static ssize_t read_full(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*)buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static void make_parent_dirs(const char* path) {
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char* p = strchr(dir, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+}
+
+static void sync_parent_dir(const char* path) {
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Temporary files live in data/cold/tmp, which start up empties
+static int create_temp(char* tmp, size_t len) {
+    snprintf(tmp, len, "data/cold/tmp/XXXXXX");
+    return mkstemp(tmp);
+}
+
+// Sync and close fd, then rename tmp over path. tmp is removed on failure.
+static int commit(int fd, const char* tmp, const char* path) {
+    int ok = fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (ok) {
+        make_parent_dirs(path);
+        ok = rename(tmp, path) == 0;
+    }
+    if (!ok) {
+        unlink(tmp);
+        return -1;
+    }
+    sync_parent_dir(path);
+    return 0;
+}
+
+static int read_header(int fd, ColdHeader* header) {
+    if (read_full(fd, header, sizeof(*header)) != (ssize_t)sizeof(*header) ||
+        header->magic != COLD_MAGIC || header->version < 1 || header->version > COLD_VERSION ||
+        header->block_size == 0 || header->block_size > COLD_BLOCK) {
+        return -1;
+    }
+    return 0;
+}
+
+// Compress src, which has sentences sentences, into path. *raw and
+// *stored get the sizes.
+static int pack(const char* src, const char* path, uint32_t sentences, uint64_t* raw,
+                uint64_t* stored) {
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    
+    char tmp[MAX_PATH];
+    int out = create_temp(tmp, sizeof(tmp));
+    size_t bound = lz4_compress_bound(COLD_BLOCK);
+    char* block = (char*)malloc(COLD_BLOCK);
+    char* packed = (char*)malloc(bound);
+    ColdHeader header = {COLD_MAGIC, COLD_VERSION, 0, COLD_BLOCK, sentences};
+    int ok = out >= 0 && block && packed && write_all(out, &header, sizeof(header)) == 0;
+    *stored = sizeof(header);
+    
+    while (ok) {
+        ssize_t n = read_full(in, block, COLD_BLOCK);
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        
+        size_t len = lz4_compress(block, n, packed, bound);
+        const char* data = packed;
+        uint32_t word = (uint32_t)len;
+        if (len == 0 || len >= (size_t)n) {
+            data = block;
+            len = n;
+            word = (uint32_t)n | COLD_BLOCK_RAW;
+        }
+        ok = write_all(out, &word, sizeof(word)) == 0 && write_all(out, data, len) == 0;
+        header.raw_size += n;
+        *stored += sizeof(word) + len;
+    }
+    ok = ok && pwrite(out, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    *raw = header.raw_size;
+    
+    free(block);
+    free(packed);
+    close(in);
+    if (out < 0) {
+        return -1;
+    }
+    if (!ok) {
+        close(out);
+        unlink(tmp);
+        return -1;
+    }
+    return commit(out, tmp, path);
+}
+
+// Whole content of a frozen file, NUL-terminated; NULL if unreadable
+static char* unpack_buffer(const char* path, size_t* len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    ColdHeader header;
+    char* content = NULL;
+    char* packed = NULL;
+    int ok = read_header(fd, &header) == 0;
+    if (ok) {
+        content = (char*)malloc(header.raw_size + 1);
+        packed = (char*)malloc(lz4_compress_bound(header.block_size));
+        ok = content && packed;
+    }
+    
+    uint64_t done = 0;
+    while (ok && done < header.raw_size) {
+        uint64_t want = header.raw_size - done;
+        if (want > header.block_size) {
+            want = header.block_size;
+        }
+        
+        uint32_t word;
+        ok = read_full(fd, &word, sizeof(word)) == (ssize_t)sizeof(word);
+        size_t stored = word & ~COLD_BLOCK_RAW;
+        if (!ok || stored > lz4_compress_bound(header.block_size)) {
+            ok = 0;
+            break;
+        }
+        
+        if (word & COLD_BLOCK_RAW) {
+            ok = stored == want && read_full(fd, content + done, stored) == (ssize_t)stored;
+        } else {
+            ok = read_full(fd, packed, stored) == (ssize_t)stored &&
+                 lz4_decompress(packed, stored, content + done, want) == (long)want;
+        }
+        done += want;
+    }
+    
+    free(packed);
+    close(fd);
+    if (!ok) {
+        free(content);
+        return NULL;
+    }
+    content[header.raw_size] = '\0';
+    *len = header.raw_size;
+    return content;
+}
+
+static int unpack(const char* path, const char* dst) {
+    size_t len = 0;
+    char* content = unpack_buffer(path, &len);
+    if (!content) {
+        return -1;
+    }
+    
+    char tmp[MAX_PATH];
+    int fd = create_temp(tmp, sizeof(tmp));
+    if (fd < 0) {
+        free(content);
+        return -1;
+    }
+    int ok = write_all(fd, content, len) == 0 && fchmod(fd, 0644) == 0;
+    free(content);
+    if (!ok) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    return commit(fd, tmp, dst);
+}
+
+static uint64_t raw_size_of(const char* path) {
+    ColdHeader header;
+    int fd = open(path, O_RDONLY);
+    int ok = fd >= 0 && read_header(fd, &header) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok ? header.raw_size : 0;
+}
+
+static void add_frozen(const char* filename, uint64_t raw, uint64_t stored) {
+    ColdEntry* entry = (ColdEntry*)malloc(sizeof(ColdEntry));
+    if (!entry) {
+        return;
+    }
+    entry->raw_size = raw;
+    entry->stored_size = stored;
+    hashmap_put(frozen, filename, entry);
+    __atomic_add_fetch(&frozen_count, 1, __ATOMIC_RELAXED);
+    
+    pthread_mutex_lock(&stats_lock);
+    stats.raw_bytes += raw;
+    stats.stored_bytes += stored;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// A frozen file found at start up. With a raw copy as well, a freeze or
+// thaw was interrupted and the raw copy is current.
+static int load_frozen(const char* filename) {
+    char cold[MAX_PATH], cold_log[MAX_PATH], hot[MAX_PATH], hot_log[MAX_PATH];
+    cold_path(filename, cold, sizeof(cold));
+    cold_log_path(filename, cold_log, sizeof(cold_log));
+    hot_path(filename, hot, sizeof(hot));
+    hot_log_path(filename, hot_log, sizeof(hot_log));
+    
+    int has_log = access(cold_log, F_OK) == 0;
+    if (access(hot, F_OK) == 0) {
+        if (has_log && access(hot_log, F_OK) != 0 && unpack(cold_log, hot_log) < 0) {
+            log_message("COLD", "ERROR", "Failed to restore the history of %s", filename);
+        }
+        unlink(cold_log);
+        unlink(cold);
+        return 0;
+    }
+    
+    struct stat st, log_st;
+    uint64_t raw = raw_size_of(cold);
+    if (stat(cold, &st) != 0) {
+        return 0;
+    }
+    uint64_t stored = st.st_size;
+    if (has_log && stat(cold_log, &log_st) == 0) {
+        raw += raw_size_of(cold_log);
+        stored += log_st.st_size;
+    }
+    add_frozen(filename, raw, stored);
+    return 1;
+}
+
+static int scan_frozen(const char* dir, const char* prefix, int* recovered) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        return 0;
+    }
+    
+    int loaded = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        
+        // Names that do not fit cannot be a file's: a cut one would freeze
+        // or thaw some other file
+        char path[MAX_PATH], name[MAX_FILENAME];
+        if (snprintf(path, MAX_PATH, "%s/%s", dir, entry->d_name) >= MAX_PATH ||
+            snprintf(name, MAX_FILENAME, "%s%s", prefix, entry->d_name) >= MAX_FILENAME) {
+            log_message("COLD", "WARNING", "Skipped %s/%s: name too long", dir, entry->d_name);
+            continue;
+        }
+        
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (stat(path, &st) != 0) {
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            char sub_prefix[MAX_FILENAME];
+            if (snprintf(sub_prefix, MAX_FILENAME, "%s/", name) >= MAX_FILENAME) {
+                log_message("COLD", "WARNING", "Skipped %s: name too long", path);
+                continue;
+            }
+            loaded += scan_frozen(path, sub_prefix, recovered);
+        } else if (load_frozen(name)) {
+            loaded++;
+        } else {
+            (*recovered)++;
+        }
+    }
+    
+    closedir(d);
+    return loaded;
+}
+
+void cold_init() {
+    frozen = hashmap_create();
+    thawed = hashmap_create();
+    incompressible = hashmap_create();
+    mkdir("data/cold", 0755);
+    mkdir("data/cold/files", 0755);
+    mkdir("data/cold/history", 0755);
+    mkdir("data/cold/tmp", 0755);
+    
+    cold_after = config_get_int("SS_COLD_AFTER_SEC", 604800);
+    if (cold_after < 0) {
+        cold_after = 0;
+    }
+    min_bytes = config_get_int("SS_COLD_MIN_BYTES", 4096);
+    
+    // Left over from a freeze or thaw that did not finish
+    DIR* d = opendir("data/cold/tmp");
+    if (d) {
+        struct dirent* entry;
+        while ((entry = readdir(d)) != NULL) {
+            char path[MAX_PATH];
+            if (entry->d_name[0] != '.') {
+                snprintf(path, MAX_PATH, "data/cold/tmp/%s", entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(d);
+    }
+    
+    int recovered = 0;
+    int loaded = scan_frozen("data/cold/files", "", &recovered);
+    if (recovered > 0) {
+        log_message("COLD", "WARNING", "Kept the raw copy of %d files found in both tiers",
+                   recovered);
+    }
+    if (cold_after) {
+        log_message("COLD", "INFO", "%d files frozen (%llu bytes for %llu), freezing after %d s idle",
+                   loaded, stats.stored_bytes, stats.raw_bytes, cold_after);
+    } else {
+        log_message("COLD", "INFO", "%d files frozen (%llu bytes for %llu), freezing disabled",
+                   loaded, stats.stored_bytes, stats.raw_bytes);
+    }
+}
+
+int cold_after_seconds() {
+    return cold_after;
+}
+
+long cold_min_bytes() {
+    return min_bytes;
+}
+
+int cold_contains(const char* filename) {
+    return __atomic_load_n(&frozen_count, __ATOMIC_RELAXED) > 0 &&
+           hashmap_contains(frozen, filename);
+}
+
+int cold_freeze(const char* filename) {
+    if (hashmap_contains(frozen, filename)) {
+        return 1;
+    }
+    time_t* thawed_at = (time_t*)hashmap_get(thawed, filename);
+    if (thawed_at && time(NULL) - *thawed_at < cold_after) {
+        return 0;
+    }
+    
+    char cold[MAX_PATH], cold_log[MAX_PATH], hot[MAX_PATH], hot_log[MAX_PATH];
+    cold_path(filename, cold, sizeof(cold));
+    cold_log_path(filename, cold_log, sizeof(cold_log));
+    hot_path(filename, hot, sizeof(hot));
+    hot_log_path(filename, hot_log, sizeof(hot_log));
+    
+    struct stat st;
+    if (stat(hot, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < min_bytes) {
+        return 0;
+    }
+    time_t* tried = (time_t*)hashmap_get(incompressible, filename);
+    if (tried && *tried == st.st_mtime) {
+        return 0;
+    }
+    
+    SentenceIndex* idx = sentence_index_load(filename, hot);
+    uint32_t sentences = idx ? (uint32_t)idx->count : 0;
+    free(idx);
+    
+    uint64_t raw = 0, stored = 0;
+    if (pack(hot, cold, sentences, &raw, &stored) < 0) {
+        log_message("COLD", "ERROR", "Failed to freeze %s: %s", filename, strerror(errno));
+        count(&stats.failures, 1);
+        return -1;
+    }
+    if (stored > raw - raw / 8) {
+        unlink(cold);
+        time_t* mtime = (time_t*)malloc(sizeof(time_t));
+        if (mtime) {
+            *mtime = st.st_mtime;
+            hashmap_put(incompressible, filename, mtime);
+        }
+        count(&stats.incompressible, 1);
+        return 0;
+    }
+    
+    int has_log = access(hot_log, F_OK) == 0;
+    uint64_t log_raw = 0, log_stored = 0;
+    if (has_log && pack(hot_log, cold_log, 0, &log_raw, &log_stored) < 0) {
+        log_message("COLD", "ERROR", "Failed to freeze the history of %s: %s", filename,
+                   strerror(errno));
+        unlink(cold);
+        count(&stats.failures, 1);
+        return -1;
+    }
+    
+    // The raw copies go only once both frozen ones are on disk
+    if (has_log) {
+        unlink(hot_log);
+    }
+    unlink(hot);
+    
+    hashmap_remove(thawed, filename);
+    hashmap_remove(incompressible, filename);
+    add_frozen(filename, raw + log_raw, stored + log_stored);
+    count(&stats.freezes, 1);
+    log_message("COLD", "INFO", "Froze %s: %llu bytes to %llu", filename,
+               (unsigned long long)(raw + log_raw), (unsigned long long)(stored + log_stored));
+    return 1;
+}
+
+int cold_thaw(const char* filename) {
+    ColdEntry* entry = (ColdEntry*)hashmap_get(frozen, filename);
+    if (!entry) {
+        return 0;
+    }
+    
+    struct timeval started, finished;
+    gettimeofday(&started, NULL);
+    
+    char cold[MAX_PATH], cold_log[MAX_PATH], hot[MAX_PATH], hot_log[MAX_PATH];
+    cold_path(filename, cold, sizeof(cold));
+    cold_log_path(filename, cold_log, sizeof(cold_log));
+    hot_path(filename, hot, sizeof(hot));
+    hot_log_path(filename, hot_log, sizeof(hot_log));
+    
+    // The log first: a file with raw content counts as thawed
+    int has_log = access(cold_log, F_OK) == 0;
+    if ((has_log && unpack(cold_log, hot_log) < 0) || unpack(cold, hot) < 0) {
+        log_message("COLD", "ERROR", "Failed to thaw %s: %s", filename, strerror(errno));
+        count(&stats.failures, 1);
+        return -1;
+    }
+    unlink(cold_log);
+    unlink(cold);
+    
+    pthread_mutex_lock(&stats_lock);
+    stats.raw_bytes -= entry->raw_size;
+    stats.stored_bytes -= entry->stored_size;
+    stats.thaws++;
+    pthread_mutex_unlock(&stats_lock);
+    hashmap_remove(frozen, filename);
+    __atomic_sub_fetch(&frozen_count, 1, __ATOMIC_RELAXED);
+    
+    time_t* now = (time_t*)malloc(sizeof(time_t));
+    if (now) {
+        *now = time(NULL);
+        hashmap_put(thawed, filename, now);
+    }
+    
+    gettimeofday(&finished, NULL);
+    long long usec = (finished.tv_sec - started.tv_sec) * 1000000LL +
+                     (finished.tv_usec - started.tv_usec);
+    count(&stats.thaw_us_total, usec);
+    log_message("COLD", "INFO", "Thawed %s in %lld us", filename, usec);
+    return 0;
+}
+
+char* cold_read(const char* filename, size_t* len) {
+    if (!cold_contains(filename)) {
+        return NULL;
+    }
+    char cold[MAX_PATH];
+    cold_path(filename, cold, sizeof(cold));
+    return unpack_buffer(cold, len);
+}
+
+int cold_stat(const char* filename, uint64_t* size, int* sentences) {
+    if (!cold_contains(filename)) {
+        return -1;
+    }
+    char cold[MAX_PATH];
+    cold_path(filename, cold, sizeof(cold));
+    
+    ColdHeader header;
+    int fd = open(cold, O_RDONLY);
+    int ok = fd >= 0 && read_header(fd, &header) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok) {
+        return -1;
+    }
+    *size = header.raw_size;
+    if (header.version >= 2) {
+        *sentences = (int)header.sentences;
+        return 0;
+    }
+    
+    // Frozen before the count was recorded: count it from the content
+    size_t len = 0;
+    char* content = unpack_buffer(cold, &len);
+    if (!content) {
+        return -1;
+    }
+    SentenceIndex* idx = sentence_index_from_text(content, len);
+    *sentences = idx ? idx->count : 0;
+    free(idx);
+    free(content);
+    return 0;
+}
+
+void cold_get_stats(ColdStats* out) {
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+    out->files = __atomic_load_n(&frozen_count, __ATOMIC_RELAXED);
+}
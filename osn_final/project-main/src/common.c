@@ -1,5 +1,10 @@
 #include "../include/common.h"
 #include <stdarg.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <endian.h>
+
+#define SEND_TIMEOUT_MS 5000
 
 // Error messages
 const char* error_messages[] = {
@@ -16,68 +21,88 @@ const char* error_messages[] = {
     "User not found",
     "No storage servers available",
     "Invalid parameters",
-    "Execution failed"
+    "Execution failed",
+    "Wrong Name Server shard",
+    "Stale storage server location"
 };
 
 char* get_error_message(int error_code) {
-    if (error_code >= 0 && error_code <= 13) {
+    if (error_code >= 0 && error_code <= 15) {
         return (char*)error_messages[error_code];
     }
     return "Unknown error";
 }
 
 char* get_timestamp() {
-    static char buffer[64];
+    static __thread char buffer[64];  // Per thread: handlers log concurrently
     time_t now = time(NULL);
-    struct tm* tm_info = localtime(&now);
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_info);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm_info);
     return buffer;
 }
 
-void log_message(const char* component, const char* level, const char* format, ...) {
-    va_list args;
-    char log_buffer[2048];
-    
-    va_start(args, format);
-    vsnprintf(log_buffer, sizeof(log_buffer), format, args);
-    va_end(args);
-    
-    printf("[%s] [%s] [%s] %s\n", get_timestamp(), component, level, log_buffer);
-    fflush(stdout);
+// Integer tunable from the environment, falling back to a compiled-in default
+int config_get_int(const char* name, int default_value) {
+    const char* value = getenv(name);
+    if (!value || *value == '\0') {
+        return default_value;
+    }
     
-    // Also write to log file
-    char log_filename[256];
-    snprintf(log_filename, sizeof(log_filename), "logs/%s.log", component);
+    char* end = NULL;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0') {
+        log_message("COMMON", "WARNING", "Ignoring invalid %s=%s", name, value);
+        return default_value;
+    }
     
-    FILE* log_file = fopen(log_filename, "a");
-    if (log_file) {
-        fprintf(log_file, "[%s] [%s] %s\n", get_timestamp(), level, log_buffer);
-        fclose(log_file);
+    return (int)parsed;
+}
+
+// Wait (bounded) until a non-blocking socket can take more data
+static int wait_writable(int socket_fd) {
+    struct pollfd pfd = { .fd = socket_fd, .events = POLLOUT };
+    if (poll(&pfd, 1, SEND_TIMEOUT_MS) > 0) {
+        return 0;
     }
+    errno = ETIMEDOUT;
+    return -1;
 }
 
-void send_message(int socket_fd, Message* msg) {
-    int total_sent = 0;
-    int bytes_to_send = sizeof(Message);
-    char* buffer = (char*)msg;
+// Send exactly len bytes, retrying on partial writes
+static int send_all(int socket_fd, const char* buffer, size_t len, int flags) {
+    size_t total_sent = 0;
     
-    while (total_sent < bytes_to_send) {
-        int sent = send(socket_fd, buffer + total_sent, bytes_to_send - total_sent, 0);
+    while (total_sent < len) {
+        ssize_t sent = send(socket_fd, buffer + total_sent, len - total_sent, flags | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Non-blocking socket (Name Server reactor): wait until writable
+            if (wait_writable(socket_fd) == 0) {
+                continue;
+            }
+        }
         if (sent <= 0) {
             log_message("COMMON", "ERROR", "Failed to send message: %s", strerror(errno));
-            return;
+            return -1;
         }
         total_sent += sent;
     }
+    
+    return 0;
 }
 
-int receive_message(int socket_fd, Message* msg) {
-    int total_received = 0;
-    int bytes_to_receive = sizeof(Message);
-    char* buffer = (char*)msg;
+// Receive exactly len bytes. Returns 0 on success, -1 on error or EOF.
+static int recv_all(int socket_fd, char* buffer, size_t len) {
+    size_t total_received = 0;
     
-    while (total_received < bytes_to_receive) {
-        int received = recv(socket_fd, buffer + total_received, bytes_to_receive - total_received, 0);
+    while (total_received < len) {
+        ssize_t received = recv(socket_fd, buffer + total_received, len - total_received, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
         if (received <= 0) {
             if (received == 0) {
                 log_message("COMMON", "INFO", "Connection closed by peer");
@@ -91,3 +116,423 @@ int receive_message(int socket_fd, Message* msg) {
     
     return 0;
 }
+
+// Senders talk to legacy peers when NFS_WIRE_FORMAT=legacy is set
+static int use_legacy_wire() {
+    static int legacy = -1;
+    if (legacy < 0) {
+        const char* format = getenv("NFS_WIRE_FORMAT");
+        legacy = (format && strcmp(format, "legacy") == 0) ? 1 : 0;
+    }
+    return legacy;
+}
+
+static size_t message_data_len(const Message* msg) {
+    size_t len = strnlen(msg->data, BUFFER_SIZE);
+    
+    // data_len may describe binary content that contains NUL bytes
+    if (msg->data_len > 0 && (size_t)msg->data_len > len && msg->data_len <= BUFFER_SIZE) {
+        len = msg->data_len;
+    }
+    
+    return len;
+}
+
+static int send_legacy_message(int socket_fd, Message* msg) {
+    LegacyMessage legacy;
+    memset(&legacy, 0, sizeof(LegacyMessage));
+    
+    legacy.msg_type = msg->msg_type;
+    legacy.command = msg->command;
+    legacy.error_code = msg->error_code;
+    memcpy(legacy.username, msg->username, MAX_USERNAME);
+    memcpy(legacy.filename, msg->filename, MAX_FILENAME);
+    
+    if (msg->body) {
+        size_t len = msg->body_len < BUFFER_SIZE - 1 ? msg->body_len : BUFFER_SIZE - 1;
+        if (len < msg->body_len) {
+            log_message("COMMON", "WARNING", "Truncating %zu byte body for legacy peer", msg->body_len);
+        }
+        memcpy(legacy.data, msg->body, len);
+        legacy.data_len = (int)len;
+    } else {
+        memcpy(legacy.data, msg->data, BUFFER_SIZE);
+        legacy.data_len = msg->data_len;
+    }
+    
+    return send_all(socket_fd, (char*)&legacy, sizeof(LegacyMessage), 0);
+}
+
+// Header, names and (unless big_body) inline data of a frame, into frame.
+// Returns the number of bytes written.
+static size_t build_frame(const Message* msg, int big_body, size_t data_len, char* frame) {
+    size_t username_len = strnlen(msg->username, MAX_USERNAME - 1);
+    size_t filename_len = strnlen(msg->filename, MAX_FILENAME - 1);
+    
+    FrameHeader header;
+    header.magic = htonl(FRAME_MAGIC);
+    header.version = FRAME_VERSION;
+    header.flags = big_body ? FRAME_FLAG_BIG_BODY : 0;
+    header.location_gen = htons(msg->location_gen);
+    header.request_id = htonl(msg->request_id);
+    header.msg_type = (int32_t)htonl((uint32_t)msg->msg_type);
+    header.command = (int32_t)htonl((uint32_t)msg->command);
+    header.error_code = (int32_t)htonl((uint32_t)msg->error_code);
+    header.username_len = htons((uint16_t)username_len);
+    header.filename_len = htons((uint16_t)filename_len);
+    header.data_len = htonl((uint32_t)data_len);
+    
+    size_t pos = 0;
+    memcpy(frame + pos, &header, sizeof(FrameHeader));
+    pos += sizeof(FrameHeader);
+    memcpy(frame + pos, msg->username, username_len);
+    pos += username_len;
+    memcpy(frame + pos, msg->filename, filename_len);
+    pos += filename_len;
+    
+    if (!big_body) {
+        memcpy(frame + pos, msg->data, data_len);
+        pos += data_len;
+    }
+    
+    return pos;
+}
+
+int send_message(int socket_fd, Message* msg) {
+    return send_message_flags(socket_fd, msg, 0);
+}
+
+// send_message with send(2) flags for the last write; MSG_MORE lets a
+// server answering a pipelined burst put several replies in one segment
+int send_message_flags(int socket_fd, Message* msg, int flags) {
+    if (msg->legacy || use_legacy_wire()) {
+        return send_legacy_message(socket_fd, msg);
+    }
+    
+    int big_body = msg->body != NULL;
+    size_t data_len = big_body ? msg->body_len : message_data_len(msg);
+    
+    if (data_len > FRAME_MAX_BODY) {
+        log_message("COMMON", "ERROR", "Message body too large (%zu bytes)", data_len);
+        return -1;
+    }
+    
+    // Coalesce header, names and inline data into one send
+    char frame[sizeof(FrameHeader) + MAX_USERNAME + MAX_FILENAME + BUFFER_SIZE];
+    size_t pos = build_frame(msg, big_body, data_len, frame);
+    
+    if (!big_body) {
+        return send_all(socket_fd, frame, pos, flags);
+    }
+    
+    if (send_all(socket_fd, frame, pos, data_len > 0 ? MSG_MORE : flags) < 0) {
+        return -1;
+    }
+    
+    return send_all(socket_fd, msg->body, data_len, flags);
+}
+
+// Send msg with len bytes at offset of file_fd as its data section. The
+// bytes go from the page cache to the socket with sendfile(2) and never
+// pass through user space. Framed peers only; returns -1 for legacy ones.
+int send_message_file(int socket_fd, Message* msg, int file_fd, off_t offset, size_t len) {
+    if (msg->legacy || use_legacy_wire() || len > FRAME_MAX_BODY) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    char frame[sizeof(FrameHeader) + MAX_USERNAME + MAX_FILENAME];
+    size_t pos = build_frame(msg, 1, len, frame);
+    
+    if (send_all(socket_fd, frame, pos, len > 0 ? MSG_MORE : 0) < 0) {
+        return -1;
+    }
+    
+    while (len > 0) {
+        ssize_t sent = sendfile(socket_fd, file_fd, &offset, len);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(socket_fd) == 0) {
+            continue;
+        }
+        if (sent <= 0) {
+            // The header is out already, so the stream cannot be recovered
+            log_message("COMMON", "ERROR", "sendfile failed: %s",
+                       sent < 0 ? strerror(errno) : "file shrank");
+            return -1;
+        }
+        len -= sent;
+    }
+    
+    return 0;
+}
+
+static void legacy_to_message(const LegacyMessage* legacy, Message* msg) {
+    msg->msg_type = legacy->msg_type;
+    msg->command = legacy->command;
+    msg->error_code = legacy->error_code;
+    memcpy(msg->username, legacy->username, MAX_USERNAME);
+    memcpy(msg->filename, legacy->filename, MAX_FILENAME);
+    memcpy(msg->data, legacy->data, BUFFER_SIZE);
+    msg->username[MAX_USERNAME - 1] = '\0';
+    msg->filename[MAX_FILENAME - 1] = '\0';
+    msg->data_len = legacy->data_len;
+    msg->legacy = 1;
+}
+
+static int receive_legacy_message(int socket_fd, Message* msg, uint32_t first_word) {
+    LegacyMessage legacy;
+    
+    // The first word has already been consumed while probing for the frame magic
+    memcpy(&legacy, &first_word, sizeof(first_word));
+    if (recv_all(socket_fd, (char*)&legacy + sizeof(first_word),
+                 sizeof(LegacyMessage) - sizeof(first_word)) < 0) {
+        return -1;
+    }
+    
+    legacy_to_message(&legacy, msg);
+    return 0;
+}
+
+// Validate a header and return the number of payload bytes that follow it, or -1
+static ssize_t frame_payload_len(const FrameHeader* header) {
+    size_t username_len = ntohs(header->username_len);
+    size_t filename_len = ntohs(header->filename_len);
+    size_t data_len = ntohl(header->data_len);
+    int big_body = (header->flags & FRAME_FLAG_BIG_BODY) != 0;
+    
+    if (header->version != FRAME_VERSION || username_len >= MAX_USERNAME ||
+        filename_len >= MAX_FILENAME || data_len > FRAME_MAX_BODY ||
+        (!big_body && data_len > BUFFER_SIZE)) {
+        log_message("COMMON", "ERROR", "Malformed frame (version %d, data %zu bytes)",
+                   header->version, data_len);
+        return -1;
+    }
+    
+    return (ssize_t)(username_len + filename_len + data_len);
+}
+
+static void frame_header_to_message(const FrameHeader* header, Message* msg) {
+    msg->request_id = ntohl(header->request_id);
+    msg->location_gen = ntohs(header->location_gen);
+    msg->msg_type = (int32_t)ntohl((uint32_t)header->msg_type);
+    msg->command = (int32_t)ntohl((uint32_t)header->command);
+    msg->error_code = (int32_t)ntohl((uint32_t)header->error_code);
+}
+
+int receive_message(int socket_fd, Message* msg) {
+    memset(msg, 0, sizeof(Message));
+    
+    FrameHeader header;
+    if (recv_all(socket_fd, (char*)&header.magic, sizeof(header.magic)) < 0) {
+        return -1;
+    }
+    
+    if (ntohl(header.magic) != FRAME_MAGIC) {
+        return receive_legacy_message(socket_fd, msg, header.magic);
+    }
+    
+    if (recv_all(socket_fd, (char*)&header + sizeof(header.magic),
+                 sizeof(FrameHeader) - sizeof(header.magic)) < 0) {
+        return -1;
+    }
+    
+    if (frame_payload_len(&header) < 0) {
+        return -1;
+    }
+    
+    size_t username_len = ntohs(header.username_len);
+    size_t filename_len = ntohs(header.filename_len);
+    size_t data_len = ntohl(header.data_len);
+    int big_body = (header.flags & FRAME_FLAG_BIG_BODY) != 0;
+    
+    frame_header_to_message(&header, msg);
+    
+    if (recv_all(socket_fd, msg->username, username_len) < 0 ||
+        recv_all(socket_fd, msg->filename, filename_len) < 0) {
+        return -1;
+    }
+    
+    if (!big_body) {
+        if (recv_all(socket_fd, msg->data, data_len) < 0) {
+            return -1;
+        }
+        msg->data_len = (int)data_len;
+        return 0;
+    }
+    
+    msg->body = (char*)malloc(data_len + 1);
+    if (!msg->body) {
+        log_message("COMMON", "ERROR", "Failed to allocate %zu byte message body", data_len);
+        return -1;
+    }
+    
+    if (recv_all(socket_fd, msg->body, data_len) < 0) {
+        message_free_body(msg);
+        return -1;
+    }
+    
+    msg->body[data_len] = '\0';
+    msg->body_len = data_len;
+    
+    return 0;
+}
+
+// Length of the complete message at the start of buf: 0 if more bytes are
+// needed to tell, -1 if the stream is malformed
+ssize_t frame_peek_length(const char* buf, size_t len) {
+    uint32_t magic;
+    
+    if (len < sizeof(magic)) {
+        return 0;
+    }
+    
+    memcpy(&magic, buf, sizeof(magic));
+    if (ntohl(magic) != FRAME_MAGIC) {
+        return sizeof(LegacyMessage);
+    }
+    
+    if (len < sizeof(FrameHeader)) {
+        return 0;
+    }
+    
+    FrameHeader header;
+    memcpy(&header, buf, sizeof(FrameHeader));
+    
+    ssize_t payload = frame_payload_len(&header);
+    if (payload < 0) {
+        return -1;
+    }
+    
+    return (ssize_t)sizeof(FrameHeader) + payload;
+}
+
+// Decode one complete message from buf (as sized by frame_peek_length).
+// Returns the number of bytes consumed, 0 if incomplete, -1 on error.
+ssize_t frame_decode(const char* buf, size_t len, Message* msg) {
+    ssize_t total = frame_peek_length(buf, len);
+    if (total <= 0 || (size_t)total > len) {
+        return total < 0 ? -1 : 0;
+    }
+    
+    memset(msg, 0, sizeof(Message));
+    
+    if ((size_t)total == sizeof(LegacyMessage) && len >= sizeof(uint32_t)) {
+        uint32_t magic;
+        memcpy(&magic, buf, sizeof(magic));
+        if (ntohl(magic) != FRAME_MAGIC) {
+            LegacyMessage legacy;
+            memcpy(&legacy, buf, sizeof(LegacyMessage));
+            legacy_to_message(&legacy, msg);
+            return total;
+        }
+    }
+    
+    FrameHeader header;
+    memcpy(&header, buf, sizeof(FrameHeader));
+    frame_header_to_message(&header, msg);
+    
+    size_t username_len = ntohs(header.username_len);
+    size_t filename_len = ntohs(header.filename_len);
+    size_t data_len = ntohl(header.data_len);
+    const char* p = buf + sizeof(FrameHeader);
+    
+    memcpy(msg->username, p, username_len);
+    p += username_len;
+    memcpy(msg->filename, p, filename_len);
+    p += filename_len;
+    
+    if (header.flags & FRAME_FLAG_BIG_BODY) {
+        msg->body = (char*)malloc(data_len + 1);
+        if (!msg->body) {
+            log_message("COMMON", "ERROR", "Failed to allocate %zu byte message body", data_len);
+            return -1;
+        }
+        memcpy(msg->body, p, data_len);
+        msg->body[data_len] = '\0';
+        msg->body_len = data_len;
+    } else {
+        memcpy(msg->data, p, data_len);
+        msg->data_len = (int)data_len;
+    }
+    
+    return total;
+}
+
+void message_free_body(Message* msg) {
+    if (msg && msg->body) {
+        free(msg->body);
+        msg->body = NULL;
+        msg->body_len = 0;
+    }
+}
+
+// Data section of a message regardless of whether it came inline or as a big body
+const char* message_payload(const Message* msg) {
+    return msg->body ? msg->body : msg->data;
+}
+
+size_t message_payload_len(const Message* msg) {
+    return msg->body ? msg->body_len : message_data_len(msg);
+}
+
+// Largest data section that reaches the peer of msg intact: legacy structs
+// only carry BUFFER_SIZE - 1 bytes
+size_t message_max_payload(const Message* msg) {
+    if (msg->legacy || use_legacy_wire()) {
+        return BUFFER_SIZE - 1;
+    }
+    return FRAME_MAX_BODY;
+}
+
+// Heartbeat into msg's data section, in network byte order
+void heartbeat_encode(const Heartbeat* hb, Message* msg) {
+    Heartbeat wire = *hb;
+    wire.magic = htonl(HEARTBEAT_MAGIC);
+    wire.seq = htonl(hb->seq);
+    wire.pid = htonl(hb->pid);
+    wire.interval_ms = htonl(hb->interval_ms);
+    wire.bytes_stored = htobe64(hb->bytes_stored);
+    wire.free_bytes = htobe64(hb->free_bytes);
+    wire.request_rate_milli = htonl(hb->request_rate_milli);
+    wire.p99_us = htonl(hb->p99_us);
+    wire.replica_count = htonl(hb->replica_count);
+    for (int i = 0; i < HEARTBEAT_MAX_REPLICAS; i++) {
+        wire.replicas[i].backlog = (int32_t)htonl((uint32_t)hb->replicas[i].backlog);
+    }
+    
+    memcpy(msg->data, &wire, sizeof(wire));
+    msg->data_len = sizeof(wire);
+}
+
+// Returns -1 if msg does not carry a heartbeat
+int heartbeat_decode(const Message* msg, Heartbeat* hb) {
+    if (msg->body || msg->data_len != (int)sizeof(Heartbeat)) {
+        return -1;
+    }
+    
+    memcpy(hb, msg->data, sizeof(Heartbeat));
+    if (ntohl(hb->magic) != HEARTBEAT_MAGIC) {
+        return -1;
+    }
+    hb->magic = HEARTBEAT_MAGIC;
+    hb->seq = ntohl(hb->seq);
+    hb->pid = ntohl(hb->pid);
+    hb->interval_ms = ntohl(hb->interval_ms);
+    hb->bytes_stored = be64toh(hb->bytes_stored);
+    hb->free_bytes = be64toh(hb->free_bytes);
+    hb->request_rate_milli = ntohl(hb->request_rate_milli);
+    hb->p99_us = ntohl(hb->p99_us);
+    hb->replica_count = ntohl(hb->replica_count);
+    if (hb->replica_count > HEARTBEAT_MAX_REPLICAS) {
+        hb->replica_count = HEARTBEAT_MAX_REPLICAS;
+    }
+    
+    hb->ss_id[sizeof(hb->ss_id) - 1] = '\0';
+    for (int i = 0; i < HEARTBEAT_MAX_REPLICAS; i++) {
+        hb->replicas[i].ss_id[sizeof(hb->replicas[i].ss_id) - 1] = '\0';
+        hb->replicas[i].backlog = (int32_t)ntohl((uint32_t)hb->replicas[i].backlog);
+    }
+    return 0;
+}
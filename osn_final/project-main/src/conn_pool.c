@@ -0,0 +1,195 @@
+#include "../include/conn_pool.h"
+#include <poll.h>
+#include <netinet/tcp.h>
+
+ConnPool* conn_pool_create(int size) {
+    if (size <= 0) {
+        log_message("CONN_POOL", "ERROR", "Invalid connection pool size: %d", size);
+        return NULL;
+    }
+    
+    ConnPool* pool = (ConnPool*)calloc(1, sizeof(ConnPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->slots = (connection_t*)calloc(size, sizeof(connection_t));
+    if (!pool->slots) {
+        log_message("CONN_POOL", "ERROR", "Failed to allocate connection pool");
+        free(pool);
+        return NULL;
+    }
+    
+    pool->size = size;
+    for (int i = 0; i < size; i++) {
+        pool->slots[i].fd = -1;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    return pool;
+}
+
+void conn_pool_destroy(ConnPool* pool) {
+    if (!pool) {
+        return;
+    }
+    
+    for (int i = 0; i < pool->size; i++) {
+        if (pool->slots[i].fd >= 0) {
+            close(pool->slots[i].fd);
+        }
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->slots);
+    free(pool);
+}
+
+// An idle connection should have nothing to read: readable means the peer
+// closed it (or sent something nobody asked for)
+static bool connection_stale(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+static int open_connection(const char* ip, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port = htons(port);
+    
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    // Requests are small and answered one at a time
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+int conn_pool_get(ConnPool* pool, const char* ip, int port) {
+    char key[80];
+    snprintf(key, sizeof(key), "%s:%d", ip, port);
+    
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 0; i < pool->size; i++) {
+        connection_t* conn = &pool->slots[i];
+        if (conn->in_use || conn->fd < 0 || strcmp(conn->key, key) != 0) {
+            continue;
+        }
+        if (connection_stale(conn->fd)) {
+            close(conn->fd);
+            conn->fd = -1;
+            continue;
+        }
+        conn->in_use = true;
+        conn->last_used = time(NULL);
+        pthread_mutex_unlock(&pool->mutex);
+        return conn->fd;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    
+    int fd = open_connection(ip, port);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    // Keep it in an empty slot, else in place of the least recently used
+    // idle one. With every slot busy it is simply not pooled.
+    pthread_mutex_lock(&pool->mutex);
+    connection_t* slot = NULL;
+    for (int i = 0; i < pool->size; i++) {
+        connection_t* conn = &pool->slots[i];
+        if (conn->fd < 0) {
+            slot = conn;
+            break;
+        }
+        if (!conn->in_use && (!slot || conn->last_used < slot->last_used)) {
+            slot = conn;
+        }
+    }
+    if (slot) {
+        if (slot->fd >= 0) {
+            close(slot->fd);
+        }
+        slot->fd = fd;
+        snprintf(slot->key, sizeof(slot->key), "%s", key);
+        slot->in_use = true;
+        slot->last_used = time(NULL);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return fd;
+}
+
+static connection_t* find_slot(ConnPool* pool, int fd) {
+    for (int i = 0; i < pool->size; i++) {
+        if (pool->slots[i].fd == fd) {
+            return &pool->slots[i];
+        }
+    }
+    return NULL;
+}
+
+void conn_pool_release(ConnPool* pool, int fd) {
+    if (fd < 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->mutex);
+    connection_t* conn = find_slot(pool, fd);
+    if (conn) {
+        conn->last_used = time(NULL);
+        conn->in_use = false;
+    } else {
+        close(fd);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void conn_pool_discard(ConnPool* pool, int fd) {
+    if (fd < 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->mutex);
+    connection_t* conn = find_slot(pool, fd);
+    if (conn) {
+        conn->fd = -1;
+        conn->in_use = false;
+        conn->last_used = 0;
+    }
+    close(fd);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Clean up idle connections that haven't been used for more than timeout_sec seconds
+int conn_pool_cleanup_idle(ConnPool* pool, int timeout_sec) {
+    if (timeout_sec <= 0) return 0;
+    
+    time_t now = time(NULL);
+    int cleaned = 0;
+    
+    pthread_mutex_lock(&pool->mutex);
+    
+    for (int i = 0; i < pool->size; i++) {
+        connection_t* conn = &pool->slots[i];
+        if (!conn->in_use && conn->fd >= 0 && (now - conn->last_used) > timeout_sec) {
+            close(conn->fd);
+            conn->fd = -1;
+            conn->last_used = 0;
+            cleaned++;
+        }
+    }
+    
+    pthread_mutex_unlock(&pool->mutex);
+    
+    if (cleaned > 0) {
+        log_message("CONN_POOL", "DEBUG", "Cleaned up %d idle connections", cleaned);
+    }
+    return cleaned;
+}
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE  // sync_file_range
+#include "../include/durability.h"
+#include <fcntl.h>
+#include <libgen.h>
+
+#define GROUP_MAX_DIRS 16  // Distinct directories synced per group
+
+static int mode = DURABILITY_STRICT;
+static int group_window_us = 0;
+
+// A sync or commit waiting for its group
+typedef struct GroupEntry {
+    int fd;
+    const char* tmp_path;  // NULL: only sync fd
+    const char* path;
+    int result;
+    int done;
+    struct GroupEntry* next;
+} GroupEntry;
+
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_flushed = PTHREAD_COND_INITIALIZER;
+static GroupEntry* group_head = NULL;
+static GroupEntry** group_tail = &group_head;
+static int group_leader = 0;  // A writer is flushing a group
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static DurabilityStats stats;
+
+static void count(int groups, int requests, int dir_syncs) {
+    pthread_mutex_lock(&stats_lock);
+    stats.groups += groups;
+    stats.requests += requests;
+    stats.dir_syncs += dir_syncs;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void durability_init() {
+    const char* name = getenv("SS_DURABILITY");
+    if (!name || name[0] == '\0' || strcmp(name, "strict") == 0) {
+        mode = DURABILITY_STRICT;
+    } else if (strcmp(name, "group") == 0) {
+        mode = DURABILITY_GROUP;
+    } else if (strcmp(name, "relaxed") == 0) {
+        mode = DURABILITY_RELAXED;
+    } else {
+        log_message("STORAGE_SERVER", "WARNING", "Unknown SS_DURABILITY '%s', using strict", name);
+        mode = DURABILITY_STRICT;
+    }
+    
+    group_window_us = config_get_int("SS_GROUP_COMMIT_US", 0);
+    if (group_window_us < 0) {
+        group_window_us = 0;
+    }
+    
+    log_message("STORAGE_SERVER", "INFO", "Durability: %s%s", durability_mode_name(),
+               mode == DURABILITY_GROUP ? " commit" : "");
+}
+
+int durability_mode() {
+    return mode;
+}
+
+const char* durability_mode_name() {
+    switch (mode) {
+        case DURABILITY_GROUP:
+            return "group";
+        case DURABILITY_RELAXED:
+            return "relaxed";
+        default:
+            return "strict";
+    }
+}
+
+static void dir_of(const char* path, char* out) {
+    strncpy(out, path, MAX_PATH - 1);
+    out[MAX_PATH - 1] = '\0';
+    char* dir = dirname(out);
+    if (dir != out) {
+        memmove(out, dir, strlen(dir) + 1);
+    }
+}
+
+static void sync_dir(const char* dirpath) {
+    int dir_fd = open(dirpath, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// Close fd and move tmp_path into place; removes it when failed is set
+static int finish_commit(int fd, const char* tmp_path, const char* path, int failed) {
+    if (failed) {
+        log_message("FILE_OPS", "ERROR", "Failed to sync temporary file %s: %s",
+                   tmp_path, strerror(errno));
+    }
+    close(fd);
+    
+    if (failed) {
+        unlink(tmp_path);
+        return -1;
+    }
+    
+    // Atomically rename the temporary file to the target file
+    if (rename(tmp_path, path) != 0) {
+        log_message("FILE_OPS", "ERROR", "Failed to rename %s to %s: %s",
+                   tmp_path, path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Flush a group: its data in one go, then the renames, then each
+// directory once
+static void flush_group(GroupEntry* batch) {
+    int members = 0;
+    for (GroupEntry* e = batch; e; e = e->next) {
+        members++;
+    }
+    
+    // Start writeback of every member before waiting on any, so the device
+    // sees the group's data together and the fdatasyncs after the first
+    // mostly find their data, and the journal commit, already done
+    if (members > 1) {
+        for (GroupEntry* e = batch; e; e = e->next) {
+            sync_file_range(e->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+    for (GroupEntry* e = batch; e; e = e->next) {
+        e->result = fdatasync(e->fd) < 0 ? -1 : 0;
+    }
+    
+    char dirs[GROUP_MAX_DIRS][MAX_PATH];
+    int dir_count = 0;
+    int dir_syncs = 0;
+    for (GroupEntry* e = batch; e; e = e->next) {
+        if (!e->tmp_path) {
+            continue;
+        }
+        e->result = finish_commit(e->fd, e->tmp_path, e->path, e->result < 0);
+        if (e->result < 0) {
+            continue;
+        }
+        
+        char dir[MAX_PATH];
+        dir_of(e->path, dir);
+        int seen = 0;
+        for (int i = 0; i < dir_count && !seen; i++) {
+            seen = strcmp(dirs[i], dir) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+        if (dir_count == GROUP_MAX_DIRS) {
+            sync_dir(dir);  // Too many to remember; sync it now
+            dir_syncs++;
+        } else {
+            strcpy(dirs[dir_count++], dir);
+        }
+    }
+    for (int i = 0; i < dir_count; i++) {
+        sync_dir(dirs[i]);
+    }
+    
+    count(1, members, dir_syncs + dir_count);
+}
+
+// Queue entry and wait until a group containing it is flushed. The first
+// writer to find no flush in progress waits out the window for others to
+// join, then flushes everything queued on their behalf.
+static int group_commit(GroupEntry* entry) {
+    entry->done = 0;
+    entry->next = NULL;
+    
+    pthread_mutex_lock(&group_lock);
+    *group_tail = entry;
+    group_tail = &entry->next;
+    
+    while (!entry->done) {
+        if (group_leader) {
+            pthread_cond_wait(&group_flushed, &group_lock);
+            continue;
+        }
+        
+        group_leader = 1;
+        pthread_mutex_unlock(&group_lock);
+        if (group_window_us > 0) {
+            usleep(group_window_us);
+        }
+        
+        pthread_mutex_lock(&group_lock);
+        GroupEntry* batch = group_head;
+        group_head = NULL;
+        group_tail = &group_head;
+        pthread_mutex_unlock(&group_lock);
+        
+        flush_group(batch);
+        
+        pthread_mutex_lock(&group_lock);
+        while (batch) {
+            GroupEntry* next = batch->next;  // batch may be gone once done
+            batch->done = 1;
+            batch = next;
+        }
+        group_leader = 0;
+        pthread_cond_broadcast(&group_flushed);
+    }
+    
+    pthread_mutex_unlock(&group_lock);
+    return entry->result;
+}
+
+int durability_sync(int fd) {
+    switch (mode) {
+        case DURABILITY_GROUP: {
+            GroupEntry entry = {fd, NULL, NULL, 0, 0, NULL};
+            return group_commit(&entry);
+        }
+        case DURABILITY_RELAXED:
+            count(0, 1, 0);
+            sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+            return 0;
+        default:
+            count(1, 1, 0);
+            return fdatasync(fd);
+    }
+}
+
+int durability_commit(int fd, const char* tmp_path, const char* path) {
+    if (mode == DURABILITY_GROUP) {
+        GroupEntry entry = {fd, tmp_path, path, 0, 0, NULL};
+        return group_commit(&entry);
+    }
+    
+    if (mode == DURABILITY_RELAXED) {
+        // Start writeback so the data follows soon, without waiting for it
+        count(0, 1, 0);
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        return finish_commit(fd, tmp_path, path, 0);
+    }
+    
+    // Ensure all data is written to disk
+    int failed = fsync(fd) != 0;
+    if (finish_commit(fd, tmp_path, path, failed) < 0) {
+        count(1, 1, 0);
+        return -1;
+    }
+    
+    // Ensure the directory is synced to disk (important for durability)
+    char dir[MAX_PATH];
+    dir_of(path, dir);
+    sync_dir(dir);
+    count(1, 1, 1);
+    return 0;
+}
+
+void durability_get_stats(DurabilityStats* out) {
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
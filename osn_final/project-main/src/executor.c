@@ -0,0 +1,453 @@
+#define _GNU_SOURCE  // pipe2
+#include "../include/executor.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define EXEC_DIR "data/exec"
+#define EXEC_READ_SIZE (16 * 1024)
+#define EXEC_POLL_MS 100  // How often a job whose pipe is quiet is checked on
+
+// A job waiting for, or running on, a worker
+typedef struct ExecJob {
+    const char* script;
+    size_t len;
+    ExecOutputFn out;
+    void* ctx;
+    ExecResult* result;
+    long long queued_at;
+    int done;
+    struct ExecJob* next;
+} ExecJob;
+
+static int cpu_sec = 5;
+static int memory_mb = 256;
+static int timeout_ms = 10000;
+static size_t output_max = 1024 * 1024;
+static char exec_root[PATH_MAX];  // Absolute: jobs change directory
+
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static ExecJob* queue_head = NULL;
+static ExecJob** queue_tail = &queue_head;
+static int reserved = 0;  // Slots claimed and not yet taken by a worker
+static ExecutorStats stats;
+
+// Scripts are written and their process forked one at a time, so no child
+// of one worker can hold another's script open for writing (ETXTBSY)
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Remove everything below path, keeping path itself
+static void clear_dir(const char* path) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child)) {
+            continue;  // Not a path this directory can hold
+        }
+        
+        struct stat st;
+        if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            chmod(child, 0700);  // A job may have taken away its own access
+            clear_dir(child);
+            rmdir(child);
+        } else {
+            unlink(child);
+        }
+    }
+    closedir(dir);
+}
+
+// In the forked child: only async-signal-safe calls until execve
+static void exec_child(const char* dir, int output_fd, char* const argv[], char* const envp[]) {
+    setpgid(0, 0);
+    
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0 || dup2(output_fd, STDOUT_FILENO) < 0 ||
+        dup2(output_fd, STDERR_FILENO) < 0 || chdir(dir) < 0) {
+        _exit(127);
+    }
+    
+    // Nothing of the server's (client sockets, data files) is passed on
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, 3, ~0U, 0) < 0)
+#endif
+    {
+        for (int fd = 3; fd < 4096; fd++) {
+            close(fd);
+        }
+    }
+    
+    struct rlimit cpu = {(rlim_t)cpu_sec, (rlim_t)cpu_sec + 1};
+    struct rlimit memory = {(rlim_t)memory_mb << 20, (rlim_t)memory_mb << 20};
+    struct rlimit files = {64, 64};
+    struct rlimit core = {0, 0};
+    setrlimit(RLIMIT_CPU, &cpu);
+    setrlimit(RLIMIT_AS, &memory);
+    setrlimit(RLIMIT_FSIZE, &memory);  // Scratch files get the same cap
+    setrlimit(RLIMIT_NOFILE, &files);
+    setrlimit(RLIMIT_CORE, &core);
+    prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+    prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+    
+    execve(argv[0], argv, envp);
+    _exit(127);
+}
+
+// Start job in dir; returns the child's pid with its output pipe in
+// *output_fd, or -1
+static pid_t spawn_job(const char* dir, ExecJob* job, int* output_fd) {
+    char script_path[PATH_MAX];
+    char home_env[PATH_MAX + 8];
+    if (snprintf(script_path, sizeof(script_path), "%s/job", dir) >= (int)sizeof(script_path) ||
+        snprintf(home_env, sizeof(home_env), "HOME=%s", dir) >= (int)sizeof(home_env)) {
+        log_message("EXECUTOR", "ERROR", "Job directory path too long: %s", dir);
+        return -1;
+    }
+    
+    // Files with an interpreter line run as themselves, the rest as sh
+    // scripts (as popen used to fall back to)
+    char shell[] = "/bin/sh";
+    char* argv[3] = {script_path, NULL, NULL};
+    if (job->len < 2 || memcmp(job->script, "#!", 2) != 0) {
+        argv[0] = shell;
+        argv[1] = script_path;
+    }
+    char path_env[] = "PATH=/usr/local/bin:/usr/bin:/bin";
+    char lang_env[] = "LANG=C";
+    char* envp[] = {path_env, lang_env, home_env, NULL};
+    
+    pthread_mutex_lock(&spawn_lock);
+    
+    int fd = open(script_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0700);
+    if (fd < 0 || write_all(fd, job->script, job->len) < 0) {
+        log_message("EXECUTOR", "ERROR", "Failed to write %s: %s", script_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_unlock(&spawn_lock);
+        return -1;
+    }
+    close(fd);
+    
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        pthread_mutex_unlock(&spawn_lock);
+        return -1;
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        exec_child(dir, pipe_fds[1], argv, envp);
+    }
+    
+    pthread_mutex_unlock(&spawn_lock);
+    close(pipe_fds[1]);
+    
+    if (pid < 0) {
+        log_message("EXECUTOR", "ERROR", "fork failed: %s", strerror(errno));
+        close(pipe_fds[0]);
+        return -1;
+    }
+    setpgid(pid, pid);  // Also done by the child; whichever runs first
+    *output_fd = pipe_fds[0];
+    return pid;
+}
+
+// Pass the job's output on until it is done or over a limit
+static void run_job(const char* dir, ExecJob* job) {
+    ExecResult* result = job->result;
+    long long started = now_ms();
+    
+    clear_dir(dir);
+    
+    int output_fd;
+    pid_t pid = spawn_job(dir, job, &output_fd);
+    if (pid < 0) {
+        result->status = EXEC_SPAWN_FAILED;
+        result->exit_code = -1;
+        return;
+    }
+    
+    long long deadline = started + timeout_ms;
+    char buffer[EXEC_READ_SIZE];
+    int status = EXEC_EXITED;
+    int wait_status = 0;
+    int reaped = 0;
+    while (1) {
+        long long remaining = deadline - now_ms();
+        if (remaining <= 0) {
+            status = EXEC_TIMED_OUT;
+            break;
+        }
+        
+        struct pollfd pfd = {output_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, remaining < EXEC_POLL_MS ? (int)remaining : EXEC_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            // Quiet pipe: done if the job has exited (whatever it left
+            // running in the background is killed below)
+            if (!reaped && waitpid(pid, &wait_status, WNOHANG) == pid) {
+                reaped = 1;
+            } else if (reaped) {
+                break;
+            }
+            continue;
+        }
+        
+        ssize_t n = read(output_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;  // Every writer has closed the pipe
+        }
+        
+        size_t len = n;
+        if (result->output_bytes + len > output_max) {
+            len = output_max - result->output_bytes;
+            status = EXEC_OUTPUT_LIMIT;
+        }
+        if (len > 0 && job->out(job->ctx, buffer, len) < 0) {
+            status = EXEC_ABORTED;
+            break;
+        }
+        result->output_bytes += len;
+        if (status == EXEC_OUTPUT_LIMIT) {
+            break;
+        }
+    }
+    
+    kill(-pid, SIGKILL);
+    close(output_fd);
+    if (!reaped) {
+        while (waitpid(pid, &wait_status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    
+    result->run_ms = now_ms() - started;
+    result->status = status;
+    if (status == EXEC_EXITED) {
+        if (WIFEXITED(wait_status)) {
+            result->exit_code = WEXITSTATUS(wait_status);
+        } else {
+            result->status = EXEC_SIGNALED;
+            result->exit_code = WTERMSIG(wait_status);
+        }
+    } else {
+        result->exit_code = -1;
+    }
+}
+
+static void* exec_worker(void* arg) {
+    // executor_init checked that the directory fits; without one every
+    // job fails rather than run somewhere else
+    char dir[PATH_MAX];
+    int dir_ok = snprintf(dir, sizeof(dir), "%s/worker%d", exec_root,
+                          (int)(intptr_t)arg) < (int)sizeof(dir);
+    
+    while (1) {
+        pthread_mutex_lock(&exec_lock);
+        while (!queue_head) {
+            pthread_cond_wait(&job_ready, &exec_lock);
+        }
+        ExecJob* job = queue_head;
+        queue_head = job->next;
+        if (!queue_head) {
+            queue_tail = &queue_head;
+        }
+        reserved--;
+        stats.queued--;
+        stats.running++;
+        
+        job->result->wait_ms = now_ms() - job->queued_at;
+        stats.wait_ms_total += job->result->wait_ms;
+        if ((unsigned long long)job->result->wait_ms > stats.wait_ms_max) {
+            stats.wait_ms_max = job->result->wait_ms;
+        }
+        pthread_mutex_unlock(&exec_lock);
+        
+        if (dir_ok) {
+            run_job(dir, job);
+        } else {
+            job->result->status = EXEC_SPAWN_FAILED;
+            job->result->exit_code = -1;
+        }
+        
+        pthread_mutex_lock(&exec_lock);
+        stats.running--;
+        stats.run_ms_total += job->result->run_ms;
+        if (job->result->status == EXEC_EXITED && job->result->exit_code == 0) {
+            stats.completed++;
+        } else {
+            stats.failed++;
+        }
+        if (job->result->status == EXEC_TIMED_OUT) {
+            stats.timed_out++;
+        }
+        job->done = 1;
+        pthread_cond_broadcast(&job_done);
+        pthread_mutex_unlock(&exec_lock);
+    }
+    return NULL;
+}
+
+void executor_init() {
+    int workers = config_get_int("SS_EXEC_WORKERS", 4);
+    int queue_limit = config_get_int("SS_EXEC_QUEUE", 16);
+    cpu_sec = config_get_int("SS_EXEC_CPU_SEC", 5);
+    memory_mb = config_get_int("SS_EXEC_MEMORY_MB", 256);
+    timeout_ms = config_get_int("SS_EXEC_TIMEOUT_MS", 10000);
+    int output_limit = config_get_int("SS_EXEC_OUTPUT_MAX", 1024 * 1024);
+    
+    workers = workers > 0 ? workers : 1;
+    cpu_sec = cpu_sec > 0 ? cpu_sec : 5;
+    memory_mb = memory_mb > 0 ? memory_mb : 256;
+    timeout_ms = timeout_ms > 0 ? timeout_ms : 10000;
+    output_max = output_limit > 0 ? (size_t)output_limit : 1024 * 1024;
+    
+    stats.workers = workers;
+    stats.queue_limit = queue_limit >= 0 ? queue_limit : 16;
+    
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        snprintf(cwd, sizeof(cwd), ".");
+    }
+    if (snprintf(exec_root, sizeof(exec_root), "%s/%s", cwd, EXEC_DIR) >= (int)sizeof(exec_root)) {
+        // Jobs would run in a directory other than their own: EXEC is refused
+        log_message("EXECUTOR", "ERROR", "Exec directory path too long under %s", cwd);
+        stats.workers = 0;
+        return;
+    }
+    mkdir("data", 0755);
+    mkdir(EXEC_DIR, 0755);
+    
+    for (int i = 0; i < workers; i++) {
+        char dir[PATH_MAX];
+        if (snprintf(dir, sizeof(dir), "%s/worker%d", exec_root, i) >= (int)sizeof(dir)) {
+            log_message("EXECUTOR", "ERROR", "Exec directory path too long: %s", exec_root);
+            stats.workers = i;
+            break;
+        }
+        mkdir(dir, 0700);
+        clear_dir(dir);
+        
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, exec_worker, (void*)(intptr_t)i) != 0) {
+            log_message("EXECUTOR", "ERROR", "Failed to start exec worker %d", i);
+            stats.workers = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+    
+    log_message("EXECUTOR", "INFO",
+               "%d exec workers, queue %d, limits: %d s CPU, %d MB, %d ms, %zu output bytes",
+               stats.workers, stats.queue_limit, cpu_sec, memory_mb, timeout_ms, output_max);
+}
+
+int executor_reserve() {
+    pthread_mutex_lock(&exec_lock);
+    if (stats.workers == 0 || reserved >= stats.queue_limit + stats.workers - stats.running) {
+        stats.rejected++;
+        pthread_mutex_unlock(&exec_lock);
+        return -1;
+    }
+    reserved++;
+    int position = reserved + stats.running - stats.workers;
+    pthread_mutex_unlock(&exec_lock);
+    return position > 0 ? position : 0;
+}
+
+void executor_release() {
+    pthread_mutex_lock(&exec_lock);
+    reserved--;
+    pthread_mutex_unlock(&exec_lock);
+}
+
+void executor_run(const char* script, size_t len, ExecOutputFn out, void* ctx,
+                  ExecResult* result) {
+    memset(result, 0, sizeof(ExecResult));
+    
+    ExecJob job;
+    memset(&job, 0, sizeof(ExecJob));
+    job.script = script;
+    job.len = len;
+    job.out = out;
+    job.ctx = ctx;
+    job.result = result;
+    job.queued_at = now_ms();
+    
+    pthread_mutex_lock(&exec_lock);
+    *queue_tail = &job;
+    queue_tail = &job.next;
+    stats.queued++;
+    stats.submitted++;
+    pthread_cond_signal(&job_ready);
+    while (!job.done) {
+        pthread_cond_wait(&job_done, &exec_lock);
+    }
+    pthread_mutex_unlock(&exec_lock);
+}
+
+const char* executor_status_name(int status) {
+    switch (status) {
+        case EXEC_EXITED:
+            return "exited";
+        case EXEC_SIGNALED:
+            return "signaled";
+        case EXEC_TIMED_OUT:
+            return "timed_out";
+        case EXEC_OUTPUT_LIMIT:
+            return "output_limit";
+        case EXEC_ABORTED:
+            return "aborted";
+        default:
+            return "spawn_failed";
+    }
+}
+
+void executor_get_stats(ExecutorStats* out) {
+    pthread_mutex_lock(&exec_lock);
+    *out = stats;
+    pthread_mutex_unlock(&exec_lock);
+}
@@ -1,5 +1,7 @@
 #include "../include/file_locking.h"
 #include "../include/common.h"
+#include "../include/metrics.h"
+#include "../include/slab.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,15 +12,28 @@
 static GHashTable* file_locks = NULL;
 static pthread_mutex_t file_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static void free_file_lock(FileLock* fl);
+
+// A FileLock exists while any thread holds or waits on the file, so one is
+// made and dropped for nearly every request; they come from a slab pool
+static SlabPool* file_lock_pool = NULL;
+
+// Per-file lock waits, kept after the lock itself is freed
+#define LOCK_CONTENTION_FILES 1024
+static GHashTable* contention = NULL;  // filename -> FileLockContention*
+static pthread_mutex_t contention_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 // Initialize the file locking system
 void file_locking_init() {
     if (!file_locks) {
+        file_lock_pool = slab_pool_create("file_lock", sizeof(FileLock));
         file_locks = g_hash_table_new_full(
             g_str_hash, g_str_equal, 
             g_free, // Key destroy function
             (GDestroyNotify)free_file_lock // Value destroy function
         );
-        if (!file_locks) {
+        contention = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        if (!file_locks || !contention) {
             log_message("FILE_LOCKING", "ERROR", "Failed to initialize file locks hash table");
             exit(EXIT_FAILURE);
         }
@@ -31,6 +46,10 @@ void file_locking_cleanup() {
         g_hash_table_destroy(file_locks);
         file_locks = NULL;
     }
+    if (contention) {
+        g_hash_table_destroy(contention);
+        contention = NULL;
+    }
     pthread_mutex_destroy(&file_locks_mutex);
 }
 
@@ -39,7 +58,7 @@ static void free_file_lock(FileLock* fl) {
     if (fl) {
         pthread_rwlock_destroy(&fl->lock);
         g_free(fl->filename);
-        g_free(fl);
+        slab_free(file_lock_pool, fl);
     }
 }
 
@@ -54,12 +73,12 @@ static FileLock* get_or_create_file_lock(const char* filename) {
     
     if (!fl) {
         // Create new file lock
-        fl = g_malloc0(sizeof(FileLock));
+        fl = slab_zalloc(file_lock_pool);
         if (fl) {
             if (pthread_rwlock_init(&fl->lock, NULL) != 0) {
                 log_message("FILE_LOCKING", "ERROR", "Failed to initialize rwlock for %s: %s", 
                            filename, strerror(errno));
-                g_free(fl);
+                slab_free(file_lock_pool, fl);
                 pthread_mutex_unlock(&file_locks_mutex);
                 return NULL;
             }
@@ -80,6 +99,54 @@ static FileLock* get_or_create_file_lock(const char* filename) {
     return fl;
 }
 
+static long long elapsed_us(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void note_contention(const char* filename, int write, long long wait_us) {
+    pthread_mutex_lock(&contention_mutex);
+    FileLockContention* entry = contention ? g_hash_table_lookup(contention, filename) : NULL;
+    if (!entry && contention && g_hash_table_size(contention) < LOCK_CONTENTION_FILES) {
+        entry = g_malloc0(sizeof(FileLockContention));
+        if (entry) {
+            strncpy(entry->filename, filename, MAX_FILENAME - 1);
+            g_hash_table_insert(contention, g_strdup(filename), entry);
+        }
+    }
+    if (entry) {
+        if (write) {
+            entry->contended_writes++;
+        } else {
+            entry->contended_reads++;
+        }
+        entry->wait_us_total += wait_us;
+        if ((unsigned long long)wait_us > entry->wait_us_max) {
+            entry->wait_us_max = wait_us;
+        }
+    }
+    pthread_mutex_unlock(&contention_mutex);
+}
+
+// Take fl's lock, timing the wait when it is held in a conflicting mode
+static int acquire(FileLock* fl, const char* filename, int write) {
+    int result = write ? pthread_rwlock_trywrlock(&fl->lock) : pthread_rwlock_tryrdlock(&fl->lock);
+    long long wait_us = 0;
+    int contended = result == EBUSY;
+    if (contended) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = write ? pthread_rwlock_wrlock(&fl->lock) : pthread_rwlock_rdlock(&fl->lock);
+        wait_us = elapsed_us(&start);
+        note_contention(filename, write, wait_us);
+    }
+    if (result == 0) {
+        metrics_record(write ? METRIC_LOCK_WRITE : METRIC_LOCK_READ, wait_us, contended);
+    }
+    return result;
+}
+
 // Get a read lock for a file
 int file_read_lock(const char* filename) {
     if (!filename || *filename == '\0') {
@@ -91,7 +158,7 @@ int file_read_lock(const char* filename) {
         return -1;
     }
     
-    int result = pthread_rwlock_rdlock(&fl->lock);
+    int result = acquire(fl, filename, 0);
     if (result != 0) {
         log_message("FILE_LOCKING", "ERROR", "Failed to acquire read lock for %s: %s", 
                    filename, strerror(result));
@@ -112,7 +179,7 @@ int file_write_lock(const char* filename) {
         return -1;
     }
     
-    int result = pthread_rwlock_wrlock(&fl->lock);
+    int result = acquire(fl, filename, 1);
     if (result != 0) {
         log_message("FILE_LOCKING", "ERROR", "Failed to acquire write lock for %s: %s", 
                    filename, strerror(result));
@@ -242,3 +309,43 @@ bool file_is_locked(const char* filename) {
     pthread_mutex_unlock(&file_locks_mutex);
     return is_locked;
 }
+
+typedef struct {
+    FileLockContention* out;
+    int max;
+    int count;
+} ContentionTop;
+
+static void keep_top(gpointer key, gpointer value, gpointer ctx) {
+    (void)key;
+    ContentionTop* top = (ContentionTop*)ctx;
+    FileLockContention* entry = (FileLockContention*)value;
+    
+    int pos = top->count;
+    while (pos > 0 && top->out[pos - 1].wait_us_total < entry->wait_us_total) {
+        pos--;
+    }
+    if (pos >= top->max) {
+        return;
+    }
+    int last = top->count < top->max ? top->count : top->max - 1;
+    memmove(&top->out[pos + 1], &top->out[pos], (last - pos) * sizeof(FileLockContention));
+    top->out[pos] = *entry;
+    if (top->count < top->max) {
+        top->count++;
+    }
+}
+
+int file_lock_top_contended(FileLockContention* out, int max) {
+    ContentionTop top = {out, max, 0};
+    if (max <= 0) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&contention_mutex);
+    if (contention) {
+        g_hash_table_foreach(contention, keep_top, &top);
+    }
+    pthread_mutex_unlock(&contention_mutex);
+    return top.count;
+}
@@ -1,6 +1,45 @@
 #include "../include/hashmap.h"
+#include "../include/slab.h"
 
-// Hash function (djb2)
+// The map is split into HASHMAP_SEGMENTS independent tables picked by the
+// top bits of a key's hash, each with its own rwlock: readers never block
+// each other, and writers only contend within a segment. A segment doubles
+// its bucket array once it holds more entries than buckets; the old array
+// is drained a few buckets per write (and always the bucket a write
+// touches), so no single operation pays for a whole rehash. Until then a
+// lookup looks in the old array for buckets not yet moved.
+
+#define HASHMAP_INITIAL_BUCKETS 16  // Per segment
+#define HASHMAP_REHASH_STEP 8       // Old buckets moved per write
+#define HASHMAP_POOLED_KEY 63       // Longer keys get a node from malloc
+
+// Nodes come from shared slab pools; a node's pool is known from its key's
+// length, so nothing extra is stored per node
+static SlabPool* node_pool = NULL;
+static SlabPool* lru_pool = NULL;
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+
+static void create_pools() {
+    node_pool = slab_pool_create("hash_node", sizeof(HashNode) + HASHMAP_POOLED_KEY + 1);
+    lru_pool = slab_pool_create("lru_node", sizeof(LRUNode));
+}
+
+static HashNode* node_alloc(size_t key_len) {
+    if (key_len > HASHMAP_POOLED_KEY || !node_pool) {
+        return (HashNode*)malloc(sizeof(HashNode) + key_len + 1);
+    }
+    return (HashNode*)slab_alloc(node_pool);
+}
+
+static void node_free(HashNode* node) {
+    if (strlen(node->key) > HASHMAP_POOLED_KEY || !node_pool) {
+        free(node);
+    } else {
+        slab_free(node_pool, node);
+    }
+}
+
+// Hash function (djb2, with a final mix so the top bits are usable)
 unsigned int hash(const char* key) {
     unsigned int hash = 5381;
     int c;
@@ -9,169 +48,392 @@ unsigned int hash(const char* key) {
         hash = ((hash << 5) + hash) + c; // hash * 33 + c
     }
     
-    return hash % HASHMAP_SIZE;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
 }
 
-HashMap* hashmap_create() {
+static HashSegment* segment_for(HashMap* map, unsigned int h) {
+    return &map->segments[h >> (32 - HASHMAP_SEGMENT_BITS)];
+}
+
+static int segment_init(HashSegment* seg) {
+    seg->buckets = (HashNode**)calloc(HASHMAP_INITIAL_BUCKETS, sizeof(HashNode*));
+    if (!seg->buckets) return -1;
+    
+    seg->mask = HASHMAP_INITIAL_BUCKETS - 1;
+    seg->old = NULL;
+    seg->old_mask = 0;
+    seg->migrated = 0;
+    seg->count = 0;
+    pthread_rwlock_init(&seg->lock, NULL);
+    return 0;
+}
+
+HashMap* hashmap_create_with(void (*free_value)(void*)) {
+    pthread_once(&pools_once, create_pools);
+    
     HashMap* map = (HashMap*)malloc(sizeof(HashMap));
     if (!map) return NULL;
     
-    for (int i = 0; i < HASHMAP_SIZE; i++) {
-        map->buckets[i] = NULL;
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++) {
+        if (segment_init(&map->segments[i]) < 0) {
+            for (int j = 0; j < i; j++) {
+                free(map->segments[j].buckets);
+                pthread_rwlock_destroy(&map->segments[j].lock);
+            }
+            free(map);
+            return NULL;
+        }
     }
-    
-    pthread_rwlock_init(&map->lock, NULL);
-    map->size = 0;
+    atomic_init(&map->size, 0);
+    map->free_value = free_value ? free_value : free;
     
     return map;
 }
 
+HashMap* hashmap_create() {
+    return hashmap_create_with(free);
+}
+
+static void free_chain(HashMap* map, HashNode* node) {
+    while (node) {
+        HashNode* next = node->next;
+        map->free_value(node->value);
+        node_free(node);
+        node = next;
+    }
+}
+
 void hashmap_destroy(HashMap* map) {
     if (!map) return;
     
-    pthread_rwlock_wrlock(&map->lock);
-    
-    for (int i = 0; i < HASHMAP_SIZE; i++) {
-        HashNode* node = map->buckets[i];
-        while (node) {
-            HashNode* next = node->next;
-            free(node->value);
-            free(node);
-            node = next;
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++) {
+        HashSegment* seg = &map->segments[i];
+        pthread_rwlock_wrlock(&seg->lock);
+        
+        for (unsigned int b = 0; b <= seg->mask; b++) {
+            free_chain(map, seg->buckets[b]);
+        }
+        if (seg->old) {
+            for (unsigned int b = seg->migrated; b <= seg->old_mask; b++) {
+                free_chain(map, seg->old[b]);
+            }
         }
+        free(seg->buckets);
+        free(seg->old);
+        
+        pthread_rwlock_unlock(&seg->lock);
+        pthread_rwlock_destroy(&seg->lock);
     }
-    
-    pthread_rwlock_unlock(&map->lock);
-    pthread_rwlock_destroy(&map->lock);
     free(map);
 }
 
+// Move old bucket b into the current array. Caller holds the write lock.
+static void migrate_bucket(HashSegment* seg, unsigned int b) {
+    HashNode* node = seg->old[b];
+    seg->old[b] = NULL;
+    while (node) {
+        HashNode* next = node->next;
+        unsigned int nb = node->hash & seg->mask;
+        node->next = seg->buckets[nb];
+        seg->buckets[nb] = node;
+        node = next;
+    }
+}
+
+// Move up to steps old buckets (all of them if steps < 0) and make sure
+// the bucket of h is no longer in the old array. Caller holds the write lock.
+static void rehash_step(HashSegment* seg, unsigned int h, int steps) {
+    if (!seg->old) return;
+    
+    unsigned int own = h & seg->old_mask;
+    if (own >= seg->migrated) {
+        migrate_bucket(seg, own);
+    }
+    while (seg->migrated <= seg->old_mask && steps-- != 0) {
+        migrate_bucket(seg, seg->migrated++);
+    }
+    
+    if (seg->migrated > seg->old_mask) {
+        free(seg->old);
+        seg->old = NULL;
+        seg->old_mask = 0;
+        seg->migrated = 0;
+    }
+}
+
+// Start doubling the bucket array once the load factor passes 1. Caller
+// holds the write lock.
+static void maybe_grow(HashSegment* seg) {
+    if ((unsigned int)seg->count <= seg->mask + 1) return;
+    if (seg->old) {
+        rehash_step(seg, 0, -1);  // Finish the previous resize first
+    }
+    
+    unsigned int buckets = (seg->mask + 1) * 2;
+    HashNode** grown = (HashNode**)calloc(buckets, sizeof(HashNode*));
+    if (!grown) return;  // Keep the longer chains
+    
+    seg->old = seg->buckets;
+    seg->old_mask = seg->mask;
+    seg->migrated = 0;
+    seg->buckets = grown;
+    seg->mask = buckets - 1;
+}
+
+void hashmap_reserve(HashMap* map, int entries) {
+    if (!map || entries <= 0) return;
+    
+    unsigned int want = HASHMAP_INITIAL_BUCKETS;
+    while (want < (unsigned int)(entries / HASHMAP_SEGMENTS + 1)) {
+        want *= 2;
+    }
+    
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++) {
+        HashSegment* seg = &map->segments[i];
+        pthread_rwlock_wrlock(&seg->lock);
+        rehash_step(seg, 0, -1);
+        
+        if (want > seg->mask + 1) {
+            HashNode** grown = (HashNode**)calloc(want, sizeof(HashNode*));
+            if (grown) {
+                // Move everything at once: the segment is about to be
+                // filled anyway
+                seg->old = seg->buckets;
+                seg->old_mask = seg->mask;
+                seg->migrated = 0;
+                seg->buckets = grown;
+                seg->mask = want - 1;
+                rehash_step(seg, 0, -1);
+            }
+        }
+        
+        pthread_rwlock_unlock(&seg->lock);
+    }
+}
+
+static HashNode* find_in_chain(HashNode* node, const char* key, unsigned int h) {
+    for (; node; node = node->next) {
+        if (node->hash == h && strcmp(node->key, key) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// A key is in its old bucket until that bucket is moved (by the cursor, or
+// ahead of it by a write to that bucket), then in the current array.
+// Caller holds the lock.
+static HashNode* find_node(HashSegment* seg, const char* key, unsigned int h) {
+    if (seg->old) {
+        unsigned int ob = h & seg->old_mask;
+        if (ob >= seg->migrated) {
+            HashNode* node = find_in_chain(seg->old[ob], key, h);
+            if (node) return node;
+        }
+    }
+    return find_in_chain(seg->buckets[h & seg->mask], key, h);
+}
+
 void hashmap_put(HashMap* map, const char* key, void* value) {
     if (!map || !key) return;
     
-    unsigned int index = hash(key);
-    
-    pthread_rwlock_wrlock(&map->lock);
+    unsigned int h = hash(key);
+    HashSegment* seg = segment_for(map, h);
     
-    HashNode* node = map->buckets[index];
+    pthread_rwlock_wrlock(&seg->lock);
+    rehash_step(seg, h, HASHMAP_REHASH_STEP);
     
     // Check if key already exists
-    while (node) {
-        if (strcmp(node->key, key) == 0) {
-            // Update existing value
-            free(node->value);
-            node->value = value;
-            pthread_rwlock_unlock(&map->lock);
-            return;
-        }
-        node = node->next;
+    HashNode* node = find_node(seg, key, h);
+    if (node) {
+        // Update existing value
+        map->free_value(node->value);
+        node->value = value;
+        pthread_rwlock_unlock(&seg->lock);
+        return;
     }
     
-    // Create new node
-    HashNode* new_node = (HashNode*)malloc(sizeof(HashNode));
-    strncpy(new_node->key, key, MAX_FILENAME - 1);
-    new_node->key[MAX_FILENAME - 1] = '\0';
+    // Create new node; the key is stored inline at its own length
+    size_t key_len = strlen(key);
+    HashNode* new_node = node_alloc(key_len);
+    if (!new_node) {
+        pthread_rwlock_unlock(&seg->lock);
+        return;
+    }
+    memcpy(new_node->key, key, key_len + 1);
+    new_node->hash = h;
     new_node->value = value;
-    new_node->next = map->buckets[index];
-    map->buckets[index] = new_node;
-    map->size++;
     
-    pthread_rwlock_unlock(&map->lock);
+    HashNode** bucket = &seg->buckets[h & seg->mask];
+    new_node->next = *bucket;
+    *bucket = new_node;
+    seg->count++;
+    atomic_fetch_add(&map->size, 1);
+    
+    maybe_grow(seg);
+    pthread_rwlock_unlock(&seg->lock);
 }
 
 void* hashmap_get(HashMap* map, const char* key) {
     if (!map || !key) return NULL;
     
-    unsigned int index = hash(key);
-    
-    pthread_rwlock_rdlock(&map->lock);
+    unsigned int h = hash(key);
+    HashSegment* seg = segment_for(map, h);
     
-    HashNode* node = map->buckets[index];
+    pthread_rwlock_rdlock(&seg->lock);
+    HashNode* node = find_node(seg, key, h);
+    void* value = node ? node->value : NULL;
+    pthread_rwlock_unlock(&seg->lock);
     
-    while (node) {
-        if (strcmp(node->key, key) == 0) {
-            void* value = node->value;
-            pthread_rwlock_unlock(&map->lock);
-            return value;
+    return value;
+}
+
+// Unlink key's node and return it (NULL if absent). Caller holds the
+// write lock.
+static HashNode* unlink_node(HashMap* map, HashSegment* seg, const char* key, unsigned int h) {
+    rehash_step(seg, h, HASHMAP_REHASH_STEP);
+    
+    HashNode** link = &seg->buckets[h & seg->mask];
+    while (*link) {
+        HashNode* node = *link;
+        if (node->hash == h && strcmp(node->key, key) == 0) {
+            *link = node->next;
+            seg->count--;
+            atomic_fetch_sub(&map->size, 1);
+            return node;
         }
-        node = node->next;
+        link = &node->next;
     }
-    
-    pthread_rwlock_unlock(&map->lock);
     return NULL;
 }
 
 void hashmap_remove(HashMap* map, const char* key) {
     if (!map || !key) return;
     
-    unsigned int index = hash(key);
-    
-    pthread_rwlock_wrlock(&map->lock);
+    unsigned int h = hash(key);
+    HashSegment* seg = segment_for(map, h);
     
-    HashNode* node = map->buckets[index];
-    HashNode* prev = NULL;
+    pthread_rwlock_wrlock(&seg->lock);
+    HashNode* node = unlink_node(map, seg, key, h);
+    pthread_rwlock_unlock(&seg->lock);
     
-    while (node) {
-        if (strcmp(node->key, key) == 0) {
-            if (prev) {
-                prev->next = node->next;
-            } else {
-                map->buckets[index] = node->next;
-            }
-            
-            free(node->value);
-            free(node);
-            map->size--;
-            pthread_rwlock_unlock(&map->lock);
-            return;
-        }
-        
-        prev = node;
-        node = node->next;
+    if (node) {
+        map->free_value(node->value);
+        node_free(node);
     }
+}
+
+void* hashmap_detach(HashMap* map, const char* key) {
+    if (!map || !key) return NULL;
+    
+    unsigned int h = hash(key);
+    HashSegment* seg = segment_for(map, h);
     
-    pthread_rwlock_unlock(&map->lock);
+    pthread_rwlock_wrlock(&seg->lock);
+    HashNode* node = unlink_node(map, seg, key, h);
+    pthread_rwlock_unlock(&seg->lock);
+    
+    if (!node) return NULL;
+    
+    void* value = node->value;
+    node_free(node);
+    return value;
 }
 
 int hashmap_contains(HashMap* map, const char* key) {
     return hashmap_get(map, key) != NULL;
 }
 
+// Every node of a segment, old array included. Caller holds the lock.
+static void segment_foreach(HashSegment* seg, void (*fn)(HashNode* node, void* ctx), void* ctx) {
+    for (unsigned int b = 0; b <= seg->mask; b++) {
+        for (HashNode* node = seg->buckets[b]; node; node = node->next) {
+            fn(node, ctx);
+        }
+    }
+    if (seg->old) {
+        for (unsigned int b = seg->migrated; b <= seg->old_mask; b++) {
+            for (HashNode* node = seg->old[b]; node; node = node->next) {
+                fn(node, ctx);
+            }
+        }
+    }
+}
+
+typedef struct {
+    char (*keys)[MAX_FILENAME];
+    int* count;
+} KeyCollector;
+
+static void collect_key(HashNode* node, void* ctx) {
+    KeyCollector* collector = (KeyCollector*)ctx;
+    char* out = collector->keys[*collector->count];
+    strncpy(out, node->key, MAX_FILENAME - 1);
+    out[MAX_FILENAME - 1] = '\0';
+    (*collector->count)++;
+}
+
 void hashmap_get_keys(HashMap* map, char keys[][MAX_FILENAME], int* count) {
     if (!map || !keys || !count) return;
     
     *count = 0;
+    KeyCollector collector = {keys, count};
     
-    pthread_rwlock_rdlock(&map->lock);
-    
-    for (int i = 0; i < HASHMAP_SIZE; i++) {
-        HashNode* node = map->buckets[i];
-        while (node) {
-            strncpy(keys[*count], node->key, MAX_FILENAME - 1);
-            keys[*count][MAX_FILENAME - 1] = '\0';
-            (*count)++;
-            node = node->next;
-        }
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++) {
+        pthread_rwlock_rdlock(&map->segments[i].lock);
+        segment_foreach(&map->segments[i], collect_key, &collector);
+        pthread_rwlock_unlock(&map->segments[i].lock);
     }
+}
+
+typedef struct {
+    void (*fn)(const char* key, void* value, void* ctx);
+    void* ctx;
+} EntryVisitor;
+
+static void visit_entry(HashNode* node, void* ctx) {
+    EntryVisitor* visitor = (EntryVisitor*)ctx;
+    visitor->fn(node->key, node->value, visitor->ctx);
+}
+
+void hashmap_foreach(HashMap* map, void (*fn)(const char* key, void* value, void* ctx), void* ctx) {
+    if (!map || !fn) return;
     
-    pthread_rwlock_unlock(&map->lock);
+    EntryVisitor visitor = {fn, ctx};
+    
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++) {
+        pthread_rwlock_rdlock(&map->segments[i].lock);
+        segment_foreach(&map->segments[i], visit_entry, &visitor);
+        pthread_rwlock_unlock(&map->segments[i].lock);
+    }
 }
 
 // LRU Cache implementation
-LRUCache* lru_create(int capacity) {
-    LRUCache* cache = (LRUCache*)malloc(sizeof(LRUCache));
+//
+// The map's values are the LRUNodes themselves, so nodes leave the map with
+// hashmap_detach and are freed here, never by the map.
+LRUCache* lru_create_sized(int capacity, size_t max_bytes, void (*free_value)(void*)) {
+    LRUCache* cache = (LRUCache*)calloc(1, sizeof(LRUCache));
     if (!cache) return NULL;
     
-    cache->head = NULL;
-    cache->tail = NULL;
     cache->map = hashmap_create();
     cache->capacity = capacity;
-    cache->size = 0;
+    cache->max_bytes = max_bytes;
+    cache->free_value = free_value ? free_value : free;
     pthread_mutex_init(&cache->lock, NULL);
     
     return cache;
 }
 
+LRUCache* lru_create(int capacity) {
+    return lru_create_sized(capacity, 0, NULL);
+}
+
 void lru_destroy(LRUCache* cache) {
     if (!cache) return;
     
@@ -180,8 +442,9 @@ void lru_destroy(LRUCache* cache) {
     LRUNode* node = cache->head;
     while (node) {
         LRUNode* next = node->next;
-        free(node->value);
-        free(node);
+        hashmap_detach(cache->map, node->key);
+        cache->free_value(node->value);
+        slab_free(lru_pool, node);
         node = next;
     }
     
@@ -192,28 +455,30 @@ void lru_destroy(LRUCache* cache) {
     free(cache);
 }
 
-static void lru_move_to_front(LRUCache* cache, LRUNode* node) {
-    if (cache->head == node) return;
-    
-    // Remove from current position
+static void lru_unlink(LRUCache* cache, LRUNode* node) {
     if (node->prev) {
         node->prev->next = node->next;
+    } else {
+        cache->head = node->next;
     }
+    
     if (node->next) {
         node->next->prev = node->prev;
-    }
-    if (cache->tail == node) {
+    } else {
         cache->tail = node->prev;
     }
     
-    // Move to front
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static void lru_push_front(LRUCache* cache, LRUNode* node) {
     node->prev = NULL;
     node->next = cache->head;
     
     if (cache->head) {
         cache->head->prev = node;
     }
-    
     cache->head = node;
     
     if (!cache->tail) {
@@ -221,27 +486,29 @@ static void lru_move_to_front(LRUCache* cache, LRUNode* node) {
     }
 }
 
-static void lru_remove_tail(LRUCache* cache) {
-    if (!cache->tail) return;
-    
-    LRUNode* node = cache->tail;
-    
-    if (cache->tail->prev) {
-        cache->tail->prev->next = NULL;
-    }
-    cache->tail = cache->tail->prev;
-    
-    if (cache->head == node) {
-        cache->head = NULL;
-    }
+static void lru_move_to_front(LRUCache* cache, LRUNode* node) {
+    if (cache->head == node) return;
     
-    hashmap_remove(cache->map, node->key);
-    free(node->value);
-    free(node);
+    lru_unlink(cache, node);
+    lru_push_front(cache, node);
+}
+
+// Caller holds cache->lock
+static void lru_drop(LRUCache* cache, LRUNode* node) {
+    lru_unlink(cache, node);
+    hashmap_detach(cache->map, node->key);
+    cache->free_value(node->value);
+    cache->bytes -= node->bytes;
     cache->size--;
+    slab_free(lru_pool, node);
 }
 
-void* lru_get(LRUCache* cache, const char* key) {
+static int lru_over_budget(LRUCache* cache) {
+    return (cache->capacity > 0 && cache->size > cache->capacity) ||
+           (cache->max_bytes > 0 && cache->bytes > cache->max_bytes);
+}
+
+void* lru_get_retain(LRUCache* cache, const char* key, void (*retain)(void*)) {
     if (!cache || !key) return NULL;
     
     pthread_mutex_lock(&cache->lock);
@@ -251,83 +518,88 @@ void* lru_get(LRUCache* cache, const char* key) {
     if (node) {
         lru_move_to_front(cache, node);
         void* value = node->value;
+        if (retain) {
+            retain(value);
+        }
+        cache->hits++;
         pthread_mutex_unlock(&cache->lock);
         return value;
     }
     
+    cache->misses++;
     pthread_mutex_unlock(&cache->lock);
     return NULL;
 }
 
-void lru_put(LRUCache* cache, const char* key, void* value) {
+void* lru_get(LRUCache* cache, const char* key) {
+    return lru_get_retain(cache, key, NULL);
+}
+
+void lru_put_sized(LRUCache* cache, const char* key, void* value, size_t bytes) {
     if (!cache || !key) return;
     
     pthread_mutex_lock(&cache->lock);
     
     LRUNode* existing = (LRUNode*)hashmap_get(cache->map, key);
-    
     if (existing) {
-        // Update existing node
-        free(existing->value);
-        existing->value = value;
-        lru_move_to_front(cache, existing);
+        lru_drop(cache, existing);
+    }
+    
+    if (cache->max_bytes > 0 && bytes > cache->max_bytes) {
+        cache->free_value(value);
         pthread_mutex_unlock(&cache->lock);
         return;
     }
     
     // Create new node
-    LRUNode* node = (LRUNode*)malloc(sizeof(LRUNode));
+    LRUNode* node = (LRUNode*)slab_alloc(lru_pool);
+    if (!node) {
+        cache->free_value(value);
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
     strncpy(node->key, key, MAX_FILENAME - 1);
     node->key[MAX_FILENAME - 1] = '\0';
     node->value = value;
-    node->prev = NULL;
-    node->next = cache->head;
-    
-    if (cache->head) {
-        cache->head->prev = node;
-    }
-    cache->head = node;
-    
-    if (!cache->tail) {
-        cache->tail = node;
-    }
+    node->bytes = bytes;
+    lru_push_front(cache, node);
     
     hashmap_put(cache->map, key, node);
     cache->size++;
+    cache->bytes += bytes;
     
-    // Remove oldest if over capacity
-    if (cache->size > cache->capacity) {
-        lru_remove_tail(cache);
+    // Remove oldest while over capacity, never the entry just added
+    while (lru_over_budget(cache) && cache->tail != node) {
+        lru_drop(cache, cache->tail);
+        cache->evictions++;
     }
     
     pthread_mutex_unlock(&cache->lock);
 }
 
+void lru_put(LRUCache* cache, const char* key, void* value) {
+    lru_put_sized(cache, key, value, 0);
+}
+
 void lru_remove(LRUCache* cache, const char* key) {
     if (!cache || !key) return;
     
     pthread_mutex_lock(&cache->lock);
     
     LRUNode* node = (LRUNode*)hashmap_get(cache->map, key);
-    
     if (node) {
-        if (node->prev) {
-            node->prev->next = node->next;
-        } else {
-            cache->head = node->next;
-        }
-        
-        if (node->next) {
-            node->next->prev = node->prev;
-        } else {
-            cache->tail = node->prev;
-        }
-        
-        hashmap_remove(cache->map, key);
-        free(node->value);
-        free(node);
-        cache->size--;
+        lru_drop(cache, node);
     }
     
     pthread_mutex_unlock(&cache->lock);
 }
+
+void lru_get_stats(LRUCache* cache, LRUStats* stats) {
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->size;
+    stats->bytes = cache->bytes;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,733 @@
+#include "../include/history.h"
+#include "../include/hashmap.h"
+#include "../include/file_locking.h"
+#include "../include/durability.h"
+#include <fcntl.h>
+
+#define HISTORY_MAGIC 0x48495354u  // "HIST"
+
+// On disk: header, count step headers, then each step's old and new bytes
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t checksum;     // FNV-1a of everything after this field
+    uint64_t seq;
+    uint64_t target;
+    uint64_t size_after;
+    uint32_t kind;
+    uint32_t count;
+    uint64_t payload_len;
+} RecordHeader;
+
+typedef struct __attribute__((packed)) {
+    uint64_t offset;
+    uint64_t old_len;
+    uint64_t new_len;
+} StepHeader;
+
+// Newest version and record count of each log seen, so appends need not
+// read the log. Entries change under the file's lock.
+typedef struct {
+    uint64_t seq;
+    int count;
+} HistoryTail;
+
+static HashMap* tails = NULL;
+static int history_depth = 100;
+
+// Files whose log has grown past twice the depth. Only the keys matter:
+// every value is compact_queued, which the map does not own.
+static HashMap* compact_pending = NULL;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static char compact_queued;
+
+static void log_path(const char* filename, char* path, size_t len) {
+    snprintf(path, len, "data/history/%s.log", filename);
+}
+
+static void checkpoint_path(const char* filename, const char* tag, char* path, size_t len) {
+    snprintf(path, len, "data/checkpoints/%s_%s.ckpt", filename, tag);
+}
+
+static uint32_t fnv1a(uint32_t h, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t record_checksum(const RecordHeader* header, const char* payload) {
+    uint32_t h = fnv1a(2166136261u, (const char*)header + offsetof(RecordHeader, seq),
+                       sizeof(RecordHeader) - offsetof(RecordHeader, seq));
+    return fnv1a(h, payload, header->payload_len);
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Whole file into a NUL-terminated buffer; NULL if missing
+static char* read_file(const char* path, size_t* len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    struct stat st;
+    char* buf = NULL;
+    if (fstat(fd, &st) == 0) {
+        buf = (char*)malloc(st.st_size + 1);
+    }
+    size_t got = 0;
+    while (buf && got < (size_t)st.st_size) {
+        ssize_t n = read(fd, buf + got, st.st_size - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    
+    if (buf) {
+        buf[got] = '\0';
+        *len = got;
+    }
+    return buf;
+}
+
+static void materialize_checkpoints(const char* filename, const History* history,
+                                    const char* content, size_t len, uint64_t below);
+
+static void tail_forget(const char* filename) {
+    hashmap_remove(tails, filename);
+}
+
+// Scan the record headers of a log (torn tails end the scan)
+static HistoryTail* tail_get(const char* filename) {
+    HistoryTail* tail = (HistoryTail*)hashmap_get(tails, filename);
+    if (tail) {
+        return tail;
+    }
+    
+    tail = (HistoryTail*)calloc(1, sizeof(HistoryTail));
+    if (!tail) {
+        return NULL;
+    }
+    
+    char path[MAX_PATH];
+    log_path(filename, path, sizeof(path));
+    int fd = open(path, O_RDWR);
+    if (fd >= 0) {
+        struct stat st;
+        off_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+        off_t pos = 0;
+        RecordHeader header;
+        while (pread(fd, &header, sizeof(header), pos) == (ssize_t)sizeof(header) &&
+               header.magic == HISTORY_MAGIC &&
+               header.payload_len <= (uint64_t)(size - pos - (off_t)sizeof(header))) {
+            tail->seq = header.seq;
+            tail->count++;
+            pos += sizeof(header) + header.payload_len;
+        }
+        
+        // Appends must not land behind a torn record
+        if (pos < size && ftruncate(fd, pos) != 0) {
+            log_message("HISTORY", "ERROR", "Failed to truncate %s: %s", path, strerror(errno));
+        }
+        close(fd);
+    }
+    
+    hashmap_put(tails, filename, tail);
+    return tail;
+}
+
+uint64_t history_version(const char* filename) {
+    HistoryTail* tail = tail_get(filename);
+    return tail ? tail->seq : 0;
+}
+
+static void compact_later(const char* filename) {
+    pthread_mutex_lock(&compact_lock);
+    // Capped at what the compaction thread takes per pass; appends retry
+    if (compact_pending->size < 1000 && !hashmap_contains(compact_pending, filename)) {
+        hashmap_put(compact_pending, filename, &compact_queued);
+    }
+    pthread_mutex_unlock(&compact_lock);
+}
+
+int history_append(const char* filename, int kind, uint64_t target,
+                   const HistoryStep* steps, int count, uint64_t size_after, off_t* mark) {
+    HistoryTail* tail = tail_get(filename);
+    if (!tail) {
+        return -1;
+    }
+    
+    RecordHeader header;
+    header.magic = HISTORY_MAGIC;
+    header.seq = tail->seq + 1;
+    header.target = target;
+    header.size_after = size_after;
+    header.kind = kind;
+    header.count = count;
+    header.payload_len = count * sizeof(StepHeader);
+    for (int i = 0; i < count; i++) {
+        header.payload_len += steps[i].old_len + steps[i].new_len;
+    }
+    
+    char* record = (char*)malloc(sizeof(header) + header.payload_len);
+    if (!record) {
+        return -1;
+    }
+    char* payload = record + sizeof(header);
+    char* bytes = payload + count * sizeof(StepHeader);
+    for (int i = 0; i < count; i++) {
+        StepHeader step = {steps[i].offset, steps[i].old_len, steps[i].new_len};
+        memcpy(payload + i * sizeof(StepHeader), &step, sizeof(step));
+        memcpy(bytes, steps[i].old_bytes, steps[i].old_len);
+        bytes += steps[i].old_len;
+        memcpy(bytes, steps[i].new_bytes, steps[i].new_len);
+        bytes += steps[i].new_len;
+    }
+    header.checksum = record_checksum(&header, payload);
+    memcpy(record, &header, sizeof(header));
+    
+    char path[MAX_PATH];
+    log_path(filename, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    struct stat st;
+    int ok = fd >= 0 && fstat(fd, &st) == 0;
+    if (ok && (write_all(fd, record, sizeof(header) + header.payload_len) < 0 || durability_sync(fd) < 0)) {
+        ok = 0;
+        if (ftruncate(fd, st.st_size) != 0) {
+            tail_forget(filename);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(record);
+    
+    if (!ok) {
+        log_message("HISTORY", "ERROR", "Failed to append to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    
+    *mark = st.st_size;
+    tail->seq = header.seq;
+    tail->count++;
+    if (tail->count > 2 * history_depth) {
+        compact_later(filename);
+    }
+    return 0;
+}
+
+void history_cancel(const char* filename, off_t mark) {
+    char path[MAX_PATH];
+    log_path(filename, path, sizeof(path));
+    if (truncate(path, mark) != 0) {
+        log_message("HISTORY", "ERROR", "Failed to take back record in %s: %s", path, strerror(errno));
+    }
+    tail_forget(filename);
+}
+
+void history_free(History* history) {
+    if (!history) {
+        return;
+    }
+    for (int i = 0; i < history->count; i++) {
+        free(history->records[i].steps);
+        free(history->records[i].raw);
+    }
+    free(history->records);
+    free(history);
+}
+
+// Parse one record at buf; 0 and *used on success
+static int parse_record(const char* buf, size_t len, HistoryRecord* rec, size_t* used) {
+    RecordHeader header;
+    if (len < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != HISTORY_MAGIC || header.payload_len > len - sizeof(header) ||
+        header.count > header.payload_len / sizeof(StepHeader) ||
+        header.checksum != record_checksum(&header, buf + sizeof(header))) {
+        return -1;
+    }
+    
+    size_t raw_len = sizeof(header) + header.payload_len;
+    rec->raw = (char*)malloc(raw_len);
+    rec->steps = (HistoryStep*)malloc((header.count ? header.count : 1) * sizeof(HistoryStep));
+    if (!rec->raw || !rec->steps) {
+        free(rec->raw);
+        free(rec->steps);
+        return -1;
+    }
+    memcpy(rec->raw, buf, raw_len);
+    rec->raw_len = raw_len;
+    rec->seq = header.seq;
+    rec->target = header.target;
+    rec->size_after = header.size_after;
+    rec->kind = header.kind;
+    rec->count = header.count;
+    
+    const char* payload = rec->raw + sizeof(header);
+    const char* bytes = payload + header.count * sizeof(StepHeader);
+    const char* end = payload + header.payload_len;
+    for (int i = 0; i < rec->count; i++) {
+        StepHeader step;
+        memcpy(&step, payload + i * sizeof(StepHeader), sizeof(step));
+        if (step.old_len > (uint64_t)(end - bytes) ||
+            step.new_len > (uint64_t)(end - bytes) - step.old_len) {
+            free(rec->raw);
+            free(rec->steps);
+            return -1;
+        }
+        rec->steps[i].offset = step.offset;
+        rec->steps[i].old_len = step.old_len;
+        rec->steps[i].new_len = step.new_len;
+        rec->steps[i].old_bytes = bytes;
+        bytes += step.old_len;
+        rec->steps[i].new_bytes = bytes;
+        bytes += step.new_len;
+    }
+    
+    *used = raw_len;
+    return 0;
+}
+
+// Parse the log; with repair 0, a log that needs repairing is left alone
+// and reported through *needs_repair instead
+static History* load_log(const char* filename, size_t current_size, int repair, int* needs_repair) {
+    History* history = (History*)calloc(1, sizeof(History));
+    if (!history) {
+        return NULL;
+    }
+    
+    char path[MAX_PATH];
+    log_path(filename, path, sizeof(path));
+    size_t len = 0;
+    char* buf = read_file(path, &len);
+    if (!buf) {
+        return history;
+    }
+    
+    size_t pos = 0;
+    int capacity = 0;
+    while (pos < len) {
+        if (history->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            HistoryRecord* grown = (HistoryRecord*)realloc(history->records,
+                                                           capacity * sizeof(HistoryRecord));
+            if (!grown) {
+                free(buf);  // Not a damaged tail: the log stays as it is
+                history_free(history);
+                return NULL;
+            }
+            history->records = grown;
+        }
+        
+        size_t used;
+        if (parse_record(buf + pos, len - pos, &history->records[history->count], &used) < 0) {
+            break;
+        }
+        history->count++;
+        pos += used;
+    }
+    free(buf);
+    
+    int mismatch = history->count > 0 &&
+                   history->records[history->count - 1].size_after != (uint64_t)current_size;
+    if (!repair) {
+        if (pos < len || mismatch) {
+            *needs_repair = 1;
+            history_free(history);
+            return NULL;
+        }
+        return history;
+    }
+    
+    if (pos < len) {
+        log_message("HISTORY", "WARNING", "Cutting damaged tail of %s at %zu bytes", path, pos);
+        if (truncate(path, pos) != 0) {
+            log_message("HISTORY", "ERROR", "Failed to truncate %s: %s", path, strerror(errno));
+        }
+        tail_forget(filename);
+    }
+    
+    // A log the file no longer matches cannot be replayed
+    if (mismatch) {
+        log_message("HISTORY", "WARNING", "History of %s does not match the file, dropping it",
+                   filename);
+        for (int i = 0; i < history->count; i++) {
+            free(history->records[i].steps);
+            free(history->records[i].raw);
+        }
+        history->count = 0;
+        unlink(path);
+        tail_forget(filename);
+        materialize_checkpoints(filename, history, NULL, 0, UINT64_MAX);
+    }
+    return history;
+}
+
+History* history_load(const char* filename, size_t current_size) {
+    return load_log(filename, current_size, 1, NULL);
+}
+
+History* history_read(const char* filename, size_t current_size, int* repair) {
+    *repair = 0;
+    return load_log(filename, current_size, 0, repair);
+}
+
+int history_undo_target(const History* history) {
+    uint64_t* undone = (uint64_t*)malloc((history->count + 1) * sizeof(uint64_t));
+    if (!undone) {
+        return -1;
+    }
+    
+    int undone_count = 0;
+    int target = -1;
+    for (int i = history->count - 1; i >= 0 && target < 0; i--) {
+        const HistoryRecord* rec = &history->records[i];
+        if (rec->kind == HISTORY_UNDO) {
+            undone[undone_count++] = rec->target;
+            continue;
+        }
+        
+        int is_undone = 0;
+        for (int j = 0; j < undone_count && !is_undone; j++) {
+            is_undone = undone[j] == rec->seq;
+        }
+        if (!is_undone) {
+            target = i;
+        }
+    }
+    free(undone);
+    return target;
+}
+
+HistoryStep* history_inverse(const History* history, int first, int last, int* count) {
+    int total = 0;
+    for (int i = first; i <= last; i++) {
+        total += history->records[i].count;
+    }
+    
+    HistoryStep* steps = (HistoryStep*)malloc((total ? total : 1) * sizeof(HistoryStep));
+    if (!steps) {
+        return NULL;
+    }
+    
+    int n = 0;
+    for (int i = last; i >= first; i--) {
+        const HistoryRecord* rec = &history->records[i];
+        for (int j = rec->count - 1; j >= 0; j--) {
+            steps[n].offset = rec->steps[j].offset;
+            steps[n].old_len = rec->steps[j].new_len;
+            steps[n].new_len = rec->steps[j].old_len;
+            steps[n].old_bytes = rec->steps[j].new_bytes;
+            steps[n].new_bytes = rec->steps[j].old_bytes;
+            n++;
+        }
+    }
+    *count = n;
+    return steps;
+}
+
+int history_apply(char** content, size_t* len, const HistoryStep* steps, int count) {
+    for (int i = 0; i < count; i++) {
+        const HistoryStep* step = &steps[i];
+        if (step->offset > *len || step->old_len > *len - step->offset) {
+            return -1;
+        }
+        
+        size_t new_len = *len - step->old_len + step->new_len;
+        if (step->new_len > step->old_len) {
+            char* grown = (char*)realloc(*content, new_len + 1);
+            if (!grown) {
+                return -1;
+            }
+            *content = grown;
+        }
+        
+        char* at = *content + step->offset;
+        memmove(at + step->new_len, at + step->old_len, *len - step->offset - step->old_len);
+        memcpy(at, step->new_bytes, step->new_len);
+        *len = new_len;
+        (*content)[new_len] = '\0';
+    }
+    return 0;
+}
+
+char* history_rebuild(const History* history, const char* content, size_t len,
+                      uint64_t seq, size_t* out_len) {
+    // Records after seq; the one right after it must still be in the log
+    int first = history->count;
+    while (first > 0 && history->records[first - 1].seq > seq) {
+        first--;
+    }
+    uint64_t current = history->count ? history->records[history->count - 1].seq : 0;
+    if (seq > current || (first < history->count && history->records[first].seq != seq + 1)) {
+        return NULL;
+    }
+    
+    char* out = (char*)malloc(len + 1);
+    if (!out) {
+        return NULL;
+    }
+    memcpy(out, content, len);
+    out[len] = '\0';
+    *out_len = len;
+    
+    if (first < history->count) {
+        int count = 0;
+        HistoryStep* steps = history_inverse(history, first, history->count - 1, &count);
+        if (!steps || history_apply(&out, out_len, steps, count) < 0) {
+            free(steps);
+            free(out);
+            return NULL;
+        }
+        free(steps);
+    }
+    return out;
+}
+
+// Give pointer checkpoints of filename to versions before `below` their
+// content (rebuilt from content, the current version) in their files
+static void materialize_checkpoints(const char* filename, const History* history,
+                                    const char* content, size_t len, uint64_t below) {
+    DIR* dir = opendir("data/checkpoints");
+    if (!dir) {
+        return;
+    }
+    
+    char prefix[MAX_FILENAME + 1];
+    snprintf(prefix, sizeof(prefix), "%s_", filename);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0 || name_len < strlen(prefix) + 5 ||
+            strcmp(entry->d_name + name_len - 5, ".ckpt") != 0) {
+            continue;
+        }
+        
+        char tag[256];
+        snprintf(tag, sizeof(tag), "%.*s", (int)(name_len - strlen(prefix) - 5),
+                 entry->d_name + strlen(prefix));
+        uint64_t seq;
+        long offset;
+        if (history_checkpoint_find(filename, tag, &seq, &offset) != 1 || seq >= below) {
+            continue;
+        }
+        
+        char path[MAX_PATH];
+        checkpoint_path(filename, tag, path, sizeof(path));
+        size_t version_len = 0;
+        char* version = content ? history_rebuild(history, content, len, seq, &version_len) : NULL;
+        if (!version) {
+            log_message("HISTORY", "WARNING", "Checkpoint %s of %s lost with its history", tag, filename);
+            unlink(path);
+            continue;
+        }
+        
+        // Keep the creation time from the pointer
+        FILE* fp = fopen(path, "r");
+        long created = (long)time(NULL);
+        if (fp) {
+            if (fscanf(fp, "%ld", &created) != 1) {
+                created = (long)time(NULL);
+            }
+            fclose(fp);
+        }
+        
+        char tmp[MAX_PATH + 8];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        fp = fopen(tmp, "w");
+        if (fp) {
+            fprintf(fp, "%ld\n", created);
+            fwrite(version, 1, version_len, fp);
+            if (fclose(fp) == 0) {
+                rename(tmp, path);
+            } else {
+                unlink(tmp);
+            }
+        }
+        free(version);
+    }
+    closedir(dir);
+}
+
+void history_reset(const char* filename) {
+    char path[MAX_PATH], filepath[MAX_PATH];
+    log_path(filename, path, sizeof(path));
+    snprintf(filepath, MAX_PATH, "data/files/%s", filename);
+    
+    size_t len = 0;
+    char* content = read_file(filepath, &len);
+    History* history = content ? history_load(filename, len) : NULL;
+    if (content && history) {
+        materialize_checkpoints(filename, history, content, len, UINT64_MAX);
+    }
+    history_free(history);
+    free(content);
+    
+    unlink(path);
+    tail_forget(filename);
+}
+
+void history_rename(const char* from, const char* to) {
+    char from_path[MAX_PATH], to_path[MAX_PATH], filepath[MAX_PATH];
+    log_path(from, from_path, sizeof(from_path));
+    log_path(to, to_path, sizeof(to_path));
+    snprintf(filepath, MAX_PATH, "data/files/%s", to);
+    
+    size_t len = 0;
+    char* content = read_file(filepath, &len);
+    History* history = content ? history_load(from, len) : NULL;
+    if (content && history) {
+        materialize_checkpoints(from, history, content, len, UINT64_MAX);
+    }
+    history_free(history);
+    free(content);
+    
+    if (rename(from_path, to_path) != 0 && errno != ENOENT) {
+        log_message("HISTORY", "WARNING", "Failed to move history of %s: %s", from, strerror(errno));
+        unlink(from_path);
+    }
+    tail_forget(from);
+    tail_forget(to);
+}
+
+int history_checkpoint(const char* filename, const char* tag) {
+    char path[MAX_PATH];
+    checkpoint_path(filename, tag, path, sizeof(path));
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        return -1;
+    }
+    fprintf(fp, "%ld @%llu\n", (long)time(NULL), (unsigned long long)history_version(filename));
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+int history_checkpoint_find(const char* filename, const char* tag, uint64_t* seq, long* offset) {
+    char path[MAX_PATH];
+    checkpoint_path(filename, tag, path, sizeof(path));
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    
+    char line[64];
+    long created;
+    unsigned long long at;
+    int pointer = 0;
+    if (fgets(line, sizeof(line), fp) && sscanf(line, "%ld @%llu", &created, &at) == 2) {
+        *seq = at;
+        pointer = 1;
+    }
+    *offset = ftell(fp);
+    fclose(fp);
+    return pointer;
+}
+
+// Drop all but the newest history_depth records of filename
+static void compact(const char* filename) {
+    char path[MAX_PATH], filepath[MAX_PATH];
+    log_path(filename, path, sizeof(path));
+    snprintf(filepath, MAX_PATH, "data/files/%s", filename);
+    
+    size_t len = 0;
+    char* content = read_file(filepath, &len);
+    History* history = content ? history_load(filename, len) : NULL;
+    if (!history || history->count <= history_depth) {
+        history_free(history);
+        free(content);
+        return;
+    }
+    
+    int cut = history->count - history_depth;
+    uint64_t base = history->records[cut].seq - 1;  // Oldest version still reachable
+    materialize_checkpoints(filename, history, content, len, base);
+    free(content);
+    
+    char tmp[MAX_PATH + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0;
+    for (int i = cut; ok && i < history->count; i++) {
+        ok = write_all(fd, history->records[i].raw, history->records[i].raw_len) == 0;
+    }
+    if (fd >= 0) {
+        ok = fdatasync(fd) == 0 && ok;
+        close(fd);
+    }
+    
+    if (ok && rename(tmp, path) == 0) {
+        log_message("HISTORY", "INFO", "Compacted history of %s: %d records dropped, %d kept",
+                   filename, cut, history_depth);
+    } else {
+        unlink(tmp);
+        log_message("HISTORY", "ERROR", "Failed to compact %s: %s", path, strerror(errno));
+    }
+    tail_forget(filename);
+    history_free(history);
+}
+
+static void* compact_thread(void* arg) {
+    int interval_ms = *(int*)arg;
+    static char names[1000][MAX_FILENAME];  // See compact_later
+    while (1) {
+        usleep(interval_ms * 1000);
+        
+        int count = 0;
+        pthread_mutex_lock(&compact_lock);
+        hashmap_get_keys(compact_pending, names, &count);
+        for (int i = 0; i < count; i++) {
+            hashmap_remove(compact_pending, names[i]);
+        }
+        pthread_mutex_unlock(&compact_lock);
+        
+        for (int i = 0; i < count; i++) {
+            file_write_lock(names[i]);
+            compact(names[i]);
+            file_unlock(names[i]);
+        }
+    }
+    return NULL;
+}
+
+static void keep_value(void* value) {
+    (void)value;
+}
+
+void history_init() {
+    tails = hashmap_create();
+    compact_pending = hashmap_create_with(keep_value);
+    mkdir("data/history", 0755);
+    
+    history_depth = config_get_int("SS_HISTORY_DEPTH", 100);
+    if (history_depth < 1) {
+        history_depth = 1;
+    }
+    
+    static int interval_ms;
+    interval_ms = config_get_int("SS_HISTORY_COMPACT_MS", 2000);
+    if (interval_ms <= 0) {
+        interval_ms = 2000;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, compact_thread, &interval_ms);
+    pthread_detach(thread);
+}
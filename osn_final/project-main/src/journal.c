@@ -0,0 +1,264 @@
+#include "../include/journal.h"
+#include <fcntl.h>
+#include <libgen.h>
+
+#define JOURNAL_INITIAL_BUFFER 4096
+
+static uint32_t record_checksum(const char* record, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)record[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Make a rename in path's directory durable
+static void sync_parent_dir(const char* path) {
+    char copy[MAX_PATH];
+    strncpy(copy, path, MAX_PATH - 1);
+    copy[MAX_PATH - 1] = '\0';
+    
+    int dir_fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// Apply records ("%08x <record>\n") from path up to the first damaged one.
+// Returns the offset just past the last intact record, or -1 if the file
+// does not exist.
+static off_t replay_file(const char* path, void (*apply)(const char* record, void* ctx),
+                         void* ctx, int* count) {
+    *count = 0;
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    off_t valid = 0;
+    
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        unsigned int sum;
+        if (len < 10 || line[len - 1] != '\n' || line[8] != ' ' ||
+            sscanf(line, "%8x", &sum) != 1) {
+            break;
+        }
+        
+        line[len - 1] = '\0';
+        const char* record = line + 9;
+        if (record_checksum(record, len - 10) != sum) {
+            break;
+        }
+        
+        apply(record, ctx);
+        valid += len;
+        (*count)++;
+    }
+    
+    if (len > 0) {
+        log_message("JOURNAL", "WARNING", "%s: discarding damaged tail after %d records",
+                   path, *count);
+    }
+    
+    free(line);
+    fclose(fp);
+    return valid;
+}
+
+int journal_replay(const char* path, void (*apply)(const char* record, void* ctx), void* ctx) {
+    int count = 0;
+    replay_file(path, apply, ctx, &count);
+    return count;
+}
+
+Journal* journal_open(const char* path, int durable,
+                      void (*apply)(const char* record, void* ctx), void* ctx) {
+    Journal* journal = (Journal*)calloc(1, sizeof(Journal));
+    if (!journal) {
+        return NULL;
+    }
+    
+    strncpy(journal->path, path, MAX_PATH - 1);
+    journal->durable = durable;
+    
+    off_t valid = replay_file(path, apply, ctx, &journal->records);
+    if (valid >= 0 && truncate(path, valid) < 0) {
+        log_message("JOURNAL", "ERROR", "Failed to trim %s: %s", path, strerror(errno));
+    }
+    
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (journal->fd < 0) {
+        log_message("JOURNAL", "ERROR", "Failed to open %s: %s", path, strerror(errno));
+        free(journal);
+        return NULL;
+    }
+    
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->flushed, NULL);
+    
+    log_message("JOURNAL", "INFO", "Opened %s (%d records replayed)", path, journal->records);
+    return journal;
+}
+
+void journal_close(Journal* journal) {
+    if (!journal) {
+        return;
+    }
+    
+    journal_wait(journal, journal->appended_seq);
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->flushed);
+    free(journal->pending);
+    free(journal->spare);
+    free(journal);
+}
+
+unsigned long long journal_append(Journal* journal, const char* record) {
+    size_t len = strlen(record);
+    
+    pthread_mutex_lock(&journal->lock);
+    
+    size_t need = journal->pending_len + len + 10;
+    if (need > journal->pending_cap) {
+        size_t cap = journal->pending_cap ? journal->pending_cap : JOURNAL_INITIAL_BUFFER;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char* grown = (char*)realloc(journal->pending, cap);
+        if (!grown) {
+            pthread_mutex_unlock(&journal->lock);
+            return 0;  // Never "durable": journal_wait(0) returns at once
+        }
+        journal->pending = grown;
+        journal->pending_cap = cap;
+    }
+    
+    char* out = journal->pending + journal->pending_len;
+    snprintf(out, 10, "%08x ", record_checksum(record, len));
+    memcpy(out + 9, record, len);
+    out[9 + len] = '\n';
+    journal->pending_len += len + 10;
+    journal->records++;
+    
+    unsigned long long seq = ++journal->appended_seq;
+    pthread_mutex_unlock(&journal->lock);
+    return seq;
+}
+
+int journal_wait(Journal* journal, unsigned long long seq) {
+    pthread_mutex_lock(&journal->lock);
+    
+    while (journal->durable_seq < seq && !journal->failed) {
+        if (journal->flushing) {
+            pthread_cond_wait(&journal->flushed, &journal->lock);
+            continue;
+        }
+        
+        // Lead this group: write everything buffered so far
+        journal->flushing = 1;
+        char* buf = journal->pending;
+        size_t len = journal->pending_len;
+        size_t cap = journal->pending_cap;
+        unsigned long long target = journal->appended_seq;
+        journal->pending = journal->spare;
+        journal->pending_cap = journal->spare ? journal->spare_cap : 0;
+        journal->pending_len = 0;
+        journal->spare = NULL;
+        pthread_mutex_unlock(&journal->lock);
+        
+        int rc = write_all(journal->fd, buf, len);
+        if (rc == 0 && journal->durable) {
+            rc = fdatasync(journal->fd);
+        }
+        
+        pthread_mutex_lock(&journal->lock);
+        if (rc == 0) {
+            journal->durable_seq = target;
+        } else {
+            // The file may end in a partial record; stop writing to it
+            // until the next rotation
+            journal->failed = 1;
+            log_message("JOURNAL", "ERROR", "Write to %s failed: %s", journal->path, strerror(errno));
+        }
+        if (!journal->spare) {
+            journal->spare = buf;
+            journal->spare_cap = cap;
+        } else {
+            free(buf);
+        }
+        journal->flushing = 0;
+        pthread_cond_broadcast(&journal->flushed);
+    }
+    
+    int rc = journal->durable_seq >= seq ? 0 : -1;
+    pthread_mutex_unlock(&journal->lock);
+    return rc;
+}
+
+int journal_rotate(Journal* journal, const char* old_path) {
+    pthread_mutex_lock(&journal->lock);
+    while (journal->flushing) {
+        pthread_cond_wait(&journal->flushed, &journal->lock);
+    }
+    
+    // Everything appended so far belongs to the old file. Records that
+    // cannot be written there are covered by the caller's snapshot.
+    if (!journal->failed && journal->pending_len > 0) {
+        if (write_all(journal->fd, journal->pending, journal->pending_len) < 0 ||
+            (journal->durable && fdatasync(journal->fd) < 0)) {
+            journal->failed = 1;
+        }
+    }
+    journal->pending_len = 0;
+    journal->durable_seq = journal->appended_seq;
+    
+    int rc = -1;
+    if (rename(journal->path, old_path) == 0) {
+        int fd = open(journal->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd >= 0) {
+            sync_parent_dir(journal->path);
+            close(journal->fd);
+            journal->fd = fd;
+            journal->records = 0;
+            journal->failed = 0;
+            rc = 0;
+        } else {
+            rename(old_path, journal->path);
+        }
+    }
+    if (rc < 0) {
+        log_message("JOURNAL", "ERROR", "Failed to rotate %s: %s", journal->path, strerror(errno));
+    }
+    
+    pthread_cond_broadcast(&journal->flushed);
+    pthread_mutex_unlock(&journal->lock);
+    return rc;
+}
+
+int journal_records(Journal* journal) {
+    pthread_mutex_lock(&journal->lock);
+    int records = journal->records;
+    pthread_mutex_unlock(&journal->lock);
+    return records;
+}
@@ -0,0 +1,172 @@
+#include "../include/lease.h"
+#include <sys/time.h>
+
+static uint8_t lease_key[16];
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND            \
+    do {                    \
+        v0 += v1;           \
+        v1 = ROTL(v1, 13);  \
+        v1 ^= v0;           \
+        v0 = ROTL(v0, 32);  \
+        v2 += v3;           \
+        v3 = ROTL(v3, 16);  \
+        v3 ^= v2;           \
+        v0 += v3;           \
+        v3 = ROTL(v3, 21);  \
+        v3 ^= v0;           \
+        v2 += v1;           \
+        v1 = ROTL(v1, 17);  \
+        v1 ^= v2;           \
+        v2 = ROTL(v2, 32);  \
+    } while (0)
+
+static uint64_t load_le64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+uint64_t siphash24(const uint8_t key[16], const void* data, size_t len) {
+    const uint8_t* in = (const uint8_t*)data;
+    uint64_t k0 = load_le64(key);
+    uint64_t k1 = load_le64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    
+    size_t whole = len - len % 8;
+    for (size_t i = 0; i < whole; i += 8) {
+        uint64_t m = load_le64(in + i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    
+    // Last block: remaining bytes and the length in the top byte
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < len % 8; i++) {
+        b |= (uint64_t)in[whole + i] << (8 * i);
+    }
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+int lease_init(const char* component) {
+    // No built-in fallback: anyone who knows the key can mint leases
+    const char* secret = getenv("LEASE_KEY");
+    if (!secret || secret[0] == '\0') {
+        log_message(component, "ERROR", "LEASE_KEY is not set; it must hold the secret shared by "
+                    "the Name Server and the Storage Servers");
+        return -1;
+    }
+    
+    // Stretch the secret to a 16-byte key
+    uint8_t seed[16] = {0};
+    uint64_t k0 = siphash24(seed, secret, strlen(secret));
+    seed[0] = 1;
+    uint64_t k1 = siphash24(seed, secret, strlen(secret));
+    for (int i = 0; i < 8; i++) {
+        lease_key[i] = (uint8_t)(k0 >> (8 * i));
+        lease_key[8 + i] = (uint8_t)(k1 >> (8 * i));
+    }
+    return 0;
+}
+
+long long lease_now_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint64_t lease_mac(const WriteLease* lease, const char* filename, const char* username) {
+    char text[MAX_FILENAME + MAX_USERNAME + 96];
+    int n = snprintf(text, sizeof(text), "%s%c%s%c%llu|%d|%d|%lld", filename, '\0', username, '\0',
+                     lease->id, lease->first, lease->last, lease->expires_ms);
+    if (n >= (int)sizeof(text)) {
+        n = sizeof(text) - 1;
+    }
+    return siphash24(lease_key, text, (size_t)n);
+}
+
+void lease_sign(WriteLease* lease, const char* filename, const char* username) {
+    lease->mac = lease_mac(lease, filename, username);
+}
+
+int lease_valid(const WriteLease* lease, const char* filename, const char* username) {
+    return lease->mac == lease_mac(lease, filename, username) &&
+           lease->expires_ms > lease_now_ms();
+}
+
+int lease_format(const WriteLease* lease, char* out, size_t len) {
+    return snprintf(out, len, LEASE_PREFIX "%llu|%d|%d|%lld|%016llx", lease->id, lease->first,
+                    lease->last, lease->expires_ms, (unsigned long long)lease->mac);
+}
+
+int lease_parse(const char* text, WriteLease* lease) {
+    if (strncmp(text, LEASE_PREFIX, strlen(LEASE_PREFIX)) != 0) {
+        return -1;
+    }
+    
+    unsigned long long mac;
+    int used = 0;
+    if (sscanf(text + strlen(LEASE_PREFIX), "%llu|%d|%d|%lld|%16llx%n", &lease->id, &lease->first,
+               &lease->last, &lease->expires_ms, &mac, &used) != 5) {
+        return -1;
+    }
+    lease->mac = mac;
+    return (int)strlen(LEASE_PREFIX) + used;
+}
+
+static uint64_t peer_mac(int command, const char* filename, long long expires_ms,
+                         const char* payload, size_t len) {
+    // The payload may be a whole file: hash it first instead of copying it
+    char text[MAX_FILENAME + 64];
+    int n = snprintf(text, sizeof(text), "%d%c%s%c%lld|%016llx", command, '\0', filename, '\0',
+                     expires_ms, (unsigned long long)siphash24(lease_key, payload, len));
+    if (n >= (int)sizeof(text)) {
+        n = sizeof(text) - 1;
+    }
+    return siphash24(lease_key, text, (size_t)n);
+}
+
+void peer_sign(int command, const char* filename, const char* payload, size_t len, char* out) {
+    long long expires_ms = lease_now_ms() + PEER_AUTH_MS;
+    char line[64];
+    snprintf(line, sizeof(line), PEER_PREFIX "%013lld|%016llx\n", expires_ms,
+             (unsigned long long)peer_mac(command, filename, expires_ms, payload, len));
+    memcpy(out, line, PEER_AUTH_LEN);
+}
+
+int peer_valid(int command, const char* filename, const char* payload, size_t len) {
+    if (len < PEER_AUTH_LEN || strncmp(payload, PEER_PREFIX, strlen(PEER_PREFIX)) != 0 ||
+        payload[PEER_AUTH_LEN - 1] != '\n') {
+        return 0;
+    }
+    
+    char line[PEER_AUTH_LEN + 1];
+    memcpy(line, payload, PEER_AUTH_LEN);
+    line[PEER_AUTH_LEN] = '\0';
+    long long expires_ms;
+    unsigned long long mac;
+    if (sscanf(line + strlen(PEER_PREFIX), "%13lld|%16llx", &expires_ms, &mac) != 2) {
+        return 0;
+    }
+    return expires_ms > lease_now_ms() &&
+           mac == peer_mac(command, filename, expires_ms, payload + PEER_AUTH_LEN, len - PEER_AUTH_LEN);
+}
@@ -0,0 +1,350 @@
+#include "../include/logger.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#define LOG_COMPONENT_MAX 32
+#define LOG_TEXT_MAX 984  // Keeps a record at 1 KB
+#define LOG_MAX_FILES 32
+#define LOG_DEFAULT_SLOTS 128
+#define LOG_DEFAULT_FLUSH_MS 20
+
+typedef struct {
+    time_t when;
+    int level;
+    char component[LOG_COMPONENT_MAX];
+    char text[LOG_TEXT_MAX];
+} LogRecord;
+
+// Single-producer/single-consumer ring: the owning thread advances head,
+// the flusher advances tail. Rings are never freed; a ring whose thread
+// exited is handed to the next thread that starts logging once drained.
+typedef struct LogRing {
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic unsigned long dropped;
+    int retired;           // Guarded by registry_lock
+    struct LogRing* next;  // Set once before the ring is published
+    LogRecord slots[];
+} LogRing;
+
+typedef struct {
+    char component[LOG_COMPONENT_MAX];
+    FILE* file;
+} LogFile;
+
+static const char* level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static _Atomic int min_level = LOG_INFO;
+static size_t ring_slots = LOG_DEFAULT_SLOTS;
+static int flush_ms = LOG_DEFAULT_FLUSH_MS;
+static int log_sync = 0;
+
+// Registered rings (newest first); the list only ever grows at the head
+static LogRing* _Atomic rings = NULL;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread LogRing* thread_ring = NULL;
+static _Atomic unsigned long unbuffered_dropped = 0;  // Threads without a ring
+static _Atomic unsigned long total_dropped = 0;
+
+// Consumer side: one drain at a time owns the output files
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogFile log_files[LOG_MAX_FILES];
+static int log_file_count = 0;
+
+static pthread_t flusher_thread;
+static int flusher_started = 0;
+static _Atomic int flusher_stop = 0;
+static int flusher_wake = 0;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+
+static int level_from_name(const char* level) {
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+        if (strcmp(level, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Positive integer from the environment. Not config_get_int(): that logs.
+static int env_int(const char* name, int default_value) {
+    const char* value = getenv(name);
+    int parsed = value ? atoi(value) : 0;
+    return parsed > 0 ? parsed : default_value;
+}
+
+// Open log file for component. *transient is set when the file could not be
+// kept open (full table) and must be closed after use. Caller holds
+// drain_lock.
+static FILE* component_file(const char* component, int* transient) {
+    *transient = 0;
+    for (int i = 0; i < log_file_count; i++) {
+        if (strcmp(log_files[i].component, component) == 0) {
+            return log_files[i].file;
+        }
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "logs/%s.log", component);
+    FILE* file = fopen(path, "a");
+    if (!file) {
+        return NULL;  // Not remembered: logs/ may be created later
+    }
+    if (log_file_count == LOG_MAX_FILES) {
+        *transient = 1;
+        return file;
+    }
+
+    strncpy(log_files[log_file_count].component, component, LOG_COMPONENT_MAX - 1);
+    log_files[log_file_count].file = file;
+    log_file_count++;
+    return file;
+}
+
+// Caller holds drain_lock
+static void write_record(const LogRecord* rec) {
+    static time_t stamp_time = 0;
+    static char stamp[64];
+    if (rec->when != stamp_time) {
+        struct tm tm_info;
+        localtime_r(&rec->when, &tm_info);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+        stamp_time = rec->when;
+    }
+
+    const char* level = level_names[rec->level];
+    printf("[%s] [%s] [%s] %s\n", stamp, rec->component, level, rec->text);
+
+    int transient;
+    FILE* file = component_file(rec->component, &transient);
+    if (file) {
+        fprintf(file, "[%s] [%s] %s\n", stamp, level, rec->text);
+        if (transient) {
+            fclose(file);
+        }
+    }
+}
+
+// Caller holds drain_lock
+static void flush_outputs() {
+    fflush(stdout);
+    for (int i = 0; i < log_file_count; i++) {
+        fflush(log_files[i].file);
+    }
+}
+
+// Write out every ring. Caller holds drain_lock.
+static void drain_rings() {
+    unsigned long dropped = atomic_exchange(&unbuffered_dropped, 0);
+
+    for (LogRing* ring = atomic_load(&rings); ring; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            write_record(&ring->slots[tail % ring_slots]);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        dropped += atomic_exchange(&ring->dropped, 0);
+    }
+
+    if (dropped > 0) {
+        LogRecord rec;
+        rec.when = time(NULL);
+        rec.level = LOG_WARNING;
+        snprintf(rec.component, sizeof(rec.component), "LOGGER");
+        snprintf(rec.text, sizeof(rec.text), "Dropped %lu log lines (buffers full)", dropped);
+        write_record(&rec);
+        atomic_fetch_add(&total_dropped, dropped);
+    }
+
+    flush_outputs();
+}
+
+static void* flusher_main(void* arg) {
+    (void)arg;
+
+    while (!atomic_load(&flusher_stop)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)flush_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&wake_lock);
+        while (!flusher_wake && !atomic_load(&flusher_stop)) {
+            if (pthread_cond_timedwait(&wake_cond, &wake_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        flusher_wake = 0;
+        pthread_mutex_unlock(&wake_lock);
+
+        log_flush();
+    }
+    return NULL;
+}
+
+static void wake_flusher() {
+    pthread_mutex_lock(&wake_lock);
+    flusher_wake = 1;
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+// Registered with atexit(): the servers leave through exit() from their
+// signal handlers, so this writes out the final lines
+static void log_shutdown() {
+    if (flusher_started) {
+        // No wake_lock here: exit() may run on a thread that holds it
+        atomic_store(&flusher_stop, 1);
+        pthread_join(flusher_thread, NULL);
+        flusher_started = 0;
+    }
+    log_flush();
+}
+
+static void ring_retire(void* value) {
+    pthread_mutex_lock(&registry_lock);
+    ((LogRing*)value)->retired = 1;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void log_init() {
+    const char* level = getenv("LOG_LEVEL");
+    if (level && level_from_name(level) >= 0) {
+        atomic_store(&min_level, level_from_name(level));
+    }
+    ring_slots = env_int("LOG_RING_SLOTS", LOG_DEFAULT_SLOTS);
+    flush_ms = env_int("LOG_FLUSH_MS", LOG_DEFAULT_FLUSH_MS);
+    log_sync = env_int("LOG_SYNC", 0) > 0;
+
+    pthread_key_create(&ring_key, ring_retire);
+    if (!log_sync) {
+        flusher_started = pthread_create(&flusher_thread, NULL, flusher_main, NULL) == 0;
+        log_sync = !flusher_started;
+    }
+    atexit(log_shutdown);
+}
+
+// The calling thread's ring, claimed on first use
+static LogRing* get_thread_ring() {
+    if (thread_ring) {
+        return thread_ring;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    LogRing* ring = NULL;
+    for (LogRing* r = atomic_load(&rings); r; r = r->next) {
+        if (r->retired && atomic_load(&r->tail) == atomic_load(&r->head)) {
+            ring = r;
+            ring->retired = 0;
+            break;
+        }
+    }
+    if (!ring) {
+        ring = (LogRing*)malloc(sizeof(LogRing) + ring_slots * sizeof(LogRecord));
+        if (ring) {
+            atomic_init(&ring->head, 0);
+            atomic_init(&ring->tail, 0);
+            atomic_init(&ring->dropped, 0);
+            ring->retired = 0;
+            ring->next = atomic_load(&rings);
+            atomic_store(&rings, ring);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (ring) {
+        pthread_setspecific(ring_key, ring);
+    }
+    thread_ring = ring;
+    return ring;
+}
+
+void log_message(const char* component, const char* level, const char* format, ...) {
+    pthread_once(&log_once, log_init);
+
+    int lvl = level_from_name(level);
+    if (lvl < 0) {
+        lvl = LOG_INFO;
+    }
+    if (lvl < atomic_load_explicit(&min_level, memory_order_relaxed)) {
+        return;
+    }
+
+    va_list args;
+
+    if (log_sync) {
+        LogRecord rec;
+        rec.when = time(NULL);
+        rec.level = lvl;
+        snprintf(rec.component, sizeof(rec.component), "%s", component);
+        va_start(args, format);
+        vsnprintf(rec.text, sizeof(rec.text), format, args);
+        va_end(args);
+
+        pthread_mutex_lock(&drain_lock);
+        write_record(&rec);
+        flush_outputs();
+        pthread_mutex_unlock(&drain_lock);
+        return;
+    }
+
+    LogRing* ring = get_thread_ring();
+    if (!ring) {
+        atomic_fetch_add(&unbuffered_dropped, 1);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= ring_slots) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord* rec = &ring->slots[head % ring_slots];
+    rec->when = time(NULL);
+    rec->level = lvl;
+    snprintf(rec->component, sizeof(rec->component), "%s", component);
+    va_start(args, format);
+    vsnprintf(rec->text, sizeof(rec->text), format, args);
+    va_end(args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    // Errors go out promptly; a filling ring is drained early
+    if (lvl >= LOG_ERROR || head + 1 - tail >= ring_slots / 2) {
+        wake_flusher();
+    }
+}
+
+int log_set_level(const char* level) {
+    pthread_once(&log_once, log_init);
+
+    int lvl = level_from_name(level);
+    if (lvl < 0) {
+        return -1;
+    }
+    atomic_store(&min_level, lvl);
+    return 0;
+}
+
+int log_enabled(const char* level) {
+    pthread_once(&log_once, log_init);
+
+    int lvl = level_from_name(level);
+    return lvl < 0 || lvl >= atomic_load_explicit(&min_level, memory_order_relaxed);
+}
+
+void log_flush() {
+    pthread_mutex_lock(&drain_lock);
+    drain_rings();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+unsigned long log_dropped_count() {
+    return atomic_load(&total_dropped) + atomic_load(&unbuffered_dropped);
+}
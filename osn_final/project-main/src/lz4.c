@@ -0,0 +1,201 @@
+#include "../include/lz4.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5   // A block always ends in this many literals
+#define LZ4_MATCH_LIMIT 12    // No match starts this close to the end
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// 15 in the token, then bytes of 255 and the rest
+static unsigned char* write_length(unsigned char* out, size_t len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (unsigned char)len;
+    return out;
+}
+
+// Room for a sequence of lit literals and a match of mlen extra bytes
+static size_t sequence_size(size_t lit, size_t mlen) {
+    return 1 + (lit >= 15 ? 1 + (lit - 15) / 255 : 0) + lit + 2 +
+           (mlen >= 15 ? 1 + (mlen - 15) / 255 : 0);
+}
+
+size_t lz4_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+size_t lz4_compress(const char* src, size_t len, char* dst, size_t cap) {
+    const unsigned char* in = (const unsigned char*)src;
+    const unsigned char* end = in + len;
+    const unsigned char* anchor = in;
+    unsigned char* out = (unsigned char*)dst;
+    unsigned char* out_end = out + cap;
+    uint32_t table[1 << LZ4_HASH_BITS];
+    
+    if (len > LZ4_MATCH_LIMIT) {
+        memset(table, 0, sizeof(table));
+        const unsigned char* match_limit = end - LZ4_MATCH_LIMIT;
+        const unsigned char* extend_limit = end - LZ4_LAST_LITERALS;
+        const unsigned char* ip = in + 1;
+        
+        while (ip < match_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const unsigned char* ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+                // Step faster through data that does not repeat
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char* p = ip + LZ4_MIN_MATCH;
+            const unsigned char* r = ref + LZ4_MIN_MATCH;
+            while (p < extend_limit && *p == *r) {
+                p++;
+                r++;
+            }
+            
+            size_t lit = ip - anchor;
+            size_t mlen = p - ip - LZ4_MIN_MATCH;
+            if ((size_t)(out_end - out) < sequence_size(lit, mlen)) {
+                return 0;
+            }
+            
+            unsigned char* token = out++;
+            *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15) {
+                out = write_length(out, lit);
+            }
+            memcpy(out, anchor, lit);
+            out += lit;
+            
+            size_t offset = ip - ref;
+            *out++ = (unsigned char)(offset & 0xff);
+            *out++ = (unsigned char)(offset >> 8);
+            *token |= (unsigned char)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) {
+                out = write_length(out, mlen);
+            }
+            
+            ip = p;
+            anchor = ip;
+            if (ip < match_limit) {
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+            }
+        }
+    }
+    
+    // The last sequence is literals only
+    size_t lit = end - anchor;
+    if ((size_t)(out_end - out) < sequence_size(lit, 0) - 2) {
+        return 0;
+    }
+    *out++ = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) {
+        out = write_length(out, lit);
+    }
+    memcpy(out, anchor, lit);
+    out += lit;
+    
+    return out - (unsigned char*)dst;
+}
+
+// Extra length bytes after a token field of 15; -1 past the end
+static long read_length(const unsigned char** ip, const unsigned char* end) {
+    long len = 0;
+    unsigned char b;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+long lz4_decompress(const char* src, size_t len, char* dst, size_t cap) {
+    const unsigned char* ip = (const unsigned char*)src;
+    const unsigned char* end = ip + len;
+    unsigned char* out = (unsigned char*)dst;
+    unsigned char* out_end = out + cap;
+    
+    // A block ends with a literals-only sequence; running out anywhere else
+    // (or an empty block) means it is cut short
+    for (;;) {
+        if (ip >= end) {
+            return -1;
+        }
+        unsigned token = *ip++;
+        
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            long extra = read_length(&ip, end);
+            if (extra < 0) {
+                return -1;
+            }
+            lit += extra;
+        }
+        if ((size_t)(end - ip) < lit || (size_t)(out_end - out) < lit) {
+            return -1;
+        }
+        memcpy(out, ip, lit);
+        out += lit;
+        ip += lit;
+        if (ip == end) {
+            break;
+        }
+        
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(out - (unsigned char*)dst)) {
+            return -1;
+        }
+        
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            long extra = read_length(&ip, end);
+            if (extra < 0) {
+                return -1;
+            }
+            mlen += extra;
+        }
+        mlen += LZ4_MIN_MATCH;
+        if ((size_t)(out_end - out) < mlen) {
+            return -1;
+        }
+        
+        const unsigned char* match = out - offset;
+        if (offset >= mlen) {
+            memcpy(out, match, mlen);
+        } else {
+            // Overlapping: repeats the last offset bytes
+            for (size_t i = 0; i < mlen; i++) {
+                out[i] = match[i];
+            }
+        }
+        out += mlen;
+    }
+    
+    return out - (unsigned char*)dst;
+}
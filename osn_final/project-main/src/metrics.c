@@ -0,0 +1,465 @@
+#include "../include/metrics.h"
+#include <stdarg.h>
+
+// One thread's recordings. Only the owning thread writes; readers hold
+// shards_lock, which also keeps an exiting thread from freeing its shard
+// under them.
+typedef struct MetricsShard {
+    MetricsSeries* series[METRICS_SERIES];
+    struct MetricsShard* next;
+} MetricsShard;
+
+static __thread MetricsShard* local_shard = NULL;
+static MetricsShard* live_shards = NULL;
+static MetricsShard retired;  // Left behind by exited threads
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void add_series(MetricsSeries* dst, const MetricsSeries* src) {
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->errors += __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+    dst->sum_us += __atomic_load_n(&src->sum_us, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&src->max_us, __ATOMIC_RELAXED);
+    if (max > dst->max_us) {
+        dst->max_us = max;
+    }
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Thread exit: fold the shard into the retired totals
+static void retire_shard(void* arg) {
+    MetricsShard* shard = (MetricsShard*)arg;
+    
+    pthread_mutex_lock(&shards_lock);
+    for (MetricsShard** p = &live_shards; *p; p = &(*p)->next) {
+        if (*p == shard) {
+            *p = shard->next;
+            break;
+        }
+    }
+    for (int i = 0; i < METRICS_SERIES; i++) {
+        if (!shard->series[i]) {
+            continue;
+        }
+        if (!retired.series[i]) {
+            retired.series[i] = (MetricsSeries*)calloc(1, sizeof(MetricsSeries));
+        }
+        if (retired.series[i]) {
+            add_series(retired.series[i], shard->series[i]);
+        }
+        free(shard->series[i]);
+    }
+    pthread_mutex_unlock(&shards_lock);
+    free(shard);
+}
+
+static void make_key() {
+    pthread_key_create(&shard_key, retire_shard);
+}
+
+static MetricsSeries* local_series(int series) {
+    if (!local_shard) {
+        pthread_once(&key_once, make_key);
+        MetricsShard* shard = (MetricsShard*)calloc(1, sizeof(MetricsShard));
+        if (!shard) {
+            return NULL;
+        }
+        pthread_mutex_lock(&shards_lock);
+        shard->next = live_shards;
+        live_shards = shard;
+        pthread_mutex_unlock(&shards_lock);
+        pthread_setspecific(shard_key, shard);
+        local_shard = shard;
+    }
+    
+    MetricsSeries* s = local_shard->series[series];
+    if (!s) {
+        s = (MetricsSeries*)calloc(1, sizeof(MetricsSeries));
+        __atomic_store_n(&local_shard->series[series], s, __ATOMIC_RELEASE);
+    }
+    return s;
+}
+
+static int bucket_of(unsigned long long usec) {
+    if (usec < METRICS_SUB_BUCKETS) {
+        return (int)usec;
+    }
+    int magnitude = 63 - __builtin_clzll(usec);  // >= 4
+    int bucket = (magnitude - 3) * METRICS_SUB_BUCKETS + (int)((usec >> (magnitude - 4)) & 15);
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+// Largest value that falls in bucket
+static unsigned long long bucket_top(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int magnitude = bucket / METRICS_SUB_BUCKETS + 3;
+    unsigned long long width = 1ULL << (magnitude - 4);
+    return (METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) * width + width - 1;
+}
+
+// Owner-only updates; relaxed stores keep concurrent readers from seeing
+// torn values without the cost of atomic read-modify-writes
+#define BUMP(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void metrics_record(int series, long long usec, int error) {
+    if (series < 0 || series >= METRICS_SERIES) {
+        return;
+    }
+    MetricsSeries* s = local_series(series);
+    if (!s) {
+        return;
+    }
+    
+    unsigned long long value = usec > 0 ? (unsigned long long)usec : 0;
+    BUMP(s->count, 1);
+    BUMP(s->sum_us, value);
+    BUMP(s->buckets[bucket_of(value)], 1);
+    if (error) {
+        BUMP(s->errors, 1);
+    }
+    if (value > s->max_us) {
+        __atomic_store_n(&s->max_us, value, __ATOMIC_RELAXED);
+    }
+}
+
+int metrics_snapshot(int series, MetricsSeries* out) {
+    memset(out, 0, sizeof(MetricsSeries));
+    if (series < 0 || series >= METRICS_SERIES) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&shards_lock);
+    if (retired.series[series]) {
+        add_series(out, retired.series[series]);
+    }
+    for (MetricsShard* shard = live_shards; shard; shard = shard->next) {
+        MetricsSeries* s = __atomic_load_n(&shard->series[series], __ATOMIC_ACQUIRE);
+        if (s) {
+            add_series(out, s);
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+    return out->count > 0;
+}
+
+unsigned long long metrics_quantile(const MetricsSeries* series, double q) {
+    if (series->count == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(q * series->count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    
+    unsigned long long seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += series->buckets[i];
+        if (seen >= rank) {
+            unsigned long long top = bucket_top(i);
+            return top < series->max_us ? top : series->max_us;
+        }
+    }
+    return series->max_us;
+}
+
+void metrics_text_printf(MetricsText* text, const char* fmt, ...) {
+    while (1) {
+        size_t room = text->cap - text->len;
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(text->data ? text->data + text->len : NULL, room, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < room) {
+            text->len += n;
+            return;
+        }
+        
+        size_t cap = text->cap ? text->cap * 2 : 8192;
+        while (cap < text->len + n + 1) {
+            cap *= 2;
+        }
+        char* data = (char*)realloc(text->data, cap);
+        if (!data) {
+            return;
+        }
+        text->data = data;
+        text->cap = cap;
+    }
+}
+
+void metrics_text_free(MetricsText* text) {
+    free(text->data);
+    text->data = NULL;
+    text->len = text->cap = 0;
+}
+
+void metrics_escape_label(const char* value, char* out, size_t len) {
+    size_t used = 0;
+    for (; *value && used + 3 < len; value++) {
+        if (*value == '\\' || *value == '"') {
+            out[used++] = '\\';
+            out[used++] = *value;
+        } else if (*value == '\n') {
+            out[used++] = '\\';
+            out[used++] = 'n';
+        } else {
+            out[used++] = *value;
+        }
+    }
+    out[used] = '\0';
+}
+
+const char* metrics_command_name(int command) {
+    static const char* names[] = {
+        [CMD_VIEW] = "VIEW", [CMD_READ] = "READ", [CMD_CREATE] = "CREATE",
+        [CMD_WRITE] = "WRITE", [CMD_DELETE] = "DELETE", [CMD_INFO] = "INFO",
+        [CMD_LIST] = "LIST", [CMD_ADDACCESS] = "ADDACCESS", [CMD_REMACCESS] = "REMACCESS",
+        [CMD_STREAM] = "STREAM", [CMD_UNDO] = "UNDO", [CMD_COPY] = "COPY",
+        [CMD_FILEINFO] = "FILEINFO", [CMD_EXEC] = "EXEC", [CMD_WRITE_COMMIT] = "WRITE_COMMIT",
+        [CMD_LOCK_ACQUIRE] = "LOCK_ACQUIRE", [CMD_LOCK_RELEASE] = "LOCK_RELEASE",
+        [CMD_CREATEFOLDER] = "CREATEFOLDER", [CMD_MOVE] = "MOVE", [CMD_VIEWFOLDER] = "VIEWFOLDER",
+        [CMD_CHECKPOINT] = "CHECKPOINT", [CMD_VIEWCHECKPOINT] = "VIEWCHECKPOINT",
+        [CMD_REVERT] = "REVERT", [CMD_LISTCHECKPOINTS] = "LISTCHECKPOINTS",
+        [CMD_REQUESTACCESS] = "REQUESTACCESS", [CMD_VIEWREQUESTS] = "VIEWREQUESTS",
+        [CMD_APPROVEREQUEST] = "APPROVEREQUEST", [CMD_DENYREQUEST] = "DENYREQUEST",
+        [CMD_READ_CHUNKED] = "READ_CHUNKED", [CMD_WRITE_BULK] = "WRITE_BULK",
+        [CMD_STATS] = "STATS", [CMD_SHARD_MAP] = "SHARD_MAP", [CMD_REPLICATE] = "REPLICATE",
+        [CMD_MIGRATE] = "MIGRATE", [CMD_METRICS] = "METRICS",
+    };
+    if (command == METRIC_HEARTBEAT) {
+        return "HEARTBEAT";
+    }
+    if (command == METRIC_REGISTER) {
+        return "REGISTER";
+    }
+    if (command < 0 || command >= (int)(sizeof(names) / sizeof(names[0])) || !names[command]) {
+        return NULL;
+    }
+    return names[command];
+}
+
+static void render_summary(MetricsText* text, const char* name, const char* labels,
+                           const MetricsSeries* s) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        metrics_text_printf(text, "%s{%s,quantile=\"%g\"} %.6f\n", name, labels, quantiles[i],
+                            metrics_quantile(s, quantiles[i]) / 1e6);
+    }
+    metrics_text_printf(text, "%s_sum{%s} %.6f\n", name, labels, s->sum_us / 1e6);
+    metrics_text_printf(text, "%s_count{%s} %llu\n", name, labels, s->count);
+}
+
+void metrics_render(MetricsText* text, const char* prefix) {
+    // Snapshots first, so every family lists the same series
+    MetricsSeries* all = (MetricsSeries*)malloc(METRICS_SERIES * sizeof(MetricsSeries));
+    if (!all) {
+        return;
+    }
+    int present[METRICS_SERIES];
+    for (int i = 0; i < METRICS_SERIES; i++) {
+        present[i] = metrics_snapshot(i, &all[i]);
+    }
+    
+    char labels[METRICS_SERIES][64];
+    for (int i = 0; i < METRIC_LOCK_READ; i++) {
+        const char* name = metrics_command_name(i);
+        if (name) {
+            snprintf(labels[i], sizeof(labels[i]), "command=\"%s\"", name);
+        } else {
+            snprintf(labels[i], sizeof(labels[i]), "command=\"%d\"", i);
+        }
+    }
+    snprintf(labels[METRIC_LOCK_READ], sizeof(labels[0]), "mode=\"read\"");
+    snprintf(labels[METRIC_LOCK_WRITE], sizeof(labels[0]), "mode=\"write\"");
+    
+    metrics_text_printf(text, "# HELP %s_requests_total Requests handled, by command.\n"
+                        "# TYPE %s_requests_total counter\n", prefix, prefix);
+    for (int i = 0; i < METRIC_LOCK_READ; i++) {
+        if (present[i]) {
+            metrics_text_printf(text, "%s_requests_total{%s} %llu\n", prefix, labels[i],
+                                all[i].count);
+        }
+    }
+    
+    metrics_text_printf(text, "# HELP %s_request_errors_total Requests answered with an error.\n"
+                        "# TYPE %s_request_errors_total counter\n", prefix, prefix);
+    for (int i = 0; i < METRIC_LOCK_READ; i++) {
+        if (present[i]) {
+            metrics_text_printf(text, "%s_request_errors_total{%s} %llu\n", prefix, labels[i],
+                                all[i].errors);
+        }
+    }
+    
+    char name[128];
+    snprintf(name, sizeof(name), "%s_request_duration_seconds", prefix);
+    metrics_text_printf(text, "# HELP %s Time from receiving a request to sending its reply.\n"
+                        "# TYPE %s summary\n", name, name);
+    for (int i = 0; i < METRIC_LOCK_READ; i++) {
+        if (present[i]) {
+            render_summary(text, name, labels[i], &all[i]);
+        }
+    }
+    
+    metrics_text_printf(text, "# HELP %s_request_duration_max_seconds Slowest request.\n"
+                        "# TYPE %s_request_duration_max_seconds gauge\n", prefix, prefix);
+    for (int i = 0; i < METRIC_LOCK_READ; i++) {
+        if (present[i]) {
+            metrics_text_printf(text, "%s_request_duration_max_seconds{%s} %.6f\n", prefix,
+                                labels[i], all[i].max_us / 1e6);
+        }
+    }
+    
+    if (present[METRIC_LOCK_READ] || present[METRIC_LOCK_WRITE]) {
+        metrics_text_printf(text, "# HELP %s_file_lock_acquisitions_total File locks taken.\n"
+                            "# TYPE %s_file_lock_acquisitions_total counter\n", prefix, prefix);
+        for (int i = METRIC_LOCK_READ; i <= METRIC_LOCK_WRITE; i++) {
+            metrics_text_printf(text, "%s_file_lock_acquisitions_total{%s} %llu\n", prefix,
+                                labels[i], all[i].count);
+        }
+        metrics_text_printf(text,
+                            "# HELP %s_file_lock_contended_total File locks that had to wait.\n"
+                            "# TYPE %s_file_lock_contended_total counter\n", prefix, prefix);
+        for (int i = METRIC_LOCK_READ; i <= METRIC_LOCK_WRITE; i++) {
+            metrics_text_printf(text, "%s_file_lock_contended_total{%s} %llu\n", prefix,
+                                labels[i], all[i].errors);
+        }
+        snprintf(name, sizeof(name), "%s_file_lock_wait_seconds", prefix);
+        metrics_text_printf(text, "# HELP %s Time spent waiting for file locks.\n"
+                            "# TYPE %s summary\n", name, name);
+        for (int i = METRIC_LOCK_READ; i <= METRIC_LOCK_WRITE; i++) {
+            render_summary(text, name, labels[i], &all[i]);
+        }
+    }
+    
+    free(all);
+}
+
+// Minimal HTTP/1.0 server for scrapers: one connection at a time, any GET
+// of / or /metrics gets the report
+typedef struct {
+    int fd;
+    metrics_render_fn render;
+} MetricsServer;
+
+static void send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void serve_scrape(int fd, metrics_render_fn render) {
+    struct timeval timeout = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    // Only the request line matters; headers are read and ignored
+    char request[2048];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[len] = '\0';
+    
+    char method[16] = "", path[256] = "";
+    sscanf(request, "%15s %255s", method, path);
+    char* query = strchr(path, '?');
+    if (query) {
+        *query = '\0';
+    }
+    
+    char header[256];
+    if (strcmp(method, "GET") != 0 || (strcmp(path, "/") != 0 && strcmp(path, "/metrics") != 0)) {
+        const char* body = "Not found\n";
+        int n = snprintf(header, sizeof(header),
+                         "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+                         "Content-Length: %zu\r\nConnection: close\r\n\r\n%s", strlen(body), body);
+        send_all(fd, header, n);
+        return;
+    }
+    
+    MetricsText text = {NULL, 0, 0};
+    render(&text);
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n", text.len);
+    send_all(fd, header, n);
+    if (text.len > 0) {
+        send_all(fd, text.data, text.len);
+    }
+    metrics_text_free(&text);
+}
+
+static void* metrics_http_loop(void* arg) {
+    MetricsServer* server = (MetricsServer*)arg;
+    while (1) {
+        int fd = accept(server->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                usleep(100000);
+            }
+            continue;
+        }
+        serve_scrape(fd, server->render);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_http_start(int port, metrics_render_fn render) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    MetricsServer* server = (MetricsServer*)malloc(sizeof(MetricsServer));
+    pthread_t thread;
+    if (!server) {
+        close(fd);
+        return -1;
+    }
+    server->fd = fd;
+    server->render = render;
+    if (pthread_create(&thread, NULL, metrics_http_loop, server) != 0) {
+        free(server);
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -1,32 +1,96 @@
 #include "../include/common.h"
 #include "../include/hashmap.h"
+#include "../include/reactor.h"
+#include "../include/journal.h"
+#include "../include/path_index.h"
+#include "../include/shard_map.h"
+#include "../include/lease.h"
+#include "../include/metrics.h"
+#include "../include/slab.h"
 #include <signal.h>
 #include <limits.h>
+#include <fcntl.h>
+
+// Write leases held on one file (see lease.h). Expired entries are dropped
+// lazily when the file's leases are next looked at.
+#define FILE_MAX_LEASES 16
+
+typedef struct {
+    unsigned long long id;
+    int first;
+    int last;
+    long long expires_ms;
+    char holder[MAX_USERNAME];
+} LeaseEntry;
+
+typedef struct {
+    int count;
+    LeaseEntry entries[FILE_MAX_LEASES];
+} FileLeases;
 
 // Global state
 HashMap* file_registry;  // filename -> FileInfo*
 HashMap* user_registry;  // username -> UserInfo*
 HashMap* ss_registry;    // ss_id -> StorageServerInfo*
-HashMap* sentence_locks; // "filename:index" -> SentenceLock*
-LRUCache* file_cache;    // Recent file lookups
+HashMap* write_leases;   // filename -> FileLeases*
 HashMap* access_requests;  // BONUS: "filename:username" -> AccessRequest*
 pthread_mutex_t registry_lock;
 
+// FileInfo and FileLeases are created and dropped with every CREATE,
+// DELETE and write lease, so they come from slab pools
+static SlabPool* file_info_pool;
+static SlabPool* file_leases_pool;
+
+static void free_file_info(void* value) {
+    slab_free(file_info_pool, value);
+}
+
+static void free_file_leases(void* value) {
+    slab_free(file_leases_pool, value);
+}
+
+// Names in file_registry by folder and by owner, for VIEW and VIEWFOLDER.
+// Updated together with file_registry under file_registry_lock. A name
+// ending in '/' is a folder marker: it keeps a CREATEFOLDER folder listed
+// while empty and records which SS holds it.
+PathIndex* path_index;
+
+// This server is shard shard_self of shard_map and only holds the names
+// hashed to it. Each shard keeps its registry under its own working
+// directory's data/. Without NM_SHARDS it is the only shard.
+ShardMap* shard_map;
+int shard_self = 0;
+
+// File registry persistence: a snapshot plus a journal of the changes made
+// since. file_registry_lock serializes registry changes with their journal
+// records so the journal replays in the order the changes happened.
+#define REGISTRY_SNAPSHOT "data/file_registry.txt"
+#define REGISTRY_JOURNAL "data/file_registry.journal"
+#define REGISTRY_JOURNAL_OLD "data/file_registry.journal.old"  // Being compacted
+Journal* registry_journal = NULL;
+pthread_mutex_t file_registry_lock;
+
 int server_socket = -1;
 int running = 1;
 
 void cleanup() {
     running = 0;
+    reactor_stop();
     if (server_socket >= 0) {
         close(server_socket);
     }
     
+    journal_close(registry_journal);
+    registry_journal = NULL;
+    
     if (file_registry) hashmap_destroy(file_registry);
+    path_index_destroy(path_index);
     if (user_registry) hashmap_destroy(user_registry);
     if (ss_registry) hashmap_destroy(ss_registry);
-    if (sentence_locks) hashmap_destroy(sentence_locks);
-    if (file_cache) lru_destroy(file_cache);
+    if (write_leases) hashmap_destroy(write_leases);
     if (access_requests) hashmap_destroy(access_requests);
+    shard_map_free(shard_map);
+    shard_map = NULL;
     
     pthread_mutex_destroy(&registry_lock);
     
@@ -40,108 +104,817 @@ void signal_handler(int signum) {
 }
 
 void init_name_server() {
-    file_registry = hashmap_create();
+    file_info_pool = slab_pool_create("file_info", sizeof(FileInfo));
+    file_leases_pool = slab_pool_create("file_leases", sizeof(FileLeases));
+    file_registry = hashmap_create_with(free_file_info);
+    path_index = path_index_create();
     user_registry = hashmap_create();
     ss_registry = hashmap_create();
-    sentence_locks = hashmap_create();
-    file_cache = lru_create(100);
+    write_leases = hashmap_create_with(free_file_leases);
     access_requests = hashmap_create();  // BONUS
     
+    if (lease_init("NAME_SERVER") < 0) {
+        fprintf(stderr, "LEASE_KEY must be set\n");
+        exit(1);
+    }
+    
+    shard_map = shard_map_from_env();
+    shard_self = config_get_int("NM_SHARD", 0);
+    if (!shard_map || shard_self < 0 || shard_self >= shard_map->count) {
+        fprintf(stderr, "Invalid NM_SHARDS/NM_SHARD configuration\n");
+        exit(1);
+    }
+    
     pthread_mutex_init(&registry_lock, NULL);
+    pthread_mutex_init(&file_registry_lock, NULL);
     
-    // Create logs directory if it doesn't exist
+    // Create logs and data directories if they don't exist
     mkdir("logs", 0755);
+    mkdir("data", 0755);
+    
+    log_message("NAME_SERVER", "INFO", "Name Server initialized (shard %d of %d)",
+               shard_self, shard_map->count);
+}
+
+// Registry line: filename|owner|ss_id|created|modified|accessed|accessed_by|words|chars
+// The first three fields are required. Split by hand rather than with
+// sscanf: a cold start parses one line per file.
+#define REGISTRY_FIELDS 9
+
+static void copy_field(char* out, size_t size, const char* field, size_t len) {
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(out, field, len);
+    out[len] = '\0';
+}
+
+static FileInfo* parse_registry_line(const char* line) {
+    const char* fields[REGISTRY_FIELDS];
+    size_t lens[REGISTRY_FIELDS];
+    int count = 0;
+    
+    const char* p = line;
+    while (count < REGISTRY_FIELDS) {
+        const char* bar = strchr(p, '|');
+        fields[count] = p;
+        lens[count] = bar ? (size_t)(bar - p) : strlen(p);
+        count++;
+        if (!bar) {
+            break;
+        }
+        p = bar + 1;
+    }
+    if (count < 3 || lens[0] == 0 || lens[1] == 0 || lens[2] == 0) {
+        return NULL;
+    }
+    
+    FileInfo* info = (FileInfo*)slab_zalloc(file_info_pool);
+    if (!info) {
+        return NULL;
+    }
+    
+    copy_field(info->filename, sizeof(info->filename), fields[0], lens[0]);
+    copy_field(info->owner, sizeof(info->owner), fields[1], lens[1]);
+    copy_field(info->ss_id, sizeof(info->ss_id), fields[2], lens[2]);
+    if (count > 3) info->created = strtol(fields[3], NULL, 10);
+    if (count > 4) info->modified = strtol(fields[4], NULL, 10);
+    if (count > 5) info->accessed = strtol(fields[5], NULL, 10);
+    if (count > 6) copy_field(info->last_accessed_by, sizeof(info->last_accessed_by), fields[6], lens[6]);
+    if (count > 7) info->word_count = (int)strtol(fields[7], NULL, 10);
+    if (count > 8) info->char_count = (int)strtol(fields[8], NULL, 10);
+    return info;
+}
+
+static void format_registry_line(const FileInfo* info, char* out, size_t len) {
+    snprintf(out, len, "%s|%s|%s|%ld|%ld|%ld|%s|%d|%d",
+             info->filename, info->owner, info->ss_id,
+             info->created, info->modified, info->accessed,
+             info->last_accessed_by, info->word_count, info->char_count);
+}
+
+// Journal records: "+<registry line>" adds or replaces, "-<filename>" removes
+static void apply_registry_record(const char* record, void* ctx) {
+    (void)ctx;
+    
+    if (record[0] == '+') {
+        FileInfo* info = parse_registry_line(record + 1);
+        if (info) {
+            hashmap_put(file_registry, info->filename, info);
+        }
+    } else if (record[0] == '-') {
+        hashmap_remove(file_registry, record + 1);
+    }
+}
+
+typedef struct {
+    FileInfo** entries;
+    int count;
+    int capacity;
+} RegistryEntries;
+
+static void collect_registry_entry(const char* key, void* value, void* ctx) {
+    (void)key;
+    RegistryEntries* list = (RegistryEntries*)ctx;
+    if (list->count < list->capacity) {
+        list->entries[list->count++] = (FileInfo*)value;
+    }
+}
+
+static int compare_entry_names(const void* a, const void* b) {
+    return strcmp((*(FileInfo* const*)a)->filename, (*(FileInfo* const*)b)->filename);
+}
+
+// The index keeps sorted arrays, so it is filled in name order: each name
+// then lands at (or near) the end of its arrays instead of shifting them
+static void index_registry() {
+    RegistryEntries list = {NULL, 0, atomic_load(&file_registry->size)};
+    list.entries = (FileInfo**)malloc((list.capacity + 1) * sizeof(FileInfo*));
+    if (!list.entries) {
+        return;
+    }
+    
+    hashmap_foreach(file_registry, collect_registry_entry, &list);
+    qsort(list.entries, list.count, sizeof(FileInfo*), compare_entry_names);
+    for (int i = 0; i < list.count; i++) {
+        path_index_add(path_index, list.entries[i]->filename, list.entries[i]->owner);
+    }
+    free(list.entries);
+}
+
+// Journal a registry change. Caller holds file_registry_lock; the returned
+// sequence is passed to registry_commit() once the lock is dropped.
+static unsigned long long journal_registry_put(const FileInfo* info) {
+    if (!registry_journal) {
+        return 0;
+    }
     
-    log_message("NAME_SERVER", "INFO", "Name Server initialized");
+    char record[1024];
+    record[0] = '+';
+    format_registry_line(info, record + 1, sizeof(record) - 1);
+    return journal_append(registry_journal, record);
 }
 
+static unsigned long long journal_registry_remove(const char* filename) {
+    if (!registry_journal) {
+        return 0;
+    }
+    
+    char record[MAX_FILENAME + 2];
+    snprintf(record, sizeof(record), "-%s", filename);
+    return journal_append(registry_journal, record);
+}
+
+// Wait for a journaled change to reach disk (shared with concurrent changes)
+static void registry_commit(unsigned long long seq) {
+    if (registry_journal && journal_wait(registry_journal, seq) < 0) {
+        log_message("NAME_SERVER", "ERROR", "Failed to persist file registry change");
+    }
+}
+
+typedef struct {
+    FileInfo* entries;
+    int count;
+    int capacity;
+} RegistrySnapshot;
+
+static void snapshot_entry(const char* key, void* value, void* ctx) {
+    (void)key;
+    RegistrySnapshot* snap = (RegistrySnapshot*)ctx;
+    
+    if (snap->count == snap->capacity) {
+        int capacity = snap->capacity ? snap->capacity * 2 : 256;
+        FileInfo* grown = (FileInfo*)realloc(snap->entries, capacity * sizeof(FileInfo));
+        if (!grown) {
+            return;
+        }
+        snap->entries = grown;
+        snap->capacity = capacity;
+    }
+    snap->entries[snap->count++] = *(FileInfo*)value;
+}
+
+// Write a fresh snapshot and drop the journal records it covers. Only the
+// in-memory copy happens under file_registry_lock; the snapshot is written
+// while CREATE and DELETE carry on in the new journal file.
+void compact_file_registry() {
+    RegistrySnapshot snap = {NULL, 0, 0};
+    
+    pthread_mutex_lock(&file_registry_lock);
+    hashmap_foreach(file_registry, snapshot_entry, &snap);
+    // A leftover .old journal means the last snapshot failed; it is still
+    // needed until one succeeds, and the current journal already holds
+    // everything since, so keep appending to it
+    if (registry_journal && access(REGISTRY_JOURNAL_OLD, F_OK) != 0) {
+        journal_rotate(registry_journal, REGISTRY_JOURNAL_OLD);
+    }
+    pthread_mutex_unlock(&file_registry_lock);
+    
+    int ok = 0;
+    FILE* fp = fopen(REGISTRY_SNAPSHOT ".tmp", "w");
+    if (fp) {
+        char line[1024];
+        for (int i = 0; i < snap.count; i++) {
+            format_registry_line(&snap.entries[i], line, sizeof(line));
+            fprintf(fp, "%s\n", line);
+        }
+        ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        ok = fclose(fp) == 0 && ok;
+        ok = ok && rename(REGISTRY_SNAPSHOT ".tmp", REGISTRY_SNAPSHOT) == 0;
+    }
+    free(snap.entries);
+    
+    if (!ok) {
+        log_message("NAME_SERVER", "ERROR", "Failed to write file registry snapshot: %s", strerror(errno));
+        return;
+    }
+    
+    unlink(REGISTRY_JOURNAL_OLD);
+    log_message("NAME_SERVER", "INFO", "File registry compacted (%d files)", snap.count);
+}
+
+// The snapshot is read in one go and split into line-aligned ranges, one
+// per worker (NM_LOAD_THREADS, default one per core). Snapshot names are
+// unique, so the workers insert straight into the segmented registry
+// without ordering between them.
+#define REGISTRY_LOAD_MIN_LINES 4096  // Per extra worker
+
+typedef struct {
+    char* start;
+    char* end;
+    int loaded;
+} RegistryLoadRange;
+
+static void* load_registry_range(void* arg) {
+    RegistryLoadRange* range = (RegistryLoadRange*)arg;
+    char* line = range->start;
+    while (line < range->end) {
+        char* eol = (char*)memchr(line, '\n', range->end - line);
+        if (!eol) {
+            eol = range->end;
+        }
+        *eol = '\0';
+        
+        FileInfo* info = parse_registry_line(line);
+        if (info) {
+            hashmap_put(file_registry, info->filename, info);
+            range->loaded++;
+        }
+        line = eol + 1;
+    }
+    return NULL;
+}
+
+static int load_registry_snapshot() {
+    int fd = open(REGISTRY_SNAPSHOT, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct stat st;
+    char* text = NULL;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0 && (text = (char*)malloc(st.st_size + 1)) != NULL) {
+        while (len < (size_t)st.st_size) {
+            ssize_t n = read(fd, text + len, st.st_size - len);
+            if (n <= 0) {
+                break;
+            }
+            len += n;
+        }
+    }
+    close(fd);
+    if (!text) {
+        return -1;
+    }
+    text[len] = '\0';
+    
+    int lines = 0;
+    for (char* p = text; (p = (char*)memchr(p, '\n', text + len - p)) != NULL; p++) {
+        lines++;
+    }
+    hashmap_reserve(file_registry, lines + 1);
+    
+    int workers = config_get_int("NM_LOAD_THREADS", reactor_default_workers());
+    if (workers > lines / REGISTRY_LOAD_MIN_LINES + 1) {
+        workers = lines / REGISTRY_LOAD_MIN_LINES + 1;
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > 64) {
+        workers = 64;
+    }
+    
+    RegistryLoadRange ranges[64];
+    pthread_t threads[64];
+    char* at = text;
+    char* limit = text + len;
+    for (int i = 0; i < workers; i++) {
+        // Each range ends at the first newline after its even share
+        char* end = limit;
+        if (i < workers - 1) {
+            char* cut = text + len * (i + 1) / workers;
+            if (cut < at) {
+                cut = at;
+            }
+            char* eol = (char*)memchr(cut, '\n', limit - cut);
+            end = eol ? eol : limit;
+        }
+        ranges[i].start = at;
+        ranges[i].end = end;
+        ranges[i].loaded = 0;
+        at = end < limit ? end + 1 : limit;
+    }
+    
+    int started = 0;
+    for (; started < workers - 1; started++) {
+        if (pthread_create(&threads[started], NULL, load_registry_range, &ranges[started]) != 0) {
+            break;
+        }
+    }
+    for (int i = started; i < workers; i++) {
+        load_registry_range(&ranges[i]);  // This thread takes what is left
+    }
+    
+    int loaded = 0;
+    for (int i = 0; i < workers; i++) {
+        if (i < started) {
+            pthread_join(threads[i], NULL);
+        }
+        loaded += ranges[i].loaded;
+    }
+    free(text);
+    
+    log_message("NAME_SERVER", "INFO", "File registry snapshot: %d files, %d thread%s",
+               loaded, started + 1, started == 0 ? "" : "s");
+    return loaded;
+}
+
+// Snapshot, then any journal left from an interrupted compaction, then the
+// live journal. Replaying records the snapshot already covers is harmless:
+// each record carries the full entry.
 void load_file_registry() {
-    FILE* fp = fopen("data/file_registry.txt", "r");
-    if (!fp) {
+    int loaded = load_registry_snapshot();
+    if (loaded < 0) {
         log_message("NAME_SERVER", "INFO", "No existing file registry found");
+        loaded = 0;
+    }
+    
+    int interrupted = access(REGISTRY_JOURNAL_OLD, F_OK) == 0;
+    int replayed = journal_replay(REGISTRY_JOURNAL_OLD, apply_registry_record, NULL);
+    
+    registry_journal = journal_open(REGISTRY_JOURNAL, config_get_int("NM_JOURNAL_FSYNC", 1),
+                                    apply_registry_record, NULL);
+    
+    // Replay may replace entries, so index the final registry only
+    index_registry();
+    
+    if (!registry_journal) {
+        log_message("NAME_SERVER", "ERROR", "File registry changes will not be persisted");
         return;
     }
+    replayed += journal_records(registry_journal);
     
-    char line[1024];
-    while (fgets(line, sizeof(line), fp)) {
-        FileInfo* info = (FileInfo*)malloc(sizeof(FileInfo));
-        char accessed_by[MAX_USERNAME];
-        
-        sscanf(line, "%[^|]|%[^|]|%[^|]|%ld|%ld|%ld|%[^|]|%d|%d",
-               info->filename, info->owner, info->ss_id,
-               &info->created, &info->modified, &info->accessed,
-               accessed_by, &info->word_count, &info->char_count);
-        
-        strncpy(info->last_accessed_by, accessed_by, MAX_USERNAME - 1);
-        
-        hashmap_put(file_registry, info->filename, info);
-        
-        log_message("NAME_SERVER", "INFO", "Loaded file: %s (owner: %s, SS: %s)",
-                   info->filename, info->owner, info->ss_id);
+    log_message("NAME_SERVER", "INFO", "File registry loaded: %d files (%d from snapshot, %d journal records)",
+               file_registry->size, loaded, replayed);
+    
+    if (interrupted) {
+        compact_file_registry();
+    }
+}
+
+// Compacts the journal once it has grown past NM_COMPACT_MIN_RECORDS,
+// checking every NM_COMPACT_INTERVAL_SEC
+void* registry_compactor(void* arg) {
+    (void)arg;
+    int interval = config_get_int("NM_COMPACT_INTERVAL_SEC", 60);
+    int min_records = config_get_int("NM_COMPACT_MIN_RECORDS", 1000);
+    
+    while (running) {
+        sleep(interval > 0 ? interval : 60);
+        if (registry_journal && (journal_records(registry_journal) >= min_records ||
+                                 registry_journal->failed)) {
+            compact_file_registry();
+        }
+    }
+    
+    return NULL;
+}
+
+// Every registered Storage Server in ss_id order. A returning SS keeps its
+// entry, so the ring only changes on a first registration, not per request.
+static StorageServerInfo** ss_ring = NULL;
+static int ss_ring_count = 0;
+static pthread_mutex_t ss_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// First position not before ss_id. Caller holds ss_ring_lock.
+static int ring_position(const char* ss_id) {
+    int lo = 0;
+    int hi = ss_ring_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(ss_ring[mid]->ss_id, ss_id) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void ring_add(StorageServerInfo* ss) {
+    pthread_mutex_lock(&ss_ring_lock);
+    int pos = ring_position(ss->ss_id);
+    StorageServerInfo** grown =
+        (StorageServerInfo**)realloc(ss_ring, (ss_ring_count + 1) * sizeof(*ss_ring));
+    if (grown) {
+        ss_ring = grown;
+        memmove(&ss_ring[pos + 1], &ss_ring[pos], (ss_ring_count - pos) * sizeof(*ss_ring));
+        ss_ring[pos] = ss;
+        ss_ring_count++;
+    }
+    pthread_mutex_unlock(&ss_ring_lock);
+}
+
+// Replicas of ss: the next NM_REPLICAS (default 1) connected Storage Servers
+// after it in ss_id order, wrapping around
+static int replicas_of(const StorageServerInfo* ss, StorageServerInfo* out[], int max) {
+    int want = config_get_int("NM_REPLICAS", 1);
+    if (want > max) {
+        want = max;
+    }
+    
+    int count = 0;
+    pthread_mutex_lock(&ss_ring_lock);
+    int self = ring_position(ss->ss_id);
+    for (int i = 1; i < ss_ring_count && count < want; i++) {
+        StorageServerInfo* replica = ss_ring[(self + i) % ss_ring_count];
+        if (replica != ss && replica->connected) {
+            out[count++] = replica;
+        }
+    }
+    pthread_mutex_unlock(&ss_ring_lock);
+    return count;
+}
+
+// Whether primary's last heartbeat, sent after since, reported replica as
+// having nothing pending. Heartbeats rewrite in_sync concurrently, so it is
+// only read under sync_lock.
+static int replica_in_sync(StorageServerInfo* primary, const StorageServerInfo* replica, time_t since) {
+    char needle[72];
+    snprintf(needle, sizeof(needle), ",%s,", replica->ss_id);
+    pthread_mutex_lock(&primary->sync_lock);
+    int in_sync = primary->in_sync_at > since && strstr(primary->in_sync, needle) != NULL;
+    pthread_mutex_unlock(&primary->sync_lock);
+    return in_sync;
+}
+
+typedef struct {
+    const char* ss_id;
+    int count;
+} FileCount;
+
+static void count_entry(const char* key, void* value, void* ctx) {
+    FileCount* fc = (FileCount*)ctx;
+    size_t len = strlen(key);
+    if (len > 0 && key[len - 1] != '/' && strcmp(((FileInfo*)value)->ss_id, fc->ss_id) == 0) {
+        fc->count++;
+    }
+}
+
+// SS copies of deleted files still to be dropped. DELETE replies once its
+// registry change is committed and leaves the drop to ss_dropper, which
+// retries with backoff until the SS acknowledges it, so a slow or hung SS
+// never holds up a reactor worker. Until then the file is not taken back
+// from that SS's inventory.
+typedef struct PendingDrop {
+    char filename[MAX_FILENAME];
+    char username[MAX_USERNAME];
+    char ss_id[64];
+    int attempts;
+    time_t next_at;
+    struct PendingDrop* next;
+} PendingDrop;
+
+static PendingDrop* pending_drops = NULL;
+static pthread_mutex_t pending_drops_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_drops_added = PTHREAD_COND_INITIALIZER;
+
+static void queue_ss_drop(const char* filename, const char* username, const char* ss_id) {
+    PendingDrop* drop = (PendingDrop*)calloc(1, sizeof(PendingDrop));
+    if (!drop) {
+        log_message("NAME_SERVER", "WARNING", "DELETE %s: SS %s keeps its copy (out of memory)",
+                    filename, ss_id);
+        return;
+    }
+    snprintf(drop->filename, sizeof(drop->filename), "%s", filename);
+    snprintf(drop->username, sizeof(drop->username), "%s", username);
+    snprintf(drop->ss_id, sizeof(drop->ss_id), "%s", ss_id);
+    
+    pthread_mutex_lock(&pending_drops_lock);
+    drop->next = pending_drops;
+    pending_drops = drop;
+    pthread_cond_signal(&pending_drops_added);
+    pthread_mutex_unlock(&pending_drops_lock);
+}
+
+static int drop_pending(const char* filename, const char* ss_id) {
+    int found = 0;
+    pthread_mutex_lock(&pending_drops_lock);
+    for (PendingDrop* drop = pending_drops; drop && !found; drop = drop->next) {
+        found = strcmp(drop->filename, filename) == 0 && strcmp(drop->ss_id, ss_id) == 0;
+    }
+    pthread_mutex_unlock(&pending_drops_lock);
+    return found;
+}
+
+// Inventory a registering SS sends after its registration line: one
+// registry line per file it holds on this shard. It is authoritative for
+// that SS: missing entries are added, entries that differ are updated, and
+// entries placed on the SS that it no longer has are dropped. Files the
+// registry places elsewhere (moved or promoted meanwhile) are left alone.
+// All of it is one pass under file_registry_lock with a single journal
+// wait, instead of a CREATE per file.
+typedef struct {
+    int files;
+    int added;
+    int updated;
+    int removed;
+} InventoryResult;
+
+typedef struct {
+    const char* ss_id;
+    HashMap* seen;
+    char** stale;
+    int count;
+    int capacity;
+} StaleScan;
+
+static void keep_value(void* value) {
+    (void)value;
+}
+
+static void collect_stale(const char* key, void* value, void* ctx) {
+    StaleScan* scan = (StaleScan*)ctx;
+    size_t len = strlen(key);
+    if (len == 0 || key[len - 1] == '/' || strcmp(((FileInfo*)value)->ss_id, scan->ss_id) != 0 ||
+        hashmap_contains(scan->seen, key)) {
+        return;
     }
     
-    fclose(fp);
+    if (scan->count == scan->capacity) {
+        int capacity = scan->capacity ? scan->capacity * 2 : 64;
+        char** grown = (char**)realloc(scan->stale, capacity * sizeof(char*));
+        if (!grown) {
+            return;
+        }
+        scan->stale = grown;
+        scan->capacity = capacity;
+    }
+    scan->stale[scan->count++] = strdup(key);
 }
 
-void save_file_registry() {
-    FILE* fp = fopen("data/file_registry.txt", "w");
-    if (!fp) {
-        log_message("NAME_SERVER", "ERROR", "Failed to save file registry");
+static void apply_inventory(const char* ss_id, char* lines, InventoryResult* result) {
+    int capacity = 1;
+    for (const char* p = lines; (p = strchr(p, '\n')) != NULL; p++) {
+        capacity++;
+    }
+    
+    FileInfo** entries = (FileInfo**)malloc(capacity * sizeof(FileInfo*));
+    HashMap* seen = hashmap_create_with(keep_value);
+    if (!entries || !seen) {
+        free(entries);
+        hashmap_destroy(seen);
         return;
     }
+    hashmap_reserve(seen, capacity);
     
-    char keys[1000][MAX_FILENAME];
     int count = 0;
-    hashmap_get_keys(file_registry, keys, &count);
+    char* save = NULL;
+    for (char* line = strtok_r(lines, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        FileInfo* info = parse_registry_line(line);
+        if (!info) {
+            continue;
+        }
+        size_t len = strlen(info->filename);
+        if (info->filename[len - 1] == '/' || hashmap_contains(seen, info->filename) ||
+            shard_map_lookup(shard_map, info->filename) != shard_self ||
+            drop_pending(info->filename, ss_id)) {
+            free_file_info(info);
+            continue;
+        }
+        strncpy(info->ss_id, ss_id, sizeof(info->ss_id) - 1);
+        entries[count++] = info;
+        hashmap_put(seen, info->filename, info);
+    }
+    result->files = count;
+    qsort(entries, count, sizeof(FileInfo*), compare_entry_names);  // For the path index
     
-    for (int i = 0; i < count; i++) {
-        FileInfo* info = (FileInfo*)hashmap_get(file_registry, keys[i]);
+    unsigned long long seq = 0;
+    pthread_mutex_lock(&file_registry_lock);
+    hashmap_reserve(file_registry, atomic_load(&file_registry->size) + count);
+    
+    StaleScan scan = {ss_id, seen, NULL, 0, 0};
+    hashmap_foreach(file_registry, collect_stale, &scan);
+    for (int i = 0; i < scan.count; i++) {
+        FileInfo* info = (FileInfo*)hashmap_get(file_registry, scan.stale[i]);
         if (info) {
-            fprintf(fp, "%s|%s|%s|%ld|%ld|%ld|%s|%d|%d\n",
-                   info->filename, info->owner, info->ss_id,
-                   info->created, info->modified, info->accessed,
-                   info->last_accessed_by, info->word_count, info->char_count);
+            path_index_remove(path_index, scan.stale[i], info->owner);
+            hashmap_remove(file_registry, scan.stale[i]);
+            seq = journal_registry_remove(scan.stale[i]);
+            result->removed++;
         }
+        free(scan.stale[i]);
     }
+    free(scan.stale);
     
-    fclose(fp);
-    log_message("NAME_SERVER", "INFO", "File registry saved (%d files)", count);
+    for (int i = 0; i < count; i++) {
+        FileInfo* info = entries[i];
+        FileInfo* existing = (FileInfo*)hashmap_get(file_registry, info->filename);
+        if (!existing) {
+            hashmap_put(file_registry, info->filename, info);
+            path_index_add(path_index, info->filename, info->owner);
+            seq = journal_registry_put(info);
+            entries[i] = NULL;
+            result->added++;
+            continue;
+        }
+        if (strcmp(existing->ss_id, ss_id) != 0) {
+            continue;
+        }
+        
+        char current[1024], reported[1024];
+        format_registry_line(existing, current, sizeof(current));
+        format_registry_line(info, reported, sizeof(reported));
+        if (strcmp(current, reported) != 0) {
+            if (strcmp(existing->owner, info->owner) != 0) {
+                path_index_remove(path_index, existing->filename, existing->owner);
+                path_index_add(path_index, existing->filename, info->owner);
+            }
+            *existing = *info;
+            seq = journal_registry_put(existing);
+            result->updated++;
+        }
+    }
+    pthread_mutex_unlock(&file_registry_lock);
+    registry_commit(seq);
+    
+    for (int i = 0; i < count; i++) {
+        if (entries[i]) {
+            free_file_info(entries[i]);
+        }
+    }
+    free(entries);
+    hashmap_destroy(seen);
 }
 
 void handle_register_ss(Message* msg, Message* response) {
-    StorageServerInfo* ss_info = (StorageServerInfo*)malloc(sizeof(StorageServerInfo));
+    StorageServerInfo reg;
+    memset(&reg, 0, sizeof(reg));
+    
+    // Parse SS registration data ("id|ip|nm_port|client_port", then
+    // "|location_gen" from SS that check cached locations, then "\n" and
+    // the inventory from SS that send one)
+    char* payload = msg->body ? msg->body : msg->data;
+    sscanf(payload, "%63[^|]|%63[^|]|%d|%d|%u",
+           reg.ss_id, reg.ip, &reg.nm_port, &reg.client_port, &reg.location_gen);
+    char* inventory = strchr(payload, '\n');
+    
+    // A returning SS keeps its entry (and file count), with a new epoch so
+    // its primaries know to resync it
+    StorageServerInfo* ss_info = (StorageServerInfo*)hashmap_get(ss_registry, reg.ss_id);
+    unsigned int epoch = (unsigned int)time(NULL);
+    if (ss_info) {
+        if (epoch <= ss_info->epoch) {
+            epoch = ss_info->epoch + 1;
+        }
+        strncpy(ss_info->ip, reg.ip, sizeof(ss_info->ip) - 1);
+        ss_info->nm_port = reg.nm_port;
+        ss_info->client_port = reg.client_port;
+        ss_info->location_gen = reg.location_gen;
+    } else {
+        ss_info = (StorageServerInfo*)malloc(sizeof(StorageServerInfo));
+        *ss_info = reg;
+        pthread_mutex_init(&ss_info->sync_lock, NULL);
+        hashmap_put(ss_registry, ss_info->ss_id, ss_info);
+        ring_add(ss_info);
+    }
     
-    // Parse SS registration data from msg->data
-    sscanf(msg->data, "%[^|]|%[^|]|%d|%d",
-           ss_info->ss_id, ss_info->ip, &ss_info->nm_port, &ss_info->client_port);
+    InventoryResult inv = {0, 0, 0, 0};
+    if (inventory) {
+        apply_inventory(ss_info->ss_id, inventory + 1, &inv);
+    }
+    
+    // Files the registry already places on it (from earlier runs)
+    FileCount fc = {ss_info->ss_id, 0};
+    pthread_mutex_lock(&file_registry_lock);
+    hashmap_foreach(file_registry, count_entry, &fc);
+    ss_info->file_count = fc.count;
+    pthread_mutex_unlock(&file_registry_lock);
     
     ss_info->connected = 1;
     ss_info->last_heartbeat = time(NULL);
-    ss_info->file_count = 0;
-    memset(ss_info->replica_ss_id, 0, sizeof(ss_info->replica_ss_id));
+    ss_info->epoch = epoch;
+    pthread_mutex_lock(&ss_info->sync_lock);
+    ss_info->in_sync[0] = '\0';
+    ss_info->in_sync_at = 0;
+    pthread_mutex_unlock(&ss_info->sync_lock);
     
-    // BONUS: Assign replica SS (simple: next SS in registry)
-    char keys[1000][MAX_FILENAME];
-    int ss_count = 0;
-    hashmap_get_keys(ss_registry, keys, &ss_count);
-    
-    if (ss_count > 0) {
-        // Assign previous SS as replica
-        StorageServerInfo* prev_ss = (StorageServerInfo*)hashmap_get(ss_registry, keys[ss_count - 1]);
-        if (prev_ss) {
-            strncpy(ss_info->replica_ss_id, prev_ss->ss_id, sizeof(ss_info->replica_ss_id) - 1);
-            strncpy(prev_ss->replica_ss_id, ss_info->ss_id, sizeof(prev_ss->replica_ss_id) - 1);
-        }
+    StorageServerInfo* replicas[1];
+    memset(ss_info->replica_ss_id, 0, sizeof(ss_info->replica_ss_id));
+    if (replicas_of(ss_info, replicas, 1) > 0) {
+        strncpy(ss_info->replica_ss_id, replicas[0]->ss_id, sizeof(ss_info->replica_ss_id) - 1);
     }
     
-    hashmap_put(ss_registry, ss_info->ss_id, ss_info);
-    
     log_message("NAME_SERVER", "INFO", "Storage Server registered: %s at %s:%d (replica: %s)",
                ss_info->ss_id, ss_info->ip, ss_info->client_port, 
                ss_info->replica_ss_id[0] ? ss_info->replica_ss_id : "none");
+    if (inventory) {
+        log_message("NAME_SERVER", "INFO",
+                   "Inventory of %s: %d files, %d added, %d updated, %d removed",
+                   ss_info->ss_id, inv.files, inv.added, inv.updated, inv.removed);
+    }
+    
+    response->error_code = SUCCESS;
+    if (inventory) {
+        snprintf(response->data, BUFFER_SIZE,
+                 "SS %s registered successfully (%d files: %d added, %d updated, %d removed)",
+                 ss_info->ss_id, inv.files, inv.added, inv.updated, inv.removed);
+    } else {
+        snprintf(response->data, BUFFER_SIZE, "SS %s registered successfully", ss_info->ss_id);
+    }
+}
+
+// Heartbeat from a Storage Server (a Heartbeat struct, see common.h). Only
+// touches that SS's entry: no registry_lock or file_registry_lock, so
+// liveness never waits behind file operations. The ack lists the SS's
+// replicas as "id|ip|port|epoch;...".
+void handle_heartbeat(Message* msg, Message* response) {
+    response->msg_type = MSG_ACK;
+    
+    Heartbeat hb;
+    if (heartbeat_decode(msg, &hb) < 0) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Malformed heartbeat");
+        return;
+    }
+    
+    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, hb.ss_id);
+    if (!ss) {
+        response->error_code = ERR_STORAGE_SERVER_DOWN;
+        snprintf(response->data, BUFFER_SIZE, "Storage Server %s is not registered", hb.ss_id);
+        return;
+    }
+    
+    // Written off meanwhile, so its files may be on a replica now: it has to
+    // register again, which also moves it to a new location generation
+    if (!__atomic_load_n(&ss->connected, __ATOMIC_RELAXED)) {
+        response->error_code = ERR_STORAGE_SERVER_DOWN;
+        snprintf(response->data, BUFFER_SIZE, "Storage Server %s was marked down", hb.ss_id);
+        log_message("NAME_SERVER", "INFO", "Storage Server %s is back, asking it to register again",
+                    ss->ss_id);
+        return;
+    }
+    
+    time_t now = time(NULL);
+    __atomic_store_n(&ss->last_heartbeat, now, __ATOMIC_RELAXED);
+    ss->heartbeat_ms = hb.interval_ms;
+    ss->heartbeat_seq = hb.seq;
     
+    char in_sync[256] = ",";
+    size_t pos = 1;
+    for (uint32_t i = 0; i < hb.replica_count; i++) {
+        if (hb.replicas[i].backlog != 0) {
+            continue;
+        }
+        int n = snprintf(in_sync + pos, sizeof(in_sync) - pos, "%s,", hb.replicas[i].ss_id);
+        if (n < 0 || pos + n >= sizeof(in_sync)) {
+            break;
+        }
+        pos += n;
+    }
+    pthread_mutex_lock(&ss->sync_lock);
+    snprintf(ss->in_sync, sizeof(ss->in_sync), "%s", in_sync);
+    ss->in_sync_at = now;
+    pthread_mutex_unlock(&ss->sync_lock);
+    
+    ss->bytes_stored = hb.bytes_stored;
+    ss->free_bytes = hb.free_bytes;
+    ss->request_rate = hb.request_rate_milli / 1000.0;
+    ss->p99_us = hb.p99_us;
+    ss->load_at = now;
+    
+    StorageServerInfo* replicas[HEARTBEAT_MAX_REPLICAS];
+    int count = replicas_of(ss, replicas, HEARTBEAT_MAX_REPLICAS);
+    int len = 0;
+    response->data[0] = '\0';
+    for (int i = 0; i < count && len < BUFFER_SIZE; i++) {
+        len += snprintf(response->data + len, BUFFER_SIZE - len, "%s%s|%s|%d|%u",
+                        i > 0 ? ";" : "", replicas[i]->ss_id, replicas[i]->ip,
+                        replicas[i]->client_port, replicas[i]->epoch);
+    }
     response->error_code = SUCCESS;
-    snprintf(response->data, BUFFER_SIZE, "SS %s registered successfully", ss_info->ss_id);
 }
 
 void handle_register_user(Message* msg, Message* response) {
@@ -160,81 +933,244 @@ void handle_register_user(Message* msg, Message* response) {
     snprintf(response->data, BUFFER_SIZE, "User %s registered", user_info->username);
 }
 
+// One page of a listing built into response->data; the last name that fit
+// becomes the cursor for the next page
+typedef struct {
+    Message* response;
+    int pos;
+    int count;
+    int full;
+    char last[MAX_FILENAME];
+} ListingPage;
+
+static void finish_page(ListingPage* page) {
+    // An empty cursor tells the client this was the last page
+    if (page->full) {
+        snprintf(page->response->filename, MAX_FILENAME, "%s", page->last);
+    } else {
+        page->response->filename[0] = '\0';
+    }
+}
+
+static int view_entry(const char* name, int is_folder, void* ctx) {
+    (void)is_folder;
+    ListingPage* page = (ListingPage*)ctx;
+    
+    FileInfo* info = (FileInfo*)hashmap_get(file_registry, name);
+    if (!info) {
+        return 0;
+    }
+    
+    char entry[MAX_FILENAME + MAX_USERNAME + 32];
+    int len = snprintf(entry, sizeof(entry), "%s|%s|%d|%d|",
+                       info->filename, info->owner, info->word_count, info->char_count);
+    if (page->pos + len >= BUFFER_SIZE) {
+        page->full = 1;
+        return 1;
+    }
+    
+    memcpy(page->response->data + page->pos, entry, len + 1);
+    page->pos += len;
+    page->count++;
+    snprintf(page->last, sizeof(page->last), "%s", name);
+    return 0;
+}
+
+// Request data: "flags|prefix|cursor". Without -a only the caller's own
+// files are listed (from the owner index); with -a every file, or only
+// those under prefix (from the path index). Each reply holds as many
+// "name|owner|words|chars|" entries as fit, and the cursor to resume from.
 void handle_view(Message* msg, Message* response) {
-    char keys[1000][MAX_FILENAME];
-    int count = 0;
-    hashmap_get_keys(file_registry, keys, &count);
+    char flags[32] = "", prefix[MAX_FILENAME] = "", after[MAX_FILENAME] = "";
+    
+    const char* p = msg->data;
+    const char* bar = strchr(p, '|');
+    snprintf(flags, sizeof(flags), "%.*s", bar ? (int)(bar - p) : (int)strlen(p), p);
+    if (bar) {
+        p = bar + 1;
+        bar = strchr(p, '|');
+        snprintf(prefix, sizeof(prefix), "%.*s", bar ? (int)(bar - p) : (int)strlen(p), p);
+        if (bar) {
+            snprintf(after, sizeof(after), "%s", bar + 1);
+        }
+    }
     
-    // Build file list
+    int all = strchr(flags, 'a') != NULL;
+    
+    ListingPage page = {response, 0, 0, 0, ""};
     response->data[0] = '\0';
-    int pos = 0;
     
-    for (int i = 0; i < count && pos < BUFFER_SIZE - MAX_FILENAME - 10; i++) {
-        FileInfo* info = (FileInfo*)hashmap_get(file_registry, keys[i]);
-        if (info) {
-            pos += snprintf(response->data + pos, BUFFER_SIZE - pos,
-                          "%s|%s|%d|%d|",
-                          info->filename, info->owner, info->word_count, info->char_count);
-        }
+    if (all) {
+        path_index_walk(path_index, prefix, after, view_entry, &page);
+    } else {
+        path_index_owned(path_index, msg->username, prefix, after, view_entry, &page);
     }
     
+    finish_page(&page);
+    
     response->error_code = SUCCESS;
-    log_message("NAME_SERVER", "INFO", "VIEW command: %d files listed for %s",
-               count, msg->username);
+    log_message("NAME_SERVER", "INFO", "VIEW command: %d files listed for %s%s",
+               page.count, msg->username, page.full ? " (more pages)" : "");
+}
+
+typedef struct {
+    StorageServerInfo* list[100];
+    int count;
+} ServerList;
+
+static void collect_connected(const char* key, void* value, void* ctx) {
+    (void)key;
+    ServerList* servers = (ServerList*)ctx;
+    StorageServerInfo* ss = (StorageServerInfo*)value;
+    if (ss->connected && servers->count < 100) {
+        servers->list[servers->count++] = ss;
+    }
+}
+
+static double share(double a, double b) {
+    return a + b > 0 ? a / (a + b) : 0.5;
+}
+
+static double fill_ratio(const StorageServerInfo* ss) {
+    double total = (double)ss->bytes_stored + (double)ss->free_bytes;
+    return total > 0 ? ss->bytes_stored / total : 0;
+}
+
+// 1 if a is the better home for a new file than b: less full, plus a
+// smaller share of the pair's request rate and p99 latency. Servers that
+// have not reported their load yet are compared by file count.
+static int better_placement(const StorageServerInfo* a, const StorageServerInfo* b) {
+    if (!a->load_at || !b->load_at) {
+        return a->file_count <= b->file_count;
+    }
+    
+    double cost_a = fill_ratio(a) + share(a->request_rate, b->request_rate) +
+                    share((double)a->p99_us, (double)b->p99_us);
+    double cost_b = fill_ratio(b) + share(b->request_rate, a->request_rate) +
+                    share((double)b->p99_us, (double)a->p99_us);
+    if (cost_a != cost_b) {
+        return cost_a < cost_b;
+    }
+    return a->file_count <= b->file_count;
+}
+
+// Placement by power of two choices: the better of two random connected SS.
+// Servers with less than NM_MIN_FREE_MB (default 64) free are only used
+// when nothing else is left. Caller holds file_registry_lock.
+static StorageServerInfo* select_storage_server() {
+    ServerList servers;
+    servers.count = 0;
+    hashmap_foreach(ss_registry, collect_connected, &servers);
+    
+    unsigned long long min_free = (unsigned long long)config_get_int("NM_MIN_FREE_MB", 64) << 20;
+    int roomy = 0;
+    for (int i = 0; i < servers.count; i++) {
+        StorageServerInfo* ss = servers.list[i];
+        if (!ss->load_at || ss->free_bytes >= min_free) {
+            servers.list[i] = servers.list[roomy];
+            servers.list[roomy++] = ss;
+        }
+    }
+    if (roomy > 0) {
+        servers.count = roomy;
+    }
+    
+    if (servers.count == 0) {
+        return NULL;
+    }
+    if (servers.count == 1) {
+        return servers.list[0];
+    }
+    
+    static __thread unsigned int seed = 0;
+    if (seed == 0) {
+        seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)&seed;
+    }
+    int a = rand_r(&seed) % servers.count;
+    int b = rand_r(&seed) % (servers.count - 1);
+    if (b >= a) {
+        b++;
+    }
+    
+    return better_placement(servers.list[a], servers.list[b]) ? servers.list[a] : servers.list[b];
+}
+
+// The SS holding the folder a name is created in, if it was made with
+// CREATEFOLDER: the directory only exists there
+static StorageServerInfo* folder_storage_server(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    if (!slash || slash == filename) {
+        return NULL;
+    }
+    
+    char marker[MAX_FILENAME];
+    snprintf(marker, sizeof(marker), "%.*s/", (int)(slash - filename), filename);
+    
+    FileInfo* folder = (FileInfo*)hashmap_get(file_registry, marker);
+    if (!folder) {
+        return NULL;
+    }
+    
+    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, folder->ss_id);
+    return ss && ss->connected ? ss : NULL;
+}
+
+static FileInfo* new_file_info(const char* filename, const char* owner, const char* ss_id) {
+    FileInfo* info = (FileInfo*)slab_zalloc(file_info_pool);
+    if (!info) {
+        return NULL;
+    }
+    strncpy(info->filename, filename, MAX_FILENAME - 1);
+    strncpy(info->owner, owner, MAX_USERNAME - 1);
+    strncpy(info->ss_id, ss_id, 63);
+    info->created = time(NULL);
+    info->modified = info->created;
+    info->accessed = info->created;
+    strncpy(info->last_accessed_by, owner, MAX_USERNAME - 1);
+    info->word_count = 0;
+    info->char_count = 0;
+    return info;
 }
 
 void handle_create(Message* msg, Message* response) {
+    pthread_mutex_lock(&file_registry_lock);
+    
     if (hashmap_contains(file_registry, msg->filename)) {
+        pthread_mutex_unlock(&file_registry_lock);
         response->error_code = ERR_FILE_EXISTS;
         snprintf(response->data, BUFFER_SIZE, "File %s already exists", msg->filename);
         return;
     }
     
-    // Select a storage server with load balancing (round-robin based on file count)
-    char ss_keys[100][64];
-    int ss_count = 0;
-    hashmap_get_keys(ss_registry, (char(*)[MAX_FILENAME])ss_keys, &ss_count);
+    StorageServerInfo* selected_ss = folder_storage_server(msg->filename);
+    if (!selected_ss) {
+        selected_ss = select_storage_server();
+    }
     
-    if (ss_count == 0) {
+    if (!selected_ss) {
+        pthread_mutex_unlock(&file_registry_lock);
         response->error_code = ERR_NO_STORAGE_SERVERS;
         snprintf(response->data, BUFFER_SIZE, "No storage servers available");
         return;
     }
     
-    // Load balancing: Select SS with minimum file count
-    StorageServerInfo* selected_ss = NULL;
-    int min_files = INT_MAX;
-    
-    for (int i = 0; i < ss_count; i++) {
-        StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, ss_keys[i]);
-        if (ss && ss->connected && ss->file_count < min_files) {
-            min_files = ss->file_count;
-            selected_ss = ss;
-        }
-    }
-    
-    if (!selected_ss) {
-        // Fallback to first available
-        selected_ss = (StorageServerInfo*)hashmap_get(ss_registry, ss_keys[0]);
+    // Create file info
+    FileInfo* info = new_file_info(msg->filename, msg->username, selected_ss->ss_id);
+    if (!info) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_INTERNAL;
+        snprintf(response->data, BUFFER_SIZE, "Out of memory");
+        return;
     }
     
     // Increment file count for load balancing
     selected_ss->file_count++;
     
-    // Create file info
-    FileInfo* info = (FileInfo*)malloc(sizeof(FileInfo));
-    strncpy(info->filename, msg->filename, MAX_FILENAME - 1);
-    strncpy(info->owner, msg->username, MAX_USERNAME - 1);
-    strncpy(info->ss_id, selected_ss->ss_id, 63);
-    info->created = time(NULL);
-    info->modified = info->created;
-    info->accessed = info->created;
-    strncpy(info->last_accessed_by, msg->username, MAX_USERNAME - 1);
-    info->word_count = 0;
-    info->char_count = 0;
-    
     hashmap_put(file_registry, msg->filename, info);
-    save_file_registry();
+    path_index_add(path_index, msg->filename, msg->username);
+    unsigned long long seq = journal_registry_put(info);
+    pthread_mutex_unlock(&file_registry_lock);
+    registry_commit(seq);
     
     // Return SS info for client to connect
     response->error_code = SUCCESS;
@@ -244,22 +1180,54 @@ void handle_create(Message* msg, Message* response) {
                msg->filename, msg->username, selected_ss->ss_id, selected_ss->file_count);
 }
 
+// Locates a file: "ip|port|location_gen|lease_ms". Clients may go straight
+// to that SS for lease_ms (NM_LOCATION_LEASE_MS, default 30000) and send
+// location_gen along; the SS turns the request away if it has become stale.
+// Only the primary is leased: a replica is only known to be current at the
+// moment it is picked, and writes must keep coming here.
 void handle_read(Message* msg, Message* response) {
+    // The entry can be dropped by a DELETE meanwhile, so copy what is needed
+    char ss_id[64];
+    time_t modified;
+    pthread_mutex_lock(&file_registry_lock);
     FileInfo* info = (FileInfo*)hashmap_get(file_registry, msg->filename);
-    
     if (!info) {
+        pthread_mutex_unlock(&file_registry_lock);
         response->error_code = ERR_FILE_NOT_FOUND;
         snprintf(response->data, BUFFER_SIZE, "File %s not found", msg->filename);
         return;
     }
-    
-    // Update cache
-    FileInfo* cached_info = (FileInfo*)malloc(sizeof(FileInfo));
-    memcpy(cached_info, info, sizeof(FileInfo));
-    lru_put(file_cache, msg->filename, cached_info);
+    memcpy(ss_id, info->ss_id, sizeof(ss_id));
+    modified = info->modified;
+    if (msg->command == CMD_WRITE_BULK) {
+        info->modified = time(NULL);  // Replicas are behind until the next heartbeat
+    }
+    pthread_mutex_unlock(&file_registry_lock);
     
     // Get SS info
-    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, info->ss_id);
+    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, ss_id);
+    StorageServerInfo* primary = ss;
+    
+    if (msg->command == CMD_READ_CHUNKED && ss) {
+        // Read-only: spread over the primary and the replicas that reported
+        // nothing pending since the file last changed
+        StorageServerInfo* candidates[5];
+        int count = 0;
+        if (ss->connected) {
+            candidates[count++] = ss;
+        }
+        StorageServerInfo* replicas[4];
+        int replica_count = replicas_of(ss, replicas, 4);
+        for (int i = 0; i < replica_count; i++) {
+            if (replica_in_sync(ss, replicas[i], modified)) {
+                candidates[count++] = replicas[i];
+            }
+        }
+        if (count > 0) {
+            static unsigned int next_reader = 0;
+            ss = candidates[__sync_fetch_and_add(&next_reader, 1) % count];
+        }
+    }
     
     if (!ss || !ss->connected) {
         response->error_code = ERR_STORAGE_SERVER_DOWN;
@@ -267,17 +1235,27 @@ void handle_read(Message* msg, Message* response) {
         return;
     }
     
+    int lease_ms = 0;
+    if (ss == primary && msg->command != CMD_WRITE_BULK && ss->location_gen != 0) {
+        lease_ms = config_get_int("NM_LOCATION_LEASE_MS", 30000);
+    }
+    
     response->error_code = SUCCESS;
-    snprintf(response->data, BUFFER_SIZE, "%s|%d", ss->ip, ss->client_port);
+    snprintf(response->data, BUFFER_SIZE, "%s|%d|%u|%d", ss->ip, ss->client_port,
+             ss->location_gen, lease_ms > 0 ? lease_ms : 0);
     
-    log_message("NAME_SERVER", "INFO", "READ: %s redirecting %s to SS %s",
-               msg->username, msg->filename, info->ss_id);
+    log_message("NAME_SERVER", "INFO", "%s: %s redirecting %s to SS %s",
+               msg->command == CMD_WRITE_BULK ? "WRITE_BULK" : msg->command == CMD_EXEC ? "EXEC" : "READ",
+               msg->username, msg->filename, ss->ss_id);
 }
 
 void handle_delete(Message* msg, Message* response) {
+    pthread_mutex_lock(&file_registry_lock);
+    
     FileInfo* info = (FileInfo*)hashmap_get(file_registry, msg->filename);
     
     if (!info) {
+        pthread_mutex_unlock(&file_registry_lock);
         response->error_code = ERR_FILE_NOT_FOUND;
         snprintf(response->data, BUFFER_SIZE, "File %s not found", msg->filename);
         return;
@@ -285,14 +1263,30 @@ void handle_delete(Message* msg, Message* response) {
     
     // Check ownership
     if (strcmp(info->owner, msg->username) != 0) {
+        pthread_mutex_unlock(&file_registry_lock);
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "Only owner can delete file");
         return;
     }
     
+    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, info->ss_id);
+    size_t name_len = strlen(msg->filename);
+    int is_file = msg->filename[name_len - 1] != '/';
+    if (ss && ss->file_count > 0 && is_file) {
+        ss->file_count--;  // Folder markers are not counted
+    }
+    
+    path_index_remove(path_index, msg->filename, info->owner);
     hashmap_remove(file_registry, msg->filename);
-    lru_remove(file_cache, msg->filename);
-    save_file_registry();
+    unsigned long long seq = journal_registry_remove(msg->filename);
+    pthread_mutex_unlock(&file_registry_lock);
+    registry_commit(seq);
+    
+    // The SS's copy goes too: its inventory would otherwise bring the file
+    // back the next time it registers
+    if (ss && is_file) {
+        queue_ss_drop(msg->filename, msg->username, ss->ss_id);
+    }
     
     response->error_code = SUCCESS;
     snprintf(response->data, BUFFER_SIZE, "File %s deleted", msg->filename);
@@ -300,11 +1294,200 @@ void handle_delete(Message* msg, Message* response) {
     log_message("NAME_SERVER", "INFO", "File deleted: %s by %s", msg->filename, msg->username);
 }
 
+// Registers the folder marker "<folder>/" and replies with the SS that
+// should create the directory
+void handle_create_folder(Message* msg, Message* response) {
+    char folder[MAX_FILENAME], marker[MAX_FILENAME + 1];
+    snprintf(folder, sizeof(folder), "%s", msg->filename);
+    size_t len = strlen(folder);
+    while (len > 0 && folder[len - 1] == '/') {
+        folder[--len] = '\0';
+    }
+    
+    if (len == 0 || len + 1 >= MAX_FILENAME) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Invalid folder name");
+        return;
+    }
+    snprintf(marker, sizeof(marker), "%s/", folder);
+    
+    pthread_mutex_lock(&file_registry_lock);
+    
+    if (hashmap_contains(file_registry, marker) || hashmap_contains(file_registry, folder) ||
+        path_index_is_folder(path_index, folder)) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_FILE_EXISTS;
+        snprintf(response->data, BUFFER_SIZE, "%s already exists", folder);
+        return;
+    }
+    
+    StorageServerInfo* selected_ss = folder_storage_server(folder);
+    if (!selected_ss) {
+        selected_ss = select_storage_server();
+    }
+    
+    if (!selected_ss) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_NO_STORAGE_SERVERS;
+        snprintf(response->data, BUFFER_SIZE, "No storage servers available");
+        return;
+    }
+    
+    FileInfo* info = new_file_info(marker, msg->username, selected_ss->ss_id);
+    if (!info) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_INTERNAL;
+        snprintf(response->data, BUFFER_SIZE, "Out of memory");
+        return;
+    }
+    hashmap_put(file_registry, marker, info);
+    path_index_add(path_index, marker, msg->username);
+    unsigned long long seq = journal_registry_put(info);
+    pthread_mutex_unlock(&file_registry_lock);
+    registry_commit(seq);
+    
+    response->error_code = SUCCESS;
+    snprintf(response->data, BUFFER_SIZE, "%s|%d", selected_ss->ip, selected_ss->client_port);
+    
+    log_message("NAME_SERVER", "INFO", "Folder created: %s (owner: %s, SS: %s)",
+               folder, msg->username, selected_ss->ss_id);
+}
+
+static int folder_entry(const char* name, int is_folder, void* ctx) {
+    ListingPage* page = (ListingPage*)ctx;
+    
+    size_t len = strlen(name) + (is_folder ? 2 : 1);
+    if (page->pos + (int)len >= BUFFER_SIZE) {
+        page->full = 1;
+        return 1;
+    }
+    
+    page->pos += snprintf(page->response->data + page->pos, BUFFER_SIZE - page->pos,
+                          "%s%s%s", page->count > 0 ? "\n" : "", name, is_folder ? "/" : "");
+    page->count++;
+    snprintf(page->last, sizeof(page->last), "%s", name);
+    return 0;
+}
+
+// Lists the folder msg->filename from the path index, resuming after the
+// child named in msg->data. Folders are listed with a trailing '/'.
+void handle_view_folder(Message* msg, Message* response) {
+    ListingPage page = {response, 0, 0, 0, ""};
+    response->data[0] = '\0';
+    
+    if (path_index_list(path_index, msg->filename, msg->data, folder_entry, &page) < 0) {
+        response->error_code = ERR_FILE_NOT_FOUND;
+        snprintf(response->data, BUFFER_SIZE, "Folder %s not found", msg->filename);
+        return;
+    }
+    finish_page(&page);
+    
+    response->error_code = SUCCESS;
+    log_message("NAME_SERVER", "INFO", "VIEWFOLDER: %s by %s (%d items%s)",
+               msg->filename, msg->username, page.count, page.full ? ", more pages" : "");
+}
+
+// Renames msg->filename to msg->data in the registry, or moves it into
+// msg->data if that is a folder. Replies "ip|port|new name" for the client
+// to move the file on its SS (and to move it back here if that fails).
+void handle_move(Message* msg, Message* response) {
+    char dest[MAX_FILENAME], new_name[MAX_FILENAME];
+    if (snprintf(dest, sizeof(dest), "%s", msg->data) >= (int)sizeof(dest)) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Destination name too long");
+        return;
+    }
+    size_t len = strlen(dest);
+    while (len > 0 && dest[len - 1] == '/') {
+        dest[--len] = '\0';
+    }
+    
+    pthread_mutex_lock(&file_registry_lock);
+    
+    FileInfo* info = (FileInfo*)hashmap_get(file_registry, msg->filename);
+    if (!info || msg->filename[strlen(msg->filename) - 1] == '/') {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_FILE_NOT_FOUND;
+        snprintf(response->data, BUFFER_SIZE, "File %s not found", msg->filename);
+        return;
+    }
+    
+    if (strcmp(info->owner, msg->username) != 0) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_UNAUTHORIZED;
+        snprintf(response->data, BUFFER_SIZE, "Only owner can move file");
+        return;
+    }
+    
+    int name_len;
+    if (len > 0 && path_index_is_folder(path_index, dest)) {
+        const char* base = strrchr(msg->filename, '/');
+        name_len = snprintf(new_name, sizeof(new_name), "%s/%s", dest,
+                            base ? base + 1 : msg->filename);
+    } else {
+        name_len = snprintf(new_name, sizeof(new_name), "%s", dest);
+    }
+    
+    // The new name must hash to this shard too; moving an entry between
+    // shards is not supported
+    StorageServerInfo* folder_ss = folder_storage_server(new_name);
+    if (len == 0 || name_len >= (int)sizeof(new_name) || strcmp(new_name, msg->filename) == 0 ||
+        shard_map_lookup(shard_map, new_name) != shard_self ||
+        (folder_ss && strcmp(folder_ss->ss_id, info->ss_id) != 0)) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Cannot move %s to %s", msg->filename, dest);
+        return;
+    }
+    
+    if (hashmap_contains(file_registry, new_name)) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_FILE_EXISTS;
+        snprintf(response->data, BUFFER_SIZE, "File %s already exists", new_name);
+        return;
+    }
+    
+    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, info->ss_id);
+    if (!ss || !ss->connected) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_STORAGE_SERVER_DOWN;
+        snprintf(response->data, BUFFER_SIZE, "Storage server unavailable");
+        return;
+    }
+    
+    FileInfo* moved = (FileInfo*)slab_alloc(file_info_pool);
+    if (!moved) {
+        pthread_mutex_unlock(&file_registry_lock);
+        response->error_code = ERR_INTERNAL;
+        snprintf(response->data, BUFFER_SIZE, "Out of memory");
+        return;
+    }
+    memcpy(moved, info, sizeof(FileInfo));
+    strncpy(moved->filename, new_name, MAX_FILENAME - 1);
+    moved->filename[MAX_FILENAME - 1] = '\0';
+    
+    path_index_remove(path_index, msg->filename, info->owner);
+    hashmap_remove(file_registry, msg->filename);  // Frees info
+    hashmap_put(file_registry, new_name, moved);
+    path_index_add(path_index, new_name, moved->owner);
+    
+    journal_registry_remove(msg->filename);
+    unsigned long long seq = journal_registry_put(moved);
+    pthread_mutex_unlock(&file_registry_lock);
+    registry_commit(seq);
+    
+    response->error_code = SUCCESS;
+    snprintf(response->data, BUFFER_SIZE, "%s|%d|%s", ss->ip, ss->client_port, new_name);
+    
+    log_message("NAME_SERVER", "INFO", "File moved: %s -> %s by %s",
+               msg->filename, new_name, msg->username);
+}
+
 void handle_list(Message* msg, Message* response) {
     (void)msg;  // Mark as intentionally unused
-    char keys[1000][MAX_USERNAME];
+    char keys[1000][MAX_FILENAME];
     int count = 0;
-    hashmap_get_keys(user_registry, (char(*)[MAX_FILENAME])keys, &count);
+    hashmap_get_keys(user_registry, keys, &count);
     
     response->data[0] = '\0';
     int pos = 0;
@@ -317,14 +1500,39 @@ void handle_list(Message* msg, Message* response) {
     log_message("NAME_SERVER", "INFO", "LIST command: %d users listed", count);
 }
 
+static unsigned long long next_lease_id = 0;
+
+// Drops expired leases, and with holder also that user's leases overlapping
+// first..last; registry_lock held
+static void prune_leases(FileLeases* leases, long long now, const char* holder, int first, int last) {
+    int kept = 0;
+    for (int i = 0; i < leases->count; i++) {
+        LeaseEntry* e = &leases->entries[i];
+        int dropped = e->expires_ms <= now ||
+                      (holder && strcmp(e->holder, holder) == 0 && e->first <= last && first <= e->last);
+        if (!dropped) {
+            leases->entries[kept++] = *e;
+        }
+    }
+    leases->count = kept;
+}
+
+// data: "first" or "first-last". Grants a lease on those sentences unless
+// another user holds a live lease overlapping them; the holder's own
+// overlapping leases are replaced (re-acquiring renews). Reply:
+// "ip|port|<lease>".
 void handle_lock_acquire(Message* msg, Message* response) {
-    // Parse sentence index from data
-    int sentence_index;
-    sscanf(msg->data, "%d", &sentence_index);
-    
-    // Create lock key: "filename:sentence_index"
-    char lock_key[MAX_FILENAME + 32];
-    snprintf(lock_key, sizeof(lock_key), "%s:%d", msg->filename, sentence_index);
+    int first, last;
+    int fields = sscanf(msg->data, "%d-%d", &first, &last);
+    if (fields == 1) {
+        last = first;
+    }
+    if (fields < 1 || first < 0 || last < first || last - first >= LEASE_MAX_SENTENCES) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Invalid sentence range (at most %d sentences)",
+                 LEASE_MAX_SENTENCES);
+        return;
+    }
     
     pthread_mutex_lock(&registry_lock);
     
@@ -337,38 +1545,6 @@ void handle_lock_acquire(Message* msg, Message* response) {
         return;
     }
     
-    // Check if sentence is already locked
-    SentenceLock* existing_lock = (SentenceLock*)hashmap_get(sentence_locks, lock_key);
-    if (existing_lock) {
-        // Check if locked by same user (allow re-entrant)
-        if (strcmp(existing_lock->locked_by, msg->username) == 0) {
-            response->error_code = SUCCESS;
-            snprintf(response->data, BUFFER_SIZE, "Lock already held by you");
-            pthread_mutex_unlock(&registry_lock);
-            log_message("NAME_SERVER", "INFO", "Lock re-acquired: %s by %s", lock_key, msg->username);
-            return;
-        }
-        
-        // Locked by another user
-        response->error_code = ERR_FILE_LOCKED;
-        snprintf(response->data, BUFFER_SIZE, "Sentence locked by %s", existing_lock->locked_by);
-        pthread_mutex_unlock(&registry_lock);
-        log_message("NAME_SERVER", "INFO", "Lock denied: %s (held by %s, requested by %s)", 
-                   lock_key, existing_lock->locked_by, msg->username);
-        return;
-    }
-    
-    // Create new lock
-    SentenceLock* lock = (SentenceLock*)malloc(sizeof(SentenceLock));
-    strncpy(lock->filename, msg->filename, MAX_FILENAME - 1);
-    lock->sentence_index = sentence_index;
-    strncpy(lock->locked_by, msg->username, MAX_USERNAME - 1);
-    lock->lock_time = time(NULL);
-    pthread_mutex_init(&lock->mutex, NULL);
-    
-    hashmap_put(sentence_locks, lock_key, lock);
-    
-    // Get SS info to return
     StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, info->ss_id);
     if (!ss) {
         response->error_code = ERR_STORAGE_SERVER_DOWN;
@@ -377,166 +1553,132 @@ void handle_lock_acquire(Message* msg, Message* response) {
         return;
     }
     
-    response->error_code = SUCCESS;
-    snprintf(response->data, BUFFER_SIZE, "%s|%d", ss->ip, ss->client_port);
-    
-    pthread_mutex_unlock(&registry_lock);
-    
-    log_message("NAME_SERVER", "INFO", "Lock acquired: %s by %s", lock_key, msg->username);
-}
-
-void handle_lock_release(Message* msg, Message* response) {
-    // Parse sentence index from data
-    int sentence_index;
-    sscanf(msg->data, "%d", &sentence_index);
-    
-    // Create lock key
-    char lock_key[MAX_FILENAME + 32];
-    snprintf(lock_key, sizeof(lock_key), "%s:%d", msg->filename, sentence_index);
-    
-    pthread_mutex_lock(&registry_lock);
+    FileLeases* leases = (FileLeases*)hashmap_get(write_leases, msg->filename);
+    if (!leases) {
+        leases = (FileLeases*)slab_zalloc(file_leases_pool);
+        if (!leases) {
+            response->error_code = ERR_INTERNAL;
+            snprintf(response->data, BUFFER_SIZE, "Out of memory");
+            pthread_mutex_unlock(&registry_lock);
+            return;
+        }
+        hashmap_put(write_leases, msg->filename, leases);
+    }
     
-    SentenceLock* lock = (SentenceLock*)hashmap_get(sentence_locks, lock_key);
+    long long now = lease_now_ms();
+    prune_leases(leases, now, NULL, 0, 0);
     
-    if (!lock) {
-        response->error_code = ERR_INVALID_PARAMETERS;
-        snprintf(response->data, BUFFER_SIZE, "No lock exists");
-        pthread_mutex_unlock(&registry_lock);
-        return;
+    for (int i = 0; i < leases->count; i++) {
+        LeaseEntry* e = &leases->entries[i];
+        if (e->first <= last && first <= e->last && strcmp(e->holder, msg->username) != 0) {
+            response->error_code = ERR_FILE_LOCKED;
+            snprintf(response->data, BUFFER_SIZE, "Sentence %d locked by %s",
+                     e->first > first ? e->first : first, e->holder);
+            pthread_mutex_unlock(&registry_lock);
+            log_message("NAME_SERVER", "INFO", "Lock denied: %s:%d-%d (held by %s, requested by %s)",
+                        msg->filename, first, last, e->holder, msg->username);
+            return;
+        }
     }
     
-    // Verify lock owner
-    if (strcmp(lock->locked_by, msg->username) != 0) {
-        response->error_code = ERR_UNAUTHORIZED;
-        snprintf(response->data, BUFFER_SIZE, "Lock owned by %s", lock->locked_by);
+    prune_leases(leases, now, msg->username, first, last);
+    if (leases->count == FILE_MAX_LEASES) {
+        response->error_code = ERR_FILE_LOCKED;
+        snprintf(response->data, BUFFER_SIZE, "Too many concurrent writers");
         pthread_mutex_unlock(&registry_lock);
         return;
     }
     
-    // Remove lock (hashmap_remove will free it)
-    pthread_mutex_destroy(&lock->mutex);
-    hashmap_remove(sentence_locks, lock_key);
+    WriteLease lease;
+    lease.id = ++next_lease_id;
+    lease.first = first;
+    lease.last = last;
+    lease.expires_ms = now + config_get_int("NM_LEASE_MS", 60000);
+    lease_sign(&lease, msg->filename, msg->username);
+    
+    LeaseEntry* entry = &leases->entries[leases->count++];
+    entry->id = lease.id;
+    entry->first = first;
+    entry->last = last;
+    entry->expires_ms = lease.expires_ms;
+    strncpy(entry->holder, msg->username, MAX_USERNAME - 1);
+    entry->holder[MAX_USERNAME - 1] = '\0';
+    
+    info->modified = time(NULL);  // A write is coming; replicas are behind
     
     response->error_code = SUCCESS;
-    snprintf(response->data, BUFFER_SIZE, "Lock released");
+    int pos = snprintf(response->data, BUFFER_SIZE, "%s|%d|", ss->ip, ss->client_port);
+    lease_format(&lease, response->data + pos, BUFFER_SIZE - pos);
     
     pthread_mutex_unlock(&registry_lock);
     
-    log_message("NAME_SERVER", "INFO", "Lock released: %s by %s", lock_key, msg->username);
+    log_message("NAME_SERVER", "INFO", "Lock acquired: %s:%d-%d by %s (lease %llu)",
+                msg->filename, first, last, msg->username, lease.id);
 }
 
-void handle_exec(Message* msg, Message* response) {
-    pthread_mutex_lock(&registry_lock);
-    
-    FileInfo* file_info = (FileInfo*)hashmap_get(file_registry, msg->filename);
-    
-    if (!file_info) {
-        response->error_code = ERR_FILE_NOT_FOUND;
-        snprintf(response->data, BUFFER_SIZE, "File not found");
-        pthread_mutex_unlock(&registry_lock);
+// data: "lease|<id>", or a sentence index to release the caller's lease
+// covering it
+void handle_lock_release(Message* msg, Message* response) {
+    unsigned long long id = 0;
+    int sentence = -1;
+    if (sscanf(msg->data, LEASE_PREFIX "%llu", &id) != 1 &&
+        sscanf(msg->data, "%d", &sentence) != 1) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Malformed release request");
         return;
     }
     
-    // Get SS info
-    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, file_info->ss_id);
+    pthread_mutex_lock(&registry_lock);
     
-    if (!ss) {
-        response->error_code = ERR_INTERNAL;
-        snprintf(response->data, BUFFER_SIZE, "Storage server not available");
-        pthread_mutex_unlock(&registry_lock);
-        return;
+    FileLeases* leases = (FileLeases*)hashmap_get(write_leases, msg->filename);
+    if (leases) {
+        prune_leases(leases, lease_now_ms(), NULL, 0, 0);
     }
     
-    pthread_mutex_unlock(&registry_lock);
-    
-    // Connect to SS to fetch file
-    int ss_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (ss_socket < 0) {
-        response->error_code = ERR_INTERNAL;
-        snprintf(response->data, BUFFER_SIZE, "Failed to connect to storage server");
-        return;
+    int found = -1;
+    for (int i = 0; leases && i < leases->count; i++) {
+        LeaseEntry* e = &leases->entries[i];
+        if (id ? e->id == id : (e->first <= sentence && sentence <= e->last &&
+                                strcmp(e->holder, msg->username) == 0)) {
+            found = i;
+            break;
+        }
     }
     
-    struct sockaddr_in ss_addr;
-    memset(&ss_addr, 0, sizeof(ss_addr));
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_addr.s_addr = inet_addr(ss->ip);
-    ss_addr.sin_port = htons(ss->client_port);
-    
-    if (connect(ss_socket, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        response->error_code = ERR_INTERNAL;
-        snprintf(response->data, BUFFER_SIZE, "Failed to connect to storage server");
-        close(ss_socket);
+    if (found < 0) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "No lock exists");
+        pthread_mutex_unlock(&registry_lock);
         return;
     }
     
-    // Request file from SS
-    Message ss_msg;
-    memset(&ss_msg, 0, sizeof(Message));
-    ss_msg.command = CMD_READ;
-    strncpy(ss_msg.username, msg->username, MAX_USERNAME - 1);
-    strncpy(ss_msg.filename, msg->filename, MAX_FILENAME - 1);
-    
-    send_message(ss_socket, &ss_msg);
-    
-    Message ss_response;
-    if (receive_message(ss_socket, &ss_response) < 0 || ss_response.error_code != SUCCESS) {
-        response->error_code = ss_response.error_code;
-        snprintf(response->data, BUFFER_SIZE, "Failed to read file");
-        close(ss_socket);
+    // Verify lock owner
+    LeaseEntry* entry = &leases->entries[found];
+    if (strcmp(entry->holder, msg->username) != 0) {
+        response->error_code = ERR_UNAUTHORIZED;
+        snprintf(response->data, BUFFER_SIZE, "Lock owned by %s", entry->holder);
+        pthread_mutex_unlock(&registry_lock);
         return;
     }
     
-    close(ss_socket);
-    
-    // Save to temp file and execute
-    char temp_path[MAX_PATH];
-    snprintf(temp_path, MAX_PATH, "/tmp/exec_%s_%ld", msg->filename, time(NULL));
-    
-    FILE* fp = fopen(temp_path, "w");
-    if (!fp) {
-        response->error_code = ERR_INTERNAL;
-        snprintf(response->data, BUFFER_SIZE, "Failed to create temp file");
-        return;
+    unsigned long long released = entry->id;
+    leases->entries[found] = leases->entries[--leases->count];
+    if (leases->count == 0) {
+        hashmap_remove(write_leases, msg->filename);
     }
     
-    fputs(ss_response.data, fp);
-    fclose(fp);
-    
-    // Make executable
-    chmod(temp_path, 0755);
-    
-    // Execute and capture output
-    char exec_cmd[MAX_PATH + 50];
-    snprintf(exec_cmd, sizeof(exec_cmd), "%s 2>&1", temp_path);
-    
-    FILE* exec_fp = popen(exec_cmd, "r");
-    if (!exec_fp) {
-        response->error_code = ERR_EXEC_FAILED;
-        snprintf(response->data, BUFFER_SIZE, "Execution failed");
-        unlink(temp_path);
-        return;
+    FileInfo* info = (FileInfo*)hashmap_get(file_registry, msg->filename);
+    if (info) {
+        info->modified = time(NULL);
     }
     
-    // Read output
-    char output[BUFFER_SIZE];
-    int bytes = fread(output, 1, BUFFER_SIZE - 1, exec_fp);
-    output[bytes] = '\0';
-    
-    int exec_status = pclose(exec_fp);
-    unlink(temp_path);
+    response->error_code = SUCCESS;
+    snprintf(response->data, BUFFER_SIZE, "Lock released");
     
-    if (exec_status != 0) {
-        response->error_code = ERR_EXEC_FAILED;
-        snprintf(response->data, BUFFER_SIZE, "Execution failed (exit code %d):\n%s", 
-                 exec_status, output);
-    } else {
-        response->error_code = SUCCESS;
-        strncpy(response->data, output, BUFFER_SIZE - 1);
-    }
+    pthread_mutex_unlock(&registry_lock);
     
-    log_message("NAME_SERVER", "INFO", "EXEC: %s by %s (exit code %d)", 
-                msg->filename, msg->username, exec_status);
+    log_message("NAME_SERVER", "INFO", "Lock released: %s (lease %llu) by %s",
+                msg->filename, released, msg->username);
 }
 
 // BONUS: Access request queue
@@ -582,7 +1724,7 @@ void handle_view_requests(Message* msg, Message* response) {
         AccessRequest* req = (AccessRequest*)hashmap_get(access_requests, keys[i]);
         if (req && req->pending && strcmp(req->owner, msg->username) == 0) {
             if (found > 0) strcat(result, "\n");
-            char line[256];
+            char line[MAX_USERNAME + MAX_FILENAME + 32];
             snprintf(line, sizeof(line), "%s requested access to %s", 
                      req->requester, req->filename);
             strcat(result, line);
@@ -627,12 +1769,7 @@ void handle_approve_request(Message* msg, Message* response) {
     }
     
     // Grant read access by forwarding to storage server
-    FileInfo* cached_info = (FileInfo*)lru_get(file_cache, filename);
-    if (!cached_info) {
-        cached_info = file;
-    }
-    
-    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, cached_info->ss_id);
+    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, file->ss_id);
     if (!ss || !ss->connected) {
         response->error_code = ERR_STORAGE_SERVER_DOWN;
         strcpy(response->data, "Storage server unavailable");
@@ -710,116 +1847,601 @@ void handle_deny_request(Message* msg, Message* response) {
                 filename, requester, msg->username);
 }
 
-void* handle_client(void* arg) {
-    int client_socket = *(int*)arg;
-    free(arg);
+// Registry name a command is routed by, or NULL if any shard serves it
+static const char* shard_key(Message* msg, char* marker, size_t len) {
+    switch (msg->command) {
+        case CMD_CREATEFOLDER: {
+            // The folder marker "<folder>/" is the registry entry
+            size_t n = strlen(msg->filename);
+            while (n > 0 && msg->filename[n - 1] == '/') {
+                n--;
+            }
+            snprintf(marker, len, "%.*s/", (int)n, msg->filename);
+            return marker;
+        }
+        case CMD_CREATE:
+        case CMD_READ:
+        case CMD_READ_CHUNKED:
+        case CMD_WRITE_BULK:
+        case CMD_DELETE:
+        case CMD_EXEC:
+        case CMD_LOCK_ACQUIRE:
+        case CMD_LOCK_RELEASE:
+        case CMD_MOVE:
+        case CMD_REQUESTACCESS:
+            return msg->filename;
+        default:
+            return NULL;
+    }
+}
+
+// Rejects requests for names another shard owns, pointing at that shard
+static int check_shard(Message* msg, Message* response) {
+    if (shard_map->count == 1 || msg->msg_type != MSG_COMMAND) {
+        return 0;
+    }
     
-    Message msg, response;
+    char marker[MAX_FILENAME + 1];
+    const char* key = shard_key(msg, marker, sizeof(marker));
+    if (!key) {
+        return 0;
+    }
     
-    while (running) {
-        memset(&msg, 0, sizeof(Message));
-        memset(&response, 0, sizeof(Message));
-        
-        if (receive_message(client_socket, &msg) < 0) {
+    int owner = shard_map_lookup(shard_map, key);
+    if (owner == shard_self) {
+        return 0;
+    }
+    
+    response->error_code = ERR_WRONG_SHARD;
+    snprintf(response->data, BUFFER_SIZE, "%s|%d",
+             shard_map->shards[owner].host, shard_map->shards[owner].port);
+    return -1;
+}
+
+void handle_shard_map(Message* msg, Message* response) {
+    (void)msg;
+    response->error_code = SUCCESS;
+    shard_map_format(shard_map, response->data, BUFFER_SIZE);
+}
+
+typedef struct {
+    int family;  // Which gauge is being listed
+    int up;
+    int down;
+    MetricsText* text;
+} SSMetrics;
+
+static void render_ss_entry(const char* key, void* value, void* ctx) {
+    (void)key;
+    SSMetrics* m = (SSMetrics*)ctx;
+    StorageServerInfo* ss = (StorageServerInfo*)value;
+    switch (m->family) {
+        case 0:
+            metrics_text_printf(m->text, "nm_ss_request_rate{ss=\"%s\"} %.2f\n", ss->ss_id,
+                                ss->request_rate);
             break;
+        case 1:
+            metrics_text_printf(m->text, "nm_ss_p99_seconds{ss=\"%s\"} %.6f\n", ss->ss_id,
+                                ss->p99_us / 1e6);
+            break;
+        default:
+            metrics_text_printf(m->text, "nm_ss_bytes_stored{ss=\"%s\"} %llu\n", ss->ss_id,
+                                ss->bytes_stored);
+            if (ss->connected) {
+                m->up++;
+            } else {
+                m->down++;
+            }
+    }
+}
+
+// Prometheus report: request series plus registry sizes and the load each
+// Storage Server last reported
+static void render_nm_metrics(MetricsText* text) {
+    metrics_render(text, "nm");
+    
+    metrics_text_printf(text,
+                        "# TYPE nm_files gauge\nnm_files %d\n"
+                        "# TYPE nm_users gauge\nnm_users %d\n"
+                        "# TYPE nm_write_leased_files gauge\nnm_write_leased_files %d\n",
+                        atomic_load(&file_registry->size), atomic_load(&user_registry->size),
+                        atomic_load(&write_leases->size));
+    
+    static const char* families[] = {
+        "# HELP nm_ss_request_rate Requests per second reported by each SS.\n"
+        "# TYPE nm_ss_request_rate gauge\n",
+        "# HELP nm_ss_p99_seconds p99 request latency reported by each SS.\n"
+        "# TYPE nm_ss_p99_seconds gauge\n",
+        "# TYPE nm_ss_bytes_stored gauge\n",
+    };
+    SSMetrics m = {0, 0, 0, text};
+    for (m.family = 0; m.family < 3; m.family++) {
+        metrics_text_printf(text, "%s", families[m.family]);
+        hashmap_foreach(ss_registry, render_ss_entry, &m);
+    }
+    metrics_text_printf(text,
+                        "# TYPE nm_storage_servers gauge\n"
+                        "nm_storage_servers{state=\"up\"} %d\nnm_storage_servers{state=\"down\"} %d\n",
+                        m.up, m.down);
+    
+    slab_render(text, "nm");
+}
+
+void handle_metrics(Message* msg, Message* response) {
+    MetricsText text = {NULL, 0, 0};
+    render_nm_metrics(&text);
+    
+    response->error_code = SUCCESS;
+    response->body = text.data;
+    response->body_len = text.len < message_max_payload(msg) ? text.len : message_max_payload(msg);
+}
+
+// Routes one request to its handler
+static void route_request(Message* msg, Message* response) {
+    if (check_shard(msg, response) < 0) {
+        return;
+    }
+    
+    switch (msg->msg_type) {
+        case MSG_REGISTER_SS:
+            handle_register_ss(msg, response);
+            break;
+        case MSG_REGISTER_USER:
+            handle_register_user(msg, response);
+            break;
+        case MSG_HEARTBEAT:
+            handle_heartbeat(msg, response);
+            break;
+        case MSG_COMMAND:
+            switch (msg->command) {
+                case CMD_VIEW:
+                    handle_view(msg, response);
+                    break;
+                case CMD_CREATE:
+                    handle_create(msg, response);
+                    break;
+                case CMD_READ:
+                case CMD_READ_CHUNKED:
+                case CMD_WRITE_BULK:
+                case CMD_EXEC:
+                    // Chunked transfers and EXEC (run by the SS holding
+                    // the file) are located exactly like a read
+                    handle_read(msg, response);
+                    break;
+                case CMD_DELETE:
+                    handle_delete(msg, response);
+                    break;
+                case CMD_LIST:
+                    handle_list(msg, response);
+                    break;
+                case CMD_CREATEFOLDER:
+                    handle_create_folder(msg, response);
+                    break;
+                case CMD_VIEWFOLDER:
+                    handle_view_folder(msg, response);
+                    break;
+                case CMD_MOVE:
+                    handle_move(msg, response);
+                    break;
+                case CMD_SHARD_MAP:
+                    handle_shard_map(msg, response);
+                    break;
+                case CMD_METRICS:
+                    handle_metrics(msg, response);
+                    break;
+                case CMD_LOCK_ACQUIRE:
+                    handle_lock_acquire(msg, response);
+                    break;
+                case CMD_LOCK_RELEASE:
+                    handle_lock_release(msg, response);
+                    break;
+                case CMD_REQUESTACCESS:
+                    handle_request_access(msg, response);
+                    break;
+                case CMD_VIEWREQUESTS:
+                    handle_view_requests(msg, response);
+                    break;
+                case CMD_APPROVEREQUEST:
+                    handle_approve_request(msg, response);
+                    break;
+                case CMD_DENYREQUEST:
+                    handle_deny_request(msg, response);
+                    break;
+                default:
+                    response->error_code = ERR_INVALID_COMMAND;
+                    snprintf(response->data, BUFFER_SIZE, "Command not implemented");
+            }
+            break;
+        default:
+            response->error_code = ERR_INVALID_COMMAND;
+    }
+}
+
+// Called from the reactor's worker threads; times each request into the
+// metrics series for its command
+void dispatch_request(Message* msg, Message* response) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    route_request(msg, response);
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long usec = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+    int series = msg->command;
+    if (msg->msg_type == MSG_HEARTBEAT) {
+        series = METRIC_HEARTBEAT;
+    } else if (msg->msg_type == MSG_REGISTER_SS || msg->msg_type == MSG_REGISTER_USER) {
+        series = METRIC_REGISTER;
+    }
+    metrics_record(series, usec, response->error_code != SUCCESS);
+}
+
+typedef struct {
+    const char* from;
+    StorageServerInfo* to;
+    int moved;
+    unsigned long long seq;
+} Promotion;
+
+static void promote_entry(const char* key, void* value, void* ctx) {
+    (void)key;
+    Promotion* promotion = (Promotion*)ctx;
+    FileInfo* info = (FileInfo*)value;
+    if (strcmp(info->ss_id, promotion->from) == 0) {
+        strncpy(info->ss_id, promotion->to->ss_id, sizeof(info->ss_id) - 1);
+        promotion->seq = journal_registry_put(info);
+        promotion->moved++;
+    }
+}
+
+// Hands every file of a failed SS to one of its replicas, preferring one
+// that was fully caught up at its last heartbeat
+static void promote_replica(StorageServerInfo* down) {
+    StorageServerInfo* replicas[4];
+    int count = replicas_of(down, replicas, 4);
+    if (count == 0) {
+        log_message("NAME_SERVER", "ERROR", "No replica to fail over to: files on %s are unavailable",
+                    down->ss_id);
+        return;
+    }
+    
+    StorageServerInfo* target = NULL;
+    for (int i = 0; i < count && !target; i++) {
+        if (replica_in_sync(down, replicas[i], 0)) {
+            target = replicas[i];
         }
-        
-        response.msg_type = MSG_RESPONSE;
-        
-        switch (msg.msg_type) {
-            case MSG_REGISTER_SS:
-                handle_register_ss(&msg, &response);
-                break;
-            case MSG_REGISTER_USER:
-                handle_register_user(&msg, &response);
-                break;
-            case MSG_COMMAND:
-                switch (msg.command) {
-                    case CMD_VIEW:
-                        handle_view(&msg, &response);
-                        break;
-                    case CMD_CREATE:
-                        handle_create(&msg, &response);
-                        break;
-                    case CMD_READ:
-                        handle_read(&msg, &response);
-                        break;
-                    case CMD_DELETE:
-                        handle_delete(&msg, &response);
-                        break;
-                    case CMD_LIST:
-                        handle_list(&msg, &response);
-                        break;
-                    case CMD_EXEC:
-                        handle_exec(&msg, &response);
-                        break;
-                    case CMD_LOCK_ACQUIRE:
-                        handle_lock_acquire(&msg, &response);
-                        break;
-                    case CMD_LOCK_RELEASE:
-                        handle_lock_release(&msg, &response);
-                        break;
-                    case CMD_REQUESTACCESS:
-                        handle_request_access(&msg, &response);
-                        break;
-                    case CMD_VIEWREQUESTS:
-                        handle_view_requests(&msg, &response);
-                        break;
-                    case CMD_APPROVEREQUEST:
-                        handle_approve_request(&msg, &response);
-                        break;
-                    case CMD_DENYREQUEST:
-                        handle_deny_request(&msg, &response);
-                        break;
-                    default:
-                        response.error_code = ERR_INVALID_COMMAND;
-                        snprintf(response.data, BUFFER_SIZE, "Command not implemented");
-                }
-                break;
-            default:
-                response.error_code = ERR_INVALID_COMMAND;
-        }
-        
-        send_message(client_socket, &response);
+    }
+    if (!target) {
+        target = replicas[0];
+        log_message("NAME_SERVER", "WARNING", "Replica %s of %s was not in sync; recent changes may be lost",
+                    target->ss_id, down->ss_id);
     }
     
-    close(client_socket);
-    return NULL;
+    Promotion promotion = {down->ss_id, target, 0, 0};
+    pthread_mutex_lock(&file_registry_lock);
+    hashmap_foreach(file_registry, promote_entry, &promotion);
+    target->file_count += promotion.moved;
+    down->file_count = 0;
+    pthread_mutex_unlock(&file_registry_lock);
+    registry_commit(promotion.seq);
+    
+    log_message("NAME_SERVER", "INFO", "Failed over %d files from %s to replica %s",
+                promotion.moved, down->ss_id, target->ss_id);
 }
 
 // BONUS: Heartbeat and failure detection thread
+//
+// Every NM_HEARTBEAT_CHECK_MS (default 1000) an SS that has missed
+// NM_HEARTBEAT_MISSES (default 3) of its announced heartbeat intervals is
+// marked down. Before its first heartbeat the window is
+// NM_HEARTBEAT_TIMEOUT_MS (default 30000).
 void* heartbeat_monitor(void* arg) {
     (void)arg;
+    int check_ms = config_get_int("NM_HEARTBEAT_CHECK_MS", 1000);
+    int misses = config_get_int("NM_HEARTBEAT_MISSES", 3);
+    int default_timeout_ms = config_get_int("NM_HEARTBEAT_TIMEOUT_MS", 30000);
+    if (check_ms <= 0) {
+        check_ms = 1000;
+    }
+    if (misses <= 0) {
+        misses = 3;
+    }
     
     while (running) {
-        sleep(10);  // Check every 10 seconds
+        usleep(check_ms * 1000);
         
-        char keys[1000][MAX_FILENAME];
-        int ss_count = 0;
-        hashmap_get_keys(ss_registry, keys, &ss_count);
+        ServerList servers;
+        servers.count = 0;
+        hashmap_foreach(ss_registry, collect_connected, &servers);
+        
+        time_t now = time(NULL);
         
+        for (int i = 0; i < servers.count; i++) {
+            StorageServerInfo* ss = servers.list[i];
+            double timeout_ms = ss->heartbeat_ms ? (double)misses * ss->heartbeat_ms : default_timeout_ms;
+            time_t last = __atomic_load_n(&ss->last_heartbeat, __ATOMIC_RELAXED);
+            if (difftime(now, last) * 1000 > timeout_ms) {
+                ss->connected = 0;
+                log_message("NAME_SERVER", "WARNING", "Storage Server %s marked as down (no heartbeat for %.0fs)",
+                            ss->ss_id, difftime(now, last));
+                
+                // Its replicas take over its files
+                promote_replica(ss);
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+// Sends one command to a Storage Server and waits for its reply
+static int ss_request(const StorageServerInfo* ss, Message* msg, Message* reply) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct timeval timeout = {30, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ss->ip);
+    addr.sin_port = htons(ss->client_port);
+    
+    int rc = -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && send_message(fd, msg) == 0 &&
+        receive_message(fd, reply) == 0) {
+        rc = 0;
+    }
+    close(fd);
+    return rc;
+}
+
+static int send_migrate(const StorageServerInfo* from, const StorageServerInfo* to,
+                        const char* filename, const char* mode) {
+    Message msg, reply;
+    memset(&msg, 0, sizeof(Message));
+    memset(&reply, 0, sizeof(Message));
+    msg.msg_type = MSG_COMMAND;
+    msg.command = CMD_MIGRATE;
+    snprintf(msg.username, MAX_USERNAME, "NM");
+    snprintf(msg.filename, MAX_FILENAME, "%s", filename);
+    int len = snprintf(msg.data + PEER_AUTH_LEN, BUFFER_SIZE - PEER_AUTH_LEN, "%s|%s|%d", mode,
+                       to->ip, to->client_port);
+    peer_sign(CMD_MIGRATE, msg.filename, msg.data + PEER_AUTH_LEN, len, msg.data);
+    
+    int ok = ss_request(from, &msg, &reply) == 0 && reply.error_code == SUCCESS;
+    message_free_body(&reply);
+    return ok ? 0 : -1;
+}
+
+// Moves one file: copy to the new SS, point the registry at it, then have
+// the old SS ship any change made meanwhile and drop its copy
+static int migrate_file(const char* filename, StorageServerInfo* from, StorageServerInfo* to) {
+    if (send_migrate(from, to, filename, "copy") < 0) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&file_registry_lock);
+    FileInfo* info = (FileInfo*)hashmap_get(file_registry, filename);
+    if (!info || strcmp(info->ss_id, from->ss_id) != 0) {
+        pthread_mutex_unlock(&file_registry_lock);
+        return -1;  // Deleted or moved meanwhile; the copy is just garbage
+    }
+    strncpy(info->ss_id, to->ss_id, sizeof(info->ss_id) - 1);
+    if (from->file_count > 0) {
+        from->file_count--;
+    }
+    to->file_count++;
+    unsigned long long seq = journal_registry_put(info);
+    pthread_mutex_unlock(&file_registry_lock);
+    registry_commit(seq);
+    
+    if (send_migrate(from, to, filename, "drop") < 0) {
+        log_message("NAME_SERVER", "WARNING", "Rebalance: %s moved to %s but %s kept its copy",
+                    filename, to->ss_id, from->ss_id);
+    }
+    return 0;
+}
+
+// Asks the SS to drop a deleted file's copy; 1 once it is gone (or the
+// name was created on that SS again meanwhile, so the copy is the new file)
+static int send_drop(const PendingDrop* drop) {
+    pthread_mutex_lock(&file_registry_lock);
+    FileInfo* info = (FileInfo*)hashmap_get(file_registry, drop->filename);
+    int recreated = info && strcmp(info->ss_id, drop->ss_id) == 0;
+    pthread_mutex_unlock(&file_registry_lock);
+    if (recreated) {
+        return 1;
+    }
+    
+    StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, drop->ss_id);
+    if (!ss) {
+        return 1;
+    }
+    if (!__atomic_load_n(&ss->connected, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    
+    Message msg, reply;
+    memset(&msg, 0, sizeof(Message));
+    memset(&reply, 0, sizeof(Message));
+    msg.msg_type = MSG_COMMAND;
+    msg.command = CMD_DELETE;
+    snprintf(msg.username, MAX_USERNAME, "%s", drop->username);
+    snprintf(msg.filename, MAX_FILENAME, "%s", drop->filename);
+    
+    int ok = ss_request(ss, &msg, &reply) == 0 &&
+             (reply.error_code == SUCCESS || reply.error_code == ERR_FILE_NOT_FOUND);
+    message_free_body(&reply);
+    return ok;
+}
+
+// Works through pending_drops one at a time, retrying each after 1, 2, 4...
+// up to NM_DROP_RETRY_MAX_SEC (default 60) seconds until its SS acknowledges
+void* ss_dropper(void* arg) {
+    (void)arg;
+    int max_backoff = config_get_int("NM_DROP_RETRY_MAX_SEC", 60);
+    if (max_backoff <= 0) {
+        max_backoff = 60;
+    }
+    
+    pthread_mutex_lock(&pending_drops_lock);
+    while (running) {
         time_t now = time(NULL);
+        PendingDrop* due = NULL;
+        time_t wake = 0;
+        for (PendingDrop* drop = pending_drops; drop && !due; drop = drop->next) {
+            if (drop->next_at <= now) {
+                due = drop;
+            } else if (!wake || drop->next_at < wake) {
+                wake = drop->next_at;
+            }
+        }
+        if (!due) {
+            if (wake) {
+                struct timespec until = {wake, 0};
+                pthread_cond_timedwait(&pending_drops_added, &pending_drops_lock, &until);
+            } else {
+                pthread_cond_wait(&pending_drops_added, &pending_drops_lock);
+            }
+            continue;
+        }
+        
+        // Only this thread unlinks entries, so due stays valid unlocked
+        pthread_mutex_unlock(&pending_drops_lock);
+        int done = send_drop(due);
+        pthread_mutex_lock(&pending_drops_lock);
         
-        for (int i = 0; i < ss_count; i++) {
-            StorageServerInfo* ss = (StorageServerInfo*)hashmap_get(ss_registry, keys[i]);
-            if (ss && ss->connected) {
-                // Check if last heartbeat was more than 30 seconds ago
-                if (difftime(now, ss->last_heartbeat) > 30) {
-                    ss->connected = 0;
-                    log_message("NAME_SERVER", "WARNING", "Storage Server %s marked as down", ss->ss_id);
-                    
-                    // If it has a replica, mark replica as primary for its files
-                    if (ss->replica_ss_id[0]) {
-                        log_message("NAME_SERVER", "INFO", "Failing over to replica: %s", ss->replica_ss_id);
-                    }
-                }
+        if (done) {
+            PendingDrop** link = &pending_drops;
+            while (*link != due) {
+                link = &(*link)->next;
             }
+            *link = due->next;
+            free(due);
+            continue;
+        }
+        
+        int backoff = due->attempts < 6 ? 1 << due->attempts : max_backoff;
+        due->attempts++;
+        due->next_at = time(NULL) + (backoff < max_backoff ? backoff : max_backoff);
+        if (due->attempts == 1) {
+            log_message("NAME_SERVER", "WARNING", "DELETE %s: SS %s has not dropped its copy yet, retrying",
+                        due->filename, due->ss_id);
         }
     }
+    pthread_mutex_unlock(&pending_drops_lock);
     
     return NULL;
 }
 
+// Load on a 0..3 scale relative to the busiest server: fill ratio plus
+// request rate and p99 latency as fractions of the cluster maximum
+static double load_score(const StorageServerInfo* ss, double max_rate, double max_p99) {
+    return fill_ratio(ss) + (max_rate > 0 ? ss->request_rate / max_rate : 0) +
+           (max_p99 > 0 ? ss->p99_us / max_p99 : 0);
+}
+
+typedef struct {
+    const char* ss_id;
+    char (*names)[MAX_FILENAME];
+    int count;
+    int max;
+} MigrationBatch;
+
+static void pick_for_migration(const char* key, void* value, void* ctx) {
+    MigrationBatch* batch = (MigrationBatch*)ctx;
+    size_t len = strlen(key);
+    if (batch->count < batch->max && len > 0 && key[len - 1] != '/' &&
+        strcmp(((FileInfo*)value)->ss_id, batch->ss_id) == 0) {
+        snprintf(batch->names[batch->count++], MAX_FILENAME, "%s", key);
+    }
+}
+
+// Optional rebalancer (NM_REBALANCE_SEC > 0): every interval, if the most
+// loaded SS scores more than NM_REBALANCE_SKEW percent (default 50) above
+// the least loaded one, move up to NM_REBALANCE_BATCH (default 8) of its
+// files there
+void* rebalancer(void* arg) {
+    int interval = *(int*)arg;
+    int skew = config_get_int("NM_REBALANCE_SKEW", 50);
+    int batch_max = config_get_int("NM_REBALANCE_BATCH", 8);
+    if (batch_max <= 0) {
+        batch_max = 8;
+    }
+    char (*names)[MAX_FILENAME] = malloc(batch_max * sizeof(*names));
+    
+    while (running && names) {
+        sleep(interval);
+        
+        ServerList servers;
+        servers.count = 0;
+        hashmap_foreach(ss_registry, collect_connected, &servers);
+        
+        double max_rate = 0, max_p99 = 0;
+        int reported = 0;
+        for (int i = 0; i < servers.count; i++) {
+            StorageServerInfo* ss = servers.list[i];
+            if (!ss->load_at) {
+                continue;
+            }
+            reported++;
+            if (ss->request_rate > max_rate) {
+                max_rate = ss->request_rate;
+            }
+            if (ss->p99_us > max_p99) {
+                max_p99 = ss->p99_us;
+            }
+        }
+        if (reported < 2) {
+            continue;
+        }
+        
+        StorageServerInfo *hot = NULL, *cold = NULL;
+        double hot_score = 0, cold_score = 0;
+        for (int i = 0; i < servers.count; i++) {
+            StorageServerInfo* ss = servers.list[i];
+            if (!ss->load_at) {
+                continue;
+            }
+            double score = load_score(ss, max_rate, max_p99);
+            if (!hot || score > hot_score) {
+                hot = ss;
+                hot_score = score;
+            }
+            if (!cold || score < cold_score) {
+                cold = ss;
+                cold_score = score;
+            }
+        }
+        if (hot == cold || (hot_score - cold_score) * 100 <= skew) {
+            continue;
+        }
+        
+        MigrationBatch batch = {hot->ss_id, names, 0, batch_max};
+        pthread_mutex_lock(&file_registry_lock);
+        hashmap_foreach(file_registry, pick_for_migration, &batch);
+        pthread_mutex_unlock(&file_registry_lock);
+        
+        int moved = 0;
+        for (int i = 0; i < batch.count && hot->connected && cold->connected; i++) {
+            if (migrate_file(names[i], hot, cold) == 0) {
+                moved++;
+            }
+        }
+        if (batch.count > 0) {
+            log_message("NAME_SERVER", "INFO", "Rebalance: moved %d/%d files from %s (%.2f) to %s (%.2f)",
+                        moved, batch.count, hot->ss_id, hot_score, cold->ss_id, cold_score);
+        }
+    }
+    
+    free(names);
+    return NULL;
+}
 
 int main() {
     signal(SIGINT, signal_handler);
@@ -833,6 +2455,22 @@ int main() {
     pthread_create(&heartbeat_thread, NULL, heartbeat_monitor, NULL);
     pthread_detach(heartbeat_thread);
     
+    pthread_t compactor_thread;
+    pthread_create(&compactor_thread, NULL, registry_compactor, NULL);
+    pthread_detach(compactor_thread);
+    
+    pthread_t dropper_thread;
+    pthread_create(&dropper_thread, NULL, ss_dropper, NULL);
+    pthread_detach(dropper_thread);
+    
+    static int rebalance_sec;
+    rebalance_sec = config_get_int("NM_REBALANCE_SEC", 0);
+    if (rebalance_sec > 0) {
+        pthread_t rebalancer_thread;
+        pthread_create(&rebalancer_thread, NULL, rebalancer, &rebalance_sec);
+        pthread_detach(rebalancer_thread);
+    }
+    
     // Create socket
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
@@ -847,7 +2485,8 @@ int main() {
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(NM_PORT);
+    int port = shard_map->shards[shard_self].port;
+    server_addr.sin_port = htons(port);
     
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         log_message("NAME_SERVER", "ERROR", "Failed to bind: %s", strerror(errno));
@@ -855,36 +2494,34 @@ int main() {
         return 1;
     }
     
-    if (listen(server_socket, MAX_CLIENTS) < 0) {
+    int backlog = config_get_int("NM_LISTEN_BACKLOG", MAX_CLIENTS);
+    if (listen(server_socket, backlog) < 0) {
         log_message("NAME_SERVER", "ERROR", "Failed to listen: %s", strerror(errno));
         close(server_socket);
         return 1;
     }
     
-    log_message("NAME_SERVER", "INFO", "Name Server listening on port %d", NM_PORT);
-    printf("Name Server started on port %d\n", NM_PORT);
+    int workers = config_get_int("NM_WORKERS", reactor_default_workers());
     
-    while (running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int* client_socket = malloc(sizeof(int));
-        *client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        
-        if (*client_socket < 0) {
-            if (running) {
-                log_message("NAME_SERVER", "ERROR", "Accept failed: %s", strerror(errno));
-            }
-            free(client_socket);
-            continue;
+    int metrics_port = config_get_int("NM_METRICS_PORT", 0);
+    if (metrics_port > 0) {
+        if (metrics_http_start(metrics_port, render_nm_metrics) < 0) {
+            log_message("NAME_SERVER", "WARNING", "Metrics endpoint: cannot listen on port %d",
+                       metrics_port);
+        } else {
+            log_message("NAME_SERVER", "INFO", "Metrics at http://0.0.0.0:%d/metrics", metrics_port);
         }
-        
-        log_message("NAME_SERVER", "INFO", "New client connected from %s:%d",
-                   inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        
-        pthread_t thread;
-        pthread_create(&thread, NULL, handle_client, client_socket);
-        pthread_detach(thread);
+    }
+    
+    log_message("NAME_SERVER", "INFO", "Name Server listening on port %d (backlog %d, %d workers)",
+               port, backlog, workers);
+    printf("Name Server started on port %d\n", port);
+    
+    // All client sockets are multiplexed by the reactor; handlers run on its worker pool
+    if (reactor_run(server_socket, dispatch_request, workers) < 0) {
+        log_message("NAME_SERVER", "ERROR", "Failed to start event loop");
+        close(server_socket);
+        return 1;
     }
     
     cleanup();
@@ -0,0 +1,386 @@
+#include "../include/path_index.h"
+
+// Lower bound of component name[0..len) among node's children
+static int child_search(PathNode* node, const char* name, size_t len, int* found) {
+    int lo = 0, hi = node->child_count;
+    *found = 0;
+    
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const char* child = node->children[mid]->name;
+        int cmp = strncmp(child, name, len);
+        if (cmp == 0 && child[len] != '\0') {
+            cmp = 1;  // Longer, so after name
+        }
+        
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            if (cmp == 0) *found = 1;
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static PathNode* child_get(PathNode* node, const char* name, size_t len, int create) {
+    int found;
+    int at = child_search(node, name, len, &found);
+    if (found) {
+        return node->children[at];
+    }
+    if (!create) {
+        return NULL;
+    }
+    
+    if (node->child_count == node->child_capacity) {
+        int capacity = node->child_capacity ? node->child_capacity * 2 : 4;
+        PathNode** grown = (PathNode**)realloc(node->children, capacity * sizeof(PathNode*));
+        if (!grown) return NULL;
+        node->children = grown;
+        node->child_capacity = capacity;
+    }
+    
+    PathNode* child = (PathNode*)calloc(1, sizeof(PathNode));
+    if (!child) return NULL;
+    child->name = strndup(name, len);
+    child->parent = node;
+    
+    memmove(&node->children[at + 1], &node->children[at],
+            (node->child_count - at) * sizeof(PathNode*));
+    node->children[at] = child;
+    node->child_count++;
+    return child;
+}
+
+static void node_free(PathNode* node) {
+    for (int i = 0; i < node->child_count; i++) {
+        node_free(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+}
+
+// Node for a registry name (trailing '/' ignored); empty components are
+// skipped, as the file system would
+static PathNode* find_node(PathIndex* index, const char* name, int create) {
+    PathNode* node = &index->root;
+    
+    while (node && *name) {
+        const char* slash = strchr(name, '/');
+        size_t len = slash ? (size_t)(slash - name) : strlen(name);
+        if (len > 0) {
+            node = child_get(node, name, len, create);
+        }
+        name += len;
+        if (*name == '/') name++;
+    }
+    return node;
+}
+
+static int name_set_search(NameSet* set, const char* name, int* found) {
+    int lo = 0, hi = set->count;
+    *found = 0;
+    
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(set->names[mid], name);
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            if (cmp == 0) *found = 1;
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void name_set_add(PathIndex* index, const char* owner, const char* name) {
+    NameSet* set = (NameSet*)hashmap_get(index->owners, owner);
+    if (!set) {
+        set = (NameSet*)calloc(1, sizeof(NameSet));
+        if (!set) return;
+        hashmap_put(index->owners, owner, set);
+    }
+    
+    int found;
+    int at = name_set_search(set, name, &found);
+    if (found) return;
+    
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 16;
+        char** grown = (char**)realloc(set->names, capacity * sizeof(char*));
+        if (!grown) return;
+        set->names = grown;
+        set->capacity = capacity;
+    }
+    memmove(&set->names[at + 1], &set->names[at], (set->count - at) * sizeof(char*));
+    set->names[at] = strdup(name);
+    set->count++;
+}
+
+static void name_set_remove(PathIndex* index, const char* owner, const char* name) {
+    NameSet* set = (NameSet*)hashmap_get(index->owners, owner);
+    if (!set) return;
+    
+    int found;
+    int at = name_set_search(set, name, &found);
+    if (!found) return;
+    
+    free(set->names[at]);
+    memmove(&set->names[at], &set->names[at + 1], (set->count - at - 1) * sizeof(char*));
+    set->count--;
+}
+
+static void name_set_free(const char* key, void* value, void* ctx) {
+    (void)key;
+    (void)ctx;
+    NameSet* set = (NameSet*)value;
+    for (int i = 0; i < set->count; i++) {
+        free(set->names[i]);
+    }
+    free(set->names);
+    set->names = NULL;
+    set->count = 0;
+}
+
+PathIndex* path_index_create() {
+    PathIndex* index = (PathIndex*)calloc(1, sizeof(PathIndex));
+    if (!index) return NULL;
+    
+    index->root.name = strdup("");
+    index->owners = hashmap_create();
+    pthread_rwlock_init(&index->lock, NULL);
+    return index;
+}
+
+void path_index_destroy(PathIndex* index) {
+    if (!index) return;
+    
+    node_free(&index->root);
+    hashmap_foreach(index->owners, name_set_free, NULL);
+    hashmap_destroy(index->owners);  // Frees the NameSets
+    pthread_rwlock_destroy(&index->lock);
+    free(index);
+}
+
+void path_index_add(PathIndex* index, const char* name, const char* owner) {
+    size_t len = strlen(name);
+    int marker = len > 0 && name[len - 1] == '/';
+    
+    pthread_rwlock_wrlock(&index->lock);
+    
+    PathNode* node = find_node(index, name, 1);
+    if (node && node != &index->root) {
+        if (marker) {
+            node->is_folder = 1;
+        } else {
+            node->is_file = 1;
+            name_set_add(index, owner, name);
+        }
+    }
+    
+    pthread_rwlock_unlock(&index->lock);
+}
+
+void path_index_remove(PathIndex* index, const char* name, const char* owner) {
+    size_t len = strlen(name);
+    int marker = len > 0 && name[len - 1] == '/';
+    
+    pthread_rwlock_wrlock(&index->lock);
+    
+    PathNode* node = find_node(index, name, 0);
+    if (node && node != &index->root) {
+        if (marker) {
+            node->is_folder = 0;
+        } else {
+            node->is_file = 0;
+            name_set_remove(index, owner, name);
+        }
+        
+        // Drop nodes nothing refers to any more, up to the first one in use
+        while (node != &index->root && !node->is_file && !node->is_folder &&
+               node->child_count == 0) {
+            PathNode* parent = node->parent;
+            int found;
+            int at = child_search(parent, node->name, strlen(node->name), &found);
+            memmove(&parent->children[at], &parent->children[at + 1],
+                    (parent->child_count - at - 1) * sizeof(PathNode*));
+            parent->child_count--;
+            node_free(node);
+            free(node);
+            node = parent;
+        }
+    }
+    
+    pthread_rwlock_unlock(&index->lock);
+}
+
+int path_index_is_folder(PathIndex* index, const char* folder) {
+    pthread_rwlock_rdlock(&index->lock);
+    PathNode* node = find_node(index, folder, 0);
+    int is_folder = node && (node == &index->root || node->is_folder || node->child_count > 0);
+    pthread_rwlock_unlock(&index->lock);
+    return is_folder;
+}
+
+int path_index_list(PathIndex* index, const char* folder, const char* after,
+                    path_index_fn fn, void* ctx) {
+    pthread_rwlock_rdlock(&index->lock);
+    
+    PathNode* node = find_node(index, folder, 0);
+    if (!node || (node != &index->root && !node->is_folder && node->child_count == 0)) {
+        pthread_rwlock_unlock(&index->lock);
+        return -1;
+    }
+    
+    int start = 0;
+    if (after && *after) {
+        int found;
+        start = child_search(node, after, strlen(after), &found);
+        if (found) start++;
+    }
+    
+    for (int i = start; i < node->child_count; i++) {
+        PathNode* child = node->children[i];
+        if (fn(child->name, child->is_folder || child->child_count > 0, ctx)) {
+            break;
+        }
+    }
+    
+    pthread_rwlock_unlock(&index->lock);
+    return 0;
+}
+
+typedef struct {
+    path_index_fn fn;
+    void* ctx;
+    char path[MAX_PATH];
+} WalkState;
+
+static int walk_children(PathNode* node, WalkState* st, size_t len, const char* after,
+                         const char* partial);
+
+// Pre-order visit of node, whose full name is st->path[0..len). after is
+// the cursor relative to node: NULL for none, "" to skip only node itself.
+static int walk_node(PathNode* node, WalkState* st, size_t len, const char* after) {
+    if (node->is_file && !after) {
+        if (st->fn(st->path, 0, st->ctx)) return 1;
+    }
+    return walk_children(node, st, len, after && *after ? after : NULL, NULL);
+}
+
+// Children of node (optionally only those starting with partial), resuming
+// after the relative cursor after
+static int walk_children(PathNode* node, WalkState* st, size_t len, const char* after,
+                         const char* partial) {
+    size_t comp_len = 0;
+    const char* rest = "";
+    int start = 0, found;
+    
+    if (partial) {
+        start = child_search(node, partial, strlen(partial), &found);
+    }
+    if (after) {
+        const char* slash = strchr(after, '/');
+        comp_len = slash ? (size_t)(slash - after) : strlen(after);
+        rest = slash ? slash + 1 : "";
+        int from = child_search(node, after, comp_len, &found);
+        if (from > start) start = from;
+    }
+    
+    for (int i = start; i < node->child_count; i++) {
+        PathNode* child = node->children[i];
+        if (partial && strncmp(child->name, partial, strlen(partial)) != 0) {
+            break;
+        }
+        
+        const char* child_after = NULL;
+        if (after && strncmp(child->name, after, comp_len) == 0 && child->name[comp_len] == '\0') {
+            child_after = rest;
+        }
+        
+        size_t child_len = len;
+        if (len > 0) {
+            st->path[child_len++] = '/';
+        }
+        int n = snprintf(st->path + child_len, MAX_PATH - child_len, "%s", child->name);
+        if (n < 0 || child_len + n >= MAX_PATH) {
+            st->path[len] = '\0';
+            continue;
+        }
+        
+        int stop = walk_node(child, st, child_len + n, child_after);
+        st->path[len] = '\0';
+        if (stop) return 1;
+    }
+    return 0;
+}
+
+void path_index_walk(PathIndex* index, const char* prefix, const char* after,
+                     path_index_fn fn, void* ctx) {
+    WalkState st;
+    st.fn = fn;
+    st.ctx = ctx;
+    st.path[0] = '\0';
+    
+    // "docs/re": descend to docs, then only children starting with "re"
+    const char* slash = strrchr(prefix, '/');
+    size_t dir_len = slash ? (size_t)(slash - prefix) : 0;
+    const char* partial = slash ? slash + 1 : prefix;
+    
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%.*s", (int)dir_len, prefix);
+    
+    // The cursor is a full name from a previous page of the same query
+    const char* rel_after = NULL;
+    if (after && *after) {
+        if (dir_len == 0) {
+            rel_after = after;
+        } else if (strncmp(after, dir, dir_len) == 0 && after[dir_len] == '/') {
+            rel_after = after + dir_len + 1;
+        }
+    }
+    
+    pthread_rwlock_rdlock(&index->lock);
+    
+    PathNode* node = find_node(index, dir, 0);
+    if (node) {
+        size_t len = 0;
+        for (const char* p = dir; *p; p++) {
+            if (*p == '/' && (len == 0 || st.path[len - 1] == '/')) continue;
+            st.path[len++] = *p;
+        }
+        if (len > 0 && st.path[len - 1] == '/') len--;
+        st.path[len] = '\0';
+        walk_children(node, &st, len, rel_after, *partial ? partial : NULL);
+    }
+    
+    pthread_rwlock_unlock(&index->lock);
+}
+
+void path_index_owned(PathIndex* index, const char* owner, const char* prefix,
+                      const char* after, path_index_fn fn, void* ctx) {
+    size_t prefix_len = strlen(prefix);
+    
+    pthread_rwlock_rdlock(&index->lock);
+    
+    NameSet* set = (NameSet*)hashmap_get(index->owners, owner);
+    if (set) {
+        // Names sharing a prefix are contiguous in bytewise order
+        int found;
+        int start = name_set_search(set, prefix, &found);
+        if (after && *after) {
+            int from = name_set_search(set, after, &found);
+            if (found) from++;
+            if (from > start) start = from;
+        }
+        for (int i = start; i < set->count; i++) {
+            if (strncmp(set->names[i], prefix, prefix_len) != 0) break;
+            if (fn(set->names[i], 0, ctx)) break;
+        }
+    }
+    
+    pthread_rwlock_unlock(&index->lock);
+}
@@ -0,0 +1,336 @@
+#include "../include/reactor.h"
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_READ_CHUNK 16384
+#define REACTOR_WAIT_MS 1000
+
+typedef struct reactor_conn {
+    int fd;
+    char* buf;
+    size_t len;
+    size_t cap;
+    int busy;     // Queued for or owned by a worker
+    int closed;   // Removed from epoll; freed by whoever clears busy last
+    int eof;      // Peer done sending: removed from epoll, freed once the
+                  // requests it sent before are answered
+    pthread_mutex_t lock;
+    struct reactor_conn* next_ready;
+} reactor_conn_t;
+
+static volatile int reactor_running = 0;
+static reactor_handler_fn reactor_handler = NULL;
+
+// Ready queue shared by the event loop and the workers
+static reactor_conn_t* ready_head = NULL;
+static reactor_conn_t* ready_tail = NULL;
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+int reactor_default_workers() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 4;
+}
+
+void reactor_stop() {
+    reactor_running = 0;
+    pthread_mutex_lock(&ready_lock);
+    pthread_cond_broadcast(&ready_cond);
+    pthread_mutex_unlock(&ready_lock);
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void conn_free(reactor_conn_t* conn) {
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->buf);
+    free(conn);
+}
+
+static void ready_push(reactor_conn_t* conn) {
+    pthread_mutex_lock(&ready_lock);
+    conn->next_ready = NULL;
+    if (ready_tail) {
+        ready_tail->next_ready = conn;
+    } else {
+        ready_head = conn;
+    }
+    ready_tail = conn;
+    pthread_cond_signal(&ready_cond);
+    pthread_mutex_unlock(&ready_lock);
+}
+
+static reactor_conn_t* ready_pop() {
+    pthread_mutex_lock(&ready_lock);
+    while (!ready_head && reactor_running) {
+        pthread_cond_wait(&ready_cond, &ready_lock);
+    }
+
+    reactor_conn_t* conn = ready_head;
+    if (conn) {
+        ready_head = conn->next_ready;
+        if (!ready_head) {
+            ready_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&ready_lock);
+    return conn;
+}
+
+// Caller holds conn->lock
+static int conn_has_frame(reactor_conn_t* conn) {
+    ssize_t need = frame_peek_length(conn->buf, conn->len);
+    return need < 0 || (need > 0 && (size_t)need <= conn->len);
+}
+
+static void* reactor_worker(void* arg) {
+    (void)arg;
+
+    while (reactor_running) {
+        reactor_conn_t* conn = ready_pop();
+        if (!conn) {
+            continue;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        while (!conn->closed) {
+            Message msg, response;
+            ssize_t consumed = frame_decode(conn->buf, conn->len, &msg);
+            if (consumed == 0) {
+                break;
+            }
+            if (consumed < 0) {
+                // Malformed stream: let the event loop see the hangup
+                shutdown(conn->fd, SHUT_RDWR);
+                break;
+            }
+
+            conn->len -= consumed;
+            memmove(conn->buf, conn->buf + consumed, conn->len);
+            // Pipelined requests already waiting: hold this reply back so it
+            // leaves together with the next one
+            int more = conn_has_frame(conn);
+            pthread_mutex_unlock(&conn->lock);
+
+            memset(&response, 0, sizeof(Message));
+            response.msg_type = MSG_RESPONSE;
+            response.request_id = msg.request_id;
+            response.legacy = msg.legacy;
+
+            reactor_handler(&msg, &response);
+
+            int sent = send_message_flags(conn->fd, &response, more ? MSG_MORE : 0);
+            message_free_body(&msg);
+            message_free_body(&response);
+
+            if (sent < 0) {
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+
+            pthread_mutex_lock(&conn->lock);
+            if (sent < 0 && conn->eof) {
+                break;  // Nobody left to answer
+            }
+        }
+
+        conn->busy = 0;
+        int release = conn->closed || conn->eof;
+        pthread_mutex_unlock(&conn->lock);
+
+        if (release) {
+            conn_free(conn);
+        }
+    }
+
+    return NULL;
+}
+
+static void reactor_accept(int epoll_fd, int listen_fd) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && reactor_running) {
+                log_message("REACTOR", "ERROR", "Accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        reactor_conn_t* conn = (reactor_conn_t*)calloc(1, sizeof(reactor_conn_t));
+        if (!conn || set_nonblocking(fd) < 0) {
+            log_message("REACTOR", "ERROR", "Failed to set up connection: %s", strerror(errno));
+            free(conn);
+            close(fd);
+            continue;
+        }
+
+        conn->fd = fd;
+        pthread_mutex_init(&conn->lock, NULL);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            log_message("REACTOR", "ERROR", "epoll_ctl ADD failed: %s", strerror(errno));
+            conn_free(conn);
+            continue;
+        }
+
+        log_message("REACTOR", "INFO", "New client connected from %s:%d",
+                   inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    }
+}
+
+// Drain the socket (edge-triggered) and hand the connection to a worker
+// once a complete frame is buffered. A peer that shuts down its side right
+// after its requests (EOF) still gets them answered; only errors drop what
+// is buffered.
+static void reactor_read(int epoll_fd, reactor_conn_t* conn, uint32_t events) {
+    int hangup = (events & EPOLLERR) != 0;
+    int eof = 0;
+
+    pthread_mutex_lock(&conn->lock);
+
+    while (!hangup) {
+        if (conn->cap - conn->len < REACTOR_READ_CHUNK) {
+            size_t new_cap = conn->cap ? conn->cap * 2 : REACTOR_READ_CHUNK * 2;
+            char* grown = (char*)realloc(conn->buf, new_cap);
+            if (!grown) {
+                hangup = 1;
+                break;
+            }
+            conn->buf = grown;
+            conn->cap = new_cap;
+        }
+
+        ssize_t n = recv(conn->fd, conn->buf + conn->len, conn->cap - conn->len, 0);
+        if (n > 0) {
+            conn->len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n == 0) {
+            eof = 1;
+            break;
+        }
+        hangup = 1;  // Hard error
+    }
+
+    if (!hangup && frame_peek_length(conn->buf, conn->len) < 0) {
+        hangup = 1;
+    }
+
+    if (hangup) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->closed = 1;
+        int release = !conn->busy;
+        pthread_mutex_unlock(&conn->lock);
+        if (release) {
+            conn_free(conn);
+        }
+        return;
+    }
+
+    if (eof) {
+        // No more events: whoever holds the connection last frees it
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->eof = 1;
+    }
+
+    int dispatch = !conn->busy && conn_has_frame(conn);
+    int release = eof && !conn->busy && !dispatch;
+    if (dispatch) {
+        conn->busy = 1;
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    if (dispatch) {
+        ready_push(conn);
+    }
+    if (release) {
+        conn_free(conn);
+    }
+}
+
+int reactor_run(int listen_fd, reactor_handler_fn handler, int num_workers) {
+    if (num_workers <= 0) {
+        num_workers = reactor_default_workers();
+    }
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        log_message("REACTOR", "ERROR", "epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // NULL marks the listening socket
+    if (set_nonblocking(listen_fd) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        log_message("REACTOR", "ERROR", "Failed to register listener: %s", strerror(errno));
+        close(epoll_fd);
+        return -1;
+    }
+
+    reactor_handler = handler;
+    reactor_running = 1;
+
+    pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * num_workers);
+    if (!workers) {
+        close(epoll_fd);
+        return -1;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_create(&workers[i], NULL, reactor_worker, NULL);
+    }
+
+    log_message("REACTOR", "INFO", "Event loop started with %d workers", num_workers);
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (reactor_running) {
+        int n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, REACTOR_WAIT_MS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message("REACTOR", "ERROR", "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                reactor_accept(epoll_fd, listen_fd);
+            } else {
+                reactor_read(epoll_fd, (reactor_conn_t*)events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+
+    reactor_stop();
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    close(epoll_fd);
+
+    return 0;
+}
@@ -0,0 +1,451 @@
+#include "../include/sentence_index.h"
+#include "../include/hashmap.h"
+#include "../include/tokenizer.h"
+#include <fcntl.h>
+
+#define INDEX_READ_CHUNK 65536
+#define INDEX_INITIAL_SPANS 16
+#define INDEX_CACHE_DEFAULT 256
+
+// Incremental tokenizer: bytes are fed in runs with their absolute file
+// offset, so a scan can start at any sentence boundary. Each 64-byte block
+// is classified once by the tokenizer.h kernels; sentences and words are
+// then found from the bitmasks.
+typedef struct {
+    SentenceIndex* idx;
+    size_t run_start;   // Offset where the current (unfinished) sentence began
+    size_t pos;         // Offset of the next byte
+    int has_text;
+    size_t text_start;  // Trimmed bounds of the current sentence
+    size_t text_end;
+    int words;
+    int in_word;
+    int failed;
+} SpanScanner;
+
+// Cache of indexes for recently written files: filename -> SentenceIndex*
+static HashMap* index_cache = NULL;
+static pthread_mutex_t index_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char** index_cache_ring = NULL;  // Insertion order, for eviction
+static int index_cache_limit = 0;
+static int index_cache_next = 0;
+
+static SentenceIndex* index_alloc(int capacity) {
+    if (capacity < INDEX_INITIAL_SPANS) {
+        capacity = INDEX_INITIAL_SPANS;
+    }
+
+    SentenceIndex* idx = (SentenceIndex*)calloc(1, sizeof(SentenceIndex) + capacity * sizeof(SentenceSpan));
+    if (idx) {
+        idx->capacity = capacity;
+    }
+    return idx;
+}
+
+static SentenceIndex* index_copy(const SentenceIndex* src) {
+    SentenceIndex* idx = index_alloc(src->count);
+    if (!idx) {
+        return NULL;
+    }
+
+    int capacity = idx->capacity;
+    memcpy(idx, src, sizeof(SentenceIndex));
+    memcpy(idx->spans, src->spans, src->count * sizeof(SentenceSpan));
+    idx->capacity = capacity;
+    return idx;
+}
+
+static void index_append(SentenceIndex** pidx, size_t offset, size_t length, int words, int* failed) {
+    SentenceIndex* idx = *pidx;
+
+    if (idx->count == idx->capacity) {
+        int capacity = idx->capacity * 2;
+        SentenceIndex* grown = (SentenceIndex*)realloc(idx, sizeof(SentenceIndex) + capacity * sizeof(SentenceSpan));
+        if (!grown) {
+            *failed = 1;
+            return;
+        }
+        grown->capacity = capacity;
+        *pidx = idx = grown;
+    }
+
+    idx->spans[idx->count].offset = offset;
+    idx->spans[idx->count].length = length;
+    idx->spans[idx->count].words = words;
+    idx->count++;
+    idx->total_words += words;
+}
+
+static void scanner_init(SpanScanner* sc, SentenceIndex* idx, size_t start) {
+    memset(sc, 0, sizeof(SpanScanner));
+    sc->idx = idx;
+    sc->run_start = start;
+    sc->pos = start;
+}
+
+static void scanner_reset(SpanScanner* sc) {
+    sc->run_start = sc->pos;
+    sc->has_text = 0;
+    sc->words = 0;
+    sc->in_word = 0;
+}
+
+// Bits from..to-1 (from < to <= 64)
+static inline uint64_t bits_range(size_t from, size_t to) {
+    return tok_bits_below(to) & ~tok_bits_below(from);
+}
+
+// Feed up to 64 bytes of p. With stop set, returns right after the first
+// sentence that ends. Returns the bytes used; *boundary is set when the
+// last of them completed a sentence.
+static size_t scanner_feed_run(SpanScanner* sc, const char* p, size_t n, int stop, int* boundary) {
+    size_t len = n < 64 ? n : 64;
+    uint64_t space, delim;
+    tok_classify(p, len, &space, &delim);
+    uint64_t text = ~space & tok_bits_below(len);
+    uint64_t starts = text & ~(text << 1);  // Bit 0 depends on the scanner state
+
+    size_t cur = 0;
+    *boundary = 0;
+    while (cur < len) {
+        size_t room = MAX_SENTENCE_LENGTH - 1 - (sc->pos - sc->run_start);
+        size_t limit = room < len - cur ? cur + room : len;
+        uint64_t ends = delim & bits_range(cur, limit);
+        size_t end = ends ? (size_t)__builtin_ctzll(ends) + 1 : limit;
+
+        uint64_t seg_text = text & bits_range(cur, end);
+        if (seg_text) {
+            size_t first = __builtin_ctzll(seg_text);
+            size_t last = 63 - __builtin_clzll(seg_text);
+            if (!sc->has_text) {
+                sc->has_text = 1;
+                sc->text_start = sc->pos + (first - cur);
+            }
+            sc->text_end = sc->pos + (last - cur) + 1;
+
+            // A word starting the run only counts if none runs into it
+            sc->words += __builtin_popcountll(starts & bits_range(cur + 1, end));
+            sc->words += (text >> cur & 1) && !sc->in_word;
+            sc->in_word = text >> (end - 1) & 1;
+        } else {
+            sc->in_word = 0;
+        }
+        sc->pos += end - cur;
+        cur = end;
+
+        if (ends) {
+            index_append(&sc->idx, sc->text_start, sc->text_end - sc->text_start, sc->words, &sc->failed);
+        } else if (sc->pos - sc->run_start >= MAX_SENTENCE_LENGTH - 1) {
+            // Overlong sentences are split untrimmed, like parse_sentences()
+            index_append(&sc->idx, sc->run_start, sc->pos - sc->run_start, sc->words, &sc->failed);
+        } else {
+            *boundary = 0;
+            continue;
+        }
+        scanner_reset(sc);
+        *boundary = 1;
+        if (stop) {
+            break;
+        }
+    }
+    return cur;
+}
+
+static void scanner_feed(SpanScanner* sc, const char* p, size_t n) {
+    int boundary;
+    while (n > 0) {
+        size_t used = scanner_feed_run(sc, p, n, 0, &boundary);
+        p += used;
+        n -= used;
+    }
+}
+
+// Unterminated trailing sentence, if any
+static void scanner_finish(SpanScanner* sc) {
+    if (sc->has_text) {
+        index_append(&sc->idx, sc->text_start, sc->text_end - sc->text_start, sc->words, &sc->failed);
+        sc->idx->open_tail = 1;
+    }
+}
+
+SentenceIndex* sentence_index_from_text(const char* text, size_t len) {
+    SentenceIndex* idx = index_alloc(INDEX_INITIAL_SPANS);
+    if (!idx) {
+        return NULL;
+    }
+
+    SpanScanner sc;
+    scanner_init(&sc, idx, 0);
+    scanner_feed(&sc, text, len);
+    scanner_finish(&sc);
+
+    if (sc.failed) {
+        free(sc.idx);
+        return NULL;
+    }
+    sc.idx->size = len;
+    return sc.idx;
+}
+
+static SentenceIndex* index_build_from_fd(int fd) {
+    char* buf = (char*)malloc(INDEX_READ_CHUNK);
+    SentenceIndex* idx = index_alloc(INDEX_INITIAL_SPANS);
+    if (!buf || !idx) {
+        free(buf);
+        free(idx);
+        return NULL;
+    }
+
+    SpanScanner sc;
+    scanner_init(&sc, idx, 0);
+
+    ssize_t n;
+    off_t offset = 0;
+    while ((n = pread(fd, buf, INDEX_READ_CHUNK, offset)) > 0) {
+        scanner_feed(&sc, buf, n);
+        offset += n;
+    }
+    scanner_finish(&sc);
+    free(buf);
+
+    if (n < 0 || sc.failed) {
+        free(sc.idx);
+        return NULL;
+    }
+    return sc.idx;
+}
+
+static void index_set_identity(SentenceIndex* idx, const struct stat* st) {
+    idx->ino = st->st_ino;
+    idx->size = st->st_size;
+    idx->mtime = st->st_mtim;
+}
+
+static int index_matches(const SentenceIndex* idx, const struct stat* st) {
+    return idx->ino == st->st_ino && idx->size == st->st_size &&
+           idx->mtime.tv_sec == st->st_mtim.tv_sec &&
+           idx->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Caller holds index_cache_lock; takes ownership of idx
+static void cache_put_locked(const char* filename, SentenceIndex* idx) {
+    if (!index_cache) {
+        index_cache_limit = config_get_int("SS_INDEX_CACHE", INDEX_CACHE_DEFAULT);
+        if (index_cache_limit <= 0) {
+            free(idx);
+            return;
+        }
+        index_cache = hashmap_create();
+        index_cache_ring = (char**)calloc(index_cache_limit, sizeof(char*));
+        if (!index_cache || !index_cache_ring) {
+            free(idx);
+            return;
+        }
+    }
+
+    if (!hashmap_contains(index_cache, filename)) {
+        char** slot = &index_cache_ring[index_cache_next];
+        if (*slot) {
+            hashmap_remove(index_cache, *slot);
+            free(*slot);
+        }
+        *slot = strdup(filename);
+        index_cache_next = (index_cache_next + 1) % index_cache_limit;
+    }
+
+    hashmap_put(index_cache, filename, idx);
+}
+
+SentenceIndex* sentence_index_load(const char* filename, const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&index_cache_lock);
+    SentenceIndex* cached = index_cache ? (SentenceIndex*)hashmap_get(index_cache, filename) : NULL;
+    if (cached && index_matches(cached, &st)) {
+        SentenceIndex* copy = index_copy(cached);
+        pthread_mutex_unlock(&index_cache_lock);
+        return copy;
+    }
+    pthread_mutex_unlock(&index_cache_lock);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Identity is taken from the descriptor the index is built from
+    SentenceIndex* idx = NULL;
+    if (fstat(fd, &st) == 0) {
+        idx = index_build_from_fd(fd);
+    }
+    close(fd);
+
+    if (!idx) {
+        log_message("SENTENCE_INDEX", "ERROR", "Failed to index %s", filename);
+        return NULL;
+    }
+    index_set_identity(idx, &st);
+
+    SentenceIndex* copy = index_copy(idx);
+    pthread_mutex_lock(&index_cache_lock);
+    cache_put_locked(filename, idx);
+    pthread_mutex_unlock(&index_cache_lock);
+
+    if (!copy) {
+        return NULL;
+    }
+    log_message("SENTENCE_INDEX", "DEBUG", "Indexed %s: %d sentences", filename, copy->count);
+    return copy;
+}
+
+void sentence_index_store(const char* filename, SentenceIndex* idx, const struct stat* st) {
+    index_set_identity(idx, st);
+
+    pthread_mutex_lock(&index_cache_lock);
+    cache_put_locked(filename, idx);
+    pthread_mutex_unlock(&index_cache_lock);
+}
+
+void sentence_index_invalidate(const char* filename) {
+    pthread_mutex_lock(&index_cache_lock);
+    if (index_cache) {
+        hashmap_remove(index_cache, filename);
+    }
+    pthread_mutex_unlock(&index_cache_lock);
+}
+
+// A span ends at a scanner boundary unless it is the unterminated tail
+static int span_is_boundary(const SentenceIndex* idx, int i) {
+    return i < idx->count - 1 || !idx->open_tail;
+}
+
+static int feed_file_range(SpanScanner* sc, int fd, size_t from, size_t to, char* buf) {
+    while (from < to) {
+        size_t want = to - from < INDEX_READ_CHUNK ? to - from : INDEX_READ_CHUNK;
+        ssize_t n = pread(fd, buf, want, from);
+        if (n <= 0) {
+            return -1;
+        }
+        scanner_feed(sc, buf, n);
+        from += n;
+    }
+    return 0;
+}
+
+void sentence_index_splice_point(const SentenceIndex* idx, int sentence, size_t len,
+                                 SentenceSplice* splice) {
+    if (sentence < idx->count) {
+        splice->offset = idx->spans[sentence].offset;
+        splice->old_length = idx->spans[sentence].length;
+        splice->separator = 0;
+    } else {
+        splice->offset = idx->size;
+        splice->old_length = 0;
+        splice->separator = idx->count > 0 && len > 0;
+    }
+}
+
+SentenceIndex* sentence_index_splice(const SentenceIndex* idx, int fd, int sentence,
+                                     const char* text, size_t len, SentenceSplice* splice) {
+    if (sentence < 0 || sentence > idx->count) {
+        return NULL;
+    }
+
+    sentence_index_splice_point(idx, sentence, len, splice);
+
+    // Re-tokenize from the last boundary before the edit. Appending after an
+    // unterminated tail must rescan that tail too, since it may now end.
+    int keep = sentence;
+    if (keep == idx->count && idx->open_tail) {
+        keep--;
+    }
+    size_t region_start = keep > 0 ? idx->spans[keep - 1].offset + idx->spans[keep - 1].length : 0;
+
+    SentenceIndex* out = index_alloc(idx->count + 4);
+    char* buf = (char*)malloc(INDEX_READ_CHUNK);
+    if (!out || !buf) {
+        free(out);
+        free(buf);
+        return NULL;
+    }
+    memcpy(out->spans, idx->spans, keep * sizeof(SentenceSpan));
+    out->count = keep;
+    for (int i = 0; i < keep; i++) {
+        out->total_words += idx->spans[i].words;
+    }
+
+    SpanScanner sc;
+    scanner_init(&sc, out, region_start);
+
+    int ok = feed_file_range(&sc, fd, region_start, splice->offset, buf) == 0;
+    if (ok) {
+        scanner_feed(&sc, " ", splice->separator);
+        scanner_feed(&sc, text, len);
+    }
+
+    // Scan the old suffix until a boundary coincides with an old one; every
+    // span after that is unchanged apart from the length delta
+    size_t old_end = idx->size;
+    size_t old_pos = splice->offset + splice->old_length;
+    long delta = (long)(splice->separator + len) - (long)splice->old_length;
+    int next_old = sentence;
+
+    // Common case: the new text ends a sentence where the old one ended
+    int resynced = sentence < idx->count && sc.pos == sc.run_start &&
+                   span_is_boundary(idx, sentence);
+
+    while (ok && !resynced && old_pos < old_end) {
+        size_t want = old_end - old_pos < INDEX_READ_CHUNK ? old_end - old_pos : INDEX_READ_CHUNK;
+        ssize_t n = pread(fd, buf, want, old_pos);
+        if (n <= 0) {
+            ok = 0;
+            break;
+        }
+
+        for (ssize_t i = 0; i < n;) {
+            int boundary;
+            size_t used = scanner_feed_run(&sc, buf + i, n - i, 1, &boundary);
+            i += used;
+            old_pos += used;
+            if (!boundary) {
+                continue;
+            }
+
+            while (next_old < idx->count &&
+                   idx->spans[next_old].offset + idx->spans[next_old].length < old_pos) {
+                next_old++;
+            }
+            if (next_old < idx->count &&
+                idx->spans[next_old].offset + idx->spans[next_old].length == old_pos &&
+                span_is_boundary(idx, next_old)) {
+                resynced = 1;
+                break;
+            }
+        }
+    }
+    free(buf);
+
+    SentenceIndex* result = sc.idx;
+    if (ok && resynced) {
+        for (int i = next_old + 1; i < idx->count && !sc.failed; i++) {
+            index_append(&result, idx->spans[i].offset + delta, idx->spans[i].length,
+                         idx->spans[i].words, &sc.failed);
+        }
+        result->open_tail = idx->open_tail && next_old + 1 < idx->count;
+    } else if (ok) {
+        sc.idx = result;
+        scanner_finish(&sc);
+        result = sc.idx;
+    }
+
+    if (!ok || sc.failed) {
+        free(result);
+        return NULL;
+    }
+
+    result->size = idx->size + delta;
+    return result;
+}
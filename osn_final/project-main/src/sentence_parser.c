@@ -1,103 +1,84 @@
 #include "../include/sentence_parser.h"
+#include "../include/sentence_index.h"
 #include <ctype.h>
 
-// Parse text into sentences (split on . ! ?)
-int parse_sentences(const char* text, char sentences[][MAX_SENTENCE_LENGTH], int max_sentences) {
-    if (!text || !sentences) return 0;
-    
-    int sentence_count = 0;
-    int char_index = 0;
+int tokenize_words(const char* text, size_t len, TextSpan* spans, int max_spans) {
+    if (!text || !spans) return 0;
     
-    for (int i = 0; text[i] != '\0' && sentence_count < max_sentences; i++) {
-        sentences[sentence_count][char_index++] = text[i];
+    int count = 0;
+    int in_word = 0;
+    size_t start = 0;
+    uint64_t carry = 0;  // Last byte of the previous block was a word byte
+    
+    for (size_t base = 0; base < len && count < max_spans; base += 64) {
+        size_t n = len - base < 64 ? len - base : 64;
+        uint64_t space, delim;
+        tok_classify(text + base, n, &space, &delim);
+        uint64_t word = ~space;
         
-        // Check for sentence delimiters
-        if (text[i] == '.' || text[i] == '!' || text[i] == '?') {
-            sentences[sentence_count][char_index] = '\0';
-            
-            // Trim leading/trailing whitespace
-            int start = 0;
-            while (isspace(sentences[sentence_count][start])) start++;
-            
-            int end = strlen(sentences[sentence_count]) - 1;
-            while (end > start && isspace(sentences[sentence_count][end])) end--;
-            
-            if (start > 0 || end < (int)strlen(sentences[sentence_count]) - 1) {
-                memmove(sentences[sentence_count], sentences[sentence_count] + start, end - start + 1);
-                sentences[sentence_count][end - start + 1] = '\0';
+        // Bits where a word starts or the first byte after one is
+        uint64_t edges = word ^ ((word << 1) | carry);
+        carry = word >> 63;
+        while (edges) {
+            size_t bit = __builtin_ctzll(edges);
+            edges &= edges - 1;
+            if (word >> bit & 1) {
+                start = base + bit;
+                in_word = 1;
+                continue;
             }
-            
-            if (strlen(sentences[sentence_count]) > 0) {
-                sentence_count++;
-                char_index = 0;
+            spans[count].offset = start;
+            spans[count].length = base + bit - start;
+            in_word = 0;
+            if (++count == max_spans) {
+                return count;
             }
         }
-        
-        if (char_index >= MAX_SENTENCE_LENGTH - 1) {
-            sentences[sentence_count][char_index] = '\0';
-            sentence_count++;
-            char_index = 0;
-        }
     }
     
-    // Add incomplete sentence if any
-    if (char_index > 0 && sentence_count < max_sentences) {
-        sentences[sentence_count][char_index] = '\0';
-        
-        // Trim whitespace
-        int start = 0;
-        while (isspace(sentences[sentence_count][start])) start++;
-        
-        if (start < char_index) {
-            int end = char_index - 1;
-            while (end > start && isspace(sentences[sentence_count][end])) end--;
-            
-            memmove(sentences[sentence_count], sentences[sentence_count] + start, end - start + 1);
-            sentences[sentence_count][end - start + 1] = '\0';
-            
-            if (strlen(sentences[sentence_count]) > 0) {
-                sentence_count++;
-            }
-        }
+    if (in_word && count < max_spans) {
+        spans[count].offset = start;
+        spans[count].length = len - start;
+        count++;
     }
+    return count;
+}
+
+// Parse text into sentences (split on . ! ?)
+int parse_sentences(const char* text, char sentences[][MAX_SENTENCE_LENGTH], int max_sentences) {
+    if (!text || !sentences) return 0;
     
-    return sentence_count;
+    SentenceIndex* idx = sentence_index_from_text(text, strlen(text));
+    if (!idx) {
+        return 0;
+    }
+    
+    int count = idx->count < max_sentences ? idx->count : max_sentences;
+    for (int i = 0; i < count; i++) {
+        memcpy(sentences[i], text + idx->spans[i].offset, idx->spans[i].length);
+        sentences[i][idx->spans[i].length] = '\0';
+    }
+    free(idx);
+    return count;
 }
 
 // Parse sentence into words (space-separated)
 int parse_words(const char* sentence, char words[][MAX_WORD_LENGTH], int max_words) {
-    if (!sentence || !words) return 0;
+    if (!sentence || !words || max_words <= 0) return 0;
     
-    int word_count = 0;
-    int char_index = 0;
-    int in_word = 0;
-    
-    for (int i = 0; sentence[i] != '\0' && word_count < max_words; i++) {
-        if (isspace(sentence[i])) {
-            if (in_word) {
-                words[word_count][char_index] = '\0';
-                word_count++;
-                char_index = 0;
-                in_word = 0;
-            }
-        } else {
-            if (!in_word) {
-                in_word = 1;
-            }
-            
-            if (char_index < MAX_WORD_LENGTH - 1) {
-                words[word_count][char_index++] = sentence[i];
-            }
-        }
+    TextSpan* spans = (TextSpan*)malloc(max_words * sizeof(TextSpan));
+    if (!spans) {
+        return 0;
     }
     
-    // Add last word if any
-    if (in_word && word_count < max_words) {
-        words[word_count][char_index] = '\0';
-        word_count++;
+    int count = tokenize_words(sentence, strlen(sentence), spans, max_words);
+    for (int i = 0; i < count; i++) {
+        size_t len = spans[i].length < MAX_WORD_LENGTH - 1 ? spans[i].length : MAX_WORD_LENGTH - 1;
+        memcpy(words[i], sentence + spans[i].offset, len);
+        words[i][len] = '\0';
     }
-    
-    return word_count;
+    free(spans);
+    return count;
 }
 
 // Rebuild text from sentences
@@ -125,83 +106,88 @@ void rebuild_text(char sentences[][MAX_SENTENCE_LENGTH], int num_sentences, char
     }
 }
 
-// Insert word at specific position in sentence
-int insert_word(char* sentence, int word_index, const char* word, char* output, int max_len) {
-    if (!sentence || !word || !output) return -1;
+// Append len bytes of src to output, space-separated, truncating at max_len
+static void append_word(char* output, int* current_len, int max_len, const char* src, int len) {
+    if (*current_len > 0 && *current_len < max_len - 1) {
+        output[(*current_len)++] = ' ';
+    }
     
-    char words[MAX_WORDS][MAX_WORD_LENGTH];
-    int word_count = parse_words(sentence, words, MAX_WORDS);
+    int space_left = max_len - *current_len - 1;
+    if (len > space_left) {
+        len = space_left > 0 ? space_left : 0;
+    }
     
-    if (word_index < 0 || word_index > word_count) {
+    memcpy(output + *current_len, src, len);
+    *current_len += len;
+    output[*current_len] = '\0';
+}
+
+// Insert word at specific position in sentence. Words are walked in place
+// rather than split into a MAX_WORDS array, so this needs no scratch space.
+int insert_word(char* sentence, int word_index, const char* word, char* output, int max_len) {
+    if (!sentence || !word || !output || max_len <= 0) return -1;
+    
+    if (word_index < 0) {
         return ERR_INVALID_INDEX;
     }
     
     output[0] = '\0';
     int current_len = 0;
+    int count = 0;
+    int inserted = 0;
+    const char* p = sentence;
     
-    // Add words before insertion point
-    for (int i = 0; i < word_index && current_len < max_len - 1; i++) {
-        if (i > 0 && current_len < max_len - 2) {
-            output[current_len++] = ' ';
-            output[current_len] = '\0';
-        }
+    while (1) {
+        while (isspace((unsigned char)*p)) p++;
         
-        strncat(output, words[i], max_len - current_len - 1);
-        current_len = strlen(output);
-    }
-    
-    // Add new word
-    if (word_index > 0 && current_len < max_len - 2) {
-        output[current_len++] = ' ';
-        output[current_len] = '\0';
-    }
-    
-    strncat(output, word, max_len - current_len - 1);
-    current_len = strlen(output);
-    
-    // Add remaining words
-    for (int i = word_index; i < word_count && current_len < max_len - 1; i++) {
-        if (current_len > 0 && current_len < max_len - 2) {
-            output[current_len++] = ' ';
-            output[current_len] = '\0';
+        if (count == word_index && !inserted) {
+            append_word(output, &current_len, max_len, word, strlen(word));
+            inserted = 1;
         }
         
-        strncat(output, words[i], max_len - current_len - 1);
-        current_len = strlen(output);
+        if (*p == '\0') break;
+        
+        const char* start = p;
+        while (*p != '\0' && !isspace((unsigned char)*p)) p++;
+        
+        int len = p - start;
+        if (len > MAX_WORD_LENGTH - 1) {
+            len = MAX_WORD_LENGTH - 1;
+        }
+        append_word(output, &current_len, max_len, start, len);
+        count++;
     }
     
-    return SUCCESS;
+    return inserted ? SUCCESS : ERR_INVALID_INDEX;
 }
 
-// Get text statistics
+// Get text statistics (one pass over the text, no per-sentence copies)
 void get_text_stats(const char* text, int* word_count, int* char_count, int* sentence_count) {
+    if (word_count) *word_count = 0;
+    if (char_count) *char_count = 0;
+    if (sentence_count) *sentence_count = 0;
+    
     if (!text) {
-        if (word_count) *word_count = 0;
-        if (char_count) *char_count = 0;
-        if (sentence_count) *sentence_count = 0;
         return;
     }
     
+    size_t len = strlen(text);
     if (char_count) {
-        *char_count = strlen(text);
+        *char_count = len;
     }
     
     if (sentence_count || word_count) {
-        char sentences[MAX_SENTENCES][MAX_SENTENCE_LENGTH];
-        int num_sentences = parse_sentences(text, sentences, MAX_SENTENCES);
+        SentenceIndex* idx = sentence_index_from_text(text, len);
+        if (!idx) {
+            return;
+        }
         
         if (sentence_count) {
-            *sentence_count = num_sentences;
+            *sentence_count = idx->count;
         }
-        
         if (word_count) {
-            int total_words = 0;
-            for (int i = 0; i < num_sentences; i++) {
-                char words[MAX_WORDS][MAX_WORD_LENGTH];
-                int num_words = parse_words(sentences[i], words, MAX_WORDS);
-                total_words += num_words;
-            }
-            *word_count = total_words;
+            *word_count = idx->total_words;
         }
+        free(idx);
     }
 }
@@ -0,0 +1,138 @@
+#include "../include/shard_map.h"
+
+static uint64_t shard_hash(const char* key) {
+    uint64_t h = 14695981039346656037ULL;  // FNV-1a
+    for (const unsigned char* p = (const unsigned char*)key; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    
+    // Final mix so nearby names spread over the whole ring
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int compare_points(const void* a, const void* b) {
+    const ShardPoint* pa = (const ShardPoint*)a;
+    const ShardPoint* pb = (const ShardPoint*)b;
+    if (pa->point != pb->point) {
+        return pa->point < pb->point ? -1 : 1;
+    }
+    return pa->shard - pb->shard;
+}
+
+static int build_ring(ShardMap* map) {
+    map->ring_size = map->count * SHARD_VNODES;
+    map->ring = (ShardPoint*)malloc(map->ring_size * sizeof(ShardPoint));
+    if (!map->ring) {
+        return -1;
+    }
+    
+    for (int s = 0; s < map->count; s++) {
+        for (int v = 0; v < SHARD_VNODES; v++) {
+            char name[96];
+            snprintf(name, sizeof(name), "%s:%d#%d", map->shards[s].host, map->shards[s].port, v);
+            map->ring[s * SHARD_VNODES + v].point = shard_hash(name);
+            map->ring[s * SHARD_VNODES + v].shard = s;
+        }
+    }
+    qsort(map->ring, map->ring_size, sizeof(ShardPoint), compare_points);
+    return 0;
+}
+
+ShardMap* shard_map_parse(const char* spec) {
+    if (!spec || *spec == '\0') {
+        return NULL;
+    }
+    
+    ShardMap* map = (ShardMap*)calloc(1, sizeof(ShardMap));
+    if (!map) {
+        return NULL;
+    }
+    
+    char copy[BUFFER_SIZE];
+    strncpy(copy, spec, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    
+    char* save = NULL;
+    for (char* entry = strtok_r(copy, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+        ShardAddr addr;
+        if (map->count == SHARD_MAX ||
+            sscanf(entry, " %63[^:]:%d", addr.host, &addr.port) != 2 ||
+            addr.port <= 0 || addr.port > 65535) {
+            log_message("SHARD_MAP", "ERROR", "Invalid shard map entry: %s", entry);
+            free(map);
+            return NULL;
+        }
+        map->shards[map->count++] = addr;
+    }
+    
+    if (map->count == 0 || build_ring(map) < 0) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+ShardMap* shard_map_from_env() {
+    const char* spec = getenv("NM_SHARDS");
+    if (spec && *spec) {
+        ShardMap* map = shard_map_parse(spec);
+        if (map) {
+            return map;
+        }
+        log_message("SHARD_MAP", "WARNING", "Ignoring NM_SHARDS, using a single Name Server");
+    }
+    
+    char single[64];
+    snprintf(single, sizeof(single), "127.0.0.1:%d", NM_PORT);
+    return shard_map_parse(single);
+}
+
+void shard_map_free(ShardMap* map) {
+    if (!map) {
+        return;
+    }
+    free(map->ring);
+    free(map);
+}
+
+int shard_map_lookup(const ShardMap* map, const char* key) {
+    if (map->count == 1) {
+        return 0;
+    }
+    
+    uint64_t h = shard_hash(key);
+    int lo = 0, hi = map->ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->ring[mid].point < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return map->ring[lo == map->ring_size ? 0 : lo].shard;
+}
+
+int shard_map_find(const ShardMap* map, const char* host, int port) {
+    for (int i = 0; i < map->count; i++) {
+        if (map->shards[i].port == port && strcmp(map->shards[i].host, host) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void shard_map_format(const ShardMap* map, char* out, size_t len) {
+    size_t pos = 0;
+    out[0] = '\0';
+    for (int i = 0; i < map->count && pos < len; i++) {
+        pos += snprintf(out + pos, len - pos, "%s%s:%d", i > 0 ? "," : "",
+                        map->shards[i].host, map->shards[i].port);
+    }
+}
@@ -0,0 +1,436 @@
+#include "../include/slab.h"
+
+struct SlabPool {
+    const char* name;
+    size_t object_size;     // Rounded up to 16 bytes
+    size_t slab_size;
+    int index;
+    int passthrough;        // SLAB_DISABLE: plain malloc and free
+    pthread_mutex_t lock;
+    void* free_list;        // Linked through each object's first word
+    char* carve;            // Not yet handed out part of the newest slab
+    size_t carve_left;
+    size_t slabs;
+};
+
+static SlabPool pools[SLAB_MAX_POOLS];
+static int pool_count = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One thread's free objects, allocation counters and arena. Only the
+// owning thread writes; readers hold threads_lock, which also keeps an
+// exiting thread from freeing its state under them.
+typedef struct {
+    void* objects[SLAB_CACHE_OBJECTS];
+    int count;
+    unsigned long long allocs;
+    unsigned long long frees;
+} SlabCache;
+
+typedef struct AllocThread {
+    SlabCache caches[SLAB_MAX_POOLS];
+    Arena arena;
+    struct AllocThread* next;
+} AllocThread;
+
+static __thread AllocThread* local_thread = NULL;
+static AllocThread* live_threads = NULL;
+static AllocThread retired;  // Counters left behind by exited threads
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static size_t arena_block_size = 0;
+
+#define BUMP(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(16)));
+};
+
+static size_t round16(size_t n) {
+    return (n + 15) & ~(size_t)15;
+}
+
+SlabPool* slab_pool_create(const char* name, size_t object_size) {
+    pthread_mutex_lock(&pools_lock);
+    if (pool_count == SLAB_MAX_POOLS) {
+        pthread_mutex_unlock(&pools_lock);
+        log_message("SLAB", "ERROR", "No pool left for %s", name);
+        return NULL;
+    }
+
+    SlabPool* pool = &pools[pool_count];
+    pool->name = name;
+    pool->object_size = round16(object_size < sizeof(void*) ? sizeof(void*) : object_size);
+    pool->slab_size = pool->object_size * 8 > SLAB_SIZE ? pool->object_size * 8 : SLAB_SIZE;
+    pool->index = pool_count;
+    pool->passthrough = config_get_int("SLAB_DISABLE", 0) != 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free_list = NULL;
+    pool->carve = NULL;
+    pool->carve_left = 0;
+    pool->slabs = 0;
+    __atomic_store_n(&pool_count, pool_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+// Caller holds pool->lock
+static void* pool_take(SlabPool* pool) {
+    void* object = pool->free_list;
+    if (object) {
+        pool->free_list = *(void**)object;
+        return object;
+    }
+
+    if (pool->carve_left < pool->object_size) {
+        char* slab = (char*)malloc(pool->slab_size);
+        if (!slab) {
+            return NULL;
+        }
+        pool->carve = slab;
+        pool->carve_left = pool->slab_size;
+        pool->slabs++;
+    }
+    object = pool->carve;
+    pool->carve += pool->object_size;
+    pool->carve_left -= pool->object_size;
+    return object;
+}
+
+// Caller holds pool->lock
+static void pool_put(SlabPool* pool, void* object) {
+    *(void**)object = pool->free_list;
+    pool->free_list = object;
+}
+
+// Thread exit: hand cached objects back and keep the counters
+static void release_thread(void* arg) {
+    AllocThread* thread = (AllocThread*)arg;
+
+    for (int i = 0; i < SLAB_MAX_POOLS; i++) {
+        SlabCache* cache = &thread->caches[i];
+        if (cache->count > 0) {
+            pthread_mutex_lock(&pools[i].lock);
+            for (int j = 0; j < cache->count; j++) {
+                pool_put(&pools[i], cache->objects[j]);
+            }
+            pthread_mutex_unlock(&pools[i].lock);
+        }
+    }
+
+    Arena* arena = &thread->arena;
+    for (ArenaBlock* block = arena->blocks; block;) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    pthread_mutex_lock(&threads_lock);
+    for (AllocThread** p = &live_threads; *p; p = &(*p)->next) {
+        if (*p == thread) {
+            *p = thread->next;
+            break;
+        }
+    }
+    for (int i = 0; i < SLAB_MAX_POOLS; i++) {
+        retired.caches[i].allocs += thread->caches[i].allocs;
+        retired.caches[i].frees += thread->caches[i].frees;
+    }
+    retired.arena.allocs += arena->allocs;
+    retired.arena.resets += arena->resets;
+    retired.arena.extra_blocks += arena->extra_blocks;
+    if (arena->peak_bytes > retired.arena.peak_bytes) {
+        retired.arena.peak_bytes = arena->peak_bytes;
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    if (local_thread == thread) {
+        local_thread = NULL;
+    }
+    free(thread);
+}
+
+static void make_key() {
+    pthread_key_create(&thread_key, release_thread);
+    arena_block_size = (size_t)config_get_int("ARENA_BLOCK_KB", 64) * 1024;
+    if (arena_block_size < 4096) {
+        arena_block_size = 4096;
+    }
+}
+
+static AllocThread* local() {
+    if (!local_thread) {
+        pthread_once(&key_once, make_key);
+        AllocThread* thread = (AllocThread*)calloc(1, sizeof(AllocThread));
+        if (!thread) {
+            return NULL;
+        }
+        pthread_mutex_lock(&threads_lock);
+        thread->next = live_threads;
+        live_threads = thread;
+        pthread_mutex_unlock(&threads_lock);
+        pthread_setspecific(thread_key, thread);
+        local_thread = thread;
+    }
+    return local_thread;
+}
+
+void* slab_alloc(SlabPool* pool) {
+    if (!pool) {
+        return NULL;
+    }
+    AllocThread* thread = local();
+    if (pool->passthrough || !thread) {
+        void* object = malloc(pool->object_size);
+        if (object && thread) {
+            BUMP(thread->caches[pool->index].allocs, 1);
+        }
+        return object;
+    }
+
+    SlabCache* cache = &thread->caches[pool->index];
+    if (cache->count == 0) {
+        // Refill half the cache at once
+        pthread_mutex_lock(&pool->lock);
+        while (cache->count < SLAB_CACHE_OBJECTS / 2) {
+            void* object = pool_take(pool);
+            if (!object) {
+                break;
+            }
+            cache->objects[cache->count] = object;
+            __atomic_store_n(&cache->count, cache->count + 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (cache->count == 0) {
+            return NULL;
+        }
+    }
+
+    __atomic_store_n(&cache->count, cache->count - 1, __ATOMIC_RELAXED);
+    BUMP(cache->allocs, 1);
+    return cache->objects[cache->count];
+}
+
+void* slab_zalloc(SlabPool* pool) {
+    void* object = slab_alloc(pool);
+    if (object) {
+        memset(object, 0, pool->object_size);
+    }
+    return object;
+}
+
+void slab_free(SlabPool* pool, void* object) {
+    if (!pool || !object) {
+        return;
+    }
+    AllocThread* thread = local();
+    if (pool->passthrough) {
+        free(object);
+        if (thread) {
+            BUMP(thread->caches[pool->index].frees, 1);
+        }
+        return;
+    }
+    if (!thread) {
+        pthread_mutex_lock(&pool->lock);
+        pool_put(pool, object);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    SlabCache* cache = &thread->caches[pool->index];
+    if (cache->count == SLAB_CACHE_OBJECTS) {
+        // Spill the older half back to the pool
+        pthread_mutex_lock(&pool->lock);
+        for (int i = 0; i < SLAB_CACHE_OBJECTS / 2; i++) {
+            pool_put(pool, cache->objects[i]);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        memmove(cache->objects, cache->objects + SLAB_CACHE_OBJECTS / 2,
+                (SLAB_CACHE_OBJECTS / 2) * sizeof(void*));
+        __atomic_store_n(&cache->count, SLAB_CACHE_OBJECTS / 2, __ATOMIC_RELAXED);
+    }
+
+    cache->objects[cache->count] = object;
+    __atomic_store_n(&cache->count, cache->count + 1, __ATOMIC_RELAXED);
+    BUMP(cache->frees, 1);
+}
+
+int slab_get_stats(SlabStats* out, int max) {
+    int count = __atomic_load_n(&pool_count, __ATOMIC_ACQUIRE);
+    if (count > max) {
+        count = max;
+    }
+
+    for (int i = 0; i < count; i++) {
+        memset(&out[i], 0, sizeof(SlabStats));
+        out[i].name = pools[i].name;
+        out[i].object_size = pools[i].object_size;
+        pthread_mutex_lock(&pools[i].lock);
+        out[i].slabs = pools[i].slabs;
+        out[i].reserved_bytes = pools[i].slabs * pools[i].slab_size;
+        pthread_mutex_unlock(&pools[i].lock);
+    }
+
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < count; i++) {
+        out[i].allocs = retired.caches[i].allocs;
+        out[i].frees = retired.caches[i].frees;
+    }
+    for (AllocThread* thread = live_threads; thread; thread = thread->next) {
+        for (int i = 0; i < count; i++) {
+            SlabCache* cache = &thread->caches[i];
+            out[i].allocs += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+            out[i].frees += __atomic_load_n(&cache->frees, __ATOMIC_RELAXED);
+            out[i].cached += __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    for (int i = 0; i < count; i++) {
+        out[i].in_use = (long long)(out[i].allocs - out[i].frees);
+    }
+    return count;
+}
+
+Arena* request_arena() {
+    AllocThread* thread = local();
+    return thread ? &thread->arena : NULL;
+}
+
+void* arena_alloc(Arena* arena, size_t len) {
+    if (!arena) {
+        return NULL;
+    }
+    len = round16(len ? len : 1);
+
+    ArenaBlock* block = arena->blocks;
+    if (!block || block->size - block->used < len) {
+        size_t size = len > arena_block_size ? len : arena_block_size;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + size);
+        if (!block) {
+            return NULL;
+        }
+        block->size = size;
+        block->used = 0;
+        if (arena->blocks) {
+            BUMP(arena->extra_blocks, 1);
+        }
+        block->next = arena->blocks;
+        arena->blocks = block;
+        BUMP(arena->reserved_bytes, sizeof(ArenaBlock) + size);
+    }
+
+    void* p = block->data + block->used;
+    block->used += len;
+    arena->used += len;
+    BUMP(arena->allocs, 1);
+    return p;
+}
+
+void arena_reset(Arena* arena) {
+    if (!arena || !arena->blocks) {
+        return;
+    }
+
+    if (arena->used > arena->peak_bytes) {
+        __atomic_store_n(&arena->peak_bytes, arena->used, __ATOMIC_RELAXED);
+    }
+
+    // Keep the first block, which is the last in the list
+    ArenaBlock* block = arena->blocks;
+    size_t released = 0;
+    while (block->next) {
+        ArenaBlock* next = block->next;
+        released += sizeof(ArenaBlock) + block->size;
+        free(block);
+        block = next;
+    }
+    block->used = 0;
+    arena->blocks = block;
+    arena->used = 0;
+    __atomic_store_n(&arena->reserved_bytes, arena->reserved_bytes - released, __ATOMIC_RELAXED);
+    BUMP(arena->resets, 1);
+}
+
+void arena_get_stats(ArenaStats* stats) {
+    memset(stats, 0, sizeof(ArenaStats));
+
+    pthread_mutex_lock(&threads_lock);
+    stats->allocs = retired.arena.allocs;
+    stats->resets = retired.arena.resets;
+    stats->extra_blocks = retired.arena.extra_blocks;
+    stats->peak_request_bytes = retired.arena.peak_bytes;
+    for (AllocThread* thread = live_threads; thread; thread = thread->next) {
+        Arena* arena = &thread->arena;
+        size_t reserved = __atomic_load_n(&arena->reserved_bytes, __ATOMIC_RELAXED);
+        if (reserved > 0) {
+            stats->arenas++;
+        }
+        stats->reserved_bytes += reserved;
+        stats->allocs += __atomic_load_n(&arena->allocs, __ATOMIC_RELAXED);
+        stats->resets += __atomic_load_n(&arena->resets, __ATOMIC_RELAXED);
+        stats->extra_blocks += __atomic_load_n(&arena->extra_blocks, __ATOMIC_RELAXED);
+        size_t peak = __atomic_load_n(&arena->peak_bytes, __ATOMIC_RELAXED);
+        if (peak > stats->peak_request_bytes) {
+            stats->peak_request_bytes = peak;
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+void slab_render(MetricsText* text, const char* prefix) {
+    SlabStats pools_stats[SLAB_MAX_POOLS];
+    int count = slab_get_stats(pools_stats, SLAB_MAX_POOLS);
+
+    static const struct {
+        const char* name;
+        const char* type;
+        const char* help;
+    } families[] = {
+        {"slab_objects_in_use", "gauge", "Objects allocated from the pool and not yet freed."},
+        {"slab_objects_cached", "gauge", "Free objects held in thread caches."},
+        {"slab_allocations_total", "counter", "Objects allocated from the pool."},
+        {"slab_object_bytes", "gauge", "Size of one object, rounded up."},
+        {"slab_slabs", "gauge", "Slabs the pool has carved objects from."},
+        {"slab_reserved_bytes", "gauge", "Memory held by the pool's slabs."},
+    };
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+        metrics_text_printf(text, "# HELP %s_%s %s\n# TYPE %s_%s %s\n", prefix, families[f].name,
+                            families[f].help, prefix, families[f].name, families[f].type);
+        for (int i = 0; i < count; i++) {
+            const SlabStats* s = &pools_stats[i];
+            unsigned long long values[] = {(unsigned long long)(s->in_use > 0 ? s->in_use : 0),
+                                           s->cached, s->allocs, s->object_size, s->slabs,
+                                           s->reserved_bytes};
+            metrics_text_printf(text, "%s_%s{pool=\"%s\"} %llu\n", prefix, families[f].name,
+                                s->name, values[f]);
+        }
+    }
+
+    ArenaStats arena;
+    arena_get_stats(&arena);
+    metrics_text_printf(text,
+                        "# HELP %s_arena_threads Threads holding a request arena.\n"
+                        "# TYPE %s_arena_threads gauge\n%s_arena_threads %d\n"
+                        "# TYPE %s_arena_reserved_bytes gauge\n%s_arena_reserved_bytes %zu\n"
+                        "# TYPE %s_arena_allocations_total counter\n"
+                        "%s_arena_allocations_total %llu\n"
+                        "# TYPE %s_arena_resets_total counter\n%s_arena_resets_total %llu\n"
+                        "# HELP %s_arena_extra_blocks_total Blocks allocated because a request "
+                        "outgrew its thread's first block.\n"
+                        "# TYPE %s_arena_extra_blocks_total counter\n"
+                        "%s_arena_extra_blocks_total %llu\n"
+                        "# HELP %s_arena_peak_request_bytes Most arena memory one request used.\n"
+                        "# TYPE %s_arena_peak_request_bytes gauge\n"
+                        "%s_arena_peak_request_bytes %zu\n",
+                        prefix, prefix, prefix, arena.arenas, prefix, prefix, arena.reserved_bytes,
+                        prefix, prefix, arena.allocs, prefix, prefix, arena.resets, prefix, prefix,
+                        prefix, arena.extra_blocks, prefix, prefix, prefix,
+                        arena.peak_request_bytes);
+}
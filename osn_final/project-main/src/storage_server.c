@@ -1,42 +1,47 @@
+#define _GNU_SOURCE  // copy_file_range
 #include "../include/common.h"
 #include "../include/sentence_parser.h"
+#include "../include/sentence_index.h"
 #include "../include/file_locking.h"
+#include "../include/hashmap.h"
+#include "../include/shard_map.h"
+#include "../include/lease.h"
+#include "../include/history.h"
+#include "../include/durability.h"
+#include "../include/executor.h"
+#include "../include/metrics.h"
+#include "../include/slab.h"
+#include "../include/cold_store.h"
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/statvfs.h>
 #include <glib.h>
 
 #define SS_CLIENT_PORT 7000
 #define SS_ID "SS1"
 
+// Identity, overridable (SS_ID, SS_PORT) to run several SS on one host
+static const char* ss_id = SS_ID;
+static int ss_port = SS_CLIENT_PORT;
+
 int client_server_socket = -1;
 int running = 1;
+static ShardMap* nm_shards = NULL;  // Name Servers this SS registers with
 
-// Connection pool for clients
-typedef struct {
-    int fd;
-    time_t last_used;
-    bool in_use;
-    pthread_mutex_t mutex;
-} connection_t;
-
-static connection_t* connection_pool = NULL;
-static int connection_pool_size = 0;
-static pthread_mutex_t connection_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Cleanup function for connection pool
-static void cleanup_connection_pool() {
-    if (connection_pool) {
-        for (int i = 0; i < connection_pool_size; i++) {
-            if (connection_pool[i].fd >= 0) {
-                close(connection_pool[i].fd);
-                pthread_mutex_destroy(&connection_pool[i].mutex);
-            }
-        }
-        g_free(connection_pool);
-        connection_pool = NULL;
-        connection_pool_size = 0;
-    }
-}
+static void metadata_flush();
+static void replication_enqueue(const char* filename);
+static void replication_set_targets(const char* spec);
+static void replication_fill_heartbeat(Heartbeat* hb);
+static unsigned long long next_version(unsigned long long previous);
+static __thread int repl_applying = 0;  // Applying a replica update: do not forward it
+static void location_forget_move(const char* filename);
+static uint16_t current_location_gen();
+static void new_location_gen();
+static int build_inventory(int shard, MetricsText* text);
 
 void cleanup_ss() {
     running = 0;
@@ -47,139 +52,15 @@ void cleanup_ss() {
         client_server_socket = -1;
     }
     
-    // Clean up connection pool
-    cleanup_connection_pool();
+    // Write out access times still held in memory
+    metadata_flush();
     
     // Clean up file locking system
     file_locking_cleanup();
     
-    // Clean up any other resources
-    pthread_mutex_destroy(&connection_pool_mutex);
-    
     log_message("STORAGE_SERVER", "INFO", "Storage Server shutdown complete");
 }
 
-// Initialize the connection pool with a given size
-static int init_connection_pool(int size) {
-    if (size <= 0) {
-        log_message("CONN_POOL", "ERROR", "Invalid connection pool size: %d", size);
-        return -1;
-    }
-    
-    pthread_mutex_lock(&connection_pool_mutex);
-    
-    // Clean up existing pool if any
-    cleanup_connection_pool();
-    
-    // Allocate new pool
-    connection_pool = g_malloc0_n(size, sizeof(connection_t));
-    if (!connection_pool) {
-        log_message("CONN_POOL", "ERROR", "Failed to allocate connection pool");
-        pthread_mutex_unlock(&connection_pool_mutex);
-        return -1;
-    }
-    
-    connection_pool_size = size;
-    
-    // Initialize pool entries
-    for (int i = 0; i < size; i++) {
-        connection_pool[i].fd = -1;
-        connection_pool[i].in_use = false;
-        connection_pool[i].last_used = 0;
-        if (pthread_mutex_init(&connection_pool[i].mutex, NULL) != 0) {
-            log_message("CONN_POOL", "ERROR", "Failed to initialize mutex for connection %d", i);
-            // Clean up any initialized mutexes
-            while (--i >= 0) {
-                pthread_mutex_destroy(&connection_pool[i].mutex);
-            }
-            g_free(connection_pool);
-            connection_pool = NULL;
-            connection_pool_size = 0;
-            pthread_mutex_unlock(&connection_pool_mutex);
-            return -1;
-        }
-    }
-    
-    log_message("CONN_POOL", "INFO", "Initialized connection pool with %d connections", size);
-    pthread_mutex_unlock(&connection_pool_mutex);
-    return 0;
-}
-
-// Get an available connection from the pool
-static connection_t* get_connection() {
-    connection_t* conn = NULL;
-    
-    pthread_mutex_lock(&connection_pool_mutex);
-    
-    // Try to find an available connection
-    for (int i = 0; i < connection_pool_size; i++) {
-        if (!connection_pool[i].in_use) {
-            conn = &connection_pool[i];
-            conn->in_use = true;
-            conn->last_used = time(NULL);
-            pthread_mutex_lock(&conn->mutex);
-            break;
-        }
-    }
-    
-    pthread_mutex_unlock(&connection_pool_mutex);
-    
-    if (!conn) {
-        log_message("CONN_POOL", "WARNING", "No available connections in pool");
-    }
-    
-    return conn;
-}
-
-// Release a connection back to the pool
-static void release_connection(connection_t* conn) {
-    if (!conn) return;
-    
-    // Reset connection state
-    conn->last_used = time(NULL);
-    conn->in_use = false;
-    
-    // Unlock the connection's mutex
-    pthread_mutex_unlock(&conn->mutex);
-}
-
-// Clean up idle connections that haven't been used for more than timeout_sec seconds
-static void cleanup_idle_connections(int timeout_sec) {
-    if (timeout_sec <= 0) return;
-    
-    time_t now = time(NULL);
-    int cleaned = 0;
-    
-    pthread_mutex_lock(&connection_pool_mutex);
-    
-    for (int i = 0; i < connection_pool_size; i++) {
-        if (connection_pool[i].in_use && 
-            (now - connection_pool[i].last_used) > timeout_sec) {
-            
-            pthread_mutex_lock(&connection_pool[i].mutex);
-            
-            // Close the socket if it's still open
-            if (connection_pool[i].fd >= 0) {
-                close(connection_pool[i].fd);
-                connection_pool[i].fd = -1;
-            }
-            
-            connection_pool[i].in_use = false;
-            connection_pool[i].last_used = 0;
-            
-            pthread_mutex_unlock(&connection_pool[i].mutex);
-            
-            cleaned++;
-        }
-    }
-    
-    if (cleaned > 0) {
-        log_message("CONN_POOL", "DEBUG", "Cleaned up %d idle connections", cleaned);
-    }
-    
-    pthread_mutex_unlock(&connection_pool_mutex);
-}
-
 void signal_handler_ss(int signum) {
     log_message("STORAGE_SERVER", "INFO", "Received signal %d, shutting down...", signum);
     cleanup_ss();
@@ -213,15 +94,161 @@ static int set_keepalive(int sockfd, int keepalive, int keepidle, int keepintvl,
     return 0;
 }
 
-// Thread function to handle NM registration and heartbeats
+// Load report
+//
+// Sent with every heartbeat for the Name Server's placement and rebalancing:
+// bytes stored, free disk, requests per second and p99 request latency over
+// the window since the previous report. Latencies are counted in log2
+// buckets of microseconds, so the p99 is an upper bound within 2x.
+#define LATENCY_BUCKETS 40
+
+static unsigned long long load_requests = 0;
+static unsigned long long load_latency[LATENCY_BUCKETS];
+static struct timeval load_window_start;
+static unsigned long long load_bytes = 0, load_free = 0, load_p99 = 0;
+static double load_rate = 0;
+static time_t load_report_at = 0;
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void record_request(const struct timeval* start, int command, int error) {
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    long long usec = (end.tv_sec - start->tv_sec) * 1000000LL + (end.tv_usec - start->tv_usec);
+    metrics_record(command, usec, error);
+    
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (1LL << bucket) <= usec) {
+        bucket++;
+    }
+    __sync_fetch_and_add(&load_latency[bucket], 1);
+    __sync_fetch_and_add(&load_requests, 1);
+}
+
+static unsigned long long dir_bytes(const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        return 0;
+    }
+    
+    unsigned long long total = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        
+        char path[MAX_PATH];
+        snprintf(path, MAX_PATH, "%s/%s", dir, entry->d_name);
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+        total += S_ISDIR(st.st_mode) ? dir_bytes(path) : (unsigned long long)st.st_size;
+    }
+    
+    closedir(d);
+    return total;
+}
+
+// Fills the load fields of hb. Recomputed at most once a second, so every
+// shard's heartbeat thread can ask.
+static void load_fill_heartbeat(Heartbeat* hb) {
+    pthread_mutex_lock(&load_mutex);
+    
+    time_t now = time(NULL);
+    if (now != load_report_at) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        double elapsed = (tv.tv_sec - load_window_start.tv_sec) +
+                         (tv.tv_usec - load_window_start.tv_usec) / 1e6;
+        load_window_start = tv;
+        
+        unsigned long long counts[LATENCY_BUCKETS], total = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            counts[i] = __sync_fetch_and_and(&load_latency[i], 0);
+            total += counts[i];
+        }
+        unsigned long long requests = __sync_fetch_and_and(&load_requests, 0);
+        
+        unsigned long long p99 = 0, seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS && total > 0; i++) {
+            seen += counts[i];
+            if (seen * 100 >= total * 99) {
+                p99 = 1ULL << i;
+                break;
+            }
+        }
+        
+        unsigned long long free_bytes = 0;
+        struct statvfs vfs;
+        if (statvfs("data", &vfs) == 0) {
+            free_bytes = (unsigned long long)vfs.f_bavail * vfs.f_frsize;
+        }
+        
+        load_bytes = dir_bytes("data/files") + dir_bytes("data/cold");
+        load_free = free_bytes;
+        load_rate = elapsed > 0 ? requests / elapsed : 0.0;
+        load_p99 = p99;
+        load_report_at = now;
+    }
+    hb->bytes_stored = load_bytes;
+    hb->free_bytes = load_free;
+    hb->request_rate_milli = (uint32_t)(load_rate * 1000);
+    hb->p99_us = load_p99 > UINT32_MAX ? UINT32_MAX : (uint32_t)load_p99;
+    
+    pthread_mutex_unlock(&load_mutex);
+}
+
+static void sleep_ms(long long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR && running) {
+    }
+}
+
+// Sleep before reconnecting to a Name Server: exponential backoff with full
+// jitter (uniform in [0, min(SS_RECONNECT_MAX_MS, SS_RECONNECT_BASE_MS << attempt)]),
+// so SS that all lost the same NM do not return in one burst
+static void reconnect_backoff(int* attempt, unsigned int* seed) {
+    int base_ms = config_get_int("SS_RECONNECT_BASE_MS", 1000);
+    int max_ms = config_get_int("SS_RECONNECT_MAX_MS", 30000);
+    if (base_ms <= 0) {
+        base_ms = 1000;
+    }
+    
+    long long window = (long long)base_ms << (*attempt < 16 ? *attempt : 16);
+    if (window > max_ms) {
+        window = max_ms;
+    }
+    if (*attempt < 16) {
+        (*attempt)++;
+    }
+    
+    sleep_ms(window > 0 ? rand_r(seed) % (window + 1) : 0);
+}
+
+// Thread function to handle NM registration and heartbeats. One runs per
+// Name Server shard: any shard may place files on this SS.
+//
+// Heartbeats are a fixed-size Heartbeat (load and replication state) every
+// SS_HEARTBEAT_MS (default 5000, +-10% jitter). The NM declares the SS down
+// after a few missed intervals; a lost or rejected heartbeat makes this
+// thread reconnect and register again.
 static void* nm_heartbeat_thread(void* arg) {
-    (void)arg; // Unused parameter
+    const ShardAddr* nm = (const ShardAddr*)arg;
+    unsigned int seed = (unsigned int)getpid() ^ (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)arg;
+    int attempt = 0;
+    uint32_t seq = 0;
+    
+    int interval_ms = config_get_int("SS_HEARTBEAT_MS", 5000);
+    if (interval_ms <= 0) {
+        interval_ms = 5000;
+    }
     
     while (running) {
         int nm_socket = socket(AF_INET, SOCK_STREAM, 0);
         if (nm_socket < 0) {
             log_message("NM_HEARTBEAT", "ERROR", "Failed to create socket for NM: %s", strerror(errno));
-            sleep(5); // Wait before retrying
+            reconnect_backoff(&attempt, &seed);
             continue;
         }
         
@@ -237,8 +264,8 @@ static void* nm_heartbeat_thread(void* arg) {
         struct sockaddr_in nm_addr;
         memset(&nm_addr, 0, sizeof(nm_addr));
         nm_addr.sin_family = AF_INET;
-        nm_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-        nm_addr.sin_port = htons(NM_PORT);
+        nm_addr.sin_addr.s_addr = inet_addr(nm->host);
+        nm_addr.sin_port = htons(nm->port);
         
         // Set connection timeout
         struct timeval timeout;
@@ -249,88 +276,146 @@ static void* nm_heartbeat_thread(void* arg) {
         
         // Connect to NM
         if (connect(nm_socket, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
-            log_message("NM_HEARTBEAT", "ERROR", "Failed to connect to NM: %s", strerror(errno));
+            log_message("NM_HEARTBEAT", "ERROR", "Failed to connect to NM %s:%d: %s",
+                        nm->host, nm->port, strerror(errno));
             close(nm_socket);
-            sleep(5); // Wait before retrying
+            reconnect_backoff(&attempt, &seed);
             continue;
         }
         
-        log_message("NM_HEARTBEAT", "INFO", "Connected to Naming Server");
+        log_message("NM_HEARTBEAT", "INFO", "Connected to Naming Server %s:%d", nm->host, nm->port);
         
-        // Send registration message
+        // Send registration message. Unless talking the legacy wire format,
+        // it carries this shard's part of the file inventory in the body,
+        // one line per file after the registration line.
+        uint16_t registered_gen = current_location_gen();
         Message msg;
         memset(&msg, 0, sizeof(Message));
         msg.msg_type = MSG_REGISTER_SS;
-        snprintf(msg.data, BUFFER_SIZE, "%s|127.0.0.1|%d|%d", SS_ID, 6000, SS_CLIENT_PORT);
+        snprintf(msg.data, BUFFER_SIZE, "%s|127.0.0.1|%d|%d|%u", ss_id, 6000, ss_port, registered_gen);
+        
+        int files = -1;
+        MetricsText inventory = {NULL, 0, 0};
+        if (message_max_payload(&msg) > BUFFER_SIZE) {
+            metrics_text_printf(&inventory, "%s\n", msg.data);
+            files = build_inventory((int)(nm - nm_shards->shards), &inventory);
+            if (inventory.len <= FRAME_MAX_BODY) {
+                msg.body = inventory.data;
+                msg.body_len = inventory.len;
+            } else {
+                log_message("NM_HEARTBEAT", "WARNING", "Inventory of %d files is too large to send",
+                            files);
+                metrics_text_free(&inventory);
+                files = -1;
+            }
+        }
         
-        if (send(nm_socket, &msg, sizeof(Message), 0) < 0) {
-            log_message("NM_HEARTBEAT", "ERROR", "Failed to send registration to NM: %s", strerror(errno));
+        Message reg_response;
+        memset(&reg_response, 0, sizeof(Message));
+        int registered = send_message(nm_socket, &msg) >= 0 &&
+                         receive_message(nm_socket, &reg_response) >= 0 &&
+                         reg_response.error_code == SUCCESS;
+        message_free_body(&msg);
+        if (!registered) {
+            log_message("NM_HEARTBEAT", "ERROR", "Failed to register with NM");
+            message_free_body(&reg_response);
             close(nm_socket);
-            sleep(5); // Wait before retrying
+            reconnect_backoff(&attempt, &seed);
             continue;
         }
+        attempt = 0;
         
-        log_message("NM_HEARTBEAT", "INFO", "Successfully registered with Naming Server");
+        if (files >= 0) {
+            log_message("NM_HEARTBEAT", "INFO", "Registered with Naming Server %s:%d: %s",
+                        nm->host, nm->port, message_payload(&reg_response));
+        } else {
+            log_message("NM_HEARTBEAT", "INFO", "Successfully registered with Naming Server %s:%d",
+                        nm->host, nm->port);
+        }
+        message_free_body(&reg_response);
         
-        // Heartbeat loop
+        // Heartbeat loop. The first one goes out right away: its ack carries
+        // the replicas to ship changes to.
         while (running) {
-            // Send heartbeat every 30 seconds
-            sleep(30);
+            Heartbeat hb;
+            memset(&hb, 0, sizeof(hb));
+            hb.seq = ++seq;
+            hb.pid = (uint32_t)getpid();
+            hb.interval_ms = (uint32_t)interval_ms;
+            snprintf(hb.ss_id, sizeof(hb.ss_id), "%s", ss_id);
+            load_fill_heartbeat(&hb);
+            replication_fill_heartbeat(&hb);
             
             Message hb_msg;
             memset(&hb_msg, 0, sizeof(Message));
             hb_msg.msg_type = MSG_HEARTBEAT;
-            snprintf(hb_msg.data, BUFFER_SIZE, "%s|ALIVE|%d", SS_ID, getpid());
+            heartbeat_encode(&hb, &hb_msg);
             
-            if (send(nm_socket, &hb_msg, sizeof(Message), 0) < 0) {
-                log_message("NM_HEARTBEAT", "ERROR", "Failed to send heartbeat to NM: %s", strerror(errno));
+            if (send_message(nm_socket, &hb_msg) < 0) {
+                log_message("NM_HEARTBEAT", "ERROR", "Failed to send heartbeat to NM");
                 break; // Exit heartbeat loop to reconnect
             }
             
             // Wait for acknowledgment (with timeout handled by SO_RCVTIMEO)
             Message ack_msg;
-            ssize_t bytes_received = recv(nm_socket, &ack_msg, sizeof(Message), 0);
-            
-            if (bytes_received <= 0) {
-                if (bytes_received == 0) {
-                    log_message("NM_HEARTBEAT", "WARNING", "Naming Server closed the connection");
-                } else {
-                    log_message("NM_HEARTBEAT", "ERROR", "Error receiving heartbeat ack: %s", strerror(errno));
-                }
+            if (receive_message(nm_socket, &ack_msg) < 0) {
+                log_message("NM_HEARTBEAT", "WARNING", "Lost connection to Naming Server");
                 break; // Exit heartbeat loop to reconnect
             }
             
-            if (ack_msg.msg_type == MSG_ACK) {
-                log_message("NM_HEARTBEAT", "DEBUG", "Received heartbeat ack from Naming Server");
+            int rejected = ack_msg.msg_type != MSG_ACK || ack_msg.error_code != SUCCESS;
+            if (!rejected && nm == &nm_shards->shards[0]) {
+                // Every shard sees the same SS, but registration epochs are per
+                // shard: take the replica assignment from the first one only
+                replication_set_targets(ack_msg.data);
+            }
+            message_free_body(&ack_msg);
+            if (rejected) {
+                // Clients may hold locations from before it lost track of us
+                log_message("NM_HEARTBEAT", "WARNING", "Naming Server %s:%d rejected heartbeat, registering again",
+                            nm->host, nm->port);
+                new_location_gen();
+                break;
+            }
+            if (current_location_gen() != registered_gen) {
+                log_message("NM_HEARTBEAT", "INFO", "New location generation, registering again with %s:%d",
+                            nm->host, nm->port);
+                break;
             }
+            
+            int jitter = interval_ms / 10;
+            sleep_ms(interval_ms - jitter + (jitter > 0 ? rand_r(&seed) % (2 * jitter + 1) : 0));
         }
         
         // Clean up
         close(nm_socket);
+        reconnect_backoff(&attempt, &seed);
     }
     
     return NULL;
 }
 
 void register_with_nm() {
-    // Initialize the connection pool
-    if (init_connection_pool(MAX_CLIENTS) < 0) {
-        log_message("STORAGE_SERVER", "ERROR", "Failed to initialize connection pool");
-        return;
-    }
-    
     // Initialize file locking system
     file_locking_init();
     
-    // Create heartbeat thread
-    pthread_t heartbeat_tid;
-    if (pthread_create(&heartbeat_tid, NULL, nm_heartbeat_thread, NULL) != 0) {
-        log_message("STORAGE_SERVER", "ERROR", "Failed to create heartbeat thread: %s", strerror(errno));
+    // Create a heartbeat thread per Name Server shard
+    nm_shards = shard_map_from_env();
+    if (!nm_shards) {
+        log_message("STORAGE_SERVER", "ERROR", "No Name Server to register with");
         return;
     }
     
-    // Detach the thread so we don't need to join it
-    pthread_detach(heartbeat_tid);
+    for (int i = 0; i < nm_shards->count; i++) {
+        pthread_t heartbeat_tid;
+        if (pthread_create(&heartbeat_tid, NULL, nm_heartbeat_thread, &nm_shards->shards[i]) != 0) {
+            log_message("STORAGE_SERVER", "ERROR", "Failed to create heartbeat thread: %s", strerror(errno));
+            return;
+        }
+        
+        // Detach the thread so we don't need to join it
+        pthread_detach(heartbeat_tid);
+    }
     
     log_message("STORAGE_SERVER", "INFO", "Started Naming Server registration and heartbeat thread");
 }
@@ -380,6 +465,33 @@ static int ensure_data_directory() {
     return 0;
 }
 
+// Lock two files in strcmp order so crossing COPY requests cannot deadlock.
+// The same name is locked once, for writing if either side writes.
+static void lock_file_pair(const char* a, int a_write, const char* b, int b_write) {
+    int cmp = strcmp(a, b);
+    if (cmp == 0) {
+        (a_write || b_write) ? file_write_lock(a) : file_read_lock(a);
+        return;
+    }
+    
+    const char* first = cmp < 0 ? a : b;
+    const char* second = cmp < 0 ? b : a;
+    int first_write = cmp < 0 ? a_write : b_write;
+    int second_write = cmp < 0 ? b_write : a_write;
+    
+    first_write ? file_write_lock(first) : file_read_lock(first);
+    second_write ? file_write_lock(second) : file_read_lock(second);
+}
+
+static void unlock_file_pair(const char* a, const char* b) {
+    file_unlock(a);
+    if (strcmp(a, b) != 0) {
+        file_unlock(b);
+    }
+}
+
+// File I/O helpers below do no locking of their own: handlers hold the
+// per-file lock (file_locking.c, keyed by filename) for the whole request
 int load_file_content(const char* filename, char* content, int max_len) {
     // Validate input parameters
     if (!filename || !content || max_len <= 0) {
@@ -401,12 +513,6 @@ int load_file_content(const char* filename, char* content, int max_len) {
     char filepath[MAX_PATH];
     snprintf(filepath, MAX_PATH, "data/files/%s", filename);
     
-    // Acquire read lock
-    if (file_read_lock(filepath) != 0) {
-        log_message("FILE_OPS", "ERROR", "Failed to acquire read lock for %s", filename);
-        return -1;
-    }
-    
     FILE* fp = NULL;
     int result = -1;
     
@@ -429,8 +535,8 @@ int load_file_content(const char* filename, char* content, int max_len) {
             break;
         }
         
-        // Check if file is too large for our buffer
-        if (file_size >= max_len - 1) {
+        // Check if file (plus terminator) fits in the buffer
+        if (file_size > max_len - 1) {
             log_message("FILE_OPS", "ERROR", "File %s is too large (%ld bytes, max %d)", 
                        filepath, file_size, max_len - 1);
             break;
@@ -454,9 +560,6 @@ int load_file_content(const char* filename, char* content, int max_len) {
         fclose(fp);
     }
     
-    // Release the lock
-    file_unlock(filepath);
-    
     if (result >= 0) {
         log_message("FILE_OPS", "DEBUG", "Successfully read %d bytes from %s", result, filename);
     }
@@ -464,71 +567,155 @@ int load_file_content(const char* filename, char* content, int max_len) {
     return result;
 }
 
-// Save content to a temporary file and then atomically rename it
-static int atomic_write_file(const char* filepath, const char* content, size_t content_len) {
-    char tmp_path[MAX_PATH + 16];
-    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX.tmp", filepath);
+// Create a uniquely named temporary file next to filepath
+static int create_temp_file(const char* filepath, char* tmp_path, size_t tmp_len) {
+    snprintf(tmp_path, tmp_len, "%s.XXXXXX.tmp", filepath);
     
-    // Create a temporary file with a unique name
     int fd = mkstemps(tmp_path, 4); // 4 is the length of ".tmp"
     if (fd < 0) {
         log_message("FILE_OPS", "ERROR", "Failed to create temporary file for %s: %s", 
                    filepath, strerror(errno));
-        return -1;
+    }
+    return fd;
+}
+
+static int write_all_fd(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copy len bytes at offset of src_fd to the current position of dst_fd.
+// copy_file_range keeps the data in the kernel; fall back to pread/write.
+static int copy_fd_range(int src_fd, off_t offset, size_t len, int dst_fd) {
+    while (len > 0) {
+        ssize_t n = copy_file_range(src_fd, &offset, dst_fd, NULL, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len -= n;
     }
     
-    FILE* fp = fdopen(fd, "w");
-    if (!fp) {
-        log_message("FILE_OPS", "ERROR", "Failed to open temporary file %s: %s", 
-                   tmp_path, strerror(errno));
-        close(fd);
-        unlink(tmp_path); // Clean up
+    char buf[16384];
+    while (len > 0) {
+        ssize_t n = pread(src_fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        if (n <= 0 || write_all_fd(dst_fd, buf, n) < 0) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Rename a finished temporary file over filepath. A durable commit also
+// syncs the file and its directory as SS_DURABILITY asks (durability.h).
+// Closes fd; the temporary file is removed on failure.
+static int commit_temp_file(int fd, const char* tmp_path, const char* filepath, int durable) {
+    if (durable) {
+        return durability_commit(fd, tmp_path, filepath);
+    }
+    
+    close(fd);
+    
+    // Atomically rename the temporary file to the target file
+    if (rename(tmp_path, filepath) != 0) {
+        log_message("FILE_OPS", "ERROR", "Failed to rename %s to %s: %s", 
+                   tmp_path, filepath, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Save content to a temporary file and then atomically rename it
+static int atomic_write_file(const char* filepath, const char* content, size_t content_len, int durable) {
+    char tmp_path[MAX_PATH + 16];
+    int fd = create_temp_file(filepath, tmp_path, sizeof(tmp_path));
+    if (fd < 0) {
         return -1;
     }
     
-    // Write content to temporary file
-    size_t written = fwrite(content, 1, content_len, fp);
-    if (ferror(fp) || written != content_len) {
+    if (write_all_fd(fd, content, content_len) < 0) {
         log_message("FILE_OPS", "ERROR", "Failed to write to temporary file %s: %s", 
                    tmp_path, strerror(errno));
-        fclose(fp);
+        close(fd);
         unlink(tmp_path);
         return -1;
     }
     
-    // Ensure all data is written to disk
-    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
-        log_message("FILE_OPS", "ERROR", "Failed to sync temporary file %s: %s", 
-                   tmp_path, strerror(errno));
-        fclose(fp);
-        unlink(tmp_path);
+    return commit_temp_file(fd, tmp_path, filepath, durable);
+}
+
+// One rewritten sentence for splice_write_file
+typedef struct {
+    SentenceSplice splice;
+    const char* text;
+    size_t len;
+} SpliceEdit;
+
+// Replace sentences of filepath (open as src_fd, old_size bytes) as
+// described by edits, sorted by offset, in one new version of the file.
+// Only the new bytes pass through user space. On success st describes the
+// new file.
+static int splice_write_file(const char* filepath, int src_fd, size_t old_size,
+                             const SpliceEdit* edits, int count, struct stat* st) {
+    char tmp_path[MAX_PATH + 16];
+    int fd = create_temp_file(filepath, tmp_path, sizeof(tmp_path));
+    if (fd < 0) {
         return -1;
     }
     
-    fclose(fp);
+    size_t pos = 0;
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        const SentenceSplice* splice = &edits[i].splice;
+        failed = copy_fd_range(src_fd, pos, splice->offset - pos, fd) < 0 ||
+                 (splice->separator && write_all_fd(fd, " ", 1) < 0) ||
+                 write_all_fd(fd, edits[i].text, edits[i].len) < 0;
+        pos = splice->offset + splice->old_length;
+    }
     
-    // Atomically rename the temporary file to the target file
-    if (rename(tmp_path, filepath) != 0) {
-        log_message("FILE_OPS", "ERROR", "Failed to rename %s to %s: %s", 
-                   tmp_path, filepath, strerror(errno));
+    if (failed || copy_fd_range(src_fd, pos, old_size - pos, fd) < 0 || fstat(fd, st) < 0) {
+        log_message("FILE_OPS", "ERROR", "Failed to write to temporary file %s: %s", 
+                   tmp_path, strerror(errno));
+        close(fd);
         unlink(tmp_path);
         return -1;
     }
     
-    // Ensure the directory is synced to disk (important for durability)
-    char dirpath[MAX_PATH];
-    strncpy(dirpath, filepath, MAX_PATH);
-    char* last_slash = strrchr(dirpath, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        int dir_fd = open(dirpath, O_RDONLY);
-        if (dir_fd >= 0) {
-            fsync(dir_fd);
-            close(dir_fd);
-        }
+    return commit_temp_file(fd, tmp_path, filepath, 1);
+}
+
+// Replace filepath with len bytes at offset of src_fd
+static int replace_file_from_fd(const char* filepath, int src_fd, off_t offset, size_t len) {
+    char tmp_path[MAX_PATH + 16];
+    int fd = create_temp_file(filepath, tmp_path, sizeof(tmp_path));
+    if (fd < 0) {
+        return -1;
     }
     
-    return 0;
+    if (copy_fd_range(src_fd, offset, len, fd) < 0) {
+        log_message("FILE_OPS", "ERROR", "Failed to write to temporary file %s: %s", 
+                   tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    
+    return commit_temp_file(fd, tmp_path, filepath, 1);
 }
 
 int save_file_content(const char* filename, const char* content) {
@@ -552,17 +739,11 @@ int save_file_content(const char* filename, const char* content) {
     char filepath[MAX_PATH];
     snprintf(filepath, MAX_PATH, "data/files/%s", filename);
     
-    // Acquire write lock
-    if (file_write_lock(filepath) != 0) {
-        log_message("FILE_OPS", "ERROR", "Failed to acquire write lock for %s", filename);
-        return -1;
-    }
-    
     int result = -1;
     size_t content_len = strlen(content);
     
     // Use atomic write to prevent partial writes
-    if (atomic_write_file(filepath, content, content_len) == 0) {
+    if (atomic_write_file(filepath, content, content_len, 1) == 0) {
         log_message("FILE_OPS", "INFO", "Successfully saved %zu bytes to %s", 
                    content_len, filename);
         result = 0;
@@ -570,9 +751,6 @@ int save_file_content(const char* filename, const char* content) {
         log_message("FILE_OPS", "ERROR", "Failed to save content to %s", filename);
     }
     
-    // Release the lock
-    file_unlock(filepath);
-    
     return result;
 }
 
@@ -604,7 +782,7 @@ char* load_file(const char* filename) {
         return NULL;
     }
     
-    // Use load_file_content to read the file with proper locking
+    // Caller holds the file's lock
     int bytes_read = load_file_content(filename, content, st.st_size + 1);
     if (bytes_read < 0) {
         log_message("FILE_OPS", "ERROR", "Failed to read file %s", filename);
@@ -629,21 +807,45 @@ int save_file(const char* filename, const char* content) {
     return save_file_content(filename, content);
 }
 
-int load_metadata(const char* filename, FileInfo* info, ACLEntry acl[], int* acl_count) {
-    char metapath[MAX_PATH];
-    snprintf(metapath, MAX_PATH, "data/metadata/%s.meta", filename);
-    
-    FILE* fp = fopen(metapath, "r");
-    if (!fp) {
-        return -1;
-    }
-    
-    char line[512];
+// Metadata cache
+//
+// Every file's metadata and ACL is kept in memory, keyed by filename, and
+// loaded from data/metadata/ at startup. load_metadata() is served from the
+// table; save_metadata() and the other mutations write through to the .meta
+// file before returning. Access-time updates (touch_access) only mark the
+// entry dirty; meta_flush_thread writes dirty entries out in batches.
+//
+// Callers hold the file's lock as before. meta_io_mutex orders the .meta
+// writes themselves, so a flush can never land an older snapshot over a
+// newer write-through.
+typedef struct {
+    FileInfo info;
+    int dirty;  // Access time not yet on disk (queued in meta_dirty)
+    int acl_count;
+    ACLEntry acl[];
+} MetaEntry;
+
+typedef struct MetaDirty {
+    char filename[MAX_FILENAME];
+    struct MetaDirty* next;
+} MetaDirty;
+
+static HashMap* meta_cache = NULL;
+static MetaDirty* meta_dirty = NULL;
+static pthread_mutex_t meta_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t meta_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Parse .meta text ("key:value" lines)
+static void parse_metadata(const char* filename, const char* text, FileInfo* info, ACLEntry acl[],
+                           int* acl_count) {
+    memset(info, 0, sizeof(FileInfo));
+    strncpy(info->filename, filename, MAX_FILENAME - 1);
     *acl_count = 0;
     
-    while (fgets(line, sizeof(line), fp)) {
+    const char* line = text;
+    while (line && *line) {
         if (strncmp(line, "owner:", 6) == 0) {
-            sscanf(line + 6, "%s", info->owner);
+            sscanf(line + 6, "%63s", info->owner);
         } else if (strncmp(line, "created:", 8) == 0) {
             sscanf(line + 8, "%ld", &info->created);
         } else if (strncmp(line, "modified:", 9) == 0) {
@@ -651,64 +853,593 @@ int load_metadata(const char* filename, FileInfo* info, ACLEntry acl[], int* acl
         } else if (strncmp(line, "accessed:", 9) == 0) {
             sscanf(line + 9, "%ld", &info->accessed);
         } else if (strncmp(line, "accessed_by:", 12) == 0) {
-            sscanf(line + 12, "%s", info->last_accessed_by);
+            sscanf(line + 12, "%63s", info->last_accessed_by);
         } else if (strncmp(line, "words:", 6) == 0) {
             sscanf(line + 6, "%d", &info->word_count);
         } else if (strncmp(line, "chars:", 6) == 0) {
             sscanf(line + 6, "%d", &info->char_count);
-        } else if (strncmp(line, "acl:", 4) == 0) {
+        } else if (strncmp(line, "version:", 8) == 0) {
+            sscanf(line + 8, "%llu", &info->version);
+        } else if (strncmp(line, "acl:", 4) == 0 && *acl_count < MAX_ACL_ENTRIES) {
             char username[MAX_USERNAME];
             char perm;
-            if (sscanf(line + 4, "%[^:]:%c", username, &perm) == 2) {
+            if (sscanf(line + 4, "%63[^:\n]:%c", username, &perm) == 2) {
                 strncpy(acl[*acl_count].username, username, MAX_USERNAME - 1);
+                acl[*acl_count].username[MAX_USERNAME - 1] = '\0';
                 acl[*acl_count].permission = (perm == 'W') ? PERM_WRITE : PERM_READ;
                 (*acl_count)++;
             }
         }
+        
+        line = strchr(line, '\n');
+        if (line) {
+            line++;
+        }
     }
-    
-    fclose(fp);
-    return 0;
 }
 
-int save_metadata(const char* filename, FileInfo* info, ACLEntry acl[], int acl_count) {
+static int read_metadata_file(const char* filename, FileInfo* info, ACLEntry acl[], int* acl_count) {
     char metapath[MAX_PATH];
     snprintf(metapath, MAX_PATH, "data/metadata/%s.meta", filename);
     
-    FILE* fp = fopen(metapath, "w");
+    FILE* fp = fopen(metapath, "r");
     if (!fp) {
         return -1;
     }
     
-    fprintf(fp, "owner:%s\n", info->owner);
-    fprintf(fp, "created:%ld\n", info->created);
-    fprintf(fp, "modified:%ld\n", info->modified);
-    fprintf(fp, "accessed:%ld\n", info->accessed);
-    fprintf(fp, "accessed_by:%s\n", info->last_accessed_by);
-    fprintf(fp, "words:%d\n", info->word_count);
-    fprintf(fp, "chars:%d\n", info->char_count);
+    char text[1024 + MAX_ACL_ENTRIES * (MAX_USERNAME + 8)];
+    size_t len = fread(text, 1, sizeof(text) - 1, fp);
+    text[len] = '\0';
+    fclose(fp);
     
-    for (int i = 0; i < acl_count; i++) {
-        fprintf(fp, "acl:%s:%c\n", acl[i].username,
-                acl[i].permission == PERM_WRITE ? 'W' : 'R');
+    parse_metadata(filename, text, info, acl, acl_count);
+    return 0;
+}
+
+// .meta text for info and acl; -1 if it does not fit in len
+static int format_metadata(const FileInfo* info, const ACLEntry acl[], int acl_count, char* buf,
+                           size_t size) {
+    int len = snprintf(buf, size,
+                       "owner:%s\ncreated:%ld\nmodified:%ld\naccessed:%ld\n"
+                       "accessed_by:%s\nwords:%d\nchars:%d\nversion:%llu\n",
+                       info->owner, info->created, info->modified, info->accessed,
+                       info->last_accessed_by, info->word_count, info->char_count, info->version);
+    
+    for (int i = 0; i < acl_count && len < (int)size; i++) {
+        len += snprintf(buf + len, size - len, "acl:%s:%c\n", acl[i].username,
+                        acl[i].permission == PERM_WRITE ? 'W' : 'R');
     }
     
-    fclose(fp);
-    return 0;
+    return len >= (int)size ? -1 : len;
 }
 
-int check_access(const char* filename, const char* username, int required_perm) {
-    FileInfo info;
-    ACLEntry acl[MAX_ACL_ENTRIES];
-    int acl_count = 0;
+// Metadata is replaced via rename so a crash never leaves a torn .meta file
+static int write_metadata_file(const char* filename, const FileInfo* info, const ACLEntry acl[],
+                               int acl_count) {
+    char metapath[MAX_PATH];
+    snprintf(metapath, MAX_PATH, "data/metadata/%s.meta", filename);
     
-    if (load_metadata(filename, &info, acl, &acl_count) < 0) {
-        return 0;
+    char buf[1024 + MAX_ACL_ENTRIES * (MAX_USERNAME + 8)];
+    int len = format_metadata(info, acl, acl_count, buf, sizeof(buf));
+    if (len < 0) {
+        return -1;
     }
     
-    // Owner always has full access
-    if (strcmp(info.owner, username) == 0) {
-        return 1;
+    return atomic_write_file(metapath, buf, len, 0);
+}
+
+// Caller holds meta_cache_mutex. Replaces any existing entry.
+static MetaEntry* meta_cache_insert(const char* filename, const FileInfo* info,
+                                    const ACLEntry acl[], int acl_count) {
+    MetaEntry* entry = (MetaEntry*)malloc(sizeof(MetaEntry) + acl_count * sizeof(ACLEntry));
+    if (!entry) {
+        hashmap_remove(meta_cache, filename);
+        return NULL;
+    }
+    
+    entry->info = *info;
+    entry->dirty = 0;
+    entry->acl_count = acl_count;
+    memcpy(entry->acl, acl, acl_count * sizeof(ACLEntry));
+    hashmap_put(meta_cache, filename, entry);
+    return entry;
+}
+
+// Startup scan: one walk of data/metadata lists the .meta files, then
+// SS_SCAN_THREADS workers (default one per core) read and parse them in
+// batches and check that each file's content is in data/files. Files
+// without content stay out of the cache, and so out of the inventory
+// sent to the Name Servers; load_metadata() still finds them on demand.
+#define META_SCAN_BATCH 64
+#define META_SCAN_MAX_THREADS 64
+
+typedef struct {
+    char** names;
+    int count;
+    int capacity;
+    int next;      // First name not yet claimed by a worker
+    int loaded;
+    int orphaned;
+} MetaScan;
+
+// List every .meta file below dir (folders nest under data/metadata/)
+static void meta_scan_dir(MetaScan* scan, const char* dir, const char* prefix) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        
+        // A name too long to be a file name cannot belong to a file; a cut
+        // one would stand for a different file
+        char path[MAX_PATH], name[MAX_FILENAME];
+        if (snprintf(path, MAX_PATH, "%s/%s", dir, entry->d_name) >= MAX_PATH ||
+            snprintf(name, MAX_FILENAME, "%s%s", prefix, entry->d_name) >= MAX_FILENAME) {
+            continue;
+        }
+        
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (stat(path, &st) != 0) {
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            char sub_prefix[MAX_FILENAME];
+            if (snprintf(sub_prefix, MAX_FILENAME, "%s/", name) >= MAX_FILENAME) {
+                continue;
+            }
+            meta_scan_dir(scan, path, sub_prefix);
+            continue;
+        }
+        
+        size_t len = strlen(name);
+        if (len <= 5 || strcmp(name + len - 5, ".meta") != 0) {
+            continue;
+        }
+        name[len - 5] = '\0';
+        
+        if (scan->count == scan->capacity) {
+            int capacity = scan->capacity ? scan->capacity * 2 : 1024;
+            char** grown = (char**)realloc(scan->names, capacity * sizeof(char*));
+            if (!grown) {
+                break;
+            }
+            scan->names = grown;
+            scan->capacity = capacity;
+        }
+        scan->names[scan->count] = strdup(name);
+        if (scan->names[scan->count]) {
+            scan->count++;
+        }
+    }
+    
+    closedir(d);
+}
+
+static void* meta_scan_worker(void* arg) {
+    MetaScan* scan = (MetaScan*)arg;
+    FileInfo info;
+    ACLEntry acl[MAX_ACL_ENTRIES];
+    
+    for (;;) {
+        int first = __atomic_fetch_add(&scan->next, META_SCAN_BATCH, __ATOMIC_RELAXED);
+        if (first >= scan->count) {
+            break;
+        }
+        int last = first + META_SCAN_BATCH < scan->count ? first + META_SCAN_BATCH : scan->count;
+        
+        for (int i = first; i < last; i++) {
+            char filepath[MAX_PATH];
+            snprintf(filepath, MAX_PATH, "data/files/%s", scan->names[i]);
+            if (access(filepath, F_OK) != 0 && !cold_contains(scan->names[i])) {
+                __atomic_fetch_add(&scan->orphaned, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            
+            int acl_count = 0;
+            if (read_metadata_file(scan->names[i], &info, acl, &acl_count) == 0) {
+                pthread_mutex_lock(&meta_cache_mutex);
+                meta_cache_insert(scan->names[i], &info, acl, acl_count);
+                pthread_mutex_unlock(&meta_cache_mutex);
+                __atomic_fetch_add(&scan->loaded, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void meta_cache_scan() {
+    struct timeval started;
+    gettimeofday(&started, NULL);
+    
+    MetaScan scan = {NULL, 0, 0, 0, 0, 0};
+    meta_scan_dir(&scan, "data/metadata", "");
+    hashmap_reserve(meta_cache, scan.count);
+    
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = config_get_int("SS_SCAN_THREADS", cores > 0 ? (int)cores : 4);
+    if (workers > scan.count / META_SCAN_BATCH + 1) {
+        workers = scan.count / META_SCAN_BATCH + 1;
+    }
+    if (workers > META_SCAN_MAX_THREADS) {
+        workers = META_SCAN_MAX_THREADS;
+    }
+    
+    pthread_t threads[META_SCAN_MAX_THREADS];
+    int started_threads = 0;
+    for (; started_threads < workers - 1; started_threads++) {
+        if (pthread_create(&threads[started_threads], NULL, meta_scan_worker, &scan) != 0) {
+            break;
+        }
+    }
+    meta_scan_worker(&scan);
+    for (int i = 0; i < started_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    for (int i = 0; i < scan.count; i++) {
+        free(scan.names[i]);
+    }
+    free(scan.names);
+    
+    struct timeval done;
+    gettimeofday(&done, NULL);
+    long long ms = (done.tv_sec - started.tv_sec) * 1000LL + (done.tv_usec - started.tv_usec) / 1000;
+    log_message("STORAGE_SERVER", "INFO",
+               "Metadata cache loaded (%d files, %d without content, %d thread%s, %lld ms)",
+               scan.loaded, scan.orphaned, started_threads + 1, started_threads == 0 ? "" : "s", ms);
+}
+
+// Registry lines ("name|owner|ss_id|created|modified|accessed|accessed_by|words|chars")
+// for the files Name Server shard owns, appended to text
+typedef struct {
+    int shard;
+    MetricsText* text;
+    int count;
+} Inventory;
+
+static void inventory_entry(const char* key, void* value, void* ctx) {
+    Inventory* inv = (Inventory*)ctx;
+    const FileInfo* info = &((MetaEntry*)value)->info;
+    if (nm_shards->count > 1 && shard_map_lookup(nm_shards, key) != inv->shard) {
+        return;
+    }
+    metrics_text_printf(inv->text, "%s|%s|%s|%ld|%ld|%ld|%s|%d|%d\n", key, info->owner, ss_id,
+                        info->created, info->modified, info->accessed, info->last_accessed_by,
+                        info->word_count, info->char_count);
+    inv->count++;
+}
+
+static int build_inventory(int shard, MetricsText* text) {
+    Inventory inv = {shard, text, 0};
+    pthread_mutex_lock(&meta_cache_mutex);
+    hashmap_foreach(meta_cache, inventory_entry, &inv);
+    pthread_mutex_unlock(&meta_cache_mutex);
+    return inv.count;
+}
+
+// Write every dirty entry's current state to disk
+static void metadata_flush() {
+    pthread_mutex_lock(&meta_cache_mutex);
+    MetaDirty* pending = meta_dirty;
+    meta_dirty = NULL;
+    pthread_mutex_unlock(&meta_cache_mutex);
+    
+    int flushed = 0;
+    while (pending) {
+        MetaDirty* next = pending->next;
+        
+        pthread_mutex_lock(&meta_io_mutex);
+        pthread_mutex_lock(&meta_cache_mutex);
+        MetaEntry* entry = (MetaEntry*)hashmap_get(meta_cache, pending->filename);
+        FileInfo info;
+        ACLEntry acl[MAX_ACL_ENTRIES];
+        int acl_count = 0;
+        int write = entry && entry->dirty;
+        if (write) {
+            entry->dirty = 0;
+            info = entry->info;
+            acl_count = entry->acl_count;
+            memcpy(acl, entry->acl, acl_count * sizeof(ACLEntry));
+        }
+        pthread_mutex_unlock(&meta_cache_mutex);
+        
+        if (write && write_metadata_file(pending->filename, &info, acl, acl_count) == 0) {
+            flushed++;
+        }
+        pthread_mutex_unlock(&meta_io_mutex);
+        
+        free(pending);
+        pending = next;
+    }
+    
+    if (flushed > 0) {
+        log_message("STORAGE_SERVER", "DEBUG", "Flushed access times of %d files", flushed);
+    }
+}
+
+static void* meta_flush_thread(void* arg) {
+    int interval_ms = *(int*)arg;
+    while (running) {
+        usleep(interval_ms * 1000);
+        metadata_flush();
+    }
+    return NULL;
+}
+
+static void metadata_cache_init() {
+    meta_cache = hashmap_create();
+    meta_cache_scan();
+    
+    static int interval_ms;
+    interval_ms = config_get_int("SS_META_FLUSH_MS", 1000);
+    if (interval_ms <= 0) {
+        interval_ms = 1000;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, meta_flush_thread, &interval_ms);
+    pthread_detach(thread);
+}
+
+int load_metadata(const char* filename, FileInfo* info, ACLEntry acl[], int* acl_count) {
+    pthread_mutex_lock(&meta_cache_mutex);
+    MetaEntry* entry = (MetaEntry*)hashmap_get(meta_cache, filename);
+    if (entry) {
+        *info = entry->info;
+        *acl_count = entry->acl_count;
+        memcpy(acl, entry->acl, entry->acl_count * sizeof(ACLEntry));
+        pthread_mutex_unlock(&meta_cache_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&meta_cache_mutex);
+    
+    // Not cached (e.g. placed on disk by hand): read it and remember it
+    if (read_metadata_file(filename, info, acl, acl_count) < 0) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&meta_cache_mutex);
+    if (!hashmap_get(meta_cache, filename)) {
+        meta_cache_insert(filename, info, acl, *acl_count);
+    }
+    pthread_mutex_unlock(&meta_cache_mutex);
+    return 0;
+}
+
+// Write-through: the .meta file is replaced before the table is updated.
+// Every save is a change to the file, so it gets a new version and is
+// queued for the replicas.
+int save_metadata(const char* filename, FileInfo* info, ACLEntry acl[], int acl_count) {
+    if (!repl_applying) {
+        info->version = next_version(info->version);
+    }
+    
+    pthread_mutex_lock(&meta_io_mutex);
+    int rc = write_metadata_file(filename, info, acl, acl_count);
+    if (rc == 0) {
+        pthread_mutex_lock(&meta_cache_mutex);
+        MetaEntry* entry = (MetaEntry*)hashmap_get(meta_cache, filename);
+        if (entry && entry->acl_count == acl_count) {
+            entry->info = *info;
+            entry->dirty = 0;
+            memcpy(entry->acl, acl, acl_count * sizeof(ACLEntry));
+        } else {
+            meta_cache_insert(filename, info, acl, acl_count);
+        }
+        pthread_mutex_unlock(&meta_cache_mutex);
+    }
+    pthread_mutex_unlock(&meta_io_mutex);
+    
+    if (rc == 0) {
+        location_forget_move(filename);
+        replication_enqueue(filename);
+    }
+    return rc;
+}
+
+// Drop a file's metadata from disk and from the table
+static void remove_metadata(const char* filename) {
+    char metapath[MAX_PATH];
+    snprintf(metapath, MAX_PATH, "data/metadata/%s.meta", filename);
+    
+    pthread_mutex_lock(&meta_io_mutex);
+    pthread_mutex_lock(&meta_cache_mutex);
+    hashmap_remove(meta_cache, filename);
+    pthread_mutex_unlock(&meta_cache_mutex);
+    unlink(metapath);
+    pthread_mutex_unlock(&meta_io_mutex);
+    
+    replication_enqueue(filename);  // Ships the deletion
+}
+
+// Move a file's metadata to a new name (MOVE into a folder)
+static int rename_metadata(const char* old_name, const char* new_name) {
+    char old_meta[MAX_PATH], new_meta[MAX_PATH];
+    snprintf(old_meta, MAX_PATH, "data/metadata/%s.meta", old_name);
+    snprintf(new_meta, MAX_PATH, "data/metadata/%s.meta", new_name);
+    
+    pthread_mutex_lock(&meta_io_mutex);
+    int rc = rename(old_meta, new_meta);
+    pthread_mutex_lock(&meta_cache_mutex);
+    MetaEntry* entry = (MetaEntry*)hashmap_get(meta_cache, old_name);
+    if (rc == 0 && entry) {
+        FileInfo info = entry->info;
+        strncpy(info.filename, new_name, MAX_FILENAME - 1);
+        info.filename[MAX_FILENAME - 1] = '\0';
+        MetaEntry* moved = meta_cache_insert(new_name, &info, entry->acl, entry->acl_count);
+        if (moved && entry->dirty) {
+            // The on-disk copy lacks the latest access time; rewrite it now
+            write_metadata_file(new_name, &moved->info, moved->acl, moved->acl_count);
+        }
+    }
+    if (rc == 0) {
+        hashmap_remove(meta_cache, old_name);
+    }
+    pthread_mutex_unlock(&meta_cache_mutex);
+    pthread_mutex_unlock(&meta_io_mutex);
+    
+    if (rc == 0) {
+        replication_enqueue(old_name);
+        replication_enqueue(new_name);
+    }
+    return rc;
+}
+
+// Content cache
+//
+// Recently used files are kept in memory with their sentence count, in an
+// LRUCache bounded by SS_CONTENT_CACHE_BYTES (default 64 MB).
+// - Files up to SS_CONTENT_CACHE_FILE_MAX (default 1 MB) are cached with their
+//   bytes once read; larger files, and files only asked about by INFO and
+//   FILEINFO, are cached with their stats only.
+// - Every handler that changes a file's contents or name invalidates its
+//   entry (invalidate_file_caches), so a hit needs no disk access at all.
+// - Entries are reference counted: a reader keeps its copy alive even if the
+//   entry is evicted or invalidated meanwhile.
+typedef struct {
+    int refs;       // Guarded by content_ref_mutex
+    off_t size;
+    int sentences;
+    int has_data;   // data[] holds the whole file (NUL-terminated)
+    char data[];
+} CachedFile;
+
+static LRUCache* content_cache = NULL;
+static size_t content_cache_file_max = 0;
+static pthread_mutex_t content_ref_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void cached_file_retain(void* value) {
+    pthread_mutex_lock(&content_ref_mutex);
+    ((CachedFile*)value)->refs++;
+    pthread_mutex_unlock(&content_ref_mutex);
+}
+
+static void cached_file_release(void* value) {
+    CachedFile* cached = (CachedFile*)value;
+    pthread_mutex_lock(&content_ref_mutex);
+    int last = --cached->refs == 0;
+    pthread_mutex_unlock(&content_ref_mutex);
+    if (last) {
+        free(cached);
+    }
+}
+
+static void content_cache_init() {
+    int budget = config_get_int("SS_CONTENT_CACHE_BYTES", 64 * 1024 * 1024);
+    int file_max = config_get_int("SS_CONTENT_CACHE_FILE_MAX", 1024 * 1024);
+    if (budget <= 0) {
+        log_message("STORAGE_SERVER", "INFO", "Content cache disabled");
+        return;
+    }
+    
+    content_cache_file_max = file_max > 0 ? (size_t)file_max : 0;
+    content_cache = lru_create_sized(0, budget, cached_file_release);
+    log_message("STORAGE_SERVER", "INFO", "Content cache: %d bytes, files up to %d bytes",
+               budget, file_max);
+}
+
+// Cached entry for filename (retained; cached_file_release() it), loading it
+// on a miss. With want_data the entry holds the file's bytes unless the file
+// is too large to cache. NULL if the file is missing. Caller holds the
+// file's lock.
+static CachedFile* content_cache_get(const char* filename, int want_data) {
+    CachedFile* cached = (CachedFile*)lru_get_retain(content_cache, filename, cached_file_retain);
+    if (cached && (cached->has_data || !want_data || (size_t)cached->size > content_cache_file_max)) {
+        return cached;
+    }
+    if (cached) {
+        cached_file_release(cached);
+    }
+    
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", filename);
+    
+    struct stat st;
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    
+    int with_data = want_data && content_cache && (size_t)st.st_size <= content_cache_file_max;
+    size_t data_len = with_data ? (size_t)st.st_size : 0;
+    cached = (CachedFile*)malloc(sizeof(CachedFile) + data_len + 1);
+    if (!cached) {
+        close(fd);
+        return NULL;
+    }
+    
+    cached->refs = 1;
+    cached->size = st.st_size;
+    cached->has_data = with_data;
+    cached->data[0] = '\0';
+    
+    size_t done = 0;
+    while (done < data_len) {
+        ssize_t n = pread(fd, cached->data + done, data_len - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    if (done < data_len) {
+        free(cached);
+        return NULL;
+    }
+    cached->data[data_len] = '\0';
+    
+    SentenceIndex* idx = sentence_index_load(filename, filepath);
+    cached->sentences = idx ? idx->count : 0;
+    free(idx);
+    
+    if (content_cache) {
+        cached_file_retain(cached);  // The cache's reference
+        lru_put_sized(content_cache, filename, cached, sizeof(CachedFile) + data_len);
+    }
+    return cached;
+}
+
+// Drop every cached view of filename's contents. Caller holds the file's
+// exclusive lock.
+static void invalidate_file_caches(const char* filename) {
+    sentence_index_invalidate(filename);
+    if (content_cache) {
+        lru_remove(content_cache, filename);
+    }
+}
+
+static void format_time(time_t t, char* buf, size_t len) {
+    struct tm tm_info;
+    localtime_r(&t, &tm_info);
+    strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm_info);
+}
+
+int check_access(const char* filename, const char* username, int required_perm) {
+    FileInfo info;
+    ACLEntry acl[MAX_ACL_ENTRIES];
+    int acl_count = 0;
+    
+    if (load_metadata(filename, &info, acl, &acl_count) < 0) {
+        return 0;
+    }
+    
+    // Owner always has full access
+    if (strcmp(info.owner, username) == 0) {
+        return 1;
     }
     
     // Check ACL
@@ -725,221 +1456,1981 @@ int check_access(const char* filename, const char* username, int required_perm)
     return 0;
 }
 
-void handle_create_file(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+// Create the folders a nested name lives in, under files/ and the metadata
+// and history mirrors. With sharded Name Servers the folder may have been
+// created through another SS.
+static void make_parent_dirs(const char* filename) {
+    static const char* roots[] = {"data/files", "data/metadata", "data/history"};
+    
+    for (int r = 0; r < 3; r++) {
+        for (const char* slash = strchr(filename, '/'); slash; slash = strchr(slash + 1, '/')) {
+            char dirpath[MAX_PATH];
+            snprintf(dirpath, MAX_PATH, "%s/%.*s", roots[r], (int)(slash - filename), filename);
+            mkdir(dirpath, 0755);
+        }
+    }
+}
+
+// Replication
+//
+// Every change to a file's content or metadata queues its name. The
+// replicator thread ships the file as it is now (content, metadata and
+// version) to each replica the Name Server assigned to this SS, as
+// CMD_REPLICATE. Replicas only apply versions newer than their own, so
+// resends and reordering are harmless. A replica that was unreachable, or
+// is new or restarted (new registration epoch), is resynced with every
+// file. Version history and checkpoints stay local.
+//
+// The per-replica backlog goes out with each heartbeat; the NM only sends
+// reads to replicas that report nothing pending.
+#define MAX_REPLICAS HEARTBEAT_MAX_REPLICAS
+
+typedef struct {
+    char ss_id[64];
+    char ip[64];
+    int port;
+    unsigned int epoch;
+} ReplicaTarget;
+
+typedef struct {
+    ReplicaTarget target;
+    int fd;
+    int state;
+} ReplicaConn;
+
+#define REPLICA_RESYNC 0     // Needs every file (again)
+#define REPLICA_CATCHING_UP 1
+#define REPLICA_IN_SYNC 2
+
+typedef struct ReplItem {
+    char filename[MAX_FILENAME];
+    struct ReplItem* next;
+} ReplItem;
+
+static ReplicaTarget repl_targets[MAX_REPLICAS];  // As last assigned by the NM
+static int repl_target_count = 0;
+static unsigned int repl_targets_gen = 0;
+static ReplItem* repl_head = NULL;
+static ReplItem* repl_tail = NULL;
+static int repl_queued = 0;
+static HashMap* repl_pending = NULL;  // Names in the queue
+static HeartbeatReplica repl_status[MAX_REPLICAS];  // Backlog per replica, for heartbeats
+static int repl_status_count = 0;
+static unsigned long long repl_sent = 0, repl_applied = 0, repl_failed = 0;
+static pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t repl_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long long now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+// Version for a new change: after the previous one, and roughly wall-clock
+// so a replica promoted to primary keeps ordering ahead of its old copies
+static unsigned long long next_version(unsigned long long previous) {
+    unsigned long long now = now_usec();
+    return now > previous ? now : previous + 1;
+}
+
+static void replication_enqueue(const char* filename) {
+    if (repl_applying) {
+        return;
+    }
+    
+    pthread_mutex_lock(&repl_mutex);
+    if (repl_target_count > 0 && !hashmap_contains(repl_pending, filename)) {
+        ReplItem* item = (ReplItem*)calloc(1, sizeof(ReplItem));
+        if (item) {
+            snprintf(item->filename, MAX_FILENAME, "%s", filename);
+            if (repl_tail) {
+                repl_tail->next = item;
+            } else {
+                repl_head = item;
+            }
+            repl_tail = item;
+            repl_queued++;
+            hashmap_put(repl_pending, filename, strdup(""));
+            pthread_cond_signal(&repl_cond);
+        }
+    }
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+static void enqueue_meta_entry(const char* key, void* value, void* ctx) {
+    (void)value;
+    (void)ctx;
+    replication_enqueue(key);
+}
+
+// Replica list from a heartbeat ack: "id|ip|port|epoch;..."
+static void replication_set_targets(const char* spec) {
+    ReplicaTarget targets[MAX_REPLICAS];
+    int count = 0;
+    memset(targets, 0, sizeof(targets));  // Compared with memcmp below
+    
+    char copy[BUFFER_SIZE];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    char* save = NULL;
+    for (char* entry = strtok_r(copy, ";", &save); entry && count < MAX_REPLICAS;
+         entry = strtok_r(NULL, ";", &save)) {
+        ReplicaTarget* t = &targets[count];
+        if (sscanf(entry, "%63[^|]|%63[^|]|%d|%u", t->ss_id, t->ip, &t->port, &t->epoch) == 4 &&
+            strcmp(t->ss_id, ss_id) != 0) {
+            count++;
+        }
+    }
+    
+    pthread_mutex_lock(&repl_mutex);
+    if (count != repl_target_count ||
+        memcmp(targets, repl_targets, count * sizeof(ReplicaTarget)) != 0) {
+        memcpy(repl_targets, targets, count * sizeof(ReplicaTarget));
+        repl_target_count = count;
+        repl_targets_gen++;
+        pthread_cond_signal(&repl_cond);
+        log_message("REPLICATION", "INFO", "Replicating to %d storage server(s)", count);
+    }
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+static void replication_fill_heartbeat(Heartbeat* hb) {
+    pthread_mutex_lock(&repl_mutex);
+    memcpy(hb->replicas, repl_status, repl_status_count * sizeof(HeartbeatReplica));
+    hb->replica_count = repl_status_count;
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+// "id:backlog,..." for CMD_STATS
+static void replication_get_report(char* out, size_t len) {
+    Heartbeat hb;
+    replication_fill_heartbeat(&hb);
+    
+    size_t pos = 0;
+    out[0] = '\0';
+    for (uint32_t i = 0; i < hb.replica_count && pos < len; i++) {
+        pos += snprintf(out + pos, len - pos, "%s%s:%d", i > 0 ? "," : "", hb.replicas[i].ss_id,
+                        hb.replicas[i].backlog);
+    }
+}
+
+// "<version> <deleted> <meta_len>\n<metadata><content>". The caller holds
+// the file's lock so all three match. The first PEER_AUTH_LEN bytes are
+// left for replica_send to sign into.
+static char* build_replica_update_locked(const char* filename, size_t* out_len) {
+    FileInfo info;
+    ACLEntry acl[MAX_ACL_ENTRIES];
+    int acl_count = 0;
+    char meta[1024 + MAX_ACL_ENTRIES * (MAX_USERNAME + 8)] = "";
+    int meta_len = 0;
+    int deleted = load_metadata(filename, &info, acl, &acl_count) < 0;
+    unsigned long long version = 0;
+    
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", filename);
+    // A frozen file is shipped from its compressed copy and stays frozen
+    size_t cold_len = 0;
+    char* cold = deleted ? NULL : cold_read(filename, &cold_len);
+    int fd = deleted || cold ? -1 : open(filepath, O_RDONLY);
+    struct stat st;
+    if (cold) {
+        st.st_size = cold_len;
+    } else if (fd < 0 || fstat(fd, &st) < 0) {
+        deleted = 1;
+        st.st_size = 0;
+    }
+    
+    if (deleted) {
+        version = now_usec();  // Tombstone: newer than any copy of the file
+    } else {
+        version = info.version;
+        meta_len = format_metadata(&info, acl, acl_count, meta, sizeof(meta));
+        if (meta_len < 0) {
+            meta_len = 0;
+        }
+    }
+    
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "%llu %d %d\n", version, deleted, meta_len);
+    size_t len = PEER_AUTH_LEN + header_len + meta_len + st.st_size;
+    char* update = (char*)malloc(len + 1);
+    if (update) {
+        memcpy(update + PEER_AUTH_LEN, header, header_len);
+        memcpy(update + PEER_AUTH_LEN + header_len, meta, meta_len);
+        size_t off = PEER_AUTH_LEN + header_len + meta_len;
+        if (cold) {
+            memcpy(update + off, cold, cold_len);
+            off += cold_len;
+        }
+        while (off < len) {
+            ssize_t n = read(fd, update + off, len - off);
+            if (n <= 0) {
+                break;
+            }
+            off += n;
+        }
+        len = off;
+    }
+    
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(cold);
+    
+    *out_len = len;
+    return update;
+}
+
+static char* build_replica_update(const char* filename, size_t* out_len) {
+    file_read_lock(filename);
+    char* update = build_replica_update_locked(filename, out_len);
+    file_unlock(filename);
+    return update;
+}
+
+static int replica_connect(ReplicaConn* conn) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct timeval timeout = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(conn->target.ip);
+    addr.sin_port = htons(conn->target.port);
+    
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    conn->fd = fd;
+    return 0;
+}
+
+static int replica_send(ReplicaConn* conn, const char* filename, char* update, size_t len) {
+    peer_sign(CMD_REPLICATE, filename, update + PEER_AUTH_LEN, len - PEER_AUTH_LEN, update);
+    
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.msg_type = MSG_COMMAND;
+    msg.command = CMD_REPLICATE;
+    snprintf(msg.username, MAX_USERNAME, "%s", ss_id);
+    snprintf(msg.filename, MAX_FILENAME, "%s", filename);
+    msg.body = update;
+    msg.body_len = len;
+    
+    Message response;
+    memset(&response, 0, sizeof(Message));
+    int ok = send_message(conn->fd, &msg) == 0 && receive_message(conn->fd, &response) == 0 &&
+             response.error_code == SUCCESS;
+    message_free_body(&response);
+    return ok ? 0 : -1;
+}
+
+static void* replicator_thread(void* arg) {
+    (void)arg;
+    ReplicaConn conns[MAX_REPLICAS];
+    int conn_count = 0;
+    unsigned int gen = 0;
+    
+    while (running) {
+        pthread_mutex_lock(&repl_mutex);
+        if (!repl_head && gen == repl_targets_gen) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&repl_cond, &repl_mutex, &deadline);
+        }
+        
+        // Pick up a new assignment, keeping connections to unchanged replicas
+        if (gen != repl_targets_gen) {
+            ReplicaConn fresh[MAX_REPLICAS];
+            for (int i = 0; i < repl_target_count; i++) {
+                fresh[i].target = repl_targets[i];
+                fresh[i].fd = -1;
+                fresh[i].state = REPLICA_RESYNC;
+                for (int j = 0; j < conn_count; j++) {
+                    if (conns[j].fd >= 0 &&
+                        memcmp(&conns[j].target, &repl_targets[i], sizeof(ReplicaTarget)) == 0) {
+                        fresh[i] = conns[j];
+                        conns[j].fd = -1;
+                    }
+                }
+            }
+            for (int j = 0; j < conn_count; j++) {
+                if (conns[j].fd >= 0) {
+                    close(conns[j].fd);
+                }
+            }
+            memcpy(conns, fresh, repl_target_count * sizeof(ReplicaConn));
+            conn_count = repl_target_count;
+            gen = repl_targets_gen;
+        }
+        
+        ReplItem* item = repl_head;
+        if (item) {
+            repl_head = item->next;
+            if (!repl_head) {
+                repl_tail = NULL;
+            }
+            repl_queued--;
+            hashmap_remove(repl_pending, item->filename);
+        }
+        pthread_mutex_unlock(&repl_mutex);
+        
+        // (Re)connect replicas that need a resync and queue every file for them
+        for (int i = 0; i < conn_count; i++) {
+            if (conns[i].state == REPLICA_RESYNC && (conns[i].fd >= 0 || replica_connect(&conns[i]) == 0)) {
+                conns[i].state = REPLICA_CATCHING_UP;
+                log_message("REPLICATION", "INFO", "Resyncing replica %s", conns[i].target.ss_id);
+                pthread_mutex_lock(&meta_cache_mutex);
+                hashmap_foreach(meta_cache, enqueue_meta_entry, NULL);
+                pthread_mutex_unlock(&meta_cache_mutex);
+            }
+        }
+        
+        if (item) {
+            size_t len = 0;
+            char* update = build_replica_update(item->filename, &len);
+            for (int i = 0; update && i < conn_count; i++) {
+                if (conns[i].state == REPLICA_RESYNC) {
+                    continue;
+                }
+                if (replica_send(&conns[i], item->filename, update, len) == 0) {
+                    __sync_fetch_and_add(&repl_sent, 1);
+                    continue;
+                }
+                __sync_fetch_and_add(&repl_failed, 1);
+                log_message("REPLICATION", "WARNING", "Lost replica %s while sending %s",
+                            conns[i].target.ss_id, item->filename);
+                close(conns[i].fd);
+                conns[i].fd = -1;
+                conns[i].state = REPLICA_RESYNC;
+            }
+            free(update);
+            free(item);
+        }
+        
+        // Publish the backlog per replica for the next heartbeat
+        pthread_mutex_lock(&repl_mutex);
+        memset(repl_status, 0, sizeof(repl_status));
+        for (int i = 0; i < conn_count; i++) {
+            if (conns[i].state == REPLICA_CATCHING_UP && repl_queued == 0) {
+                conns[i].state = REPLICA_IN_SYNC;
+            }
+            snprintf(repl_status[i].ss_id, sizeof(repl_status[i].ss_id), "%s", conns[i].target.ss_id);
+            repl_status[i].backlog = conns[i].state == REPLICA_RESYNC ? -1 : repl_queued;
+        }
+        repl_status_count = conn_count;
+        pthread_mutex_unlock(&repl_mutex);
+    }
+    
+    return NULL;
+}
+
+static void replication_init() {
+    repl_pending = hashmap_create();
+    
+    pthread_t thread;
+    pthread_create(&thread, NULL, replicator_thread, NULL);
+    pthread_detach(thread);
+}
+
+// Apply an update from the primary (see build_replica_update) if it is
+// newer than what this SS holds
+void handle_replicate(Message* msg, Message* response) {
+    const char* update = message_payload(msg);
+    size_t len = message_payload_len(msg);
+    if (!peer_valid(CMD_REPLICATE, msg->filename, update, len)) {
+        response->error_code = ERR_UNAUTHORIZED;
+        snprintf(response->data, BUFFER_SIZE, "Replica updates must be signed by a peer");
+        log_message("REPLICATION", "WARNING", "Refused unsigned update to %s from %s",
+                    msg->filename, msg->username);
+        return;
+    }
+    update += PEER_AUTH_LEN;
+    len -= PEER_AUTH_LEN;
+    
+    unsigned long long version;
+    int deleted, meta_len, header_len;
+    if (sscanf(update, "%llu %d %d\n%n", &version, &deleted, &meta_len, &header_len) != 3 ||
+        meta_len < 0 || (size_t)(header_len + meta_len) > len) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Malformed replica update");
+        return;
+    }
+    if (msg->filename[0] == '\0' || msg->filename[0] == '/' || strstr(msg->filename, "..")) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Invalid filename");
+        return;
+    }
+    
+    file_write_lock(msg->filename);
+    
+    FileInfo info;
+    ACLEntry acl[MAX_ACL_ENTRIES];
+    int acl_count = 0;
+    int exists = load_metadata(msg->filename, &info, acl, &acl_count) == 0;
+    
+    response->error_code = SUCCESS;
+    if (exists && info.version >= version) {
+        snprintf(response->data, BUFFER_SIZE, "Already at version %llu", info.version);
+        file_unlock(msg->filename);
+        return;
+    }
+    
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
+    
+    // The primary's history is not shipped; local history ends here
+    history_reset(msg->filename);
+    
+    repl_applying = 1;
+    if (deleted) {
+        if (exists) {
+            unlink(filepath);
+            remove_metadata(msg->filename);
+        }
+    } else {
+        char meta[1024 + MAX_ACL_ENTRIES * (MAX_USERNAME + 8)];
+        snprintf(meta, sizeof(meta), "%.*s", meta_len, update + header_len);
+        parse_metadata(msg->filename, meta, &info, acl, &acl_count);
+        info.version = version;
+        
+        make_parent_dirs(msg->filename);
+        if (atomic_write_file(filepath, update + header_len + meta_len,
+                              len - header_len - meta_len, 0) < 0 ||
+            save_metadata(msg->filename, &info, acl, acl_count) < 0) {
+            response->error_code = ERR_INTERNAL;
+            snprintf(response->data, BUFFER_SIZE, "Failed to apply replica update");
+        }
+    }
+    repl_applying = 0;
+    invalidate_file_caches(msg->filename);
+    file_unlock(msg->filename);
+    
+    if (response->error_code == SUCCESS) {
+        __sync_fetch_and_add(&repl_applied, 1);
+        snprintf(response->data, BUFFER_SIZE, "Applied version %llu", version);
+        log_message("REPLICATION", "DEBUG", "Applied %s %s version %llu from %s",
+                    deleted ? "delete of" : "update to", msg->filename, version, msg->username);
+    }
+}
+
+// Cached client locations
+//
+// The NM hands out locations with this SS's location generation, and a client
+// going straight here from its cache sends it back (Message.location_gen).
+// The request is refused with ERR_STALE_LOCATION when the generation is not
+// the current one or the file is not here. A new generation is taken on every
+// start and whenever a Name Server had forgotten or written off this SS:
+// meanwhile its files may have been handed to a replica. Files rebalanced
+// away leave a forwarding address for the redirect hint.
+static uint16_t location_gen = 0;
+static LRUCache* moved_files = NULL;  // filename -> "ip|port" it migrated to
+static pthread_mutex_t moved_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void location_init() {
+    location_gen = (uint16_t)(getpid() ^ time(NULL));
+    if (location_gen == 0) {
+        location_gen = 1;
+    }
+    moved_files = lru_create(config_get_int("SS_MOVED_FILES", 1024));
+}
+
+static uint16_t current_location_gen() {
+    return __atomic_load_n(&location_gen, __ATOMIC_RELAXED);
+}
+
+static void new_location_gen() {
+    uint16_t gen = current_location_gen() + 1;
+    __atomic_store_n(&location_gen, gen ? gen : 1, __ATOMIC_RELAXED);
+}
+
+static void location_record_move(const char* filename, const char* ip, int port) {
+    char* hint = (char*)malloc(80);
+    snprintf(hint, 80, "%s|%d", ip, port);
+    pthread_mutex_lock(&moved_files_mutex);
+    lru_put(moved_files, filename, hint);
+    pthread_mutex_unlock(&moved_files_mutex);
+}
+
+// The name is stored here again
+static void location_forget_move(const char* filename) {
+    if (!moved_files) {
+        return;
+    }
+    pthread_mutex_lock(&moved_files_mutex);
+    if (moved_files->size > 0) {
+        lru_remove(moved_files, filename);
+    }
+    pthread_mutex_unlock(&moved_files_mutex);
+}
+
+// 1 (and the reply in response) if msg was sent on a location this SS no
+// longer stands behind
+static int stale_location(const Message* msg, Message* response) {
+    if (msg->location_gen == 0) {
+        return 0;
+    }
+    
+    if (msg->location_gen == current_location_gen()) {
+        if (msg->filename[0] == '\0') {
+            return 0;
+        }
+        pthread_mutex_lock(&meta_cache_mutex);
+        int here = hashmap_contains(meta_cache, msg->filename);
+        pthread_mutex_unlock(&meta_cache_mutex);
+        if (here) {
+            return 0;
+        }
+    }
+    
+    response->error_code = ERR_STALE_LOCATION;
+    response->data[0] = '\0';
+    pthread_mutex_lock(&moved_files_mutex);
+    const char* hint = (const char*)lru_get(moved_files, msg->filename);
+    if (hint && msg->location_gen == current_location_gen()) {
+        snprintf(response->data, BUFFER_SIZE, "%s", hint);
+    }
+    pthread_mutex_unlock(&moved_files_mutex);
+    return 1;
+}
+
+// Rebalancing, from the NM (signed, see peer_sign): "copy|ip|port" ships
+// the file to that SS; "drop|ip|port" ships it once more (changes made
+// during the move) and then removes the local copy without telling this
+// SS's replicas, which may be the new primary
+void handle_migrate(Message* msg, Message* response) {
+    if (!peer_valid(CMD_MIGRATE, msg->filename, message_payload(msg), message_payload_len(msg))) {
+        response->error_code = ERR_UNAUTHORIZED;
+        snprintf(response->data, BUFFER_SIZE, "Migrations must be signed by the Name Server");
+        log_message("STORAGE_SERVER", "WARNING", "Refused unsigned migration of %s", msg->filename);
+        return;
+    }
+    
+    char mode[8];
+    ReplicaConn conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.fd = -1;
+    if (sscanf(message_payload(msg) + PEER_AUTH_LEN, "%7[^|]|%63[^|]|%d", mode, conn.target.ip,
+               &conn.target.port) != 3 ||
+        (strcmp(mode, "copy") != 0 && strcmp(mode, "drop") != 0)) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Usage: copy|drop|ip|port");
+        return;
+    }
+    
+    // A drop holds the write lock from the last shipment until the copy is
+    // gone, so no write can land here in between and be lost
+    int drop = strcmp(mode, "drop") == 0;
+    size_t len = 0;
+    char* update;
+    if (drop) {
+        file_write_lock(msg->filename);
+        update = build_replica_update_locked(msg->filename, &len);
+    } else {
+        update = build_replica_update(msg->filename, &len);
+    }
+    int ok = update && replica_connect(&conn) == 0 &&
+             replica_send(&conn, msg->filename, update, len) == 0;
+    free(update);
+    if (conn.fd >= 0) {
+        close(conn.fd);
+    }
+    
+    if (!ok) {
+        if (drop) {
+            file_unlock(msg->filename);
+        }
+        response->error_code = ERR_STORAGE_SERVER_DOWN;
+        snprintf(response->data, BUFFER_SIZE, "Failed to ship %s to %s:%d", msg->filename,
+                 conn.target.ip, conn.target.port);
+        return;
+    }
+    
+    if (drop) {
+        char filepath[MAX_PATH];
+        snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
+        
+        history_reset(msg->filename);
+        unlink(filepath);
+        repl_applying = 1;
+        remove_metadata(msg->filename);
+        repl_applying = 0;
+        invalidate_file_caches(msg->filename);
+        location_record_move(msg->filename, conn.target.ip, conn.target.port);
+        file_unlock(msg->filename);
+    }
+    
+    response->error_code = SUCCESS;
+    snprintf(response->data, BUFFER_SIZE, "%s %s to %s:%d", drop ? "Moved" : "Copied",
+             msg->filename, conn.target.ip, conn.target.port);
+    log_message("STORAGE_SERVER", "INFO", "Migrate: %s", response->data);
+}
+
+void handle_create_file(Message* msg, Message* response) {
+    file_write_lock(msg->filename);
+    
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
+    
+    // Check if file exists
+    if (access(filepath, F_OK) == 0) {
+        response->error_code = ERR_FILE_EXISTS;
+        snprintf(response->data, BUFFER_SIZE, "File already exists");
+        file_unlock(msg->filename);
+        return;
+    }
+    
+    // Create empty file
+    make_parent_dirs(msg->filename);
+    FILE* fp = fopen(filepath, "w");
+    if (!fp) {
+        response->error_code = ERR_INTERNAL;
+        snprintf(response->data, BUFFER_SIZE, "Failed to create file");
+        file_unlock(msg->filename);
+        return;
+    }
+    fclose(fp);
+    invalidate_file_caches(msg->filename);
+    
+    // Create metadata
+    FileInfo info;
+    strncpy(info.filename, msg->filename, MAX_FILENAME - 1);
+    strncpy(info.owner, msg->username, MAX_USERNAME - 1);
+    info.created = time(NULL);
+    info.modified = info.created;
+    info.accessed = info.created;
+    strncpy(info.last_accessed_by, msg->username, MAX_USERNAME - 1);
+    info.word_count = 0;
+    info.char_count = 0;
+    
+    ACLEntry acl[MAX_ACL_ENTRIES];
+    int acl_count = 0;
+    
+    save_metadata(msg->filename, &info, acl, acl_count);
+    
+    response->error_code = SUCCESS;
+    snprintf(response->data, BUFFER_SIZE, "File %s created", msg->filename);
+    
+    log_message("STORAGE_SERVER", "INFO", "File created: %s by %s", msg->filename, msg->username);
+    
+    file_unlock(msg->filename);
+}
+
+// Record a read in the file's metadata. Only the table is updated; the
+// flush thread writes access times out later. Caller holds the file's lock.
+static void touch_access(const char* filename, const char* username) {
+    pthread_mutex_lock(&meta_cache_mutex);
+    MetaEntry* entry = (MetaEntry*)hashmap_get(meta_cache, filename);
+    if (entry) {
+        entry->info.accessed = time(NULL);
+        strncpy(entry->info.last_accessed_by, username, MAX_USERNAME - 1);
+        entry->info.last_accessed_by[MAX_USERNAME - 1] = '\0';
+        
+        MetaDirty* dirty = entry->dirty ? NULL : (MetaDirty*)malloc(sizeof(MetaDirty));
+        if (dirty) {
+            strncpy(dirty->filename, filename, MAX_FILENAME - 1);
+            dirty->filename[MAX_FILENAME - 1] = '\0';
+            dirty->next = meta_dirty;
+            meta_dirty = dirty;
+            entry->dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&meta_cache_mutex);
+}
+
+// Cold tier (cold_store.h): every SS_COLD_SCAN_SEC (default 300) the files
+// neither read nor written for cold_after_seconds() are frozen
+typedef struct {
+    time_t before;
+    char** names;
+    int count;
+    int capacity;
+} IdleScan;
+
+static void collect_idle(const char* key, void* value, void* ctx) {
+    IdleScan* scan = (IdleScan*)ctx;
+    const FileInfo* info = &((MetaEntry*)value)->info;
+    if (info->accessed >= scan->before || info->modified >= scan->before ||
+        info->char_count < cold_min_bytes() || cold_contains(key)) {
+        return;
+    }
+    
+    if (scan->count == scan->capacity) {
+        int capacity = scan->capacity ? scan->capacity * 2 : 256;
+        char** grown = (char**)realloc(scan->names, capacity * sizeof(char*));
+        if (!grown) {
+            return;
+        }
+        scan->names = grown;
+        scan->capacity = capacity;
+    }
+    scan->names[scan->count] = strdup(key);
+    if (scan->names[scan->count]) {
+        scan->count++;
+    }
+}
+
+static void cold_freeze_idle() {
+    IdleScan scan = {time(NULL) - cold_after_seconds(), NULL, 0, 0};
+    pthread_mutex_lock(&meta_cache_mutex);
+    hashmap_foreach(meta_cache, collect_idle, &scan);
+    pthread_mutex_unlock(&meta_cache_mutex);
+    
+    int frozen = 0;
+    for (int i = 0; i < scan.count; i++) {
+        const char* filename = scan.names[i];
+        file_write_lock(filename);
+        
+        // A request may have used it since the scan
+        pthread_mutex_lock(&meta_cache_mutex);
+        MetaEntry* entry = (MetaEntry*)hashmap_get(meta_cache, filename);
+        int idle = entry && entry->info.accessed < scan.before &&
+                   entry->info.modified < scan.before;
+        pthread_mutex_unlock(&meta_cache_mutex);
+        
+        if (idle && cold_freeze(filename) == 1) {
+            invalidate_file_caches(filename);
+            frozen++;
+        }
+        file_unlock(filename);
+        free(scan.names[i]);
+    }
+    free(scan.names);
+    
+    if (frozen > 0) {
+        log_message("STORAGE_SERVER", "INFO", "Froze %d of %d idle files", frozen, scan.count);
+    }
+}
+
+static void* cold_freeze_thread(void* arg) {
+    int interval = *(int*)arg;
+    while (running) {
+        sleep(interval);
+        cold_freeze_idle();
+    }
+    return NULL;
+}
+
+static void cold_tier_init() {
+    if (cold_after_seconds() == 0) {
+        return;
+    }
+    
+    static int interval;
+    interval = config_get_int("SS_COLD_SCAN_SEC", 300);
+    if (interval <= 0) {
+        interval = 300;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, cold_freeze_thread, &interval);
+    pthread_detach(thread);
+}
+
+// The file a request works on: the commands that take a second name or a
+// tag carry both in data, "<file>|<other>"
+static const char* request_filename(const Message* msg, char* buf, size_t len) {
+    switch (msg->command) {
+        case CMD_COPY:
+        case CMD_MOVE:
+        case CMD_CHECKPOINT:
+        case CMD_VIEWCHECKPOINT:
+        case CMD_REVERT: {
+            const char* bar = strchr(msg->data, '|');
+            size_t n = bar ? (size_t)(bar - msg->data) : 0;
+            if (n >= len) {
+                n = 0;
+            }
+            memcpy(buf, msg->data, n);
+            buf[n] = '\0';
+            return buf;
+        }
+        default:
+            return msg->filename;
+    }
+}
+
+// A frozen file is thawed before its request runs, so handlers only ever
+// see data/files
+static void thaw_request_file(const Message* msg) {
+    switch (msg->command) {
+        // Metadata only: the file can stay frozen
+        case CMD_FILEINFO:
+        case CMD_INFO:
+        case CMD_ADDACCESS:
+        case CMD_REMACCESS:
+        case CMD_LISTCHECKPOINTS:
+            return;
+    }
+    
+    char name[MAX_FILENAME];
+    const char* filename = request_filename(msg, name, sizeof(name));
+    if (!filename[0] || !cold_contains(filename)) {
+        return;
+    }
+    
+    file_write_lock(filename);
+    cold_thaw(filename);
+    file_unlock(filename);
+}
+
+// Read-path transfer accounting, reported by CMD_STATS. sendfile and mmap
+// are the zero-copy paths; buffered is the pread-into-a-buffer fallback;
+// cached bytes come from the content cache.
+static pthread_mutex_t read_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long read_bytes_sendfile = 0;
+static unsigned long long read_bytes_mmap = 0;
+static unsigned long long read_bytes_buffered = 0;
+static unsigned long long read_bytes_cached = 0;
+
+static void count_read_bytes(unsigned long long* counter, size_t n) {
+    pthread_mutex_lock(&read_stats_mutex);
+    *counter += n;
+    pthread_mutex_unlock(&read_stats_mutex);
+}
+
+// Files up to this size are served from an mmap'ed view, larger ones with
+// sendfile(2)
+static off_t ss_mmap_max() {
+    static int mmap_max = -1;
+    if (mmap_max < 0) {
+        mmap_max = config_get_int("SS_MMAP_MAX", 64 * 1024);
+    }
+    return mmap_max;
+}
+
+// Send out with len bytes at offset of fd (a file of file_size bytes) as its
+// data section. Files are only ever replaced by rename, never truncated in
+// place, so a mapping cannot lose its pages under us.
+static int send_file_range(int client_socket, Message* out, int fd, off_t offset, size_t len,
+                           off_t file_size) {
+    // Legacy structs copy the data anyway, so they take the buffered path
+    int zero_copy = len > 0 && len <= message_max_payload(out) &&
+                    message_max_payload(out) == FRAME_MAX_BODY;
+    
+    if (zero_copy && file_size > ss_mmap_max()) {
+        if (send_message_file(client_socket, out, fd, offset, len) < 0) {
+            return -1;
+        }
+        count_read_bytes(&read_bytes_sendfile, len);
+        return 0;
+    }
+    
+    if (zero_copy) {
+        off_t page = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        size_t delta = offset - page;
+        char* view = (char*)mmap(NULL, len + delta, PROT_READ, MAP_SHARED, fd, page);
+        if (view != MAP_FAILED) {
+            out->body = view + delta;
+            out->body_len = len;
+            int rc = send_message(client_socket, out);
+            out->body = NULL;
+            munmap(view, len + delta);
+            if (rc == 0) {
+                count_read_bytes(&read_bytes_mmap, len);
+            }
+            return rc;
+        }
+    }
+    
+    // Legacy peers (which only take BUFFER_SIZE - 1 bytes) and mmap failures
+    if (len > message_max_payload(out)) {
+        len = message_max_payload(out);
+    }
+    char* buffer = (char*)malloc(len + 1);
+    if (!buffer) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buffer + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    
+    out->body = buffer;
+    out->body_len = done;
+    int rc = send_message(client_socket, out);
+    out->body = NULL;
+    free(buffer);
+    if (rc == 0) {
+        count_read_bytes(&read_bytes_buffered, done);
+    }
+    return rc;
+}
+
+static int ss_chunk_size() {
+    static int chunk_size = 0;
+    if (chunk_size == 0) {
+        int size = config_get_int("SS_CHUNK_SIZE", FILE_CHUNK_SIZE);
+        chunk_size = (size > 0 && size <= FRAME_MAX_BODY) ? size : FILE_CHUNK_SIZE;
+    }
+    return chunk_size;
+}
+
+// Reply to msg outside the normal one-response-per-request path
+static int send_stream_message(int client_socket, const Message* msg, int msg_type,
+                               int error_code, const char* body, size_t body_len) {
+    Message out;
+    memset(&out, 0, sizeof(Message));
+    out.msg_type = msg_type;
+    out.request_id = msg->request_id;
+    out.legacy = msg->legacy;
+    out.command = msg->command;
+    out.error_code = error_code;
+    
+    if (body_len > 0) {
+        out.body = (char*)body;
+        out.body_len = body_len;
+    } else if (body) {
+        snprintf(out.data, BUFFER_SIZE, "%s", body);
+    }
+    
+    return send_message(client_socket, &out);
+}
+
+// Where a read's bytes come from: the content cache, or an open file
+typedef struct {
+    CachedFile* cached;
+    int fd;
+    off_t size;
+} ReadSource;
+
+static void close_read_source(ReadSource* src) {
+    if (src->cached) {
+        cached_file_release(src->cached);
+    }
+    if (src->fd >= 0) {
+        close(src->fd);
+    }
+}
+
+// Open filename for reading on behalf of msg's user and record the access.
+// Returns 0, or -1 with the error already sent as the reply (*rc is the
+// send result).
+static int open_for_read(int client_socket, Message* msg, ReadSource* src, int* rc) {
+    src->cached = NULL;
+    src->fd = -1;
+    
+    file_read_lock(msg->filename);
+    
+    if (!check_access(msg->filename, msg->username, PERM_READ)) {
+        file_unlock(msg->filename);
+        *rc = send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_UNAUTHORIZED,
+                                  "No read access", 0);
+        return -1;
+    }
+    
+    CachedFile* cached = content_cache_get(msg->filename, 1);
+    if (cached && cached->has_data) {
+        src->cached = cached;
+        src->size = cached->size;
+    } else {
+        if (cached) {
+            cached_file_release(cached);
+        }
+        
+        char filepath[MAX_PATH];
+        snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
+        
+        struct stat st;
+        src->fd = open(filepath, O_RDONLY);
+        if (src->fd < 0 || fstat(src->fd, &st) < 0) {
+            close_read_source(src);
+            file_unlock(msg->filename);
+            *rc = send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_FILE_NOT_FOUND,
+                                      "File not found", 0);
+            return -1;
+        }
+        src->size = st.st_size;
+    }
+    
+    touch_access(msg->filename, msg->username);
+    file_unlock(msg->filename);
+    return 0;
+}
+
+// Send out with len bytes at offset of src as its data section
+static int send_source_range(int client_socket, Message* out, ReadSource* src, off_t offset,
+                             size_t len) {
+    if (!src->cached) {
+        return send_file_range(client_socket, out, src->fd, offset, len, src->size);
+    }
+    
+    if (len > message_max_payload(out)) {
+        len = message_max_payload(out);
+    }
+    out->body = src->cached->data + offset;
+    out->body_len = len;
+    int rc = send_message(client_socket, out);
+    out->body = NULL;
+    if (rc == 0) {
+        count_read_bytes(&read_bytes_cached, len);
+    }
+    return rc;
+}
+
+// Whole-file read in a single response, from the content cache or without
+// copying through user space where possible (see send_file_range). Legacy
+// peers get the first BUFFER_SIZE - 1 bytes. Returns -1 if the connection
+// broke.
+static int handle_read_file(int client_socket, Message* msg) {
+    ReadSource src;
+    int rc = 0;
+    if (open_for_read(client_socket, msg, &src, &rc) < 0) {
+        return rc;
+    }
+    
+    if (src.size > FRAME_MAX_BODY) {
+        close_read_source(&src);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_INVALID_PARAMETERS,
+                                   "File too large for a single READ; use a chunked read", 0);
+    }
+    
+    Message out;
+    memset(&out, 0, sizeof(Message));
+    out.msg_type = MSG_RESPONSE;
+    out.request_id = msg->request_id;
+    out.legacy = msg->legacy;
+    out.error_code = SUCCESS;
+    
+    if (src.size == 0) {
+        rc = send_message(client_socket, &out);
+    } else {
+        rc = send_source_range(client_socket, &out, &src, 0, src.size);
+    }
+    
+    log_message("STORAGE_SERVER", "INFO", "File read: %s by %s (%lld bytes%s)",
+               msg->filename, msg->username, (long long)src.size, src.cached ? ", cached" : "");
+    close_read_source(&src);
+    return rc;
+}
+
+// READ_CHUNKED: stream a file, or the range "offset|length" of it (length 0
+// means to the end), as
+//   MSG_RESPONSE "size|offset|length", MSG_CHUNK..., MSG_END "bytes"
+// or a single error MSG_RESPONSE. The lock is only held to open the file:
+// writers replace files by rename, so the open descriptor keeps reading a
+// consistent version while they proceed. Returns -1 if the connection broke.
+static int handle_read_chunked(int client_socket, Message* msg) {
+    ReadSource src;
+    int rc = 0;
+    if (open_for_read(client_socket, msg, &src, &rc) < 0) {
+        return rc;
+    }
+    
+    // Optional range
+    long long offset = 0, length = 0;
+    if (msg->data[0] != '\0' &&
+        (sscanf(msg->data, "%lld|%lld", &offset, &length) < 1 || offset < 0 || length < 0)) {
+        close_read_source(&src);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_INVALID_PARAMETERS,
+                                   "Malformed range (use offset|length)", 0);
+    }
+    if (offset > src.size) {
+        close_read_source(&src);
+        char error[128];
+        snprintf(error, sizeof(error), "Range starts past end of file (%lld bytes)",
+                 (long long)src.size);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_INVALID_PARAMETERS,
+                                   error, 0);
+    }
+    if (length == 0 || length > src.size - offset) {
+        length = src.size - offset;
+    }
+    
+    size_t chunk_size = ss_chunk_size();
+    if (chunk_size > message_max_payload(msg)) {
+        chunk_size = message_max_payload(msg);
+    }
+    
+    char header[128];
+    snprintf(header, sizeof(header), "%lld|%lld|%lld", (long long)src.size, offset, length);
+    if (send_stream_message(client_socket, msg, MSG_RESPONSE, SUCCESS, header, 0) < 0) {
+        close_read_source(&src);
+        return -1;
+    }
+    
+    Message chunk;
+    memset(&chunk, 0, sizeof(Message));
+    chunk.msg_type = MSG_CHUNK;
+    chunk.request_id = msg->request_id;
+    chunk.legacy = msg->legacy;
+    chunk.command = msg->command;
+    
+    long long sent = 0;
+    while (sent < length) {
+        size_t want = (size_t)(length - sent) < chunk_size ? (size_t)(length - sent) : chunk_size;
+        if (send_source_range(client_socket, &chunk, &src, offset + sent, want) < 0) {
+            close_read_source(&src);
+            return -1;
+        }
+        sent += want;
+    }
+    
+    close_read_source(&src);
+    
+    char trailer[64];
+    snprintf(trailer, sizeof(trailer), "%lld", sent);
+    log_message("STORAGE_SERVER", "INFO", "Chunked read: %s by %s (%lld bytes from %lld)",
+               msg->filename, msg->username, sent, offset);
+    return send_stream_message(client_socket, msg, MSG_END, SUCCESS, trailer, 0);
+}
+
+// STREAM: send a file's words as they are read, as
+//   MSG_RESPONSE "size|pace_ms|window", MSG_CHUNK..., MSG_END "words"
+// Each chunk holds space-separated words: one per chunk, pace_ms apart, or
+// with pace 0 as many as fit in SS_CHUNK_SIZE. The request data is
+// "window[|pace_ms]"; without a pace SS_STREAM_WORD_MS applies. A window of
+// N > 0 lets the client have at most N chunks unacknowledged: every N/2
+// chunks it consumes, the client sends MSG_ACK "N/2" for more credit
+// (including after the last one, which the server drains before the next
+// request). Window 0 leaves back-pressure to TCP.
+
+#define STREAM_READ_SIZE (64 * 1024)
+#define STREAM_MAX_PACE_MS 1000
+#define STREAM_MAX_WINDOW 1024
+
+typedef struct {
+    int socket;
+    const Message* request;
+    Message chunk;
+    char* frame;         // Words for the next chunk
+    size_t frame_len;
+    size_t frame_cap;
+    int pace_ms;
+    int window;          // 0: no credit-based flow control
+    int credits;
+    long acks;           // Credit messages received
+    long words;
+    long chunks;
+} WordStream;
+
+static int stream_credit_timeout_ms() {
+    static int timeout_ms = 0;
+    if (timeout_ms == 0) {
+        int ms = config_get_int("SS_STREAM_CREDIT_TIMEOUT_MS", 30000);
+        timeout_ms = ms > 0 ? ms : 30000;
+    }
+    return timeout_ms;
+}
+
+// Wait for the client to grant more chunks. Returns -1 if it went away,
+// stalled past SS_STREAM_CREDIT_TIMEOUT_MS or broke the protocol.
+static int stream_wait_credit(WordStream* ws) {
+    struct pollfd pfd = {ws->socket, POLLIN, 0};
+    int ready;
+    do {
+        ready = poll(&pfd, 1, stream_credit_timeout_ms());
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) {
+        log_message("STORAGE_SERVER", "WARNING", "Stream of %s: no credit from client",
+                   ws->request->filename);
+        return -1;
+    }
+    
+    Message ack;
+    if (receive_message(ws->socket, &ack) < 0 || ack.msg_type != MSG_ACK) {
+        message_free_body(&ack);
+        return -1;
+    }
+    int granted = atoi(ack.data);
+    message_free_body(&ack);
+    if (granted <= 0 || granted > ws->window) {
+        return -1;
+    }
+    ws->credits += granted;
+    ws->acks++;
+    return 0;
+}
+
+static int stream_flush(WordStream* ws) {
+    if (ws->frame_len == 0) {
+        return 0;
+    }
+    while (ws->window > 0 && ws->credits == 0) {
+        if (stream_wait_credit(ws) < 0) {
+            return -1;
+        }
+    }
+    
+    ws->chunk.body = ws->frame;
+    ws->chunk.body_len = ws->frame_len;
+    int rc = send_message(ws->socket, &ws->chunk);
+    ws->chunk.body = NULL;
+    if (rc < 0) {
+        return -1;
+    }
+    ws->frame_len = 0;
+    ws->credits--;
+    ws->chunks++;
+    return 0;
+}
+
+static int stream_word(WordStream* ws, const char* word, size_t len) {
+    if (len > MAX_WORD_LENGTH - 1) {
+        len = MAX_WORD_LENGTH - 1;
+    }
+    if (ws->frame_len > 0 && ws->frame_len + 1 + len > ws->frame_cap) {
+        if (stream_flush(ws) < 0) {
+            return -1;
+        }
+    }
+    if (ws->frame_len > 0) {
+        ws->frame[ws->frame_len++] = ' ';
+    }
+    memcpy(ws->frame + ws->frame_len, word, len);
+    ws->frame_len += len;
+    ws->words++;
     
-    char filepath[MAX_PATH];
-    snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
+    if (ws->pace_ms > 0) {
+        if (stream_flush(ws) < 0) {
+            return -1;
+        }
+        usleep(ws->pace_ms * 1000);
+    }
+    return 0;
+}
+
+// Next block of src at offset into buf; 0 at end of file
+static ssize_t stream_read_block(ReadSource* src, off_t offset, char* buf, size_t len) {
+    if (offset >= src->size) {
+        return 0;
+    }
+    if (src->cached) {
+        size_t n = (size_t)(src->size - offset) < len ? (size_t)(src->size - offset) : len;
+        memcpy(buf, src->cached->data + offset, n);
+        return n;
+    }
+    ssize_t n;
+    do {
+        n = pread(src->fd, buf, len, offset);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Tokenize src block by block, carrying a word cut by a block boundary into
+// the next block. Words longer than MAX_WORD_LENGTH - 1 are truncated.
+static int stream_words(WordStream* ws, ReadSource* src) {
+    char* buf = (char*)arena_alloc(request_arena(), MAX_WORD_LENGTH + STREAM_READ_SIZE);
+    if (!buf) {
+        return -1;
+    }
     
-    // Check if file exists
-    if (access(filepath, F_OK) == 0) {
-        response->error_code = ERR_FILE_EXISTS;
-        snprintf(response->data, BUFFER_SIZE, "File already exists");
-        pthread_mutex_unlock(&file_mutex);
-        return;
+    TextSpan spans[512];
+    size_t carry = 0;   // Start of a word at buf[0]
+    int skipping = 0;   // Inside an over-long word that was already sent
+    off_t offset = 0;
+    int rc = 0;
+    while (rc == 0) {
+        ssize_t n = stream_read_block(src, offset, buf + carry, STREAM_READ_SIZE);
+        if (n < 0) {
+            log_message("STORAGE_SERVER", "ERROR", "Stream of %s: read failed: %s",
+                       ws->request->filename, strerror(errno));
+            rc = -1;
+            break;
+        }
+        offset += n;
+        int eof = n == 0;
+        size_t have = carry + n;
+        carry = 0;
+        
+        size_t pos = 0;
+        while (rc == 0 && pos < have) {
+            int count = tokenize_words(buf + pos, have - pos, spans, 512);
+            if (count == 0) {
+                skipping = 0;
+                break;
+            }
+            
+            for (int i = 0; i < count; i++) {
+                size_t start = pos + spans[i].offset;
+                size_t len = spans[i].length;
+                int open_end = !eof && start + len == have;
+                
+                if (skipping) {
+                    skipping = start == 0 && open_end;
+                    if (start == 0) {
+                        continue;
+                    }
+                }
+                if (open_end && len < MAX_WORD_LENGTH - 1) {
+                    memmove(buf, buf + start, len);
+                    carry = len;
+                    break;
+                }
+                if (stream_word(ws, buf + start, len) < 0) {
+                    rc = -1;
+                    break;
+                }
+                skipping = open_end;
+            }
+            pos += spans[count - 1].offset + spans[count - 1].length;
+            if (carry || count < 512) {
+                break;
+            }
+        }
+        if (eof) {
+            break;
+        }
     }
     
-    // Create empty file
-    FILE* fp = fopen(filepath, "w");
-    if (!fp) {
-        response->error_code = ERR_INTERNAL;
-        snprintf(response->data, BUFFER_SIZE, "Failed to create file");
-        pthread_mutex_unlock(&file_mutex);
-        return;
+    if (rc == 0) {
+        rc = stream_flush(ws);
+    }
+    return rc;
+}
+
+static int handle_stream(int client_socket, Message* msg) {
+    ReadSource src;
+    int rc = 0;
+    if (open_for_read(client_socket, msg, &src, &rc) < 0) {
+        return rc;
     }
-    fclose(fp);
     
-    // Create metadata
-    FileInfo info;
-    strncpy(info.filename, msg->filename, MAX_FILENAME - 1);
-    strncpy(info.owner, msg->username, MAX_USERNAME - 1);
-    info.created = time(NULL);
-    info.modified = info.created;
-    info.accessed = info.created;
-    strncpy(info.last_accessed_by, msg->username, MAX_USERNAME - 1);
-    info.word_count = 0;
-    info.char_count = 0;
+    int window = 0;
+    int pace_ms = config_get_int("SS_STREAM_WORD_MS", 100);
+    int fields = sscanf(msg->data, "%d|%d", &window, &pace_ms);
+    if (fields < 0) {
+        window = 0;
+    }
+    if (window < 0 || window > STREAM_MAX_WINDOW || pace_ms < 0 || pace_ms > STREAM_MAX_PACE_MS) {
+        close_read_source(&src);
+        char error[128];
+        snprintf(error, sizeof(error), "Invalid stream parameters (window 0-%d, pace 0-%d ms)",
+                 STREAM_MAX_WINDOW, STREAM_MAX_PACE_MS);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_INVALID_PARAMETERS,
+                                   error, 0);
+    }
     
-    ACLEntry acl[MAX_ACL_ENTRIES];
-    int acl_count = 0;
+    WordStream ws;
+    memset(&ws, 0, sizeof(WordStream));
+    ws.socket = client_socket;
+    ws.request = msg;
+    ws.pace_ms = pace_ms;
+    ws.window = window;
+    ws.credits = window;
+    ws.frame_cap = ss_chunk_size();
+    if (ws.frame_cap > message_max_payload(msg)) {
+        ws.frame_cap = message_max_payload(msg);
+    }
+    ws.chunk.msg_type = MSG_CHUNK;
+    ws.chunk.request_id = msg->request_id;
+    ws.chunk.legacy = msg->legacy;
+    ws.chunk.command = msg->command;
+    ws.frame = (char*)malloc(ws.frame_cap);
+    if (!ws.frame) {
+        close_read_source(&src);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_INTERNAL,
+                                   "Out of memory", 0);
+    }
     
-    save_metadata(msg->filename, &info, acl, acl_count);
+    char header[128];
+    snprintf(header, sizeof(header), "%lld|%d|%d", (long long)src.size, pace_ms, window);
+    rc = send_stream_message(client_socket, msg, MSG_RESPONSE, SUCCESS, header, 0);
+    if (rc == 0) {
+        rc = stream_words(&ws, &src);
+    }
+    close_read_source(&src);
+    free(ws.frame);
+    if (rc < 0) {
+        log_message("STORAGE_SERVER", "WARNING", "Stream: %s by %s stopped after %ld words",
+                   msg->filename, msg->username, ws.words);
+        return -1;
+    }
     
-    response->error_code = SUCCESS;
-    snprintf(response->data, BUFFER_SIZE, "File %s created", msg->filename);
+    char trailer[64];
+    snprintf(trailer, sizeof(trailer), "%ld", ws.words);
+    if (send_stream_message(client_socket, msg, MSG_END, SUCCESS, trailer, 0) < 0) {
+        return -1;
+    }
     
-    log_message("STORAGE_SERVER", "INFO", "File created: %s by %s", msg->filename, msg->username);
+    // Credit the client sent for the last chunks
+    if (window > 0) {
+        long expected = ws.chunks / (window / 2 > 0 ? window / 2 : 1);
+        while (ws.acks < expected) {
+            if (stream_wait_credit(&ws) < 0) {
+                return -1;
+            }
+        }
+    }
     
-    pthread_mutex_unlock(&file_mutex);
+    log_message("STORAGE_SERVER", "INFO", "Stream: %s by %s (%ld words in %ld chunks, %d ms pace)",
+               msg->filename, msg->username, ws.words, ws.chunks, pace_ms);
+    return 0;
+}
+
+// EXEC: run a file on the executor pool (see executor.h) and stream its
+// output back as
+//   MSG_RESPONSE "queue_position", MSG_CHUNK..., MSG_END "status|exit_code|wait_ms|run_ms"
+// where the position is 0 when a worker is free. The MSG_END error code is
+// SUCCESS only if the job exited with status 0. A full queue is refused
+// with a single error MSG_RESPONSE.
+
+#define EXEC_SCRIPT_MAX (1024 * 1024)
+
+typedef struct {
+    int socket;
+    Message chunk;
+    size_t chunk_size;
+} ExecStream;
+
+static int exec_output(void* ctx, const char* data, size_t len) {
+    ExecStream* stream = (ExecStream*)ctx;
+    while (len > 0) {
+        size_t n = len < stream->chunk_size ? len : stream->chunk_size;
+        stream->chunk.body = (char*)data;
+        stream->chunk.body_len = n;
+        int rc = send_message(stream->socket, &stream->chunk);
+        stream->chunk.body = NULL;
+        if (rc < 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
 }
 
-void handle_read_file(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+static int handle_exec(int client_socket, Message* msg) {
+    ReadSource src;
+    int rc = 0;
+    if (open_for_read(client_socket, msg, &src, &rc) < 0) {
+        return rc;
+    }
     
-    if (!check_access(msg->filename, msg->username, PERM_READ)) {
-        response->error_code = ERR_UNAUTHORIZED;
-        snprintf(response->data, BUFFER_SIZE, "No read access");
-        pthread_mutex_unlock(&file_mutex);
-        return;
+    if (src.size > EXEC_SCRIPT_MAX) {
+        close_read_source(&src);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_EXEC_FAILED,
+                                   "File too large to execute", 0);
     }
     
-    char content[BUFFER_SIZE];
-    if (load_file_content(msg->filename, content, BUFFER_SIZE) < 0) {
-        response->error_code = ERR_FILE_NOT_FOUND;
-        snprintf(response->data, BUFFER_SIZE, "File not found");
-        pthread_mutex_unlock(&file_mutex);
-        return;
+    // The job runs from its own copy, so the file may change meanwhile
+    char* script = (char*)malloc(src.size + 1);
+    ssize_t got = script ? stream_read_block(&src, 0, script, src.size) : -1;
+    close_read_source(&src);
+    if (got != src.size) {
+        free(script);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_INTERNAL,
+                                   "Failed to read file", 0);
+    }
+    
+    int position = executor_reserve();
+    if (position < 0) {
+        free(script);
+        log_message("STORAGE_SERVER", "WARNING", "EXEC: %s by %s refused, executor queue full",
+                   msg->filename, msg->username);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_EXEC_FAILED,
+                                   "Executor busy, try again later", 0);
+    }
+    
+    char header[64];
+    snprintf(header, sizeof(header), "%d", position);
+    if (send_stream_message(client_socket, msg, MSG_RESPONSE, SUCCESS, header, 0) < 0) {
+        executor_release();
+        free(script);
+        return -1;
+    }
+    
+    ExecStream stream;
+    memset(&stream, 0, sizeof(ExecStream));
+    stream.socket = client_socket;
+    stream.chunk.msg_type = MSG_CHUNK;
+    stream.chunk.request_id = msg->request_id;
+    stream.chunk.legacy = msg->legacy;
+    stream.chunk.command = msg->command;
+    stream.chunk_size = ss_chunk_size();
+    if (stream.chunk_size > message_max_payload(msg)) {
+        stream.chunk_size = message_max_payload(msg);
+    }
+    
+    ExecResult result;
+    executor_run(script, got, exec_output, &stream, &result);
+    free(script);
+    
+    log_message("STORAGE_SERVER", "INFO",
+               "EXEC: %s by %s (%s %d, %lld ms queued, %lld ms run, %zu output bytes)",
+               msg->filename, msg->username, executor_status_name(result.status),
+               result.exit_code, result.wait_ms, result.run_ms, result.output_bytes);
+    if (result.status == EXEC_ABORTED) {
+        return -1;
+    }
+    
+    char trailer[128];
+    snprintf(trailer, sizeof(trailer), "%s|%d|%lld|%lld", executor_status_name(result.status),
+             result.exit_code, result.wait_ms, result.run_ms);
+    int ok = result.status == EXEC_EXITED && result.exit_code == 0;
+    return send_stream_message(client_socket, msg, MSG_END, ok ? SUCCESS : ERR_EXEC_FAILED,
+                               trailer, 0);
+}
+
+// WRITE_BULK: replace a file's contents with a chunked upload:
+//   request -> MSG_RESPONSE "ready" (or an error, and nothing follows)
+//   MSG_CHUNK... MSG_END from the client -> final MSG_RESPONSE
+// The upload is spooled into a temporary file without the file lock, which
+// is only taken to install it. Returns -1 if the connection broke.
+static int handle_write_bulk(int client_socket, Message* msg) {
+    file_read_lock(msg->filename);
+    int allowed = check_access(msg->filename, msg->username, PERM_WRITE);
+    file_unlock(msg->filename);
+    
+    if (!allowed) {
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_UNAUTHORIZED,
+                                   "No write access", 0);
+    }
+    
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
+    
+    char tmp_path[MAX_PATH + 16];
+    int fd = create_temp_file(filepath, tmp_path, sizeof(tmp_path));
+    if (fd < 0) {
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_INTERNAL,
+                                   "Failed to stage upload", 0);
+    }
+    
+    if (send_stream_message(client_socket, msg, MSG_RESPONSE, SUCCESS, "ready", 0) < 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    
+    // Drain the whole upload even after a local failure so the connection
+    // stays in step with the client
+    int status = SUCCESS;
+    size_t total = 0;
+    while (1) {
+        Message chunk;
+        if (receive_message(client_socket, &chunk) < 0 ||
+            (chunk.msg_type != MSG_CHUNK && chunk.msg_type != MSG_END)) {
+            log_message("STORAGE_SERVER", "ERROR", "Upload of %s interrupted after %zu bytes",
+                       msg->filename, total);
+            message_free_body(&chunk);
+            close(fd);
+            unlink(tmp_path);
+            return -1;
+        }
+        
+        if (chunk.msg_type == MSG_END) {
+            if (chunk.error_code != SUCCESS && status == SUCCESS) {
+                status = ERR_INVALID_PARAMETERS;  // Client gave up
+            }
+            message_free_body(&chunk);
+            break;
+        }
+        
+        size_t len = message_payload_len(&chunk);
+        if (status == SUCCESS && write_all_fd(fd, message_payload(&chunk), len) < 0) {
+            log_message("FILE_OPS", "ERROR", "Failed to write to temporary file %s: %s",
+                       tmp_path, strerror(errno));
+            status = ERR_INTERNAL;
+        }
+        total += len;
+        message_free_body(&chunk);
+    }
+    
+    if (status != SUCCESS) {
+        close(fd);
+        unlink(tmp_path);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, status,
+                                   status == ERR_INTERNAL ? "Failed to save file" : "Upload aborted", 0);
     }
     
-    // Update access time
+    file_write_lock(msg->filename);
+    
     FileInfo info;
     ACLEntry acl[MAX_ACL_ENTRIES];
     int acl_count = 0;
     
-    if (load_metadata(msg->filename, &info, acl, &acl_count) == 0) {
-        info.accessed = time(NULL);
-        strncpy(info.last_accessed_by, msg->username, MAX_USERNAME - 1);
-        save_metadata(msg->filename, &info, acl, acl_count);
+    // The file may have been deleted or had its ACL changed meanwhile
+    if (load_metadata(msg->filename, &info, acl, &acl_count) < 0 ||
+        !check_access(msg->filename, msg->username, PERM_WRITE)) {
+        file_unlock(msg->filename);
+        close(fd);
+        unlink(tmp_path);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_FILE_NOT_FOUND,
+                                   "File no longer available for writing", 0);
+    }
+    
+    // A small upload goes into the history as one whole-file change; a
+    // large one ends the history instead
+    size_t inline_max = (size_t)config_get_int("SS_HISTORY_INLINE_MAX", 1024 * 1024);
+    struct stat old_st;
+    off_t mark = -1;
+    int recorded = 0;
+    if (stat(filepath, &old_st) == 0 && (size_t)old_st.st_size <= inline_max && total <= inline_max) {
+        char* old_content = load_file(msg->filename);
+        char* new_content = (char*)malloc(total + 1);
+        if (old_content && new_content && pread(fd, new_content, total, 0) == (ssize_t)total) {
+            HistoryStep step = {0, (size_t)old_st.st_size, total, old_content, new_content};
+            recorded = history_append(msg->filename, HISTORY_EDIT, 0, &step, 1, total, &mark) == 0;
+        }
+        free(old_content);
+        free(new_content);
+    }
+    if (!recorded) {
+        history_reset(msg->filename);
+    }
+    
+    if (commit_temp_file(fd, tmp_path, filepath, 1) < 0) {
+        if (recorded) {
+            history_cancel(msg->filename, mark);
+        }
+        invalidate_file_caches(msg->filename);
+        file_unlock(msg->filename);
+        return send_stream_message(client_socket, msg, MSG_RESPONSE, ERR_INTERNAL,
+                                   "Failed to save file", 0);
     }
     
-    response->error_code = SUCCESS;
-    strncpy(response->data, content, BUFFER_SIZE - 1);
-    response->data_len = strlen(content);
+    // Index the new contents once; later writes and INFO reuse it
+    invalidate_file_caches(msg->filename);
+    SentenceIndex* idx = sentence_index_load(msg->filename, filepath);
+    info.modified = time(NULL);
+    info.word_count = idx ? idx->total_words : 0;
+    info.char_count = (int)total;
+    save_metadata(msg->filename, &info, acl, acl_count);
+    free(idx);
+    
+    file_unlock(msg->filename);
     
-    log_message("STORAGE_SERVER", "INFO", "File read: %s by %s", msg->filename, msg->username);
+    log_message("STORAGE_SERVER", "INFO", "Bulk write: %s by %s (%zu bytes)",
+               msg->filename, msg->username, total);
+    
+    char result[128];
+    snprintf(result, sizeof(result), "Wrote %zu bytes", total);
+    return send_stream_message(client_socket, msg, MSG_RESPONSE, SUCCESS, result, 0);
+}
+
+// Log a commit's splices (sorted by offset, against the file open as fd) in
+// the file's history. The steps go last to first so that every offset is
+// still right when its step is replayed.
+static int record_commit(const char* filename, int fd, size_t old_size,
+                         const SpliceEdit* edits, int count, off_t* mark) {
+    HistoryStep steps[LEASE_MAX_SENTENCES];
+    Arena* arena = request_arena();
+    size_t size_after = old_size;
+    int ok = 1;
+    
+    for (int i = 0; i < count && ok; i++) {
+        const SpliceEdit* edit = &edits[count - 1 - i];
+        const SentenceSplice* splice = &edit->splice;
+        char* old_bytes = (char*)arena_alloc(arena, splice->old_length + 1);
+        char* new_bytes = (char*)arena_alloc(arena, edit->len + 2);
+        ok = old_bytes && new_bytes &&
+             pread(fd, old_bytes, splice->old_length, splice->offset) == (ssize_t)splice->old_length;
+        if (!ok) {
+            break;
+        }
+        
+        if (splice->separator) {
+            new_bytes[0] = ' ';
+        }
+        memcpy(new_bytes + splice->separator, edit->text, edit->len);
+        steps[i].offset = splice->offset;
+        steps[i].old_len = splice->old_length;
+        steps[i].new_len = edit->len + splice->separator;
+        steps[i].old_bytes = old_bytes;
+        steps[i].new_bytes = new_bytes;
+        size_after += steps[i].new_len - steps[i].old_len;
+    }
     
-    pthread_mutex_unlock(&file_mutex);
+    ok = ok && history_append(filename, HISTORY_EDIT, 0, steps, count, size_after, mark) == 0;
+    return ok ? 0 : -1;
+}
+
+// One sentence of a WRITE_COMMIT
+typedef struct {
+    int sentence;
+    char* edits;   // "word_index|word|word_index|word|..."
+    char* text;    // The rewritten sentence
+    size_t len;
+} CommitSentence;
+
+static int compare_commit_sentences(const void* a, const void* b) {
+    return ((const CommitSentence*)a)->sentence - ((const CommitSentence*)b)->sentence;
+}
+
+// Applies edits to the sentence in text (MAX_SENTENCE_LENGTH bytes, scratch
+// as spare space), swapping the two as it goes
+static int apply_word_edits(const char* edits, char** text, char** scratch) {
+    const char* data_ptr = edits;
+    while (*data_ptr != '\0') {
+        int word_index;
+        char word[MAX_WORD_LENGTH];
+        
+        if (sscanf(data_ptr, "%d|%127[^|]|", &word_index, word) != 2) {
+            break;
+        }
+        
+        if (insert_word(*text, word_index, word, *scratch, MAX_SENTENCE_LENGTH) != SUCCESS) {
+            return -1;
+        }
+        
+        char* swap = *text;
+        *text = *scratch;
+        *scratch = swap;
+        
+        // Move to next edit: skip word_index and word
+        data_ptr = strchr(data_ptr, '|');
+        data_ptr = data_ptr ? strchr(data_ptr + 1, '|') : NULL;
+        if (!data_ptr) {
+            break;
+        }
+        data_ptr++;
+    }
+    return 0;
 }
 
+// Rewrites one or more sentences as a unit. data:
+//   lease|...\n                          (the NM's write lease, see lease.h)
+//   sentence_index|word_index|word|...\n (one line per sentence)
+// The lease is checked here, without asking the Name Server, and covers every
+// sentence edited. All edits are applied before anything is written; the
+// new version is then written once, so either every sentence changes or
+// none does. The rewritten sentences go into the file's history as one
+// record, which UNDO reverts as a whole.
+//
+// The file's sentence index locates the sentences, only those are read and
+// re-tokenized, and the new bytes are spliced between kernel-copied ranges,
+// so the cost follows the edit size.
 void handle_write_commit(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+    file_write_lock(msg->filename);
     
     if (!check_access(msg->filename, msg->username, PERM_WRITE)) {
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "No write access");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
-    // Load current content
-    char content[BUFFER_SIZE];
-    int content_len = load_file_content(msg->filename, content, BUFFER_SIZE);
-    if (content_len < 0) {
-        content[0] = '\0';
+    WriteLease lease;
+    int has_lease = 0;
+    char* lines = msg->data;
+    int used = lease_parse(lines, &lease);
+    if (used > 0) {
+        has_lease = 1;
+        lines += used;
     }
     
-    // Save undo copy
-    char undo_path[MAX_PATH];
-    snprintf(undo_path, MAX_PATH, "data/undo/%s.undo", msg->filename);
-    FILE* undo_fp = fopen(undo_path, "w");
-    if (undo_fp) {
-        fputs(content, undo_fp);
-        fclose(undo_fp);
+    // Leases are required unless turned off (SS_WRITE_LEASES=0) for Name
+    // Servers that do not issue them
+    if (has_lease ? !lease_valid(&lease, msg->filename, msg->username)
+                  : config_get_int("SS_WRITE_LEASES", 1)) {
+        response->error_code = ERR_FILE_LOCKED;
+        snprintf(response->data, BUFFER_SIZE, "Write lease missing, expired or invalid");
+        file_unlock(msg->filename);
+        log_message("STORAGE_SERVER", "WARNING", "Write to %s by %s refused: no valid lease",
+                   msg->filename, msg->username);
+        return;
     }
     
-    // Parse write data: sentence_index|word_index|word|word_index|word|...
-    int sentence_index;
-    char* data_ptr = msg->data;
-    sscanf(data_ptr, "%d|", &sentence_index);
-    data_ptr = strchr(data_ptr, '|') + 1;
+    // Split into per-sentence lines
+    CommitSentence sentences[LEASE_MAX_SENTENCES];
+    int count = 0;
+    int malformed = 0;
+    char* save = NULL;
+    for (char* line = strtok_r(lines, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char* edits = strchr(line, '|');
+        if (count == LEASE_MAX_SENTENCES || !edits ||
+            sscanf(line, "%d|", &sentences[count].sentence) != 1) {
+            malformed = 1;
+            break;
+        }
+        sentences[count].edits = edits + 1;
+        sentences[count].text = NULL;
+        count++;
+    }
     
-    // Parse sentences
-    char sentences[MAX_SENTENCES][MAX_SENTENCE_LENGTH];
-    int num_sentences = parse_sentences(content, sentences, MAX_SENTENCES);
+    qsort(sentences, count, sizeof(CommitSentence), compare_commit_sentences);
+    for (int i = 1; i < count && !malformed; i++) {
+        malformed = sentences[i].sentence == sentences[i - 1].sentence;
+    }
     
-    // Validate sentence index (allow creating new sentence at end)
-    if (sentence_index < 0 || sentence_index > num_sentences) {
-        response->error_code = ERR_INVALID_INDEX;
-        snprintf(response->data, BUFFER_SIZE, "Invalid sentence index %d (max: %d)", 
-                 sentence_index, num_sentences);
-        pthread_mutex_unlock(&file_mutex);
+    if (malformed || count == 0) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Malformed write request");
+        file_unlock(msg->filename);
         return;
     }
     
-    // Get target sentence (or create new one)
-    char sentence[MAX_SENTENCE_LENGTH];
-    if (sentence_index < num_sentences) {
-        strncpy(sentence, sentences[sentence_index], MAX_SENTENCE_LENGTH - 1);
-    } else {
-        sentence[0] = '\0';
+    for (int i = 0; has_lease && i < count; i++) {
+        if (sentences[i].sentence < lease.first || sentences[i].sentence > lease.last) {
+            response->error_code = ERR_FILE_LOCKED;
+            snprintf(response->data, BUFFER_SIZE, "Sentence %d is not covered by the write lease",
+                     sentences[i].sentence);
+            file_unlock(msg->filename);
+            return;
+        }
     }
     
-    // Apply all edits
-    while (*data_ptr != '\0') {
-        int word_index;
-        char word[MAX_WORD_LENGTH];
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
+    
+    SentenceIndex* idx = sentence_index_load(msg->filename, filepath);
+    if (!idx) {
+        response->error_code = ERR_FILE_NOT_FOUND;
+        snprintf(response->data, BUFFER_SIZE, "File not found");
+        file_unlock(msg->filename);
+        return;
+    }
+    
+    // Validate sentence indices (allow creating new sentence at end)
+    for (int i = 0; i < count; i++) {
+        if (sentences[i].sentence < 0 || sentences[i].sentence > idx->count) {
+            response->error_code = ERR_INVALID_INDEX;
+            snprintf(response->data, BUFFER_SIZE, "Invalid sentence index %d (max: %d)",
+                     sentences[i].sentence, idx->count);
+            free(idx);
+            file_unlock(msg->filename);
+            return;
+        }
+    }
+    
+    // Sentence buffers are request scratch, released with the arena
+    Arena* arena = request_arena();
+    int fd = open(filepath, O_RDONLY);
+    char* scratch = (char*)arena_alloc(arena, MAX_SENTENCE_LENGTH);
+    SentenceIndex* updated = NULL;
+    
+    response->error_code = ERR_INTERNAL;
+    snprintf(response->data, BUFFER_SIZE, "Failed to save file");
+    
+    do {
+        if (fd < 0 || !scratch) {
+            break;
+        }
+        
+        // Rewrite every sentence in memory first
+        int ready = 0;
+        int edit_failed = 0;
+        for (; ready < count; ready++) {
+            CommitSentence* cs = &sentences[ready];
+            cs->text = (char*)arena_alloc(arena, MAX_SENTENCE_LENGTH);
+            if (!cs->text) {
+                break;
+            }
+            
+            // Get target sentence (or create new one)
+            cs->text[0] = '\0';
+            if (cs->sentence < idx->count) {
+                const SentenceSpan* span = &idx->spans[cs->sentence];
+                ssize_t n = pread(fd, cs->text, span->length, span->offset);
+                if (n != (ssize_t)span->length) {
+                    break;
+                }
+                cs->text[n] = '\0';
+            }
+            
+            if (apply_word_edits(cs->edits, &cs->text, &scratch) < 0) {
+                edit_failed = 1;
+                break;
+            }
+            cs->len = strlen(cs->text);
+        }
+        
+        if (edit_failed) {
+            response->error_code = ERR_INVALID_INDEX;
+            snprintf(response->data, BUFFER_SIZE, "Invalid word index in sentence %d",
+                     sentences[ready].sentence);
+            break;
+        }
+        if (ready < count) {
+            break;
+        }
+        
+        // A single sentence updates the index incrementally; several are
+        // placed against the old index and the file is re-indexed after
+        SpliceEdit edits[LEASE_MAX_SENTENCES];
+        for (int i = 0; i < count; i++) {
+            edits[i].text = sentences[i].text;
+            edits[i].len = sentences[i].len;
+            if (count > 1) {
+                sentence_index_splice_point(idx, sentences[i].sentence, sentences[i].len,
+                                            &edits[i].splice);
+            }
+        }
+        if (count == 1) {
+            updated = sentence_index_splice(idx, fd, sentences[0].sentence, sentences[0].text,
+                                            sentences[0].len, &edits[0].splice);
+            if (!updated) {
+                break;
+            }
+        }
         
-        if (sscanf(data_ptr, "%d|%[^|]|", &word_index, word) != 2) {
+        off_t mark;
+        if (record_commit(msg->filename, fd, idx->size, edits, count, &mark) < 0) {
             break;
         }
         
-        char new_sentence[MAX_SENTENCE_LENGTH];
-        if (insert_word(sentence, word_index, word, new_sentence, MAX_SENTENCE_LENGTH) != SUCCESS) {
-            response->error_code = ERR_INVALID_INDEX;
-            snprintf(response->data, BUFFER_SIZE, "Invalid word index");
-            pthread_mutex_unlock(&file_mutex);
-            return;
+        struct stat st;
+        if (splice_write_file(filepath, fd, idx->size, edits, count, &st) < 0) {
+            history_cancel(msg->filename, mark);
+            invalidate_file_caches(msg->filename);
+            break;
         }
         
-        strncpy(sentence, new_sentence, MAX_SENTENCE_LENGTH - 1);
+        if (content_cache) {
+            lru_remove(content_cache, msg->filename);
+        }
+        int words = -1;
+        if (updated) {
+            words = updated->total_words;
+            sentence_index_store(msg->filename, updated, &st);
+            updated = NULL;
+        } else {
+            // Sentences may have split or merged; index the new version
+            sentence_index_invalidate(msg->filename);
+            SentenceIndex* fresh = sentence_index_load(msg->filename, filepath);
+            if (fresh) {
+                words = fresh->total_words;
+                free(fresh);
+            }
+        }
         
-        // Move to next edit
-        data_ptr = strchr(data_ptr, '|') + 1;  // Skip word_index
-        data_ptr = strchr(data_ptr, '|') + 1;  // Skip word
-    }
-    
-    // Check if new sentence creates multiple sentences (due to delimiters)
-    char new_sentences[MAX_SENTENCES][MAX_SENTENCE_LENGTH];
-    int new_sent_count = parse_sentences(sentence, new_sentences, MAX_SENTENCES);
-    
-    // Replace old sentence with new sentence(s)
-    char result_sentences[MAX_SENTENCES][MAX_SENTENCE_LENGTH];
-    int result_count = 0;
-    
-    // Copy sentences before
-    for (int i = 0; i < sentence_index && i < num_sentences; i++) {
-        strncpy(result_sentences[result_count++], sentences[i], MAX_SENTENCE_LENGTH - 1);
-    }
-    
-    // Add new sentences
-    for (int i = 0; i < new_sent_count; i++) {
-        strncpy(result_sentences[result_count++], new_sentences[i], MAX_SENTENCE_LENGTH - 1);
-    }
-    
-    // Copy sentences after
-    for (int i = sentence_index + 1; i < num_sentences; i++) {
-        strncpy(result_sentences[result_count++], sentences[i], MAX_SENTENCE_LENGTH - 1);
-    }
-    
-    // Rebuild full text
-    char new_content[BUFFER_SIZE];
-    rebuild_text(result_sentences, result_count, new_content, BUFFER_SIZE);
-    
-    // Save file
-    save_file_content(msg->filename, new_content);
-    
-    // Update metadata
-    FileInfo info;
-    ACLEntry acl[MAX_ACL_ENTRIES];
-    int acl_count = 0;
+        // Update metadata from the index instead of rescanning the text
+        FileInfo info;
+        ACLEntry acl[MAX_ACL_ENTRIES];
+        int acl_count = 0;
+        
+        if (load_metadata(msg->filename, &info, acl, &acl_count) == 0) {
+            info.modified = time(NULL);
+            if (words >= 0) {
+                info.word_count = words;
+            }
+            info.char_count = (int)st.st_size;
+            save_metadata(msg->filename, &info, acl, acl_count);
+        }
+        
+        response->error_code = SUCCESS;
+        snprintf(response->data, BUFFER_SIZE, "Write successful");
+        
+        log_message("STORAGE_SERVER", "INFO", "File written: %s by %s (%d sentence%s from %d, %zu bytes)",
+                   msg->filename, msg->username, count, count == 1 ? "" : "s",
+                   sentences[0].sentence, (size_t)st.st_size);
+    } while (0);
     
-    if (load_metadata(msg->filename, &info, acl, &acl_count) == 0) {
-        info.modified = time(NULL);
-        get_text_stats(new_content, &info.word_count, &info.char_count, NULL);
-        save_metadata(msg->filename, &info, acl, acl_count);
+    if (fd >= 0) {
+        close(fd);
     }
+    free(updated);
+    free(idx);
     
-    response->error_code = SUCCESS;
-    snprintf(response->data, BUFFER_SIZE, "Write successful");
-    
-    log_message("STORAGE_SERVER", "INFO", "File written: %s by %s (sentence %d)",
-               msg->filename, msg->username, sentence_index);
-    
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(msg->filename);
 }
 
 void handle_delete_file(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+    file_write_lock(msg->filename);
     
     FileInfo info;
     ACLEntry acl[MAX_ACL_ENTRIES];
@@ -948,106 +3439,147 @@ void handle_delete_file(Message* msg, Message* response) {
     if (load_metadata(msg->filename, &info, acl, &acl_count) < 0) {
         response->error_code = ERR_FILE_NOT_FOUND;
         snprintf(response->data, BUFFER_SIZE, "File not found");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
     if (strcmp(info.owner, msg->username) != 0) {
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "Only owner can delete");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
+    // Checkpoints outlive the file; they get its content before the
+    // history goes
+    history_reset(msg->filename);
+    
     // Delete file
     char filepath[MAX_PATH];
     snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
     unlink(filepath);
     
     // Delete metadata
-    char metapath[MAX_PATH];
-    snprintf(metapath, MAX_PATH, "data/metadata/%s.meta", msg->filename);
-    unlink(metapath);
+    remove_metadata(msg->filename);
     
-    // Delete undo
-    char undopath[MAX_PATH];
-    snprintf(undopath, MAX_PATH, "data/undo/%s.undo", msg->filename);
-    unlink(undopath);
+    invalidate_file_caches(msg->filename);
     
     response->error_code = SUCCESS;
     snprintf(response->data, BUFFER_SIZE, "File deleted");
     
     log_message("STORAGE_SERVER", "INFO", "File deleted: %s by %s", msg->filename, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(msg->filename);
+}
+
+// Current content of filename and its length; NULL if it is missing
+static char* load_file_sized(const char* filename, const char* filepath, size_t* len) {
+    struct stat st;
+    if (stat(filepath, &st) != 0) {
+        return NULL;
+    }
+    *len = st.st_size;
+    return load_file(filename);
+}
+
+// Install content, a version rebuilt from the file's history, recording the
+// steps that led to it as a new history record. Refreshes caches and
+// metadata; the caller holds the write lock.
+static int install_version(const char* filename, const char* filepath, const char* content,
+                           size_t len, int kind, uint64_t target,
+                           const HistoryStep* steps, int count) {
+    off_t mark;
+    if (history_append(filename, kind, target, steps, count, len, &mark) < 0) {
+        return -1;
+    }
+    
+    if (atomic_write_file(filepath, content, len, 1) < 0) {
+        history_cancel(filename, mark);
+        invalidate_file_caches(filename);
+        return -1;
+    }
+    
+    invalidate_file_caches(filename);
+    SentenceIndex* idx = sentence_index_load(filename, filepath);
+    
+    FileInfo info;
+    ACLEntry acl[MAX_ACL_ENTRIES];
+    int acl_count = 0;
+    
+    if (load_metadata(filename, &info, acl, &acl_count) == 0) {
+        info.modified = time(NULL);
+        info.word_count = idx ? idx->total_words : 0;
+        info.char_count = idx ? (int)idx->size : 0;
+        save_metadata(filename, &info, acl, acl_count);
+    }
+    free(idx);
+    return 0;
 }
 
+// Reverts the newest change not undone yet by replaying its history record
+// backwards. The reversal is recorded too, so repeated UNDOs keep going
+// back.
 void handle_undo(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+    file_write_lock(msg->filename);
     
     if (!check_access(msg->filename, msg->username, PERM_WRITE)) {
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "No write access");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
-    // Load undo content
-    char undo_path[MAX_PATH];
-    snprintf(undo_path, MAX_PATH, "data/undo/%s.undo", msg->filename);
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
     
-    char undo_content[BUFFER_SIZE];
-    FILE* undo_fp = fopen(undo_path, "r");
-    if (!undo_fp) {
-        response->error_code = ERR_INVALID_PARAMETERS;
-        snprintf(response->data, BUFFER_SIZE, "No undo history");
-        pthread_mutex_unlock(&file_mutex);
+    size_t len = 0;
+    char* content = load_file_sized(msg->filename, filepath, &len);
+    History* history = content ? history_load(msg->filename, len) : NULL;
+    int target = history ? history_undo_target(history) : -1;
+    if (target < 0) {
+        response->error_code = content ? ERR_INVALID_PARAMETERS : ERR_FILE_NOT_FOUND;
+        snprintf(response->data, BUFFER_SIZE, content ? "No undo history" : "File not found");
+        history_free(history);
+        free(content);
+        file_unlock(msg->filename);
         return;
     }
     
-    int bytes = fread(undo_content, 1, BUFFER_SIZE - 1, undo_fp);
-    undo_content[bytes] = '\0';
-    fclose(undo_fp);
-    
-    // Save current as new undo
-    char current_content[BUFFER_SIZE];
-    load_file_content(msg->filename, current_content, BUFFER_SIZE);
-    
-    undo_fp = fopen(undo_path, "w");
-    if (undo_fp) {
-        fputs(current_content, undo_fp);
-        fclose(undo_fp);
-    }
-    
-    // Restore undo content
-    save_file_content(msg->filename, undo_content);
-    
-    // Update metadata
-    FileInfo info;
-    ACLEntry acl[MAX_ACL_ENTRIES];
-    int acl_count = 0;
+    int count = 0;
+    HistoryStep* steps = history_inverse(history, target, target, &count);
+    int done = steps && history_apply(&content, &len, steps, count) == 0 &&
+               install_version(msg->filename, filepath, content, len, HISTORY_UNDO,
+                               history->records[target].seq, steps, count) == 0;
+    uint64_t undone = history->records[target].seq;
+    free(steps);
+    history_free(history);
+    free(content);
     
-    if (load_metadata(msg->filename, &info, acl, &acl_count) == 0) {
-        info.modified = time(NULL);
-        get_text_stats(undo_content, &info.word_count, &info.char_count, NULL);
-        save_metadata(msg->filename, &info, acl, acl_count);
+    if (!done) {
+        log_message("FILE_OPS", "ERROR", "Failed to undo change %llu of %s",
+                   (unsigned long long)undone, msg->filename);
+        response->error_code = ERR_INTERNAL;
+        snprintf(response->data, BUFFER_SIZE, "Undo failed");
+        file_unlock(msg->filename);
+        return;
     }
     
     response->error_code = SUCCESS;
     snprintf(response->data, BUFFER_SIZE, "Undo successful");
     
-    log_message("STORAGE_SERVER", "INFO", "Undo: %s by %s", msg->filename, msg->username);
+    log_message("STORAGE_SERVER", "INFO", "Undo: %s change %llu by %s", msg->filename,
+               (unsigned long long)undone, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(msg->filename);
 }
 
 void handle_info(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+    file_read_lock(msg->filename);
     
     if (!check_access(msg->filename, msg->username, PERM_READ)) {
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "No read access");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
@@ -1058,20 +3590,25 @@ void handle_info(Message* msg, Message* response) {
     if (load_metadata(msg->filename, &info, acl, &acl_count) < 0) {
         response->error_code = ERR_FILE_NOT_FOUND;
         snprintf(response->data, BUFFER_SIZE, "File not found");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
     // Format metadata info
     char created_str[64], modified_str[64];
-    strftime(created_str, sizeof(created_str), "%Y-%m-%d %H:%M:%S", localtime(&info.created));
-    strftime(modified_str, sizeof(modified_str), "%Y-%m-%d %H:%M:%S", localtime(&info.modified));
+    format_time(info.created, created_str, sizeof(created_str));
+    format_time(info.modified, modified_str, sizeof(modified_str));
     
-    // Count sentences from content
-    char content[BUFFER_SIZE];
+    // Sentence count from the content cache (no disk access on a hit), or
+    // from the cold tier for a frozen file, which INFO leaves frozen
     int sentence_count = 0;
-    if (load_file_content(msg->filename, content, BUFFER_SIZE) >= 0) {
-        get_text_stats(content, NULL, NULL, &sentence_count);
+    uint64_t frozen_size;
+    if (cold_stat(msg->filename, &frozen_size, &sentence_count) < 0) {
+        CachedFile* cached = content_cache_get(msg->filename, 0);
+        if (cached) {
+            sentence_count = cached->sentences;
+            cached_file_release(cached);
+        }
     }
     
     snprintf(response->data, BUFFER_SIZE,
@@ -1091,47 +3628,11 @@ void handle_info(Message* msg, Message* response) {
     response->error_code = SUCCESS;
     log_message("STORAGE_SERVER", "INFO", "Info: %s by %s", msg->filename, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
-}
-
-void handle_stream(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
-    
-    if (!check_access(msg->filename, msg->username, PERM_READ)) {
-        response->error_code = ERR_UNAUTHORIZED;
-        snprintf(response->data, BUFFER_SIZE, "No read access");
-        pthread_mutex_unlock(&file_mutex);
-        return;
-    }
-    
-    char content[BUFFER_SIZE];
-    if (load_file_content(msg->filename, content, BUFFER_SIZE) < 0) {
-        response->error_code = ERR_FILE_NOT_FOUND;
-        snprintf(response->data, BUFFER_SIZE, "File not found");
-        pthread_mutex_unlock(&file_mutex);
-        return;
-    }
-    
-    // Parse into words
-    char words[MAX_WORDS][MAX_WORD_LENGTH];
-    int word_count = parse_words(content, words, MAX_WORDS);
-    
-    // Stream word by word with delimiter |WORD|
-    response->data[0] = '\0';
-    for (int i = 0; i < word_count && i < 100; i++) {  // Limit to 100 words for buffer
-        strcat(response->data, "|WORD|");
-        strcat(response->data, words[i]);
-    }
-    
-    response->error_code = SUCCESS;
-    log_message("STORAGE_SERVER", "INFO", "Stream: %s by %s (%d words)", 
-                msg->filename, msg->username, word_count);
-    
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(msg->filename);
 }
 
 void handle_add_access(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+    file_write_lock(msg->filename);
     
     // Only owner can modify ACL
     FileInfo info;
@@ -1141,14 +3642,14 @@ void handle_add_access(Message* msg, Message* response) {
     if (load_metadata(msg->filename, &info, acl, &acl_count) < 0) {
         response->error_code = ERR_FILE_NOT_FOUND;
         snprintf(response->data, BUFFER_SIZE, "File not found");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
     if (strcmp(info.owner, msg->username) != 0) {
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "Only owner can modify access");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
@@ -1161,7 +3662,7 @@ void handle_add_access(Message* msg, Message* response) {
         if (strcmp(acl[i].username, target_user) == 0) {
             response->error_code = ERR_INVALID_PARAMETERS;
             snprintf(response->data, BUFFER_SIZE, "User already has access");
-            pthread_mutex_unlock(&file_mutex);
+            file_unlock(msg->filename);
             return;
         }
     }
@@ -1170,7 +3671,7 @@ void handle_add_access(Message* msg, Message* response) {
     if (acl_count >= MAX_ACL_ENTRIES) {
         response->error_code = ERR_INVALID_PARAMETERS;
         snprintf(response->data, BUFFER_SIZE, "ACL full");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
@@ -1185,11 +3686,11 @@ void handle_add_access(Message* msg, Message* response) {
     log_message("STORAGE_SERVER", "INFO", "AddAccess: %s granted to %s by %s", 
                 msg->filename, target_user, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(msg->filename);
 }
 
 void handle_rem_access(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+    file_write_lock(msg->filename);
     
     // Only owner can modify ACL
     FileInfo info;
@@ -1199,14 +3700,14 @@ void handle_rem_access(Message* msg, Message* response) {
     if (load_metadata(msg->filename, &info, acl, &acl_count) < 0) {
         response->error_code = ERR_FILE_NOT_FOUND;
         snprintf(response->data, BUFFER_SIZE, "File not found");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
     if (strcmp(info.owner, msg->username) != 0) {
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "Only owner can modify access");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
@@ -1231,7 +3732,7 @@ void handle_rem_access(Message* msg, Message* response) {
     if (!found) {
         response->error_code = ERR_INVALID_PARAMETERS;
         snprintf(response->data, BUFFER_SIZE, "User not in ACL");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
@@ -1242,17 +3743,17 @@ void handle_rem_access(Message* msg, Message* response) {
     log_message("STORAGE_SERVER", "INFO", "RemAccess: %s revoked from %s by %s", 
                 msg->filename, target_user, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(msg->filename);
 }
 
 // FILEINFO: Get detailed file information
 void handle_fileinfo(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+    file_read_lock(msg->filename);
     
     if (!check_access(msg->filename, msg->username, PERM_READ)) {
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "No read access");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
@@ -1263,31 +3764,32 @@ void handle_fileinfo(Message* msg, Message* response) {
     if (load_metadata(msg->filename, &info, acl, &acl_count) < 0) {
         response->error_code = ERR_FILE_NOT_FOUND;
         snprintf(response->data, BUFFER_SIZE, "File not found");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
-    // Get file size
-    char filepath[MAX_PATH];
-    snprintf(filepath, MAX_PATH, "data/files/%s", msg->filename);
-    struct stat st;
+    // Size and sentence count from the content cache (no disk access on a
+    // hit), or from the cold tier for a frozen file, which FILEINFO leaves
+    // frozen
     long file_size = 0;
-    if (stat(filepath, &st) == 0) {
-        file_size = st.st_size;
+    int sentence_count = 0;
+    uint64_t frozen_size;
+    if (cold_stat(msg->filename, &frozen_size, &sentence_count) == 0) {
+        file_size = (long)frozen_size;
+    } else {
+        CachedFile* cached = content_cache_get(msg->filename, 0);
+        if (cached) {
+            file_size = cached->size;
+            sentence_count = cached->sentences;
+            cached_file_release(cached);
+        }
     }
     
     // Format timestamps
     char created_str[64], modified_str[64], accessed_str[64];
-    strftime(created_str, sizeof(created_str), "%Y-%m-%d %H:%M:%S", localtime(&info.created));
-    strftime(modified_str, sizeof(modified_str), "%Y-%m-%d %H:%M:%S", localtime(&info.modified));
-    strftime(accessed_str, sizeof(accessed_str), "%Y-%m-%d %H:%M:%S", localtime(&info.accessed));
-    
-    // Count sentences from content
-    char content[BUFFER_SIZE];
-    int sentence_count = 0;
-    if (load_file_content(msg->filename, content, BUFFER_SIZE) >= 0) {
-        get_text_stats(content, NULL, NULL, &sentence_count);
-    }
+    format_time(info.created, created_str, sizeof(created_str));
+    format_time(info.modified, modified_str, sizeof(modified_str));
+    format_time(info.accessed, accessed_str, sizeof(accessed_str));
     
     // Build response with complete file information
     snprintf(response->data, BUFFER_SIZE,
@@ -1325,27 +3827,26 @@ void handle_fileinfo(Message* msg, Message* response) {
     response->error_code = SUCCESS;
     log_message("STORAGE_SERVER", "INFO", "FileInfo: %s by %s", msg->filename, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(msg->filename);
 }
 
 // COPY: Copy file to new name
 void handle_copy(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
-    
     // Parse: source|destination
     char source[MAX_FILENAME], destination[MAX_FILENAME];
     if (sscanf(msg->data, "%[^|]|%s", source, destination) != 2) {
         response->error_code = ERR_INVALID_PARAMETERS;
         strcpy(response->data, "Invalid parameters. Use: COPY source destination");
-        pthread_mutex_unlock(&file_mutex);
         return;
     }
     
+    lock_file_pair(source, 0, destination, 1);
+    
     // Check read access on source
     if (!check_access(source, msg->username, PERM_READ)) {
         response->error_code = ERR_UNAUTHORIZED;
         snprintf(response->data, BUFFER_SIZE, "No read access to source file");
-        pthread_mutex_unlock(&file_mutex);
+        unlock_file_pair(source, destination);
         return;
     }
     
@@ -1357,7 +3858,7 @@ void handle_copy(Message* msg, Message* response) {
     if (load_metadata(source, &src_info, src_acl, &src_acl_count) < 0) {
         response->error_code = ERR_FILE_NOT_FOUND;
         snprintf(response->data, BUFFER_SIZE, "Source file not found");
-        pthread_mutex_unlock(&file_mutex);
+        unlock_file_pair(source, destination);
         return;
     }
     
@@ -1368,16 +3869,24 @@ void handle_copy(Message* msg, Message* response) {
     if (load_metadata(destination, &dest_info, dest_acl, &dest_acl_count) == 0) {
         response->error_code = ERR_FILE_EXISTS;
         snprintf(response->data, BUFFER_SIZE, "Destination file already exists");
-        pthread_mutex_unlock(&file_mutex);
+        unlock_file_pair(source, destination);
         return;
     }
     
-    // Load source content
-    char content[BUFFER_SIZE];
-    if (load_file_content(source, content, BUFFER_SIZE) < 0) {
+    // Open source content
+    char src_path[MAX_PATH], dest_path[MAX_PATH];
+    snprintf(src_path, MAX_PATH, "data/files/%s", source);
+    snprintf(dest_path, MAX_PATH, "data/files/%s", destination);
+    
+    struct stat st;
+    int src_fd = open(src_path, O_RDONLY);
+    if (src_fd < 0 || fstat(src_fd, &st) < 0 || validate_filename(destination) != 0) {
+        if (src_fd >= 0) {
+            close(src_fd);
+        }
         response->error_code = ERR_INTERNAL;
         snprintf(response->data, BUFFER_SIZE, "Failed to read source file");
-        pthread_mutex_unlock(&file_mutex);
+        unlock_file_pair(source, destination);
         return;
     }
     
@@ -1394,10 +3903,13 @@ void handle_copy(Message* msg, Message* response) {
     new_info.char_count = src_info.char_count;
     
     // Save destination content
-    if (save_file_content(destination, content) < 0) {
+    int copied = replace_file_from_fd(dest_path, src_fd, 0, st.st_size);
+    close(src_fd);
+    invalidate_file_caches(destination);
+    if (copied < 0) {
         response->error_code = ERR_INTERNAL;
         snprintf(response->data, BUFFER_SIZE, "Failed to write destination file");
-        pthread_mutex_unlock(&file_mutex);
+        unlock_file_pair(source, destination);
         return;
     }
     
@@ -1410,17 +3922,22 @@ void handle_copy(Message* msg, Message* response) {
     log_message("STORAGE_SERVER", "INFO", "Copy: %s -> %s by %s", 
                 source, destination, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
+    unlock_file_pair(source, destination);
 }
 
 // BONUS: Create folder
 void handle_create_folder(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
-    
     char folderpath[MAX_PATH];
     snprintf(folderpath, MAX_PATH, "data/files/%s", msg->filename);
     
     if (mkdir(folderpath, 0755) == 0) {
+        // Metadata and history files of files inside mirror the folder
+        char mirror[MAX_PATH];
+        snprintf(mirror, MAX_PATH, "data/metadata/%s", msg->filename);
+        mkdir(mirror, 0755);
+        snprintf(mirror, MAX_PATH, "data/history/%s", msg->filename);
+        mkdir(mirror, 0755);
+        
         response->error_code = SUCCESS;
         snprintf(response->data, BUFFER_SIZE, "Folder created: %s", msg->filename);
         log_message("STORAGE_SERVER", "INFO", "Folder created: %s by %s", 
@@ -1430,54 +3947,70 @@ void handle_create_folder(Message* msg, Message* response) {
         snprintf(response->data, BUFFER_SIZE, "Failed to create folder: %s", strerror(errno));
     }
     
-    pthread_mutex_unlock(&file_mutex);
 }
 
-// BONUS: Move file to folder
+// BONUS: Move file into a folder, or rename it (like mv). The new name is
+// returned in response->filename.
 void handle_move_file(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
-    
-    // Parse: filename|foldername
-    char filename[MAX_FILENAME], foldername[MAX_FILENAME];
-    if (sscanf(msg->data, "%[^|]|%s", filename, foldername) != 2) {
+    // Parse: filename|destination
+    char filename[MAX_FILENAME], destination[MAX_FILENAME];
+    if (sscanf(msg->data, "%255[^|]|%255s", filename, destination) != 2) {
         response->error_code = ERR_INVALID_PARAMETERS;
         strcpy(response->data, "Invalid parameters");
-        pthread_mutex_unlock(&file_mutex);
         return;
     }
     
-    char oldpath[MAX_PATH], newpath[MAX_PATH];
+    char oldpath[MAX_PATH], newpath[MAX_PATH], new_name[MAX_FILENAME];
     snprintf(oldpath, MAX_PATH, "data/files/%s", filename);
-    snprintf(newpath, MAX_PATH, "data/files/%s/%s", foldername, filename);
+    snprintf(newpath, MAX_PATH, "data/files/%s", destination);
     
-    if (rename(oldpath, newpath) == 0) {
-        // Also move metadata and undo files
-        char old_meta[MAX_PATH], new_meta[MAX_PATH];
-        char old_undo[MAX_PATH], new_undo[MAX_PATH];
-        snprintf(old_meta, MAX_PATH, "data/metadata/%s.meta", filename);
-        snprintf(new_meta, MAX_PATH, "data/metadata/%s/%s.meta", foldername, filename);
-        snprintf(old_undo, MAX_PATH, "data/undo/%s.undo", filename);
-        snprintf(new_undo, MAX_PATH, "data/undo/%s/%s.undo", foldername, filename);
-        
-        rename(old_meta, new_meta);
-        rename(old_undo, new_undo);
+    struct stat st;
+    int name_len;
+    if (stat(newpath, &st) == 0 && S_ISDIR(st.st_mode)) {
+        const char* base = strrchr(filename, '/');
+        name_len = snprintf(new_name, MAX_FILENAME, "%s/%s", destination,
+                            base ? base + 1 : filename);
+    } else {
+        name_len = snprintf(new_name, MAX_FILENAME, "%s", destination);
+    }
+    if (name_len >= MAX_FILENAME) {
+        response->error_code = ERR_INVALID_PARAMETERS;
+        snprintf(response->data, BUFFER_SIZE, "Destination name too long");
+        return;
+    }
+    snprintf(newpath, MAX_PATH, "data/files/%s", new_name);
+    
+    // Both names: a CREATE, COPY or REPLICATE of new_name must not pass its
+    // own existence check while the rename lands there
+    lock_file_pair(filename, 1, new_name, 1);
+    
+    int exists = access(newpath, F_OK) == 0 || cold_contains(new_name);
+    if (!exists) {
+        make_parent_dirs(new_name);
+    }
+    if (!exists && rename(oldpath, newpath) == 0) {
+        // Also move metadata and history
+        rename_metadata(filename, new_name);
+        history_rename(filename, new_name);
+        invalidate_file_caches(filename);
+        invalidate_file_caches(new_name);
         
         response->error_code = SUCCESS;
-        snprintf(response->data, BUFFER_SIZE, "File moved to folder: %s", foldername);
+        snprintf(response->filename, MAX_FILENAME, "%s", new_name);
+        snprintf(response->data, BUFFER_SIZE, "File moved to %s", new_name);
         log_message("STORAGE_SERVER", "INFO", "File moved: %s to %s by %s", 
-                    filename, foldername, msg->username);
+                    filename, new_name, msg->username);
     } else {
-        response->error_code = ERR_INTERNAL;
-        snprintf(response->data, BUFFER_SIZE, "Failed to move file: %s", strerror(errno));
+        response->error_code = exists ? ERR_FILE_EXISTS : ERR_INTERNAL;
+        snprintf(response->data, BUFFER_SIZE, "Failed to move file: %s",
+                 exists ? "destination exists" : strerror(errno));
     }
     
-    pthread_mutex_unlock(&file_mutex);
+    unlock_file_pair(filename, new_name);
 }
 
 // BONUS: View folder contents
 void handle_view_folder(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
-    
     char folderpath[MAX_PATH];
     snprintf(folderpath, MAX_PATH, "data/files/%s", msg->filename);
     
@@ -1485,7 +4018,6 @@ void handle_view_folder(Message* msg, Message* response) {
     if (!dir) {
         response->error_code = ERR_FILE_NOT_FOUND;
         strcpy(response->data, "Folder not found");
-        pthread_mutex_unlock(&file_mutex);
         return;
     }
     
@@ -1502,166 +4034,264 @@ void handle_view_folder(Message* msg, Message* response) {
     }
     closedir(dir);
     
+    // Frozen files are only in the cold tier (cold_store.h). Subfolders
+    // stay in data/files.
+    snprintf(folderpath, MAX_PATH, "data/cold/files/%s", msg->filename);
+    dir = opendir(folderpath);
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_DIR && strcmp(entry->d_name, ".") != 0 &&
+            strcmp(entry->d_name, "..") != 0 &&
+            strlen(result) + strlen(entry->d_name) + 2 < sizeof(result)) {
+            if (count > 0) strcat(result, "\n");
+            strcat(result, entry->d_name);
+            count++;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    
     response->error_code = SUCCESS;
     snprintf(response->data, BUFFER_SIZE, "%s", result);
     log_message("STORAGE_SERVER", "INFO", "ViewFolder: %s by %s (%d items)", 
                 msg->filename, msg->username, count);
     
-    pthread_mutex_unlock(&file_mutex);
 }
 
-// BONUS: Save checkpoint
+// BONUS: Save checkpoint. The checkpoint only names the file's current
+// version in its history (see history.h).
 void handle_checkpoint(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
-    
     // Parse: filename|tag
     char filename[MAX_FILENAME], tag[64];
     if (sscanf(msg->data, "%[^|]|%s", filename, tag) != 2) {
         response->error_code = ERR_INVALID_PARAMETERS;
         strcpy(response->data, "Invalid parameters");
-        pthread_mutex_unlock(&file_mutex);
         return;
     }
     
+    file_write_lock(filename);
+    
     char filepath[MAX_PATH];
     snprintf(filepath, MAX_PATH, "data/files/%s", filename);
     
-    char* content = load_file(filename);
-    if (!content) {
+    if (access(filepath, F_OK) != 0) {
         response->error_code = ERR_FILE_NOT_FOUND;
         strcpy(response->data, "File not found");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(filename);
         return;
     }
     
-    // Save checkpoint
-    char checkpoint_path[MAX_PATH];
-    snprintf(checkpoint_path, MAX_PATH, "data/checkpoints/%s_%s.ckpt", filename, tag);
-    
-    FILE* fp = fopen(checkpoint_path, "w");
-    if (fp) {
-        fprintf(fp, "%ld\n", time(NULL));
-        fprintf(fp, "%s", content);
-        fclose(fp);
-        
+    if (history_checkpoint(filename, tag) == 0) {
         response->error_code = SUCCESS;
         snprintf(response->data, BUFFER_SIZE, "Checkpoint created: %s", tag);
-        log_message("STORAGE_SERVER", "INFO", "Checkpoint: %s tag=%s by %s", 
-                    filename, tag, msg->username);
+        log_message("STORAGE_SERVER", "INFO", "Checkpoint: %s tag=%s (version %llu) by %s", 
+                    filename, tag, (unsigned long long)history_version(filename), msg->username);
     } else {
         response->error_code = ERR_INTERNAL;
         strcpy(response->data, "Failed to create checkpoint");
     }
     
-    free(content);
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(filename);
+}
+
+// Content of checkpoint tag of filename. A pointer checkpoint is rebuilt
+// from the current content and history; with history, also returns the
+// history and the index of the first record after the checkpoint. NULL
+// with *error set on failure. With repair NULL the caller holds the write
+// lock; otherwise only the read lock, and if the history needs repairing
+// first this returns NULL with *repair set.
+static char* load_checkpoint(const char* filename, const char* tag, size_t* len,
+                             History** history_out, int* first_out, int* repair, int* error) {
+    uint64_t seq = 0;
+    long offset = 0;
+    int kind = history_checkpoint_find(filename, tag, &seq, &offset);
+    if (kind < 0) {
+        *error = ERR_FILE_NOT_FOUND;
+        return NULL;
+    }
+    *error = ERR_INTERNAL;
+    
+    if (kind == 0) {
+        // Holds its own content after the timestamp line
+        char checkpoint_path[MAX_PATH];
+        snprintf(checkpoint_path, MAX_PATH, "data/checkpoints/%s_%s.ckpt", filename, tag);
+        int fd = open(checkpoint_path, O_RDONLY);
+        struct stat st;
+        char* content = NULL;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= offset) {
+            *len = st.st_size - offset;
+            content = (char*)malloc(*len + 1);
+            if (content && pread(fd, content, *len, offset) != (ssize_t)*len) {
+                free(content);
+                content = NULL;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (content) {
+            content[*len] = '\0';
+        }
+        return content;
+    }
+    
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", filename);
+    size_t current_len = 0;
+    char* current = load_file_sized(filename, filepath, &current_len);
+    History* history = NULL;
+    if (current && repair) {
+        history = history_read(filename, current_len, repair);
+        if (*repair) {
+            free(current);
+            return NULL;
+        }
+    } else if (current) {
+        history = history_load(filename, current_len);
+    }
+    char* content = history ? history_rebuild(history, current, current_len, seq, len) : NULL;
+    free(current);
+    
+    if (!content) {
+        log_message("STORAGE_SERVER", "WARNING", "Checkpoint %s of %s: version %llu is not in the history",
+                   tag, filename, (unsigned long long)seq);
+        history_free(history);
+        return NULL;
+    }
+    
+    if (history_out) {
+        int first = history->count;
+        while (first > 0 && history->records[first - 1].seq > seq) {
+            first--;
+        }
+        *history_out = history;
+        *first_out = first;
+    } else {
+        history_free(history);
+    }
+    return content;
 }
 
 // BONUS: View checkpoint
 void handle_view_checkpoint(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
-    
     // Parse: filename|tag
     char filename[MAX_FILENAME], tag[64];
     if (sscanf(msg->data, "%[^|]|%s", filename, tag) != 2) {
         response->error_code = ERR_INVALID_PARAMETERS;
         strcpy(response->data, "Invalid parameters");
-        pthread_mutex_unlock(&file_mutex);
         return;
     }
     
-    char checkpoint_path[MAX_PATH];
-    snprintf(checkpoint_path, MAX_PATH, "data/checkpoints/%s_%s.ckpt", filename, tag);
-    
-    FILE* fp = fopen(checkpoint_path, "r");
-    if (!fp) {
-        response->error_code = ERR_FILE_NOT_FOUND;
-        strcpy(response->data, "Checkpoint not found");
-        pthread_mutex_unlock(&file_mutex);
+    file_read_lock(filename);
+    
+    size_t bytes = 0;
+    int repair = 0;
+    int error;
+    char* content = load_checkpoint(filename, tag, &bytes, NULL, NULL, &repair, &error);
+    if (repair) {
+        // Its history needs repairing, which only a writer may do
+        file_unlock(filename);
+        file_write_lock(filename);
+        content = load_checkpoint(filename, tag, &bytes, NULL, NULL, NULL, &error);
+    }
+    if (!content) {
+        response->error_code = error;
+        strcpy(response->data, error == ERR_FILE_NOT_FOUND ? "Checkpoint not found"
+                                                           : "Failed to read checkpoint");
+        file_unlock(filename);
         return;
     }
     
-    char timestamp_str[64];
-    fgets(timestamp_str, sizeof(timestamp_str), fp);
-    
-    char content[BUFFER_SIZE];
-    size_t bytes = fread(content, 1, BUFFER_SIZE - 1, fp);
-    content[bytes] = '\0';
-    fclose(fp);
-    
     response->error_code = SUCCESS;
-    snprintf(response->data, BUFFER_SIZE, "%s", content);
+    response->body = content;
+    response->body_len = bytes;
     log_message("STORAGE_SERVER", "INFO", "ViewCheckpoint: %s tag=%s by %s", 
                 filename, tag, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(filename);
 }
 
-// BONUS: Revert to checkpoint
+// BONUS: Revert to checkpoint. For a pointer checkpoint the records after
+// it are replayed backwards; the revert is recorded as one record of those
+// reversed steps, so UNDO brings the changes back.
 void handle_revert_checkpoint(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
-    
     // Parse: filename|tag
     char filename[MAX_FILENAME], tag[64];
     if (sscanf(msg->data, "%[^|]|%s", filename, tag) != 2) {
         response->error_code = ERR_INVALID_PARAMETERS;
         strcpy(response->data, "Invalid parameters");
-        pthread_mutex_unlock(&file_mutex);
         return;
     }
     
-    char checkpoint_path[MAX_PATH];
-    snprintf(checkpoint_path, MAX_PATH, "data/checkpoints/%s_%s.ckpt", filename, tag);
+    file_write_lock(filename);
     
-    FILE* fp = fopen(checkpoint_path, "r");
-    if (!fp) {
-        response->error_code = ERR_FILE_NOT_FOUND;
-        strcpy(response->data, "Checkpoint not found");
-        pthread_mutex_unlock(&file_mutex);
+    History* history = NULL;
+    int first = 0;
+    size_t len = 0;
+    int error;
+    char* content = load_checkpoint(filename, tag, &len, &history, &first, NULL, &error);
+    if (!content) {
+        response->error_code = error;
+        strcpy(response->data, error == ERR_FILE_NOT_FOUND ? "Checkpoint not found"
+                                                           : "Failed to revert");
+        file_unlock(filename);
         return;
     }
     
-    char timestamp_str[64];
-    fgets(timestamp_str, sizeof(timestamp_str), fp);
-    
-    char content[BUFFER_SIZE];
-    size_t bytes = fread(content, 1, BUFFER_SIZE - 1, fp);
-    content[bytes] = '\0';
-    fclose(fp);
+    char filepath[MAX_PATH];
+    snprintf(filepath, MAX_PATH, "data/files/%s", filename);
     
-    // Save current content to undo
-    char* current = load_file(filename);
-    if (current) {
-        char undo_path[MAX_PATH];
-        snprintf(undo_path, MAX_PATH, "data/undo/%s.undo", filename);
-        FILE* undo_fp = fopen(undo_path, "w");
-        if (undo_fp) {
-            fprintf(undo_fp, "%s", current);
-            fclose(undo_fp);
+    int count = 0;
+    HistoryStep* steps = NULL;
+    char* current = NULL;
+    if (history) {
+        steps = history_inverse(history, first, history->count - 1, &count);
+    } else {
+        // A checkpoint that holds its content: one whole-file change
+        size_t current_len = 0;
+        current = load_file_sized(filename, filepath, &current_len);
+        steps = current ? (HistoryStep*)malloc(sizeof(HistoryStep)) : NULL;
+        if (steps) {
+            steps[0].offset = 0;
+            steps[0].old_len = current_len;
+            steps[0].new_len = len;
+            steps[0].old_bytes = current;
+            steps[0].new_bytes = content;
+            count = 1;
         }
-        free(current);
     }
     
-    // Restore checkpoint content
-    save_file(filename, content);
+    int restored = steps && install_version(filename, filepath, content, len, HISTORY_REVERT, 0,
+                                            steps, count) == 0;
+    free(steps);
+    free(current);
+    free(content);
+    history_free(history);
+    
+    if (!restored) {
+        response->error_code = ERR_INTERNAL;
+        strcpy(response->data, "Failed to revert");
+        file_unlock(filename);
+        return;
+    }
     
     response->error_code = SUCCESS;
     snprintf(response->data, BUFFER_SIZE, "Reverted to checkpoint: %s", tag);
     log_message("STORAGE_SERVER", "INFO", "Revert: %s to tag=%s by %s", 
                 filename, tag, msg->username);
     
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(filename);
 }
 
 // BONUS: List checkpoints
 void handle_list_checkpoints(Message* msg, Message* response) {
-    pthread_mutex_lock(&file_mutex);
+    file_read_lock(msg->filename);
     
     DIR* dir = opendir("data/checkpoints");
     if (!dir) {
         response->error_code = ERR_INTERNAL;
         strcpy(response->data, "No checkpoints directory");
-        pthread_mutex_unlock(&file_mutex);
+        file_unlock(msg->filename);
         return;
     }
     
@@ -1694,87 +4324,352 @@ void handle_list_checkpoints(Message* msg, Message* response) {
     log_message("STORAGE_SERVER", "INFO", "ListCheckpoints: %s by %s (%d found)", 
                 msg->filename, msg->username, count);
     
-    pthread_mutex_unlock(&file_mutex);
+    file_unlock(msg->filename);
 }
 
-void* handle_ss_client(void* arg) {
-    int client_socket = *(int*)arg;
-    free(arg);
+// STATS: how read bytes left the server
+void handle_stats(Message* msg, Message* response) {
+    (void)msg;
+    
+    pthread_mutex_lock(&read_stats_mutex);
+    unsigned long long sendfile_bytes = read_bytes_sendfile;
+    unsigned long long mmap_bytes = read_bytes_mmap;
+    unsigned long long buffered_bytes = read_bytes_buffered;
+    unsigned long long cached_bytes = read_bytes_cached;
+    pthread_mutex_unlock(&read_stats_mutex);
+    
+    LRUStats cache;
+    memset(&cache, 0, sizeof(cache));
+    if (content_cache) {
+        lru_get_stats(content_cache, &cache);
+    }
+    
+    char report[256];
+    replication_get_report(report, sizeof(report));
+    
+    DurabilityStats durability;
+    durability_get_stats(&durability);
+    
+    ExecutorStats exec;
+    executor_get_stats(&exec);
+    
+    ColdStats cold;
+    cold_get_stats(&cold);
+    
+    response->error_code = SUCCESS;
+    snprintf(response->data, BUFFER_SIZE,
+             "read_bytes_zero_copy:%llu\nread_bytes_sendfile:%llu\n"
+             "read_bytes_mmap:%llu\nread_bytes_buffered:%llu\nread_bytes_cached:%llu\n"
+             "content_cache_hits:%lu\ncontent_cache_misses:%lu\n"
+             "content_cache_evictions:%lu\ncontent_cache_entries:%d\n"
+             "content_cache_bytes:%zu\n"
+             "replica_updates_sent:%llu\nreplica_updates_failed:%llu\n"
+             "replica_updates_applied:%llu\nreplica_backlog:%s\n"
+             "durability_mode:%s\ndurability_requests:%llu\ndurability_flushes:%llu\n"
+             "durability_dir_syncs:%llu\n"
+             "exec_workers:%d\nexec_running:%d\nexec_queued:%d\nexec_queue_limit:%d\n"
+             "exec_submitted:%llu\nexec_rejected:%llu\nexec_completed:%llu\n"
+             "exec_failed:%llu\nexec_timed_out:%llu\nexec_wait_ms_total:%llu\n"
+             "exec_wait_ms_max:%llu\nexec_run_ms_total:%llu\n"
+             "cold_files:%d\ncold_stored_bytes:%llu\ncold_raw_bytes:%llu\n"
+             "cold_freezes:%llu\ncold_thaws:%llu\n",
+             sendfile_bytes + mmap_bytes, sendfile_bytes, mmap_bytes, buffered_bytes,
+             cached_bytes, cache.hits, cache.misses, cache.evictions, cache.entries,
+             cache.bytes, repl_sent, repl_failed, repl_applied, report,
+             durability_mode_name(), durability.requests, durability.groups,
+             durability.dir_syncs, exec.workers, exec.running, exec.queued,
+             exec.queue_limit, exec.submitted, exec.rejected, exec.completed, exec.failed,
+             exec.timed_out, exec.wait_ms_total, exec.wait_ms_max, exec.run_ms_total,
+             cold.files, cold.stored_bytes, cold.raw_bytes, cold.freezes, cold.thaws);
+}
+
+#define METRICS_TOP_LOCKS 10  // Most contended files listed
+
+// Prometheus report: request and lock series plus the STATS counters
+static void render_ss_metrics(MetricsText* text) {
+    metrics_render(text, "ss");
+    
+    LRUStats cache;
+    memset(&cache, 0, sizeof(cache));
+    if (content_cache) {
+        lru_get_stats(content_cache, &cache);
+    }
+    unsigned long lookups = cache.hits + cache.misses;
+    metrics_text_printf(text,
+                        "# HELP ss_content_cache_requests_total Content cache lookups.\n"
+                        "# TYPE ss_content_cache_requests_total counter\n"
+                        "ss_content_cache_requests_total{result=\"hit\"} %lu\n"
+                        "ss_content_cache_requests_total{result=\"miss\"} %lu\n"
+                        "# HELP ss_content_cache_hit_ratio Share of lookups served from the cache.\n"
+                        "# TYPE ss_content_cache_hit_ratio gauge\n"
+                        "ss_content_cache_hit_ratio %.4f\n"
+                        "# TYPE ss_content_cache_evictions_total counter\n"
+                        "ss_content_cache_evictions_total %lu\n"
+                        "# TYPE ss_content_cache_entries gauge\n"
+                        "ss_content_cache_entries %d\n"
+                        "# TYPE ss_content_cache_bytes gauge\n"
+                        "ss_content_cache_bytes %zu\n",
+                        cache.hits, cache.misses, lookups ? (double)cache.hits / lookups : 0.0,
+                        cache.evictions, cache.entries, cache.bytes);
+    
+    pthread_mutex_lock(&read_stats_mutex);
+    metrics_text_printf(text,
+                        "# HELP ss_read_bytes_total Bytes sent by reads, by path.\n"
+                        "# TYPE ss_read_bytes_total counter\n"
+                        "ss_read_bytes_total{path=\"sendfile\"} %llu\n"
+                        "ss_read_bytes_total{path=\"mmap\"} %llu\n"
+                        "ss_read_bytes_total{path=\"buffered\"} %llu\n"
+                        "ss_read_bytes_total{path=\"cached\"} %llu\n",
+                        read_bytes_sendfile, read_bytes_mmap, read_bytes_buffered,
+                        read_bytes_cached);
+    pthread_mutex_unlock(&read_stats_mutex);
+    
+    metrics_text_printf(text,
+                        "# TYPE ss_replica_updates_total counter\n"
+                        "ss_replica_updates_total{result=\"sent\"} %llu\n"
+                        "ss_replica_updates_total{result=\"failed\"} %llu\n"
+                        "ss_replica_updates_total{result=\"applied\"} %llu\n",
+                        repl_sent, repl_failed, repl_applied);
+    
+    DurabilityStats durability;
+    durability_get_stats(&durability);
+    metrics_text_printf(text,
+                        "# TYPE ss_durability_requests_total counter\n"
+                        "ss_durability_requests_total{mode=\"%s\"} %llu\n"
+                        "# TYPE ss_durability_flushes_total counter\n"
+                        "ss_durability_flushes_total %llu\n"
+                        "# TYPE ss_durability_dir_syncs_total counter\n"
+                        "ss_durability_dir_syncs_total %llu\n",
+                        durability_mode_name(), durability.requests, durability.groups,
+                        durability.dir_syncs);
+    
+    ExecutorStats exec;
+    executor_get_stats(&exec);
+    metrics_text_printf(text,
+                        "# TYPE ss_exec_workers gauge\nss_exec_workers %d\n"
+                        "# TYPE ss_exec_running gauge\nss_exec_running %d\n"
+                        "# TYPE ss_exec_queued gauge\nss_exec_queued %d\n"
+                        "# TYPE ss_exec_jobs_total counter\n"
+                        "ss_exec_jobs_total{result=\"completed\"} %llu\n"
+                        "ss_exec_jobs_total{result=\"failed\"} %llu\n"
+                        "ss_exec_jobs_total{result=\"timed_out\"} %llu\n"
+                        "ss_exec_jobs_total{result=\"rejected\"} %llu\n"
+                        "# TYPE ss_exec_queue_wait_seconds_total counter\n"
+                        "ss_exec_queue_wait_seconds_total %.3f\n"
+                        "# TYPE ss_exec_queue_wait_max_seconds gauge\n"
+                        "ss_exec_queue_wait_max_seconds %.3f\n"
+                        "# TYPE ss_exec_run_seconds_total counter\n"
+                        "ss_exec_run_seconds_total %.3f\n",
+                        exec.workers, exec.running, exec.queued, exec.completed,
+                        exec.failed - exec.timed_out, exec.timed_out, exec.rejected,
+                        exec.wait_ms_total / 1e3, exec.wait_ms_max / 1e3, exec.run_ms_total / 1e3);
+    
+    ColdStats cold;
+    cold_get_stats(&cold);
+    metrics_text_printf(text,
+                        "# HELP ss_cold_files Files in the compressed tier.\n"
+                        "# TYPE ss_cold_files gauge\nss_cold_files %d\n"
+                        "# TYPE ss_cold_bytes gauge\n"
+                        "ss_cold_bytes{size=\"stored\"} %llu\n"
+                        "ss_cold_bytes{size=\"raw\"} %llu\n"
+                        "# TYPE ss_cold_compression_ratio gauge\n"
+                        "ss_cold_compression_ratio %.3f\n"
+                        "# TYPE ss_cold_transitions_total counter\n"
+                        "ss_cold_transitions_total{kind=\"freeze\"} %llu\n"
+                        "ss_cold_transitions_total{kind=\"thaw\"} %llu\n"
+                        "ss_cold_transitions_total{kind=\"incompressible\"} %llu\n"
+                        "ss_cold_transitions_total{kind=\"failed\"} %llu\n"
+                        "# TYPE ss_cold_thaw_seconds_total counter\n"
+                        "ss_cold_thaw_seconds_total %.6f\n",
+                        cold.files, cold.stored_bytes, cold.raw_bytes,
+                        cold.stored_bytes ? (double)cold.raw_bytes / cold.stored_bytes : 0.0,
+                        cold.freezes, cold.thaws, cold.incompressible, cold.failures,
+                        cold.thaw_us_total / 1e6);
+    
+    FileLockContention top[METRICS_TOP_LOCKS];
+    int count = file_lock_top_contended(top, METRICS_TOP_LOCKS);
+    char names[METRICS_TOP_LOCKS][MAX_FILENAME * 2];
+    for (int i = 0; i < count; i++) {
+        metrics_escape_label(top[i].filename, names[i], sizeof(names[i]));
+    }
+    metrics_text_printf(text,
+                        "# HELP ss_file_lock_file_wait_seconds_total Lock wait of the most "
+                        "contended files.\n"
+                        "# TYPE ss_file_lock_file_wait_seconds_total counter\n");
+    for (int i = 0; i < count; i++) {
+        metrics_text_printf(text, "ss_file_lock_file_wait_seconds_total{file=\"%s\"} %.6f\n",
+                            names[i], top[i].wait_us_total / 1e6);
+    }
+    metrics_text_printf(text, "# TYPE ss_file_lock_file_contended_total counter\n");
+    for (int i = 0; i < count; i++) {
+        metrics_text_printf(text,
+                            "ss_file_lock_file_contended_total{file=\"%s\",mode=\"read\"} %llu\n"
+                            "ss_file_lock_file_contended_total{file=\"%s\",mode=\"write\"} %llu\n",
+                            names[i], top[i].contended_reads, names[i], top[i].contended_writes);
+    }
+    
+    slab_render(text, "ss");
+}
+
+void handle_metrics(Message* msg, Message* response) {
+    MetricsText text = {NULL, 0, 0};
+    render_ss_metrics(&text);
     
-    Message msg, response;
+    response->error_code = SUCCESS;
+    response->body = text.data;
+    response->body_len = text.len < message_max_payload(msg) ? text.len : message_max_payload(msg);
+}
+
+// A pipelining client has already sent its next request: the reply to this
+// one can wait for the next reply (MSG_MORE) instead of going out alone
+static int request_pending(int client_socket) {
+    char byte;
+    return recv(client_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+void* handle_ss_client(void* arg) {
+    int client_socket = (int)(intptr_t)arg;
+    
+    // Kept off the stack: connection threads run on small stacks
+    // (SS_THREAD_STACK_KB)
+    Message* msg = (Message*)malloc(sizeof(Message));
+    Message* response = (Message*)malloc(sizeof(Message));
+    Arena* arena = request_arena();
+    if (!msg || !response) {
+        free(msg);
+        free(response);
+        close(client_socket);
+        return NULL;
+    }
     
     while (running) {
-        memset(&msg, 0, sizeof(Message));
-        memset(&response, 0, sizeof(Message));
+        // Scratch from the previous request goes all at once
+        arena_reset(arena);
+        memset(response, 0, sizeof(Message));
         
-        if (receive_message(client_socket, &msg) < 0) {
+        if (receive_message(client_socket, msg) < 0) {
             break;
         }
         
-        response.msg_type = MSG_RESPONSE;
+        struct timeval started;
+        gettimeofday(&started, NULL);
         
-        switch (msg.command) {
-            case CMD_CREATE:
-                handle_create_file(&msg, &response);
-                break;
+        response->msg_type = MSG_RESPONSE;
+        response->request_id = msg->request_id;
+        response->legacy = msg->legacy;
+        
+        if (stale_location(msg, response)) {
+            send_message(client_socket, response);
+            record_request(&started, msg->command, 1);
+            message_free_body(msg);
+            continue;
+        }
+        thaw_request_file(msg);
+        
+        // Reads and chunked transfers send their own replies
+        int direct = 1, rc = 0;
+        switch (msg->command) {
             case CMD_READ:
-                handle_read_file(&msg, &response);
+                rc = handle_read_file(client_socket, msg);
+                break;
+            case CMD_READ_CHUNKED:
+                rc = handle_read_chunked(client_socket, msg);
+                break;
+            case CMD_WRITE_BULK:
+                rc = handle_write_bulk(client_socket, msg);
+                break;
+            case CMD_STREAM:
+                rc = handle_stream(client_socket, msg);
+                break;
+            case CMD_EXEC:
+                rc = handle_exec(client_socket, msg);
+                break;
+            default:
+                direct = 0;
+        }
+        if (direct) {
+            record_request(&started, msg->command, rc < 0);
+            message_free_body(msg);
+            if (rc < 0) {
+                break;
+            }
+            continue;
+        }
+        
+        switch (msg->command) {
+            case CMD_CREATE:
+                handle_create_file(msg, response);
                 break;
             case CMD_WRITE_COMMIT:
-                handle_write_commit(&msg, &response);
+                handle_write_commit(msg, response);
                 break;
             case CMD_DELETE:
-                handle_delete_file(&msg, &response);
+                handle_delete_file(msg, response);
                 break;
             case CMD_UNDO:
-                handle_undo(&msg, &response);
+                handle_undo(msg, response);
                 break;
             case CMD_COPY:
-                handle_copy(&msg, &response);
+                handle_copy(msg, response);
                 break;
             case CMD_FILEINFO:
-                handle_fileinfo(&msg, &response);
+                handle_fileinfo(msg, response);
                 break;
             case CMD_INFO:
-                handle_info(&msg, &response);
-                break;
-            case CMD_STREAM:
-                handle_stream(&msg, &response);
+                handle_info(msg, response);
                 break;
             case CMD_ADDACCESS:
-                handle_add_access(&msg, &response);
+                handle_add_access(msg, response);
                 break;
             case CMD_REMACCESS:
-                handle_rem_access(&msg, &response);
+                handle_rem_access(msg, response);
                 break;
             case CMD_CREATEFOLDER:
-                handle_create_folder(&msg, &response);
+                handle_create_folder(msg, response);
                 break;
             case CMD_MOVE:
-                handle_move_file(&msg, &response);
+                handle_move_file(msg, response);
                 break;
             case CMD_VIEWFOLDER:
-                handle_view_folder(&msg, &response);
+                handle_view_folder(msg, response);
                 break;
             case CMD_CHECKPOINT:
-                handle_checkpoint(&msg, &response);
+                handle_checkpoint(msg, response);
                 break;
             case CMD_VIEWCHECKPOINT:
-                handle_view_checkpoint(&msg, &response);
+                handle_view_checkpoint(msg, response);
                 break;
             case CMD_REVERT:
-                handle_revert_checkpoint(&msg, &response);
+                handle_revert_checkpoint(msg, response);
                 break;
             case CMD_LISTCHECKPOINTS:
-                handle_list_checkpoints(&msg, &response);
+                handle_list_checkpoints(msg, response);
+                break;
+            case CMD_STATS:
+                handle_stats(msg, response);
+                break;
+            case CMD_METRICS:
+                handle_metrics(msg, response);
+                break;
+            case CMD_REPLICATE:
+                handle_replicate(msg, response);
+                break;
+            case CMD_MIGRATE:
+                handle_migrate(msg, response);
                 break;
             default:
-                response.error_code = ERR_INVALID_COMMAND;
+                response->error_code = ERR_INVALID_COMMAND;
         }
         
-        send_message(client_socket, &response);
+        send_message_flags(client_socket, response, request_pending(client_socket) ? MSG_MORE : 0);
+        record_request(&started, msg->command, response->error_code != SUCCESS);
+        
+        message_free_body(msg);
+        message_free_body(response);
     }
     
+    free(msg);
+    free(response);
     close(client_socket);
     return NULL;
 }
@@ -1783,17 +4678,38 @@ int main() {
     signal(SIGINT, signal_handler_ss);
     signal(SIGTERM, signal_handler_ss);
     
-    pthread_mutex_init(&file_mutex, NULL);
+    file_locking_init();
     
     // Create required directories
     mkdir("data", 0755);
     mkdir("data/files", 0755);
     mkdir("data/metadata", 0755);
-    mkdir("data/undo", 0755);
+    mkdir("data/history", 0755);
     mkdir("data/checkpoints", 0755);
     mkdir("logs", 0755);
+    durability_init();
+    history_init();
+    executor_init();
+    cold_init();
+    
+    const char* id_env = getenv("SS_ID");
+    if (id_env && *id_env) {
+        ss_id = id_env;
+    }
+    ss_port = config_get_int("SS_PORT", SS_CLIENT_PORT);
     
-    log_message("STORAGE_SERVER", "INFO", "Storage Server %s starting", SS_ID);
+    log_message("STORAGE_SERVER", "INFO", "Storage Server %s starting", ss_id);
+    
+    gettimeofday(&load_window_start, NULL);
+    if (lease_init("STORAGE_SERVER") < 0) {
+        fprintf(stderr, "LEASE_KEY must be set\n");
+        return 1;
+    }
+    location_init();
+    replication_init();
+    metadata_cache_init();
+    content_cache_init();
+    cold_tier_init();
     
     // Register with Name Server
     register_with_nm();
@@ -1812,7 +4728,7 @@ int main() {
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SS_CLIENT_PORT);
+    server_addr.sin_port = htons(ss_port);
     
     if (bind(client_server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         log_message("STORAGE_SERVER", "ERROR", "Failed to bind: %s", strerror(errno));
@@ -1824,21 +4740,42 @@ int main() {
         return 1;
     }
     
-    log_message("STORAGE_SERVER", "INFO", "Storage Server listening on port %d", SS_CLIENT_PORT);
-    printf("Storage Server %s started on port %d\n", SS_ID, SS_CLIENT_PORT);
+    log_message("STORAGE_SERVER", "INFO", "Storage Server listening on port %d", ss_port);
+    
+    int metrics_port = config_get_int("SS_METRICS_PORT", 0);
+    if (metrics_port > 0) {
+        if (metrics_http_start(metrics_port, render_ss_metrics) < 0) {
+            log_message("STORAGE_SERVER", "WARNING", "Metrics endpoint: cannot listen on port %d",
+                       metrics_port);
+        } else {
+            log_message("STORAGE_SERVER", "INFO", "Metrics at http://0.0.0.0:%d/metrics",
+                       metrics_port);
+        }
+    }
+    printf("Storage Server %s started on port %d\n", ss_id, ss_port);
+    
+    // One detached thread per connection. Request buffers live on the heap
+    // and in the thread's arena, so a small stack is enough and thousands
+    // of connections do not each reserve the default 8 MB.
+    pthread_attr_t client_attr;
+    pthread_attr_init(&client_attr);
+    pthread_attr_setdetachstate(&client_attr, PTHREAD_CREATE_DETACHED);
+    size_t stack_kb = (size_t)config_get_int("SS_THREAD_STACK_KB", 512);
+    if (pthread_attr_setstacksize(&client_attr, stack_kb * 1024) != 0) {
+        log_message("STORAGE_SERVER", "WARNING", "SS_THREAD_STACK_KB=%zu rejected; using the default",
+                   stack_kb);
+    }
     
     while (running) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         
-        int* client_socket = malloc(sizeof(int));
-        *client_socket = accept(client_server_socket, (struct sockaddr*)&client_addr, &client_len);
+        int client_socket = accept(client_server_socket, (struct sockaddr*)&client_addr, &client_len);
         
-        if (*client_socket < 0) {
+        if (client_socket < 0) {
             if (running) {
                 log_message("STORAGE_SERVER", "ERROR", "Accept failed");
             }
-            free(client_socket);
             continue;
         }
         
@@ -1846,9 +4783,14 @@ int main() {
                    inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
         
         pthread_t thread;
-        pthread_create(&thread, NULL, handle_ss_client, client_socket);
-        pthread_detach(thread);
+        if (pthread_create(&thread, &client_attr, handle_ss_client,
+                           (void*)(intptr_t)client_socket) != 0) {
+            log_message("STORAGE_SERVER", "ERROR", "Cannot start a thread for the client: %s",
+                       strerror(errno));
+            close(client_socket);
+        }
     }
+    pthread_attr_destroy(&client_attr);
     
     cleanup_ss();
     return 0;
@@ -0,0 +1,209 @@
+#include "../include/tokenizer.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define TOKENIZER_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define TOKENIZER_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Classifies exactly 64 bytes
+typedef struct {
+    const char* name;
+    void (*classify64)(const char* p, uint64_t* space, uint64_t* delim);
+} TokenizerKernel;
+
+static void scalar_classify64(const char* p, uint64_t* space, uint64_t* delim) {
+    uint64_t s = 0, d = 0;
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = (unsigned char)p[i];
+        // ' ', '\t', '\n', '\v', '\f', '\r'
+        s |= (uint64_t)(c == ' ' || (unsigned char)(c - '\t') < 5) << i;
+        d |= (uint64_t)(c == '.' || c == '!' || c == '?') << i;
+    }
+    *space = s;
+    *delim = d;
+}
+
+static const TokenizerKernel scalar_kernel = {"scalar", scalar_classify64};
+
+#ifdef TOKENIZER_X86
+
+// SSE2: four 16-byte lanes
+
+static inline void sse2_classify16(const char* p, unsigned* space, unsigned* delim) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+
+    // Whitespace: ' ', or c - '\t' <= 4 unsigned
+    __m128i blank = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    __m128i control = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control);
+    *space = (unsigned)_mm_movemask_epi8(_mm_or_si128(blank, low));
+
+    __m128i dot = _mm_cmpeq_epi8(v, _mm_set1_epi8('.'));
+    __m128i bang = _mm_cmpeq_epi8(v, _mm_set1_epi8('!'));
+    __m128i question = _mm_cmpeq_epi8(v, _mm_set1_epi8('?'));
+    *delim = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(dot, bang), question));
+}
+
+static void sse2_classify64(const char* p, uint64_t* space, uint64_t* delim) {
+    uint64_t s = 0, d = 0;
+    for (int i = 0; i < 4; i++) {
+        unsigned lane_space, lane_delim;
+        sse2_classify16(p + 16 * i, &lane_space, &lane_delim);
+        s |= (uint64_t)lane_space << (16 * i);
+        d |= (uint64_t)lane_delim << (16 * i);
+    }
+    *space = s;
+    *delim = d;
+}
+
+static const TokenizerKernel sse2_kernel = {"sse2", sse2_classify64};
+
+// AVX2: two 32-byte lanes, compiled for AVX2 whatever the build flags
+
+__attribute__((target("avx2")))
+static inline void avx2_classify32(const char* p, uint32_t* space, uint32_t* delim) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+
+    __m256i blank = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    __m256i control = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8(4)), control);
+    *space = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(blank, low));
+
+    __m256i dot = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'));
+    __m256i bang = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('!'));
+    __m256i question = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?'));
+    *delim = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(dot, bang), question));
+}
+
+__attribute__((target("avx2")))
+static void avx2_classify64(const char* p, uint64_t* space, uint64_t* delim) {
+    uint32_t s0, d0, s1, d1;
+    avx2_classify32(p, &s0, &d0);
+    avx2_classify32(p + 32, &s1, &d1);
+    *space = (uint64_t)s1 << 32 | s0;
+    *delim = (uint64_t)d1 << 32 | d0;
+}
+
+static const TokenizerKernel avx2_kernel = {"avx2", avx2_classify64};
+
+#endif // TOKENIZER_X86
+
+#ifdef TOKENIZER_NEON
+
+// NEON: four 16-byte lanes. There is no movemask; each lane is ANDed
+// with its bit weights and pairwise adds fold the 64 bytes into 64 bits.
+
+static inline uint64_t neon_movemask64(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3) {
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t w = vld1q_u8(weights);
+    uint8x16_t sum0 = vpaddq_u8(vandq_u8(m0, w), vandq_u8(m1, w));
+    uint8x16_t sum1 = vpaddq_u8(vandq_u8(m2, w), vandq_u8(m3, w));
+    sum0 = vpaddq_u8(sum0, sum1);
+    sum0 = vpaddq_u8(sum0, sum0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+
+static inline uint8x16_t neon_space16(uint8x16_t v) {
+    uint8x16_t blank = vceqq_u8(v, vdupq_n_u8(' '));
+    uint8x16_t low = vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(4));
+    return vorrq_u8(blank, low);
+}
+
+static inline uint8x16_t neon_delim16(uint8x16_t v) {
+    uint8x16_t dot = vceqq_u8(v, vdupq_n_u8('.'));
+    uint8x16_t bang = vceqq_u8(v, vdupq_n_u8('!'));
+    uint8x16_t question = vceqq_u8(v, vdupq_n_u8('?'));
+    return vorrq_u8(vorrq_u8(dot, bang), question);
+}
+
+static void neon_classify64(const char* p, uint64_t* space, uint64_t* delim) {
+    const uint8_t* b = (const uint8_t*)p;
+    uint8x16_t v0 = vld1q_u8(b), v1 = vld1q_u8(b + 16);
+    uint8x16_t v2 = vld1q_u8(b + 32), v3 = vld1q_u8(b + 48);
+    *space = neon_movemask64(neon_space16(v0), neon_space16(v1), neon_space16(v2), neon_space16(v3));
+    *delim = neon_movemask64(neon_delim16(v0), neon_delim16(v1), neon_delim16(v2), neon_delim16(v3));
+}
+
+static const TokenizerKernel neon_kernel = {"neon", neon_classify64};
+
+#endif // TOKENIZER_NEON
+
+static const TokenizerKernel* active_kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static const TokenizerKernel* kernel_by_name(const char* name) {
+    if (strcmp(name, "scalar") == 0) {
+        return &scalar_kernel;
+    }
+#ifdef TOKENIZER_X86
+    if (strcmp(name, "sse2") == 0) {
+        return &sse2_kernel;
+    }
+    if (strcmp(name, "avx2") == 0) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &avx2_kernel : NULL;
+    }
+#endif
+#ifdef TOKENIZER_NEON
+    if (strcmp(name, "neon") == 0) {
+        return &neon_kernel;
+    }
+#endif
+    return NULL;
+}
+
+static void choose_kernel() {
+    const char* forced = getenv("TOKENIZER_KERNEL");
+    if (forced && forced[0] != '\0') {
+        active_kernel = kernel_by_name(forced);
+        if (active_kernel) {
+            return;
+        }
+        log_message("TOKENIZER", "WARNING", "TOKENIZER_KERNEL=%s is not available here", forced);
+    }
+
+    static const char* preferred[] = {"avx2", "sse2", "neon"};
+    for (size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]) && !active_kernel; i++) {
+        active_kernel = kernel_by_name(preferred[i]);
+    }
+    if (!active_kernel) {
+        active_kernel = &scalar_kernel;
+    }
+}
+
+static inline const TokenizerKernel* kernel() {
+    pthread_once(&kernel_once, choose_kernel);
+    return active_kernel;
+}
+
+void tok_classify(const char* p, size_t len, uint64_t* space, uint64_t* delim) {
+    if (len >= 64) {
+        kernel()->classify64(p, space, delim);
+        return;
+    }
+
+    // Short tail: classify a copy padded with whitespace
+    char block[64];
+    memcpy(block, p, len);
+    memset(block + len, ' ', 64 - len);
+    kernel()->classify64(block, space, delim);
+}
+
+const char* tokenizer_kernel() {
+    return kernel()->name;
+}
+
+int tokenizer_use_kernel(const char* name) {
+    kernel();
+    const TokenizerKernel* chosen = kernel_by_name(name);
+    if (!chosen) {
+        return -1;
+    }
+    active_kernel = chosen;
+    return 0;
+}
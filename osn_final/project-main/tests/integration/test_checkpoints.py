@@ -0,0 +1,81 @@
+"""Integration tests for checkpoints.
+
+A checkpoint keeps the file as it was when tagged; VIEWCHECKPOINT returns
+it whatever happened to the file since, at any size (the content comes in
+the reply body, not in the fixed-size header data).
+"""
+import shutil
+import tempfile
+from pathlib import Path
+
+import pytest
+
+from test_utils import (
+    start_test_servers, stop_test_servers, run_batch, batch_result, BIN_DIR
+)
+
+
+def checkpoint_content(output: str) -> str:
+    """The text VIEWCHECKPOINT printed."""
+    marker = "Checkpoint content:\n"
+    assert marker in output, output
+    return output.split(marker, 1)[1].split("\n\n", 1)[0]
+
+
+@pytest.mark.skipif(not (BIN_DIR / 'client').exists(), reason="binaries not built (make all)")
+class TestCheckpoints:
+    """CHECKPOINT / VIEWCHECKPOINT round trips."""
+
+    @classmethod
+    def setup_class(cls):
+        """Start servers in a scratch directory."""
+        cls.workdir = Path(tempfile.mkdtemp(prefix="nfs_checkpoints_"))
+        cls.naming_server, cls.storage_server = start_test_servers(cls.workdir)
+
+    @classmethod
+    def teardown_class(cls):
+        """Stop the servers and drop their data."""
+        stop_test_servers(cls.naming_server, cls.storage_server)
+        shutil.rmtree(cls.workdir, ignore_errors=True)
+
+    def test_checkpoint_round_trip(self):
+        """VIEWCHECKPOINT shows the content at CHECKPOINT time, not the current one."""
+        success, output = run_batch("\n".join([
+            "CREATE cp_small.txt",
+            "WRITE cp_small.txt 0", "0 Before", "1 the", "2 edit.", "ETIRW",
+            "CHECKPOINT cp_small.txt v1",
+            "WRITE cp_small.txt 0", "0 After", "ETIRW",
+        ]))
+        assert success, output
+
+        success, output = run_batch("VIEWCHECKPOINT cp_small.txt v1\nREAD cp_small.txt")
+        assert success, output
+        assert checkpoint_content(output) == "Before the edit."
+        assert batch_result(output, 3) == "After Before the edit."
+
+    def test_large_checkpoint_round_trip(self):
+        """A checkpoint bigger than one message buffer comes back whole."""
+        text = " ".join(f"Sentence {i} of a file too large for one message." for i in range(2000))
+        local = self.workdir / "cp_large_source.txt"
+        local.write_text(text)
+
+        success, output = run_batch("\n".join([
+            "CREATE cp_large.txt",
+            f"UPLOAD cp_large.txt {local}",
+            "CHECKPOINT cp_large.txt big",
+            "WRITE cp_large.txt 0", "0 Changed", "ETIRW",
+        ]))
+        assert success, output
+
+        success, output = run_batch("VIEWCHECKPOINT cp_large.txt big")
+        assert success, output
+        assert checkpoint_content(output) == text
+
+    def test_missing_checkpoint(self):
+        """An unknown tag is an error, not empty content."""
+        success, output = run_batch("CREATE cp_none.txt")
+        assert success, output
+
+        success, output = run_batch("VIEWCHECKPOINT cp_none.txt nosuchtag")
+        assert not success
+        assert "Checkpoint content" not in output
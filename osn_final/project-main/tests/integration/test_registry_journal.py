@@ -0,0 +1,75 @@
+"""Integration tests for the Name Server registry journal.
+
+The Name Server journals every registry change and replays the journal at
+start up, so it knows the files without waiting for Storage Servers to
+register. These tests restart it alone and check what it lists.
+"""
+import shutil
+import tempfile
+from pathlib import Path
+
+import pytest
+
+from test_utils import (
+    start_test_servers, stop_test_servers, start_name_server, run_batch, BIN_DIR
+)
+
+
+def listed_files() -> set:
+    """Names VIEW -a lists."""
+    success, output = run_batch("VIEW -a")
+    assert success, output
+    return {line[4:].strip() for line in output.splitlines() if line.startswith("--> ")}
+
+
+@pytest.mark.skipif(not (BIN_DIR / 'client').exists(), reason="binaries not built (make all)")
+class TestRegistryJournal:
+    """Registry state across Name Server restarts."""
+
+    def setup_method(self):
+        """Servers in a fresh scratch directory per test."""
+        self.workdir = Path(tempfile.mkdtemp(prefix="nfs_journal_"))
+        self.journal = self.workdir / 'data' / 'file_registry.journal'
+
+    def teardown_method(self):
+        shutil.rmtree(self.workdir, ignore_errors=True)
+
+    def populate(self):
+        """Create, delete and rename a few files, then stop everything."""
+        naming_server, storage_server = start_test_servers(self.workdir)
+        try:
+            success, output = run_batch("\n".join([
+                "CREATE keep.txt", "CREATE drop.txt", "CREATE old_name.txt",
+                "DELETE drop.txt",
+                "MOVE old_name.txt new_name.txt",
+            ]))
+            assert success, output
+            assert listed_files() == {"keep.txt", "new_name.txt"}
+        finally:
+            stop_test_servers(naming_server, storage_server)
+
+    def test_replay_after_restart(self):
+        """A restarted Name Server lists the files before any SS registers."""
+        self.populate()
+        assert self.journal.exists()
+
+        naming_server = start_name_server(self.workdir)
+        try:
+            assert listed_files() == {"keep.txt", "new_name.txt"}
+        finally:
+            naming_server.terminate()
+
+    def test_torn_tail_ignored(self):
+        """A half-written last record is dropped; the rest still replays."""
+        self.populate()
+        with open(self.journal, 'a') as f:
+            f.write("deadbeef create|half_written.txt")
+
+        naming_server = start_name_server(self.workdir)
+        try:
+            assert listed_files() == {"keep.txt", "new_name.txt"}
+        finally:
+            naming_server.terminate()
+
+        # The tail was cut off, so later records are not lost behind it
+        assert not self.journal.read_text().endswith("half_written.txt")
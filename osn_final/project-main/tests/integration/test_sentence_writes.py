@@ -0,0 +1,124 @@
+"""Integration tests for the sentence-level write path.
+
+WRITE commits are spliced into the file around the edited sentence using
+the Storage Server's sentence index, instead of rebuilding the whole file.
+These tests check the file the client reads back, and its sentence count,
+after edits that keep, move, add or split sentence boundaries.
+"""
+import shutil
+import tempfile
+from pathlib import Path
+
+import pytest
+
+from test_utils import (
+    start_test_servers, stop_test_servers, run_batch, batch_result, BIN_DIR
+)
+
+
+def write_script(filename: str, sentence: str, *edits: str) -> str:
+    """A WRITE session: the lock, one edit line per entry, ETIRW."""
+    return "\n".join([f"WRITE {filename} {sentence}", *edits, "ETIRW"])
+
+
+def sentence_count(filename: str) -> int:
+    """Sentences in filename according to INFO."""
+    success, output = run_batch(f"INFO {filename}")
+    assert success, output
+    for line in output.splitlines():
+        if line.startswith("Sentences:"):
+            return int(line.split(":")[1])
+    raise AssertionError(f"No sentence count in INFO output:\n{output}")
+
+
+@pytest.mark.skipif(not (BIN_DIR / 'client').exists(), reason="binaries not built (make all)")
+class TestSentenceWrites:
+    """Edits spliced into files by sentence."""
+
+    @classmethod
+    def setup_class(cls):
+        """Start servers in a scratch directory."""
+        cls.workdir = Path(tempfile.mkdtemp(prefix="nfs_writes_"))
+        cls.naming_server, cls.storage_server = start_test_servers(cls.workdir)
+
+    @classmethod
+    def teardown_class(cls):
+        """Stop the servers and drop their data."""
+        stop_test_servers(cls.naming_server, cls.storage_server)
+        shutil.rmtree(cls.workdir, ignore_errors=True)
+
+    def create(self, filename: str, *sentences: str):
+        """Create filename holding sentences, one WRITE each."""
+        script = [f"CREATE {filename}"]
+        for i, sentence in enumerate(sentences):
+            words = [f"{w} {word}" for w, word in enumerate(sentence.split())]
+            script.append(write_script(filename, str(i), *words))
+        success, output = run_batch("\n".join(script))
+        assert success, output
+
+    def read(self, filename: str) -> str:
+        success, output = run_batch(f"READ {filename}")
+        assert success, output
+        return batch_result(output, 2)
+
+    def test_edit_keeps_other_sentences(self):
+        """Editing the middle sentence leaves its neighbours byte for byte."""
+        self.create("splice_middle.txt", "Hello world.", "Second one.", "Third.")
+        assert self.read("splice_middle.txt") == "Hello world. Second one. Third."
+
+        success, output = run_batch(write_script("splice_middle.txt", "1", "1 middle!"))
+        assert success, output
+        assert self.read("splice_middle.txt") == "Hello world. Second middle! one. Third."
+        assert sentence_count("splice_middle.txt") == 4
+
+    def test_terminator_splits_sentence(self):
+        """A word ending in '.' inside a sentence makes it two."""
+        self.create("splice_split.txt", "One two three four.")
+        assert sentence_count("splice_split.txt") == 1
+
+        success, output = run_batch(write_script("splice_split.txt", "0", "2 stop."))
+        assert success, output
+        assert self.read("splice_split.txt") == "One two stop. three four."
+        assert sentence_count("splice_split.txt") == 2
+
+        # The second sentence is addressable right after the split
+        success, output = run_batch(write_script("splice_split.txt", "1", "0 then"))
+        assert success, output
+        assert self.read("splice_split.txt") == "One two stop. then three four."
+
+    def test_append_sentence(self):
+        """Writing at the sentence count appends; beyond it is refused."""
+        self.create("splice_append.txt", "First.")
+        success, output = run_batch(write_script("splice_append.txt", "1", "0 Second."))
+        assert success, output
+        assert self.read("splice_append.txt") == "First. Second."
+
+        success, output = run_batch(write_script("splice_append.txt", "5", "0 Far."))
+        assert not success
+        assert "invalid sentence" in output.lower()
+        assert self.read("splice_append.txt") == "First. Second."
+
+    def test_multi_sentence_write(self):
+        """One commit editing several sentences applies every edit."""
+        self.create("splice_multi.txt", "Alpha beta.", "Gamma delta.", "Epsilon zeta.")
+        success, output = run_batch(write_script("splice_multi.txt", "0-2",
+                                                 "0 1 one", "2 0 two", "2 2 three"))
+        assert success, output
+        assert self.read("splice_multi.txt") == "Alpha one beta. Gamma delta. two Epsilon three zeta."
+
+    def test_edit_deep_in_large_file(self):
+        """Spans after the edit are shifted correctly in a many-sentence file."""
+        sentences = [f"Sentence number {i}." for i in range(40)]
+        self.create("splice_large.txt", *sentences)
+
+        success, output = run_batch(write_script("splice_large.txt", "20", "1 edited"))
+        assert success, output
+        sentences[20] = "Sentence edited number 20."
+        assert self.read("splice_large.txt") == " ".join(sentences)
+
+        # Sentences after the edit still land where expected
+        success, output = run_batch(write_script("splice_large.txt", "39", "0 Last"))
+        assert success, output
+        sentences[39] = "Last Sentence number 39."
+        assert self.read("splice_large.txt") == " ".join(sentences)
+        assert sentence_count("splice_large.txt") == 40
@@ -1,307 +1,119 @@
-"""Performance tests for the NFS system."""
+"""Performance tests for the NFS system.
+
+The measurements are taken by bin/load_bench (bench/load_bench.c, built with
+`make bench`), which speaks the wire protocol directly from many connections
+at once, rather than by spawning the client per operation. Each test runs it
+against freshly started servers and keeps its JSON report under results/.
+"""
+import json
 import os
-import time
-import pytest
-import statistics
+import subprocess
+from datetime import datetime
 from pathlib import Path
-from typing import List, Tuple, Dict, Any
-from concurrent.futures import ThreadPoolExecutor, as_completed
+from typing import Any, Dict, List
+
+import pytest
 
 from test_utils import (
-    run_client_command, cleanup_test_files, start_test_servers, stop_test_servers,
-    TestProcess, TEST_FILE, TEST_CONTENT, TEST_DIR, PROJECT_ROOT, BIN_DIR
+    start_test_servers, stop_test_servers, PROJECT_ROOT, BIN_DIR,
+    NAMING_SERVER_HOST, NAMING_SERVER_PORT
 )
 
+LOAD_BENCH = BIN_DIR / 'load_bench'
+
 # Performance test configurations
-PERF_TEST_ITERATIONS = 10
+PERF_SECONDS = int(os.getenv('PERF_SECONDS', '3'))
+PERF_WARMUP = int(os.getenv('PERF_WARMUP', '1'))
+PERF_THREADS = int(os.getenv('PERF_THREADS', '8'))
 PERF_FILE_SIZES = [
-    ("1KB", 1024),          # 1KB
+    ("1KB", 1024),           # 1KB
     ("10KB", 10 * 1024),     # 10KB
     ("100KB", 100 * 1024),   # 100KB
     ("1MB", 1024 * 1024),    # 1MB
 ]
-PERF_CONCURRENT_CLIENTS = [1, 5, 10, 25, 50]  # Number of concurrent clients
+PERF_CONNECTIONS = [16, 256, 1024, 2048]  # Concurrent client connections
+
 
+@pytest.mark.skipif(not LOAD_BENCH.exists(), reason="bin/load_bench not built (make bench)")
 class TestNFSPerformance:
     """Performance tests for the NFS system."""
-    
+
     @classmethod
     def setup_class(cls):
         """Setup test class."""
-        # Start test servers
         cls.naming_server, cls.storage_server = start_test_servers()
-        
-        # Register a test user
-        run_client_command("REGISTER testuser testpass123")
-        
-        # Create a test directory
-        run_client_command(f"CREATEFOLDER {TEST_DIR}")
-    
+
     @classmethod
     def teardown_class(cls):
         """Teardown test class."""
-        # Stop test servers
         stop_test_servers(cls.naming_server, cls.storage_server)
-    
-    def setup_method(self):
-        """Setup before each test method."""
-        cleanup_test_files()
-    
-    def teardown_method(self):
-        """Teardown after each test method."""
-        cleanup_test_files()
-    
-    def generate_test_content(self, size: int) -> str:
-        """Generate test content of specified size."""
-        # Use a repeating pattern to make compression less effective
-        pattern = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
-        repeat = (size // len(pattern)) + 1
-        return (pattern * repeat)[:size]
-    
-    def test_file_write_performance(self):
-        ""Test write performance with different file sizes.""
-        results = {}
-        
-        for size_name, size in PERF_FILE_SIZES:
-            test_content = self.generate_test_content(size)
-            test_file = f"perf_write_{size_name}.txt"
-            
-            times = []
-            for i in range(PERF_TEST_ITERATIONS):
-                start_time = time.time()
-                
-                success, output = run_client_command(
-                    f"CREATE {test_file} \"{test_content}\""
-                )
-                assert success, f"Failed to create file: {output}"
-                
-                end_time = time.time()
-                times.append(end_time - start_time)
-                
-                # Cleanup for next iteration
-                run_client_command(f"DELETE {test_file}")
-            
-            # Calculate statistics
-            avg_time = statistics.mean(times)
-            throughput = size / (avg_time * 1024)  # KB/s
-            
-            results[size_name] = {
-                'size_bytes': size,
-                'iterations': PERF_TEST_ITERATIONS,
-                'avg_time_seconds': avg_time,
-                'throughput_kb_per_sec': throughput,
-                'all_times': times
-            }
-            
-            print(f"\nWrite Performance - {size_name}:")
-            print(f"  Average time: {avg_time:.4f} seconds")
-            print(f"  Throughput: {throughput:.2f} KB/s")
-        
-        # Save results to file
-        self.save_performance_results("write_performance.json", results)
-    
-    def test_file_read_performance(self):
-        ""Test read performance with different file sizes.""
-        results = {}
-        
-        for size_name, size in PERF_FILE_SIZES:
-            test_content = self.generate_test_content(size)
-            test_file = f"perf_read_{size_name}.txt"
-            
-            # Create the test file first
-            success, _ = run_client_command(f"CREATE {test_file} \"{test_content}\"")
-            assert success, f"Failed to create test file {test_file}"
-            
-            times = []
-            for _ in range(PERF_TEST_ITERATIONS):
-                start_time = time.time()
-                
-                success, output = run_client_command(f"READ {test_file}")
-                assert success, f"Failed to read file: {output}"
-                assert len(output.strip()) >= size, "Incomplete content read"
-                
-                end_time = time.time()
-                times.append(end_time - start_time)
-            
-            # Calculate statistics
-            avg_time = statistics.mean(times)
-            throughput = size / (avg_time * 1024)  # KB/s
-            
-            results[size_name] = {
-                'size_bytes': size,
-                'iterations': PERF_TEST_ITERATIONS,
-                'avg_time_seconds': avg_time,
-                'throughput_kb_per_sec': throughput,
-                'all_times': times
-            }
-            
-            print(f"\nRead Performance - {size_name}:")
-            print(f"  Average time: {avg_time:.6f} seconds")
-            print(f"  Throughput: {throughput:.2f} KB/s")
-            
-            # Cleanup
-            run_client_command(f"DELETE {test_file}")
-        
-        # Save results to file
-        self.save_performance_results("read_performance.json", results)
-    
-    def test_concurrent_reads(self):
-        ""Test performance with multiple concurrent read operations."""
-        test_file = "concurrent_read_test.txt"
-        test_content = self.generate_test_content(10 * 1024)  # 10KB file
-        
-        # Create the test file
-        success, _ = run_client_command(f"CREATE {test_file} \"{test_content}\"")
-        assert success, "Failed to create test file"
-        
-        results = {}
-        
-        for num_clients in PERF_CONCURRENT_CLIENTS:
-            print(f"\nTesting with {num_clients} concurrent readers...")
-            
-            def read_worker() -> float:
-                start_time = time.time()
-                success, output = run_client_command(f"READ {test_file}")
-                end_time = time.time()
-                
-                assert success, f"Read failed: {output}"
-                assert len(output.strip()) >= len(test_content), "Incomplete content read"
-                
-                return end_time - start_time
-            
-            # Run concurrent readers
-            with ThreadPoolExecutor(max_workers=num_clients) as executor:
-                futures = [executor.submit(read_worker) for _ in range(num_clients)]
-                times = [future.result() for future in as_completed(futures)]
-            
-            # Calculate statistics
-            avg_time = statistics.mean(times)
-            throughput = (len(test_content) * num_clients) / (avg_time * 1024)  # KB/s
-            
-            results[num_clients] = {
-                'num_clients': num_clients,
-                'file_size': len(test_content),
-                'avg_time_seconds': avg_time,
-                'throughput_kb_per_sec': throughput,
-                'all_times': times
-            }
-            
-            print(f"  Average time per read: {avg_time:.6f} seconds")
-            print(f"  Total throughput: {throughput:.2f} KB/s")
-        
-        # Save results to file
-        self.save_performance_results("concurrent_reads.json", results)
-        
-        # Cleanup
-        run_client_command(f"DELETE {test_file}")
-    
-    def test_concurrent_writes(self):
-        ""Test performance with multiple concurrent write operations."""
-        results = {}
-        
-        for num_clients in PERF_CONCURRENT_CLIENTS:
-            print(f"\nTesting with {num_clients} concurrent writers...")
-            
-            test_files = [f"concurrent_write_{i}.txt" for i in range(num_clients)]
-            test_content = self.generate_test_content(1024)  # 1KB per file
-            
-            def write_worker(file_idx: int) -> Tuple[bool, float]:
-                filename = test_files[file_idx]
-                start_time = time.time()
-                
-                success, output = run_client_command(
-                    f"CREATE {filename} \"{test_content}\""
-                )
-                
-                end_time = time.time()
-                return success, (end_time - start_time)
-            
-            # Run concurrent writers
-            with ThreadPoolExecutor(max_workers=num_clients) as executor:
-                futures = [executor.submit(write_worker, i) for i in range(num_clients)]
-                results_list = [future.result() for future in as_completed(futures)]
-            
-            # Process results
-            success_count = sum(1 for success, _ in results_list if success)
-            times = [time for _, time in results_list]
-            
-            if times:
-                avg_time = statistics.mean(times)
-                throughput = (len(test_content) * num_clients) / (avg_time * 1024)  # KB/s
-                
-                results[num_clients] = {
-                    'num_clients': num_clients,
-                    'file_size': len(test_content),
-                    'success_count': success_count,
-                    'avg_time_seconds': avg_time,
-                    'throughput_kb_per_sec': throughput,
-                    'all_times': times
-                }
-                
-                print(f"  Success rate: {success_count}/{num_clients}")
-                print(f"  Average time per write: {avg_time:.6f} seconds")
-                print(f"  Total throughput: {throughput:.2f} KB/s")
-            
-            # Cleanup
-            for filename in test_files:
-                run_client_command(f"DELETE {filename}", expect_success=False)
-        
-        # Save results to file
-        self.save_performance_results("concurrent_writes.json", results)
-    
-    def save_performance_results(self, filename: str, data: Dict[str, Any]):
-        """Save performance results to a JSON file."""
-        import json
-        from datetime import datetime
-        
-        # Create results directory if it doesn't exist
+
+    def run_load_bench(self, name: str, *args: str) -> Dict[str, Any]:
+        """Run load_bench with args and return its JSON report."""
         results_dir = PROJECT_ROOT / "results"
         results_dir.mkdir(exist_ok=True)
-        
-        # Add timestamp to filename
         timestamp = datetime.now().strftime("%Y%m%d_%H%M%S")
-        base_name = Path(filename).stem
-        ext = Path(filename).suffix
-        output_file = results_dir / f"{base_name}_{timestamp}{ext}"
-        
-        # Save the data
-        with open(output_file, 'w') as f:
-            json.dump({
-                'timestamp': datetime.now().isoformat(),
-                'test_name': self.id(),
-                'data': data
-            }, f, indent=2)
-        
-        print(f"\nResults saved to: {output_file}")
+        output_file = results_dir / f"{name}_{timestamp}.json"
+
+        command = [
+            str(LOAD_BENCH),
+            '--host', NAMING_SERVER_HOST,
+            '--port', str(NAMING_SERVER_PORT),
+            '--threads', str(PERF_THREADS),
+            '--seconds', str(PERF_SECONDS),
+            '--warmup', str(PERF_WARMUP),
+            '--json', str(output_file),
+            *args,
+        ]
+        completed = subprocess.run(command, cwd=str(PROJECT_ROOT), capture_output=True,
+                                   text=True, timeout=PERF_SECONDS + PERF_WARMUP + 120)
+        print(f"\n{completed.stdout}{completed.stderr}")
+        assert completed.returncode == 0, f"load_bench failed: {completed.stderr}"
+
+        with open(output_file) as f:
+            report = json.load(f)
+        print(f"Results saved to: {output_file}")
+        return report
+
+    def assert_healthy(self, report: Dict[str, Any], operations: List[str]):
+        """Every connection stayed up, nothing failed, and each operation ran."""
+        assert report['connected'] == report['config']['connections']
+        assert report['failed_connections'] == 0
+        for op in operations:
+            result = report['operations'][op]
+            assert result['errors'] == 0, f"{op}: {result['errors']} errors"
+            assert result['ops'] > 0, f"{op}: no operations completed"
+            latency = result['latency_us']
+            assert 0 < latency['p50'] <= latency['p99'] <= latency['p999'] <= latency['max']
+
+    def test_mixed_workload(self):
+        """Default mix (mostly reads) from many connections."""
+        report = self.run_load_bench("mixed_workload", '--connections', '256')
+        self.assert_healthy(report, ['create', 'read', 'write', 'lock'])
+
+    def test_write_heavy_workload(self):
+        """Writes and locks contending for a small working set."""
+        report = self.run_load_bench(
+            "write_heavy_workload", '--connections', '256', '--files', '16',
+            '--mix', 'write=60,lock=20,read=20')
+        self.assert_healthy(report, ['read', 'write', 'lock'])
+
+    def test_file_read_performance(self):
+        """Read throughput and latency for different file sizes."""
+        for size_name, size in PERF_FILE_SIZES:
+            report = self.run_load_bench(
+                f"read_performance_{size_name}", '--connections', '16', '--files', '8',
+                '--file-size', str(size), '--mix', 'read=100')
+            self.assert_healthy(report, ['read'])
+
+            read = report['operations']['read']
+            print(f"Read Performance - {size_name}: {read['ops_per_sec']:.0f} reads/s, "
+                  f"{read['ops_per_sec'] * size / 1024:.0f} KB/s")
 
-# This test requires manual execution as it's destructive
-# @pytest.mark.skip(reason="Manual execution only - this test is destructive")
-# def test_system_limits():
-#     """Test system limits by creating a large number of files."""
-#     num_files = 1000
-#     print(f"\nCreating {num_files} files...")
-#     
-#     start_time = time.time()
-#     
-#     for i in range(num_files):
-#         filename = f"limit_test_{i:04d}.txt"
-#         success, output = run_client_command(f"CREATE {filename} \"Test content {i}\"")
-#         
-#         if not success:
-#             print(f"Failed after {i} files: {output}")
-#             break
-#             
-#         if (i + 1) % 100 == 0:
-#             print(f"  Created {i + 1} files...")
-#     
-#     end_time = time.time()
-#     elapsed = end_time - start_time
-#     
-#     print(f"\nCreated {num_files} files in {elapsed:.2f} seconds")
-#     print(f"Average time per file: {(elapsed * 1000 / num_files):.2f} ms")
-#     
-#     # Cleanup
-#     print("\nCleaning up...")
-#     for i in range(num_files):
-#         filename = f"limit_test_{i:04d}.txt"
-#         run_client_command(f"DELETE {filename}", expect_success=False)
+    @pytest.mark.parametrize("connections", PERF_CONNECTIONS)
+    def test_concurrent_connections(self, connections: int):
+        """Throughput and tail latency as the number of connections grows."""
+        report = self.run_load_bench(
+            f"concurrent_connections_{connections}", '--connections', str(connections),
+            '--mix', 'read=80,create=10,lock=10')
+        self.assert_healthy(report, ['read', 'create', 'lock'])
@@ -4,6 +4,7 @@ import time
 import socket
 import subprocess
 import signal
+import re
 from pathlib import Path
 from typing import Optional, Tuple, List, Dict, Any
 from dataclasses import dataclass
@@ -102,27 +103,57 @@ def wait_for_port(host: str, port: int, timeout: float = 10.0, check_interval: f
         time.sleep(check_interval)
     return False
 
-def start_test_servers() -> Tuple[TestProcess, TestProcess]:
-    """Start the naming server and storage server for testing."""
+def start_name_server(workdir: Optional[Path] = None,
+                      env: Optional[Dict[str, str]] = None) -> TestProcess:
+    """Start the naming server alone in workdir and wait for its port.
+    
+    workdir and env are as for start_test_servers.
+    """
     # Ensure binary directory exists
     if not BIN_DIR.exists():
         raise FileNotFoundError(f"Binary directory not found: {BIN_DIR}")
     
+    workdir = workdir or PROJECT_ROOT
+    server_env = os.environ.copy()
+    server_env.update(env or {})
+    
     # Create log directory
-    log_dir = PROJECT_ROOT / 'logs'
+    log_dir = workdir / 'logs'
     log_dir.mkdir(exist_ok=True)
     
-    # Start Naming Server
     ns_log = log_dir / 'naming_server_test.log'
     ns_cmd = [str(BIN_DIR / 'name_server')]
     ns_process = subprocess.Popen(
         ns_cmd,
-        stdout=open(ns_log, 'w'),
+        stdout=open(ns_log, 'a'),
         stderr=subprocess.STDOUT,
-        cwd=str(PROJECT_ROOT)
+        cwd=str(workdir),
+        env=server_env
     )
     naming_server = TestProcess(ns_process, "Naming Server", ns_log)
     
+    if not wait_for_port(NAMING_SERVER_HOST, NAMING_SERVER_PORT, timeout=10):
+        naming_server.terminate()
+        raise RuntimeError("Naming Server failed to start")
+    
+    return naming_server
+
+def start_test_servers(workdir: Optional[Path] = None,
+                       env: Optional[Dict[str, str]] = None) -> Tuple[TestProcess, TestProcess]:
+    """Start the naming server and storage server for testing.
+    
+    Both run in workdir (default: the project root), so a test passing a
+    scratch directory gets its own data/ and logs/. env adds settings on
+    top of the current environment (e.g. NM_LEASE_MS).
+    """
+    # The Name Server is up before the Storage Server registers with it
+    naming_server = start_name_server(workdir, env)
+    
+    workdir = workdir or PROJECT_ROOT
+    server_env = os.environ.copy()
+    server_env.update(env or {})
+    log_dir = workdir / 'logs'
+    
     # Start Storage Server
     ss_log = log_dir / 'storage_server_test.log'
     ss_cmd = [str(BIN_DIR / 'storage_server')]
@@ -130,16 +161,13 @@ def start_test_servers() -> Tuple[TestProcess, TestProcess]:
         ss_cmd,
         stdout=open(ss_log, 'w'),
         stderr=subprocess.STDOUT,
-        cwd=str(PROJECT_ROOT)
+        cwd=str(workdir),
+        env=server_env
     )
     storage_server = TestProcess(ss_process, "Storage Server", ss_log)
     
-    # Wait for servers to start
-    if not wait_for_port(NAMING_SERVER_HOST, NAMING_SERVER_PORT, timeout=10):
-        naming_server.terminate()
-        storage_server.terminate()
-        raise RuntimeError("Naming Server failed to start")
-    
+    # The Storage Server registers before it listens, so once its port is
+    # open it is ready for clients
     if not wait_for_port(STORAGE_SERVER_HOST, STORAGE_SERVER_PORT, timeout=10):
         naming_server.terminate()
         storage_server.terminate()
@@ -170,6 +198,41 @@ def run_client_command(command: str, username: str = TEST_USER, expect_success:
     
     return False, f"Command failed after {MAX_RETRIES} attempts: {stdout} {stderr}"
 
+def run_batch(script: str, username: str = TEST_USER, timeout: float = 60.0) -> Tuple[bool, str]:
+    """Run script through `client --batch` as username and return (success, output).
+    
+    script holds one command per line, WRITE edit lines and ETIRW included,
+    exactly as typed in the client. Success means the client exited cleanly
+    and printed no ERROR.
+    """
+    result = subprocess.run(
+        [str(BIN_DIR / 'client'), '--batch'],
+        input=f"{username}\n{script.strip()}\nEXIT\n",
+        cwd=str(PROJECT_ROOT),
+        capture_output=True,
+        text=True,
+        timeout=timeout
+    )
+    output = result.stdout + result.stderr
+    return result.returncode == 0 and 'ERROR' not in output, output
+
+def batch_result(output: str, line: int) -> str:
+    """Output of the command on script line `line` in run_batch output.
+    
+    Line 1 is the username, so the script's first command is line 2.
+    """
+    lines = output.splitlines()
+    prefix = f"{line}: "
+    for i, text in enumerate(lines):
+        if text.startswith(prefix):
+            collected = [text.split(': ', 2)[2] if text.count(': ') >= 2 else '']
+            for rest in lines[i + 1:]:
+                if re.match(r'^\d+: |^Batch: ', rest):
+                    break
+                collected.append(rest)
+            return '\n'.join(collected).strip()
+    raise AssertionError(f"No output for batch line {line}:\n{output}")
+
 def cleanup_test_files():
     """Clean up test files and directories."""
     test_files = [
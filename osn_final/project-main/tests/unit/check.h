@@ -0,0 +1,37 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+// Assertions for the native unit tests (tests/unit/test_*.c, built by
+// `make unit`). A failed CHECK prints where and keeps going; check_done()
+// gives the exit status, so one run reports every failure.
+
+#include <stdio.h>
+
+static int check_failures = 0;
+static int check_count = 0;
+
+#define CHECK(cond) do { \
+    check_count++; \
+    if (!(cond)) { \
+        check_failures++; \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+// CHECK with a printf-style note for failures inside loops
+#define CHECKF(cond, ...) do { \
+    check_count++; \
+    if (!(cond)) { \
+        check_failures++; \
+        fprintf(stderr, "%s:%d: CHECK failed: %s: ", __FILE__, __LINE__, #cond); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+    } \
+} while (0)
+
+static inline int check_done(const char* name) {
+    printf("%s: %d checks, %d failed\n", name, check_count, check_failures);
+    return check_failures ? 1 : 0;
+}
+
+#endif // CHECK_H
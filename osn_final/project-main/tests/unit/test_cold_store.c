@@ -0,0 +1,258 @@
+#define _GNU_SOURCE  // nftw
+
+// Cold tier (cold_store.c)
+//
+// Freezing replaces a file and its history log with compressed copies that
+// read and thaw back byte for byte; small or incompressible files stay raw.
+// At start up a file found in both tiers keeps its raw copy, and a log
+// only left in the cold tier is restored.
+
+#include "../../include/cold_store.h"
+#include "../../include/sentence_index.h"
+#include "check.h"
+#include <ftw.h>
+
+static char scratch[] = "/tmp/test_cold_store_XXXXXX";
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static void write_file(const char* path, const char* data, size_t len) {
+    FILE* fp = fopen(path, "w");
+    CHECKF(fp != NULL, "cannot create %s", path);
+    if (fp) {
+        fwrite(data, 1, len, fp);
+        fclose(fp);
+    }
+}
+
+// Whole file, NUL-terminated; NULL if missing
+static char* read_whole(const char* path, size_t* len) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    char* buf = (char*)malloc(size + 1);
+    *len = fread(buf, 1, size, fp);
+    buf[*len] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+static int holds(const char* path, const char* data, size_t len) {
+    size_t got_len = 0;
+    char* got = read_whole(path, &got_len);
+    int same = got && got_len == len && memcmp(got, data, len) == 0;
+    free(got);
+    return same;
+}
+
+static int exists(const char* path) {
+    return access(path, F_OK) == 0;
+}
+
+// Sentences of prose, size bytes
+static char* make_text(size_t size) {
+    static const char* sentences[] = {"The file stays cold until someone reads it. ",
+                                      "Why would anyone read it again? ",
+                                      "Old notes come back now and then! "};
+    char* text = (char*)malloc(size + 1);
+    size_t pos = 0;
+    for (int i = 0; pos < size; i++) {
+        const char* s = sentences[i % 3];
+        size_t n = strlen(s);
+        if (n > size - pos) {
+            n = size - pos;
+        }
+        memcpy(text + pos, s, n);
+        pos += n;
+    }
+    text[size] = '\0';
+    return text;
+}
+
+static int count_sentences(const char* text, size_t len) {
+    SentenceIndex* idx = sentence_index_from_text(text, len);
+    int count = idx ? idx->count : -1;
+    free(idx);
+    return count;
+}
+
+static void test_freeze_thaw() {
+    size_t len = 200000;  // Several blocks
+    char* text = make_text(len);
+    const char log[] = "history records, not parsed by the cold tier";
+    write_file("data/files/notes.txt", text, len);
+    write_file("data/history/notes.txt.log", log, sizeof(log) - 1);
+
+    CHECK(!cold_contains("notes.txt"));
+    CHECK(cold_freeze("notes.txt") == 1);
+    CHECK(cold_contains("notes.txt"));
+    CHECK(!exists("data/files/notes.txt"));
+    CHECK(!exists("data/history/notes.txt.log"));
+    CHECK(exists("data/cold/files/notes.txt"));
+    CHECK(exists("data/cold/history/notes.txt.log"));
+
+    ColdStats stats;
+    cold_get_stats(&stats);
+    CHECK(stats.files == 1 && stats.freezes == 1);
+    CHECK(stats.raw_bytes == len + sizeof(log) - 1 && stats.stored_bytes < len / 2);
+
+    // Read and stat without thawing
+    size_t read_len = 0;
+    char* content = cold_read("notes.txt", &read_len);
+    CHECK(content && read_len == len && memcmp(content, text, len) == 0);
+    free(content);
+    uint64_t size = 0;
+    int sentences = -1;
+    CHECK(cold_stat("notes.txt", &size, &sentences) == 0);
+    CHECK(size == len);
+    CHECK(sentences == count_sentences(text, len));
+    CHECK(cold_contains("notes.txt"));
+
+    // Thaw restores both copies exactly
+    CHECK(cold_thaw("notes.txt") == 0);
+    CHECK(!cold_contains("notes.txt"));
+    CHECK(holds("data/files/notes.txt", text, len));
+    CHECK(holds("data/history/notes.txt.log", log, sizeof(log) - 1));
+    CHECK(!exists("data/cold/files/notes.txt"));
+    CHECK(!exists("data/cold/history/notes.txt.log"));
+    cold_get_stats(&stats);
+    CHECK(stats.files == 0 && stats.thaws == 1 && stats.raw_bytes == 0);
+
+    // Not frozen any more
+    CHECK(cold_read("notes.txt", &read_len) == NULL);
+    CHECK(cold_stat("notes.txt", &size, &sentences) == -1);
+    CHECK(cold_thaw("notes.txt") == 0);
+
+    // Folders are kept
+    write_file("data/files/dir/inner.txt", text, 10000);
+    CHECK(cold_freeze("dir/inner.txt") == 1);
+    CHECK(exists("data/cold/files/dir/inner.txt"));
+    CHECK(cold_thaw("dir/inner.txt") == 0);
+    CHECK(holds("data/files/dir/inner.txt", text, 10000));
+
+    free(text);
+}
+
+static void test_left_raw() {
+    // Too small
+    write_file("data/files/small.txt", "tiny. file.", 11);
+    CHECK(cold_freeze("small.txt") == 0);
+    CHECK(exists("data/files/small.txt") && !cold_contains("small.txt"));
+
+    // Does not shrink
+    size_t len = 50000;
+    char* noise = (char*)malloc(len);
+    unsigned int seed = 7;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245u + 12345u;
+        noise[i] = (char)(seed >> 16);
+    }
+    write_file("data/files/noise.bin", noise, len);
+    CHECK(cold_freeze("noise.bin") == 0);
+    CHECK(holds("data/files/noise.bin", noise, len));
+    CHECK(!exists("data/cold/files/noise.bin"));
+    ColdStats stats;
+    cold_get_stats(&stats);
+    CHECK(stats.incompressible == 1);
+    free(noise);
+
+    // Missing
+    CHECK(cold_freeze("missing.txt") == 0);
+}
+
+static void test_recovery() {
+    size_t len = 30000;
+    char* text = make_text(len);
+    const char log[] = "log of both.txt";
+
+    // Frozen, then a raw copy written back by a thaw that did not finish:
+    // the raw copy wins and the log comes back from the cold tier
+    write_file("data/files/both.txt", text, len);
+    write_file("data/history/both.txt.log", log, sizeof(log) - 1);
+    CHECK(cold_freeze("both.txt") == 1);
+    write_file("data/files/both.txt", "newer raw copy.", 15);
+
+    // Frozen and intact
+    write_file("data/files/kept.txt", text, len);
+    CHECK(cold_freeze("kept.txt") == 1);
+
+    // Leftover temporary file
+    write_file("data/cold/tmp/partial", "x", 1);
+
+    cold_init();
+    CHECK(!cold_contains("both.txt"));
+    CHECK(holds("data/files/both.txt", "newer raw copy.", 15));
+    CHECK(holds("data/history/both.txt.log", log, sizeof(log) - 1));
+    CHECK(!exists("data/cold/files/both.txt"));
+    CHECK(!exists("data/cold/history/both.txt.log"));
+
+    CHECK(cold_contains("kept.txt"));
+    size_t read_len = 0;
+    char* content = cold_read("kept.txt", &read_len);
+    CHECK(content && read_len == len && memcmp(content, text, len) == 0);
+    free(content);
+
+    CHECK(!exists("data/cold/tmp/partial"));
+    free(text);
+}
+
+static void test_version_one() {
+    // Containers from before the sentence count was recorded still stat,
+    // counting from the content
+    size_t len = 20000;
+    char* text = make_text(len);
+    write_file("data/files/v1.txt", text, len);
+    CHECK(cold_freeze("v1.txt") == 1);
+
+    FILE* fp = fopen("data/cold/files/v1.txt", "r+");
+    uint32_t header[6];
+    CHECK(fp && fread(header, sizeof(header), 1, fp) == 1);
+    header[1] = 1;  // version
+    header[5] = 0;  // no sentence count
+    if (fp) {
+        rewind(fp);
+        fwrite(header, sizeof(header), 1, fp);
+        fclose(fp);
+    }
+
+    uint64_t size = 0;
+    int sentences = -1;
+    CHECK(cold_stat("v1.txt", &size, &sentences) == 0);
+    CHECK(size == len && sentences == count_sentences(text, len));
+    CHECK(cold_thaw("v1.txt") == 0);
+    CHECK(holds("data/files/v1.txt", text, len));
+    free(text);
+}
+
+int main() {
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        perror(scratch);
+        return 1;
+    }
+    mkdir("data", 0755);
+    mkdir("data/files", 0755);
+    mkdir("data/files/dir", 0755);
+    mkdir("data/history", 0755);
+    mkdir("logs", 0755);
+    setenv("SS_COLD_MIN_BYTES", "1024", 1);
+    setenv("SS_COLD_AFTER_SEC", "0", 1);
+    cold_init();
+
+    test_freeze_thaw();
+    test_left_raw();
+    test_recovery();
+    test_version_one();
+
+    int status = check_done("test_cold_store");
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return status;
+}
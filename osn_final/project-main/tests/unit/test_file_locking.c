@@ -0,0 +1,174 @@
+// Per-file reader/writer locks (file_locking.c)
+//
+// Readers of one file share it, a writer has it alone, and locks on
+// different files never wait for each other. Waits are done with short
+// sleeps: a thread that should be blocked must still be blocked after
+// BLOCK_MS, and one that should not must finish well within it.
+
+#include "../../include/file_locking.h"
+#include "check.h"
+#include <sched.h>
+
+#define BLOCK_MS 100
+
+typedef struct {
+    const char* filename;
+    int write;
+    volatile int acquired;
+} LockTry;
+
+static void* take_and_release(void* arg) {
+    LockTry* t = (LockTry*)arg;
+    int rc = t->write ? file_write_lock(t->filename) : file_read_lock(t->filename);
+    t->acquired = rc == 0 ? 1 : -1;
+    if (rc == 0) {
+        file_unlock(t->filename);
+    }
+    return NULL;
+}
+
+// Starts a thread taking filename's lock; *done tells whether it was
+// done after BLOCK_MS
+static pthread_t try_lock(LockTry* t, const char* filename, int write, int* done) {
+    t->filename = filename;
+    t->write = write;
+    t->acquired = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, take_and_release, t);
+    usleep(BLOCK_MS * 1000);
+    *done = t->acquired != 0;
+    return thread;
+}
+
+static void test_readers_share() {
+    CHECK(file_read_lock("shared.txt") == 0);
+    LockTry t;
+    int done;
+    pthread_t thread = try_lock(&t, "shared.txt", 0, &done);
+    CHECK(done && t.acquired == 1);
+    pthread_join(thread, NULL);
+
+    // A writer waits for the reader
+    thread = try_lock(&t, "shared.txt", 1, &done);
+    CHECK(!done);
+    CHECK(file_unlock("shared.txt") == 0);
+    pthread_join(thread, NULL);
+    CHECK(t.acquired == 1);
+}
+
+static void test_writer_excludes() {
+    CHECK(file_write_lock("excl.txt") == 0);
+    CHECK(file_is_locked("excl.txt"));
+
+    LockTry reader, writer;
+    int reader_done, writer_done;
+    pthread_t r = try_lock(&reader, "excl.txt", 0, &reader_done);
+    pthread_t w = try_lock(&writer, "excl.txt", 1, &writer_done);
+    CHECK(!reader_done);
+    CHECK(!writer_done);
+
+    CHECK(file_unlock("excl.txt") == 0);
+    pthread_join(r, NULL);
+    pthread_join(w, NULL);
+    CHECK(reader.acquired == 1 && writer.acquired == 1);
+}
+
+static void test_files_independent() {
+    CHECK(file_write_lock("one.txt") == 0);
+    LockTry t;
+    int done;
+    pthread_t thread = try_lock(&t, "two.txt", 1, &done);
+    CHECK(done && t.acquired == 1);
+    pthread_join(thread, NULL);
+    CHECK(file_unlock("one.txt") == 0);
+}
+
+static void test_entries_released() {
+    CHECK(file_write_lock("gone.txt") == 0);
+    CHECK(file_unlock("gone.txt") == 0);
+    CHECK(!file_is_locked("gone.txt"));
+    // Nothing left to unlock
+    CHECK(file_unlock("gone.txt") == -1);
+    CHECK(file_read_lock("") == -1);
+    CHECK(file_write_lock(NULL) == -1);
+}
+
+static void test_contention_reported() {
+    CHECK(file_write_lock("hot.txt") == 0);
+    LockTry t;
+    int done;
+    pthread_t thread = try_lock(&t, "hot.txt", 1, &done);
+    CHECK(!done);
+    CHECK(file_unlock("hot.txt") == 0);
+    pthread_join(thread, NULL);
+
+    FileLockContention top[4];
+    int count = file_lock_top_contended(top, 4);
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(top[i].filename, "hot.txt") == 0) {
+            found = 1;
+            CHECK(top[i].contended_writes >= 1);
+            CHECK(top[i].wait_us_total >= (BLOCK_MS / 2) * 1000ULL);
+        }
+    }
+    CHECK(found);
+}
+
+// Writers on a few files from many threads: every increment survives
+#define STRESS_THREADS 8
+#define STRESS_FILES 3
+#define STRESS_ROUNDS 2000
+
+static long stress_counts[STRESS_FILES];
+
+static void* stress_writer(void* arg) {
+    int id = (int)(long)arg;
+    char name[32];
+    for (int i = 0; i < STRESS_ROUNDS; i++) {
+        int file = (id + i) % STRESS_FILES;
+        snprintf(name, sizeof(name), "stress%d.txt", file);
+        if (file_write_lock(name) == 0) {
+            long seen = stress_counts[file];
+            if (i % 64 == 0) {
+                sched_yield();
+            }
+            stress_counts[file] = seen + 1;
+            file_unlock(name);
+        }
+    }
+    return NULL;
+}
+
+static void test_stress() {
+    pthread_t threads[STRESS_THREADS];
+    for (long i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress_writer, (void*)i);
+    }
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    long total = 0;
+    char name[32];
+    for (int i = 0; i < STRESS_FILES; i++) {
+        total += stress_counts[i];
+        snprintf(name, sizeof(name), "stress%d.txt", i);
+        CHECK(!file_is_locked(name));
+    }
+    CHECK(total == (long)STRESS_THREADS * STRESS_ROUNDS);
+}
+
+int main() {
+    file_locking_init();
+
+    test_readers_share();
+    test_writer_excludes();
+    test_files_independent();
+    test_entries_released();
+    test_contention_reported();
+    test_stress();
+
+    file_locking_cleanup();
+    return check_done("test_file_locking");
+}
@@ -0,0 +1,269 @@
+// Segmented, incrementally resized HashMap (hashmap.c)
+//
+// Every key stays findable while segments grow and drain their old bucket
+// arrays a few buckets per write, and each node is always in the bucket
+// its hash names: in the old array until that bucket has moved, in the
+// current one after.
+
+#include "../../include/hashmap.h"
+#include "check.h"
+
+static int freed = 0;
+
+static void count_free(void* value) {
+    (void)value;
+    __atomic_fetch_add(&freed, 1, __ATOMIC_RELAXED);
+}
+
+static void* value_of(int i) {
+    return (void*)(intptr_t)(i + 1);
+}
+
+static void key_of(int i, char* key, size_t len) {
+    snprintf(key, len, "folder%d/file_%d.txt", i % 97, i);
+}
+
+// Structure of every segment; 1 if consistent
+static int map_consistent(HashMap* map) {
+    int total = 0;
+    for (int s = 0; s < HASHMAP_SEGMENTS; s++) {
+        HashSegment* seg = &map->segments[s];
+        int count = 0;
+        for (unsigned int b = 0; b <= seg->mask; b++) {
+            for (HashNode* n = seg->buckets[b]; n; n = n->next) {
+                if ((n->hash & seg->mask) != b || n->hash >> (32 - HASHMAP_SEGMENT_BITS) != (unsigned)s) {
+                    return 0;
+                }
+                count++;
+            }
+        }
+        if (seg->old) {
+            for (unsigned int b = 0; b <= seg->old_mask; b++) {
+                if (b < seg->migrated && seg->old[b]) {
+                    return 0;  // Moved buckets are empty
+                }
+                for (HashNode* n = seg->old[b]; n; n = n->next) {
+                    if ((n->hash & seg->old_mask) != b) {
+                        return 0;
+                    }
+                    count++;
+                }
+            }
+        }
+        if (count != seg->count) {
+            return 0;
+        }
+        total += count;
+    }
+    return total == atomic_load(&map->size);
+}
+
+static int resizing(HashMap* map) {
+    int n = 0;
+    for (int s = 0; s < HASHMAP_SEGMENTS; s++) {
+        n += map->segments[s].old != NULL;
+    }
+    return n;
+}
+
+static void test_basic() {
+    freed = 0;
+    HashMap* map = hashmap_create_with(count_free);
+    CHECK(map != NULL);
+    CHECK(hashmap_get(map, "missing") == NULL);
+
+    hashmap_put(map, "a", value_of(1));
+    hashmap_put(map, "b", value_of(2));
+    CHECK(hashmap_get(map, "a") == value_of(1));
+    CHECK(hashmap_contains(map, "b"));
+    CHECK(atomic_load(&map->size) == 2);
+
+    // Replacing releases the old value and keeps the size
+    hashmap_put(map, "a", value_of(3));
+    CHECK(hashmap_get(map, "a") == value_of(3));
+    CHECK(freed == 1);
+    CHECK(atomic_load(&map->size) == 2);
+
+    // Detach hands the value back; remove releases it
+    CHECK(hashmap_detach(map, "a") == value_of(3));
+    CHECK(freed == 1);
+    hashmap_remove(map, "b");
+    CHECK(freed == 2);
+    CHECK(!hashmap_contains(map, "a") && !hashmap_contains(map, "b"));
+    CHECK(atomic_load(&map->size) == 0);
+    hashmap_remove(map, "b");
+    CHECK(hashmap_detach(map, "b") == NULL);
+
+    // Keys longer than the pooled node size, up to the file name limit
+    char long_key[MAX_FILENAME];
+    memset(long_key, 'k', sizeof(long_key) - 1);
+    long_key[sizeof(long_key) - 1] = '\0';
+    hashmap_put(map, long_key, value_of(4));
+    long_key[100] = '\0';
+    hashmap_put(map, long_key, value_of(5));
+    CHECK(hashmap_get(map, long_key) == value_of(5));
+    long_key[100] = 'k';
+    CHECK(hashmap_get(map, long_key) == value_of(4));
+
+    hashmap_destroy(map);
+    CHECK(freed == 4);
+}
+
+// Grow from empty: lookups of every key so far keep working mid-resize
+static void test_rehash_during_growth() {
+    HashMap* map = hashmap_create_with(count_free);
+    int n = 50000;
+    char key[64];
+    int saw_resize = 0;
+    int all_found = 1;
+    int consistent = 1;
+
+    for (int i = 0; i < n; i++) {
+        key_of(i, key, sizeof(key));
+        hashmap_put(map, key, value_of(i));
+        if (resizing(map)) {
+            saw_resize = 1;
+        }
+        if (i % 997 == 0) {
+            consistent &= map_consistent(map);
+            for (int j = 0; j <= i; j += 7) {
+                key_of(j, key, sizeof(key));
+                all_found &= hashmap_get(map, key) == value_of(j);
+            }
+        }
+    }
+    CHECK(saw_resize);
+    CHECK(consistent);
+    CHECK(all_found);
+    CHECK(atomic_load(&map->size) == n);
+
+    // Segments grew well past their initial size
+    int grown = 1;
+    for (int s = 0; s < HASHMAP_SEGMENTS; s++) {
+        grown &= map->segments[s].mask + 1 > 16;
+    }
+    CHECK(grown);
+
+    // Removing while old arrays still drain
+    freed = 0;
+    for (int i = 0; i < n; i += 2) {
+        key_of(i, key, sizeof(key));
+        hashmap_remove(map, key);
+    }
+    CHECK(freed == n / 2);
+    CHECK(map_consistent(map));
+    int right = 1;
+    for (int i = 0; i < n; i++) {
+        key_of(i, key, sizeof(key));
+        right &= hashmap_get(map, key) == (i % 2 ? value_of(i) : NULL);
+    }
+    CHECK(right);
+
+    // get_keys lists each remaining entry once
+    char (*keys)[MAX_FILENAME] = malloc((size_t)n * MAX_FILENAME);
+    int count = 0;
+    hashmap_get_keys(map, keys, &count);
+    CHECK(count == n / 2);
+    HashMap* seen = hashmap_create_with(count_free);
+    for (int i = 0; i < count; i++) {
+        hashmap_put(seen, keys[i], value_of(i));
+    }
+    CHECK(atomic_load(&seen->size) == n / 2);
+    hashmap_destroy(seen);
+    free(keys);
+
+    freed = 0;
+    hashmap_destroy(map);
+    CHECK(freed == n / 2);
+}
+
+static void count_entry(const char* key, void* value, void* ctx) {
+    (void)key;
+    (void)value;
+    (*(int*)ctx)++;
+}
+
+static void test_reserve() {
+    HashMap* map = hashmap_create_with(count_free);
+    int n = 20000;
+    hashmap_reserve(map, n);
+    CHECK(resizing(map) == 0);
+
+    char key[64];
+    int never_resized = 1;
+    for (int i = 0; i < n; i++) {
+        key_of(i, key, sizeof(key));
+        hashmap_put(map, key, value_of(i));
+        never_resized &= resizing(map) == 0;
+    }
+    CHECK(never_resized);
+    CHECK(map_consistent(map));
+
+    int entries = 0;
+    hashmap_foreach(map, count_entry, &entries);
+    CHECK(entries == n);
+    hashmap_destroy(map);
+}
+
+// Writers and readers on one map from several threads
+#define THREADS 8
+#define PER_THREAD 20000
+
+static HashMap* shared;
+static int lost[THREADS];
+
+static void* worker(void* arg) {
+    int id = (int)(long)arg;
+    char key[64];
+    for (int i = 0; i < PER_THREAD; i++) {
+        int k = id * PER_THREAD + i;
+        key_of(k, key, sizeof(key));
+        hashmap_put(shared, key, value_of(k));
+        // Own keys written so far stay visible as other threads grow it
+        if (i % 50 == 0) {
+            for (int j = 0; j <= i; j += 211) {
+                key_of(id * PER_THREAD + j, key, sizeof(key));
+                if (hashmap_get(shared, key) != value_of(id * PER_THREAD + j)) {
+                    lost[id]++;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static void test_concurrent() {
+    shared = hashmap_create_with(count_free);
+    pthread_t threads[THREADS];
+    for (long i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void*)i);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int lost_total = 0;
+    for (int i = 0; i < THREADS; i++) {
+        lost_total += lost[i];
+    }
+    CHECK(lost_total == 0);
+    CHECK(atomic_load(&shared->size) == THREADS * PER_THREAD);
+    CHECK(map_consistent(shared));
+
+    int all = 1;
+    char key[64];
+    for (int k = 0; k < THREADS * PER_THREAD; k++) {
+        key_of(k, key, sizeof(key));
+        all &= hashmap_get(shared, key) == value_of(k);
+    }
+    CHECK(all);
+    hashmap_destroy(shared);
+}
+
+int main() {
+    test_basic();
+    test_rehash_during_growth();
+    test_reserve();
+    test_concurrent();
+    return check_done("test_hashmap");
+}
@@ -0,0 +1,230 @@
+// Name Server registry journal (journal.c)
+//
+// Records come back from replay in append order, across reopens and
+// rotations; a torn or corrupted tail is cut off at the last intact record
+// and appends continue after it.
+
+#include "../../include/journal.h"
+#include "check.h"
+#include <fcntl.h>
+
+static char scratch[] = "/tmp/test_journal_XXXXXX";
+static char path[MAX_PATH];
+static char old_path[MAX_PATH];
+
+typedef struct {
+    char records[8192][32];
+    int count;
+} Replayed;
+
+static Replayed replayed;
+
+static void collect(const char* record, void* ctx) {
+    Replayed* r = (Replayed*)ctx;
+    if (r->count < 8192) {
+        snprintf(r->records[r->count], sizeof(r->records[0]), "%s", record);
+    }
+    r->count++;
+}
+
+static int replay(const char* file) {
+    replayed.count = 0;
+    return journal_replay(file, collect, &replayed);
+}
+
+// Records first..last, named "rec <n>"
+static void append_range(Journal* journal, int first, int last) {
+    char record[32];
+    unsigned long long seq = 0;
+    for (int i = first; i <= last; i++) {
+        snprintf(record, sizeof(record), "rec %d", i);
+        seq = journal_append(journal, record);
+    }
+    CHECK(journal_wait(journal, seq) == 0);
+}
+
+static int holds_range(int first, int last) {
+    if (replayed.count != last - first + 1) {
+        return 0;
+    }
+    char expected[32];
+    for (int i = first; i <= last; i++) {
+        snprintf(expected, sizeof(expected), "rec %d", i);
+        if (strcmp(replayed.records[i - first], expected) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void append_raw(const char* text) {
+    int fd = open(path, O_WRONLY | O_APPEND);
+    CHECK(fd >= 0 && write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void test_missing_file() {
+    CHECK(replay(path) == 0);
+}
+
+static void test_replay_in_order() {
+    Journal* journal = journal_open(path, 1, collect, &replayed);
+    CHECK(journal != NULL);
+    append_range(journal, 0, 99);
+    CHECK(journal_records(journal) == 100);
+    journal_close(journal);
+
+    CHECK(replay(path) == 100);
+    CHECK(holds_range(0, 99));
+}
+
+static void test_reopen_appends() {
+    replayed.count = 0;
+    Journal* journal = journal_open(path, 0, collect, &replayed);
+    CHECK(journal != NULL);
+    // Opening replays what is there
+    CHECK(holds_range(0, 99));
+    append_range(journal, 100, 149);
+    CHECK(journal_records(journal) == 150);
+    journal_close(journal);
+
+    CHECK(replay(path) == 150);
+    CHECK(holds_range(0, 149));
+}
+
+static void test_torn_tail() {
+    // A crash in the middle of a write leaves a line without its newline
+    append_raw("1234abcd rec 150 cut off");
+    CHECK(replay(path) == 150);
+
+    // Opening cuts it off, so new records follow the last intact one
+    replayed.count = 0;
+    Journal* journal = journal_open(path, 1, collect, &replayed);
+    CHECK(journal != NULL);
+    CHECK(journal_records(journal) == 150);
+    append_range(journal, 150, 159);
+    journal_close(journal);
+
+    CHECK(replay(path) == 160);
+    CHECK(holds_range(0, 159));
+}
+
+// The journal line for record, as journal_append writes it
+static void journal_line(const char* record, char* line, size_t len) {
+    Journal* journal = journal_open(old_path, 0, collect, &replayed);
+    CHECK(journal != NULL);
+    CHECK(journal_wait(journal, journal_append(journal, record)) == 0);
+    journal_close(journal);
+
+    FILE* fp = fopen(old_path, "r");
+    line[0] = '\0';
+    if (fp) {
+        CHECK(fgets(line, len, fp) != NULL);
+        fclose(fp);
+    }
+    unlink(old_path);
+}
+
+static void test_bad_checksum() {
+    // A complete line whose checksum does not match ends the replay there,
+    // even with intact records after it
+    char intact[64];
+    journal_line("rec 999", intact, sizeof(intact));
+    CHECK(strstr(intact, " rec 999\n") != NULL);
+    append_raw("00000000 rec 160\n");
+    append_raw(intact);
+    CHECK(replay(path) == 160);
+
+    Journal* journal = journal_open(path, 1, collect, &replayed);
+    CHECK(journal != NULL);
+    append_range(journal, 160, 160);
+    journal_close(journal);
+    CHECK(replay(path) == 161);
+    CHECK(holds_range(0, 160));
+}
+
+static void test_rotate() {
+    replayed.count = 0;
+    Journal* journal = journal_open(path, 1, collect, &replayed);
+    CHECK(journal != NULL);
+    append_range(journal, 161, 170);
+    CHECK(journal_rotate(journal, old_path) == 0);
+    CHECK(journal_records(journal) == 0);
+    append_range(journal, 171, 175);
+    journal_close(journal);
+
+    CHECK(replay(old_path) == 171);
+    CHECK(holds_range(0, 170));
+    CHECK(replay(path) == 5);
+    CHECK(holds_range(171, 175));
+    unlink(old_path);
+}
+
+// Group commit from many threads: every record is kept, each thread's in
+// the order it appended them
+#define GROUP_THREADS 8
+#define GROUP_RECORDS 500
+
+static Journal* group_journal;
+
+static void* group_writer(void* arg) {
+    int id = (int)(long)arg;
+    char record[32];
+    for (int i = 0; i < GROUP_RECORDS; i++) {
+        snprintf(record, sizeof(record), "t%d %d", id, i);
+        if (journal_wait(group_journal, journal_append(group_journal, record)) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void test_group_commit() {
+    unlink(path);
+    group_journal = journal_open(path, 1, collect, &replayed);
+    CHECK(group_journal != NULL);
+
+    pthread_t threads[GROUP_THREADS];
+    for (long i = 0; i < GROUP_THREADS; i++) {
+        pthread_create(&threads[i], NULL, group_writer, (void*)i);
+    }
+    for (int i = 0; i < GROUP_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    journal_close(group_journal);
+
+    CHECK(replay(path) == GROUP_THREADS * GROUP_RECORDS);
+    int next[GROUP_THREADS] = {0};
+    int in_order = 1;
+    for (int i = 0; i < replayed.count && i < 8192; i++) {
+        int id, n;
+        if (sscanf(replayed.records[i], "t%d %d", &id, &n) != 2 || id < 0 ||
+            id >= GROUP_THREADS || n != next[id]++) {
+            in_order = 0;
+        }
+    }
+    CHECK(in_order);
+}
+
+int main() {
+    if (!mkdtemp(scratch)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/registry.journal", scratch);
+    snprintf(old_path, sizeof(old_path), "%s/registry.journal.old", scratch);
+
+    test_missing_file();
+    test_replay_in_order();
+    test_reopen_appends();
+    test_torn_tail();
+    test_bad_checksum();
+    test_rotate();
+    test_group_commit();
+
+    unlink(path);
+    rmdir(scratch);
+    return check_done("test_journal");
+}
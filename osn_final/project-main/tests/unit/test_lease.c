@@ -0,0 +1,180 @@
+// Signed write leases (lease.c)
+//
+// SipHash-2-4 against the reference vectors (key 00..0f, message
+// 00..len-1), and lease checks: a lease is valid only for the file, user,
+// range and expiry it was signed with, under the same LEASE_KEY, and there
+// is no key without LEASE_KEY. Signed peer requests follow the same rules.
+
+#include "../../include/lease.h"
+#include "check.h"
+
+static void test_siphash_vectors() {
+    static const struct {
+        size_t len;
+        uint64_t hash;
+    } vectors[] = {
+        {0, 0x726fdb47dd0e0e31ULL},
+        {1, 0x74f839c593dc67fdULL},
+        {7, 0xab0200f58b01d137ULL},
+        {8, 0x93f5f5799a932462ULL},
+        {15, 0xa129ca6149be45e5ULL},
+        {63, 0x958a324ceb064572ULL},
+    };
+    uint8_t key[16];
+    uint8_t message[64];
+    for (int i = 0; i < 16; i++) {
+        key[i] = (uint8_t)i;
+    }
+    for (int i = 0; i < 64; i++) {
+        message[i] = (uint8_t)i;
+    }
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        CHECKF(siphash24(key, message, vectors[i].len) == vectors[i].hash, "length %zu",
+               vectors[i].len);
+    }
+}
+
+static WriteLease signed_lease(const char* filename, const char* username) {
+    WriteLease lease;
+    lease.id = 42;
+    lease.first = 3;
+    lease.last = 7;
+    lease.expires_ms = lease_now_ms() + 60000;
+    lease_sign(&lease, filename, username);
+    return lease;
+}
+
+static void test_valid_only_as_signed() {
+    WriteLease lease = signed_lease("notes.txt", "alice");
+    CHECK(lease_valid(&lease, "notes.txt", "alice"));
+
+    // Someone else, or another file
+    CHECK(!lease_valid(&lease, "notes.txt", "bob"));
+    CHECK(!lease_valid(&lease, "other.txt", "alice"));
+    // The name/user split is part of what is signed
+    WriteLease split = signed_lease("ab", "c");
+    CHECK(!lease_valid(&split, "a", "bc"));
+
+    // Every field is covered by the signature
+    WriteLease tampered = lease;
+    tampered.id++;
+    CHECK(!lease_valid(&tampered, "notes.txt", "alice"));
+    tampered = lease;
+    tampered.first = 0;
+    CHECK(!lease_valid(&tampered, "notes.txt", "alice"));
+    tampered = lease;
+    tampered.last = 31;
+    CHECK(!lease_valid(&tampered, "notes.txt", "alice"));
+    tampered = lease;
+    tampered.expires_ms += 3600 * 1000;
+    CHECK(!lease_valid(&tampered, "notes.txt", "alice"));
+    tampered = lease;
+    tampered.mac ^= 1;
+    CHECK(!lease_valid(&tampered, "notes.txt", "alice"));
+}
+
+static void test_expiry() {
+    WriteLease lease = signed_lease("notes.txt", "alice");
+    lease.expires_ms = lease_now_ms() - 1;
+    lease_sign(&lease, "notes.txt", "alice");
+    CHECK(!lease_valid(&lease, "notes.txt", "alice"));
+
+    lease.expires_ms = lease_now_ms() + 200;
+    lease_sign(&lease, "notes.txt", "alice");
+    CHECK(lease_valid(&lease, "notes.txt", "alice"));
+    usleep(300 * 1000);
+    CHECK(!lease_valid(&lease, "notes.txt", "alice"));
+}
+
+static void test_format_parse() {
+    WriteLease lease = signed_lease("notes.txt", "alice");
+    char text[128];
+    int len = lease_format(&lease, text, sizeof(text));
+    CHECK(len > 0 && strncmp(text, LEASE_PREFIX, strlen(LEASE_PREFIX)) == 0);
+
+    // Parsing stops at the lease, so edits can follow it in one message
+    char message[256];
+    snprintf(message, sizeof(message), "%s\n0|1|word|", text);
+    WriteLease parsed;
+    CHECK(lease_parse(message, &parsed) == len);
+    CHECK(parsed.id == lease.id && parsed.first == lease.first && parsed.last == lease.last &&
+          parsed.expires_ms == lease.expires_ms && parsed.mac == lease.mac);
+    CHECK(lease_valid(&parsed, "notes.txt", "alice"));
+
+    CHECK(lease_parse("0|1|word|", &parsed) == -1);
+    CHECK(lease_parse(LEASE_PREFIX "1|2|3", &parsed) == -1);
+    CHECK(lease_parse(LEASE_PREFIX "x|2|3|4|5", &parsed) == -1);
+}
+
+static void test_peer_requests() {
+    char request[PEER_AUTH_LEN + 32];
+    const char* payload = "copy|10.0.0.2|7001";
+    size_t len = strlen(payload);
+    memcpy(request + PEER_AUTH_LEN, payload, len + 1);
+    peer_sign(CMD_MIGRATE, "notes.txt", request + PEER_AUTH_LEN, len, request);
+    CHECK(strncmp(request, PEER_PREFIX, strlen(PEER_PREFIX)) == 0);
+    CHECK(request[PEER_AUTH_LEN - 1] == '\n');
+    CHECK(peer_valid(CMD_MIGRATE, "notes.txt", request, PEER_AUTH_LEN + len));
+
+    // Bound to the command, the file and every byte of the payload
+    CHECK(!peer_valid(CMD_REPLICATE, "notes.txt", request, PEER_AUTH_LEN + len));
+    CHECK(!peer_valid(CMD_MIGRATE, "other.txt", request, PEER_AUTH_LEN + len));
+    CHECK(!peer_valid(CMD_MIGRATE, "notes.txt", request, PEER_AUTH_LEN + len - 1));
+    request[PEER_AUTH_LEN + 5] = '9';
+    CHECK(!peer_valid(CMD_MIGRATE, "notes.txt", request, PEER_AUTH_LEN + len));
+
+    // Unsigned or truncated requests
+    CHECK(!peer_valid(CMD_MIGRATE, "notes.txt", payload, len));
+    CHECK(!peer_valid(CMD_MIGRATE, "notes.txt", request, PEER_AUTH_LEN - 1));
+
+    // Expired: re-sign with a past expiry by hand
+    char expired[PEER_AUTH_LEN + 32];
+    memcpy(expired + PEER_AUTH_LEN, payload, len + 1);
+    peer_sign(CMD_MIGRATE, "notes.txt", expired + PEER_AUTH_LEN, len, expired);
+    memcpy(expired + strlen(PEER_PREFIX), "0000000000001", 13);
+    CHECK(!peer_valid(CMD_MIGRATE, "notes.txt", expired, PEER_AUTH_LEN + len));
+
+    // Another key
+    peer_sign(CMD_MIGRATE, "notes.txt", expired + PEER_AUTH_LEN, len, expired);
+    setenv("LEASE_KEY", "other key", 1);
+    lease_init("TEST");
+    CHECK(!peer_valid(CMD_MIGRATE, "notes.txt", expired, PEER_AUTH_LEN + len));
+    setenv("LEASE_KEY", "test key", 1);
+    lease_init("TEST");
+    CHECK(peer_valid(CMD_MIGRATE, "notes.txt", expired, PEER_AUTH_LEN + len));
+}
+
+static void test_key() {
+    setenv("LEASE_KEY", "first secret", 1);
+    CHECK(lease_init("TEST") == 0);
+    WriteLease lease = signed_lease("notes.txt", "alice");
+    CHECK(lease_valid(&lease, "notes.txt", "alice"));
+
+    // A server with another key rejects it
+    setenv("LEASE_KEY", "second secret", 1);
+    lease_init("TEST");
+    CHECK(!lease_valid(&lease, "notes.txt", "alice"));
+
+    setenv("LEASE_KEY", "first secret", 1);
+    lease_init("TEST");
+    CHECK(lease_valid(&lease, "notes.txt", "alice"));
+
+    // There is no built-in key to fall back to
+    unsetenv("LEASE_KEY");
+    CHECK(lease_init("TEST") < 0);
+    setenv("LEASE_KEY", "", 1);
+    CHECK(lease_init("TEST") < 0);
+}
+
+int main() {
+    setenv("LEASE_KEY", "test key", 1);
+    lease_init("TEST");
+
+    test_siphash_vectors();
+    test_valid_only_as_signed();
+    test_expiry();
+    test_format_parse();
+    test_peer_requests();
+    test_key();
+    return check_done("test_lease");
+}
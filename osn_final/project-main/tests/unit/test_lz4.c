@@ -0,0 +1,187 @@
+// LZ4 block codec (lz4.c)
+//
+// Round trips over text, repetitive, random and edge-sized inputs, and
+// rejection of blocks that are truncated, corrupt or do not fit: the
+// decoder must fail rather than read or write out of bounds.
+
+#include "../../include/lz4.h"
+#include "check.h"
+
+#define BLOCK (64 * 1024)
+#define GUARD 64
+
+static unsigned int rng = 12345;
+
+static unsigned int next_random() {
+    rng = rng * 1103515245u + 12345u;
+    return rng >> 8;
+}
+
+static void fill_text(char* buf, size_t len) {
+    static const char* words[] = {"the", "storage", "server", "keeps", "every", "sentence.",
+                                  "files", "move", "between", "tiers!", "why?", "cold"};
+    size_t pos = 0;
+    while (pos < len) {
+        const char* word = words[next_random() % 12];
+        for (const char* w = word; *w && pos < len; w++) {
+            buf[pos++] = *w;
+        }
+        if (pos < len) {
+            buf[pos++] = ' ';
+        }
+    }
+}
+
+static void fill_random(char* buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (char)(next_random() & 0xff);
+    }
+}
+
+// Compress and decompress src; the compressed length, 0 on failure
+static size_t round_trip(const char* src, size_t len, const char* what) {
+    size_t bound = lz4_compress_bound(len);
+    char* packed = (char*)malloc(bound);
+    char* out = (char*)malloc(len + GUARD);
+    memset(out, 0x5a, len + GUARD);
+
+    size_t packed_len = lz4_compress(src, len, packed, bound);
+    CHECKF(packed_len > 0 && packed_len <= bound, "%s: %zu bytes packed to %zu", what, len,
+           packed_len);
+    long got = lz4_decompress(packed, packed_len, out, len);
+    CHECKF(got == (long)len && memcmp(out, src, len) == 0, "%s: %zu bytes came back as %ld", what,
+           len, got);
+
+    // Nothing past cap is touched
+    int guard_ok = 1;
+    for (int i = 0; i < GUARD; i++) {
+        guard_ok = guard_ok && out[len + i] == 0x5a;
+    }
+    CHECKF(guard_ok, "%s: wrote past the output", what);
+
+    free(packed);
+    free(out);
+    return got == (long)len ? packed_len : 0;
+}
+
+static void test_round_trips() {
+    char* buf = (char*)malloc(BLOCK);
+
+    fill_text(buf, BLOCK);
+    size_t packed = round_trip(buf, BLOCK, "text");
+    CHECKF(packed < BLOCK / 2, "text packed to %zu", packed);
+
+    memset(buf, 'a', BLOCK);
+    packed = round_trip(buf, BLOCK, "one byte repeated");
+    CHECKF(packed < BLOCK / 100, "repeated byte packed to %zu", packed);
+
+    for (int i = 0; i < BLOCK; i++) {
+        buf[i] = "abcdefg"[i % 7];
+    }
+    round_trip(buf, BLOCK, "short period");
+
+    fill_random(buf, BLOCK);
+    packed = round_trip(buf, BLOCK, "random");
+    CHECKF(packed >= BLOCK, "random data shrank to %zu", packed);
+
+    // Sizes around the minimum match and the end-of-block limits
+    static const size_t sizes[] = {0, 1, 4, 5, 11, 12, 13, 16, 255, 256, 270, 4096, BLOCK - 1};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        fill_text(buf, sizes[i]);
+        round_trip(buf, sizes[i], "text of edge size");
+        memset(buf, 'x', sizes[i]);
+        round_trip(buf, sizes[i], "run of edge size");
+    }
+
+    // Matches up to the largest offset
+    fill_random(buf, BLOCK);
+    memcpy(buf + BLOCK - 1000, buf, 900);
+    round_trip(buf, BLOCK, "far match");
+
+    free(buf);
+}
+
+static void test_compress_cap() {
+    char src[4096], dst[4096];
+    fill_random(src, sizeof(src));
+    CHECK(lz4_compress(src, sizeof(src), dst, 100) == 0);
+    CHECK(lz4_compress(src, 10, dst, 5) == 0);
+}
+
+static void test_truncated() {
+    char src[8192];
+    fill_text(src, sizeof(src));
+    size_t bound = lz4_compress_bound(sizeof(src));
+    char* packed = (char*)malloc(bound);
+    char* out = (char*)malloc(sizeof(src));
+    size_t packed_len = lz4_compress(src, sizeof(src), packed, bound);
+
+    // Every prefix either fails or decodes to less than the original
+    size_t decoded_in_full = 0;
+    for (size_t cut = 0; cut < packed_len; cut++) {
+        if (lz4_decompress(packed, cut, out, sizeof(src)) == (long)sizeof(src)) {
+            decoded_in_full++;
+        }
+    }
+    CHECKF(decoded_in_full == 0, "%zu prefixes of %zu bytes decoded in full", decoded_in_full,
+           packed_len);
+    CHECK(lz4_decompress(packed, 0, out, sizeof(src)) == -1);
+
+    // Output one byte short
+    CHECK(lz4_decompress(packed, packed_len, out, sizeof(src) - 1) == -1);
+
+    free(packed);
+    free(out);
+}
+
+static void test_corrupt() {
+    char out[256];
+
+    // Match before the start of the output, and offset 0
+    const char before_start[] = {0x40, 'a', 'b', 'c', 'd', 0x10, 0x00, 0x50, 'v', 'w', 'x', 'y', 'z'};
+    CHECK(lz4_decompress(before_start, sizeof(before_start), out, sizeof(out)) == -1);
+    const char zero_offset[] = {0x40, 'a', 'b', 'c', 'd', 0x00, 0x00, 0x50, 'v', 'w', 'x', 'y', 'z'};
+    CHECK(lz4_decompress(zero_offset, sizeof(zero_offset), out, sizeof(out)) == -1);
+
+    // The same block with a valid offset decodes
+    const char valid[] = {0x40, 'a', 'b', 'c', 'd', 0x04, 0x00, 0x50, 'v', 'w', 'x', 'y', 'z'};
+    CHECK(lz4_decompress(valid, sizeof(valid), out, sizeof(out)) == 13);
+    CHECK(memcmp(out, "abcdabcdvwxyz", 13) == 0);
+
+    // Literal length past the end of the block, and an unfinished length
+    const char long_literals[] = {0x50, 'a', 'b'};
+    CHECK(lz4_decompress(long_literals, sizeof(long_literals), out, sizeof(out)) == -1);
+    const char open_length[] = {(char)0xf0, (char)0xff, (char)0xff};
+    CHECK(lz4_decompress(open_length, sizeof(open_length), out, sizeof(out)) == -1);
+
+    // Match longer than the output
+    const char long_match[] = {0x1f, 'a', 0x01, 0x00, (char)0xff, 0x10, 0x00};
+    CHECK(lz4_decompress(long_match, sizeof(long_match), out, sizeof(out)) == -1);
+
+    // Random garbage never decodes past cap
+    char garbage[512];
+    char big[1024 + GUARD];
+    int overruns = 0;
+    memset(big + 1024, 0x5a, GUARD);
+    for (int round = 0; round < 2000; round++) {
+        fill_random(garbage, sizeof(garbage));
+        long got = lz4_decompress(garbage, 1 + next_random() % sizeof(garbage), big, 1024);
+        for (int i = 0; i < GUARD; i++) {
+            if (big[1024 + i] != 0x5a) {
+                overruns++;
+                memset(big + 1024, 0x5a, GUARD);
+                break;
+            }
+        }
+        overruns += got > 1024;
+    }
+    CHECKF(overruns == 0, "%d garbage blocks decoded past cap", overruns);
+}
+
+int main() {
+    test_round_trips();
+    test_compress_cap();
+    test_truncated();
+    test_corrupt();
+    return check_done("test_lz4");
+}
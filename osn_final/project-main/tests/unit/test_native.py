@@ -0,0 +1,23 @@
+"""Runs the native unit tests (tests/unit/test_*.c, built by `make unit`).
+
+Each C program checks one module directly, without servers; a failure
+prints the failing CHECK and its location.
+"""
+import subprocess
+
+import pytest
+
+from test_utils import PROJECT_ROOT, BIN_DIR
+
+NATIVE_TESTS = sorted(p.stem for p in (PROJECT_ROOT / 'tests' / 'unit').glob('test_*.c'))
+
+
+@pytest.mark.parametrize("name", NATIVE_TESTS)
+def test_native(name: str):
+    binary = BIN_DIR / name
+    if not binary.exists():
+        pytest.skip(f"bin/{name} not built (make unit)")
+    result = subprocess.run([str(binary)], cwd=str(PROJECT_ROOT), capture_output=True,
+                            text=True, timeout=300)
+    print(result.stdout)
+    assert result.returncode == 0, f"{name} failed:\n{result.stdout}{result.stderr}"
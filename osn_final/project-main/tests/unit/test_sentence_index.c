@@ -0,0 +1,182 @@
+// Sentence splice writer (sentence_index_splice)
+//
+// Each case writes a text to a scratch file, indexes it, replaces one
+// sentence (or appends), and checks the spliced index against indexing the
+// resulting text from scratch, which is what the storage server would get
+// if it re-tokenized the whole file after the write.
+
+#include "../../include/sentence_index.h"
+#include "check.h"
+#include <fcntl.h>
+
+static char scratch[] = "/tmp/test_sentence_index_XXXXXX";
+
+// The file the storage server writes: old prefix, separator, new bytes,
+// old suffix
+static char* spliced_text(const char* old, const SentenceSplice* splice,
+                          const char* text, size_t* len) {
+    size_t old_len = strlen(old);
+    size_t text_len = strlen(text);
+    char* out = (char*)malloc(old_len + text_len + 2);
+    size_t pos = 0;
+    memcpy(out, old, splice->offset);
+    pos += splice->offset;
+    if (splice->separator) {
+        out[pos++] = ' ';
+    }
+    memcpy(out + pos, text, text_len);
+    pos += text_len;
+    size_t rest = splice->offset + splice->old_length;
+    memcpy(out + pos, old + rest, old_len - rest);
+    pos += old_len - rest;
+    out[pos] = '\0';
+    *len = pos;
+    return out;
+}
+
+static int same_index(const SentenceIndex* a, const SentenceIndex* b) {
+    if (a->count != b->count || a->total_words != b->total_words ||
+        a->open_tail != b->open_tail || a->size != b->size) {
+        return 0;
+    }
+    for (int i = 0; i < a->count; i++) {
+        if (a->spans[i].offset != b->spans[i].offset || a->spans[i].length != b->spans[i].length ||
+            a->spans[i].words != b->spans[i].words) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Replace sentence `sentence` of old with text; 1 if the splice matched a
+// full re-index
+static int splice_matches(const char* old, int sentence, const char* text) {
+    char path[sizeof(scratch) + 16];
+    snprintf(path, sizeof(path), "%s/file", scratch);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, old, strlen(old)) != (ssize_t)strlen(old)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    SentenceIndex* before = sentence_index_from_text(old, strlen(old));
+    SentenceSplice splice;
+    SentenceIndex* after = sentence_index_splice(before, fd, sentence, text, strlen(text), &splice);
+    close(fd);
+
+    int ok = 0;
+    if (after) {
+        size_t len;
+        char* expected_text = spliced_text(old, &splice, text, &len);
+        SentenceIndex* expected = sentence_index_from_text(expected_text, len);
+        ok = expected && same_index(after, expected);
+        free(expected);
+        free(expected_text);
+    }
+    free(before);
+    free(after);
+    return ok;
+}
+
+static void test_replace() {
+    const char* old = "One two three. Four five!  Six seven?\nEight.";
+    CHECK(splice_matches(old, 0, "Uno dos tres."));
+    CHECK(splice_matches(old, 1, "Four."));
+    CHECK(splice_matches(old, 3, "Eight nine ten."));
+    // Whitespace between untouched sentences stays as written
+    CHECK(splice_matches(old, 2, "Six?"));
+}
+
+static void test_boundaries_move() {
+    const char* old = "Alpha beta. Gamma delta. Epsilon zeta.";
+    // Dropping the terminator merges the sentence with the next one
+    CHECK(splice_matches(old, 1, "Gamma delta"));
+    CHECK(splice_matches(old, 0, "Alpha"));
+    // A terminator in the middle splits it in two
+    CHECK(splice_matches(old, 1, "Gamma. Delta."));
+    CHECK(splice_matches(old, 2, "Epsilon! Zeta? Eta."));
+}
+
+static void test_append() {
+    // After a terminated last sentence
+    CHECK(splice_matches("First. Second.", 2, "Third."));
+    // After an unterminated tail, which the new text may end
+    CHECK(splice_matches("First. Second", 2, "third."));
+    CHECK(splice_matches("First. Second", 2, "third"));
+    // Into an empty file
+    CHECK(splice_matches("", 0, "Only sentence."));
+}
+
+static void test_index_counts() {
+    const char* text = "Hello world. This is   a test!\n\nDone";
+    SentenceIndex* idx = sentence_index_from_text(text, strlen(text));
+    CHECK(idx && idx->count == 3);
+    CHECK(idx && idx->total_words == 7);
+    CHECK(idx && idx->open_tail);
+    CHECK(idx && idx->spans[1].offset == 13 && idx->spans[1].length == 17);
+    free(idx);
+
+    // Out of range
+    idx = sentence_index_from_text("A. B.", 5);
+    SentenceSplice splice;
+    CHECK(sentence_index_splice(idx, -1, 5, "C.", 2, &splice) == NULL);
+    free(idx);
+}
+
+// Random texts and edits against the full re-index
+static void test_random_splices() {
+    static const char* words[] = {"cat", "dog", "bird", "a", "the", "ran", "far", "x"};
+    static const char* ends[] = {".", "!", "?", "", "", ""};
+    static const char* gaps[] = {" ", "  ", "\n", " \t"};
+    srand(4242);
+
+    for (int round = 0; round < 400; round++) {
+        char old[2048] = "";
+        char text[256] = "";
+        size_t pos = 0;
+        int sentences = rand() % 8;
+        for (int s = 0; s < sentences; s++) {
+            int count = 1 + rand() % 5;
+            for (int w = 0; w < count; w++) {
+                pos += snprintf(old + pos, sizeof(old) - pos, "%s%s", w ? " " : "",
+                                words[rand() % 8]);
+            }
+            pos += snprintf(old + pos, sizeof(old) - pos, "%s%s", ends[rand() % 6],
+                            gaps[rand() % 4]);
+        }
+
+        pos = 0;
+        int count = rand() % 6;
+        for (int w = 0; w < count; w++) {
+            pos += snprintf(text + pos, sizeof(text) - pos, "%s%s%s", w ? " " : "",
+                            words[rand() % 8], rand() % 4 == 0 ? ends[rand() % 3] : "");
+        }
+
+        SentenceIndex* idx = sentence_index_from_text(old, strlen(old));
+        int sentence = idx && idx->count ? rand() % (idx->count + 1) : 0;
+        free(idx);
+        CHECKF(splice_matches(old, sentence, text), "old=\"%s\" sentence=%d text=\"%s\"",
+               old, sentence, text);
+    }
+}
+
+int main() {
+    if (!mkdtemp(scratch)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    test_replace();
+    test_boundaries_move();
+    test_append();
+    test_index_counts();
+    test_random_splices();
+
+    char path[sizeof(scratch) + 16];
+    snprintf(path, sizeof(path), "%s/file", scratch);
+    unlink(path);
+    rmdir(scratch);
+    return check_done("test_sentence_index");
+}
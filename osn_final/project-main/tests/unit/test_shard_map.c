@@ -0,0 +1,146 @@
+// Name Server shard map (shard_map.c)
+//
+// Parsing and formatting NM_SHARDS, and the consistent-hash ring: owners
+// depend only on the shard addresses, keys spread evenly, and adding a
+// shard moves only the keys it takes over.
+
+#include "../../include/shard_map.h"
+#include "check.h"
+
+#define KEYS 100000
+
+static void key_of(int i, char* key, size_t len) {
+    snprintf(key, len, "user%d/notes_%d.txt", i % 113, i);
+}
+
+static const ShardAddr* owner(const ShardMap* map, const char* key) {
+    return &map->shards[shard_map_lookup(map, key)];
+}
+
+static void test_parse() {
+    ShardMap* map = shard_map_parse("10.0.0.1:5000, 10.0.0.2:5001,localhost:6000");
+    CHECK(map != NULL);
+    if (map) {
+        CHECK(map->count == 3);
+        CHECK(strcmp(map->shards[1].host, "10.0.0.2") == 0 && map->shards[1].port == 5001);
+        CHECK(map->ring_size == 3 * SHARD_VNODES);
+        CHECK(shard_map_find(map, "localhost", 6000) == 2);
+        CHECK(shard_map_find(map, "localhost", 6001) == -1);
+
+        // Format gives back a spec that parses to the same shards
+        char spec[256];
+        shard_map_format(map, spec, sizeof(spec));
+        CHECK(strcmp(spec, "10.0.0.1:5000,10.0.0.2:5001,localhost:6000") == 0);
+        ShardMap* again = shard_map_parse(spec);
+        CHECK(again && again->count == 3 && shard_map_find(again, "10.0.0.1", 5000) == 0);
+        shard_map_free(again);
+
+        int sorted = 1;
+        for (int i = 1; i < map->ring_size; i++) {
+            sorted &= map->ring[i - 1].point <= map->ring[i].point;
+        }
+        CHECK(sorted);
+    }
+    shard_map_free(map);
+
+    CHECK(shard_map_parse(NULL) == NULL);
+    CHECK(shard_map_parse("") == NULL);
+    CHECK(shard_map_parse("host") == NULL);
+    CHECK(shard_map_parse("host:0") == NULL);
+    CHECK(shard_map_parse("host:70000") == NULL);
+    CHECK(shard_map_parse("a:1,b") == NULL);
+
+    char many[64 * (SHARD_MAX + 1)];
+    size_t pos = 0;
+    for (int i = 0; i <= SHARD_MAX; i++) {
+        pos += snprintf(many + pos, sizeof(many) - pos, "%shost%d:5000", i ? "," : "", i);
+    }
+    CHECK(shard_map_parse(many) == NULL);
+}
+
+static void test_from_env() {
+    unsetenv("NM_SHARDS");
+    ShardMap* map = shard_map_from_env();
+    CHECK(map && map->count == 1 && shard_map_find(map, "127.0.0.1", NM_PORT) == 0);
+    CHECK(map && shard_map_lookup(map, "anything.txt") == 0);
+    shard_map_free(map);
+
+    setenv("NM_SHARDS", "a:1,b:2", 1);
+    map = shard_map_from_env();
+    CHECK(map && map->count == 2);
+    shard_map_free(map);
+
+    // A malformed map falls back to the single local Name Server
+    setenv("NM_SHARDS", "a:1,b", 1);
+    map = shard_map_from_env();
+    CHECK(map && map->count == 1 && shard_map_find(map, "127.0.0.1", NM_PORT) == 0);
+    shard_map_free(map);
+    unsetenv("NM_SHARDS");
+}
+
+static void test_owner_by_address() {
+    // Listing order changes shard indexes, not which address owns a key
+    ShardMap* a = shard_map_parse("n1:5000,n2:5000,n3:5000");
+    ShardMap* b = shard_map_parse("n3:5000,n1:5000,n2:5000");
+    char key[64];
+    int same = 1;
+    for (int i = 0; i < KEYS && a && b; i++) {
+        key_of(i, key, sizeof(key));
+        const ShardAddr* x = owner(a, key);
+        const ShardAddr* y = owner(b, key);
+        same &= strcmp(x->host, y->host) == 0 && x->port == y->port;
+        same &= shard_map_lookup(a, key) == shard_map_lookup(a, key);
+    }
+    CHECK(a && b && same);
+    shard_map_free(a);
+    shard_map_free(b);
+}
+
+static void test_balance() {
+    ShardMap* map = shard_map_parse("n1:5000,n2:5000,n3:5000,n4:5000");
+    int counts[4] = {0};
+    char key[64];
+    for (int i = 0; i < KEYS && map; i++) {
+        key_of(i, key, sizeof(key));
+        int s = shard_map_lookup(map, key);
+        if (s >= 0 && s < 4) {
+            counts[s]++;
+        }
+    }
+    for (int s = 0; s < 4; s++) {
+        CHECKF(counts[s] > KEYS * 15 / 100 && counts[s] < KEYS * 35 / 100,
+               "shard %d owns %d of %d keys", s, counts[s], KEYS);
+    }
+    shard_map_free(map);
+}
+
+static void test_adding_a_shard() {
+    ShardMap* before = shard_map_parse("n1:5000,n2:5000,n3:5000,n4:5000");
+    ShardMap* after = shard_map_parse("n1:5000,n2:5000,n3:5000,n4:5000,n5:5000");
+    int moved = 0;
+    int moved_elsewhere = 0;
+    char key[64];
+    for (int i = 0; i < KEYS && before && after; i++) {
+        key_of(i, key, sizeof(key));
+        int old_owner = shard_map_lookup(before, key);
+        int new_owner = shard_map_lookup(after, key);
+        if (old_owner != new_owner) {
+            moved++;
+            moved_elsewhere += new_owner != 4;
+        }
+    }
+    // Only keys the new shard takes over move, about a fifth of them
+    CHECK(moved_elsewhere == 0);
+    CHECKF(moved > KEYS * 10 / 100 && moved < KEYS * 30 / 100, "%d of %d keys moved", moved, KEYS);
+    shard_map_free(before);
+    shard_map_free(after);
+}
+
+int main() {
+    test_parse();
+    test_from_env();
+    test_owner_by_address();
+    test_balance();
+    test_adding_a_shard();
+    return check_done("test_shard_map");
+}